@@ -0,0 +1,116 @@
+/*
+ * arena.h — Bump allocator and string pool for Pass 1 objects
+ *
+ * Pass 1 creates tens of millions of small, long-lived objects (inodes,
+ * extent and dirent arrays, xattrs, names) that are all released together
+ * when the conversion ends. Carving them out of large chunks removes the
+ * per-object malloc header and turns teardown into one free per chunk.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Default chunk size; requests above a quarter of it get their own chunk */
+#define ARENA_CHUNK_SIZE (1024 * 1024)
+
+/* Free lists for blocks abandoned by arena_grow(), by power-of-two size */
+#define ARENA_SIZE_CLASSES 32
+
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t size;    /* usable bytes in data[] */
+  size_t used;
+  size_t map_len; /* bytes mapped from the spill file, 0 = malloc'd */
+  _Alignas(16) unsigned char data[]; /* malloc is 16-aligned on LP64 */
+};
+
+/*
+ * Spill file shared by several arenas. Once their malloc'd chunks reach
+ * `threshold` bytes, or mem_track_exceeded() trips, new chunks are mapped
+ * from an unlinked file in the workdir instead. Mapped objects are used
+ * exactly like resident ones; the kernel writes cold pages back to the
+ * file instead of the OOM killer stepping in.
+ */
+struct arena_spill {
+  int fd;
+  uint64_t threshold;
+  uint64_t resident;  /* malloc'd chunk bytes of the sharing arenas */
+  uint64_t file_size; /* bytes of the file handed out as chunks */
+  pthread_mutex_t lock; /* arenas of parallel scan shards share it */
+};
+
+struct arena {
+  struct arena_chunk *head; /* current chunk first */
+  size_t chunk_size;        /* 0 = ARENA_CHUNK_SIZE */
+  struct arena_spill *spill; /* NULL = always malloc */
+  void *free_blocks[ARENA_SIZE_CLASSES];
+  uint64_t reserved; /* bytes obtained from malloc or the spill file */
+  uint64_t used;     /* bytes handed out (recycled blocks count again) */
+};
+
+/* A zeroed struct arena is valid and empty; arena_init only sets the size */
+void arena_init(struct arena *a, size_t chunk_size);
+
+/* Zeroed, 16-byte aligned memory owned by the arena, or NULL on OOM */
+void *arena_alloc(struct arena *a, size_t size);
+
+/*
+ * Move an array to a larger block: copies old_size bytes, zeroes the rest
+ * and recycles the old block for later arena_grow() calls. `old` may be
+ * NULL (old_size 0). Returns NULL on OOM, leaving `old` untouched.
+ */
+void *arena_grow(struct arena *a, void *old, size_t old_size, size_t new_size);
+
+/* Copy of `len` bytes (plus a NUL terminator), or NULL */
+char *arena_strndup(struct arena *a, const char *s, size_t len);
+
+/*
+ * Transfer every chunk of `src` to `dst`; src is left empty. Both should
+ * share the same spill file (or none).
+ */
+void arena_adopt(struct arena *dst, struct arena *src);
+
+/* Release every chunk; chunk_size and spill are kept */
+void arena_free(struct arena *a);
+
+/*
+ * Create the spill file under `workdir`, unlinked at once so it goes away
+ * with the process. Returns 0 on success, -1 on error (errno set).
+ */
+int arena_spill_open(struct arena_spill *s, const char *workdir,
+                     uint64_t threshold);
+
+/* Close the file; every arena using it must have been freed */
+void arena_spill_close(struct arena_spill *s);
+
+/*
+ * String pool: names stored back to back, NUL-terminated, addressed by
+ * offset so the pool can grow (and later be spilled or remapped) without
+ * invalidating references.
+ */
+struct str_pool {
+  char *buf;
+  uint64_t len;
+  uint64_t capacity;
+};
+
+#define STR_POOL_INVALID UINT64_MAX
+
+/* Append `len` bytes; returns the offset or STR_POOL_INVALID on OOM */
+uint64_t str_pool_add(struct str_pool *p, const char *s, size_t len);
+
+/* Append all of `src` to `dst`; returns the offset src's names moved to */
+uint64_t str_pool_append(struct str_pool *dst, const struct str_pool *src);
+
+static inline const char *str_pool_get(const struct str_pool *p,
+                                       uint64_t off) {
+  return p->buf + off;
+}
+
+void str_pool_free(struct str_pool *p);
+
+#endif /* ARENA_H */
@@ -0,0 +1,82 @@
+/*
+ * btree.h — Generic btrfs B-tree walker
+ */
+
+#ifndef BTRFS_BTREE_H
+#define BTRFS_BTREE_H
+
+#include <stdint.h>
+
+#include "btrfs/btrfs_structures.h"
+
+struct device;
+struct chunk_map;
+
+/*
+ * Callback type for B-tree leaf item processing.
+ * Called for each item in each leaf node.
+ * Return 0 to continue iteration, non-zero to stop.
+ */
+typedef int (*btree_callback)(const struct btrfs_disk_key *key,
+                              const void *data, uint32_t data_size, void *ctx);
+
+/*
+ * Shard factory for btree_walk_parallel().
+ * Called once per subtree, in key order, from the calling thread before any
+ * worker starts. Returns the context passed to `callback` for every item of
+ * that subtree, or NULL to abort the walk.
+ */
+typedef void *(*btree_shard_fn)(uint32_t shard_index, void *arg);
+
+/* Let btree_walk_parallel() pick the split level from the thread count */
+#define BTREE_SPLIT_AUTO 0xFF
+
+/* Subtrees queued per worker when the split level is chosen automatically */
+#define BTREE_SUBTREES_PER_THREAD 4
+
+/* Nodes read per batch by btree_walk_physical() */
+#define BTREE_SWEEP_BATCH 256
+
+/*
+ * Walk a btrfs B-tree sequentially, calling the callback for each leaf item.
+ * Returns 0 on success, -1 on error.
+ */
+int btree_walk(struct device *dev, const struct chunk_map *chunk_map,
+               uint64_t root_logical, uint8_t root_level, uint32_t nodesize,
+               uint16_t csum_type, btree_callback callback, void *ctx);
+
+/*
+ * Walk a btrfs B-tree with `num_threads` workers.
+ *
+ * Internal nodes above `split_level` are read on the calling thread; every
+ * node at `split_level` (or the root, if it is already at or below it)
+ * becomes an independent subtree task walked with its own shard context.
+ * Shards are numbered in key order, so merging them in index order yields
+ * the same item order as btree_walk().
+ *
+ * Returns the number of shards created (>= 1) on success, -1 on error.
+ */
+int btree_walk_parallel(struct device *dev, const struct chunk_map *chunk_map,
+                        uint64_t root_logical, uint8_t root_level,
+                        uint32_t nodesize, uint16_t csum_type,
+                        uint8_t split_level, uint32_t num_threads,
+                        btree_callback callback, btree_shard_fn new_shard,
+                        void *shard_arg);
+
+/*
+ * Walk a btrfs B-tree in physical order, for rotational devices.
+ *
+ * Each level is read as one elevator sweep: the child pointers of the
+ * previous level are resolved through the chunk map, sorted by physical
+ * offset and read in batches of BTREE_SWEEP_BATCH nodes. Leaves therefore
+ * reach the callback in disk order, NOT key order; callbacks must not rely
+ * on item order across leaves (items within one leaf stay in key order).
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int btree_walk_physical(struct device *dev, const struct chunk_map *chunk_map,
+                        uint64_t root_logical, uint8_t root_level,
+                        uint32_t nodesize, uint16_t csum_type,
+                        btree_callback callback, void *ctx);
+
+#endif /* BTRFS_BTREE_H */
@@ -8,15 +8,20 @@
 #ifndef BTRFS_READER_H
 #define BTRFS_READER_H
 
+#include "arena.h"
 #include "btrfs/btrfs_structures.h"
+#include "usage_map.h"
 #include <stddef.h>
 #include <stdint.h>
 
 /* Maximum filename length */
 #define BTRFS_MAX_NAME_LEN 255
 
-/* Maximum number of extents per file (can grow dynamically) */
-#define BTRFS_INITIAL_EXTENTS_CAPACITY 8
+/* First extent array size; grows by doubling (most files have one extent) */
+#define BTRFS_INITIAL_EXTENTS_CAPACITY 1
+
+/* First dirent array size */
+#define BTRFS_INITIAL_CHILDREN_CAPACITY 4
 
 /* BTRFS key types for xattr parsing */
 
@@ -26,7 +31,8 @@
 
 struct file_extent {
   uint64_t file_offset;    /* offset within the file */
-  uint64_t disk_bytenr;    /* physical byte address on disk (0=hole) */
+  uint64_t disk_bytenr;    /* logical address, or device offset tagged
+                              CHUNK_MAP_PHYSICAL (0=hole) */
   uint64_t disk_num_bytes; /* size on disk */
   uint64_t num_bytes;      /* logical bytes in file */
   uint64_t ram_bytes;      /* decompressed size */
@@ -37,6 +43,17 @@ struct file_extent {
   uint32_t inline_data_len;
 };
 
+/* Packed extents (see btrfs/extent_store.h): one slot per column each */
+#define EXTENT_STORE_UNIT 4096 /* disk_len/len granularity, bytes */
+
+struct extent_store {
+  uint64_t *bytenr;   /* disk_bytenr, 0 = hole */
+  uint32_t *disk_len; /* disk_num_bytes / EXTENT_STORE_UNIT */
+  uint32_t *len;      /* num_bytes / EXTENT_STORE_UNIT */
+  uint8_t *flags;     /* EXTENT_STORE_* */
+  uint64_t count;
+};
+
 /* ========================================================================
  * Extended attribute entry (for Phase 6: xattr/ACL preservation)
  * ======================================================================== */
@@ -56,8 +73,13 @@ struct xattr_entry {
 struct file_entry;
 
 struct dir_entry_link {
-  struct file_entry *target;         /* the inode this dirent points to */
-  char name[BTRFS_MAX_NAME_LEN + 1]; /* name of the link within its directory */
+  /* The inode this dirent points to. The FS-tree walk only records its
+   * number; btrfs_resolve_links() swaps in the entry once all are read. */
+  union {
+    struct file_entry *target;
+    uint64_t target_ino;
+  };
+  uint64_t name_off;         /* name within fs_info->names (NUL-terminated) */
   uint16_t name_len;
 };
 
@@ -86,10 +108,18 @@ struct file_entry {
   /* Symlink target (if S_ISLNK) */
   char *symlink_target;
 
-  /* File extents (for regular files) */
+  /*
+   * Everything below except children names is allocated from the owning
+   * btrfs_fs_info's arena: grow arrays with btrfs_reserve_extents() /
+   * arena_grow(), never realloc()/free().
+   */
+
+  /* File extents (for regular files). NULL with extent_count > 0 once
+   * packed into fs_info->extent_store at ext_first */
   struct file_extent *extents;
   uint32_t extent_count;
   uint32_t extent_capacity;
+  uint64_t ext_first;
 
   /* Directory children (for directories) */
   struct dir_entry_link *children;
@@ -103,22 +133,6 @@ struct file_entry {
   uint32_t ext4_flags;
 };
 
-/* ========================================================================
- * In-memory used-block map (extent tree data)
- * ======================================================================== */
-
-struct used_extent {
-  uint64_t start;  /* physical byte offset */
-  uint64_t length; /* length in bytes */
-  uint64_t flags;  /* BTRFS_BLOCK_GROUP_DATA/METADATA/SYSTEM */
-};
-
-struct used_block_map {
-  struct used_extent *extents;
-  uint32_t count;
-  uint32_t capacity;
-};
-
 /* ========================================================================
  * Inode lookup hash table (optional accelerator)
  * ======================================================================== */
@@ -151,13 +165,33 @@ struct btrfs_fs_info {
   uint32_t inode_count;
   uint32_t inode_capacity;
 
-  /* Used block map from extent tree */
-  struct used_block_map used_blocks;
+  /* Physical blocks in use by Btrfs, streamed from the extent tree */
+  struct usage_map usage;
 
   /* Optional inode lookup hash table (accelerates btrfs_find_inode) */
   struct inode_lookup_ht ino_ht;
   int use_hash;
 
+  /* inode_table is in ascending ino order and ino_ht is not maintained:
+   * lookups binary-search the table. Cleared (and the hash built) by the
+   * first out-of-order insertion or by btrfs_resolve_links(). */
+  int sorted_append;
+
+  /* Backing store for file entries, their arrays, xattrs and inline data */
+  struct arena arena;
+
+  /* Workdir file both arenas spill to past the memory budget, or NULL */
+  struct arena_spill *spill;
+
+  /* Directory entry names, referenced by dir_entry_link.name_off */
+  struct str_pool names;
+
+  /* Pass 1 extent arrays, until btrfs_pack_extents() moves ordinary files
+   * into extent_store and releases the arena */
+  struct arena extent_arena;
+  struct extent_store extent_store;
+  int extents_packed;
+
   /* Compression statistics (computed during Pass 1) */
   uint64_t total_compressed_bytes;   /* sum of disk_num_bytes for compressed */
   uint64_t total_decompressed_bytes; /* sum of ram_bytes for compressed */
@@ -184,15 +218,25 @@ struct adaptive_mem_config {
  * Bloom filter for HDD thrashing prevention (graceful degradation)
  * ======================================================================== */
 
+#define BLOOM_BLOCK_WORDS 8     /* one 64-byte cache line per block */
+#define BLOOM_DEFAULT_FPR 0.01  /* bloom_init() target false positive rate */
+
 struct bloom_filter {
-  uint8_t *bits;
-  uint64_t size_bits;  /* total number of bits */
-  uint32_t num_hashes; /* number of hash functions (k) */
+  uint64_t *blocks;    /* num_blocks * BLOOM_BLOCK_WORDS, 64-byte aligned */
+  uint64_t num_blocks;
+  uint32_t num_hashes; /* bits set per key, all in one block (k) */
 };
 
+/* Size for expected_items keys at false positive rate fpr (0 < fpr < 1) */
+int bloom_init_fpr(struct bloom_filter *bf, uint64_t expected_items,
+                   double fpr);
 int bloom_init(struct bloom_filter *bf, uint64_t expected_items);
 void bloom_add(struct bloom_filter *bf, uint64_t key);
 int bloom_test(const struct bloom_filter *bf, uint64_t key);
+/* bloom_test() for n keys into out[i], overlapping their cache misses.
+ * Returns the number of possible hits. */
+uint32_t bloom_test_batch(const struct bloom_filter *bf, const uint64_t *keys,
+                          uint32_t n, uint8_t *out);
 void bloom_free(struct bloom_filter *bf);
 
 /* ========================================================================
@@ -212,6 +256,14 @@ int btrfs_read_fs(struct device *dev, struct btrfs_fs_info *fs_info);
  */
 void btrfs_free_fs(struct btrfs_fs_info *fs_info);
 
+/*
+ * Build fs_info->usage from the FS-tree data extents alone (no metadata),
+ * covering `device_size` bytes. btrfs_read_fs() falls back to this when the
+ * extent tree cannot be read; consumers call it for hand-built fs_info.
+ * Returns 0 on success, -1 on OOM.
+ */
+int btrfs_build_usage_map(struct btrfs_fs_info *fs_info, uint64_t device_size);
+
 /*
  * Find a file_entry by its btrfs inode number.
  * Returns NULL if not found.
@@ -219,4 +271,64 @@ void btrfs_free_fs(struct btrfs_fs_info *fs_info);
 struct file_entry *btrfs_find_inode(struct btrfs_fs_info *fs_info,
                                     uint64_t ino);
 
+/*
+ * The file_entry for `ino`, created empty and added to the inode table
+ * (and hash, when fs_info->use_hash is set) if there is none yet. With
+ * fs_info->sorted_append, an ino above the last one is appended without
+ * any lookup. Returns NULL on OOM.
+ */
+struct file_entry *btrfs_get_inode(struct btrfs_fs_info *fs_info,
+                                   uint64_t ino);
+
+/*
+ * End of a scan: build the inode hash in one pass if the table was
+ * appended in order, then resolve every dirent's target_ino to its
+ * file_entry, creating an empty one for targets no item described.
+ * Returns 0 on success, -1 on OOM.
+ */
+int btrfs_resolve_links(struct btrfs_fs_info *fs_info);
+
+/*
+ * Grow fe->extents (arena-backed) to hold at least `capacity` extents.
+ * Returns 0 on success, -1 on OOM.
+ */
+int btrfs_reserve_extents(struct btrfs_fs_info *fs_info, struct file_entry *fe,
+                          uint32_t capacity);
+
+/*
+ * Store a dirent name in the name pool. Returns its offset, or
+ * STR_POOL_INVALID on OOM.
+ */
+uint64_t btrfs_intern_name(struct btrfs_fs_info *fs_info, const char *name,
+                           uint16_t name_len);
+
+static inline const char *btrfs_link_name(const struct btrfs_fs_info *fs_info,
+                                          const struct dir_entry_link *link) {
+  return str_pool_get(&fs_info->names, link->name_off);
+}
+
+/*
+ * Configure the parallel FS-tree scan used by btrfs_read_fs().
+ *   threads     - worker count; 0 = one per online CPU, 1 = sequential walk
+ *   split_level - tree level whose nodes become independent subtree tasks;
+ *                 BTREE_SPLIT_AUTO picks one from the thread count
+ */
+void btrfs_set_scan_parallelism(uint32_t threads, uint8_t split_level);
+
+/* Order in which btrfs_read_fs() reads the FS and extent tree nodes */
+enum btrfs_scan_order {
+  BTRFS_SCAN_AUTO = 0, /* physical on rotational devices, key otherwise */
+  BTRFS_SCAN_KEY,      /* depth-first in key order (parallel when allowed) */
+  BTRFS_SCAN_PHYSICAL, /* level-by-level elevator sweep, single thread */
+};
+
+void btrfs_set_scan_order(enum btrfs_scan_order order);
+
+/*
+ * Memory budget for btrfs_read_fs(): once the Pass 1 arenas hold
+ * cfg->mmap_threshold bytes of RAM, or mem_track_exceeded() trips, new
+ * arena chunks are mapped from a file in cfg->workdir. NULL turns it off.
+ */
+void btrfs_set_memory_config(const struct adaptive_mem_config *cfg);
+
 #endif /* BTRFS_READER_H */
@@ -104,6 +104,14 @@
 #define BTRFS_BLOCK_GROUP_DATA (1ULL << 0)
 #define BTRFS_BLOCK_GROUP_SYSTEM (1ULL << 1)
 #define BTRFS_BLOCK_GROUP_METADATA (1ULL << 2)
+#define BTRFS_BLOCK_GROUP_RAID1 (1ULL << 4)
+#define BTRFS_BLOCK_GROUP_DUP (1ULL << 5)
+#define BTRFS_BLOCK_GROUP_RAID1C3 (1ULL << 9)
+#define BTRFS_BLOCK_GROUP_RAID1C4 (1ULL << 10)
+/* Profiles whose every stripe holds the whole chunk */
+#define BTRFS_BLOCK_GROUP_MIRRORED                                             \
+  (BTRFS_BLOCK_GROUP_RAID1 | BTRFS_BLOCK_GROUP_DUP |                           \
+   BTRFS_BLOCK_GROUP_RAID1C3 | BTRFS_BLOCK_GROUP_RAID1C4)
 
 /* ========================================================================
  * On-disk key structure (17 bytes)
@@ -388,6 +396,10 @@ struct btrfs_extent_item {
   uint64_t flags;
 } __attribute__((packed));
 
+/* btrfs_extent_item.flags */
+#define BTRFS_EXTENT_FLAG_DATA 0x1ULL
+#define BTRFS_EXTENT_FLAG_TREE_BLOCK 0x2ULL
+
 /* ========================================================================
  * Block group item
  * ======================================================================== */
@@ -20,4 +20,10 @@ int btrfs_verify_checksum(uint16_t type, const uint8_t *stored_csum,
 uint32_t btrfs_crc32c(uint32_t crc, const void *data, size_t len);
 uint32_t crc32c(uint32_t crc, const void *data, size_t len);
 
+/* Portable slice-by-8 CRC32C, same contract as btrfs_crc32c() */
+uint32_t btrfs_crc32c_sw(uint32_t crc, const void *data, size_t len);
+
+/* Name of the CRC32C implementation selected for this CPU */
+const char *btrfs_crc32c_impl(void);
+
 #endif /* BTRFS_CHECKSUM_H */
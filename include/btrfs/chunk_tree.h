@@ -7,12 +7,33 @@
 
 #include <stdint.h>
 
+/* Copies of a chunk kept per mapping: DUP stores two on one device */
+#define CHUNK_MAX_COPIES 2
+
 /* A single chunk mapping entry */
 struct chunk_mapping {
   uint64_t logical;  /* start logical address */
   uint64_t physical; /* start physical address (for devid 1) */
   uint64_t length;   /* length of this chunk */
   uint64_t type;     /* BTRFS_BLOCK_GROUP_* flags */
+  /*
+   * Start of every copy on this device, copy[0] == physical. Mirrored
+   * profiles (DUP, RAID1*) list each stripe on stripe 0's device; other
+   * chunks have one. 0 copies (maps filled by hand) means physical only.
+   */
+  uint64_t copy[CHUNK_MAX_COPIES];
+  uint32_t copies;
+};
+
+/*
+ * Search index over a sorted chunk map: the chunk start addresses in
+ * Eytzinger (BFS) order, 1-based, so the first levels of every search share
+ * a few cache lines, plus each one's position in entries[].
+ */
+struct chunk_resolver {
+  uint64_t *keys;  /* keys[1..count] */
+  uint32_t *rank;  /* rank[k] = index of keys[k] in entries[] */
+  uint32_t count;
 };
 
 /* Chunk map: array of mappings sorted by logical address */
@@ -20,6 +41,7 @@ struct chunk_map {
   struct chunk_mapping *entries;
   uint32_t count;
   uint32_t capacity;
+  struct chunk_resolver *resolver; /* NULL = plain binary search */
 };
 
 struct device;
@@ -41,12 +63,64 @@ int chunk_map_init_from_superblock(struct chunk_map *map,
 int chunk_map_populate(struct chunk_map *map, struct device *dev,
                        const struct btrfs_super_block *sb);
 
+/*
+ * Build (or rebuild) map->resolver from the sorted entries. Called by
+ * chunk_map_populate(); maps filled by hand work without one.
+ * Returns 0 on success, -1 on OOM (resolution still works, just slower).
+ */
+int chunk_map_build_resolver(struct chunk_map *map);
+
+/*
+ * Tag on a file extent's disk_bytenr once it holds a device offset instead
+ * of a logical address: set by the relocator and the decompression
+ * pipeline, whose new homes need not lie in any chunk. Btrfs logical
+ * addresses never reach bit 63.
+ */
+#define CHUNK_MAP_PHYSICAL (1ULL << 63)
+
 /*
  * Resolve a logical address to a physical address.
+ * Each thread first retries the chunk of its previous hit, then searches.
+ * Addresses tagged CHUNK_MAP_PHYSICAL come back untagged.
  * Returns the physical byte offset, or (uint64_t)-1 on failure.
  */
 uint64_t chunk_map_resolve(const struct chunk_map *map, uint64_t logical);
 
+/*
+ * Resolve to the copy whose start is nearest `pos` (typically where the
+ * thread's last request ended; UINT64_MAX picks copy 0). `*copy`, if not
+ * NULL, gets the copy chosen. Same failure and tagging rules as
+ * chunk_map_resolve().
+ */
+uint64_t chunk_map_resolve_near(const struct chunk_map *map, uint64_t logical,
+                                uint64_t pos, uint32_t *copy);
+
+/*
+ * Resolve to copy `copy` of the chunk. Returns (uint64_t)-1 when the
+ * address is unmapped or the chunk has fewer copies; tagged addresses
+ * have only copy 0.
+ */
+uint64_t chunk_map_resolve_copy(const struct chunk_map *map, uint64_t logical,
+                                uint32_t copy);
+
+/*
+ * The mapping containing a logical address, or NULL. Same lookup as
+ * chunk_map_resolve(), for callers that need the chunk's bounds.
+ */
+const struct chunk_mapping *chunk_map_find(const struct chunk_map *map,
+                                           uint64_t logical);
+
+/*
+ * Resolve `n` logical addresses at once. For ascending input the map is
+ * walked linearly alongside it; an address lower than its predecessor
+ * just falls back to chunk_map_resolve(). Unmapped addresses get
+ * (uint64_t)-1; tagged ones are untagged. Returns the number of addresses
+ * resolved.
+ */
+uint32_t chunk_map_resolve_batch(const struct chunk_map *map,
+                                 const uint64_t *logical, uint64_t *physical,
+                                 uint32_t n);
+
 /*
  * Free chunk map resources.
  */
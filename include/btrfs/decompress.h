@@ -14,6 +14,41 @@ struct device;
 struct chunk_map;
 struct file_extent;
 
+/* Default output window for streaming callers (rounded down to block_size) */
+#define BTRFS_DECOMP_WINDOW (1024 * 1024)
+
+/*
+ * Receives each block-aligned chunk of decompressed output, in order.
+ * `offset` is the byte position of `data` within the extent; `len` is a
+ * multiple of block_size. Return -1 to abort the decompression.
+ */
+typedef int (*btrfs_decomp_sink)(const uint8_t *data, size_t len,
+                                 uint64_t offset, void *arg);
+
+/*
+ * Validate the sizes recorded in a compressed extent (anti-bomb limits) and
+ * return its decompressed size, or 0 if the extent must be skipped.
+ */
+uint64_t btrfs_decompressed_size(const struct file_extent *ext);
+
+/*
+ * Decompress a single Btrfs extent through a caller-owned window.
+ *
+ * The compressed data is pread() in chunks and decoded straight into
+ * `window` (size a multiple of block_size); every time it fills, it is
+ * handed to `sink`. The last chunk is zero-padded to the block boundary.
+ * No locks are taken, so workers may call this concurrently, each with its
+ * own window.
+ *
+ * Returns 0 on success (out_len = decompressed size), -1 on error.
+ */
+int btrfs_decompress_extent_stream(struct device *dev,
+                                   const struct chunk_map *chunk_map,
+                                   const struct file_extent *ext,
+                                   uint32_t block_size, uint8_t *window,
+                                   size_t window_size, btrfs_decomp_sink sink,
+                                   void *sink_arg, uint64_t *out_len);
+
 /*
  * Decompress a single Btrfs extent.
  *
@@ -0,0 +1,78 @@
+/*
+ * extent_store.h — Packed file extent table
+ *
+ * At the end of Pass 1 the extents of ordinary files (uncompressed REG and
+ * PREALLOC extents and holes, laid end to end from offset 0) move out of
+ * their per-file struct file_extent arrays, 64 bytes per extent, into one
+ * structure-of-arrays table of 17 bytes per extent. A packed file keeps its
+ * index range in the table; each extent's file offset follows from the
+ * lengths before it. Files with compressed or inline extents, gaps, or
+ * lengths that are not whole units keep their arrays.
+ *
+ * Read extents through struct extent_iter, which handles both forms.
+ */
+
+#ifndef BTRFS_EXTENT_STORE_H
+#define BTRFS_EXTENT_STORE_H
+
+#include <stdint.h>
+
+#include "btrfs/btrfs_reader.h"
+
+/* extent_store.flags[] */
+#define EXTENT_STORE_PREALLOC 0x01 /* BTRFS_FILE_EXTENT_PREALLOC, else REG */
+#define EXTENT_STORE_RAM_DISK 0x02 /* ram_bytes == disk_num_bytes, else
+                                      ram_bytes == num_bytes */
+
+/* Bytes per packed extent across the four columns */
+#define EXTENT_STORE_ROW_BYTES                                                \
+  (sizeof(uint64_t) + 2 * sizeof(uint32_t) + sizeof(uint8_t))
+
+/* Sequential reader over one file's extents, packed or not */
+struct extent_iter {
+  const struct btrfs_fs_info *fs_info;
+  const struct file_entry *fe;
+  uint32_t index;       /* of the extent last returned */
+  uint32_t next;        /* of the extent returned next */
+  uint64_t file_offset; /* packed: offset of the next extent */
+  struct file_extent cur;
+};
+
+/*
+ * Move every file that qualifies into fs_info->extent_store and release
+ * the Pass 1 extent arena; arrays of the files that stay unpacked are
+ * copied to the main arena. Called once, at the end of btrfs_read_fs().
+ * Returns 0 on success, -1 on OOM (nothing is packed then).
+ */
+int btrfs_pack_extents(struct btrfs_fs_info *fs_info);
+
+/* Release the packed table (btrfs_free_fs() does this) */
+void btrfs_free_extent_store(struct extent_store *st);
+
+void extent_iter_init(struct extent_iter *it,
+                      const struct btrfs_fs_info *fs_info,
+                      const struct file_entry *fe);
+
+/*
+ * The next extent, or NULL at the end. For a packed file the result is a
+ * decoded copy that the following call overwrites; inline_data is NULL.
+ */
+const struct file_extent *extent_iter_next(struct extent_iter *it);
+
+/* Point extent `index` of `fe` at a new disk address (relocation) */
+void btrfs_extent_set_bytenr(struct btrfs_fs_info *fs_info,
+                             struct file_entry *fe, uint32_t index,
+                             uint64_t disk_bytenr);
+
+/*
+ * Split extent `index` of `fe` where its disk data was split: piece k
+ * covers the next disk_lens[k] bytes and the file bytes over them. Pieces
+ * past the end of what the extent references are dropped. A packed file
+ * is given an array first. Uncompressed extents only. Returns the number
+ * of extents now in its place, or -1 on OOM.
+ */
+int btrfs_extent_split(struct btrfs_fs_info *fs_info, struct file_entry *fe,
+                       uint32_t index, const uint64_t *disk_lens,
+                       uint32_t pieces);
+
+#endif /* BTRFS_EXTENT_STORE_H */
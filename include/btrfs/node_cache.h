@@ -0,0 +1,52 @@
+/*
+ * node_cache.h — Shared cache of verified btrfs tree nodes
+ *
+ * Pass 1 reads the chunk, root, FS and extent trees in separate walks.
+ * Nodes are kept in one bounded LRU keyed by logical bytenr so repeated
+ * and overlapping reads are served from memory, and a node's checksum is
+ * verified only once: only nodes that passed verification are inserted.
+ */
+
+#ifndef BTRFS_NODE_CACHE_H
+#define BTRFS_NODE_CACHE_H
+
+#include <stdint.h>
+
+/* Default memory budget (node data plus entry headers) */
+#define NODE_CACHE_DEFAULT_BUDGET (64ULL * 1024 * 1024)
+
+struct node_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint32_t nodes;    /* nodes currently cached */
+  uint64_t bytes;    /* memory they take */
+};
+
+/*
+ * Create the process-wide cache for nodes of `nodesize` bytes.
+ * budget = bytes (0 = NODE_CACHE_DEFAULT_BUDGET). Replaces an existing
+ * cache. Returns 0 on success, -1 on OOM (lookups then always miss).
+ */
+int node_cache_init(uint32_t nodesize, uint64_t budget);
+
+/* Drop every node and release the cache */
+void node_cache_destroy(void);
+
+/*
+ * Copy the cached node at `logical` into `buf` (nodesize bytes).
+ * Returns 1 on a hit (checksum already verified), 0 on a miss.
+ * Thread-safe.
+ */
+int node_cache_lookup(uint64_t logical, uint8_t *buf);
+
+/*
+ * Insert a node that has passed checksum and header validation. Leaves
+ * enter at the cold end of the LRU so a DFS, which never revisits them,
+ * does not push out the internal nodes. Thread-safe.
+ */
+void node_cache_insert(uint64_t logical, const uint8_t *buf, uint8_t level);
+
+void node_cache_get_stats(struct node_cache_stats *out);
+
+#endif /* BTRFS_NODE_CACHE_H */
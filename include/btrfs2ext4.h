@@ -18,6 +18,27 @@ struct convert_options {
   uint32_t block_size;      /* ext4 block size (default 4096) */
   uint32_t inode_ratio;     /* bytes per inode (default 16384) */
   uint32_t memory_limit_mb; /* --memory-limit: max RAM MB (0=auto) */
+  uint32_t scan_threads;    /* --scan-threads: Pass 1 workers (0=auto) */
+  uint8_t scan_split_level; /* --scan-split-level: subtree level (0xFF=auto) */
+  int scan_order;           /* --scan-order: enum btrfs_scan_order */
+  uint32_t reloc_depth;     /* --reloc-depth: relocation buffers (0=default) */
+  int verify_moves;         /* --verify-moves: CRC relocated data in user space */
+  int no_alloc_goal;        /* --no-alloc-goal: ignore inode locality */
+  int no_tree_region;       /* --no-tree-region: tree blocks next to files */
+  int no_flex_pack;         /* --no-flex-pack: per-group metadata layout */
+  int no_lazy_itable;       /* --no-lazy-itable: write whole inode tables */
+  int layout_search;        /* --layout-search: least-relocation layout */
+  uint32_t max_inode_ratio; /* --max-inode-ratio: search bound (0=-i) */
+  int no_write_cache;       /* --no-write-cache: Pass 3 writes go direct */
+  int direct_io;            /* --direct-io: O_DIRECT for bulk data */
+  const char *mem_report;   /* --mem-report: JSON memory profile ("-"=stdout) */
+  int stats;                /* --stats: IO_STATS_OFF/TEXT/JSON */
+  int resume;               /* --resume: continue from the workdir checkpoint */
+  int plan_only;            /* --plan-only: scan and plan, save, don't write */
+  int profile_writes;       /* --profile-writes: time writes in the dry run */
+  const char *device_profile; /* --device-profile: saved profile to reuse */
+  int no_progress;          /* --no-progress: no live status on stdout */
+  int progress_fd;          /* --progress-fd: JSON progress records (-1=off) */
 };
 
 /* Conversion progress callback */
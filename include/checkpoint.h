@@ -0,0 +1,111 @@
+/*
+ * checkpoint.h — Resumable conversion state in --workdir
+ *
+ * After each phase of a real conversion the converter snapshots what the
+ * next one needs into <workdir>/btrfs2ext4.ckpt: the Pass 1 btrfs_fs_info
+ * (inodes, extents, names, xattrs, chunk and usage maps) and, once Pass 2
+ * has planned, the ext4_layout and relocation_plan. The file is written
+ * to a temporary name, synced and renamed, so a crash leaves either the
+ * previous snapshot or the new one. It is tied to the Btrfs filesystem by
+ * fsid and generation and to the options that shape the layout.
+ *
+ * While blocks are relocated, <workdir>/btrfs2ext4.ckpt.reloc records how
+ * many plan entries (in execution order) are on disk, updated after a device
+ * sync in the same windows the relocation journal commits groups in.
+ * --resume loads the snapshot, marks those entries completed and carries
+ * on from the first phase that did not finish.
+ *
+ * Snapshots use native byte order and struct layout: they are meant to be
+ * read back by the same build on the same host.
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+
+struct device;
+struct btrfs_fs_info;
+struct ext4_layout;
+struct relocation_plan;
+struct relocation_entry;
+
+#define CHECKPOINT_FILE "btrfs2ext4.ckpt"
+#define CHECKPOINT_RELOC_FILE "btrfs2ext4.ckpt.reloc"
+
+#define CHECKPOINT_MAGIC "B2E4CKPT"
+#define CHECKPOINT_RELOC_MAGIC "B2E4RLOG"
+#define CHECKPOINT_VERSION 1
+
+/* Last phase whose results a snapshot holds */
+enum checkpoint_phase {
+  CHECKPOINT_NONE = 0,
+  CHECKPOINT_SCANNED,   /* Pass 1: btrfs_fs_info */
+  CHECKPOINT_PLANNED,   /* + ext4_layout and relocation_plan */
+  CHECKPOINT_RELOCATED, /* relocation done, extents at their new homes */
+};
+
+struct checkpoint {
+  const char *workdir;
+  struct device *dev;
+  uint32_t block_size;  /* options the layout depends on */
+  uint32_t inode_ratio;
+
+  /* Relocation progress log (checkpoint_reloc_begin .. _end) */
+  const struct relocation_plan *reloc_plan;
+  int reloc_fd;
+  uint32_t run_id;     /* CRC of the PLANNED snapshot the log belongs to */
+  uint32_t reloc_done; /* entries [0, reloc_done) known to be on disk */
+  uint32_t reloc_count;
+  uint32_t pending;        /* entries written since the last record */
+  uint64_t pending_bytes;
+  uint64_t pending_since_ms;
+};
+
+void checkpoint_init(struct checkpoint *ck, const char *workdir,
+                     struct device *dev, uint32_t block_size,
+                     uint32_t inode_ratio);
+
+/*
+ * Write the snapshot for `phase`. layout and plan are only read from
+ * CHECKPOINT_PLANNED on. Returns 0 on success, -1 on error (the previous
+ * snapshot, if any, is left in place).
+ */
+int checkpoint_save(struct checkpoint *ck, enum checkpoint_phase phase,
+                    const struct btrfs_fs_info *fs_info,
+                    const struct ext4_layout *layout,
+                    const struct relocation_plan *plan);
+
+/*
+ * Load the snapshot into zeroed structures after checking it against the
+ * device: its fsid and generation must match the Btrfs superblock (or the
+ * backup copy migration_map_save() keeps once Pass 3 may have overwritten
+ * it), and the device size and layout options must be unchanged. For a
+ * PLANNED snapshot, entries the relocation log records are flagged
+ * completed. Returns the phase (> 0), or -1 with a message on stderr.
+ */
+int checkpoint_load(struct checkpoint *ck, struct btrfs_fs_info *fs_info,
+                    struct ext4_layout *layout, struct relocation_plan *plan);
+
+/*
+ * Open the relocation log for the plan of the last PLANNED snapshot and
+ * install checkpoint_reloc_progress() as the relocator's progress hook.
+ * Returns 0 on success, -1 on error (relocation can go ahead unlogged).
+ */
+int checkpoint_reloc_begin(struct checkpoint *ck,
+                           const struct relocation_plan *plan);
+
+/* relocator progress hook; `arg` is the struct checkpoint */
+void checkpoint_reloc_progress(const struct relocation_entry *entry,
+                               void *arg);
+
+/* Remove the hook and close the log */
+void checkpoint_reloc_end(struct checkpoint *ck);
+
+/* Delete the snapshot and the relocation log from `workdir` */
+void checkpoint_remove(const char *workdir);
+
+/* Human-readable phase name */
+const char *checkpoint_phase_name(enum checkpoint_phase phase);
+
+#endif /* CHECKPOINT_H */
@@ -23,12 +23,65 @@
 /* Maximum number of in-flight I/O operations for batch API */
 #define DEVICE_BATCH_QUEUE_DEPTH 256
 
+/* Write-combining cache: page size, largest write it absorbs, default
+ * memory budget */
+#define DEVICE_CACHE_PAGE 4096
+#define DEVICE_CACHE_MAX_WRITE (64 * 1024)
+#define DEVICE_CACHE_DEFAULT_BUDGET (64ULL * 1024 * 1024)
+
+/* device_open_flags() flags */
+#define DEVICE_OPEN_READ_ONLY 0x1 /* O_RDONLY (dry-run mode) */
+#define DEVICE_OPEN_DIRECT 0x2    /* O_DIRECT descriptor for bulk data */
+
+/* Alignment of device_buf_alloc() buffers; the strictest O_DIRECT
+ * requirement this tool accepts */
+#define DEVICE_DIRECT_ALIGN 4096
+
+/* Aligned buffer pool: size classes 4 KiB .. 64 MiB, and how many bytes
+ * of released buffers it keeps for reuse */
+#define DEVICE_BUF_MIN_SHIFT 12
+#define DEVICE_BUF_CLASSES 15
+#define DEVICE_BUF_POOL_LIMIT (64ULL * 1024 * 1024)
+
+/* Data mover: piece size for splice() pipes and the bounce buffer */
+#define DEVICE_COPY_CHUNK (1u << 20)
+
+/* Zeroing: largest piece of the shared zero buffer written at a time */
+#define DEVICE_ZERO_CHUNK (1u << 20)
+
+/* How device_zero_range() zeroes, cheapest first */
+enum device_zero_mode {
+  DEVICE_ZERO_AUTO = 0, /* not tried yet */
+  DEVICE_ZERO_PUNCH,    /* fallocate(PUNCH_HOLE): deallocate / unmap */
+  DEVICE_ZERO_RANGE,    /* fallocate(ZERO_RANGE) or BLKZEROOUT */
+  DEVICE_ZERO_WRITE,    /* writes of a shared zero buffer */
+};
+
+/* How device_copy() moves bytes, fastest first */
+enum device_copy_mode {
+  DEVICE_COPY_AUTO = 0, /* not probed yet */
+  DEVICE_COPY_RANGE,    /* copy_file_range(): in the kernel, maybe offloaded */
+  DEVICE_COPY_SPLICE,   /* splice() through a pipe (io_uring when present) */
+  DEVICE_COPY_BUFFER,   /* bulk read + write through a bounce buffer */
+};
+
+struct device_cache;
+
 /* Opaque device handle */
 struct device {
   int fd;
   uint64_t size;   /* total device/file size in bytes */
   int read_only;   /* 1 = opened read-only (dry-run mode) */
   char path[4096]; /* device path for error messages */
+  struct device_cache *cache; /* NULL = write-through */
+  int direct_fd;              /* O_DIRECT descriptor, -1 = buffered only */
+  uint32_t direct_align;      /* offset/length/buffer alignment for it */
+  int copy_mode;              /* enum device_copy_mode in use */
+  int copy_pipe[2];           /* splice() pipe, -1 until first needed */
+  uint32_t copy_pipe_size;
+  int copy_no_ring;           /* the ring refused splice; use the syscall */
+  int zero_mode;              /* enum device_zero_mode in use */
+  int is_blkdev;              /* a block device, not an image file */
 
 #ifdef HAVE_IO_URING
   struct io_uring ring;   /* io_uring instance for batch I/O */
@@ -44,6 +97,14 @@ struct device {
  */
 int device_open(struct device *dev, const char *path, int read_only);
 
+/*
+ * device_open() with DEVICE_OPEN_* flags. DEVICE_OPEN_DIRECT opens a
+ * second, O_DIRECT descriptor used only by the bulk data calls below;
+ * metadata I/O keeps going through the page cache. If the file system
+ * or device refuses O_DIRECT the device stays fully buffered.
+ */
+int device_open_flags(struct device *dev, const char *path, int flags);
+
 /*
  * Close the device.
  */
@@ -74,6 +135,152 @@ int device_sync(struct device *dev);
  */
 uint64_t device_get_size(struct device *dev);
 
+/*
+ * 1 if the device (or, for an image file, the disk holding it) rotates,
+ * 0 if it does not, -1 if sysfs cannot tell.
+ */
+int device_is_rotational(const struct device *dev);
+
+/* ========================================================================
+ * Bulk data I/O
+ *
+ * Relocation, decompressed data and migration-map copies move file data
+ * the converter never reads again; with DEVICE_OPEN_DIRECT they bypass
+ * the page cache so a multi-TB conversion does not evict the rest of the
+ * host and the kernel does not copy every byte twice. Requests whose
+ * offset, length or buffer are not aligned to dev->direct_align (and all
+ * requests on a buffered device) fall back to device_read/device_write.
+ * Cached writes overlapping a bulk request are flushed first.
+ * ======================================================================== */
+
+int device_read_bulk(struct device *dev, uint64_t offset, void *buf,
+                     size_t size);
+
+int device_write_bulk(struct device *dev, uint64_t offset, const void *buf,
+                      size_t size);
+
+/*
+ * DEVICE_DIRECT_ALIGN-aligned buffer for bulk I/O, taken from a
+ * process-wide pool of released buffers (rounded up to a power of two)
+ * before falling back to posix_memalign(). Thread-safe. Returns NULL on
+ * OOM. device_buf_free() must be given the size that was requested.
+ */
+void *device_buf_alloc(size_t size);
+void device_buf_free(void *buf, size_t size);
+
+/* Release every pooled buffer */
+void device_buf_pool_drain(void);
+
+struct device_buf_stats {
+  uint64_t allocs;  /* buffers obtained from posix_memalign */
+  uint64_t reuses;  /* requests served from the pool */
+  uint64_t pooled;  /* bytes currently held for reuse */
+};
+
+void device_buf_get_stats(struct device_buf_stats *out);
+
+/* ========================================================================
+ * Data mover
+ *
+ * Relocation, CoW clones and rollback copy one range of the device to
+ * another. device_copy() keeps those bytes in the kernel when it can:
+ * copy_file_range() first (image files; the host file system may clone or
+ * offload the copy), then splice() through a pipe (block devices; on
+ * io_uring a linked splice pair per piece), then the bulk read/write path.
+ * A method the kernel refuses is dropped for the rest of the device's
+ * life and the piece is retried with the next one. Cached writes
+ * overlapping either range are flushed first. Nothing is checksummed:
+ * callers that need a CRC of the data read it themselves.
+ *
+ * The ranges must not overlap. Not thread-safe per device (one pipe).
+ * ======================================================================== */
+
+/* Copy `len` bytes at `src` to `dst`. Returns 0 on success, -1 on error. */
+int device_copy(struct device *dev, uint64_t src, uint64_t dst, uint64_t len);
+
+/*
+ * Method device_copy() will use next. The first call probes
+ * copy_file_range() with an empty request.
+ */
+enum device_copy_mode device_copy_mode(struct device *dev);
+
+/* Force a method (tests, benchmarks); DEVICE_COPY_AUTO probes again */
+void device_copy_set_mode(struct device *dev, enum device_copy_mode mode);
+
+/* 1 if the bytes of a copy in this mode never reach user space */
+static inline int device_copy_in_kernel(enum device_copy_mode mode) {
+  return mode == DEVICE_COPY_RANGE || mode == DEVICE_COPY_SPLICE;
+}
+
+/* "copy_file_range", "splice", "buffer" (or "auto") */
+const char *device_copy_mode_name(enum device_copy_mode mode);
+
+/* ========================================================================
+ * Zeroing
+ *
+ * The journal, and without lazy inode tables the tables' unused parts,
+ * must read back as zeros. device_zero_range() gets the kernel to zero a
+ * range without the bytes crossing the host when it can:
+ * fallocate(PUNCH_HOLE) first, which deallocates the range of an image
+ * file and, on a block device, unmaps it only where the device
+ * guarantees unmapped blocks read as zeros (the kernel does the
+ * discard-zeroes check); then fallocate(ZERO_RANGE) on image files or
+ * BLKZEROOUT on block devices (WRITE ZEROES where the device offloads
+ * it); then writes of one shared zero buffer through the write batch
+ * (io_uring when present). As with device_copy(), a method the kernel
+ * refuses is dropped for the rest of the device's life. The unaligned
+ * edges of a range are always written. Cached writes overlapping the
+ * range are flushed first. Writes go through a batch of their own, so no
+ * write batch may be open when it is called.
+ * ======================================================================== */
+
+/* Zero `len` bytes at `offset`. Returns 0 on success, -1 on error. */
+int device_zero_range(struct device *dev, uint64_t offset, uint64_t len);
+
+/* Method device_zero_range() tries next (DEVICE_ZERO_AUTO: the first) */
+enum device_zero_mode device_zero_mode(const struct device *dev);
+
+/* Force a method (tests, benchmarks); DEVICE_ZERO_AUTO starts over */
+void device_zero_set_mode(struct device *dev, enum device_zero_mode mode);
+
+/* "punch", "zero_range" / "blkzeroout", "write" (or "auto") */
+const char *device_zero_mode_name(const struct device *dev,
+                                  enum device_zero_mode mode);
+
+/* ========================================================================
+ * Write-combining cache (optional)
+ *
+ * While enabled, device_write() calls of up to DEVICE_CACHE_MAX_WRITE bytes
+ * are absorbed into in-memory pages and written out later, sorted by
+ * offset with adjacent dirty ranges merged. device_read() sees cached
+ * bytes. Larger writes and batch I/O that overlap a cached page flush the
+ * cache first. The cache is flushed when it outgrows its budget or
+ * mem_track_exceeded() trips, by device_cache_flush() at phase barriers,
+ * by device_sync() (so journal ordering points still hold) and by
+ * device_close(). Writes absorbed by the cache report errors at the flush.
+ *
+ * Writes queued with device_write_batch_add() are not ordered against
+ * cached writes to the same bytes until device_write_batch_submit().
+ * ======================================================================== */
+
+struct device_cache_stats {
+  uint64_t writes_absorbed; /* device_write calls kept in the cache */
+  uint64_t flush_ios;       /* pwritev calls issued by flushes */
+  uint64_t flushes;
+};
+
+/* budget = bytes of cached pages before a forced flush (0 = default) */
+int device_cache_enable(struct device *dev, uint64_t budget);
+
+/* Write out everything cached, in offset order */
+int device_cache_flush(struct device *dev);
+
+/* Flush and return to write-through */
+int device_cache_disable(struct device *dev);
+
+void device_cache_get_stats(const struct device *dev,
+                            struct device_cache_stats *out);
+
 /* ========================================================================
  * Batch Write API — io_uring accelerated (optional)
  *
@@ -88,6 +295,8 @@ uint64_t device_get_size(struct device *dev);
  *
  * When HAVE_IO_URING is not defined, _add() calls pwrite() immediately
  * and _begin()/_submit() are no-ops. Zero overhead, identical semantics.
+ * Batch writes are buffered; batch reads are bulk reads (see above) and
+ * use the O_DIRECT descriptor when the request is aligned.
  * ======================================================================== */
 
 /*
@@ -0,0 +1,140 @@
+/*
+ * device_profile.h — Device performance profile and dry-run time model
+ *
+ * --dry-run measures what the device does for the access patterns a
+ * conversion issues: long sequential reads, random 4 KiB and 64 KiB reads
+ * (relocation sources, compressed extents, clone sources), and, when the
+ * user allows writes, sequential writes and write + fdatasync commits of
+ * a few queue depths (the relocation checkpoint's syncs). The
+ * figures are fed with the counts Pass 2 planned into a per-phase model
+ * of the real conversion's run time.
+ *
+ * Measurements bypass the page cache: the bulk descriptor is O_DIRECT
+ * when the device was opened with it, otherwise the ranges are dropped
+ * from the cache before they are read. Write tests read a range Btrfs
+ * does not use and write the same bytes back, so the device's contents
+ * never change.
+ *
+ * A profile can be saved to a file and reused by later runs against the
+ * same device, since a thorough profile takes several seconds.
+ */
+
+#ifndef DEVICE_PROFILE_H
+#define DEVICE_PROFILE_H
+
+#include <stdint.h>
+
+struct device;
+struct usage_map;
+
+#define DEVICE_PROFILE_MAGIC "B2E4PROF"
+#define DEVICE_PROFILE_VERSION 1
+
+/* Sequential tests: bytes moved, in pieces of DEVICE_PROFILE_SEQ_IO */
+#define DEVICE_PROFILE_SEQ_BYTES (128ULL * 1024 * 1024)
+#define DEVICE_PROFILE_SEQ_IO (1024 * 1024)
+
+/* Random read tests stop after this many requests or this much time */
+#define DEVICE_PROFILE_RAND_OPS 2048
+#define DEVICE_PROFILE_RAND_MS 2000
+
+/* Commit tests: writes per fdatasync, and commits timed per depth */
+#define DEVICE_PROFILE_DEPTHS 3
+#define DEVICE_PROFILE_DEPTH_LIST {1, 8, 64}
+#define DEVICE_PROFILE_COMMITS 32
+
+/* device_profile_measure() flags */
+#define DEVICE_PROFILE_WRITES 0x1 /* also run the write and commit tests */
+
+struct device_profile {
+  uint64_t device_size;  /* the profile only applies to this size */
+  int64_t measured_at;   /* time(NULL) */
+  int32_t rotational;    /* device_is_rotational() */
+  uint32_t writes;       /* 1 if the write figures were measured */
+  double seq_read;       /* bytes/s */
+  double seq_write;      /* bytes/s; 0 = not measured */
+  double rand_4k_iops;   /* 4 KiB random reads per second, one in flight */
+  double rand_64k_iops;  /* 64 KiB random reads per second, one in flight */
+  uint32_t depth[DEVICE_PROFILE_DEPTHS];
+  double commit_sec[DEVICE_PROFILE_DEPTHS]; /* depth writes + fdatasync */
+};
+
+/*
+ * Profile `dev`. Random reads cover the whole device. With
+ * DEVICE_PROFILE_WRITES the write tests reopen dev->path read-write (the
+ * handle itself may be read-only) and use the first run of free space in
+ * `usage` big enough for them; without such a run, or without the flag,
+ * the write figures stay 0. Returns 0 on success, -1 if the read tests
+ * failed.
+ */
+int device_profile_measure(struct device_profile *p, struct device *dev,
+                           const struct usage_map *usage, uint32_t flags);
+
+/*
+ * Load a profile saved by device_profile_save(). Returns 0 if the file
+ * holds an intact profile for a device of `device_size` bytes, -1
+ * otherwise (a missing file is not an error message).
+ */
+int device_profile_load(struct device_profile *p, const char *path,
+                        uint64_t device_size);
+
+/* Write the profile to `path` atomically. Returns 0 or -1. */
+int device_profile_save(const struct device_profile *p, const char *path);
+
+/* ========================================================================
+ * Time model
+ *
+ * Every request that is not contiguous with the previous one pays the
+ * positioning time of a random read; bytes move at the sequential rate.
+ * The positioning time is the intercept of the line through the two
+ * random read tests, t(len) = access + len / rate. A commit costs a
+ * record write plus the flush measured at the nearest queue depth. When
+ * the writes were not measured they are assumed to run as fast as reads,
+ * with a fixed flush cost (larger on rotating disks).
+ * ======================================================================== */
+
+/* Phases of a real conversion after planning */
+enum eta_phase {
+  ETA_PHASE_SCAN = 0,  /* Pass 1 and 2, as timed by the dry run */
+  ETA_PHASE_RELOCATE,  /* relocation moves and checkpoint syncs */
+  ETA_PHASE_DECOMPRESS,/* compressed extents read and written out */
+  ETA_PHASE_CLONE,     /* shared blocks copied for reflinks */
+  ETA_PHASE_METADATA,  /* inode tables, bitmaps, GDT and final syncs */
+  ETA_PHASE_COUNT
+};
+
+/* What the plan will make the device do */
+struct eta_workload {
+  double scan_sec;             /* measured Pass 1 + 2 wall time */
+  uint64_t reloc_moves;        /* relocation_plan entries */
+  uint64_t reloc_bytes;
+  uint64_t reloc_syncs;        /* checkpoint syncs every so many moves */
+  double reloc_sync_sec;       /* ... and at least this often (0 = no) */
+  uint64_t decomp_extents;     /* compressed extents */
+  uint64_t decomp_read_bytes;  /* compressed bytes on disk */
+  uint64_t decomp_write_bytes; /* decompressed bytes */
+  uint64_t clone_reads;        /* clone plan source ranges */
+  uint64_t clone_read_bytes;
+  uint64_t clone_writes;       /* clone plan runs */
+  uint64_t clone_write_bytes;
+  uint64_t meta_runs;          /* separate metadata regions (block groups) */
+  uint64_t meta_bytes;
+  uint64_t syncs;              /* barriers outside relocation */
+};
+
+struct eta_estimate {
+  double phase_sec[ETA_PHASE_COUNT];
+  double total_sec;
+};
+
+/* Positioning time of one scattered request, in seconds */
+double device_profile_access(const struct device_profile *p);
+
+void device_profile_estimate(const struct device_profile *p,
+                             const struct eta_workload *w,
+                             struct eta_estimate *out);
+
+/* "scan", "relocate", ... */
+const char *eta_phase_name(enum eta_phase phase);
+
+#endif /* DEVICE_PROFILE_H */
@@ -7,6 +7,10 @@
 
 #include <stdint.h>
 
+/* Block groups per flex group (s_log_groups_per_flex) */
+#define EXT4_LOG_GROUPS_PER_FLEX 4
+#define EXT4_GROUPS_PER_FLEX (1U << EXT4_LOG_GROUPS_PER_FLEX)
+
 /* Represents one block group's metadata layout */
 struct ext4_bg_layout {
   uint64_t group_start_block;   /* first block of this group */
@@ -44,6 +48,22 @@ struct ext4_layout {
 
 struct btrfs_fs_info;
 
+/*
+ * Pack the bitmaps and inode tables of each flex group into one run, placed
+ * where it covers the fewest Btrfs data blocks (on by default). Off gives
+ * every group its own metadata right after its superblock/GDT.
+ */
+void ext4_plan_set_flex_pack(int enabled);
+
+/* What a layout is planned with, besides the device and block size */
+#define EXT4_PLAN_RESERVED_GDT_AUTO UINT32_MAX
+struct ext4_plan_params {
+  uint32_t inode_ratio;  /* bytes per inode */
+  uint32_t reserved_gdt; /* growth GDT blocks, or EXT4_PLAN_RESERVED_GDT_AUTO
+                            for as many as the GDT has */
+  int flex_pack;         /* pack each flex group's metadata */
+};
+
 /*
  * Calculate the ext4 layout for a device.
  * device_size is in bytes, inode_ratio is bytes per inode.
@@ -53,6 +73,49 @@ int ext4_plan_layout(struct ext4_layout *layout, uint64_t device_size,
                      uint32_t block_size, uint32_t inode_ratio,
                      const struct btrfs_fs_info *fs_info);
 
+/* ext4_plan_layout() with every parameter given */
+int ext4_plan_layout_params(struct ext4_layout *layout, uint64_t device_size,
+                            uint32_t block_size,
+                            const struct ext4_plan_params *params,
+                            const struct btrfs_fs_info *fs_info);
+
+/*
+ * Layout search (--layout-search). Candidate layouts vary the inode ratio
+ * from the configured one up to max_inode_ratio in powers of two, drop the
+ * reserved GDT blocks, and turn flex group packing off; where each flex
+ * group's run goes is already searched by the planner. Every candidate is
+ * planned quietly and scored by the bytes of Btrfs extents over its
+ * metadata, in parallel on the thread pool. The cheapest wins; ties keep
+ * the candidate closer to the configured layout, which is cand[0].
+ */
+#define EXT4_PLAN_SEARCH_MAX 32
+
+struct ext4_plan_candidate {
+  struct ext4_plan_params params;
+  int ok;                   /* planned; 0 if it does not fit the device */
+  uint32_t total_inodes;
+  uint32_t reserved_blocks; /* metadata blocks */
+  uint64_t conflicts;       /* Btrfs extents over the metadata */
+  uint64_t reloc_bytes;     /* bytes the relocator would copy for them */
+};
+
+struct ext4_plan_search {
+  struct ext4_plan_candidate cand[EXT4_PLAN_SEARCH_MAX];
+  uint32_t count;
+  uint32_t chosen;  /* index of the cheapest candidate */
+  uint32_t threads; /* workers the candidates ran on */
+};
+
+/* Returns 0, or -1 if no candidate fits the device */
+int ext4_plan_search(struct ext4_plan_search *s, uint64_t device_size,
+                     uint32_t block_size,
+                     const struct ext4_plan_params *base,
+                     uint32_t max_inode_ratio,
+                     const struct btrfs_fs_info *fs_info);
+
+/* Print the candidates and the trade-off of the chosen one */
+void ext4_plan_search_report(const struct ext4_plan_search *s);
+
 /*
  * Find all reserved (metadata) block numbers that conflict with
  * btrfs data extents.
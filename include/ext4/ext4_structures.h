@@ -77,6 +77,7 @@
 #define EXT4_FEATURE_INCOMPAT_MMP 0x0100
 #define EXT4_FEATURE_INCOMPAT_FLEX_BG 0x0200
 #define EXT4_FEATURE_INCOMPAT_CSUM_SEED 0x2000
+#define EXT4_FEATURE_INCOMPAT_LARGEDIR 0x4000
 #define EXT4_FEATURE_INCOMPAT_INLINE_DATA 0x8000
 
 /* Read-only compatible feature flags (s_feature_ro_compat) */
@@ -89,6 +90,9 @@
 #define EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE 0x0040
 #define EXT4_FEATURE_RO_COMPAT_METADATA_CSUM 0x0400
 
+/* s_checksum_type */
+#define EXT4_CRC32C_CHKSUM 1
+
 /* Block group flags (bg_flags in group descriptor) */
 #define EXT4_BG_INODE_UNINIT 0x0001 /* Inode table not initialized */
 #define EXT4_BG_BLOCK_UNINIT 0x0002 /* Block bitmap not initialized */
@@ -328,10 +332,17 @@ struct ext4_extent_header {
   uint32_t eh_generation; /* generation of tree */
 } __attribute__((packed));
 
+/*
+ * Longest initialized extent. An ee_len above it marks the extent
+ * unwritten (allocated, reads as zeros), covering ee_len - 32768 blocks.
+ */
+#define EXT4_EXT_INIT_MAX_LEN 32768
+#define EXT4_EXT_UNWRITTEN_MAX_LEN (EXT4_EXT_INIT_MAX_LEN - 1)
+
 /* Leaf extent (eh_depth == 0) */
 struct ext4_extent {
   uint32_t ee_block;    /* first file block covered */
-  uint16_t ee_len;      /* number of blocks covered */
+  uint16_t ee_len;      /* number of blocks covered; see above */
   uint16_t ee_start_hi; /* physical block (hi 16 bits) */
   uint32_t ee_start_lo; /* physical block (lo 32 bits) */
 } __attribute__((packed));
@@ -395,6 +406,10 @@ struct ext4_dir_entry_2 {
  * HTree Directory Index structures
  * ======================================================================== */
 
+/* HTree depth (root included): 2 levels, or 3 with INCOMPAT_LARGEDIR */
+#define EXT4_HTREE_LEVEL_COMPAT 2
+#define EXT4_HTREE_LEVEL 3
+
 struct ext4_dx_root_info {
   uint32_t reserved_zero;
   uint8_t hash_version; /* EXT4_HASH_* */
@@ -11,6 +11,16 @@
 struct device;
 struct ext4_layout;
 struct btrfs_fs_info;
+struct file_entry;
+struct ext4_clone_plan;
+struct ext4_tree_regions;
+struct ext4_super_block;
+
+/* Where the next search starts: group and data block within it */
+struct ext4_alloc_cursor {
+  uint32_t group;
+  uint32_t block_in_group;
+};
 
 /* Allocator state structure (thread-safe, explicit state) */
 struct ext4_block_allocator {
@@ -19,8 +29,21 @@ struct ext4_block_allocator {
   /* 1 bit por bloque físico: 1 = bloque en uso (meta o datos) */
   uint8_t *reserved_bitmap;
   /* Cursor for O(1) amortized allocation (Bug E fix) */
-  uint32_t current_group;
-  uint32_t current_block_in_group;
+  struct ext4_alloc_cursor cursor;
+
+  /* Goal-based allocation: one cursor per flex group. While a goal inode
+   * is set, allocations start in that inode's flex group. */
+  struct ext4_alloc_cursor *flex_cursors;
+  uint32_t num_flex;
+  uint32_t goal_ino;    /* 0 = no goal, use `cursor` */
+  uint32_t goal_flex;   /* flex group of goal_ino, UINT32_MAX if none */
+  uint64_t goal_spills; /* goal allocations served outside the goal flex */
+
+  /* Copies of shared blocks the extent trees point at instead, or NULL */
+  const struct ext4_clone_plan *clones;
+
+  /* Where extent-tree blocks go instead of next to each file, or NULL */
+  struct ext4_tree_regions *tree_regions;
 };
 
 /* Inode mapping: btrfs objectid → ext4 inode number */
@@ -29,19 +52,34 @@ struct inode_map_entry {
   uint32_t ext4_ino;
 };
 
+/* Lookup index chosen by inode_map_build_hash() from the id density */
+enum inode_map_index {
+  INODE_MAP_LINEAR = 0, /* not built yet: scan entries */
+  INODE_MAP_DIRECT,     /* flat array indexed by btrfs_ino - direct_base */
+  INODE_MAP_ROBIN_HOOD, /* open addressing, split key/value arrays */
+};
+
 struct inode_map {
   struct inode_map_entry *entries;
   uint32_t count;
   uint32_t capacity;
-  /* Hash table for O(1) lookups */
-  struct inode_map_entry *ht_buckets;
-  uint32_t ht_size;
+
+  /* Lookup index (one allocation or mapping: index_mem) */
+  enum inode_map_index index;
+  uint32_t *direct; /* ext4 ino, 0 = none */
+  uint64_t direct_base;
+  uint64_t direct_len;
+  uint64_t *rh_keys; /* btrfs ino, 0 = empty slot */
+  uint32_t *rh_vals;
+  uint32_t rh_mask;  /* slot count - 1 */
+  uint32_t rh_shift; /* 64 - log2(slot count) */
+  void *index_mem;
+  size_t index_size;
 
   /* mmap specific fields for extreme scalability */
   int fd_entries;
   int fd_ht;
   size_t mapped_entries_size;
-  size_t mapped_ht_size;
 
   /* Adaptive memory and HDD thrashing prevention */
   struct adaptive_mem_config *mem_cfg;
@@ -71,8 +109,32 @@ int ext4_write_gdt(struct device *dev, const struct ext4_layout *layout);
 int ext4_write_bitmaps(struct device *dev, const struct ext4_layout *layout,
                        const struct ext4_block_allocator *alloc,
                        const struct inode_map *inode_map);
+/* Recount free blocks and inodes, set the group flags and checksums.
+ * Blocks `alloc` (may be NULL) holds but the on-disk block bitmaps miss,
+ * such as the journal's, are added to those bitmaps first. */
 int ext4_update_free_counts(struct device *dev,
-                            const struct ext4_layout *layout);
+                            const struct ext4_layout *layout,
+                            const struct ext4_block_allocator *alloc);
+
+/* Seed of the metadata_csum checksums (stored or derived from the UUID) */
+uint32_t ext4_csum_seed(const struct ext4_super_block *sb);
+
+/* bg_checksum of group `group` for the features `sb` declares: crc32c with
+ * metadata_csum, crc16 with gdt_csum, 0 otherwise. The bg_checksum field
+ * of `desc` is skipped, so it need not be cleared first. */
+uint16_t ext4_group_desc_csum(const struct ext4_super_block *sb,
+                              uint32_t group, const void *desc,
+                              uint32_t desc_size);
+
+/*
+ * Lazy inode tables (--no-lazy-itable turns them off; on by default).
+ * Only the prefix of each group's table up to its last used inode is
+ * written, rounded up to a block, and groups without inodes are skipped;
+ * bg_itable_unused and INODE_UNINIT tell the kernel, which zeroes the rest
+ * in the background after mounting. Off, every table is written in full.
+ */
+void ext4_itable_set_lazy_policy(int enabled);
+int ext4_itable_lazy_policy(void);
 int ext4_write_inode_table(struct device *dev, const struct ext4_layout *layout,
                            const struct btrfs_fs_info *fs_info,
                            struct inode_map *inode_map,
@@ -85,6 +147,17 @@ int ext4_write_directories(struct device *dev, const struct ext4_layout *layout,
 void inode_map_free(struct inode_map *map);
 int inode_map_add(struct inode_map *map, uint64_t btrfs_ino, uint32_t ext4_ino);
 uint32_t inode_map_lookup(const struct inode_map *map, uint64_t btrfs_ino);
+/* inode_map_lookup() for n inodes, INODE_MAP_BATCH at a time: the Bloom
+ * filter and hash buckets of a whole batch are fetched before probing */
+#define INODE_MAP_BATCH 64
+void inode_map_lookup_batch(const struct inode_map *map,
+                            const uint64_t *btrfs_inos, uint32_t n,
+                            uint32_t *ext4_inos);
+/* Index the entries added so far; ext4_write_inode_table() calls it */
+void inode_map_build_hash(struct inode_map *map);
+
+/* Ext4 legacy directory hash, used to order HTree leaf entries */
+uint32_t ext4_legacy_hash(const char *name, uint8_t len);
 
 /* Block allocator for extent tree and directory blocks */
 void ext4_block_alloc_init(struct ext4_block_allocator *alloc,
@@ -93,20 +166,183 @@ void ext4_block_alloc_free(struct ext4_block_allocator *alloc);
 uint64_t ext4_alloc_block(struct ext4_block_allocator *alloc,
                           const struct ext4_layout *layout);
 
+/*
+ * Allocate up to `want` contiguous blocks from the cursor onwards. Returns
+ * the first block of the first run that fits, or else of the longest
+ * shorter run seen, with its length in *got; (uint64_t)-1 when the device
+ * is full.
+ */
+uint64_t ext4_alloc_run(struct ext4_block_allocator *alloc,
+                        const struct ext4_layout *layout, uint32_t want,
+                        uint32_t *got);
+
+/*
+ * Make following allocations prefer the flex group holding `ext4_ino`,
+ * falling back to the next flex groups in turn; 0 clears the goal. Returns
+ * the previous goal so nested users can restore it.
+ */
+uint32_t ext4_alloc_set_goal(struct ext4_block_allocator *alloc,
+                             const struct ext4_layout *layout,
+                             uint32_t ext4_ino);
+
+/* Enable/disable goal-based allocation for allocators initialised later */
+void ext4_alloc_set_goal_policy(int enabled);
+
+/* Give blocks back; the tail of the latest run is handed out again next */
+void ext4_release_run(struct ext4_block_allocator *alloc,
+                      const struct ext4_layout *layout, uint64_t start,
+                      uint32_t count);
+
+/* Blocks claimed ahead with ext4_alloc_run() and handed out one at a time,
+ * so a structure built block by block still lands in few extents */
+struct ext4_block_reserve {
+  uint64_t next;
+  uint32_t left;
+  uint32_t want; /* blocks still expected; 0 = 1 */
+};
+
+uint64_t ext4_reserve_take(struct ext4_block_reserve *r,
+                           struct ext4_block_allocator *alloc,
+                           const struct ext4_layout *layout);
+
+/* Up to `want` contiguous blocks from the reserve, in *got; a run never
+ * spans two claims. (uint64_t)-1 when the device is full. */
+uint64_t ext4_reserve_take_run(struct ext4_block_reserve *r,
+                               struct ext4_block_allocator *alloc,
+                               const struct ext4_layout *layout, uint32_t want,
+                               uint32_t *got);
+
+/* Return the unused part of the reserve to the allocator */
+void ext4_reserve_release(struct ext4_block_reserve *r,
+                          struct ext4_block_allocator *alloc,
+                          const struct ext4_layout *layout);
+
 /* Marcar en el allocator todos los bloques de datos ya usados por Btrfs
  * (extents finales tras relocación) para que no sean reutilizados por Ext4. */
 void ext4_block_alloc_mark_fs_data(struct ext4_block_allocator *alloc,
                                    const struct ext4_layout *layout,
                                    const struct btrfs_fs_info *fs_info);
 
-/* Multi-level extent tree builder (replaces inline-only builder) */
+/*
+ * CoW clone plan. Blocks that several files (reflinks, snapshots) or
+ * several extents of one file map stay with the first user in inode table
+ * order; every later user gets a copy, since ext4 cannot share blocks.
+ * Compressed extents are skipped: each is decompressed into its own blocks.
+ */
+#define EXT4_CLONE_NO_DST ((uint64_t)-1)
+#define EXT4_CLONE_IO_MAX (4u << 20) /* source bytes read at a time */
+
+struct ext4_clone {
+  const struct file_entry *fe;
+  uint32_t file_block; /* first file block of the run */
+  uint32_t num_blocks;
+  uint64_t src_block;  /* the shared blocks */
+  uint64_t dst_block;  /* the copy; EXT4_CLONE_NO_DST until allocated */
+};
+
+struct ext4_clone_plan {
+  struct ext4_clone *clones; /* by (fe, file_block) after _execute() */
+  uint32_t count;
+  uint32_t capacity;
+  uint64_t blocks;        /* blocks to copy */
+  uint64_t source_ranges; /* merged source ranges, each read once */
+  uint64_t source_blocks; /* blocks in those ranges */
+  uint64_t bytes_read;    /* by _execute() */
+  uint64_t bytes_written;
+};
+
+/*
+ * Collect the shared runs of every regular file, in inode table order.
+ * With an allocator each run gets a destination near its inode (split when
+ * only a shorter run is free); without one the plan is an estimate for the
+ * dry run. Leaves the clones in source order. Returns 0, or -1 on OOM or
+ * when the device is full.
+ */
+int ext4_clone_plan_build(struct ext4_clone_plan *plan,
+                          const struct ext4_layout *layout,
+                          const struct btrfs_fs_info *fs_info,
+                          struct ext4_block_allocator *alloc,
+                          const struct inode_map *inode_map);
+
+/*
+ * Copy the clones in source order. When the device takes copy_file_range()
+ * each clone is one device_copy(). Otherwise overlapping and adjacent
+ * sources are merged into ranges read once, a few MiB at a time, and each
+ * piece is written to all of its destinations in one batch. Then sorts the
+ * clones for ext4_clone_plan_find().
+ */
+int ext4_clone_plan_execute(struct ext4_clone_plan *plan, struct device *dev,
+                            uint32_t block_size);
+
+/* The clones of `fe`, sorted by file block, and their number in *n */
+const struct ext4_clone *
+ext4_clone_plan_find(const struct ext4_clone_plan *plan,
+                     const struct file_entry *fe, uint32_t *n);
+
+void ext4_clone_plan_free(struct ext4_clone_plan *plan);
+
+/*
+ * Extent-tree regions. Before the inode tables are written, the tree
+ * blocks every file will need are estimated from its extent count and
+ * summed per flex group (by the file's inode). The first tree built in a
+ * flex group claims that many blocks as one run; trees are built in
+ * memory, take their blocks from the run in inode order and are staged
+ * until EXT4_TREE_REGION_STAGE bytes of consecutive blocks go out as one
+ * device_write_batch_*() write. A flex group that needs more than its
+ * estimate claims another run; what is left over is given back.
+ */
+#define EXT4_TREE_REGION_STAGE (1u << 20)
+
+struct ext4_tree_region {
+  struct ext4_block_reserve reserve;
+  uint8_t *stage;       /* EXT4_TREE_REGION_STAGE bytes, on first use */
+  uint64_t stage_block; /* first block staged */
+  uint32_t staged;      /* blocks staged */
+};
+
+struct ext4_tree_regions {
+  struct ext4_tree_region *flex; /* one per flex group, or just one */
+  uint32_t count;
+  uint32_t block_size;
+  struct device *dev;
+  uint64_t planned; /* blocks estimated */
+  uint64_t blocks;  /* blocks written through the regions */
+  uint64_t writes;  /* batched writes issued */
+  int error;        /* a staged write failed */
+};
+
+/* Enable/disable tree regions (--no-tree-region); on by default */
+void ext4_tree_region_set_policy(int enabled);
+
+/* Blocks outside the inode a tree of `extents` extents takes (0 if the
+ * extents fit in i_block) */
+uint32_t ext4_extent_tree_blocks(uint32_t extents, uint32_t block_size);
+
+/*
+ * Estimate the tree blocks of every regular file of `fs_info`, per flex
+ * group of its inode in `map` (one region if `alloc` has no flex group
+ * cursors). Nothing is claimed yet. Returns 0, or -1 on OOM; with the
+ * policy off, 0 and no regions (r->count == 0).
+ */
+int ext4_tree_regions_init(struct ext4_tree_regions *r,
+                           const struct ext4_block_allocator *alloc,
+                           struct device *dev, const struct ext4_layout *layout,
+                           const struct btrfs_fs_info *fs_info,
+                           const struct inode_map *map);
+
+/* Write out what is staged, give back unclaimed blocks and free the
+ * regions. Returns 0, or -1 if any staged write failed. */
+int ext4_tree_regions_finish(struct ext4_tree_regions *r,
+                             struct ext4_block_allocator *alloc,
+                             const struct ext4_layout *layout);
+
+/* Multi-level extent tree builder (replaces inline-only builder). Tree
+ * blocks come from alloc->tree_regions when set. */
 struct ext4_inode;
-struct file_entry;
-struct chunk_map;
 int ext4_build_extent_tree(struct ext4_block_allocator *alloc,
                            struct device *dev, struct ext4_inode *inode,
                            const struct file_entry *fe,
-                           const struct chunk_map *chunk_map,
+                           const struct btrfs_fs_info *fs_info,
                            const struct ext4_layout *layout);
 /* Journal writer — creates JBD2 journal (inode 8) */
 int ext4_write_journal(struct device *dev, const struct ext4_layout *layout,
@@ -0,0 +1,82 @@
+/*
+ * io_stats.h — Per-phase I/O and CPU statistics
+ *
+ * device_io.c counts every request it hands to the kernel (bytes, requests,
+ * syscalls, syncs, io_uring submissions and the distance from the previous
+ * request) against the phase main() last entered with io_stats_phase().
+ * Counters live in per-thread blocks that only their thread writes, with
+ * plain loads and stores; io_stats_collect() sums them. Wall and CPU time
+ * (user and system, all threads) are charged to a phase while it is the
+ * current one. Cheap enough to leave on in every run.
+ */
+
+#ifndef IO_STATS_H
+#define IO_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Parts of a run the counters are broken down by */
+enum io_phase {
+  IO_PHASE_SETUP = 0,  /* device open, anything before Pass 1 */
+  IO_PHASE_SCAN,       /* Pass 1 tree walks */
+  IO_PHASE_PLAN,       /* Pass 2 planning, dry-run benchmark */
+  IO_PHASE_RELOCATE,   /* migration map and block relocation */
+  IO_PHASE_METADATA,   /* superblock, GDT, bitmaps, free counts */
+  IO_PHASE_INODES,     /* inode tables, extent trees, file data */
+  IO_PHASE_DIRS,       /* directory blocks */
+  IO_PHASE_JOURNAL,    /* ext4 journal */
+  IO_PHASE_COUNT
+};
+
+/* --stats output formats */
+#define IO_STATS_OFF 0
+#define IO_STATS_TEXT 1
+#define IO_STATS_JSON 2
+
+struct io_phase_stats {
+  uint64_t read_ops;      /* read requests (pread loops, io_uring reads) */
+  uint64_t read_bytes;
+  uint64_t write_ops;     /* write requests (pwrite/pwritev, io_uring) */
+  uint64_t write_bytes;
+  uint64_t syscalls;      /* pread/pwrite/pwritev/sync/io_uring_submit */
+  uint64_t fsyncs;        /* fsync and fdatasync */
+  uint64_t uring_submits; /* io_uring_submit calls */
+  uint64_t uring_sqes;    /* requests queued on the ring */
+  uint64_t seek_bytes;    /* |offset - end of the thread's last request| */
+  double wall_sec;
+  double user_sec;
+  double sys_sec;
+};
+
+/* Charge what follows to `phase`; called by the main thread only */
+void io_stats_phase(enum io_phase phase);
+
+/* Recording hooks for device_io.c; thread-safe and lock-free */
+void io_stats_read(uint64_t offset, uint64_t bytes);
+void io_stats_write(uint64_t offset, uint64_t bytes);
+void io_stats_syscall(void);
+void io_stats_fsync(void);
+void io_stats_uring_submit(uint32_t sqes);
+
+/* Where the calling thread's last request ended (its head position, as far
+ * as it knows), or UINT64_MAX before its first */
+uint64_t io_stats_last_offset(void);
+
+/* Sum of all threads per phase, times up to now included */
+void io_stats_collect(struct io_phase_stats out[IO_PHASE_COUNT]);
+
+/* Zero all counters and times and return to IO_PHASE_SETUP; no I/O may
+ * be in flight */
+void io_stats_reset(void);
+
+/* Stable lowercase name of a phase, as used in the JSON output */
+const char *io_phase_name(enum io_phase phase);
+
+/*
+ * Print the collected statistics: a table (IO_STATS_TEXT) or a single
+ * line of JSON (IO_STATS_JSON). Returns 0 on success, -1 on a write error.
+ */
+int io_stats_print(FILE *f, int format);
+
+#endif /* IO_STATS_H */
@@ -10,7 +10,19 @@
 struct device;
 struct relocation_entry;
 
-#define JOURNAL_MAGIC 0x42324534 /* "B2E4" */
+#define JOURNAL_MAGIC 0x42324534       /* "B2E4" */
+#define JOURNAL_GROUP_MAGIC 0x47453242 /* "B2EG" */
+
+#define JOURNAL_VERSION_FLAT 1    /* v1: one entry per slot after the header */
+#define JOURNAL_VERSION_GROUPED 2 /* v2: block-aligned group records */
+
+/* Group records start one block after the header and stay block-aligned */
+#define JOURNAL_BLOCK_SIZE 4096
+
+/* Default group-commit window (see journal_set_group_window) */
+#define JOURNAL_DEFAULT_GROUP_ENTRIES 256
+#define JOURNAL_DEFAULT_GROUP_BYTES (256ULL * 1024 * 1024)
+#define JOURNAL_DEFAULT_GROUP_MS 500
 
 /* Journal header: written at a fixed location on the device */
 struct journal_header {
@@ -19,7 +31,26 @@ struct journal_header {
   uint32_t entry_count;
   uint32_t state;          /* 0=clean, 1=in-progress, 2=needs-rollback */
   uint64_t journal_offset; /* where journal entries start */
-  uint32_t checksum;       /* CRC32 of this header */
+  uint32_t checksum;       /* CRC32 of this header (v1: up to this field) */
+  /* v2 */
+  uint32_t nonce;       /* per-run id stamped into every group record */
+  uint32_t group_count; /* committed group records */
+} __attribute__((packed));
+
+/*
+ * Group record header (v2). Followed by entry_count relocation_entry
+ * structs and zero padding up to record_blocks * JOURNAL_BLOCK_SIZE.
+ * The checksum covers this header (checksum = 0) and the entries with
+ * their `completed` flag read as 0, since completion is flagged in place.
+ */
+struct journal_group_header {
+  uint32_t magic;
+  uint32_t nonce;     /* must match journal_header.nonce */
+  uint32_t group_seq; /* 0, 1, 2, ... — a gap ends the log */
+  uint32_t entry_count;
+  uint32_t record_blocks;
+  uint32_t checksum; /* CRC32C batch checksum */
+  uint32_t reserved;
 } __attribute__((packed));
 
 #define JOURNAL_STATE_CLEAN 0
@@ -35,12 +66,43 @@ int journal_init(struct device *dev, uint64_t journal_offset);
 
 /*
  * Log a relocation operation before executing it.
+ * Equivalent to journal_stage_move() + journal_commit(): one fsync per call.
  * Returns 0 on success, -1 on error.
  */
 int journal_log_move(struct device *dev, const struct relocation_entry *entry);
 
 /*
- * Mark a relocation operation as completed.
+ * Configure the group-commit window: a group is committed once it holds
+ * max_entries entries, covers max_bytes of relocated data, or its oldest
+ * entry has waited max_delay_ms. A zero byte/time limit disables that
+ * trigger.
+ */
+void journal_set_group_window(uint32_t max_entries, uint64_t max_bytes,
+                              uint32_t max_delay_ms);
+
+/*
+ * Stage a relocation in the current group. Staged entries are NOT durable:
+ * the caller must not start the move until a commit has covered it.
+ * Returns 1 if the window filled and everything staged was committed,
+ * 0 if the entry is only staged, -1 on error.
+ */
+int journal_stage_move(struct device *dev,
+                       const struct relocation_entry *entry);
+
+/*
+ * Write all staged entries as one group record, update the header and
+ * fsync once. No-op when nothing is staged.
+ * Returns 0 on success, -1 on error.
+ */
+int journal_commit(struct device *dev);
+
+/*
+ * Number of entries staged but not yet committed.
+ */
+uint32_t journal_staged_count(void);
+
+/*
+ * Mark a committed relocation (by its seq) as completed.
  * Returns 0 on success, -1 on error.
  */
 int journal_mark_complete(struct device *dev, uint32_t seq);
@@ -62,7 +124,8 @@ int journal_replay(struct device *dev, uint64_t journal_offset);
 
 /*
  * Replay/rollback an incomplete journal partially up to a specific sequence.
- * Reverses any partially-completed relocation operations up to failed_seq.
+ * Reverses completed relocation operations logged up to failed_seq (v1
+ * journals: up to journal position failed_seq).
  * Returns 0 on success, -1 on error.
  */
 int journal_replay_partial(struct device *dev, uint64_t journal_offset,
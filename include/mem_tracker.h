@@ -2,7 +2,10 @@
  * mem_tracker.h — Memory usage tracker
  *
  * Lightweight memory usage monitoring to prevent OOM-killer situations
- * on systems converting large, fragmented filesystems.
+ * on systems converting large, fragmented filesystems. Allocations are
+ * counted per subsystem (tag) with lock-free counters; each tag and each
+ * phase of the run keeps its high-water mark, and the whole picture can
+ * be written out as JSON to size hosts and --memory-limit from data.
  */
 
 #ifndef MEM_TRACKER_H
@@ -10,21 +13,56 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+
+/* Subsystems memory is accounted to */
+enum mem_tag {
+  MEM_TAG_OTHER = 0,  /* untagged mem_track_alloc() callers */
+  MEM_TAG_PASS1,      /* arenas, name pool, inode table, extent store */
+  MEM_TAG_CHUNK_MAP,  /* chunk mappings and their resolver */
+  MEM_TAG_USAGE_MAP,  /* device usage bitmap */
+  MEM_TAG_NODE_CACHE, /* verified B-tree nodes */
+  MEM_TAG_RELOC,      /* relocation plan, extent hash, free-space index */
+  MEM_TAG_INODE_MAP,  /* btrfs → ext4 inode numbers */
+  MEM_TAG_BLOOM,      /* bloom filters */
+  MEM_TAG_DIR,        /* directory builder batches */
+  MEM_TAG_IO_BUF,     /* bulk I/O buffer pool */
+  MEM_TAG_WRITE_CACHE,/* write-combining device cache */
+  MEM_TAG_COUNT
+};
+
+/* Phases whose high-water marks are kept apart; later phases fold into
+ * the last slot */
+#define MEM_TRACK_MAX_PHASES 16
+
+/*
+ * Release about `want` bytes of a subsystem's memory; returns the bytes
+ * actually released. Called from mem_track_reclaim(), never while the
+ * tracker itself holds a lock.
+ */
+typedef uint64_t (*mem_reclaim_fn)(void *arg, uint64_t want);
 
 /*
  * Initialize the memory tracker.
  * Reads available system memory from /proc/meminfo and sets the threshold
- * to 75% of MemAvailable.
+ * to 75% of MemAvailable. Counters are left as they are.
  */
 void mem_track_init(void);
 
+/* Override the threshold with an explicit budget in bytes (0 = keep) */
+void mem_track_set_limit(uint64_t bytes);
+
+/* Count `bytes` allocated or released by subsystem `tag`. Thread-safe. */
+void mem_track_alloc_tag(enum mem_tag tag, size_t bytes);
+void mem_track_free_tag(enum mem_tag tag, size_t bytes);
+
 /*
- * Track a memory allocation of the given size.
+ * Track a memory allocation of the given size (MEM_TAG_OTHER).
  */
 void mem_track_alloc(size_t bytes);
 
 /*
- * Track a memory deallocation of the given size.
+ * Track a memory deallocation of the given size (MEM_TAG_OTHER).
  */
 void mem_track_free(size_t bytes);
 
@@ -33,6 +71,10 @@ void mem_track_free(size_t bytes);
  */
 uint64_t mem_track_usage(void);
 
+/* Current and peak bytes of one subsystem */
+uint64_t mem_track_tag_usage(enum mem_tag tag);
+uint64_t mem_track_tag_peak(enum mem_tag tag);
+
 /*
  * Returns 1 if current tracked usage exceeds the safety threshold, 0 otherwise.
  * When exceeded, callers should disable optional hash tables and fall back to
@@ -40,6 +82,34 @@ uint64_t mem_track_usage(void);
  */
 int mem_track_exceeded(void);
 
+/*
+ * Start a new phase (e.g. "pass1"): high-water marks from here on are
+ * also recorded under `name`, which must outlive the tracker.
+ */
+void mem_track_phase(const char *name);
+
+/*
+ * Register (fn != NULL) or remove the reclaim callback of `tag`. One
+ * callback per tag; the previous one is replaced.
+ */
+void mem_track_set_reclaim(enum mem_tag tag, mem_reclaim_fn fn, void *arg);
+
+/*
+ * If usage exceeds the threshold, ask subsystems to give memory back,
+ * largest first, until it no longer does. Call only where no subsystem
+ * lock is held. Returns the bytes released; concurrent callers return 0.
+ */
+uint64_t mem_track_reclaim(void);
+
+/* Stable lowercase name of a tag, as used in the JSON report */
+const char *mem_track_tag_name(enum mem_tag tag);
+
+/*
+ * Write current, peak and per-phase high-water usage of every tag as one
+ * JSON object. Returns 0 on success, -1 on a write error.
+ */
+int mem_track_write_json(FILE *f);
+
 /*
  * Print memory usage summary.
  */
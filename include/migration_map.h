@@ -31,11 +31,21 @@ struct device;
  */
 int migration_map_save(struct device *dev, const struct relocation_plan *plan);
 
+/*
+ * Rewrite the entries of a saved map (same plan, same count) once
+ * relocator_execute() has filled in their checksums. The superblock backup
+ * is left alone. Returns 0 on success, -1 on error.
+ */
+int migration_map_update(struct device *dev,
+                         const struct relocation_plan *plan);
+
 /*
  * Performs a full rollback using the written migration map.
- * Reads the footer from the end of the device, reverses all physical block
- * copies (from dst_offset back to src_offset), and finally restores the
- * primary Btrfs superblock.
+ * Reads the footer from the end of the device, verifies the CRC of every
+ * copy that has one (in parallel, before writing anything), reverses all
+ * physical block copies last to first (from dst_offset back to src_offset)
+ * with the relocation engine, and finally restores the primary Btrfs
+ * superblock.
  *
  * It erases the migration footer when successfully completed to prevent
  * accidental double-rollbacks.
@@ -0,0 +1,58 @@
+/*
+ * progress.h — Live progress of the long phases
+ *
+ * The loops doing a phase's work count it with progress_add(), one relaxed
+ * atomic add and nothing else. A reporter thread started by main() samples
+ * the counter every interval and works out the rate over the last interval,
+ * a smoothed rate and, when the phase's total is known, the time left. On
+ * a terminal it redraws one status line; to a file or pipe it writes a
+ * line every PROGRESS_LOG_INTERVAL_MS. It can also write every sample as
+ * one JSON object per line to a descriptor, for supervising tools.
+ *
+ * Without a reporter the counters still count and nothing is printed.
+ * progress_begin() and progress_end() are called by the thread driving the
+ * conversion; progress_add() from any thread.
+ */
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Sampling interval, and how often a non-terminal gets a line */
+#define PROGRESS_INTERVAL_MS 1000
+#define PROGRESS_LOG_INTERVAL_MS 10000
+
+/* Time constant of the smoothed rate the ETA is based on */
+#define PROGRESS_SMOOTH_SEC 10.0
+
+/*
+ * Start the reporter. `out` receives the human-readable status (NULL for
+ * none); `json_fd` the JSON records (-1 for none; SIGPIPE is ignored from
+ * then on so a reader going away cannot kill the conversion). interval_ms
+ * 0 selects PROGRESS_INTERVAL_MS. Returns 0, or -1 if the thread could not
+ * be created.
+ */
+int progress_start(FILE *out, int json_fd, uint32_t interval_ms);
+
+/* End the current phase, if any, and join the reporter */
+void progress_stop(void);
+
+/*
+ * Enter a phase, ending the previous one. `total` is the work it will do
+ * (0 = unknown: rate only, no ETA); `unit` names the items counted, or is
+ * NULL for bytes. Both strings must outlive the phase.
+ */
+void progress_begin(const char *phase, uint64_t total, const char *unit);
+
+/* Count `n` units of work done in the current phase */
+void progress_add(uint64_t n);
+
+/* Leave the current phase; prints its summary if the status was shown */
+void progress_end(void);
+
+/* Units counted so far in the current phase */
+uint64_t progress_done(void);
+
+#endif /* PROGRESS_H */
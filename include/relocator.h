@@ -11,6 +11,29 @@ struct device;
 struct ext4_layout;
 struct btrfs_fs_info;
 
+/* Read-ahead depth of relocator_execute() (buffers in the ring) */
+#define RELOCATOR_DEFAULT_DEPTH 4
+#define RELOCATOR_MAX_DEPTH 64
+
+/* Total bytes of ring buffers, split evenly across the depth */
+#define RELOCATOR_BUFFER_BUDGET (16ULL * 1024 * 1024)
+
+/* Buffers refilled per read batch: reads are issued in runs, not one by one */
+#define RELOCATOR_REFILL(depth) (((depth) + 1) / 2)
+
+/* relocation_entry.flags — legs of a move split through scratch space */
+#define RELOC_FLAG_SCRATCH_OUT 0x01 /* src → scratch; extents untouched */
+#define RELOC_FLAG_SCRATCH_IN 0x02  /* scratch → final dst of the move */
+/* checksum holds the CRC32C of the moved data (--verify-moves) */
+#define RELOC_FLAG_CHECKSUM 0x04
+/* PREALLOC space: the allocation moves, there is no data to copy */
+#define RELOC_FLAG_UNWRITTEN 0x08
+
+/* relocator_move(): a bigger ring than relocator_execute() by default,
+ * as rollback runs against the clock */
+#define RELOCATOR_MOVE_DEPTH RELOCATOR_MAX_DEPTH
+#define RELOCATOR_MOVE_BUDGET (64ULL * 1024 * 1024)
+
 /* A single relocation operation */
 struct relocation_entry {
   uint64_t src_offset; /* original physical byte offset */
@@ -19,6 +42,16 @@ struct relocation_entry {
   uint32_t checksum;   /* CRC32 of the data */
   uint32_t seq;        /* sequence number (for journal ordering) */
   uint8_t completed;   /* 1 when verified */
+  uint8_t flags;       /* RELOC_FLAG_* (fits in the struct's tail padding) */
+};
+
+/* Result of relocator_schedule(), for the dry-run report */
+struct reloc_schedule_stats {
+  uint64_t seek_before;   /* estimated head travel, bytes, planner order */
+  uint64_t seek_after;    /* estimated head travel, bytes, scheduled order */
+  uint32_t dependencies;  /* "read A before B overwrites it" edges */
+  uint32_t cycles_broken; /* moves split through scratch space */
+  uint64_t scratch_bytes; /* bytes staged through scratch */
 };
 
 /* Relocation plan */
@@ -27,8 +60,16 @@ struct relocation_plan {
   uint32_t count;
   uint32_t capacity;
   uint64_t total_bytes_to_move;
+  struct reloc_schedule_stats sched;
 };
 
+/*
+ * Scratch allocator for relocator_schedule(): returns the physical offset of
+ * `length` bytes of free space that no entry reads or writes, or
+ * (uint64_t)-1 if none is left.
+ */
+typedef uint64_t (*reloc_scratch_fn)(uint64_t length, void *arg);
+
 /*
  * Build the relocation plan: identify all data blocks that conflict
  * with ext4 metadata positions and find free destinations for them.
@@ -39,18 +80,82 @@ int relocator_plan(struct relocation_plan *plan,
                    const struct ext4_layout *layout,
                    struct btrfs_fs_info *fs_info);
 
+/*
+ * Reorder the plan for the disk head (called by relocator_plan()).
+ *
+ * Entries are treated as a parallel move: each one must read its source
+ * before any other entry overwrites it. The scheduler builds that
+ * dependency graph, emits ready entries in elevator (SCAN) order over
+ * their source offsets, and breaks cycles by first copying one member to
+ * scratch space. Entries are renumbered (seq) in execution order.
+ *
+ * `batch` is the read window assumed for seek_after (see
+ * relocator_seek_distance()). Returns 0 on success, -1 on error.
+ */
+int relocator_schedule(struct relocation_plan *plan, uint32_t batch,
+                       reloc_scratch_fn scratch, void *scratch_arg);
+
+/*
+ * Estimated head travel, in bytes, to execute `plan` in order when the
+ * executor reads `batch` entries back to back before writing them.
+ */
+uint64_t relocator_seek_distance(const struct relocation_plan *plan,
+                                 uint32_t batch);
+
 /*
  * Execute the relocation plan: move data blocks and update
  * the in-memory extent maps in fs_info.
  *
  * This is the most critical operation — it physically moves data.
- * Each move is journaled for crash recovery.
+ * Each move is journaled for crash recovery. Entries already flagged
+ * `completed` (a resumed run) are not copied again; only their extents
+ * are repointed.
  *
  * Returns 0 on success, -1 on error (partial moves are journaled).
  */
 int relocator_execute(struct relocation_plan *plan, struct device *dev,
                       struct btrfs_fs_info *fs_info, uint32_t block_size);
 
+/*
+ * Called by relocator_execute() as each entry's data has been written, in
+ * seq order. The write may still sit in the device cache.
+ */
+typedef void (*reloc_progress_fn)(const struct relocation_entry *entry,
+                                  void *arg);
+
+/* Install (or with NULL, remove) the progress hook */
+void relocator_set_progress_hook(reloc_progress_fn fn, void *arg);
+
+/*
+ * Set how many buffers relocator_execute() keeps in flight.
+ * 1 = strictly serial read → write; 0 = default.
+ */
+void relocator_set_pipeline_depth(uint32_t depth);
+
+/*
+ * By default relocator_execute() moves data with device_copy() when the
+ * kernel can keep it out of user space, and entries carry no checksum.
+ * With verify set the data always goes through the read pipeline and each
+ * entry gets the CRC32C of what was moved.
+ */
+void relocator_set_verify(int verify);
+
+/*
+ * Move the data of every entry not yet completed, in order, with the
+ * engine of relocator_execute() (kernel copies unless verification is on,
+ * else the read pipeline at RELOCATOR_MOVE_DEPTH) but without touching
+ * extents, the usage map or the journal. For rollback. Returns 0 or -1.
+ */
+int relocator_move(struct relocation_plan *plan, struct device *dev);
+
+/*
+ * Check every entry flagged RELOC_FLAG_CHECKSUM: read its source and
+ * compare the CRC32C, entries spread over `threads` workers (0 = one per
+ * CPU). Returns the number of mismatches, or -1 on a read error or OOM.
+ */
+int64_t relocator_verify(const struct relocation_plan *plan,
+                         struct device *dev, uint32_t threads);
+
 /*
  * Free relocation plan resources.
  */
@@ -18,27 +18,99 @@ struct thread_pool_wait_group {
   uint32_t pending_tasks;
 };
 
+/*
+ * Work-stealing pool.
+ *
+ * Every worker owns a bounded Chase-Lev deque: it pushes and pops at the
+ * bottom without locks, idle workers steal from the top with one CAS.
+ * Tasks submitted from outside the pool go through a bounded lock-free
+ * MPMC injection queue; tasks submitted from a worker (nested parallelism)
+ * go straight to that worker's deque. The only mutex left guards sleeping.
+ */
+
+/* Chase-Lev deque: slots are read racily by thieves, so every field is
+ * accessed with __atomic builtins */
+struct thread_pool_deque {
+  int64_t top; /* thieves CAS here */
+  char pad0[56];
+  int64_t bottom; /* owner only */
+  char pad1[56];
+  struct thread_task *slots;
+  uint32_t mask;
+};
+
+/* Vyukov bounded MPMC queue for external submissions */
+struct thread_pool_inject_cell {
+  uint64_t seq;
+  struct thread_task task;
+};
+
+struct thread_pool_inject {
+  uint64_t head; /* consumers */
+  char pad0[56];
+  uint64_t tail; /* producers */
+  char pad1[56];
+  struct thread_pool_inject_cell *cells;
+  uint32_t mask;
+};
+
+/* Counters for tuning; per worker, relaxed atomics */
+struct thread_pool_stats {
+  uint64_t tasks_run;       /* tasks executed by workers */
+  uint64_t tasks_stolen;    /* tasks taken from another worker's deque */
+  uint64_t steal_failures;  /* steal attempts that found nothing or lost */
+  uint64_t idle_sleeps;     /* times a worker blocked for lack of work */
+  uint64_t submit_rejected; /* submits refused because a queue was full */
+};
+
+struct thread_pool_worker {
+  struct thread_pool *pool;
+  struct thread_pool_deque deque;
+  uint32_t index;
+  uint64_t rng; /* victim selection */
+  struct thread_pool_stats stats;
+};
+
 struct thread_pool {
   pthread_t *threads;
   uint32_t num_threads;
-
-  struct thread_task *tasks;
   uint32_t queue_capacity;
-  uint32_t head;
-  uint32_t tail;
-  uint32_t count;
+
+  struct thread_pool_worker *workers;
+  struct thread_pool_inject inject;
+
+  uint64_t queued;   /* tasks enqueued but not yet taken */
+  uint32_t sleepers; /* workers blocked on `notify` */
+  uint64_t rejected;
 
   pthread_mutex_t lock;
   pthread_cond_t notify;
   int shutdown;
 };
 
+/*
+ * Worker count when none is given: online CPUs, narrowed by the affinity
+ * mask and by a cgroup (v2 cpu.max or v1 cfs quota) CPU limit.
+ */
+uint32_t thread_pool_default_threads(void);
+
+/*
+ * Create a pool. num_threads == 0 picks thread_pool_default_threads().
+ * queue_capacity bounds the injection queue and each worker deque (rounded
+ * up to a power of two).
+ */
 struct thread_pool *thread_pool_create(uint32_t num_threads,
                                        uint32_t queue_capacity);
+
+/* Returns -1 if the queue is full; callers then run the task inline. */
 int thread_pool_submit(struct thread_pool *pool, thread_task_fn fn, void *arg,
                        struct thread_pool_wait_group *wg);
 void thread_pool_destroy(struct thread_pool *pool);
 
+/* Snapshot of the counters, summed over all workers */
+void thread_pool_get_stats(const struct thread_pool *pool,
+                           struct thread_pool_stats *out);
+
 struct thread_pool_wait_group *thread_pool_wg_create(void);
 void thread_pool_wg_add(struct thread_pool_wait_group *wg, uint32_t count);
 void thread_pool_wg_done(struct thread_pool_wait_group *wg);
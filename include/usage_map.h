@@ -0,0 +1,75 @@
+/*
+ * usage_map.h — Device-wide map of the blocks Btrfs occupies
+ *
+ * Built once during Pass 1 while the extent tree streams past, then shared:
+ * the relocation planner carves its free space out of it, the relocator
+ * moves bits along with the data, and the ext4 allocator seeds its bitmap
+ * from it instead of walking every file extent again.
+ */
+
+#ifndef USAGE_MAP_H
+#define USAGE_MAP_H
+
+#include <stdint.h>
+
+/* Physical byte range [start, end) */
+struct usage_range {
+  uint64_t start;
+  uint64_t end;
+};
+
+struct usage_map {
+  uint64_t *bits;         /* one bit per granule, 1 = in use by Btrfs */
+  uint64_t granules;      /* bits in the map */
+  uint32_t granule;       /* bytes per bit (the Btrfs sectorsize) */
+  uint32_t granule_shift; /* log2(granule) */
+
+  /* Btrfs metadata, merged and sorted: in use until Pass 3 overwrites it,
+   * but never carried into the ext4 block bitmap */
+  struct usage_range *meta;
+  uint32_t meta_count;
+  uint32_t meta_capacity;
+
+  uint64_t items;  /* extents fed to the builder */
+  uint64_t ranges; /* ranges left after merging adjacent extents */
+};
+
+/*
+ * Allocate an empty map covering `device_size` bytes. `granule` must be a
+ * power of two (0 selects 4096). Returns 0 on success, -1 on OOM.
+ */
+int usage_map_init(struct usage_map *um, uint64_t device_size,
+                   uint32_t granule);
+
+void usage_map_free(struct usage_map *um);
+
+/* Mark [phys, phys + len) used or free; bytes past the map are ignored */
+void usage_map_set(struct usage_map *um, uint64_t phys, uint64_t len,
+                   int used);
+
+/*
+ * Mark [phys, phys + len) used and remember it as Btrfs metadata.
+ * Returns 0 on success, -1 on OOM.
+ */
+int usage_map_add_meta(struct usage_map *um, uint64_t phys, uint64_t len);
+
+/* Sort and merge the metadata list once the builder is done */
+void usage_map_finish(struct usage_map *um);
+
+/*
+ * Byte offset of the first granule at or after `phys` whose state equals
+ * `used`, or the end of the map (granules * granule) if there is none.
+ */
+uint64_t usage_map_next(const struct usage_map *um, uint64_t phys, int used);
+
+/* 1 if any byte of [phys, phys + len) is in use */
+int usage_map_test(const struct usage_map *um, uint64_t phys, uint64_t len);
+
+/*
+ * OR the blocks holding Btrfs data (metadata excluded) into a byte bitmap
+ * of `total_blocks` blocks of `block_size` bytes, bit b = block b.
+ */
+void usage_map_mark_data(const struct usage_map *um, uint8_t *bitmap,
+                         uint32_t block_size, uint64_t total_blocks);
+
+#endif /* USAGE_MAP_H */
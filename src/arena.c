@@ -0,0 +1,335 @@
+/*
+ * arena.c — Bump allocator and string pool for Pass 1 objects
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "mem_tracker.h"
+
+#define ARENA_ALIGN 16
+
+static inline size_t align_up(size_t n) {
+  return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+/* floor(log2(n)) for n > 0 */
+static inline unsigned size_class_floor(size_t n) {
+  return (unsigned)(sizeof(unsigned long long) * 8 - 1 -
+                    (unsigned)__builtin_clzll((unsigned long long)n));
+}
+
+/* ceil(log2(n)) for n > 0 */
+static inline unsigned size_class_ceil(size_t n) {
+  unsigned c = size_class_floor(n);
+  return ((size_t)1 << c) == n ? c : c + 1;
+}
+
+void arena_init(struct arena *a, size_t chunk_size) {
+  memset(a, 0, sizeof(*a));
+  a->chunk_size = chunk_size;
+}
+
+/* Map `bytes` (rounded up to pages) at the end of the spill file */
+static struct arena_chunk *arena_spill_map(struct arena_spill *s,
+                                           size_t bytes) {
+  long page = sysconf(_SC_PAGESIZE);
+  size_t pg = page > 0 ? (size_t)page : 4096;
+  size_t len = (bytes + pg - 1) & ~(pg - 1);
+
+  if (ftruncate(s->fd, (off_t)(s->file_size + len)) < 0)
+    return NULL;
+  void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd,
+                 (off_t)s->file_size);
+  if (p == MAP_FAILED)
+    return NULL; /* the next mapping reuses the grown tail */
+  s->file_size += len;
+
+  struct arena_chunk *c = p;
+  c->map_len = len;
+  return c;
+}
+
+/* A chunk of `bytes` bytes including its header: spilled past the budget */
+static struct arena_chunk *arena_chunk_alloc(struct arena *a, size_t bytes) {
+  struct arena_spill *s = a->spill;
+  struct arena_chunk *c = NULL;
+
+  /* Caches give memory back before Pass 1 objects go to disk */
+  mem_track_reclaim();
+
+  if (s && s->fd >= 0) {
+    pthread_mutex_lock(&s->lock);
+    if (s->resident + bytes > s->threshold || mem_track_exceeded())
+      c = arena_spill_map(s, bytes);
+    if (!c) {
+      c = malloc(bytes);
+      if (c) {
+        c->map_len = 0;
+        s->resident += bytes;
+      }
+    }
+    pthread_mutex_unlock(&s->lock);
+  } else {
+    c = malloc(bytes);
+    if (c)
+      c->map_len = 0;
+  }
+
+  if (c && !c->map_len)
+    mem_track_alloc_tag(MEM_TAG_PASS1, bytes);
+  return c;
+}
+
+static void arena_chunk_release(struct arena *a, struct arena_chunk *c) {
+  if (c->map_len) {
+    munmap(c, c->map_len);
+    return;
+  }
+  size_t bytes = sizeof(struct arena_chunk) + c->size;
+  mem_track_free_tag(MEM_TAG_PASS1, bytes);
+  struct arena_spill *s = a->spill;
+  if (s && s->fd >= 0) {
+    pthread_mutex_lock(&s->lock);
+    s->resident = s->resident > bytes ? s->resident - bytes : 0;
+    pthread_mutex_unlock(&s->lock);
+  }
+  free(c);
+}
+
+static struct arena_chunk *arena_new_chunk(struct arena *a, size_t min_size) {
+  size_t chunk_size = a->chunk_size ? a->chunk_size : ARENA_CHUNK_SIZE;
+  size_t size = min_size > chunk_size / 4 ? min_size : chunk_size;
+
+  struct arena_chunk *c =
+      arena_chunk_alloc(a, sizeof(struct arena_chunk) + size);
+  if (!c)
+    return NULL;
+  /* A mapping is rounded up to pages: the slack is usable too */
+  c->size = c->map_len ? c->map_len - sizeof(struct arena_chunk) : size;
+  c->used = 0;
+  a->reserved += sizeof(struct arena_chunk) + c->size;
+
+  if (size == chunk_size || !a->head) {
+    c->next = a->head;
+    a->head = c;
+  } else {
+    /* Oversized request: keep bumping the current chunk afterwards */
+    c->next = a->head->next;
+    a->head->next = c;
+  }
+  return c;
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+  if (size == 0)
+    size = 1;
+  size = align_up(size);
+
+  struct arena_chunk *c = a->head;
+  if (!c || c->size - c->used < size) {
+    c = arena_new_chunk(a, size);
+    if (!c) {
+      fprintf(stderr, "btrfs2ext4: OOM growing Pass 1 arena\n");
+      return NULL;
+    }
+  }
+
+  void *p = c->data + c->used;
+  c->used += size;
+  a->used += size;
+  memset(p, 0, size);
+  return p;
+}
+
+/* A recycled block of at least `size` bytes, or NULL */
+static void *arena_take_recycled(struct arena *a, size_t size) {
+  unsigned cls = size_class_ceil(size);
+  for (; cls < ARENA_SIZE_CLASSES; cls++) {
+    void *block = a->free_blocks[cls];
+    if (block) {
+      memcpy(&a->free_blocks[cls], block, sizeof(void *));
+      return block;
+    }
+  }
+  return NULL;
+}
+
+static void arena_recycle(struct arena *a, void *block, size_t size) {
+  size = align_up(size);
+  if (!block || size < sizeof(void *))
+    return;
+  unsigned cls = size_class_floor(size);
+  if (cls >= ARENA_SIZE_CLASSES)
+    return;
+  memcpy(block, &a->free_blocks[cls], sizeof(void *));
+  a->free_blocks[cls] = block;
+}
+
+void *arena_grow(struct arena *a, void *old, size_t old_size,
+                 size_t new_size) {
+  if (new_size <= old_size)
+    return old;
+
+  void *p = arena_take_recycled(a, align_up(new_size));
+  if (p) {
+    a->used += align_up(new_size);
+    memset(p, 0, new_size);
+  } else {
+    p = arena_alloc(a, new_size);
+    if (!p)
+      return NULL;
+  }
+
+  if (old_size > 0)
+    memcpy(p, old, old_size);
+  arena_recycle(a, old, old_size);
+  return p;
+}
+
+char *arena_strndup(struct arena *a, const char *s, size_t len) {
+  char *p = arena_alloc(a, len + 1);
+  if (p)
+    memcpy(p, s, len); /* terminator comes from the zeroed block */
+  return p;
+}
+
+void arena_adopt(struct arena *dst, struct arena *src) {
+  if (src->head) {
+    /* Keep dst's current chunk first so it goes on bumping */
+    struct arena_chunk *tail = src->head;
+    while (tail->next)
+      tail = tail->next;
+    if (dst->head) {
+      tail->next = dst->head->next;
+      dst->head->next = src->head;
+    } else {
+      dst->head = src->head;
+    }
+  }
+  dst->reserved += src->reserved;
+  dst->used += src->used;
+
+  /* src's recycled blocks now live in dst's chunks: keep them usable */
+  for (unsigned cls = 0; cls < ARENA_SIZE_CLASSES; cls++) {
+    void *block = src->free_blocks[cls];
+    while (block) {
+      void *next;
+      memcpy(&next, block, sizeof(void *));
+      memcpy(block, &dst->free_blocks[cls], sizeof(void *));
+      dst->free_blocks[cls] = block;
+      block = next;
+    }
+  }
+
+  size_t chunk_size = src->chunk_size;
+  struct arena_spill *spill = src->spill;
+  memset(src, 0, sizeof(*src));
+  src->chunk_size = chunk_size;
+  src->spill = spill;
+}
+
+void arena_free(struct arena *a) {
+  struct arena_chunk *c = a->head;
+  while (c) {
+    struct arena_chunk *next = c->next;
+    arena_chunk_release(a, c);
+    c = next;
+  }
+  size_t chunk_size = a->chunk_size;
+  struct arena_spill *spill = a->spill;
+  memset(a, 0, sizeof(*a));
+  a->chunk_size = chunk_size;
+  a->spill = spill;
+}
+
+/* ========================================================================
+ * Spill file
+ * ======================================================================== */
+
+int arena_spill_open(struct arena_spill *s, const char *workdir,
+                     uint64_t threshold) {
+  memset(s, 0, sizeof(*s));
+  s->fd = -1;
+
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/.btrfs2ext4.tmp.pass1",
+           workdir ? workdir : ".");
+  unlink(path);
+  int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                0600);
+  if (fd < 0)
+    return -1;
+  unlink(path); /* nothing to clean up after a crash */
+
+  if (pthread_mutex_init(&s->lock, NULL) != 0) {
+    close(fd);
+    errno = ENOMEM;
+    return -1;
+  }
+  s->fd = fd;
+  s->threshold = threshold;
+  return 0;
+}
+
+void arena_spill_close(struct arena_spill *s) {
+  if (s->fd < 0)
+    return;
+  close(s->fd);
+  pthread_mutex_destroy(&s->lock);
+  s->fd = -1;
+}
+
+/* ========================================================================
+ * String pool
+ * ======================================================================== */
+
+static int str_pool_reserve(struct str_pool *p, uint64_t need) {
+  if (need <= p->capacity)
+    return 0;
+  uint64_t new_cap = p->capacity ? p->capacity * 2 : 64 * 1024;
+  while (new_cap < need)
+    new_cap *= 2;
+  char *grown = realloc(p->buf, new_cap);
+  if (!grown) {
+    fprintf(stderr, "btrfs2ext4: OOM growing name pool\n");
+    return -1;
+  }
+  mem_track_alloc_tag(MEM_TAG_PASS1, new_cap - p->capacity);
+  p->buf = grown;
+  p->capacity = new_cap;
+  return 0;
+}
+
+uint64_t str_pool_add(struct str_pool *p, const char *s, size_t len) {
+  if (str_pool_reserve(p, p->len + len + 1) < 0)
+    return STR_POOL_INVALID;
+  uint64_t off = p->len;
+  memcpy(p->buf + off, s, len);
+  p->buf[off + len] = '\0';
+  p->len += len + 1;
+  return off;
+}
+
+uint64_t str_pool_append(struct str_pool *dst, const struct str_pool *src) {
+  uint64_t base = dst->len;
+  if (src->len == 0)
+    return base;
+  if (str_pool_reserve(dst, dst->len + src->len) < 0)
+    return STR_POOL_INVALID;
+  memcpy(dst->buf + base, src->buf, src->len);
+  dst->len += src->len;
+  return base;
+}
+
+void str_pool_free(struct str_pool *p) {
+  mem_track_free_tag(MEM_TAG_PASS1, p->capacity);
+  free(p->buf);
+  memset(p, 0, sizeof(*p));
+}
@@ -1,82 +1,197 @@
 /*
  * bloom.c — Bloom filter for HDD thrashing prevention
  *
- * A probabilistic data structure that uses minimal RAM (~2MB for 1M items)
+ * A probabilistic data structure that uses minimal RAM (~1.3MB for 1M items)
  * to quickly reject non-existent inode lookups, avoiding useless disk seeks
  * when the inode hash table is paged to disk via mmap().
  *
- * False positive rate: ~1% with k=7 hash functions and 10 bits per element.
+ * The filter is blocked: one hash picks a 64-byte, cache-line aligned block
+ * and all k bits of a key live inside it, so a lookup costs one cache miss
+ * instead of k. The k bit positions are turned into a 512-bit mask and the
+ * block is tested against it with a few SIMD instructions.
+ *
+ * Sized from a target false positive rate (1% by default); confining the
+ * bits to one block costs about 10% more memory than a classic filter for
+ * the same rate.
  */
 
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "btrfs/btrfs_reader.h"
+#include "mem_tracker.h"
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#elif defined(__x86_64__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#define BLOOM_BLOCK_BITS (BLOOM_BLOCK_WORDS * 64)
+#define BLOOM_MAX_BYTES (512ULL * 1024 * 1024)
+#define BLOOM_MAX_HASHES 16
+
+/* Keys looked up ahead of the one being tested by bloom_test_batch() */
+#define BLOOM_PREFETCH 8
 
-/* Knuth-style multiplicative hash variants with distinct salts */
-static const uint64_t BLOOM_SALTS[8] = {
-    0x9e3779b97f4a7c15ULL, 0x517cc1b727220a95ULL, 0x6c62272e07bb0142ULL,
-    0xe08c1d668b756f82ULL, 0x9fa4abaf1a1c97c8ULL, 0xc10f9b301a2dbfa2ULL,
-    0xdb3cc3340f1a9425ULL, 0x93301a1c435520b2ULL};
-
-static inline uint64_t bloom_hash(uint64_t key, uint32_t seed) {
-  key ^= BLOOM_SALTS[seed % 8];
-  key *= 0x517cc1b727220a95ULL;
-  key ^= key >> 32;
-  key *= 0x6c62272e07bb0142ULL;
-  key ^= key >> 32;
+/* Blocking penalty: extra bits per key for the same false positive rate */
+#define BLOOM_BLOCK_OVERHEAD 1.1
+
+static inline uint64_t bloom_hash(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
   return key;
 }
 
-int bloom_init(struct bloom_filter *bf, uint64_t expected_items) {
-  if (!bf || expected_items == 0)
-    return -1;
+/* Block for hash h: high 32 bits scaled onto [0, num_blocks), which
+ * BLOOM_MAX_BYTES keeps below 2^32 */
+static inline const uint64_t *bloom_block(const struct bloom_filter *bf,
+                                          uint64_t h) {
+  uint64_t b = ((h >> 32) * bf->num_blocks) >> 32;
+  return bf->blocks + b * BLOOM_BLOCK_WORDS;
+}
 
-  /* 10 bits per element → ~1% false positive rate */
-  if (expected_items > UINT64_MAX / 10) {
-    bf->size_bits = (uint64_t)512 * 1024 * 1024 * 8; /* 512 MiB of bits */
-  } else {
-    bf->size_bits = expected_items * 10;
+/*
+ * The k bit positions of a key inside its block, by double hashing on the
+ * low bits of h (independent of the block choice). An odd stride keeps the
+ * positions distinct.
+ */
+static inline void bloom_mask(const struct bloom_filter *bf, uint64_t h,
+                              uint64_t *mask) {
+  uint64_t g = h * 0x9e3779b97f4a7c15ULL;
+  uint32_t pos = (uint32_t)(g >> 32);
+  uint32_t step = (uint32_t)g | 1;
+  memset(mask, 0, BLOOM_BLOCK_WORDS * sizeof(uint64_t));
+  for (uint32_t i = 0; i < bf->num_hashes; i++) {
+    uint32_t bit = pos & (BLOOM_BLOCK_BITS - 1);
+    mask[bit >> 6] |= 1ULL << (bit & 63);
+    pos += step;
   }
+}
 
-  if (bf->size_bits < 1024)
-    bf->size_bits = 1024;
+/* 1 if every bit of mask is set in blk */
+static inline int bloom_block_has(const uint64_t *blk, const uint64_t *mask) {
+#if defined(__AVX2__)
+  const __m256i *b = (const __m256i *)blk;
+  const __m256i *m = (const __m256i *)mask;
+  return _mm256_testc_si256(_mm256_load_si256(b), _mm256_load_si256(m)) &
+         _mm256_testc_si256(_mm256_load_si256(b + 1),
+                            _mm256_load_si256(m + 1));
+#elif defined(__SSE4_1__) || defined(__x86_64__)
+  const __m128i *b = (const __m128i *)blk;
+  const __m128i *m = (const __m128i *)mask;
+  __m128i miss = _mm_setzero_si128();
+  for (int i = 0; i < 4; i++)
+    miss = _mm_or_si128(miss, _mm_andnot_si128(_mm_load_si128(b + i),
+                                               _mm_load_si128(m + i)));
+#if defined(__SSE4_1__)
+  return _mm_testz_si128(miss, miss);
+#else
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(miss, _mm_setzero_si128())) ==
+         0xFFFF;
+#endif
+#elif defined(__aarch64__)
+  uint64x2_t miss = vdupq_n_u64(0);
+  for (int i = 0; i < 4; i++)
+    miss = vorrq_u64(miss, vbicq_u64(vld1q_u64(mask + 2 * i),
+                                     vld1q_u64(blk + 2 * i)));
+  return (vgetq_lane_u64(miss, 0) | vgetq_lane_u64(miss, 1)) == 0;
+#else
+  uint64_t miss = 0;
+  for (int i = 0; i < BLOOM_BLOCK_WORDS; i++)
+    miss |= mask[i] & ~blk[i];
+  return miss == 0;
+#endif
+}
 
-  /* Round up to full bytes */
-  uint64_t byte_count = (bf->size_bits + 7) / 8;
-  if (byte_count > 512ULL * 1024 * 1024) {
-    byte_count = 512ULL * 1024 * 1024;
-    bf->size_bits = byte_count * 8;
-  }
+int bloom_init_fpr(struct bloom_filter *bf, uint64_t expected_items,
+                   double fpr) {
+  if (!bf || expected_items == 0 || !(fpr > 0.0 && fpr < 1.0))
+    return -1;
+  memset(bf, 0, sizeof(*bf));
+
+  /* Classic sizing: m/n = -ln(p) / ln(2)^2, k = m/n * ln(2) */
+  double bits_per_item = -log(fpr) / (M_LN2 * M_LN2);
+  double k = round(bits_per_item * M_LN2);
+  bf->num_hashes = k < 1 ? 1 : k > BLOOM_MAX_HASHES ? BLOOM_MAX_HASHES
+                                                    : (uint32_t)k;
 
-  bf->bits = calloc(1, byte_count);
-  if (!bf->bits)
+  double bits = bits_per_item * BLOOM_BLOCK_OVERHEAD * (double)expected_items;
+  uint64_t blocks = bits >= (double)(BLOOM_MAX_BYTES * 8)
+                        ? BLOOM_MAX_BYTES / 64
+                        : (uint64_t)(bits / BLOOM_BLOCK_BITS) + 1;
+  if (blocks < 2)
+    blocks = 2;
+
+  size_t bytes = (size_t)blocks * 64;
+  void *mem = NULL;
+  if (posix_memalign(&mem, 64, bytes) != 0)
     return -1;
+  memset(mem, 0, bytes);
+  mem_track_alloc_tag(MEM_TAG_BLOOM, bytes);
 
-  bf->num_hashes = 7; /* optimal k for 10 bits/element */
+  bf->blocks = mem;
+  bf->num_blocks = blocks;
   return 0;
 }
 
+int bloom_init(struct bloom_filter *bf, uint64_t expected_items) {
+  return bloom_init_fpr(bf, expected_items, BLOOM_DEFAULT_FPR);
+}
+
 void bloom_add(struct bloom_filter *bf, uint64_t key) {
-  for (uint32_t i = 0; i < bf->num_hashes; i++) {
-    uint64_t h = bloom_hash(key, i) % bf->size_bits;
-    bf->bits[h / 8] |= (1 << (h % 8));
-  }
+  uint64_t h = bloom_hash(key);
+  uint64_t *blk = (uint64_t *)bloom_block(bf, h);
+  _Alignas(64) uint64_t mask[BLOOM_BLOCK_WORDS];
+  bloom_mask(bf, h, mask);
+  for (int i = 0; i < BLOOM_BLOCK_WORDS; i++)
+    blk[i] |= mask[i];
 }
 
 int bloom_test(const struct bloom_filter *bf, uint64_t key) {
-  for (uint32_t i = 0; i < bf->num_hashes; i++) {
-    uint64_t h = bloom_hash(key, i) % bf->size_bits;
-    if (!(bf->bits[h / 8] & (1 << (h % 8))))
-      return 0; /* definitely not present */
+  uint64_t h = bloom_hash(key);
+  _Alignas(64) uint64_t mask[BLOOM_BLOCK_WORDS];
+  bloom_mask(bf, h, mask);
+  return bloom_block_has(bloom_block(bf, h), mask);
+}
+
+uint32_t bloom_test_batch(const struct bloom_filter *bf, const uint64_t *keys,
+                          uint32_t n, uint8_t *out) {
+  uint64_t hashes[BLOOM_PREFETCH];
+  uint32_t hits = 0;
+
+  /* Keep BLOOM_PREFETCH blocks in flight so their misses overlap */
+  for (uint32_t i = 0; i < n && i < BLOOM_PREFETCH; i++) {
+    hashes[i] = bloom_hash(keys[i]);
+    __builtin_prefetch(bloom_block(bf, hashes[i]));
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    uint64_t h = hashes[i % BLOOM_PREFETCH];
+    if (i + BLOOM_PREFETCH < n) {
+      uint64_t next = bloom_hash(keys[i + BLOOM_PREFETCH]);
+      hashes[i % BLOOM_PREFETCH] = next;
+      __builtin_prefetch(bloom_block(bf, next));
+    }
+    _Alignas(64) uint64_t mask[BLOOM_BLOCK_WORDS];
+    bloom_mask(bf, h, mask);
+    out[i] = (uint8_t)bloom_block_has(bloom_block(bf, h), mask);
+    hits += out[i];
   }
-  return 1; /* probably present */
+  return hits;
 }
 
 void bloom_free(struct bloom_filter *bf) {
   if (bf) {
-    free(bf->bits);
-    bf->bits = NULL;
-    bf->size_bits = 0;
+    if (bf->blocks)
+      mem_track_free_tag(MEM_TAG_BLOOM, bf->num_blocks * 64);
+    free(bf->blocks);
+    bf->blocks = NULL;
+    bf->num_blocks = 0;
   }
 }
@@ -11,25 +11,205 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "btrfs/btree.h"
 #include "btrfs/btrfs_structures.h"
 #include "btrfs/checksum.h"
 #include "btrfs/chunk_tree.h"
+#include "btrfs/node_cache.h"
 #include "device_io.h"
+#include "io_stats.h"
+#include "progress.h"
+#include "thread_pool.h"
+
+/* Verify a node's checksum using proper btrfs logic */
+static int btree_csum_ok(uint32_t nodesize, uint16_t csum_type,
+                         const uint8_t *node_buf) {
+  const struct btrfs_header *hdr = (const struct btrfs_header *)node_buf;
+  return btrfs_verify_checksum(csum_type, hdr->csum,
+                               (const uint8_t *)hdr + BTRFS_CSUM_SIZE,
+                               nodesize - BTRFS_CSUM_SIZE) == 0;
+}
 
 /*
- * Callback type for B-tree leaf item processing.
- * Called for each item in each leaf node.
- *
- * Parameters:
- *   key       - the item's key
- *   data      - pointer to the item's data
- *   data_size - size of the item's data
- *   ctx       - user context
- *
- * Return 0 to continue iteration, non-zero to stop.
+ * Resolve logical → physical, reporting unmapped nodes. Of the copies of
+ * a DUP chunk the one nearest `pos` is chosen.
+ */
+static uint64_t btree_resolve_node(const struct chunk_map *chunk_map,
+                                   uint64_t node_logical, uint64_t pos) {
+  uint64_t node_physical =
+      chunk_map_resolve_near(chunk_map, node_logical, pos, NULL);
+  if (node_physical == (uint64_t)-1) {
+    fprintf(stderr,
+            "btrfs2ext4: cannot resolve btree node at logical 0x%lx\n",
+            (unsigned long)node_logical);
+  }
+  return node_physical;
+}
+
+/*
+ * The copy at `bad` failed to read or verify: try the node's other copies.
+ * Returns 0 with a verified node in node_buf, -1 (reported) when no copy
+ * is good.
  */
-typedef int (*btree_callback)(const struct btrfs_disk_key *key,
-                              const void *data, uint32_t data_size, void *ctx);
+static int btree_fetch_other_copy(struct device *dev,
+                                  const struct chunk_map *chunk_map,
+                                  uint64_t node_logical, uint64_t bad,
+                                  uint32_t nodesize, uint16_t csum_type,
+                                  uint8_t *node_buf) {
+  uint64_t phys;
+  for (uint32_t copy = 0; (phys = chunk_map_resolve_copy(
+                               chunk_map, node_logical, copy)) != (uint64_t)-1;
+       copy++) {
+    if (phys == bad)
+      continue;
+    if (device_read(dev, phys, node_buf, nodesize) == 0 &&
+        btree_csum_ok(nodesize, csum_type, node_buf)) {
+      fprintf(stderr,
+              "btrfs2ext4: btree node 0x%lx: copy at 0x%lx bad, using copy "
+              "%u\n",
+              (unsigned long)node_logical, (unsigned long)bad, copy);
+      return 0;
+    }
+  }
+
+  fprintf(stderr,
+          "btrfs2ext4: btree node checksum mismatch at logical 0x%lx "
+          "(algorithm: %s)\n",
+          (unsigned long)node_logical, btrfs_csum_name(csum_type));
+  return -1;
+}
+
+/*
+ * Read a node from disk and verify its checksum. The copy nearest the end
+ * of this thread's last request is read; if it is unreadable or corrupt,
+ * the other copy of a DUP chunk is.
+ */
+static int btree_fetch_node(struct device *dev,
+                            const struct chunk_map *chunk_map,
+                            uint64_t node_logical, uint32_t nodesize,
+                            uint16_t csum_type, uint8_t *node_buf) {
+  uint64_t node_physical =
+      btree_resolve_node(chunk_map, node_logical, io_stats_last_offset());
+  if (node_physical == (uint64_t)-1)
+    return -1;
+
+  if (device_read(dev, node_physical, node_buf, nodesize) == 0 &&
+      btree_csum_ok(nodesize, csum_type, node_buf))
+    return 0;
+  return btree_fetch_other_copy(dev, chunk_map, node_logical, node_physical,
+                                nodesize, csum_type, node_buf);
+}
+
+/* Check that a node is the one its parent pointed at, at the right level */
+static int btree_check_header(const uint8_t *node_buf, uint64_t node_logical,
+                              uint8_t expected_level) {
+  const struct btrfs_header *hdr = (const struct btrfs_header *)node_buf;
+  uint8_t level = hdr->level;
+
+  uint64_t bytenr = le64toh(hdr->bytenr);
+  if (bytenr != node_logical) {
+    fprintf(
+        stderr,
+        "btrfs2ext4: btree node bytenr mismatch: expected 0x%lx, got 0x%lx\n",
+        (unsigned long)node_logical, (unsigned long)bytenr);
+    return -1;
+  }
+
+  if (level != expected_level) {
+    fprintf(stderr,
+            "btrfs2ext4: btree node level mismatch/cycle detected: expected "
+            "%u, got %u at 0x%lx\n",
+            expected_level, level, (unsigned long)node_logical);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Read a node and validate checksum, bytenr and level.
+ * Nodes come from the shared node cache when present; those were already
+ * checksummed when they were inserted, so only the header is checked.
+ * Returns 0 on success, -1 on error (already reported).
+ */
+static int btree_read_node(struct device *dev,
+                           const struct chunk_map *chunk_map,
+                           uint64_t node_logical, uint8_t expected_level,
+                           uint32_t nodesize, uint16_t csum_type,
+                           uint8_t *node_buf) {
+  int cached = node_cache_lookup(node_logical, node_buf);
+  if (!cached &&
+      btree_fetch_node(dev, chunk_map, node_logical, nodesize, csum_type,
+                       node_buf) < 0)
+    return -1;
+
+  if (btree_check_header(node_buf, node_logical, expected_level) < 0)
+    return -1;
+
+  if (!cached)
+    node_cache_insert(node_logical, node_buf, expected_level);
+  progress_add(nodesize);
+  return 0;
+}
+
+/*
+ * Issue readahead hints for all children of an internal node (#12).
+ * The kernel will start prefetching these nodes in parallel.
+ */
+static void btree_prefetch_children(struct device *dev,
+                                    const struct chunk_map *chunk_map,
+                                    const uint8_t *node_buf,
+                                    uint32_t nodesize) {
+  const struct btrfs_header *hdr = (const struct btrfs_header *)node_buf;
+  uint32_t nritems = le32toh(hdr->nritems);
+  const struct btrfs_key_ptr *ptrs =
+      (const struct btrfs_key_ptr *)(node_buf + sizeof(struct btrfs_header));
+
+  /* The copies btree_fetch_node() will pick, just after reading the parent */
+  uint64_t pos = io_stats_last_offset();
+  for (uint32_t i = 0; i < nritems; i++) {
+    uint64_t child_logical = le64toh(ptrs[i].blockptr);
+    uint64_t child_physical =
+        chunk_map_resolve_near(chunk_map, child_logical, pos, NULL);
+    if (child_physical != (uint64_t)-1) {
+      posix_fadvise(dev->fd, (off_t)child_physical, nodesize,
+                    POSIX_FADV_WILLNEED);
+    }
+  }
+}
+
+/*
+ * Hand every item of a leaf to the callback.
+ * Returns non-zero when the callback asked to stop.
+ */
+static int btree_leaf_items(const uint8_t *node_buf, uint64_t node_logical,
+                            uint32_t nritems, uint32_t nodesize,
+                            btree_callback callback, void *ctx) {
+  const struct btrfs_item *items =
+      (const struct btrfs_item *)(node_buf + sizeof(struct btrfs_header));
+
+  for (uint32_t i = 0; i < nritems; i++) {
+    uint32_t data_offset = le32toh(items[i].offset);
+    uint32_t data_size = le32toh(items[i].size);
+
+    /* Data is stored at end of leaf, offset from byte 0x65 (header size) */
+    const void *data = node_buf + sizeof(struct btrfs_header) + data_offset;
+
+    /* Safety check */
+    if ((uint64_t)sizeof(struct btrfs_header) + data_offset + data_size >
+        nodesize) {
+      fprintf(stderr,
+              "btrfs2ext4: btree item data out of bounds in node 0x%lx\n",
+              (unsigned long)node_logical);
+      continue; /* Skip malformed item */
+    }
+
+    int cb_ret = callback(&items[i].key, data, data_size, ctx);
+    if (cb_ret != 0)
+      return cb_ret;
+  }
+  return 0;
+}
 
 /*
  * Walk a btrfs B-tree, calling the callback for each leaf item.
@@ -97,18 +277,8 @@ int btree_walk(struct device *dev, const struct chunk_map *chunk_map,
     uint64_t node_logical = stack[stack_top].logical;
     uint8_t expected_level = stack[stack_top].level;
 
-    /* Resolve logical → physical */
-    uint64_t node_physical = chunk_map_resolve(chunk_map, node_logical);
-    if (node_physical == (uint64_t)-1) {
-      fprintf(stderr,
-              "btrfs2ext4: cannot resolve btree node at logical 0x%lx\n",
-              (unsigned long)node_logical);
-      ret = -1;
-      break;
-    }
-
-    /* Read the node */
-    if (device_read(dev, node_physical, node_buf, nodesize) < 0) {
+    if (btree_read_node(dev, chunk_map, node_logical, expected_level,
+                        nodesize, csum_type, node_buf) < 0) {
       ret = -1;
       break;
     }
@@ -117,55 +287,13 @@ int btree_walk(struct device *dev, const struct chunk_map *chunk_map,
     uint32_t nritems = le32toh(hdr->nritems);
     uint8_t level = hdr->level;
 
-    /* Validate header */
-    /* Check node checksum using proper btrfs logic */
-    if (btrfs_verify_checksum(csum_type, hdr->csum,
-                              (const uint8_t *)hdr + BTRFS_CSUM_SIZE,
-                              nodesize - BTRFS_CSUM_SIZE) != 0) {
-      fprintf(stderr,
-              "btrfs2ext4: btree node checksum mismatch at logical 0x%lx "
-              "(algorithm: %s)\n",
-              (unsigned long)node_logical, btrfs_csum_name(csum_type));
-      ret = -1;
-      break;
-    }
-
-    /* Validate header */
-    uint64_t bytenr = le64toh(hdr->bytenr);
-    if (bytenr != node_logical) {
-      fprintf(
-          stderr,
-          "btrfs2ext4: btree node bytenr mismatch: expected 0x%lx, got 0x%lx\n",
-          (unsigned long)node_logical, (unsigned long)bytenr);
-      ret = -1;
-      break;
-    }
-
-    if (level != expected_level) {
-      fprintf(stderr,
-              "btrfs2ext4: btree node level mismatch/cycle detected: expected "
-              "%u, got %u at 0x%lx\n",
-              expected_level, level, (unsigned long)node_logical);
-      ret = -1;
-      break;
-    }
-
     if (level > 0) {
       /* Internal node: push children (in reverse order for DFS) */
       const struct btrfs_key_ptr *ptrs =
           (const struct btrfs_key_ptr *)(node_buf +
                                          sizeof(struct btrfs_header));
 
-      /* Issue readahead hints for all children before descending (#12).
-       * The kernel will start prefetching these nodes in parallel. */
-      for (uint32_t i = 0; i < nritems; i++) {
-        uint64_t child_logical = le64toh(ptrs[i].blockptr);
-        uint64_t child_physical = chunk_map_resolve(chunk_map, child_logical);
-        if (child_physical != (uint64_t)-1) {
-          posix_fadvise(dev->fd, (off_t)child_physical, nodesize,
-                        POSIX_FADV_WILLNEED);
-        }
-      }
+      btree_prefetch_children(dev, chunk_map, node_buf, nodesize);
 
       for (int i = (int)nritems - 1; i >= 0; i--) {
         /* Bug L fix: Grow stack dynamically instead of hard-failing at 8192 */
@@ -187,36 +315,447 @@ int btree_walk(struct device *dev, const struct chunk_map *chunk_map,
       }
     } else {
       /* Leaf node: process items */
-      const struct btrfs_item *items =
-          (const struct btrfs_item *)(node_buf + sizeof(struct btrfs_header));
+      if (btree_leaf_items(node_buf, node_logical, nritems, nodesize, callback,
+                           ctx) != 0)
+        goto done; /* Callback requested stop (not an error) */
+    }
+  }
+
+done:
+  free(node_buf);
+  free(stack);
+  return ret;
+}
+
+/* ========================================================================
+ * Parallel subtree walk
+ * ======================================================================== */
+
+struct btree_subtree {
+  uint64_t logical;
+  uint8_t level;
+};
+
+struct btree_walk_shared {
+  struct device *dev;
+  const struct chunk_map *chunk_map;
+  uint32_t nodesize;
+  uint16_t csum_type;
+  btree_callback callback;
+  int stop; /* set once any subtree fails or its callback asks to stop */
+};
 
+struct btree_subtree_task {
+  struct btree_walk_shared *shared;
+  struct btree_subtree subtree;
+  void *ctx;
+  int status;
+};
+
+/* Forwards items to the user callback until some subtree requests a stop */
+static int btree_subtree_callback(const struct btrfs_disk_key *key,
+                                  const void *data, uint32_t data_size,
+                                  void *ctx) {
+  struct btree_subtree_task *task = (struct btree_subtree_task *)ctx;
+  struct btree_walk_shared *shared = task->shared;
+
+  if (__atomic_load_n(&shared->stop, __ATOMIC_RELAXED))
+    return 1;
+
+  int cb_ret = shared->callback(key, data, data_size, task->ctx);
+  if (cb_ret != 0)
+    __atomic_store_n(&shared->stop, 1, __ATOMIC_RELAXED);
+  return cb_ret;
+}
+
+static void btree_subtree_worker(void *arg) {
+  struct btree_subtree_task *task = (struct btree_subtree_task *)arg;
+  struct btree_walk_shared *shared = task->shared;
+
+  if (__atomic_load_n(&shared->stop, __ATOMIC_RELAXED)) {
+    task->status = 0;
+    return;
+  }
+
+  task->status =
+      btree_walk(shared->dev, shared->chunk_map, task->subtree.logical,
+                 task->subtree.level, shared->nodesize, shared->csum_type,
+                 btree_subtree_callback, task);
+  if (task->status < 0)
+    __atomic_store_n(&shared->stop, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Expand internal nodes level by level (in key order) until the frontier
+ * reaches `split_level`, or until it holds at least `target` subtrees when
+ * the split level is automatic. Returns the frontier size, -1 on error.
+ */
+static int btree_collect_subtrees(struct device *dev,
+                                  const struct chunk_map *chunk_map,
+                                  uint64_t root_logical, uint8_t root_level,
+                                  uint32_t nodesize, uint16_t csum_type,
+                                  uint8_t split_level, uint32_t target,
+                                  struct btree_subtree **out) {
+  uint32_t count = 1;
+  struct btree_subtree *frontier = malloc(sizeof(struct btree_subtree));
+  uint8_t *node_buf = malloc(nodesize);
+  if (!frontier || !node_buf) {
+    fprintf(stderr, "btrfs2ext4: out of memory for btree subtree list\n");
+    free(frontier);
+    free(node_buf);
+    return -1;
+  }
+  frontier[0].logical = root_logical;
+  frontier[0].level = root_level;
+
+  uint32_t max_ptrs = (nodesize - (uint32_t)sizeof(struct btrfs_header)) /
+                      (uint32_t)sizeof(struct btrfs_key_ptr);
+  uint8_t level = root_level;
+
+  while (level > 0 && (split_level == BTREE_SPLIT_AUTO ? count < target
+                                                        : level > split_level)) {
+    struct btree_subtree *next = NULL;
+    uint32_t next_count = 0;
+    uint32_t next_cap = 0;
+    int failed = 0;
+
+    for (uint32_t n = 0; n < count; n++) {
+      if (btree_read_node(dev, chunk_map, frontier[n].logical, level, nodesize,
+                          csum_type, node_buf) < 0) {
+        failed = 1;
+        break;
+      }
+
+      const struct btrfs_header *hdr = (const struct btrfs_header *)node_buf;
+      uint32_t nritems = le32toh(hdr->nritems);
+      if (nritems > max_ptrs) {
+        fprintf(stderr,
+                "btrfs2ext4: btree node 0x%lx claims %u pointers (max %u)\n",
+                (unsigned long)frontier[n].logical, nritems, max_ptrs);
+        failed = 1;
+        break;
+      }
+
+      btree_prefetch_children(dev, chunk_map, node_buf, nodesize);
+
+      if (next_count + nritems > next_cap) {
+        uint32_t new_cap = next_cap ? next_cap : 256;
+        while (new_cap < next_count + nritems)
+          new_cap *= 2;
+        struct btree_subtree *grown =
+            realloc(next, new_cap * sizeof(struct btree_subtree));
+        if (!grown) {
+          fprintf(stderr, "btrfs2ext4: btree subtree list realloc failed\n");
+          failed = 1;
+          break;
+        }
+        next = grown;
+        next_cap = new_cap;
+      }
+
+      const struct btrfs_key_ptr *ptrs =
+          (const struct btrfs_key_ptr *)(node_buf +
+                                         sizeof(struct btrfs_header));
       for (uint32_t i = 0; i < nritems; i++) {
-        uint32_t data_offset = le32toh(items[i].offset);
-        uint32_t data_size = le32toh(items[i].size);
-
-        /* Data is stored at end of leaf, offset from byte 0x65 (header size) */
-        const void *data = node_buf + sizeof(struct btrfs_header) + data_offset;
-
-        /* Safety check */
-        if ((uint64_t)sizeof(struct btrfs_header) + data_offset + data_size >
-            nodesize) {
-          fprintf(stderr,
-                  "btrfs2ext4: btree item data out of bounds in node 0x%lx\n",
-                  (unsigned long)node_logical);
-          continue; /* Skip malformed item */
+        next[next_count].logical = le64toh(ptrs[i].blockptr);
+        next[next_count].level = level - 1;
+        next_count++;
+      }
+    }
+
+    if (failed) {
+      free(next);
+      free(frontier);
+      free(node_buf);
+      return -1;
+    }
+
+    free(frontier);
+    frontier = next;
+    count = next_count;
+    level--;
+
+    /* An internal node with no children leaves nothing to walk */
+    if (count == 0)
+      break;
+  }
+
+  free(node_buf);
+  *out = frontier;
+  return (int)count;
+}
+
+int btree_walk_parallel(struct device *dev, const struct chunk_map *chunk_map,
+                        uint64_t root_logical, uint8_t root_level,
+                        uint32_t nodesize, uint16_t csum_type,
+                        uint8_t split_level, uint32_t num_threads,
+                        btree_callback callback, btree_shard_fn new_shard,
+                        void *shard_arg) {
+  if (root_level > 8) {
+    fprintf(stderr,
+            "btrfs2ext4: FATAL: tree root level %u is absurdly high "
+            "(malicious/corrupt tree?)\n",
+            root_level);
+    return -1;
+  }
+  if (num_threads == 0)
+    num_threads = 1;
+
+  posix_fadvise(dev->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  struct btree_subtree *subtrees = NULL;
+  int count = btree_collect_subtrees(
+      dev, chunk_map, root_logical, root_level, nodesize, csum_type,
+      split_level, num_threads * BTREE_SUBTREES_PER_THREAD, &subtrees);
+  if (count < 0)
+    return -1;
+  if (count == 0) {
+    /* Empty tree: still hand out one shard so callers can merge uniformly */
+    free(subtrees);
+    return new_shard(0, shard_arg) ? 1 : -1;
+  }
+
+  struct btree_subtree_task *tasks =
+      calloc((size_t)count, sizeof(struct btree_subtree_task));
+  if (!tasks) {
+    fprintf(stderr, "btrfs2ext4: out of memory for btree subtree tasks\n");
+    free(subtrees);
+    return -1;
+  }
+
+  struct btree_walk_shared shared;
+  memset(&shared, 0, sizeof(shared));
+  shared.dev = dev;
+  shared.chunk_map = chunk_map;
+  shared.nodesize = nodesize;
+  shared.csum_type = csum_type;
+  shared.callback = callback;
+
+  for (int i = 0; i < count; i++) {
+    tasks[i].shared = &shared;
+    tasks[i].subtree = subtrees[i];
+    tasks[i].ctx = new_shard((uint32_t)i, shard_arg);
+    if (!tasks[i].ctx) {
+      free(tasks);
+      free(subtrees);
+      return -1;
+    }
+  }
+  free(subtrees);
+
+  struct thread_pool *pool = NULL;
+  struct thread_pool_wait_group *wg = NULL;
+  if (num_threads > 1 && count > 1) {
+    pool = thread_pool_create(num_threads, (uint32_t)count);
+    wg = pool ? thread_pool_wg_create() : NULL;
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (wg) {
+      thread_pool_wg_add(wg, 1);
+      if (thread_pool_submit(pool, btree_subtree_worker, &tasks[i], wg) == 0)
+        continue;
+      /* Fallback if pool is full or fails */
+      thread_pool_wg_done(wg);
+    }
+    btree_subtree_worker(&tasks[i]);
+  }
+
+  if (wg) {
+    thread_pool_wg_wait(wg);
+    thread_pool_wg_destroy(wg);
+  }
+  if (pool)
+    thread_pool_destroy(pool);
+
+  int ret = count;
+  for (int i = 0; i < count; i++) {
+    if (tasks[i].status < 0)
+      ret = -1;
+  }
+
+  free(tasks);
+  return ret;
+}
+
+/* ========================================================================
+ * Physically-ordered walk (elevator sweep, one level at a time)
+ * ======================================================================== */
+
+struct btree_sweep_node {
+  uint64_t logical;
+  uint64_t physical;
+};
+
+static int sweep_node_cmp(const void *a, const void *b) {
+  const struct btree_sweep_node *na = (const struct btree_sweep_node *)a;
+  const struct btree_sweep_node *nb = (const struct btree_sweep_node *)b;
+  if (na->physical < nb->physical)
+    return -1;
+  if (na->physical > nb->physical)
+    return 1;
+  return 0;
+}
+
+/*
+ * Append the children of an internal node to the next level's list. Each
+ * is read from the copy nearest its parent's, so a DUP tree is swept
+ * within one stripe instead of alternating between the two.
+ */
+static int sweep_add_children(const struct chunk_map *chunk_map,
+                              const uint8_t *node_buf, uint64_t node_logical,
+                              uint64_t node_physical, uint32_t max_ptrs,
+                              struct btree_sweep_node **next,
+                              uint32_t *next_count, uint32_t *next_cap) {
+  const struct btrfs_header *hdr = (const struct btrfs_header *)node_buf;
+  uint32_t nritems = le32toh(hdr->nritems);
+  if (nritems > max_ptrs) {
+    fprintf(stderr,
+            "btrfs2ext4: btree node 0x%lx claims %u pointers (max %u)\n",
+            (unsigned long)node_logical, nritems, max_ptrs);
+    return -1;
+  }
+
+  if (*next_count + nritems > *next_cap) {
+    uint32_t new_cap = *next_cap ? *next_cap : 256;
+    while (new_cap < *next_count + nritems)
+      new_cap *= 2;
+    struct btree_sweep_node *grown =
+        realloc(*next, new_cap * sizeof(struct btree_sweep_node));
+    if (!grown) {
+      fprintf(stderr, "btrfs2ext4: btree sweep list realloc failed\n");
+      return -1;
+    }
+    *next = grown;
+    *next_cap = new_cap;
+  }
+
+  const struct btrfs_key_ptr *ptrs =
+      (const struct btrfs_key_ptr *)(node_buf + sizeof(struct btrfs_header));
+  for (uint32_t i = 0; i < nritems; i++) {
+    struct btree_sweep_node *child = &(*next)[(*next_count)++];
+    child->logical = le64toh(ptrs[i].blockptr);
+    child->physical =
+        btree_resolve_node(chunk_map, child->logical, node_physical);
+    if (child->physical == (uint64_t)-1)
+      return -1;
+  }
+  return 0;
+}
+
+int btree_walk_physical(struct device *dev, const struct chunk_map *chunk_map,
+                        uint64_t root_logical, uint8_t root_level,
+                        uint32_t nodesize, uint16_t csum_type,
+                        btree_callback callback, void *ctx) {
+  if (root_level > 8) {
+    fprintf(stderr,
+            "btrfs2ext4: FATAL: tree root level %u is absurdly high "
+            "(malicious/corrupt tree?)\n",
+            root_level);
+    return -1;
+  }
+
+  uint32_t count = 1;
+  struct btree_sweep_node *frontier = malloc(sizeof(struct btree_sweep_node));
+  uint8_t *cached = malloc(BTREE_SWEEP_BATCH);
+  /* Aligned pool buffers let the batch go through O_DIRECT when enabled */
+  size_t bufs_size = (size_t)BTREE_SWEEP_BATCH * nodesize;
+  uint8_t *bufs = device_buf_alloc(bufs_size);
+  if (!frontier || !cached || !bufs) {
+    fprintf(stderr, "btrfs2ext4: out of memory for btree sweep\n");
+    free(frontier);
+    free(cached);
+    device_buf_free(bufs, bufs_size);
+    return -1;
+  }
+  frontier[0].logical = root_logical;
+  frontier[0].physical =
+      btree_resolve_node(chunk_map, root_logical, io_stats_last_offset());
+
+  uint32_t max_ptrs = (nodesize - (uint32_t)sizeof(struct btrfs_header)) /
+                      (uint32_t)sizeof(struct btrfs_key_ptr);
+  int ret = frontier[0].physical == (uint64_t)-1 ? -1 : 0;
+  int stop = 0;
+
+  for (int level = root_level; level >= 0 && count > 0 && ret == 0 && !stop;
+       level--) {
+    /* One ascending sweep across the whole level */
+    qsort(frontier, count, sizeof(struct btree_sweep_node), sweep_node_cmp);
+
+    struct btree_sweep_node *next = NULL;
+    uint32_t next_count = 0;
+    uint32_t next_cap = 0;
+
+    for (uint32_t base = 0; base < count && ret == 0 && !stop;
+         base += BTREE_SWEEP_BATCH) {
+      uint32_t n = count - base;
+      if (n > BTREE_SWEEP_BATCH)
+        n = BTREE_SWEEP_BATCH;
+
+      int batch_failed = 0;
+      device_read_batch_begin(dev);
+      for (uint32_t k = 0; k < n; k++) {
+        const struct btree_sweep_node *sn = &frontier[base + k];
+        uint8_t *buf = bufs + (size_t)k * nodesize;
+        cached[k] = (uint8_t)node_cache_lookup(sn->logical, buf);
+        if (!batch_failed && !cached[k] &&
+            device_read_batch_add(dev, sn->physical, buf, nodesize) < 0)
+          batch_failed = 1;
+      }
+      if (device_read_batch_submit(dev) < 0)
+        batch_failed = 1;
+
+      for (uint32_t k = 0; k < n && ret == 0; k++) {
+        const struct btree_sweep_node *sn = &frontier[base + k];
+        uint8_t *buf = bufs + (size_t)k * nodesize;
+
+        /* A failed batch says nothing about which node was bad: read each
+         * one again on its own, falling back to its other copy */
+        if (!cached[k] && batch_failed &&
+            btree_fetch_node(dev, chunk_map, sn->logical, nodesize, csum_type,
+                             buf) < 0) {
+          ret = -1;
+          break;
+        }
+        if (!cached[k] && !batch_failed &&
+            !btree_csum_ok(nodesize, csum_type, buf) &&
+            btree_fetch_other_copy(dev, chunk_map, sn->logical, sn->physical,
+                                   nodesize, csum_type, buf) < 0) {
+          ret = -1;
+          break;
+        }
+        if (btree_check_header(buf, sn->logical, (uint8_t)level) < 0) {
+          ret = -1;
+          break;
         }
+        if (!cached[k])
+          node_cache_insert(sn->logical, buf, (uint8_t)level);
+        progress_add(nodesize);
 
-        int cb_ret = callback(&items[i].key, data, data_size, ctx);
-        if (cb_ret != 0) {
-          /* Callback requested stop (not an error) */
-          goto done;
+        if (level > 0) {
+          if (sweep_add_children(chunk_map, buf, sn->logical, sn->physical,
+                                 max_ptrs, &next, &next_count,
+                                 &next_cap) < 0)
+            ret = -1;
+        } else {
+          uint32_t nritems =
+              le32toh(((const struct btrfs_header *)buf)->nritems);
+          if (btree_leaf_items(buf, sn->logical, nritems, nodesize, callback,
+                               ctx) != 0) {
+            stop = 1; /* Callback requested stop (not an error) */
+            break;
+          }
         }
       }
     }
+
+    free(frontier);
+    frontier = next;
+    count = next_count;
   }
 
-done:
-  free(node_buf);
-  free(stack);
+  free(frontier);
+  free(cached);
+  device_buf_free(bufs, bufs_size);
   return ret;
 }
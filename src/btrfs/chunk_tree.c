@@ -13,12 +13,20 @@
 #include "btrfs/btrfs_structures.h"
 #include "btrfs/checksum.h"
 #include "btrfs/chunk_tree.h"
+#include "btrfs/node_cache.h"
 #include "device_io.h"
+#include "mem_tracker.h"
 
 #define INITIAL_CHUNK_CAPACITY 64
 
 static int chunk_map_add(struct chunk_map *map, uint64_t logical,
-                         uint64_t physical, uint64_t length, uint64_t type) {
+                         const struct btrfs_chunk *chunk,
+                         const struct btrfs_stripe *stripes,
+                         uint16_t num_stripes) {
+  uint64_t length = le64toh(chunk->length);
+  uint64_t type = le64toh(chunk->type);
+
+
   /* Prevent logical address overflow */
   if (UINT64_MAX - logical < length) {
     fprintf(stderr, "btrfs2ext4: chunk logical address overflow\n");
@@ -39,16 +47,31 @@ static int chunk_map_add(struct chunk_map *map, uint64_t logical,
       fprintf(stderr, "btrfs2ext4: out of memory for chunk map\n");
       return -1;
     }
+    mem_track_alloc_tag(MEM_TAG_CHUNK_MAP,
+                        (size_t)(new_cap - map->capacity) *
+                            sizeof(struct chunk_mapping));
     map->entries = new_entries;
     map->capacity = new_cap;
   }
 
   struct chunk_mapping *e = &map->entries[map->count++];
   e->logical = logical;
-  e->physical = physical;
+  e->physical = le64toh(stripes[0].offset);
   e->length = length;
   e->type = type;
 
+  /* Each stripe of a mirrored chunk is a whole copy; only those on stripe
+   * 0's device can be read */
+  e->copy[0] = e->physical;
+  e->copies = 1;
+  uint64_t devid = le64toh(stripes[0].devid);
+  for (uint16_t i = 1; i < num_stripes && e->copies < CHUNK_MAX_COPIES &&
+                       (type & BTRFS_BLOCK_GROUP_MIRRORED);
+       i++) {
+    if (le64toh(stripes[i].devid) == devid)
+      e->copy[e->copies++] = le64toh(stripes[i].offset);
+  }
+
   return 0;
 }
 
@@ -72,6 +95,8 @@ int chunk_map_init_from_superblock(struct chunk_map *map,
     fprintf(stderr, "btrfs2ext4: out of memory for chunk map\n");
     return -1;
   }
+  mem_track_alloc_tag(MEM_TAG_CHUNK_MAP,
+                      map->capacity * sizeof(struct chunk_mapping));
 
   /* Parse sys_chunk_array from superblock */
   uint32_t array_size = le32toh(sb->sys_chunk_array_size);
@@ -80,9 +105,7 @@ int chunk_map_init_from_superblock(struct chunk_map *map,
             "btrfs2ext4: invalid sys_chunk_array_size=%u "
             "(max=%u) — superblock corrupt or unsupported\n",
             array_size, BTRFS_SYSTEM_CHUNK_ARRAY_SIZE);
-    free(map->entries);
-    map->entries = NULL;
-    map->capacity = 0;
+    chunk_map_free(map);
     return -1;
   }
   const uint8_t *p = sb->sys_chunk_array;
@@ -122,7 +145,10 @@ int chunk_map_init_from_superblock(struct chunk_map *map,
       return -1;
     }
 
-    /* For single-device, use stripe[0] */
+    if (num_stripes == 0) {
+      fprintf(stderr, "btrfs2ext4: sys_chunk_array chunk without stripes\n");
+      return -1;
+    }
     const struct btrfs_stripe *stripe =
         (const struct btrfs_stripe *)(p + sizeof(struct btrfs_chunk));
 
@@ -135,7 +161,7 @@ int chunk_map_init_from_superblock(struct chunk_map *map,
            (unsigned long)logical, (unsigned long)physical,
            (unsigned long)length, (unsigned long)type);
 
-    if (chunk_map_add(map, logical, physical, length, type) < 0)
+    if (chunk_map_add(map, logical, chunk, stripe, num_stripes) < 0)
       return -1;
 
     p += chunk_size;
@@ -185,39 +211,48 @@ int chunk_map_populate(struct chunk_map *map, struct device *dev,
   while (stack_top > 0) {
     stack_top--;
     uint64_t node_logical = stack[stack_top].logical;
+    const struct btrfs_header *hdr = (const struct btrfs_header *)node_buf;
 
-    /* Resolve logical → physical */
-    uint64_t node_physical = chunk_map_resolve(map, node_logical);
-    if (node_physical == (uint64_t)-1) {
-      fprintf(stderr,
-              "btrfs2ext4: cannot resolve chunk tree node at logical 0x%lx\n",
-              (unsigned long)node_logical);
-      free(node_buf);
-      return -1;
-    }
-
-    /* Read the node */
-    if (device_read(dev, node_physical, node_buf, nodesize) < 0) {
-      free(node_buf);
-      return -1;
+    /* Cached nodes were checksummed when they were inserted */
+    int cached = node_cache_lookup(node_logical, node_buf);
+    if (!cached) {
+      /* The SYSTEM chunk is DUP by default: a bad copy is not fatal */
+      uint64_t node_physical;
+      uint32_t copy = 0;
+      int good = 0, read_ok = 0;
+      while (!good && (node_physical = chunk_map_resolve_copy(
+                           map, node_logical, copy)) != (uint64_t)-1) {
+        read_ok = device_read(dev, node_physical, node_buf, nodesize) == 0;
+        good = read_ok &&
+               btrfs_verify_checksum(csum_type, hdr->csum,
+                                     (const uint8_t *)hdr + BTRFS_CSUM_SIZE,
+                                     nodesize - BTRFS_CSUM_SIZE) == 0;
+        if (good && copy > 0)
+          fprintf(stderr,
+                  "btrfs2ext4: chunk tree node 0x%lx: copy 0 bad, using copy "
+                  "%u\n",
+                  (unsigned long)node_logical, copy);
+        copy++;
+      }
+      if (!good) {
+        if (copy == 0)
+          fprintf(stderr,
+                  "btrfs2ext4: cannot resolve chunk tree node at logical "
+                  "0x%lx\n",
+                  (unsigned long)node_logical);
+        else if (read_ok)
+          fprintf(stderr,
+                  "btrfs2ext4: chunk tree node checksum mismatch at logical "
+                  "0x%lx (algorithm: %s)\n",
+                  (unsigned long)node_logical, btrfs_csum_name(csum_type));
+        free(node_buf);
+        return -1;
+      }
     }
 
-    const struct btrfs_header *hdr = (const struct btrfs_header *)node_buf;
     uint32_t nritems = le32toh(hdr->nritems);
     uint8_t level = hdr->level;
 
-    /* Validate checksum for chunk tree nodes as well */
-    if (btrfs_verify_checksum(csum_type, hdr->csum,
-                              (const uint8_t *)hdr + BTRFS_CSUM_SIZE,
-                              nodesize - BTRFS_CSUM_SIZE) != 0) {
-      fprintf(stderr,
-              "btrfs2ext4: chunk tree node checksum mismatch at logical 0x%lx "
-              "(algorithm: %s)\n",
-              (unsigned long)node_logical, btrfs_csum_name(csum_type));
-      free(node_buf);
-      return -1;
-    }
-
     uint32_t max_items =
         (nodesize - sizeof(struct btrfs_header)) / sizeof(struct btrfs_key_ptr);
     if (nritems > max_items) {
@@ -228,6 +263,8 @@ int chunk_map_populate(struct chunk_map *map, struct device *dev,
       free(node_buf);
       return -1;
     }
+    if (!cached)
+      node_cache_insert(node_logical, node_buf, level);
 
     if (level > 0) {
       /* Internal node: push children onto stack */
@@ -289,11 +326,12 @@ int chunk_map_populate(struct chunk_map *map, struct device *dev,
                                           sizeof(struct btrfs_chunk));
 
         uint64_t logical = le64toh(items[i].key.offset);
-        uint64_t physical = le64toh(stripe->offset);
-        uint64_t length = le64toh(chunk->length);
-        uint64_t type = le64toh(chunk->type);
+        if (num_stripes == 0) {
+          fprintf(stderr, "btrfs2ext4: chunk item without stripes\n");
+          continue;
+        }
 
-        if (chunk_map_add(map, logical, physical, length, type) < 0) {
+        if (chunk_map_add(map, logical, chunk, stripe, num_stripes) < 0) {
           free(node_buf);
           return -1;
         }
@@ -305,33 +343,208 @@ int chunk_map_populate(struct chunk_map *map, struct device *dev,
 
   /* Re-sort after adding new entries */
   qsort(map->entries, map->count, sizeof(struct chunk_mapping), chunk_cmp);
+  chunk_map_build_resolver(map);
 
   printf("  Total chunk mappings: %u\n\n", map->count);
   return 0;
 }
 
-uint64_t chunk_map_resolve(const struct chunk_map *map, uint64_t logical) {
-  /* Binary search for the chunk containing this logical address */
-  int lo = 0, hi = (int)map->count - 1;
+/* Fill keys[] in BFS order with an in-order walk of the implicit tree */
+static uint32_t eytzinger_fill(const struct chunk_map *map,
+                               struct chunk_resolver *r, uint32_t i,
+                               uint32_t k) {
+  if (k <= r->count) {
+    i = eytzinger_fill(map, r, i, 2 * k);
+    r->keys[k] = map->entries[i].logical;
+    r->rank[k] = i++;
+    i = eytzinger_fill(map, r, i, 2 * k + 1);
+  }
+  return i;
+}
 
-  while (lo <= hi) {
-    int mid = (lo + hi) / 2;
-    const struct chunk_mapping *e = &map->entries[mid];
+static size_t chunk_resolver_bytes(uint32_t count) {
+  return sizeof(struct chunk_resolver) +
+         ((size_t)count + 1) * (sizeof(uint64_t) + sizeof(uint32_t));
+}
 
-    if (logical < e->logical) {
-      hi = mid - 1;
-    } else if (logical >= e->logical + e->length) {
+static void chunk_resolver_free(struct chunk_resolver *r) {
+  if (!r)
+    return;
+  if (r->keys && r->rank)
+    mem_track_free_tag(MEM_TAG_CHUNK_MAP, chunk_resolver_bytes(r->count));
+  free(r->keys);
+  free(r->rank);
+  free(r);
+}
+
+int chunk_map_build_resolver(struct chunk_map *map) {
+  chunk_resolver_free(map->resolver);
+  map->resolver = NULL;
+  if (map->count == 0)
+    return 0;
+
+  struct chunk_resolver *r = calloc(1, sizeof(*r));
+  if (r) {
+    r->count = map->count;
+    r->keys = malloc(((size_t)map->count + 1) * sizeof(uint64_t));
+    r->rank = malloc(((size_t)map->count + 1) * sizeof(uint32_t));
+  }
+  if (!r || !r->keys || !r->rank) {
+    fprintf(stderr, "btrfs2ext4: warning: OOM for chunk resolver, using "
+                    "binary search\n");
+    chunk_resolver_free(r);
+    return -1;
+  }
+  mem_track_alloc_tag(MEM_TAG_CHUNK_MAP, chunk_resolver_bytes(r->count));
+  r->keys[0] = 0;
+  r->rank[0] = 0;
+  eytzinger_fill(map, r, 0, 1);
+  map->resolver = r;
+  return 0;
+}
+
+/* Last chunk hit per thread; any entry that contains the address is the
+ * right one, so a stale hint can only cost a search */
+static __thread const struct chunk_map *tls_hit_map;
+static __thread uint32_t tls_hit_index;
+
+static inline int chunk_contains(const struct chunk_mapping *e,
+                                 uint64_t logical) {
+  return logical >= e->logical && logical - e->logical < e->length;
+}
+
+/* Index of the last entry starting at or below `logical`, or -1 */
+static int64_t chunk_search(const struct chunk_map *map, uint64_t logical) {
+  const struct chunk_resolver *r = map->resolver;
+  if (r && r->count == map->count) {
+    uint64_t k = 1;
+    while (k <= r->count) {
+      __builtin_prefetch(&r->keys[16 * k]);
+      k = 2 * k + (r->keys[k] <= logical);
+    }
+    /* Drop the trailing right turns: k is the first key > logical */
+    k >>= __builtin_ffsll((long long)~k);
+    uint32_t above = k ? r->rank[k] : r->count;
+    return (int64_t)above - 1;
+  }
+
+  /* Binary search for the chunk containing this logical address */
+  int64_t lo = 0, hi = (int64_t)map->count - 1, found = -1;
+  while (lo <= hi) {
+    int64_t mid = (lo + hi) / 2;
+    if (map->entries[mid].logical <= logical) {
+      found = mid;
       lo = mid + 1;
     } else {
-      /* Found: logical is within [e->logical, e->logical + e->length) */
-      return e->physical + (logical - e->logical);
+      hi = mid - 1;
     }
   }
+  return found;
+}
 
-  return (uint64_t)-1; /* Not found */
+const struct chunk_mapping *chunk_map_find(const struct chunk_map *map,
+                                           uint64_t logical) {
+  if (tls_hit_map == map && tls_hit_index < map->count) {
+    const struct chunk_mapping *e = &map->entries[tls_hit_index];
+    if (chunk_contains(e, logical))
+      return e;
+  }
+
+  int64_t i = chunk_search(map, logical);
+  if (i < 0 || !chunk_contains(&map->entries[i], logical))
+    return NULL;
+
+  tls_hit_map = map;
+  tls_hit_index = (uint32_t)i;
+  return &map->entries[i];
+}
+
+uint64_t chunk_map_resolve(const struct chunk_map *map, uint64_t logical) {
+  if (logical & CHUNK_MAP_PHYSICAL)
+    return logical & ~CHUNK_MAP_PHYSICAL;
+  const struct chunk_mapping *e = chunk_map_find(map, logical);
+  if (!e)
+    return (uint64_t)-1; /* Not found */
+  return e->physical + (logical - e->logical);
+}
+
+uint64_t chunk_map_resolve_near(const struct chunk_map *map, uint64_t logical,
+                                uint64_t pos, uint32_t *copy) {
+  if (copy)
+    *copy = 0;
+  if (logical & CHUNK_MAP_PHYSICAL)
+    return logical & ~CHUNK_MAP_PHYSICAL;
+  const struct chunk_mapping *e = chunk_map_find(map, logical);
+  if (!e)
+    return (uint64_t)-1;
+  uint64_t off = logical - e->logical;
+  uint64_t best = e->physical + off;
+  if (pos == UINT64_MAX)
+    return best;
+
+  uint64_t best_dist = best > pos ? best - pos : pos - best;
+  for (uint32_t i = 1; i < e->copies; i++) {
+    uint64_t phys = e->copy[i] + off;
+    uint64_t dist = phys > pos ? phys - pos : pos - phys;
+    if (dist < best_dist) {
+      best = phys;
+      best_dist = dist;
+      if (copy)
+        *copy = i;
+    }
+  }
+  return best;
+}
+
+uint64_t chunk_map_resolve_copy(const struct chunk_map *map, uint64_t logical,
+                                uint32_t copy) {
+  if (logical & CHUNK_MAP_PHYSICAL)
+    return copy == 0 ? logical & ~CHUNK_MAP_PHYSICAL : (uint64_t)-1;
+  const struct chunk_mapping *e = chunk_map_find(map, logical);
+  if (!e || (copy > 0 && copy >= e->copies))
+    return (uint64_t)-1;
+  return (copy == 0 ? e->physical : e->copy[copy]) + (logical - e->logical);
+}
+
+uint32_t chunk_map_resolve_batch(const struct chunk_map *map,
+                                 const uint64_t *logical, uint64_t *physical,
+                                 uint32_t n) {
+  uint32_t resolved = 0;
+  uint32_t cur = 0;
+  uint64_t prev = 0;
+
+  for (uint32_t i = 0; i < n; i++) {
+    uint64_t addr = logical[i];
+    if (addr & CHUNK_MAP_PHYSICAL) {
+      physical[i] = addr & ~CHUNK_MAP_PHYSICAL;
+      resolved++;
+      continue;
+    }
+    if (i == 0 || addr < prev) {
+      /* First or out-of-order address: search, then carry on from there */
+      int64_t at = chunk_search(map, addr);
+      cur = at < 0 ? 0 : (uint32_t)at;
+    } else {
+      while (cur + 1 < map->count && map->entries[cur + 1].logical <= addr)
+        cur++;
+    }
+    const struct chunk_mapping *e = &map->entries[cur];
+    physical[i] = cur < map->count && chunk_contains(e, addr)
+                      ? e->physical + (addr - e->logical)
+                      : (uint64_t)-1;
+    if (physical[i] != (uint64_t)-1)
+      resolved++;
+    prev = addr;
+  }
+  return resolved;
 }
 
 void chunk_map_free(struct chunk_map *map) {
+  chunk_resolver_free(map->resolver);
+  map->resolver = NULL;
+  if (map->entries)
+    mem_track_free_tag(MEM_TAG_CHUNK_MAP,
+                       map->capacity * sizeof(struct chunk_mapping));
   free(map->entries);
   map->entries = NULL;
   map->count = 0;
@@ -10,9 +10,12 @@
  *         compressed. A 4-byte LE header gives the total compressed size,
  *         followed by per-page segments (4-byte LE len + compressed data).
  * - ZSTD: standard zstd frame
+ *
+ * Output is streamed through a caller-supplied, block-aligned window:
+ * nothing is inflated into a full-size buffer first, and only the bytes
+ * the stream does not produce (up to the block boundary) are zeroed.
  */
 
-#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,14 +39,90 @@
 #define DECOMPRESS_MAX_COMP_SIZE (512ULL * 1024 * 1024)        // 512 MiB
 #define DECOMPRESS_MAX_DECOMP_SIZE (4ULL * 1024 * 1024 * 1024) // 4 GiB
 
-static int decompress_zlib(const uint8_t *in, size_t in_len, uint8_t *out,
-                           size_t out_len) {
+/* Compressed input is read in chunks of this size (zlib, zstd) */
+#define DECOMPRESS_IN_CHUNK (128 * 1024)
+
+/* LZO output page: every segment inflates to at most this much */
+#define DECOMPRESS_LZO_PAGE 4096
+
+/* ========================================================================
+ * Output window — block-aligned chunks handed to the caller's sink
+ * ======================================================================== */
+
+struct decomp_stream {
+  struct device *dev;
+  uint64_t phys;      /* next compressed byte on disk */
+  uint64_t comp_left; /* compressed bytes not read yet */
+  uint8_t *in;        /* thread-local input buffer */
+
+  uint8_t *window;
+  size_t window_size; /* multiple of block_size */
+  size_t fill;        /* bytes pending in window */
+  uint64_t flushed;   /* bytes already handed to the sink */
+  uint64_t limit;     /* decompressed size (ram_bytes) */
+  uint64_t padded;    /* limit rounded up to block_size */
+
+  btrfs_decomp_sink sink;
+  void *sink_arg;
+};
+
+/* Bytes the decompressor may write into the window right now */
+static inline size_t stream_room(const struct decomp_stream *s) {
+  uint64_t left = s->limit - s->flushed - s->fill;
+  size_t room = s->window_size - s->fill;
+  return left < room ? (size_t)left : room;
+}
+
+static int stream_flush(struct decomp_stream *s) {
+  if (s->fill == 0)
+    return 0;
+  if (s->sink(s->window, s->fill, s->flushed, s->sink_arg) < 0)
+    return -1;
+  s->flushed += s->fill;
+  s->fill = 0;
+  return 0;
+}
+
+/* Flush when the window is full; callers loop on stream_room() */
+static inline int stream_advance(struct decomp_stream *s, size_t produced) {
+  s->fill += produced;
+  return s->fill == s->window_size ? stream_flush(s) : 0;
+}
+
+/* Zero only what the stream did not produce, up to the block boundary */
+static int stream_finish(struct decomp_stream *s) {
+  while (s->flushed + s->fill < s->padded) {
+    size_t gap = s->window_size - s->fill;
+    uint64_t want = s->padded - s->flushed - s->fill;
+    if (want < gap)
+      gap = (size_t)want;
+    memset(s->window + s->fill, 0, gap);
+    s->fill += gap;
+    if (stream_flush(s) < 0)
+      return -1;
+  }
+  return stream_flush(s);
+}
+
+/* Read the next chunk of compressed input; returns bytes read or -1 */
+static ssize_t stream_refill(struct decomp_stream *s, size_t cap) {
+  size_t n = s->comp_left < cap ? (size_t)s->comp_left : cap;
+  if (n == 0)
+    return 0;
+  if (device_read_bulk(s->dev, s->phys, s->in, n) < 0)
+    return -1;
+  s->phys += n;
+  s->comp_left -= n;
+  return (ssize_t)n;
+}
+
+/* ========================================================================
+ * Decoders
+ * ======================================================================== */
+
+static int decompress_zlib(struct decomp_stream *s) {
   z_stream strm;
   memset(&strm, 0, sizeof(strm));
-  strm.next_in = (Bytef *)in;
-  strm.avail_in = (uInt)in_len;
-  strm.next_out = (Bytef *)out;
-  strm.avail_out = (uInt)out_len;
 
   /* Btrfs uses raw deflate (no zlib/gzip header), windowBits = -15 */
   if (inflateInit2(&strm, -15) != Z_OK) {
@@ -51,20 +130,45 @@ static int decompress_zlib(const uint8_t *in, size_t in_len, uint8_t *out,
     return -1;
   }
 
-  int ret = inflate(&strm, Z_FINISH);
-  inflateEnd(&strm);
+  int ret = Z_OK;
+  while (ret != Z_STREAM_END) {
+    if (strm.avail_in == 0) {
+      ssize_t n = stream_refill(s, DECOMPRESS_IN_CHUNK);
+      if (n < 0)
+        break;
+      strm.next_in = s->in;
+      strm.avail_in = (uInt)n;
+    }
 
-  if (ret != Z_STREAM_END && ret != Z_OK) {
-    fprintf(stderr, "btrfs2ext4: zlib inflate failed (ret=%d)\n", ret);
-    return -1;
+    size_t room = stream_room(s);
+    if (room == 0) {
+      ret = Z_STREAM_END; /* ram_bytes reached; anything past it is dropped */
+      break;
+    }
+    strm.next_out = s->window + s->fill;
+    strm.avail_out = (uInt)room;
+
+    ret = inflate(&strm, Z_NO_FLUSH);
+    if (ret == Z_BUF_ERROR && strm.avail_in == 0 && s->comp_left == 0) {
+      fprintf(stderr, "btrfs2ext4: zlib stream truncated\n");
+      break;
+    }
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+      fprintf(stderr, "btrfs2ext4: zlib inflate failed (ret=%d)\n", ret);
+      break;
+    }
+    if (stream_advance(s, room - strm.avail_out) < 0) {
+      ret = Z_ERRNO;
+      break;
+    }
   }
+  inflateEnd(&strm);
 
-  return 0;
+  return ret == Z_STREAM_END ? 0 : -1;
 }
 
 #ifdef HAVE_LZO
-static int decompress_lzo(const uint8_t *in, size_t in_len, uint8_t *out,
-                          size_t out_len) {
+static int decompress_lzo(struct decomp_stream *s, uint64_t comp_size) {
   /*
    * Btrfs LZO format:
    *   [4 bytes LE] total compressed length (including this header)
@@ -72,19 +176,22 @@ static int decompress_lzo(const uint8_t *in, size_t in_len, uint8_t *out,
    *     [4 bytes LE] compressed segment length
    *     [N bytes]    LZO1X compressed data
    *
-   * We decompress segment-by-segment into the output buffer.
+   * Segments are small, so the whole input is read at once (into the
+   * thread-local buffer) and each page is inflated straight into the
+   * window.
    */
-  if (in_len < 4) {
+  if (comp_size < 4) {
     fprintf(stderr, "btrfs2ext4: LZO data too short\n");
     return -1;
   }
+  if (stream_refill(s, (size_t)comp_size) < 0)
+    return -1;
 
   /* Skip the 4-byte total-length header */
-  const uint8_t *p = in + 4;
-  const uint8_t *end = in + in_len;
-  size_t out_offset = 0;
+  const uint8_t *p = s->in + 4;
+  const uint8_t *end = s->in + comp_size;
 
-  while (p < end && out_offset < out_len) {
+  while (p < end && s->flushed + s->fill < s->limit) {
     if (p + 4 > end)
       break;
 
@@ -92,20 +199,26 @@ static int decompress_lzo(const uint8_t *in, size_t in_len, uint8_t *out,
                        ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
     p += 4;
 
-    if (p + seg_len > end) {
+    if (seg_len > (size_t)(end - p)) {
       fprintf(stderr, "btrfs2ext4: LZO segment exceeds input\n");
       return -1;
     }
 
-    lzo_uint dst_len = (lzo_uint)(out_len - out_offset);
+    /* A page must not straddle a flush */
+    if (s->window_size - s->fill < DECOMPRESS_LZO_PAGE &&
+        stream_flush(s) < 0)
+      return -1;
+
+    lzo_uint dst_len = (lzo_uint)stream_room(s);
     int ret =
-        lzo1x_decompress_safe(p, seg_len, out + out_offset, &dst_len, NULL);
+        lzo1x_decompress_safe(p, seg_len, s->window + s->fill, &dst_len, NULL);
     if (ret != LZO_E_OK) {
       fprintf(stderr, "btrfs2ext4: LZO decompress failed (ret=%d)\n", ret);
       return -1;
     }
 
-    out_offset += dst_len;
+    if (stream_advance(s, (size_t)dst_len) < 0)
+      return -1;
     p += seg_len;
   }
 
@@ -114,29 +227,60 @@ static int decompress_lzo(const uint8_t *in, size_t in_len, uint8_t *out,
 #endif /* HAVE_LZO */
 
 #ifdef HAVE_ZSTD
-static int decompress_zstd(const uint8_t *in, size_t in_len, uint8_t *out,
-                           size_t out_len) {
-  size_t ret = ZSTD_decompress(out, out_len, in, in_len);
-  if (ZSTD_isError(ret)) {
-    fprintf(stderr, "btrfs2ext4: zstd decompress failed: %s\n",
-            ZSTD_getErrorName(ret));
-    return -1;
+static int decompress_zstd(struct decomp_stream *s) {
+  /* One decoder context per thread, reused across extents */
+  static __thread ZSTD_DCtx *dctx = NULL;
+  if (!dctx) {
+    dctx = ZSTD_createDCtx();
+    if (!dctx) {
+      fprintf(stderr, "btrfs2ext4: zstd context allocation failed\n");
+      return -1;
+    }
+  }
+  ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+
+  ZSTD_inBuffer in = {s->in, 0, 0};
+  size_t ret = 1;
+  int out_full = 0; /* decoder may still hold output without more input */
+
+  while (ret != 0) {
+    if (in.pos == in.size && !out_full) {
+      ssize_t n = stream_refill(s, DECOMPRESS_IN_CHUNK);
+      if (n < 0)
+        return -1;
+      if (n == 0) {
+        fprintf(stderr, "btrfs2ext4: zstd frame truncated\n");
+        return -1;
+      }
+      in.src = s->in;
+      in.size = (size_t)n;
+      in.pos = 0;
+    }
+
+    size_t room = stream_room(s);
+    if (room == 0)
+      break; /* ram_bytes reached; anything past it is dropped */
+    ZSTD_outBuffer out = {s->window + s->fill, room, 0};
+
+    ret = ZSTD_decompressStream(dctx, &out, &in);
+    if (ZSTD_isError(ret)) {
+      fprintf(stderr, "btrfs2ext4: zstd decompress failed: %s\n",
+              ZSTD_getErrorName(ret));
+      return -1;
+    }
+    out_full = out.pos == out.size;
+    if (stream_advance(s, out.pos) < 0)
+      return -1;
   }
   return 0;
 }
 #endif /* HAVE_ZSTD */
 
-int btrfs_decompress_extent(struct device *dev,
-                            const struct chunk_map *chunk_map,
-                            const struct file_extent *ext, uint32_t block_size,
-                            uint8_t **out_buf, uint64_t *out_len) {
-  if (ext->compression == BTRFS_COMPRESS_NONE) {
-    /* Not compressed — shouldn't be called, but handle gracefully */
-    *out_buf = NULL;
-    *out_len = 0;
-    return -1;
-  }
+/* ========================================================================
+ * Public API
+ * ======================================================================== */
 
+uint64_t btrfs_decompressed_size(const struct file_extent *ext) {
   uint64_t comp_size = ext->disk_num_bytes;
   uint64_t decomp_size = ext->ram_bytes;
   if (decomp_size == 0)
@@ -148,7 +292,7 @@ int btrfs_decompress_extent(struct device *dev,
             "(limit: %lu MiB) — skipping extent\n",
             (unsigned long)comp_size,
             (unsigned long)(DECOMPRESS_MAX_COMP_SIZE / (1024 * 1024)));
-    return -1;
+    return 0;
   }
 
   if (decomp_size == 0 || decomp_size > DECOMPRESS_MAX_DECOMP_SIZE) {
@@ -156,7 +300,7 @@ int btrfs_decompress_extent(struct device *dev,
             "btrfs2ext4: suspicious decompressed size %lu bytes "
             "— skipping extent\n",
             (unsigned long)decomp_size);
-    return -1;
+    return 0;
   }
 
   if (comp_size > decomp_size) {
@@ -164,7 +308,7 @@ int btrfs_decompress_extent(struct device *dev,
             "btrfs2ext4: compressed size > decompressed size "
             "(%lu > %lu) — skipping\n",
             (unsigned long)comp_size, (unsigned long)decomp_size);
-    return -1;
+    return 0;
   }
 
   /* Security Check: Limit decompression to max 2x the allocated extent bytes
@@ -174,8 +318,31 @@ int btrfs_decompress_extent(struct device *dev,
             "btrfs2ext4: safety limit exceeded - decompressed size (%lu) > 2x "
             "extent limit (%lu)\n",
             (unsigned long)decomp_size, (unsigned long)ext->num_bytes);
+    return 0;
+  }
+
+  return decomp_size;
+}
+
+int btrfs_decompress_extent_stream(struct device *dev,
+                                   const struct chunk_map *chunk_map,
+                                   const struct file_extent *ext,
+                                   uint32_t block_size, uint8_t *window,
+                                   size_t window_size, btrfs_decomp_sink sink,
+                                   void *sink_arg, uint64_t *out_len) {
+  if (ext->compression == BTRFS_COMPRESS_NONE) {
+    /* Not compressed — shouldn't be called, but handle gracefully */
+    *out_len = 0;
     return -1;
   }
+  if (block_size == 0 || window_size < block_size ||
+      window_size % block_size != 0)
+    return -1;
+
+  uint64_t decomp_size = btrfs_decompressed_size(ext);
+  if (decomp_size == 0)
+    return -1;
+  uint64_t comp_size = ext->disk_num_bytes;
 
   /* Resolve physical address of compressed data */
   uint64_t phys = chunk_map_resolve(chunk_map, ext->disk_bytenr);
@@ -185,59 +352,47 @@ int btrfs_decompress_extent(struct device *dev,
     return -1;
   }
 
-  /* Read compressed data from disk */
+  /* Compressed input, per thread. Each worker preads on its own; the
+   * device fd is shared but pread() needs no lock. */
   static __thread uint8_t *shared_comp_buf = NULL;
   static __thread size_t shared_comp_size = 0;
 
-  if (comp_size > shared_comp_size) {
-    free(shared_comp_buf);
-    shared_comp_buf = malloc(comp_size);
+  size_t in_need = ext->compression == BTRFS_COMPRESS_LZO
+                       ? (size_t)comp_size
+                       : DECOMPRESS_IN_CHUNK;
+  if (in_need > shared_comp_size) {
+    device_buf_free(shared_comp_buf, shared_comp_size);
+    shared_comp_buf = device_buf_alloc(in_need);
     if (!shared_comp_buf) {
       shared_comp_size = 0;
       return -1;
     }
-    shared_comp_size = comp_size;
+    shared_comp_size = in_need;
   }
-  uint8_t *comp_buf = shared_comp_buf;
-
-  static pthread_mutex_t decompress_io_mutex = PTHREAD_MUTEX_INITIALIZER;
-  pthread_mutex_lock(&decompress_io_mutex);
-  int read_ret = device_read(dev, phys, comp_buf, comp_size);
-  pthread_mutex_unlock(&decompress_io_mutex);
-
-  if (read_ret < 0) {
-    return -1;
-  }
-
-  /* Round up to block boundary */
-  uint64_t aligned_size =
-      ((decomp_size + block_size - 1) / block_size) * block_size;
-
-  static __thread uint8_t *shared_decomp_buf = NULL;
-  static __thread size_t shared_decomp_size = 0;
 
-  if (aligned_size > shared_decomp_size) {
-    free(shared_decomp_buf);
-    shared_decomp_buf = malloc(aligned_size);
-    if (!shared_decomp_buf) {
-      shared_decomp_size = 0;
-      return -1;
-    }
-    shared_decomp_size = aligned_size;
-  }
-  uint8_t *decomp_buf = shared_decomp_buf;
-  memset(decomp_buf, 0, aligned_size);
+  struct decomp_stream s;
+  memset(&s, 0, sizeof(s));
+  s.dev = dev;
+  s.phys = phys;
+  s.comp_left = comp_size;
+  s.in = shared_comp_buf;
+  s.window = window;
+  s.window_size = window_size;
+  s.limit = decomp_size;
+  s.padded = ((decomp_size + block_size - 1) / block_size) * block_size;
+  s.sink = sink;
+  s.sink_arg = sink_arg;
 
   int ret = -1;
 
   switch (ext->compression) {
   case BTRFS_COMPRESS_ZLIB:
-    ret = decompress_zlib(comp_buf, comp_size, decomp_buf, decomp_size);
+    ret = decompress_zlib(&s);
     break;
 
   case BTRFS_COMPRESS_LZO:
 #ifdef HAVE_LZO
-    ret = decompress_lzo(comp_buf, comp_size, decomp_buf, decomp_size);
+    ret = decompress_lzo(&s, comp_size);
 #else
     fprintf(stderr,
             "btrfs2ext4: LZO decompression not available (build without "
@@ -247,7 +402,7 @@ int btrfs_decompress_extent(struct device *dev,
 
   case BTRFS_COMPRESS_ZSTD:
 #ifdef HAVE_ZSTD
-    ret = decompress_zstd(comp_buf, comp_size, decomp_buf, decomp_size);
+    ret = decompress_zstd(&s);
 #else
     fprintf(stderr,
             "btrfs2ext4: zstd decompression not available (build without "
@@ -261,11 +416,59 @@ int btrfs_decompress_extent(struct device *dev,
     break;
   }
 
-  if (ret < 0) {
+  if (ret < 0 || stream_finish(&s) < 0)
     return -1;
-  }
 
-  *out_buf = decomp_buf;
   *out_len = decomp_size;
   return 0;
 }
+
+/* btrfs_decompress_extent() sink: append to a heap buffer */
+struct decomp_collect {
+  uint8_t *buf;
+};
+
+static int decomp_collect_sink(const uint8_t *data, size_t len,
+                               uint64_t offset, void *arg) {
+  struct decomp_collect *c = (struct decomp_collect *)arg;
+  memcpy(c->buf + offset, data, len);
+  return 0;
+}
+
+int btrfs_decompress_extent(struct device *dev,
+                            const struct chunk_map *chunk_map,
+                            const struct file_extent *ext, uint32_t block_size,
+                            uint8_t **out_buf, uint64_t *out_len) {
+  *out_buf = NULL;
+  *out_len = 0;
+
+  uint64_t decomp_size = btrfs_decompressed_size(ext);
+  if (decomp_size == 0 || block_size == 0)
+    return -1;
+  uint64_t padded = ((decomp_size + block_size - 1) / block_size) * block_size;
+
+  size_t window_size = BTRFS_DECOMP_WINDOW - BTRFS_DECOMP_WINDOW % block_size;
+  if (window_size == 0)
+    window_size = block_size;
+
+  struct decomp_collect c;
+  c.buf = malloc(padded);
+  uint8_t *window = malloc(window_size);
+  if (!c.buf || !window) {
+    free(c.buf);
+    free(window);
+    return -1;
+  }
+
+  int ret = btrfs_decompress_extent_stream(dev, chunk_map, ext, block_size,
+                                           window, window_size,
+                                           decomp_collect_sink, &c, out_len);
+  free(window);
+  if (ret < 0) {
+    free(c.buf);
+    *out_len = 0;
+    return -1;
+  }
+  *out_buf = c.buf;
+  return 0;
+}
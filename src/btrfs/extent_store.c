@@ -0,0 +1,236 @@
+/*
+ * extent_store.c — Packed file extent table
+ *
+ * Four parallel columns (disk address, disk length, file length, flags)
+ * hold the extents of every ordinary file, file by file. Scans that only
+ * look at disk addresses and lengths walk them front to back; the rare
+ * files that need the full record keep a struct file_extent array.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "btrfs/btrfs_reader.h"
+#include "btrfs/btrfs_structures.h"
+#include "btrfs/extent_store.h"
+#include "mem_tracker.h"
+
+/* Whether `e`, expected at `file_offset`, survives packing unchanged */
+static int extent_packable(const struct file_extent *e, uint64_t file_offset) {
+  if (e->type != BTRFS_FILE_EXTENT_REG && e->type != BTRFS_FILE_EXTENT_PREALLOC)
+    return 0;
+  if (e->compression != BTRFS_COMPRESS_NONE || e->inline_data ||
+      e->inline_data_len)
+    return 0;
+  if (e->file_offset != file_offset)
+    return 0;
+  if (e->disk_num_bytes % EXTENT_STORE_UNIT || e->num_bytes % EXTENT_STORE_UNIT)
+    return 0;
+  if (e->disk_num_bytes / EXTENT_STORE_UNIT > UINT32_MAX ||
+      e->num_bytes / EXTENT_STORE_UNIT > UINT32_MAX)
+    return 0;
+  return e->ram_bytes == e->num_bytes || e->ram_bytes == e->disk_num_bytes;
+}
+
+static int file_entry_packable(const struct file_entry *fe) {
+  if (!fe->extents || fe->extent_count == 0)
+    return 0;
+  uint64_t off = 0;
+  for (uint32_t j = 0; j < fe->extent_count; j++) {
+    if (!extent_packable(&fe->extents[j], off))
+      return 0;
+    off += fe->extents[j].num_bytes;
+  }
+  return 1;
+}
+
+int btrfs_pack_extents(struct btrfs_fs_info *fs_info) {
+  struct extent_store *st = &fs_info->extent_store;
+  if (fs_info->extents_packed)
+    return 0;
+
+  uint64_t total = 0, packed = 0;
+  for (uint32_t i = 0; i < fs_info->inode_count; i++) {
+    const struct file_entry *fe = fs_info->inode_table[i];
+    total += fe->extent_count;
+    if (file_entry_packable(fe))
+      packed += fe->extent_count;
+  }
+
+  if (packed > 0) {
+    st->bytenr = malloc(packed * sizeof(uint64_t));
+    st->disk_len = malloc(packed * sizeof(uint32_t));
+    st->len = malloc(packed * sizeof(uint32_t));
+    st->flags = malloc(packed);
+    if (!st->bytenr || !st->disk_len || !st->len || !st->flags) {
+      fprintf(stderr, "btrfs2ext4: warning: OOM packing extents, keeping "
+                      "per-file arrays\n");
+      free(st->bytenr);
+      free(st->disk_len);
+      free(st->len);
+      free(st->flags);
+      memset(st, 0, sizeof(*st));
+      return -1;
+    }
+    mem_track_alloc_tag(MEM_TAG_PASS1, packed * EXTENT_STORE_ROW_BYTES);
+  }
+
+  /* Unpacked arrays move to the main arena so the extent arena can go */
+  int keep_arena = 0;
+  for (uint32_t i = 0; i < fs_info->inode_count; i++) {
+    struct file_entry *fe = fs_info->inode_table[i];
+    if (file_entry_packable(fe)) {
+      fe->ext_first = st->count;
+      for (uint32_t j = 0; j < fe->extent_count; j++) {
+        const struct file_extent *e = &fe->extents[j];
+        uint64_t k = st->count++;
+        st->bytenr[k] = e->disk_bytenr;
+        st->disk_len[k] = (uint32_t)(e->disk_num_bytes / EXTENT_STORE_UNIT);
+        st->len[k] = (uint32_t)(e->num_bytes / EXTENT_STORE_UNIT);
+        st->flags[k] =
+            (e->type == BTRFS_FILE_EXTENT_PREALLOC ? EXTENT_STORE_PREALLOC
+                                                   : 0) |
+            (e->ram_bytes == e->num_bytes ? 0 : EXTENT_STORE_RAM_DISK);
+      }
+      fe->extents = NULL;
+      fe->extent_capacity = 0;
+    } else if (fe->extent_count > 0) {
+      size_t bytes = (size_t)fe->extent_count * sizeof(struct file_extent);
+      struct file_extent *copy = arena_alloc(&fs_info->arena, bytes);
+      if (!copy) {
+        keep_arena = 1; /* the old array stays valid */
+        continue;
+      }
+      memcpy(copy, fe->extents, bytes);
+      fe->extents = copy;
+      fe->extent_capacity = fe->extent_count;
+    }
+  }
+
+  uint64_t arena_bytes = fs_info->extent_arena.reserved;
+  if (!keep_arena)
+    arena_free(&fs_info->extent_arena);
+  fs_info->extents_packed = 1;
+
+  printf("  Packed extents:    %lu of %lu (%.1f MiB, arrays were %.1f MiB)\n",
+         (unsigned long)packed, (unsigned long)total,
+         (double)(packed * (2 * sizeof(uint32_t) + sizeof(uint64_t) + 1)) /
+             (1024.0 * 1024.0),
+         (double)arena_bytes / (1024.0 * 1024.0));
+  return 0;
+}
+
+void extent_iter_init(struct extent_iter *it,
+                      const struct btrfs_fs_info *fs_info,
+                      const struct file_entry *fe) {
+  memset(it, 0, sizeof(*it));
+  it->fs_info = fs_info;
+  it->fe = fe;
+}
+
+const struct file_extent *extent_iter_next(struct extent_iter *it) {
+  const struct file_entry *fe = it->fe;
+  if (it->next >= fe->extent_count)
+    return NULL;
+  it->index = it->next++;
+  if (fe->extents)
+    return &fe->extents[it->index];
+
+  const struct extent_store *st = &it->fs_info->extent_store;
+  uint64_t k = fe->ext_first + it->index;
+  struct file_extent *e = &it->cur;
+  e->file_offset = it->file_offset;
+  e->disk_bytenr = st->bytenr[k];
+  e->disk_num_bytes = (uint64_t)st->disk_len[k] * EXTENT_STORE_UNIT;
+  e->num_bytes = (uint64_t)st->len[k] * EXTENT_STORE_UNIT;
+  e->ram_bytes = st->flags[k] & EXTENT_STORE_RAM_DISK ? e->disk_num_bytes
+                                                      : e->num_bytes;
+  e->compression = BTRFS_COMPRESS_NONE;
+  e->type = st->flags[k] & EXTENT_STORE_PREALLOC ? BTRFS_FILE_EXTENT_PREALLOC
+                                                 : BTRFS_FILE_EXTENT_REG;
+  e->inline_data = NULL;
+  e->inline_data_len = 0;
+  it->file_offset += e->num_bytes;
+  return e;
+}
+
+void btrfs_extent_set_bytenr(struct btrfs_fs_info *fs_info,
+                             struct file_entry *fe, uint32_t index,
+                             uint64_t disk_bytenr) {
+  if (index >= fe->extent_count)
+    return;
+  if (fe->extents)
+    fe->extents[index].disk_bytenr = disk_bytenr;
+  else
+    fs_info->extent_store.bytenr[fe->ext_first + index] = disk_bytenr;
+}
+
+int btrfs_extent_split(struct btrfs_fs_info *fs_info, struct file_entry *fe,
+                       uint32_t index, const uint64_t *disk_lens,
+                       uint32_t pieces) {
+  if (index >= fe->extent_count)
+    return -1;
+
+  struct extent_iter it;
+  const struct file_extent *e = NULL;
+  extent_iter_init(&it, fs_info, fe);
+  while (it.next <= index && (e = extent_iter_next(&it)) != NULL)
+    ;
+  struct file_extent orig = *e;
+
+  /* Pieces past the referenced bytes drop out of this file */
+  uint32_t n = 0;
+  for (uint64_t at = 0; n < pieces && at < orig.num_bytes; n++)
+    at += disk_lens[n];
+  if (n <= 1)
+    return 1;
+
+  uint32_t count = fe->extent_count + n - 1;
+  if (!fe->extents) {
+    /* A packed file cannot grow in place; it becomes an array */
+    struct file_extent *arr =
+        arena_alloc(&fs_info->arena, (size_t)count * sizeof(*arr));
+    if (!arr) {
+      fprintf(stderr, "btrfs2ext4: OOM splitting file extents\n");
+      return -1;
+    }
+    extent_iter_init(&it, fs_info, fe);
+    for (uint32_t j = 0; (e = extent_iter_next(&it)) != NULL; j++)
+      arr[j] = *e;
+    fe->extents = arr;
+    fe->extent_capacity = count;
+  } else if (btrfs_reserve_extents(fs_info, fe, count) < 0) {
+    return -1;
+  }
+
+  if (index + 1 < fe->extent_count)
+    memmove(&fe->extents[index + n], &fe->extents[index + 1],
+            (fe->extent_count - index - 1) * sizeof(struct file_extent));
+
+  uint64_t at = 0;
+  for (uint32_t k = 0; k < n; k++) {
+    struct file_extent *p = &fe->extents[index + k];
+    *p = orig;
+    p->disk_bytenr = orig.disk_bytenr + at;
+    p->disk_num_bytes = disk_lens[k];
+    p->file_offset = orig.file_offset + at;
+    p->num_bytes =
+        disk_lens[k] < orig.num_bytes - at ? disk_lens[k] : orig.num_bytes - at;
+    p->ram_bytes = p->num_bytes;
+    at += disk_lens[k];
+  }
+  fe->extent_count = count;
+  return (int)n;
+}
+
+void btrfs_free_extent_store(struct extent_store *st) {
+  if (st->bytenr)
+    mem_track_free_tag(MEM_TAG_PASS1, st->count * EXTENT_STORE_ROW_BYTES);
+  free(st->bytenr);
+  free(st->disk_len);
+  free(st->len);
+  free(st->flags);
+  memset(st, 0, sizeof(*st));
+}
@@ -6,90 +6,140 @@
  */
 
 #include <endian.h>
+#include <fcntl.h> /* posix_fadvise */
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
+#include "arena.h"
+#include "btrfs/btree.h"
 #include "btrfs/btrfs_reader.h"
 #include "btrfs/btrfs_structures.h"
 #include "btrfs/chunk_tree.h"
+#include "btrfs/extent_store.h"
+#include "btrfs/node_cache.h"
 #include "device_io.h"
+#include "mem_tracker.h"
+#include "thread_pool.h"
 
 /* ========================================================================
  * Internal helpers
  * ======================================================================== */
 
-static struct file_entry *file_entry_create(uint64_t ino) {
-  struct file_entry *fe = calloc(1, sizeof(struct file_entry));
+/* Arrays start empty: directories never get extents, files never children */
+static struct file_entry *file_entry_create(struct btrfs_fs_info *fs_info,
+                                            uint64_t ino) {
+  struct file_entry *fe = arena_alloc(&fs_info->arena, sizeof(*fe));
   if (!fe)
     return NULL;
   fe->ino = ino;
-  fe->extent_capacity = BTRFS_INITIAL_EXTENTS_CAPACITY;
-  fe->extents = calloc(fe->extent_capacity, sizeof(struct file_extent));
-  if (!fe->extents) {
-    free(fe);
-    return NULL;
-  }
   return fe;
 }
 
-static int file_entry_add_extent(struct file_entry *fe,
-                                 const struct file_extent *ext) {
-  /* Phase 2.4: Adjacent Extent Coalescing */
-  if (fe->extent_count > 0) {
-    struct file_extent *last = &fe->extents[fe->extent_count - 1];
-
-    if (last->type != BTRFS_FILE_EXTENT_INLINE &&
-        ext->type != BTRFS_FILE_EXTENT_INLINE &&
-        last->compression == ext->compression &&
-        last->file_offset + last->num_bytes == ext->file_offset &&
-        last->disk_bytenr != 0 && ext->disk_bytenr != 0 &&
-        last->disk_bytenr + last->disk_num_bytes == ext->disk_bytenr) {
-
-      last->num_bytes += ext->num_bytes;
-      last->disk_num_bytes += ext->disk_num_bytes;
-      last->ram_bytes += ext->ram_bytes;
-      return 0;
-    }
+int btrfs_reserve_extents(struct btrfs_fs_info *fs_info, struct file_entry *fe,
+                          uint32_t capacity) {
+  if (capacity <= fe->extent_capacity)
+    return 0;
+  /* Pass 1 arrays come from the extent arena, which packing releases */
+  struct arena *a =
+      fs_info->extents_packed ? &fs_info->arena : &fs_info->extent_arena;
+  struct file_extent *new_ext =
+      arena_grow(a, fe->extents,
+                 (size_t)fe->extent_capacity * sizeof(struct file_extent),
+                 (size_t)capacity * sizeof(struct file_extent));
+  if (!new_ext) {
+    fprintf(stderr, "btrfs2ext4: OOM reallocating file extents\n");
+    return -1;
   }
+  fe->extents = new_ext;
+  fe->extent_capacity = capacity;
+  return 0;
+}
 
-  if (fe->extent_count >= fe->extent_capacity) {
-    uint32_t new_cap = fe->extent_capacity * 2;
-    struct file_extent *new_ext =
-        realloc(fe->extents, new_cap * sizeof(struct file_extent));
-    if (!new_ext) {
-      fprintf(stderr, "btrfs2ext4: OOM reallocating file extents\n");
-      return -1;
-    }
-    fe->extents = new_ext;
-    fe->extent_capacity = new_cap;
+uint64_t btrfs_intern_name(struct btrfs_fs_info *fs_info, const char *name,
+                           uint16_t name_len) {
+  if (name_len > BTRFS_MAX_NAME_LEN)
+    name_len = BTRFS_MAX_NAME_LEN;
+  return str_pool_add(&fs_info->names, name, name_len);
+}
+
+/* Phase 2.4: Adjacent Extent Coalescing — grow `last` if `ext` continues it
+ * both in the file and on disk. Returns 1 if merged. */
+static int file_extent_coalesce(struct file_extent *last,
+                                const struct file_extent *ext) {
+  if (last->type != BTRFS_FILE_EXTENT_INLINE &&
+      ext->type != BTRFS_FILE_EXTENT_INLINE &&
+      last->compression == ext->compression &&
+      last->file_offset + last->num_bytes == ext->file_offset &&
+      last->disk_bytenr != 0 && ext->disk_bytenr != 0 &&
+      last->disk_bytenr + last->disk_num_bytes == ext->disk_bytenr) {
+
+    last->num_bytes += ext->num_bytes;
+    last->disk_num_bytes += ext->disk_num_bytes;
+    last->ram_bytes += ext->ram_bytes;
+    return 1;
   }
+  return 0;
+}
+
+static int file_entry_add_extent(struct btrfs_fs_info *fs_info,
+                                 struct file_entry *fe,
+                                 const struct file_extent *ext) {
+  if (fe->extent_count > 0 &&
+      file_extent_coalesce(&fe->extents[fe->extent_count - 1], ext))
+    return 0;
+
+  if (fe->extent_count >= fe->extent_capacity &&
+      btrfs_reserve_extents(fs_info, fe,
+                            fe->extent_capacity
+                                ? fe->extent_capacity * 2
+                                : BTRFS_INITIAL_EXTENTS_CAPACITY) < 0)
+    return -1;
   fe->extents[fe->extent_count++] = *ext;
   return 0;
 }
 
-static int file_entry_add_child(struct file_entry *parent,
-                                struct file_entry *child, const char *name,
-                                uint16_t name_len) {
-  if (parent->child_count >= parent->child_capacity) {
-    uint32_t new_cap = parent->child_capacity ? parent->child_capacity * 2 : 16;
-    struct dir_entry_link *new_children =
-        realloc(parent->children, new_cap * sizeof(struct dir_entry_link));
-    if (!new_children) {
-      fprintf(stderr, "btrfs2ext4: OOM reallocating dir children\n");
-      return -1;
-    }
-    parent->children = new_children;
-    parent->child_capacity = new_cap;
+static int file_entry_reserve_children(struct btrfs_fs_info *fs_info,
+                                       struct file_entry *parent,
+                                       uint32_t capacity) {
+  if (capacity <= parent->child_capacity)
+    return 0;
+  struct dir_entry_link *new_children = arena_grow(
+      &fs_info->arena, parent->children,
+      (size_t)parent->child_capacity * sizeof(struct dir_entry_link),
+      (size_t)capacity * sizeof(struct dir_entry_link));
+  if (!new_children) {
+    fprintf(stderr, "btrfs2ext4: OOM reallocating dir children\n");
+    return -1;
   }
+  parent->children = new_children;
+  parent->child_capacity = capacity;
+  return 0;
+}
+
+/* The link records child_ino until btrfs_resolve_links() */
+static int file_entry_add_child(struct btrfs_fs_info *fs_info,
+                                struct file_entry *parent, uint64_t child_ino,
+                                const char *name, uint16_t name_len) {
+  if (parent->child_count >= parent->child_capacity &&
+      file_entry_reserve_children(fs_info, parent,
+                                  parent->child_capacity
+                                      ? parent->child_capacity * 2
+                                      : BTRFS_INITIAL_CHILDREN_CAPACITY) < 0)
+    return -1;
+
+  uint64_t off = btrfs_intern_name(fs_info, name, name_len);
+  if (off == STR_POOL_INVALID)
+    return -1;
+
   struct dir_entry_link *link = &parent->children[parent->child_count++];
-  link->target = child;
+  link->target_ino = child_ino;
+  link->name_off = off;
   link->name_len =
       name_len > BTRFS_MAX_NAME_LEN ? BTRFS_MAX_NAME_LEN : name_len;
-  memcpy(link->name, name, link->name_len);
-  link->name[link->name_len] = '\0';
   return 0;
 }
 
@@ -102,6 +152,7 @@ static int ino_ht_grow(struct btrfs_fs_info *fs_info, uint32_t new_cap) {
       calloc(new_cap, sizeof(struct file_entry *));
   if (!new_buckets)
     return -1;
+  mem_track_alloc_tag(MEM_TAG_PASS1, new_cap * sizeof(struct file_entry *));
 
   if (fs_info->ino_ht.buckets) {
     for (uint32_t i = 0; i < fs_info->ino_ht.capacity; i++) {
@@ -114,6 +165,8 @@ static int ino_ht_grow(struct btrfs_fs_info *fs_info, uint32_t new_cap) {
       }
       new_buckets[idx] = fe;
     }
+    mem_track_free_tag(MEM_TAG_PASS1,
+                       fs_info->ino_ht.capacity * sizeof(struct file_entry *));
     free(fs_info->ino_ht.buckets);
   }
 
@@ -172,8 +225,44 @@ static struct file_entry *ino_ht_get(struct btrfs_fs_info *fs_info,
  * Inode table management
  * ======================================================================== */
 
+/*
+ * Index the whole table in a hash sized for it (no rehash on the way) and
+ * leave sorted-append mode. On OOM lookups fall back to a linear scan.
+ */
+static void fs_info_build_hash(struct btrfs_fs_info *fs_info) {
+  fs_info->sorted_append = 0;
+  if (!fs_info->use_hash)
+    return;
+
+  uint32_t cap = 256;
+  while (cap / 2 <= fs_info->inode_count && cap < (1U << 31))
+    cap *= 2;
+  if (fs_info->ino_ht.capacity < cap) {
+    mem_track_free_tag(MEM_TAG_PASS1,
+                       fs_info->ino_ht.capacity * sizeof(struct file_entry *));
+    free(fs_info->ino_ht.buckets);
+    fs_info->ino_ht.buckets = NULL;
+    fs_info->ino_ht.capacity = 0;
+    fs_info->ino_ht.count = 0;
+    if (ino_ht_grow(fs_info, cap) < 0) {
+      fprintf(stderr,
+              "btrfs2ext4: warning: inode hash table disabled (OOM), falling "
+              "back to linear lookups\n");
+      fs_info->use_hash = 0;
+      return;
+    }
+  }
+  for (uint32_t i = 0; i < fs_info->inode_count; i++)
+    ino_ht_insert(fs_info, fs_info->inode_table[i]); /* cannot grow */
+}
+
 static int fs_info_add_inode(struct btrfs_fs_info *fs_info,
                              struct file_entry *fe) {
+  /* Out of order: the table stops being sorted, so index it once */
+  if (fs_info->sorted_append && fs_info->inode_count > 0 &&
+      fs_info->inode_table[fs_info->inode_count - 1]->ino >= fe->ino)
+    fs_info_build_hash(fs_info);
+
   if (fs_info->inode_count >= fs_info->inode_capacity) {
     uint32_t new_cap =
         fs_info->inode_capacity ? fs_info->inode_capacity * 2 : 256;
@@ -183,13 +272,16 @@ static int fs_info_add_inode(struct btrfs_fs_info *fs_info,
       fprintf(stderr, "btrfs2ext4: OOM reallocating inode_table\n");
       return -1;
     }
+    mem_track_alloc_tag(MEM_TAG_PASS1, (new_cap - fs_info->inode_capacity) *
+                                           sizeof(struct file_entry *));
     fs_info->inode_table = new_table;
     fs_info->inode_capacity = new_cap;
   }
   fs_info->inode_table[fs_info->inode_count++] = fe;
 
   /* Best-effort insertion into hash table; fall back to linear scan on OOM */
-  if (fs_info->use_hash && ino_ht_insert(fs_info, fe) < 0) {
+  if (!fs_info->sorted_append && fs_info->use_hash &&
+      ino_ht_insert(fs_info, fe) < 0) {
     fprintf(stderr,
             "btrfs2ext4: warning: inode hash table disabled (OOM), falling "
             "back to linear lookups\n");
@@ -201,15 +293,29 @@ static int fs_info_add_inode(struct btrfs_fs_info *fs_info,
 
 struct file_entry *btrfs_find_inode(struct btrfs_fs_info *fs_info,
                                     uint64_t ino) {
-  /* Fast path: use hash table if available */
-  if (fs_info->use_hash) {
-    struct file_entry *fe = ino_ht_get(fs_info, ino);
-    if (fe)
-      return fe;
+  /* Sorted table: the last entry is the common case, else binary search */
+  if (fs_info->sorted_append) {
+    uint32_t lo = 0, hi = fs_info->inode_count;
+    if (hi > 0 && fs_info->inode_table[hi - 1]->ino == ino)
+      return fs_info->inode_table[hi - 1];
+    while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (fs_info->inode_table[mid]->ino < ino)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo < fs_info->inode_count && fs_info->inode_table[lo]->ino == ino)
+      return fs_info->inode_table[lo];
+    return NULL;
   }
 
-  /* Fallback: linear scan (used during very early phases or if hash disabled)
-   */
+  /* The hash holds every entry while use_hash is set, so a miss is final:
+   * scanning the table after it made each new inode cost O(n) */
+  if (fs_info->use_hash)
+    return ino_ht_get(fs_info, ino);
+
+  /* Fallback: linear scan (hash disabled after OOM) */
   for (uint32_t i = 0; i < fs_info->inode_count; i++) {
     if (fs_info->inode_table[i]->ino == ino)
       return fs_info->inode_table[i];
@@ -217,34 +323,42 @@ struct file_entry *btrfs_find_inode(struct btrfs_fs_info *fs_info,
   return NULL;
 }
 
-static struct file_entry *find_or_create_inode(struct btrfs_fs_info *fs_info,
-                                               uint64_t ino) {
-  struct file_entry *fe = btrfs_find_inode(fs_info, ino);
+struct file_entry *btrfs_get_inode(struct btrfs_fs_info *fs_info,
+                                   uint64_t ino) {
+  /* Sorted append: a key-order walk meets each new inode above the last */
+  int append = fs_info->sorted_append &&
+               (fs_info->inode_count == 0 ||
+                fs_info->inode_table[fs_info->inode_count - 1]->ino < ino);
+  struct file_entry *fe = append ? NULL : btrfs_find_inode(fs_info, ino);
   if (fe)
     return fe;
 
-  fe = file_entry_create(ino);
+  fe = file_entry_create(fs_info, ino);
   if (!fe)
     return NULL;
-  if (fs_info_add_inode(fs_info, fe) < 0) {
-    free(fe->extents);
-    free(fe);
-    return NULL;
-  }
+  if (fs_info_add_inode(fs_info, fe) < 0)
+    return NULL; /* the entry stays in the arena until btrfs_free_fs() */
   return fe;
 }
 
-/* ========================================================================
- * B-tree callback for FS tree items
- * ======================================================================== */
+int btrfs_resolve_links(struct btrfs_fs_info *fs_info) {
+  if (fs_info->sorted_append)
+    fs_info_build_hash(fs_info);
 
-/* Forward declaration of btree_walk callback type */
-typedef int (*btree_callback)(const struct btrfs_disk_key *key,
-                              const void *data, uint32_t data_size, void *ctx);
-extern int btree_walk(struct device *dev, const struct chunk_map *chunk_map,
-                      uint64_t root_logical, uint8_t root_level,
-                      uint32_t nodesize, uint16_t csum_type,
-                      btree_callback callback, void *ctx);
+  /* Entries created here for dangling targets have no children */
+  uint32_t count = fs_info->inode_count;
+  for (uint32_t i = 0; i < count; i++) {
+    struct file_entry *fe = fs_info->inode_table[i];
+    for (uint32_t c = 0; c < fe->child_count; c++) {
+      struct file_entry *target =
+          btrfs_get_inode(fs_info, fe->children[c].target_ino);
+      if (!target)
+        return -1;
+      fe->children[c].target = target;
+    }
+  }
+  return 0;
+}
 
 /* ========================================================================
  * CoW Deduplication Hash Table (Phase 4.1)
@@ -256,6 +370,15 @@ struct cow_hash {
   uint32_t count;
 };
 
+/* Bucket of a sector-aligned bytenr; capacity is a power of two. Hashing
+ * the raw bytenr left every key's low 12 bits zero and piled the whole
+ * table into bucket 0. */
+static inline uint32_t cow_hash_slot(const struct cow_hash *h,
+                                     uint64_t bytenr) {
+  uint64_t x = (bytenr >> 12) * 0x9e3779b97f4a7c15ULL;
+  return (uint32_t)(x >> 32) & (h->capacity - 1);
+}
+
 static void cow_hash_init(struct cow_hash *h, uint32_t initial_cap) {
   h->capacity = initial_cap;
   h->count = 0;
@@ -284,9 +407,9 @@ static int cow_hash_rehash(struct cow_hash *h) {
     if (old_buckets[i] == 0)
       continue;
     uint64_t key = old_buckets[i];
-    uint32_t idx = (uint32_t)(key * 2654435761ULL) % h->capacity;
+    uint32_t idx = cow_hash_slot(h, key);
     while (h->buckets[idx] != 0)
-      idx = (idx + 1) % h->capacity;
+      idx = (idx + 1) & (h->capacity - 1);
     h->buckets[idx] = key;
     h->count++;
   }
@@ -301,12 +424,12 @@ static int cow_hash_check_and_add(struct cow_hash *h, uint64_t bytenr) {
       return -1;
   }
 
-  uint32_t idx = (uint32_t)(bytenr * 2654435761ULL) % h->capacity;
+  uint32_t idx = cow_hash_slot(h, bytenr);
   while (h->buckets[idx] != 0) {
     if (h->buckets[idx] == bytenr) {
       return 1; /* Already seen! It's a CoW duplicate */
     }
-    idx = (idx + 1) % h->capacity;
+    idx = (idx + 1) & (h->capacity - 1);
   }
 
   h->buckets[idx] = bytenr;
@@ -314,11 +437,76 @@ static int cow_hash_check_and_add(struct cow_hash *h, uint64_t bytenr) {
   return 0; /* First time seeing this physical layout */
 }
 
+/* Physical extent reference recorded by a parallel scan shard */
+struct cow_ref {
+  uint64_t disk_bytenr;
+  uint64_t disk_num_bytes;
+};
+
 struct fs_tree_ctx {
   struct btrfs_fs_info *fs_info;
   struct cow_hash cow_track;
+
+  /* Parallel scan: CoW detection needs every shard's extents, so shards only
+   * record them here and the merge replays them in key order. */
+  int defer_cow;
+  struct cow_ref *cow_refs;
+  uint32_t cow_ref_count;
+  uint32_t cow_ref_capacity;
+
+  /* Inode of the previous item: a leaf holds an inode's items together */
+  struct file_entry *cur;
 };
 
+static struct file_entry *fs_tree_inode(struct fs_tree_ctx *fctx,
+                                        uint64_t ino) {
+  if (fctx->cur && fctx->cur->ino == ino)
+    return fctx->cur;
+  struct file_entry *fe = btrfs_get_inode(fctx->fs_info, ino);
+  if (fe)
+    fctx->cur = fe;
+  return fe;
+}
+
+static int cow_ref_add(struct fs_tree_ctx *fctx, uint64_t disk_bytenr,
+                       uint64_t disk_num_bytes) {
+  if (fctx->cow_ref_count >= fctx->cow_ref_capacity) {
+    uint32_t new_cap =
+        fctx->cow_ref_capacity ? fctx->cow_ref_capacity * 2 : 256;
+    struct cow_ref *new_refs =
+        realloc(fctx->cow_refs, new_cap * sizeof(struct cow_ref));
+    if (!new_refs) {
+      fprintf(stderr, "btrfs2ext4: OOM reallocating CoW reference list\n");
+      return -1;
+    }
+    fctx->cow_refs = new_refs;
+    fctx->cow_ref_capacity = new_cap;
+  }
+  fctx->cow_refs[fctx->cow_ref_count].disk_bytenr = disk_bytenr;
+  fctx->cow_refs[fctx->cow_ref_count].disk_num_bytes = disk_num_bytes;
+  fctx->cow_ref_count++;
+  return 0;
+}
+
+/* Account one physical extent reference against the CoW tracker */
+static void cow_account(struct btrfs_fs_info *fs_info, struct cow_hash *h,
+                        uint64_t disk_bytenr, uint64_t disk_num_bytes) {
+  if (cow_hash_check_and_add(h, disk_bytenr)) {
+    /* We have seen this physical block sequence before. Needs clone. */
+    fs_info->shared_extent_count++;
+
+    /* Add to required deduplication physical blocks count */
+    uint32_t block_size =
+        fs_info->sb.sectorsize ? le32toh(fs_info->sb.sectorsize) : 4096;
+    fs_info->dedup_blocks_needed +=
+        (disk_num_bytes + block_size - 1) / block_size;
+  }
+}
+
+/* ========================================================================
+ * B-tree callback for FS tree items
+ * ======================================================================== */
+
 static int fs_tree_callback(const struct btrfs_disk_key *key, const void *data,
                             uint32_t data_size, void *ctx) {
   struct fs_tree_ctx *fctx = (struct fs_tree_ctx *)ctx;
@@ -333,7 +521,7 @@ static int fs_tree_callback(const struct btrfs_disk_key *key, const void *data,
       break;
 
     const struct btrfs_inode_item *ii = (const struct btrfs_inode_item *)data;
-    struct file_entry *fe = find_or_create_inode(fs_info, objectid);
+    struct file_entry *fe = fs_tree_inode(fctx, objectid);
     if (!fe)
       return -1;
 
@@ -361,12 +549,13 @@ static int fs_tree_callback(const struct btrfs_disk_key *key, const void *data,
 
     uint64_t parent_ino = le64toh(key->offset);
 
-    struct file_entry *fe = find_or_create_inode(fs_info, objectid);
+    struct file_entry *fe = fs_tree_inode(fctx, objectid);
     if (!fe)
       return -1;
 
-    /* Set primary parent_ino for '..' directory links */
-    if (fe->parent_ino == 0) {
+    /* Set primary parent_ino for '..' directory links: the lowest one,
+     * which is the first in key order, whatever order leaves arrive in */
+    if (fe->parent_ino == 0 || parent_ino < fe->parent_ino) {
       fe->parent_ino = parent_ino;
     }
 
@@ -391,13 +580,14 @@ static int fs_tree_callback(const struct btrfs_disk_key *key, const void *data,
     if (data_size < sizeof(struct btrfs_dir_item) + name_len)
       break;
 
-    struct file_entry *parent = find_or_create_inode(fs_info, parent_ino);
-    struct file_entry *child = find_or_create_inode(fs_info, child_ino);
-    if (!parent || !child)
+    /* The child usually has a higher objectid and no entry yet: keep its
+     * number and resolve it once the walk is over */
+    struct file_entry *parent = fs_tree_inode(fctx, parent_ino);
+    if (!parent)
       return -1;
 
     const char *name = (const char *)(di + 1);
-    file_entry_add_child(parent, child, name, name_len);
+    file_entry_add_child(fs_info, parent, child_ino, name, name_len);
     break;
   }
 
@@ -408,7 +598,7 @@ static int fs_tree_callback(const struct btrfs_disk_key *key, const void *data,
     const struct btrfs_file_extent_item *fi =
         (const struct btrfs_file_extent_item *)data;
 
-    struct file_entry *fe = find_or_create_inode(fs_info, objectid);
+    struct file_entry *fe = fs_tree_inode(fctx, objectid);
     if (!fe)
       return -1;
 
@@ -424,7 +614,7 @@ static int fs_tree_callback(const struct btrfs_disk_key *key, const void *data,
       size_t header_size = offsetof(struct btrfs_file_extent_item, disk_bytenr);
       if (data_size > header_size) {
         ext.inline_data_len = data_size - header_size;
-        ext.inline_data = malloc(ext.inline_data_len);
+        ext.inline_data = arena_alloc(&fs_info->arena, ext.inline_data_len);
         if (ext.inline_data) {
           memcpy(ext.inline_data, (const uint8_t *)data + header_size,
                  ext.inline_data_len);
@@ -440,21 +630,18 @@ static int fs_tree_callback(const struct btrfs_disk_key *key, const void *data,
 
         /* CoW Deduplication Tracking (Phase 4.1) */
         if (ext.disk_bytenr != 0 && ext.type != BTRFS_FILE_EXTENT_INLINE) {
-          if (cow_hash_check_and_add(&fctx->cow_track, ext.disk_bytenr)) {
-            /* We have seen this physical block sequence before. Needs clone. */
-            fs_info->shared_extent_count++;
-
-            /* Add to required deduplication physical blocks count */
-            uint32_t block_size =
-                fs_info->sb.sectorsize ? le32toh(fs_info->sb.sectorsize) : 4096;
-            fs_info->dedup_blocks_needed +=
-                (ext.disk_num_bytes + block_size - 1) / block_size;
+          if (fctx->defer_cow) {
+            if (cow_ref_add(fctx, ext.disk_bytenr, ext.disk_num_bytes) < 0)
+              return -1;
+          } else {
+            cow_account(fs_info, &fctx->cow_track, ext.disk_bytenr,
+                        ext.disk_num_bytes);
           }
         }
       }
     }
 
-    file_entry_add_extent(fe, &ext);
+    file_entry_add_extent(fs_info, fe, &ext);
     break;
   }
 
@@ -470,32 +657,26 @@ static int fs_tree_callback(const struct btrfs_disk_key *key, const void *data,
     if (data_size < sizeof(struct btrfs_dir_item) + name_len + data_len)
       break; /* Bounds check */
 
-    struct file_entry *fe = find_or_create_inode(fs_info, objectid);
+    struct file_entry *fe = fs_tree_inode(fctx, objectid);
     if (!fe)
       break;
 
-    struct xattr_entry *xattr = malloc(sizeof(struct xattr_entry));
+    /* Entry, name and value in one arena block */
+    struct xattr_entry *xattr = arena_alloc(
+        &fs_info->arena, sizeof(struct xattr_entry) + name_len + 1 + data_len);
     if (xattr) {
+      const uint8_t *payload = (const uint8_t *)(di + 1);
       xattr->name_len = name_len;
       xattr->value_len = data_len;
-      xattr->name = malloc(name_len + 1);
-      xattr->value = data_len > 0 ? malloc(data_len) : NULL;
-
-      if (xattr->name && (data_len == 0 || xattr->value)) {
-        const uint8_t *payload = (const uint8_t *)(di + 1);
-        memcpy(xattr->name, payload, name_len);
-        xattr->name[name_len] = '\0';
-        if (data_len > 0)
-          memcpy(xattr->value, payload + name_len, data_len);
-
-        /* Link it */
-        xattr->next = fe->xattrs;
-        fe->xattrs = xattr;
-      } else {
-        free(xattr->name);
-        free(xattr->value);
-        free(xattr);
-      }
+      xattr->name = (char *)(xattr + 1);
+      memcpy(xattr->name, payload, name_len); /* NUL from the zeroed block */
+      xattr->value = data_len > 0 ? xattr->name + name_len + 1 : NULL;
+      if (data_len > 0)
+        memcpy(xattr->value, payload + name_len, data_len);
+
+      /* Link it */
+      xattr->next = fe->xattrs;
+      fe->xattrs = xattr;
     }
     break;
   }
@@ -508,6 +689,322 @@ static int fs_tree_callback(const struct btrfs_disk_key *key, const void *data,
   return 0;
 }
 
+/* ========================================================================
+ * Parallel FS-tree scan (thread-local shards merged after the walk)
+ * ======================================================================== */
+
+static uint32_t g_scan_threads = 0; /* 0 = one per usable CPU */
+static uint8_t g_scan_split_level = BTREE_SPLIT_AUTO;
+static enum btrfs_scan_order g_scan_order = BTRFS_SCAN_AUTO;
+
+#define FS_SCAN_MAX_THREADS 64
+
+void btrfs_set_scan_parallelism(uint32_t threads, uint8_t split_level) {
+  g_scan_threads = threads;
+  g_scan_split_level = split_level;
+}
+
+void btrfs_set_scan_order(enum btrfs_scan_order order) {
+  g_scan_order = order;
+}
+
+static struct adaptive_mem_config g_mem_cfg;
+static int g_mem_cfg_set = 0;
+
+void btrfs_set_memory_config(const struct adaptive_mem_config *cfg) {
+  g_mem_cfg_set = cfg != NULL;
+  if (cfg)
+    g_mem_cfg = *cfg;
+}
+
+/* Let the Pass 1 arenas spill to the workdir past the memory budget */
+static void fs_info_open_spill(struct btrfs_fs_info *fs_info) {
+  if (!g_mem_cfg_set || g_mem_cfg.mmap_threshold == 0)
+    return;
+  struct arena_spill *spill = malloc(sizeof(*spill));
+  if (!spill || arena_spill_open(spill, g_mem_cfg.workdir,
+                                 g_mem_cfg.mmap_threshold) < 0) {
+    fprintf(stderr,
+            "btrfs2ext4: warning: cannot create Pass 1 spill file in %s, "
+            "keeping all metadata in RAM\n",
+            g_mem_cfg.workdir ? g_mem_cfg.workdir : ".");
+    free(spill);
+    return;
+  }
+  fs_info->spill = spill;
+  fs_info->arena.spill = spill;
+  fs_info->extent_arena.spill = spill;
+}
+
+/* Physical order only pays off where seeks cost milliseconds */
+static int fs_scan_physical(struct device *dev) {
+  if (g_scan_order != BTRFS_SCAN_AUTO)
+    return g_scan_order == BTRFS_SCAN_PHYSICAL;
+  return device_is_rotational(dev) == 1;
+}
+
+static int file_extent_offset_cmp(const void *a, const void *b) {
+  const struct file_extent *ea = (const struct file_extent *)a;
+  const struct file_extent *eb = (const struct file_extent *)b;
+  if (ea->file_offset < eb->file_offset)
+    return -1;
+  if (ea->file_offset > eb->file_offset)
+    return 1;
+  return 0;
+}
+
+/*
+ * A physical-order walk delivers an inode's EXTENT_DATA items leaf by leaf
+ * in disk order. Put each extent list back in file order and coalesce the
+ * neighbours that landed in different leaves.
+ */
+static void fs_sort_extents(struct btrfs_fs_info *fs_info) {
+  for (uint32_t i = 0; i < fs_info->inode_count; i++) {
+    struct file_entry *fe = fs_info->inode_table[i];
+    uint32_t j;
+    for (j = 1; j < fe->extent_count; j++) {
+      if (fe->extents[j].file_offset < fe->extents[j - 1].file_offset)
+        break;
+    }
+    if (j >= fe->extent_count)
+      continue; /* already in order */
+
+    qsort(fe->extents, fe->extent_count, sizeof(struct file_extent),
+          file_extent_offset_cmp);
+    uint32_t out = 0;
+    for (j = 1; j < fe->extent_count; j++) {
+      if (!file_extent_coalesce(&fe->extents[out], &fe->extents[j]))
+        fe->extents[++out] = fe->extents[j];
+    }
+    fe->extent_count = out + 1;
+  }
+}
+
+static uint32_t fs_scan_thread_count(void) {
+  uint32_t threads = g_scan_threads;
+  if (threads == 0)
+    threads = thread_pool_default_threads(); /* CPUs, affinity, cgroup */
+  return threads > FS_SCAN_MAX_THREADS ? FS_SCAN_MAX_THREADS : threads;
+}
+
+/* One subtree's private view: inodes land in `info`, not the global table */
+struct fs_scan_shard {
+  struct fs_tree_ctx ctx;
+  struct btrfs_fs_info info;
+};
+
+struct fs_scan_shards {
+  const struct btrfs_fs_info *fs_info;
+  struct fs_scan_shard **shards;
+  uint32_t count;
+  uint32_t capacity;
+};
+
+static void *fs_scan_new_shard(uint32_t shard_index, void *arg) {
+  struct fs_scan_shards *ss = (struct fs_scan_shards *)arg;
+  (void)shard_index;
+
+  if (ss->count >= ss->capacity) {
+    uint32_t new_cap = ss->capacity ? ss->capacity * 2 : 64;
+    struct fs_scan_shard **new_shards =
+        realloc(ss->shards, new_cap * sizeof(struct fs_scan_shard *));
+    if (!new_shards) {
+      fprintf(stderr, "btrfs2ext4: OOM reallocating FS scan shards\n");
+      return NULL;
+    }
+    ss->shards = new_shards;
+    ss->capacity = new_cap;
+  }
+
+  struct fs_scan_shard *shard = calloc(1, sizeof(struct fs_scan_shard));
+  if (!shard) {
+    fprintf(stderr, "btrfs2ext4: OOM allocating FS scan shard\n");
+    return NULL;
+  }
+  shard->info.sb = ss->fs_info->sb;
+  shard->info.use_hash = 1;
+  shard->info.sorted_append = 1; /* a subtree is a contiguous key range */
+  shard->info.arena.spill = ss->fs_info->spill;
+  shard->info.extent_arena.spill = ss->fs_info->spill;
+  shard->ctx.fs_info = &shard->info;
+  shard->ctx.defer_cow = 1;
+
+  ss->shards[ss->count++] = shard;
+  return &shard->ctx;
+}
+
+/* Free the file entries a shard still owns (merge failure / walk error) */
+static void fs_scan_shard_free(struct fs_scan_shard *shard) {
+  btrfs_free_fs(&shard->info);
+  free(shard->ctx.cow_refs);
+  free(shard);
+}
+
+/*
+ * Fold `src` (seen in a later shard) into `dst` (first seen), reproducing
+ * what a sequential walk would have built: items of one inode can straddle
+ * subtree boundaries.
+ */
+static int file_entry_merge(struct btrfs_fs_info *fs_info,
+                            struct file_entry *dst, struct file_entry *src) {
+  /* mode is never 0 once the INODE_ITEM has been parsed */
+  if (dst->mode == 0 && src->mode != 0) {
+    dst->mode = src->mode;
+    dst->uid = src->uid;
+    dst->gid = src->gid;
+    dst->nlink = src->nlink;
+    dst->size = src->size;
+    dst->rdev = src->rdev;
+    dst->atime_sec = src->atime_sec;
+    dst->atime_nsec = src->atime_nsec;
+    dst->mtime_sec = src->mtime_sec;
+    dst->mtime_nsec = src->mtime_nsec;
+    dst->ctime_sec = src->ctime_sec;
+    dst->ctime_nsec = src->ctime_nsec;
+    dst->crtime_sec = src->crtime_sec;
+    dst->crtime_nsec = src->crtime_nsec;
+  }
+  if (dst->parent_ino == 0)
+    dst->parent_ino = src->parent_ino;
+
+  if (src->child_count > 0) {
+    uint32_t need = dst->child_count + src->child_count;
+    if (file_entry_reserve_children(fs_info, dst, need) < 0)
+      return -1;
+    memcpy(&dst->children[dst->child_count], src->children,
+           src->child_count * sizeof(struct dir_entry_link));
+    dst->child_count = need;
+    src->child_count = 0;
+  }
+
+  /* Extents go through the normal path so boundary extents still coalesce;
+   * inline data ownership moves to dst. */
+  for (uint32_t i = 0; i < src->extent_count; i++) {
+    if (file_entry_add_extent(fs_info, dst, &src->extents[i]) < 0) {
+      /* Entries [i, count) still belong to src */
+      memmove(src->extents, &src->extents[i],
+              (src->extent_count - i) * sizeof(struct file_extent));
+      src->extent_count -= i;
+      return -1;
+    }
+  }
+  src->extent_count = 0;
+
+  /* Sequential parsing prepends xattrs, so later ones go first */
+  if (src->xattrs) {
+    struct xattr_entry *tail = src->xattrs;
+    while (tail->next)
+      tail = tail->next;
+    tail->next = dst->xattrs;
+    dst->xattrs = src->xattrs;
+    src->xattrs = NULL;
+  }
+
+  return 0;
+}
+
+/*
+ * Merge shards into fs_info in key order. Each shard's table is sorted and
+ * shards cover ascending key ranges, so inodes append in order and only one
+ * split across a boundary meets an existing entry. The CoW references are
+ * replayed through a single tracker so reflinks that span shards are still
+ * detected. Dirents still hold inode numbers; btrfs_resolve_links() follows.
+ */
+static int fs_scan_merge_shards(struct btrfs_fs_info *fs_info,
+                                struct fs_scan_shards *ss) {
+  struct cow_hash cow_track;
+  cow_hash_init(&cow_track, 1024);
+  if (!cow_track.buckets)
+    return -1;
+
+  int ret = 0;
+
+  for (uint32_t s = 0; s < ss->count && ret == 0; s++) {
+    struct fs_scan_shard *shard = ss->shards[s];
+    struct btrfs_fs_info *sfs = &shard->info;
+
+    /* The shard's objects join the global arena; its names are appended to
+     * the global pool, so its dirents are rebased by the copy offset */
+    arena_adopt(&fs_info->arena, &sfs->arena);
+    arena_adopt(&fs_info->extent_arena, &sfs->extent_arena);
+    uint64_t name_base = str_pool_append(&fs_info->names, &sfs->names);
+    if (name_base == STR_POOL_INVALID) {
+      ret = -1;
+      break;
+    }
+    for (uint32_t i = 0; i < sfs->inode_count; i++) {
+      struct file_entry *fe = sfs->inode_table[i];
+      for (uint32_t c = 0; c < fe->child_count; c++)
+        fe->children[c].name_off += name_base;
+    }
+    str_pool_free(&sfs->names);
+
+    uint32_t i;
+    for (i = 0; i < sfs->inode_count; i++) {
+      struct file_entry *fe = sfs->inode_table[i];
+      /* Sorted: anything above the last merged inode is new */
+      uint32_t n = fs_info->inode_count;
+      struct file_entry *dst = NULL;
+      if (!fs_info->sorted_append ||
+          (n > 0 && fs_info->inode_table[n - 1]->ino >= fe->ino))
+        dst = btrfs_find_inode(fs_info, fe->ino);
+
+      if (!dst) {
+        if (fs_info_add_inode(fs_info, fe) < 0) {
+          ret = -1;
+          break;
+        }
+        sfs->inode_table[i] = NULL;
+        continue;
+      }
+
+      if (file_entry_merge(fs_info, dst, fe) < 0) {
+        ret = -1;
+        break;
+      }
+      /* The emptied shell is arena memory, released with fs_info */
+      sfs->inode_table[i] = NULL;
+    }
+
+    for (uint32_t r = 0; r < shard->ctx.cow_ref_count && ret == 0; r++) {
+      cow_account(fs_info, &cow_track, shard->ctx.cow_refs[r].disk_bytenr,
+                  shard->ctx.cow_refs[r].disk_num_bytes);
+    }
+  }
+
+  free(cow_track.buckets);
+  return ret;
+}
+
+/*
+ * Walk the FS tree with one shard per subtree, then merge.
+ * Returns 0 on success, -1 on error.
+ */
+static int fs_tree_walk_parallel(struct device *dev,
+                                 struct btrfs_fs_info *fs_info,
+                                 uint64_t fs_tree_bytenr, uint8_t fs_tree_level,
+                                 uint32_t nodesize, uint32_t threads) {
+  struct fs_scan_shards ss;
+  memset(&ss, 0, sizeof(ss));
+  ss.fs_info = fs_info;
+
+  int shards = btree_walk_parallel(
+      dev, fs_info->chunk_map, fs_tree_bytenr, fs_tree_level, nodesize,
+      le16toh(fs_info->sb.csum_type), g_scan_split_level, threads,
+      fs_tree_callback, fs_scan_new_shard, &ss);
+
+  int ret = shards < 0 ? -1 : 0;
+  if (ret == 0) {
+    printf("  Parallel scan: %u subtrees on %u threads\n", ss.count, threads);
+    ret = fs_scan_merge_shards(fs_info, &ss);
+  }
+
+  for (uint32_t s = 0; s < ss.count; s++)
+    fs_scan_shard_free(ss.shards[s]);
+  free(ss.shards);
+  return ret;
+}
+
 /* ========================================================================
  * B-tree callback for root tree (to find FS tree root)
  * ======================================================================== */
@@ -559,28 +1056,65 @@ static int root_tree_callback(const struct btrfs_disk_key *key,
  * B-tree callback for extent tree (to build used-block map)
  * ======================================================================== */
 
+/*
+ * Streaming usage builder. Extent items arrive in bytenr order (per leaf,
+ * at least), so adjacent and overlapping items are merged into one pending
+ * logical range; only when the next item does not touch it is the range
+ * resolved through the chunk map and set in the usage bitmap.
+ */
 struct extent_tree_ctx {
-  struct used_block_map *map;
+  const struct chunk_map *chunk_map;
+  struct usage_map *usage;
+  uint32_t nodesize;
+  int error;
+  /* Pending merged range, logical bytes */
+  uint64_t start;
+  uint64_t end;
+  int meta;
+  int pending;
 };
 
-static int used_block_map_add(struct used_block_map *map, uint64_t start,
-                              uint64_t length, uint64_t flags) {
-  if (map->count >= map->capacity) {
-    uint32_t new_cap = map->capacity ? map->capacity * 2 : 256;
-    struct used_extent *new_ext =
-        realloc(map->extents, new_cap * sizeof(struct used_extent));
-    if (!new_ext) {
-      fprintf(stderr, "btrfs2ext4: OOM reallocating used block map\n");
-      return -1;
+/* Resolve the pending range chunk by chunk into the usage map */
+static void usage_builder_flush(struct extent_tree_ctx *ectx) {
+  if (!ectx->pending)
+    return;
+  ectx->pending = 0;
+  ectx->usage->ranges++;
+
+  uint64_t addr = ectx->start;
+  while (addr < ectx->end) {
+    const struct chunk_mapping *c = chunk_map_find(ectx->chunk_map, addr);
+    if (!c)
+      return; /* unmapped: nothing on disk to protect */
+    uint64_t chunk_end = c->logical + c->length;
+    uint64_t seg_end = ectx->end < chunk_end ? ectx->end : chunk_end;
+    uint64_t phys = c->physical + (addr - c->logical);
+    if (ectx->meta) {
+      if (usage_map_add_meta(ectx->usage, phys, seg_end - addr) < 0)
+        ectx->error = 1;
+    } else {
+      usage_map_set(ectx->usage, phys, seg_end - addr, 1);
     }
-    map->extents = new_ext;
-    map->capacity = new_cap;
+    addr = seg_end;
   }
-  map->extents[map->count].start = start;
-  map->extents[map->count].length = length;
-  map->extents[map->count].flags = flags;
-  map->count++;
-  return 0;
+}
+
+static void usage_builder_add(struct extent_tree_ctx *ectx, uint64_t start,
+                              uint64_t length, int meta) {
+  if (length == 0 || start + length < start)
+    return;
+  ectx->usage->items++;
+  if (ectx->pending && meta == ectx->meta && start >= ectx->start &&
+      start <= ectx->end) {
+    if (start + length > ectx->end)
+      ectx->end = start + length;
+    return;
+  }
+  usage_builder_flush(ectx);
+  ectx->start = start;
+  ectx->end = start + length;
+  ectx->meta = meta;
+  ectx->pending = 1;
 }
 
 static int extent_tree_callback(const struct btrfs_disk_key *key,
@@ -595,22 +1129,51 @@ static int extent_tree_callback(const struct btrfs_disk_key *key,
           (const struct btrfs_extent_item *)data;
       uint64_t start = le64toh(key->objectid);
       uint64_t length;
+      int meta;
 
       if (key->type == BTRFS_EXTENT_ITEM_KEY) {
         length = le64toh(key->offset);
+        meta = (le64toh(ei->flags) & BTRFS_EXTENT_FLAG_TREE_BLOCK) != 0;
       } else {
-        /* METADATA_ITEM uses nodesize as implicit length */
-        length = 0; /* Will be filled in later with nodesize */
+        /* METADATA_ITEM (skinny metadata) is one node long */
+        length = ectx->nodesize;
+        meta = 1;
       }
 
-      uint64_t flags = le64toh(ei->flags);
-      used_block_map_add(ectx->map, start, length, flags);
+      usage_builder_add(ectx, start, length, meta);
     }
   }
 
   return 0;
 }
 
+int btrfs_build_usage_map(struct btrfs_fs_info *fs_info,
+                          uint64_t device_size) {
+  if (!fs_info->usage.bits &&
+      usage_map_init(&fs_info->usage, device_size,
+                     le32toh(fs_info->sb.sectorsize)) < 0)
+    return -1;
+
+  struct extent_tree_ctx ectx;
+  memset(&ectx, 0, sizeof(ectx));
+  ectx.chunk_map = fs_info->chunk_map;
+  ectx.usage = &fs_info->usage;
+
+  for (uint32_t i = 0; i < fs_info->inode_count; i++) {
+    struct extent_iter it;
+    extent_iter_init(&it, fs_info, fs_info->inode_table[i]);
+    const struct file_extent *ext;
+    while ((ext = extent_iter_next(&it)) != NULL) {
+      if (ext->type == BTRFS_FILE_EXTENT_INLINE || ext->disk_bytenr == 0)
+        continue;
+      usage_builder_add(&ectx, ext->disk_bytenr, ext->disk_num_bytes, 0);
+    }
+  }
+  usage_builder_flush(&ectx);
+  usage_map_finish(&fs_info->usage);
+  return 0;
+}
+
 /* ========================================================================
  * Public API
  * ======================================================================== */
@@ -618,10 +1181,12 @@ static int extent_tree_callback(const struct btrfs_disk_key *key,
 extern int btrfs_read_superblock(struct device *dev,
                                  struct btrfs_super_block *sb);
 
-int btrfs_read_fs(struct device *dev, struct btrfs_fs_info *fs_info) {
+static int btrfs_read_trees(struct device *dev,
+                            struct btrfs_fs_info *fs_info) {
   memset(fs_info, 0, sizeof(*fs_info));
   fs_info->dev = dev;
   fs_info->use_hash = 1;
+  fs_info_open_spill(fs_info);
 
   printf("=== Phase 1: Reading Btrfs Metadata ===\n\n");
 
@@ -630,6 +1195,9 @@ int btrfs_read_fs(struct device *dev, struct btrfs_fs_info *fs_info) {
   if (btrfs_read_superblock(dev, &fs_info->sb) < 0)
     return -1;
 
+  /* One node cache for the chunk, root, FS and extent tree walks */
+  node_cache_init(le32toh(fs_info->sb.nodesize), 0);
+
   /* Step 2: Bootstrap chunk mappings from sys_chunk_array */
   printf("Step 2/6: Bootstrapping chunk mappings...\n");
   fs_info->chunk_map = calloc(1, sizeof(struct chunk_map));
@@ -668,54 +1236,105 @@ int btrfs_read_fs(struct device *dev, struct btrfs_fs_info *fs_info) {
 
   /* Step 5: Walk FS tree to build file/directory tree */
   printf("Step 5/6: Walking filesystem tree...\n");
-  struct fs_tree_ctx fctx;
-  memset(&fctx, 0, sizeof(fctx));
-  fctx.fs_info = fs_info;
-  cow_hash_init(&fctx.cow_track, 1024);
-
-  if (btree_walk(dev, fs_info->chunk_map, rctx.fs_tree_bytenr,
-                 rctx.fs_tree_level, nodesize, le16toh(fs_info->sb.csum_type),
-                 fs_tree_callback, &fctx) < 0) {
-    fprintf(stderr, "btrfs2ext4: failed to walk FS tree\n");
+  uint32_t scan_threads = fs_scan_thread_count();
+  int physical = fs_scan_physical(dev);
+
+  /* Key order meets inodes in ascending objectid order: append them and
+   * index the table once at the end instead of hashing every item */
+  fs_info->sorted_append = !physical;
+
+  if (physical) {
+    struct fs_tree_ctx fctx;
+    memset(&fctx, 0, sizeof(fctx));
+    fctx.fs_info = fs_info;
+    cow_hash_init(&fctx.cow_track, 1024);
+
+    printf("  Physical-order scan (elevator sweep per tree level)\n");
+    if (btree_walk_physical(dev, fs_info->chunk_map, rctx.fs_tree_bytenr,
+                            rctx.fs_tree_level, nodesize,
+                            le16toh(fs_info->sb.csum_type), fs_tree_callback,
+                            &fctx) < 0) {
+      fprintf(stderr, "btrfs2ext4: failed to walk FS tree\n");
+      free(fctx.cow_track.buckets);
+      return -1;
+    }
+
+    free(fctx.cow_track.buckets);
+    fs_sort_extents(fs_info);
+  } else if (scan_threads > 1) {
+    if (fs_tree_walk_parallel(dev, fs_info, rctx.fs_tree_bytenr,
+                              rctx.fs_tree_level, nodesize,
+                              scan_threads) < 0) {
+      fprintf(stderr, "btrfs2ext4: failed to walk FS tree\n");
+      return -1;
+    }
+  } else {
+    struct fs_tree_ctx fctx;
+    memset(&fctx, 0, sizeof(fctx));
+    fctx.fs_info = fs_info;
+    cow_hash_init(&fctx.cow_track, 1024);
+
+    if (btree_walk(dev, fs_info->chunk_map, rctx.fs_tree_bytenr,
+                   rctx.fs_tree_level, nodesize,
+                   le16toh(fs_info->sb.csum_type), fs_tree_callback,
+                   &fctx) < 0) {
+      fprintf(stderr, "btrfs2ext4: failed to walk FS tree\n");
+      free(fctx.cow_track.buckets);
+      return -1;
+    }
+
     free(fctx.cow_track.buckets);
-    return -1;
   }
 
-  free(fctx.cow_track.buckets);
+  if (btrfs_resolve_links(fs_info) < 0) {
+    fprintf(stderr, "btrfs2ext4: OOM resolving directory entries\n");
+    return -1;
+  }
 
   /* Step 6: Walk extent tree to build used-block map */
   printf("Step 6/6: Walking extent tree...\n");
 
   /* The extent tree is rooted separately, we need to find it in the root tree.
    */
+  if (usage_map_init(&fs_info->usage, dev->size,
+                     le32toh(fs_info->sb.sectorsize)) < 0)
+    return -1;
+
   struct extent_tree_ctx ectx;
-  ectx.map = &fs_info->used_blocks;
+  memset(&ectx, 0, sizeof(ectx));
+  ectx.chunk_map = fs_info->chunk_map;
+  ectx.usage = &fs_info->usage;
+  ectx.nodesize = nodesize;
 
   if (rctx.found_extent) {
-    if (btree_walk(dev, fs_info->chunk_map, rctx.extent_tree_bytenr,
-                   rctx.extent_tree_level, nodesize,
-                   le16toh(fs_info->sb.csum_type), extent_tree_callback,
-                   &ectx) < 0) {
+    /* Items merge best in key order, but the bitmap takes any order */
+    int (*walk)(struct device *, const struct chunk_map *, uint64_t, uint8_t,
+                uint32_t, uint16_t, btree_callback, void *) =
+        physical ? btree_walk_physical : btree_walk;
+    if (walk(dev, fs_info->chunk_map, rctx.extent_tree_bytenr,
+             rctx.extent_tree_level, nodesize, le16toh(fs_info->sb.csum_type),
+             extent_tree_callback, &ectx) < 0) {
       fprintf(stderr, "btrfs2ext4: warning: extent tree walk failed, "
                       "using FS tree extents only\n");
       rctx.found_extent = 0;
     }
+    usage_builder_flush(&ectx);
+    usage_map_finish(&fs_info->usage);
+    if (ectx.error)
+      return -1;
   }
 
   if (!rctx.found_extent) {
-    /* Build used-block map from FS tree data extents (sufficient for v1) */
-    for (uint32_t i = 0; i < fs_info->inode_count; i++) {
-      const struct file_entry *fe = fs_info->inode_table[i];
-      for (uint32_t j = 0; j < fe->extent_count; j++) {
-        const struct file_extent *ext = &fe->extents[j];
-        if (ext->type == BTRFS_FILE_EXTENT_INLINE || ext->disk_bytenr == 0)
-          continue;
-        used_block_map_add(&fs_info->used_blocks, ext->disk_bytenr,
-                           ext->disk_num_bytes, BTRFS_BLOCK_GROUP_DATA);
-      }
-    }
+    /* Data extents from the FS tree (sufficient for v1) */
+    if (btrfs_build_usage_map(fs_info, dev->size) < 0)
+      return -1;
   }
-  printf("  Built used-block map: %u extents\n", fs_info->used_blocks.count);
+  printf("  Built usage map: %lu extents merged into %lu ranges "
+         "(%.1f MiB bitmap)\n",
+         (unsigned long)fs_info->usage.items,
+         (unsigned long)fs_info->usage.ranges,
+         (double)((fs_info->usage.granules + 63) / 64 * 8) /
+             (1024.0 * 1024.0));
 
   /* Compute compression statistics for space check in Pass 2 */
   fs_info->total_compressed_bytes = 0;
@@ -749,10 +1368,6 @@ int btrfs_read_fs(struct device *dev, struct btrfs_fs_info *fs_info) {
                (1024.0 * 1024.0));
   }
 
-  /* Suppress unused warning — extent_tree_callback will be used for full
-   * extent tree walking in a future version */
-  (void)extent_tree_callback;
-
   /* Read symlink targets for symlink inodes */
   for (uint32_t i = 0; i < fs_info->inode_count; i++) {
     struct file_entry *fe = fs_info->inode_table[i];
@@ -770,11 +1385,8 @@ int btrfs_read_fs(struct device *dev, struct btrfs_fs_info *fs_info) {
                   (unsigned long)fe->ino, tlen);
           break;
         }
-        fe->symlink_target = malloc(tlen + 1);
-        if (fe->symlink_target) {
-          memcpy(fe->symlink_target, fe->extents[j].inline_data, tlen);
-          fe->symlink_target[tlen] = '\0';
-        }
+        fe->symlink_target = arena_strndup(
+            &fs_info->arena, (const char *)fe->extents[j].inline_data, tlen);
         break;
       }
     }
@@ -787,45 +1399,54 @@ int btrfs_read_fs(struct device *dev, struct btrfs_fs_info *fs_info) {
     return -1;
   }
 
+  /* Ordinary files' extents move to the packed table for Passes 2 and 3 */
+  btrfs_pack_extents(fs_info);
+
   printf("\n=== Btrfs Metadata Summary ===\n");
   printf("  Total inodes read: %u\n", fs_info->inode_count);
-  printf("  Used extents:      %u\n", fs_info->used_blocks.count);
+  printf("  Used extents:      %lu (%lu ranges)\n",
+         (unsigned long)fs_info->usage.items,
+         (unsigned long)fs_info->usage.ranges);
+  printf("  Metadata arena:    %.1f MiB (names %.1f MiB)\n",
+         fs_info->arena.reserved / (1024.0 * 1024.0),
+         fs_info->names.len / (1024.0 * 1024.0));
+  if (fs_info->spill && fs_info->spill->file_size > 0)
+    printf("  Spill file:        %.1f MiB in %s\n",
+           fs_info->spill->file_size / (1024.0 * 1024.0), g_mem_cfg.workdir);
   printf("  Root directory:    inode %lu\n",
          (unsigned long)fs_info->root_dir->ino);
+  struct node_cache_stats ncs;
+  node_cache_get_stats(&ncs);
+  printf("  Node cache:        %lu hits, %lu misses (%.1f MiB held)\n",
+         (unsigned long)ncs.hits, (unsigned long)ncs.misses,
+         ncs.bytes / (1024.0 * 1024.0));
   printf("==============================\n\n");
 
   return 0;
 }
 
-void btrfs_free_fs(struct btrfs_fs_info *fs_info) {
-  /* Free all file entries */
-  if (fs_info->inode_table) {
-    for (uint32_t i = 0; i < fs_info->inode_count; i++) {
-      struct file_entry *fe = fs_info->inode_table[i];
-      if (fe) {
-        /* Free inline data */
-        for (uint32_t j = 0; j < fe->extent_count; j++) {
-          free(fe->extents[j].inline_data);
-        }
-
-        /* Free xattrs */
-        struct xattr_entry *xa = fe->xattrs;
-        while (xa) {
-          struct xattr_entry *next = xa->next;
-          free(xa->name);
-          free(xa->value);
-          free(xa);
-          xa = next;
-        }
+int btrfs_read_fs(struct device *dev, struct btrfs_fs_info *fs_info) {
+  int ret = btrfs_read_trees(dev, fs_info);
+  /* Only Pass 1 walks trees: give the node memory back to later passes */
+  node_cache_destroy();
+  return ret;
+}
 
-        free(fe->extents);
-        free(fe->children);
-        free(fe->symlink_target);
-        free(fe);
-      }
-    }
-    free(fs_info->inode_table);
+void btrfs_free_fs(struct btrfs_fs_info *fs_info) {
+  /* File entries, their arrays, xattrs and inline data live in the arena */
+  mem_track_free_tag(MEM_TAG_PASS1,
+                     fs_info->inode_capacity * sizeof(struct file_entry *));
+  free(fs_info->inode_table);
+  fs_info->inode_table = NULL;
+  fs_info->inode_count = 0;
+  arena_free(&fs_info->arena);
+  arena_free(&fs_info->extent_arena);
+  if (fs_info->spill) {
+    arena_spill_close(fs_info->spill);
+    free(fs_info->spill);
   }
+  str_pool_free(&fs_info->names);
+  btrfs_free_extent_store(&fs_info->extent_store);
 
   /* Free chunk map */
   if (fs_info->chunk_map) {
@@ -833,11 +1454,12 @@ void btrfs_free_fs(struct btrfs_fs_info *fs_info) {
     free(fs_info->chunk_map);
   }
 
-  /* Free used block map */
-  if (fs_info->used_blocks.extents)
-    free(fs_info->used_blocks.extents);
+  /* Free the device usage map */
+  usage_map_free(&fs_info->usage);
 
   /* Free inode hash table */
+  mem_track_free_tag(MEM_TAG_PASS1,
+                     fs_info->ino_ht.capacity * sizeof(struct file_entry *));
   if (fs_info->ino_ht.buckets)
     free(fs_info->ino_ht.buckets);
   fs_info->ino_ht.buckets = NULL;
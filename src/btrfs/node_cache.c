@@ -0,0 +1,232 @@
+/*
+ * node_cache.c — Shared cache of verified btrfs tree nodes
+ *
+ * Chained hash (Knuth multiplicative on bytenr) plus a doubly-linked LRU.
+ * The table is sized once from the budget, so it never rehashes. Entry
+ * memory is reported to mem_tracker; while the tracker is over its limit
+ * the cache stops growing and gives back one node per insert, and
+ * mem_track_reclaim() can evict from the cold end.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btrfs/node_cache.h"
+#include "mem_tracker.h"
+
+struct node_entry {
+  uint64_t logical;
+  struct node_entry *hash_next;
+  struct node_entry *prev, *next; /* LRU: prev = hotter */
+  uint8_t data[];
+};
+
+struct node_cache {
+  pthread_mutex_t lock;
+  uint32_t nodesize;
+  size_t entry_size;
+  uint32_t max_nodes;
+  struct node_entry **buckets;
+  uint32_t bucket_mask;
+  struct node_entry *head, *tail; /* head = most recently used */
+  struct node_cache_stats stats;
+};
+
+static struct node_cache *g_node_cache = NULL;
+
+static inline uint32_t node_hash(const struct node_cache *c,
+                                 uint64_t logical) {
+  /* Node bytenrs are nodesize-aligned: drop the zero low bits first */
+  return (uint32_t)(((logical / c->nodesize) * 2654435761ULL) >> 8) &
+         c->bucket_mask;
+}
+
+static void lru_unlink(struct node_cache *c, struct node_entry *e) {
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    c->head = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    c->tail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void lru_push_head(struct node_cache *c, struct node_entry *e) {
+  e->prev = NULL;
+  e->next = c->head;
+  if (c->head)
+    c->head->prev = e;
+  c->head = e;
+  if (!c->tail)
+    c->tail = e;
+}
+
+static void lru_push_tail(struct node_cache *c, struct node_entry *e) {
+  e->next = NULL;
+  e->prev = c->tail;
+  if (c->tail)
+    c->tail->next = e;
+  c->tail = e;
+  if (!c->head)
+    c->head = e;
+}
+
+static struct node_entry *node_find(const struct node_cache *c,
+                                    uint64_t logical) {
+  struct node_entry *e = c->buckets[node_hash(c, logical)];
+  while (e && e->logical != logical)
+    e = e->hash_next;
+  return e;
+}
+
+/* Drop the least recently used node; lock held */
+static void node_evict_tail(struct node_cache *c) {
+  struct node_entry *e = c->tail;
+  if (!e)
+    return;
+  lru_unlink(c, e);
+  struct node_entry **pp = &c->buckets[node_hash(c, e->logical)];
+  while (*pp != e)
+    pp = &(*pp)->hash_next;
+  *pp = e->hash_next;
+  free(e);
+  mem_track_free_tag(MEM_TAG_NODE_CACHE, c->entry_size);
+  c->stats.nodes--;
+  c->stats.bytes -= c->entry_size;
+  c->stats.evictions++;
+}
+
+/* mem_track_reclaim() callback: evict cold nodes worth `want` bytes */
+static uint64_t node_cache_reclaim(void *arg, uint64_t want) {
+  struct node_cache *c = arg;
+  uint64_t released = 0;
+  pthread_mutex_lock(&c->lock);
+  while (c->tail && released < want) {
+    node_evict_tail(c);
+    released += c->entry_size;
+  }
+  pthread_mutex_unlock(&c->lock);
+  return released;
+}
+
+int node_cache_init(uint32_t nodesize, uint64_t budget) {
+  node_cache_destroy();
+  if (nodesize == 0)
+    return -1;
+  if (budget == 0)
+    budget = NODE_CACHE_DEFAULT_BUDGET;
+
+  struct node_cache *c = calloc(1, sizeof(*c));
+  if (!c)
+    return -1;
+  c->nodesize = nodesize;
+  c->entry_size = sizeof(struct node_entry) + nodesize;
+  uint64_t max_nodes = budget / c->entry_size;
+  if (max_nodes < 1)
+    max_nodes = 1;
+  if (max_nodes > UINT32_MAX / 2)
+    max_nodes = UINT32_MAX / 2;
+  c->max_nodes = (uint32_t)max_nodes;
+
+  uint32_t buckets = 1024;
+  while (buckets < c->max_nodes)
+    buckets *= 2;
+  c->buckets = calloc(buckets, sizeof(*c->buckets));
+  if (!c->buckets) {
+    fprintf(stderr, "btrfs2ext4: OOM for node cache, reading uncached\n");
+    free(c);
+    return -1;
+  }
+  c->bucket_mask = buckets - 1;
+  pthread_mutex_init(&c->lock, NULL);
+  g_node_cache = c;
+  mem_track_set_reclaim(MEM_TAG_NODE_CACHE, node_cache_reclaim, c);
+  return 0;
+}
+
+void node_cache_destroy(void) {
+  struct node_cache *c = g_node_cache;
+  if (!c)
+    return;
+  /* Waits for a reclaim pass that may be using the cache */
+  mem_track_set_reclaim(MEM_TAG_NODE_CACHE, NULL, NULL);
+  g_node_cache = NULL;
+  while (c->tail)
+    node_evict_tail(c);
+  pthread_mutex_destroy(&c->lock);
+  free(c->buckets);
+  free(c);
+}
+
+int node_cache_lookup(uint64_t logical, uint8_t *buf) {
+  struct node_cache *c = g_node_cache;
+  if (!c)
+    return 0;
+
+  pthread_mutex_lock(&c->lock);
+  struct node_entry *e = node_find(c, logical);
+  if (e) {
+    memcpy(buf, e->data, c->nodesize);
+    lru_unlink(c, e);
+    lru_push_head(c, e);
+    c->stats.hits++;
+  } else {
+    c->stats.misses++;
+  }
+  pthread_mutex_unlock(&c->lock);
+  return e != NULL;
+}
+
+void node_cache_insert(uint64_t logical, const uint8_t *buf, uint8_t level) {
+  struct node_cache *c = g_node_cache;
+  if (!c)
+    return;
+
+  pthread_mutex_lock(&c->lock);
+  if (node_find(c, logical)) {
+    /* Another walker got here first */
+    pthread_mutex_unlock(&c->lock);
+    return;
+  }
+  if (mem_track_exceeded()) {
+    /* Memory is tight: shrink instead of growing */
+    node_evict_tail(c);
+    pthread_mutex_unlock(&c->lock);
+    return;
+  }
+  while (c->stats.nodes >= c->max_nodes)
+    node_evict_tail(c);
+
+  struct node_entry *e = malloc(c->entry_size);
+  if (!e) {
+    pthread_mutex_unlock(&c->lock);
+    return;
+  }
+  e->logical = logical;
+  memcpy(e->data, buf, c->nodesize);
+  uint32_t h = node_hash(c, logical);
+  e->hash_next = c->buckets[h];
+  c->buckets[h] = e;
+  if (level > 0)
+    lru_push_head(c, e);
+  else
+    lru_push_tail(c, e);
+  mem_track_alloc_tag(MEM_TAG_NODE_CACHE, c->entry_size);
+  c->stats.nodes++;
+  c->stats.bytes += c->entry_size;
+  pthread_mutex_unlock(&c->lock);
+}
+
+void node_cache_get_stats(struct node_cache_stats *out) {
+  memset(out, 0, sizeof(*out));
+  struct node_cache *c = g_node_cache;
+  if (!c)
+    return;
+  pthread_mutex_lock(&c->lock);
+  *out = c->stats;
+  pthread_mutex_unlock(&c->lock);
+}
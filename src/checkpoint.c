@@ -0,0 +1,975 @@
+/*
+ * checkpoint.c — Resumable conversion state in --workdir
+ *
+ * A snapshot is a header, the sections of its phase and a CRC32C trailer
+ * over everything before it. Pointers are flattened on the way out: file
+ * entries become fixed records followed by their symlink target, extent
+ * array (unless packed) and xattrs; directory links name their target by
+ * inode number and are written after all inodes, so loading can resolve
+ * them through the rebuilt inode hash.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "btrfs/btrfs_reader.h"
+#include "btrfs/btrfs_structures.h"
+#include "btrfs/chunk_tree.h"
+#include "btrfs/extent_store.h"
+#include "checkpoint.h"
+#include "device_io.h"
+#include "ext4/ext4_planner.h"
+#include "journal.h"
+#include "mem_tracker.h"
+#include "migration_map.h"
+#include "relocator.h"
+
+extern uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* Refuse sections larger than this when loading a damaged file */
+#define CHECKPOINT_MAX_COUNT (1ULL << 40)
+
+struct ckpt_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t phase;
+  uint8_t fsid[BTRFS_FSID_SIZE];
+  uint64_t generation;
+  uint64_t device_size;
+  uint32_t block_size;
+  uint32_t inode_ratio;
+  /* sizeof() of the structs written as-is, so another build refuses it */
+  uint16_t bg_layout_size;
+  uint16_t reloc_entry_size;
+  uint16_t chunk_mapping_size;
+  uint16_t super_size;
+};
+
+/* One file_entry; followed by its symlink target, extents and xattrs */
+struct ckpt_inode {
+  uint64_t ino;
+  uint64_t parent_ino;
+  uint64_t size;
+  uint64_t rdev;
+  uint64_t ext_first;
+  int64_t atime_sec;
+  int64_t mtime_sec;
+  int64_t ctime_sec;
+  int64_t crtime_sec;
+  uint32_t atime_nsec;
+  uint32_t mtime_nsec;
+  uint32_t ctime_nsec;
+  uint32_t crtime_nsec;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t nlink;
+  uint32_t extent_count; /* > 0 with packed = 1: in the extent store */
+  uint32_t child_count;
+  uint32_t xattr_count;
+  uint32_t symlink_len;
+  uint32_t ext4_flags;
+  uint8_t packed;
+  uint8_t has_symlink;
+  uint8_t pad[2];
+};
+
+/* One unpacked file_extent; followed by inline_len bytes of inline data */
+struct ckpt_extent {
+  uint64_t file_offset;
+  uint64_t disk_bytenr;
+  uint64_t disk_num_bytes;
+  uint64_t num_bytes;
+  uint64_t ram_bytes;
+  uint32_t inline_len;
+  uint8_t compression;
+  uint8_t type;
+  uint8_t has_inline;
+  uint8_t pad;
+};
+
+/* One xattr_entry; followed by the name and value bytes */
+struct ckpt_xattr {
+  uint32_t value_len;
+  uint16_t name_len;
+  uint8_t has_value;
+  uint8_t pad;
+};
+
+struct ckpt_link {
+  uint64_t target_ino;
+  uint64_t name_off;
+  uint16_t name_len;
+  uint8_t pad[6];
+};
+
+struct ckpt_layout {
+  uint64_t total_blocks;
+  uint32_t block_size;
+  uint32_t blocks_per_group;
+  uint32_t inodes_per_group;
+  uint32_t inode_size;
+  uint32_t num_groups;
+  uint32_t total_inodes;
+  uint32_t reserved_block_count;
+  uint16_t desc_size;
+  uint8_t pad[2];
+};
+
+/* The relocation log: a single record rewritten in place */
+struct ckpt_reloc_record {
+  char magic[8];
+  uint32_t run_id;
+  uint32_t count;
+  uint32_t done;
+  uint32_t checksum; /* CRC32C of the fields above */
+};
+
+/* ========================================================================
+ * Streams with a running CRC
+ * ======================================================================== */
+
+struct ckpt_stream {
+  FILE *f;
+  uint32_t crc;
+  int err;
+  uint64_t bytes;
+};
+
+static void ckpt_put(struct ckpt_stream *s, const void *data, size_t len) {
+  if (s->err || len == 0)
+    return;
+  if (fwrite(data, 1, len, s->f) != len) {
+    s->err = 1;
+    return;
+  }
+  s->crc = crc32c(s->crc, data, len);
+  s->bytes += len;
+}
+
+static void ckpt_put_u32(struct ckpt_stream *s, uint32_t v) {
+  ckpt_put(s, &v, sizeof(v));
+}
+
+static void ckpt_put_u64(struct ckpt_stream *s, uint64_t v) {
+  ckpt_put(s, &v, sizeof(v));
+}
+
+static int ckpt_get(struct ckpt_stream *s, void *data, size_t len) {
+  if (s->err)
+    return -1;
+  if (len == 0)
+    return 0;
+  if (fread(data, 1, len, s->f) != len) {
+    s->err = 1;
+    return -1;
+  }
+  s->crc = crc32c(s->crc, data, len);
+  s->bytes += len;
+  return 0;
+}
+
+static uint32_t ckpt_get_u32(struct ckpt_stream *s) {
+  uint32_t v = 0;
+  ckpt_get(s, &v, sizeof(v));
+  return v;
+}
+
+static uint64_t ckpt_get_u64(struct ckpt_stream *s) {
+  uint64_t v = 0;
+  ckpt_get(s, &v, sizeof(v));
+  return v;
+}
+
+static void ckpt_path(char *buf, size_t len, const char *workdir,
+                      const char *name) {
+  snprintf(buf, len, "%s/%s", workdir ? workdir : ".", name);
+}
+
+static uint64_t ckpt_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+const char *checkpoint_phase_name(enum checkpoint_phase phase) {
+  switch (phase) {
+  case CHECKPOINT_SCANNED:
+    return "scanned";
+  case CHECKPOINT_PLANNED:
+    return "planned";
+  case CHECKPOINT_RELOCATED:
+    return "relocated";
+  default:
+    return "none";
+  }
+}
+
+void checkpoint_init(struct checkpoint *ck, const char *workdir,
+                     struct device *dev, uint32_t block_size,
+                     uint32_t inode_ratio) {
+  memset(ck, 0, sizeof(*ck));
+  ck->workdir = workdir ? workdir : ".";
+  ck->dev = dev;
+  ck->block_size = block_size;
+  ck->inode_ratio = inode_ratio;
+  ck->reloc_fd = -1;
+}
+
+static void ckpt_fill_header(struct ckpt_header *h,
+                             const struct checkpoint *ck,
+                             enum checkpoint_phase phase,
+                             const struct btrfs_super_block *sb) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, CHECKPOINT_MAGIC, sizeof(h->magic));
+  h->version = CHECKPOINT_VERSION;
+  h->phase = (uint32_t)phase;
+  if (sb) {
+    memcpy(h->fsid, sb->fsid, sizeof(h->fsid));
+    h->generation = le64toh(sb->generation);
+  }
+  h->device_size = ck->dev ? ck->dev->size : 0;
+  h->block_size = ck->block_size;
+  h->inode_ratio = ck->inode_ratio;
+  h->bg_layout_size = sizeof(struct ext4_bg_layout);
+  h->reloc_entry_size = sizeof(struct relocation_entry);
+  h->chunk_mapping_size = sizeof(struct chunk_mapping);
+  h->super_size = sizeof(struct btrfs_super_block);
+}
+
+/* ========================================================================
+ * Save
+ * ======================================================================== */
+
+static void ckpt_save_fs(struct ckpt_stream *s,
+                         const struct btrfs_fs_info *fs_info) {
+  ckpt_put(s, &fs_info->sb, sizeof(fs_info->sb));
+
+  const struct chunk_map *cm = fs_info->chunk_map;
+  uint32_t chunks = cm ? cm->count : 0;
+  ckpt_put_u32(s, chunks);
+  if (chunks > 0)
+    ckpt_put(s, cm->entries, chunks * sizeof(struct chunk_mapping));
+
+  const struct usage_map *um = &fs_info->usage;
+  ckpt_put_u64(s, um->bits ? um->granules : 0);
+  ckpt_put_u32(s, um->granule);
+  ckpt_put_u64(s, um->items);
+  ckpt_put_u64(s, um->ranges);
+  if (um->bits)
+    ckpt_put(s, um->bits, (size_t)((um->granules + 63) / 64) * 8);
+  ckpt_put_u32(s, um->meta_count);
+  ckpt_put(s, um->meta, um->meta_count * sizeof(struct usage_range));
+
+  ckpt_put_u64(s, fs_info->names.len);
+  ckpt_put(s, fs_info->names.buf, fs_info->names.len);
+
+  ckpt_put_u64(s, fs_info->total_compressed_bytes);
+  ckpt_put_u64(s, fs_info->total_decompressed_bytes);
+  ckpt_put_u32(s, fs_info->compressed_extent_count);
+  ckpt_put_u64(s, fs_info->dedup_blocks_needed);
+  ckpt_put_u32(s, fs_info->shared_extent_count);
+
+  const struct extent_store *st = &fs_info->extent_store;
+  ckpt_put_u64(s, st->count);
+  if (st->count > 0) {
+    ckpt_put(s, st->bytenr, st->count * sizeof(uint64_t));
+    ckpt_put(s, st->disk_len, st->count * sizeof(uint32_t));
+    ckpt_put(s, st->len, st->count * sizeof(uint32_t));
+    ckpt_put(s, st->flags, st->count);
+  }
+
+  ckpt_put_u32(s, fs_info->inode_count);
+  ckpt_put_u64(s, fs_info->root_dir ? fs_info->root_dir->ino : 0);
+
+  for (uint32_t i = 0; i < fs_info->inode_count && !s->err; i++) {
+    const struct file_entry *fe = fs_info->inode_table[i];
+    struct ckpt_inode rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.ino = fe->ino;
+    rec.parent_ino = fe->parent_ino;
+    rec.size = fe->size;
+    rec.rdev = fe->rdev;
+    rec.ext_first = fe->ext_first;
+    rec.atime_sec = fe->atime_sec;
+    rec.mtime_sec = fe->mtime_sec;
+    rec.ctime_sec = fe->ctime_sec;
+    rec.crtime_sec = fe->crtime_sec;
+    rec.atime_nsec = fe->atime_nsec;
+    rec.mtime_nsec = fe->mtime_nsec;
+    rec.ctime_nsec = fe->ctime_nsec;
+    rec.crtime_nsec = fe->crtime_nsec;
+    rec.mode = fe->mode;
+    rec.uid = fe->uid;
+    rec.gid = fe->gid;
+    rec.nlink = fe->nlink;
+    rec.extent_count = fe->extent_count;
+    rec.child_count = fe->child_count;
+    rec.ext4_flags = fe->ext4_flags;
+    rec.packed = fe->extent_count > 0 && !fe->extents;
+    rec.has_symlink = fe->symlink_target != NULL;
+    rec.symlink_len =
+        fe->symlink_target ? (uint32_t)strlen(fe->symlink_target) : 0;
+    for (const struct xattr_entry *x = fe->xattrs; x; x = x->next)
+      rec.xattr_count++;
+    ckpt_put(s, &rec, sizeof(rec));
+    ckpt_put(s, fe->symlink_target, rec.symlink_len);
+
+    for (uint32_t j = 0; !rec.packed && j < fe->extent_count; j++) {
+      const struct file_extent *e = &fe->extents[j];
+      struct ckpt_extent ce;
+      memset(&ce, 0, sizeof(ce));
+      ce.file_offset = e->file_offset;
+      ce.disk_bytenr = e->disk_bytenr;
+      ce.disk_num_bytes = e->disk_num_bytes;
+      ce.num_bytes = e->num_bytes;
+      ce.ram_bytes = e->ram_bytes;
+      ce.compression = e->compression;
+      ce.type = e->type;
+      ce.has_inline = e->inline_data != NULL;
+      ce.inline_len = e->inline_data ? e->inline_data_len : 0;
+      ckpt_put(s, &ce, sizeof(ce));
+      ckpt_put(s, e->inline_data, ce.inline_len);
+    }
+
+    for (const struct xattr_entry *x = fe->xattrs; x; x = x->next) {
+      struct ckpt_xattr cx;
+      memset(&cx, 0, sizeof(cx));
+      cx.name_len = x->name_len;
+      cx.has_value = x->value != NULL;
+      cx.value_len = x->value ? x->value_len : 0;
+      ckpt_put(s, &cx, sizeof(cx));
+      ckpt_put(s, x->name, cx.name_len);
+      ckpt_put(s, x->value, cx.value_len);
+    }
+  }
+
+  /* Directory links, once every target exists on the way back in */
+  for (uint32_t i = 0; i < fs_info->inode_count && !s->err; i++) {
+    const struct file_entry *fe = fs_info->inode_table[i];
+    for (uint32_t c = 0; c < fe->child_count; c++) {
+      struct ckpt_link cl;
+      memset(&cl, 0, sizeof(cl));
+      cl.target_ino = fe->children[c].target->ino;
+      cl.name_off = fe->children[c].name_off;
+      cl.name_len = fe->children[c].name_len;
+      ckpt_put(s, &cl, sizeof(cl));
+    }
+  }
+}
+
+static void ckpt_save_plan(struct ckpt_stream *s,
+                           const struct ext4_layout *layout,
+                           const struct relocation_plan *plan) {
+  struct ckpt_layout cl;
+  memset(&cl, 0, sizeof(cl));
+  cl.total_blocks = layout->total_blocks;
+  cl.block_size = layout->block_size;
+  cl.blocks_per_group = layout->blocks_per_group;
+  cl.inodes_per_group = layout->inodes_per_group;
+  cl.inode_size = layout->inode_size;
+  cl.num_groups = layout->num_groups;
+  cl.total_inodes = layout->total_inodes;
+  cl.reserved_block_count = layout->reserved_block_count;
+  cl.desc_size = layout->desc_size;
+  ckpt_put(s, &cl, sizeof(cl));
+  ckpt_put(s, layout->groups,
+           (size_t)layout->num_groups * sizeof(struct ext4_bg_layout));
+  ckpt_put(s, layout->reserved_blocks,
+           (size_t)layout->reserved_block_count * sizeof(uint64_t));
+
+  ckpt_put_u32(s, plan->count);
+  ckpt_put_u64(s, plan->total_bytes_to_move);
+  ckpt_put(s, &plan->sched, sizeof(plan->sched));
+  ckpt_put(s, plan->entries,
+           (size_t)plan->count * sizeof(struct relocation_entry));
+}
+
+int checkpoint_save(struct checkpoint *ck, enum checkpoint_phase phase,
+                    const struct btrfs_fs_info *fs_info,
+                    const struct ext4_layout *layout,
+                    const struct relocation_plan *plan) {
+  char path[1024], tmp[1024];
+  ckpt_path(path, sizeof(path), ck->workdir, CHECKPOINT_FILE);
+  ckpt_path(tmp, sizeof(tmp), ck->workdir, CHECKPOINT_FILE ".tmp");
+
+  FILE *f = fopen(tmp, "wb");
+  if (!f) {
+    fprintf(stderr, "btrfs2ext4: cannot create checkpoint %s: %s\n", tmp,
+            strerror(errno));
+    return -1;
+  }
+  setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+  struct ckpt_stream s;
+  memset(&s, 0, sizeof(s));
+  s.f = f;
+
+  struct ckpt_header h;
+  ckpt_fill_header(&h, ck, phase, &fs_info->sb);
+  ckpt_put(&s, &h, sizeof(h));
+  ckpt_save_fs(&s, fs_info);
+  if (phase >= CHECKPOINT_PLANNED)
+    ckpt_save_plan(&s, layout, plan);
+
+  uint32_t crc = s.crc;
+  if (!s.err && fwrite(&crc, 1, sizeof(crc), f) != sizeof(crc))
+    s.err = 1;
+  if (fflush(f) == EOF || fsync(fileno(f)) < 0)
+    s.err = 1;
+  if (fclose(f) == EOF)
+    s.err = 1;
+
+  if (s.err || rename(tmp, path) < 0) {
+    fprintf(stderr, "btrfs2ext4: failed to write checkpoint %s: %s\n", path,
+            strerror(errno));
+    unlink(tmp);
+    return -1;
+  }
+
+  /* Make the rename itself durable */
+  int dfd = open(ck->workdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dfd >= 0) {
+    fsync(dfd);
+    close(dfd);
+  }
+
+  if (phase >= CHECKPOINT_PLANNED)
+    ck->run_id = crc;
+  printf("  Checkpoint: %s state saved to %s (%.1f MiB)\n",
+         checkpoint_phase_name(phase), path, s.bytes / (1024.0 * 1024.0));
+  return 0;
+}
+
+/* ========================================================================
+ * Load
+ * ======================================================================== */
+
+static int ckpt_load_fs(struct ckpt_stream *s, struct device *dev,
+                        struct btrfs_fs_info *fs_info) {
+  ckpt_get(s, &fs_info->sb, sizeof(fs_info->sb));
+
+  uint32_t chunks = ckpt_get_u32(s);
+  if (s->err)
+    return -1;
+  fs_info->chunk_map = calloc(1, sizeof(struct chunk_map));
+  if (!fs_info->chunk_map)
+    return -1;
+  if (chunks > 0) {
+    struct chunk_map *cm = fs_info->chunk_map;
+    cm->entries = malloc(chunks * sizeof(struct chunk_mapping));
+    if (!cm->entries)
+      return -1;
+    cm->capacity = chunks;
+    mem_track_alloc_tag(MEM_TAG_CHUNK_MAP,
+                        chunks * sizeof(struct chunk_mapping));
+    if (ckpt_get(s, cm->entries, chunks * sizeof(struct chunk_mapping)) < 0)
+      return -1;
+    cm->count = chunks;
+    chunk_map_build_resolver(cm);
+  }
+
+  struct usage_map *um = &fs_info->usage;
+  uint64_t granules = ckpt_get_u64(s);
+  uint32_t granule = ckpt_get_u32(s);
+  uint64_t items = ckpt_get_u64(s);
+  uint64_t ranges = ckpt_get_u64(s);
+  if (s->err || granules > CHECKPOINT_MAX_COUNT || granule == 0 ||
+      granule > (1U << 20))
+    return -1;
+  if (granules > 0) {
+    if (usage_map_init(um, granules * granule, granule) < 0 ||
+        um->granules != granules)
+      return -1;
+    if (ckpt_get(s, um->bits, (size_t)((granules + 63) / 64) * 8) < 0)
+      return -1;
+  }
+  um->items = items;
+  um->ranges = ranges;
+  uint32_t meta = ckpt_get_u32(s);
+  if (s->err || (granules == 0 && meta > 0))
+    return -1;
+  if (meta > 0) {
+    um->meta = malloc(meta * sizeof(struct usage_range));
+    if (!um->meta)
+      return -1;
+    um->meta_capacity = meta;
+    if (ckpt_get(s, um->meta, meta * sizeof(struct usage_range)) < 0)
+      return -1;
+    um->meta_count = meta;
+  }
+
+  /* Names go through a small buffer to avoid holding the pool twice */
+  uint64_t names_len = ckpt_get_u64(s);
+  if (s->err || names_len > CHECKPOINT_MAX_COUNT)
+    return -1;
+  char chunk[64 * 1024];
+  for (uint64_t done = 0; done < names_len;) {
+    size_t n = names_len - done < sizeof(chunk) ? (size_t)(names_len - done)
+                                                : sizeof(chunk);
+    if (ckpt_get(s, chunk, n) < 0)
+      return -1;
+    struct str_pool part = {chunk, n, n};
+    if (str_pool_append(&fs_info->names, &part) == STR_POOL_INVALID)
+      return -1;
+    done += n;
+  }
+
+  fs_info->total_compressed_bytes = ckpt_get_u64(s);
+  fs_info->total_decompressed_bytes = ckpt_get_u64(s);
+  fs_info->compressed_extent_count = ckpt_get_u32(s);
+  fs_info->dedup_blocks_needed = ckpt_get_u64(s);
+  fs_info->shared_extent_count = ckpt_get_u32(s);
+
+  struct extent_store *st = &fs_info->extent_store;
+  uint64_t packed = ckpt_get_u64(s);
+  if (s->err || packed > CHECKPOINT_MAX_COUNT / EXTENT_STORE_ROW_BYTES)
+    return -1;
+  if (packed > 0) {
+    st->bytenr = malloc(packed * sizeof(uint64_t));
+    st->disk_len = malloc(packed * sizeof(uint32_t));
+    st->len = malloc(packed * sizeof(uint32_t));
+    st->flags = malloc(packed);
+    if (!st->bytenr || !st->disk_len || !st->len || !st->flags) {
+      btrfs_free_extent_store(st);
+      return -1;
+    }
+    st->count = packed;
+    mem_track_alloc_tag(MEM_TAG_PASS1, packed * EXTENT_STORE_ROW_BYTES);
+    ckpt_get(s, st->bytenr, packed * sizeof(uint64_t));
+    ckpt_get(s, st->disk_len, packed * sizeof(uint32_t));
+    ckpt_get(s, st->len, packed * sizeof(uint32_t));
+    ckpt_get(s, st->flags, packed);
+  }
+  /* Unpacked arrays below come from the main arena, as after packing */
+  fs_info->extents_packed = 1;
+  fs_info->use_hash = 1;
+  fs_info->dev = dev;
+
+  uint32_t inodes = ckpt_get_u32(s);
+  uint64_t root_ino = ckpt_get_u64(s);
+  if (s->err)
+    return -1;
+
+  struct arena *a = &fs_info->arena;
+  for (uint32_t i = 0; i < inodes; i++) {
+    struct ckpt_inode rec;
+    if (ckpt_get(s, &rec, sizeof(rec)) < 0)
+      return -1;
+    uint32_t before = fs_info->inode_count;
+    struct file_entry *fe = btrfs_get_inode(fs_info, rec.ino);
+    if (!fe || fs_info->inode_count != before + 1)
+      return -1; /* OOM or a duplicate inode number */
+
+    fe->parent_ino = rec.parent_ino;
+    fe->size = rec.size;
+    fe->rdev = rec.rdev;
+    fe->atime_sec = rec.atime_sec;
+    fe->mtime_sec = rec.mtime_sec;
+    fe->ctime_sec = rec.ctime_sec;
+    fe->crtime_sec = rec.crtime_sec;
+    fe->atime_nsec = rec.atime_nsec;
+    fe->mtime_nsec = rec.mtime_nsec;
+    fe->ctime_nsec = rec.ctime_nsec;
+    fe->crtime_nsec = rec.crtime_nsec;
+    fe->mode = rec.mode;
+    fe->uid = rec.uid;
+    fe->gid = rec.gid;
+    fe->nlink = rec.nlink;
+    fe->ext4_flags = rec.ext4_flags;
+
+    if (rec.has_symlink) {
+      fe->symlink_target = arena_alloc(a, (size_t)rec.symlink_len + 1);
+      if (!fe->symlink_target ||
+          ckpt_get(s, fe->symlink_target, rec.symlink_len) < 0)
+        return -1;
+    }
+
+    fe->extent_count = rec.extent_count;
+    if (rec.packed) {
+      if (rec.ext_first + rec.extent_count > st->count)
+        return -1;
+      fe->ext_first = rec.ext_first;
+    } else if (rec.extent_count > 0) {
+      fe->extents =
+          arena_alloc(a, (size_t)rec.extent_count * sizeof(struct file_extent));
+      if (!fe->extents)
+        return -1;
+      fe->extent_capacity = rec.extent_count;
+      for (uint32_t j = 0; j < rec.extent_count; j++) {
+        struct ckpt_extent ce;
+        if (ckpt_get(s, &ce, sizeof(ce)) < 0)
+          return -1;
+        struct file_extent *e = &fe->extents[j];
+        e->file_offset = ce.file_offset;
+        e->disk_bytenr = ce.disk_bytenr;
+        e->disk_num_bytes = ce.disk_num_bytes;
+        e->num_bytes = ce.num_bytes;
+        e->ram_bytes = ce.ram_bytes;
+        e->compression = ce.compression;
+        e->type = ce.type;
+        if (ce.has_inline) {
+          e->inline_data = arena_alloc(a, ce.inline_len ? ce.inline_len : 1);
+          if (!e->inline_data ||
+              ckpt_get(s, e->inline_data, ce.inline_len) < 0)
+            return -1;
+          e->inline_data_len = ce.inline_len;
+        }
+      }
+    }
+
+    struct xattr_entry **tail = &fe->xattrs;
+    for (uint32_t x = 0; x < rec.xattr_count; x++) {
+      struct ckpt_xattr cx;
+      if (ckpt_get(s, &cx, sizeof(cx)) < 0)
+        return -1;
+      struct xattr_entry *xe = arena_alloc(
+          a, sizeof(struct xattr_entry) + cx.name_len + 1 + cx.value_len);
+      if (!xe)
+        return -1;
+      xe->name_len = cx.name_len;
+      xe->value_len = cx.value_len;
+      xe->name = (char *)(xe + 1);
+      xe->value = cx.has_value ? xe->name + cx.name_len + 1 : NULL;
+      if (ckpt_get(s, xe->name, cx.name_len) < 0 ||
+          (xe->value && ckpt_get(s, xe->value, cx.value_len) < 0))
+        return -1;
+      *tail = xe;
+      tail = &xe->next;
+    }
+
+    if (rec.child_count > 0) {
+      fe->children = arena_alloc(a, (size_t)rec.child_count *
+                                        sizeof(struct dir_entry_link));
+      if (!fe->children)
+        return -1;
+      fe->child_capacity = rec.child_count;
+      fe->child_count = rec.child_count;
+    }
+  }
+
+  for (uint32_t i = 0; i < fs_info->inode_count; i++) {
+    struct file_entry *fe = fs_info->inode_table[i];
+    for (uint32_t c = 0; c < fe->child_count; c++) {
+      struct ckpt_link cl;
+      if (ckpt_get(s, &cl, sizeof(cl)) < 0)
+        return -1;
+      struct dir_entry_link *link = &fe->children[c];
+      link->target = btrfs_find_inode(fs_info, cl.target_ino);
+      link->name_off = cl.name_off;
+      link->name_len = cl.name_len;
+      if (!link->target || cl.name_off + cl.name_len >= fs_info->names.len)
+        return -1; /* names end in a NUL inside the pool */
+    }
+  }
+
+  fs_info->root_dir = btrfs_find_inode(fs_info, root_ino);
+  if (!fs_info->root_dir)
+    return -1;
+  return s->err ? -1 : 0;
+}
+
+static int ckpt_load_plan(struct ckpt_stream *s, struct ext4_layout *layout,
+                          struct relocation_plan *plan) {
+  struct ckpt_layout cl;
+  if (ckpt_get(s, &cl, sizeof(cl)) < 0)
+    return -1;
+  layout->total_blocks = cl.total_blocks;
+  layout->block_size = cl.block_size;
+  layout->blocks_per_group = cl.blocks_per_group;
+  layout->inodes_per_group = cl.inodes_per_group;
+  layout->inode_size = cl.inode_size;
+  layout->num_groups = cl.num_groups;
+  layout->total_inodes = cl.total_inodes;
+  layout->desc_size = cl.desc_size;
+
+  layout->groups = calloc(cl.num_groups ? cl.num_groups : 1,
+                          sizeof(struct ext4_bg_layout));
+  layout->reserved_blocks = malloc(
+      (cl.reserved_block_count ? cl.reserved_block_count : 1) *
+      sizeof(uint64_t));
+  if (!layout->groups || !layout->reserved_blocks)
+    return -1;
+  layout->reserved_block_capacity =
+      cl.reserved_block_count ? cl.reserved_block_count : 1;
+  if (ckpt_get(s, layout->groups,
+               (size_t)cl.num_groups * sizeof(struct ext4_bg_layout)) < 0 ||
+      ckpt_get(s, layout->reserved_blocks,
+               (size_t)cl.reserved_block_count * sizeof(uint64_t)) < 0)
+    return -1;
+  layout->reserved_block_count = cl.reserved_block_count;
+
+  uint32_t count = ckpt_get_u32(s);
+  plan->total_bytes_to_move = ckpt_get_u64(s);
+  ckpt_get(s, &plan->sched, sizeof(plan->sched));
+  if (s->err)
+    return -1;
+  plan->capacity = count ? count : 1;
+  plan->entries = calloc(plan->capacity, sizeof(struct relocation_entry));
+  if (!plan->entries)
+    return -1;
+  mem_track_alloc_tag(MEM_TAG_RELOC,
+                      plan->capacity * sizeof(struct relocation_entry));
+  if (ckpt_get(s, plan->entries,
+               (size_t)count * sizeof(struct relocation_entry)) < 0)
+    return -1;
+  plan->count = count;
+  return 0;
+}
+
+/*
+ * Identity of the Btrfs filesystem on the device: the primary superblock,
+ * or once Pass 3 may have overwritten it, the copy migration_map_save()
+ * keeps at the end of the device. Returns 0 and fills fsid/generation,
+ * -1 if neither is a Btrfs superblock.
+ */
+static int ckpt_device_identity(struct device *dev, uint8_t *fsid,
+                                uint64_t *generation) {
+  struct btrfs_super_block sb;
+  if (dev->size < 2 * SUPERBLOCK_BACKUP_OFFSET)
+    return -1;
+  uint64_t offsets[2] = {BTRFS_SUPER_OFFSET,
+                         (dev->size - SUPERBLOCK_BACKUP_OFFSET) & ~4095ULL};
+  for (int i = 0; i < 2; i++) {
+    if (offsets[i] + sizeof(sb) > dev->size ||
+        device_read(dev, offsets[i], &sb, sizeof(sb)) < 0)
+      continue;
+    if (le64toh(sb.magic) != BTRFS_MAGIC)
+      continue;
+    memcpy(fsid, sb.fsid, BTRFS_FSID_SIZE);
+    *generation = le64toh(sb.generation);
+    return 0;
+  }
+  return -1;
+}
+
+/* Entries the relocation log of run `run_id` records as on disk */
+static uint32_t ckpt_reloc_done(const char *workdir, uint32_t run_id,
+                                uint32_t count) {
+  char path[1024];
+  ckpt_path(path, sizeof(path), workdir, CHECKPOINT_RELOC_FILE);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  struct ckpt_reloc_record rec;
+  ssize_t n = pread(fd, &rec, sizeof(rec), 0);
+  close(fd);
+  if (n != (ssize_t)sizeof(rec) ||
+      memcmp(rec.magic, CHECKPOINT_RELOC_MAGIC, sizeof(rec.magic)) != 0 ||
+      rec.checksum !=
+          crc32c(0, &rec, offsetof(struct ckpt_reloc_record, checksum)) ||
+      rec.run_id != run_id || rec.count != count || rec.done > count)
+    return 0;
+  return rec.done;
+}
+
+int checkpoint_load(struct checkpoint *ck, struct btrfs_fs_info *fs_info,
+                    struct ext4_layout *layout, struct relocation_plan *plan) {
+  char path[1024];
+  ckpt_path(path, sizeof(path), ck->workdir, CHECKPOINT_FILE);
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "btrfs2ext4: no checkpoint to resume from (%s: %s)\n",
+            path, strerror(errno));
+    return -1;
+  }
+  setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+  struct ckpt_stream s;
+  memset(&s, 0, sizeof(s));
+  s.f = f;
+
+  struct ckpt_header h, want;
+  ckpt_fill_header(&want, ck, CHECKPOINT_NONE, NULL);
+  if (ckpt_get(&s, &h, sizeof(h)) < 0 ||
+      memcmp(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic)) != 0 ||
+      h.version != CHECKPOINT_VERSION || h.phase < CHECKPOINT_SCANNED ||
+      h.phase > CHECKPOINT_RELOCATED ||
+      h.bg_layout_size != want.bg_layout_size ||
+      h.reloc_entry_size != want.reloc_entry_size ||
+      h.chunk_mapping_size != want.chunk_mapping_size ||
+      h.super_size != want.super_size) {
+    fprintf(stderr,
+            "btrfs2ext4: %s is not a checkpoint this build can read\n", path);
+    fclose(f);
+    return -1;
+  }
+
+  uint8_t fsid[BTRFS_FSID_SIZE];
+  uint64_t generation;
+  const char *mismatch = NULL;
+  if (ckpt_device_identity(ck->dev, fsid, &generation) < 0)
+    mismatch = "no Btrfs superblock or backup on the device";
+  else if (memcmp(fsid, h.fsid, sizeof(fsid)) != 0)
+    mismatch = "it belongs to a different filesystem (fsid)";
+  else if (generation != h.generation)
+    mismatch = "the filesystem changed since (generation)";
+  else if (h.device_size != want.device_size)
+    mismatch = "the device size changed";
+  else if (h.block_size != want.block_size ||
+           h.inode_ratio != want.inode_ratio)
+    mismatch = "--block-size / --inode-ratio differ from that run";
+  if (mismatch) {
+    fprintf(stderr, "btrfs2ext4: checkpoint %s does not match: %s\n", path,
+            mismatch);
+    fclose(f);
+    return -1;
+  }
+
+  int ret = ckpt_load_fs(&s, ck->dev, fs_info);
+  if (ret == 0 && h.phase >= CHECKPOINT_PLANNED)
+    ret = ckpt_load_plan(&s, layout, plan);
+
+  uint32_t crc = s.crc;
+  uint32_t stored = 0;
+  if (ret == 0 && (fread(&stored, 1, sizeof(stored), f) != sizeof(stored) ||
+                   stored != crc || fgetc(f) != EOF))
+    ret = -1;
+  fclose(f);
+
+  if (ret < 0) {
+    fprintf(stderr, "btrfs2ext4: checkpoint %s is damaged or truncated\n",
+            path);
+    btrfs_free_fs(fs_info);
+    ext4_free_layout(layout);
+    relocator_free(plan);
+    return -1;
+  }
+
+  ck->run_id = crc;
+  printf("Resuming from checkpoint %s: %s, %u inodes", path,
+         checkpoint_phase_name((enum checkpoint_phase)h.phase),
+         fs_info->inode_count);
+  if (h.phase == CHECKPOINT_PLANNED) {
+    uint32_t done = ckpt_reloc_done(ck->workdir, crc, plan->count);
+    for (uint32_t i = 0; i < done; i++)
+      plan->entries[i].completed = 1;
+    printf(", %u of %u relocations done", done, plan->count);
+  }
+  printf("\n\n");
+  return (int)h.phase;
+}
+
+/* ========================================================================
+ * Relocation progress log
+ * ======================================================================== */
+
+static int ckpt_reloc_write(struct checkpoint *ck, uint32_t done) {
+  struct ckpt_reloc_record rec;
+  memset(&rec, 0, sizeof(rec));
+  memcpy(rec.magic, CHECKPOINT_RELOC_MAGIC, sizeof(rec.magic));
+  rec.run_id = ck->run_id;
+  rec.count = ck->reloc_count;
+  rec.done = done;
+  rec.checksum =
+      crc32c(0, &rec, offsetof(struct ckpt_reloc_record, checksum));
+  if (pwrite(ck->reloc_fd, &rec, sizeof(rec), 0) != (ssize_t)sizeof(rec) ||
+      fdatasync(ck->reloc_fd) < 0)
+    return -1;
+  ck->reloc_done = done;
+  ck->pending = 0;
+  ck->pending_bytes = 0;
+  ck->pending_since_ms = ckpt_now_ms();
+  return 0;
+}
+
+int checkpoint_reloc_begin(struct checkpoint *ck,
+                           const struct relocation_plan *plan) {
+  char path[1024];
+  ckpt_path(path, sizeof(path), ck->workdir, CHECKPOINT_RELOC_FILE);
+  ck->reloc_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (ck->reloc_fd < 0) {
+    fprintf(stderr, "btrfs2ext4: cannot open relocation log %s: %s\n", path,
+            strerror(errno));
+    return -1;
+  }
+
+  uint32_t done = 0;
+  while (done < plan->count && plan->entries[done].completed)
+    done++;
+  ck->reloc_plan = plan;
+  ck->reloc_count = plan->count;
+  if (ckpt_reloc_write(ck, done) < 0) {
+    fprintf(stderr, "btrfs2ext4: cannot write relocation log %s\n", path);
+    close(ck->reloc_fd);
+    ck->reloc_fd = -1;
+    return -1;
+  }
+  relocator_set_progress_hook(checkpoint_reloc_progress, ck);
+  return 0;
+}
+
+/* 1 if the move after `idx` overwrites the source of an unrecorded one */
+static int ckpt_reloc_clobbers(const struct checkpoint *ck, uint32_t idx) {
+  const struct relocation_entry *e = ck->reloc_plan->entries;
+  if (idx + 1 >= ck->reloc_count)
+    return 0;
+  const struct relocation_entry *next = &e[idx + 1];
+  if (next->flags & RELOC_FLAG_UNWRITTEN)
+    return 0; /* writes nothing */
+  for (uint32_t k = ck->reloc_done; k <= idx; k++) {
+    if (!(e[k].flags & RELOC_FLAG_UNWRITTEN) &&
+        next->dst_offset < e[k].src_offset + e[k].length &&
+        e[k].src_offset < next->dst_offset + next->length)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Entries are recorded after a device sync has made them durable, in the
+ * same windows the relocation journal uses for group commits. A resume
+ * copies unrecorded entries again, which is only safe while their sources
+ * are intact, so the window also closes before the next move (the writer
+ * goes in entry order) overwrites the source of one still pending.
+ */
+void checkpoint_reloc_progress(const struct relocation_entry *entry,
+                               void *arg) {
+  struct checkpoint *ck = arg;
+  if (ck->reloc_fd < 0)
+    return;
+
+  uint32_t idx = (uint32_t)(entry - ck->reloc_plan->entries);
+  ck->pending++;
+  if (!(entry->flags & RELOC_FLAG_UNWRITTEN))
+    ck->pending_bytes += entry->length;
+  if (ck->pending < JOURNAL_DEFAULT_GROUP_ENTRIES &&
+      ck->pending_bytes < JOURNAL_DEFAULT_GROUP_BYTES &&
+      ckpt_now_ms() - ck->pending_since_ms < JOURNAL_DEFAULT_GROUP_MS &&
+      !ckpt_reloc_clobbers(ck, idx))
+    return;
+
+  uint32_t done = idx + 1;
+  if (device_sync(ck->dev) < 0 || ckpt_reloc_write(ck, done) < 0) {
+    /* A stale log could redo a move from a clobbered source: drop the
+     * snapshot too, the next one is taken once relocation is over */
+    fprintf(stderr, "btrfs2ext4: warning: relocation log not updated, "
+                    "this run cannot be resumed until relocation ends\n");
+    close(ck->reloc_fd);
+    ck->reloc_fd = -1;
+    checkpoint_remove(ck->workdir);
+  }
+}
+
+void checkpoint_reloc_end(struct checkpoint *ck) {
+  relocator_set_progress_hook(NULL, NULL);
+  if (ck->reloc_fd < 0)
+    return;
+  close(ck->reloc_fd);
+  ck->reloc_fd = -1;
+}
+
+void checkpoint_remove(const char *workdir) {
+  char path[1024];
+  ckpt_path(path, sizeof(path), workdir, CHECKPOINT_FILE);
+  unlink(path);
+  ckpt_path(path, sizeof(path), workdir, CHECKPOINT_RELOC_FILE);
+  unlink(path);
+}
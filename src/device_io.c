@@ -7,21 +7,65 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <linux/fs.h> /* BLKGETSIZE64 */
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "io_stats.h"
+#include "mem_tracker.h"
+
+static int cache_absorb(struct device *dev, uint64_t offset, const void *buf,
+                        size_t size);
+static int cache_before_direct_io(struct device *dev, uint64_t offset,
+                                  size_t size);
+static void cache_overlay(struct device *dev, uint64_t offset, void *buf,
+                          size_t size);
+static void copy_pipe_close(struct device *dev);
+
 int device_open(struct device *dev, const char *path, int read_only) {
+  return device_open_flags(dev, path, read_only ? DEVICE_OPEN_READ_ONLY : 0);
+}
+
+/* Second descriptor with O_DIRECT for the bulk data calls. Not fatal: the
+ * device simply stays buffered. */
+static void device_open_direct(struct device *dev, int flags, int is_blk) {
+  int fd = open(dev->path, flags | O_DIRECT);
+  if (fd < 0) {
+    fprintf(stderr,
+            "btrfs2ext4: O_DIRECT not supported on %s (%s), using buffered "
+            "I/O\n",
+            dev->path, strerror(errno));
+    return;
+  }
+
+  int sector = 0;
+  if (is_blk && ioctl(fd, BLKSSZGET, &sector) < 0)
+    sector = 0;
+  if (sector <= 0 || sector > DEVICE_DIRECT_ALIGN ||
+      (sector & (sector - 1)) != 0)
+    sector = DEVICE_DIRECT_ALIGN; /* files: the common worst case */
+
+  dev->direct_fd = fd;
+  dev->direct_align = (uint32_t)sector;
+}
+
+int device_open_flags(struct device *dev, const char *path, int oflags) {
+  int read_only = (oflags & DEVICE_OPEN_READ_ONLY) != 0;
   memset(dev, 0, sizeof(*dev));
   strncpy(dev->path, path, sizeof(dev->path) - 1);
   dev->read_only = read_only;
+  dev->direct_fd = -1;
+  dev->copy_pipe[0] = dev->copy_pipe[1] = -1;
 
   int flags = read_only ? O_RDONLY : O_RDWR;
-  /* Use O_DIRECT if possible for safety, fall back if not */
   dev->fd = open(path, flags);
   if (dev->fd < 0) {
     fprintf(stderr, "btrfs2ext4: cannot open %s: %s\n", path, strerror(errno));
@@ -62,37 +106,44 @@ int device_open(struct device *dev, const char *path, int read_only) {
     return -1;
   }
 
+  dev->is_blkdev = S_ISBLK(st.st_mode);
+  if (oflags & DEVICE_OPEN_DIRECT)
+    device_open_direct(dev, flags, dev->is_blkdev);
+
   return 0;
 }
 
 void device_close(struct device *dev) {
   if (dev->fd >= 0) {
+    device_cache_disable(dev);
 #ifdef HAVE_IO_URING
     if (dev->ring_initialized) {
       io_uring_queue_exit(&dev->ring);
       dev->ring_initialized = 0;
     }
 #endif
+    if (dev->direct_fd >= 0) {
+      close(dev->direct_fd);
+      dev->direct_fd = -1;
+    }
+    copy_pipe_close(dev);
+    io_stats_fsync();
     fsync(dev->fd);
     close(dev->fd);
     dev->fd = -1;
   }
 }
 
-int device_read(struct device *dev, uint64_t offset, void *buf, size_t size) {
-  if (size > dev->size || offset > dev->size - size) {
-    fprintf(stderr,
-            "btrfs2ext4: read beyond device end: offset=%lu size=%zu "
-            "dev_size=%lu\n",
-            (unsigned long)offset, size, (unsigned long)dev->size);
-    return -1;
-  }
-
+/* pread() loop shared by device_read and the cache */
+static int device_pread_all(int fd, uint64_t offset, void *buf,
+                            size_t size) {
   ssize_t total = 0;
   uint8_t *p = (uint8_t *)buf;
 
+  io_stats_read(offset, size);
   while ((size_t)total < size) {
-    ssize_t n = pread(dev->fd, p + total, size - total, offset + total);
+    io_stats_syscall();
+    ssize_t n = pread(fd, p + total, size - total, offset + total);
     if (n < 0) {
       if (errno == EINTR)
         continue;
@@ -111,27 +162,32 @@ int device_read(struct device *dev, uint64_t offset, void *buf, size_t size) {
   return 0;
 }
 
-int device_write(struct device *dev, uint64_t offset, const void *buf,
-                 size_t size) {
-  if (dev->read_only) {
-    fprintf(stderr,
-            "btrfs2ext4: cannot write: device opened read-only (dry-run)\n");
-    return -1;
-  }
-
+int device_read(struct device *dev, uint64_t offset, void *buf, size_t size) {
   if (size > dev->size || offset > dev->size - size) {
     fprintf(stderr,
-            "btrfs2ext4: write beyond device end: offset=%lu size=%zu "
+            "btrfs2ext4: read beyond device end: offset=%lu size=%zu "
             "dev_size=%lu\n",
             (unsigned long)offset, size, (unsigned long)dev->size);
     return -1;
   }
 
+  if (device_pread_all(dev->fd, offset, buf, size) < 0)
+    return -1;
+
+  cache_overlay(dev, offset, buf, size);
+  return 0;
+}
+
+/* pwrite() loop shared by device_write and the cache flush */
+static int device_pwrite_all(int fd, uint64_t offset, const void *buf,
+                             size_t size) {
   ssize_t total = 0;
   const uint8_t *p = (const uint8_t *)buf;
 
+  io_stats_write(offset, size);
   while ((size_t)total < size) {
-    ssize_t n = pwrite(dev->fd, p + total, size - total, offset + total);
+    io_stats_syscall();
+    ssize_t n = pwrite(fd, p + total, size - total, offset + total);
     if (n < 0) {
       if (errno == EINTR)
         continue;
@@ -145,10 +201,41 @@ int device_write(struct device *dev, uint64_t offset, const void *buf,
   return 0;
 }
 
+int device_write(struct device *dev, uint64_t offset, const void *buf,
+                 size_t size) {
+  if (dev->read_only) {
+    fprintf(stderr,
+            "btrfs2ext4: cannot write: device opened read-only (dry-run)\n");
+    return -1;
+  }
+
+  if (size > dev->size || offset > dev->size - size) {
+    fprintf(stderr,
+            "btrfs2ext4: write beyond device end: offset=%lu size=%zu "
+            "dev_size=%lu\n",
+            (unsigned long)offset, size, (unsigned long)dev->size);
+    return -1;
+  }
+
+  if (dev->cache) {
+    int absorbed = cache_absorb(dev, offset, buf, size);
+    if (absorbed != 0)
+      return absorbed < 0 ? -1 : 0;
+    if (cache_before_direct_io(dev, offset, size) < 0)
+      return -1;
+  }
+  return device_pwrite_all(dev->fd, offset, buf, size);
+}
+
 int device_sync(struct device *dev) {
   if (dev->read_only)
     return 0;
 
+  /* Ordering point: everything cached reaches the device first */
+  if (device_cache_flush(dev) < 0)
+    return -1;
+
+  io_stats_fsync();
   if (fdatasync(dev->fd) < 0) {
     fprintf(stderr, "btrfs2ext4: sync error: %s\n", strerror(errno));
     return -1;
@@ -159,6 +246,1013 @@ int device_sync(struct device *dev) {
 
 uint64_t device_get_size(struct device *dev) { return dev->size; }
 
+/* queue/rotational of a whole disk; partitions keep theirs on the parent */
+static int sysfs_rotational(unsigned int maj, unsigned int min) {
+  static const char *const paths[] = {
+      "/sys/dev/block/%u:%u/queue/rotational",
+      "/sys/dev/block/%u:%u/../queue/rotational",
+  };
+  for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+    char path[128];
+    snprintf(path, sizeof(path), paths[i], maj, min);
+    FILE *f = fopen(path, "r");
+    if (!f)
+      continue;
+    int c = fgetc(f);
+    fclose(f);
+    if (c == '0' || c == '1')
+      return c - '0';
+  }
+  return -1;
+}
+
+int device_is_rotational(const struct device *dev) {
+  struct stat st;
+  if (fstat(dev->fd, &st) < 0)
+    return -1;
+  /* An image file lives on whatever disk holds its file system */
+  dev_t d = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+  return sysfs_rotational(major(d), minor(d));
+}
+
+/* ========================================================================
+ * Bulk data I/O
+ * ======================================================================== */
+
+/* 1 if the request may go through the O_DIRECT descriptor */
+static int device_direct_ok(const struct device *dev, uint64_t offset,
+                            const void *buf, size_t size) {
+  if (dev->direct_fd < 0 || size == 0)
+    return 0;
+  uint64_t mask = dev->direct_align - 1;
+  return (offset & mask) == 0 && (size & mask) == 0 &&
+         ((uintptr_t)buf & mask) == 0;
+}
+
+int device_read_bulk(struct device *dev, uint64_t offset, void *buf,
+                     size_t size) {
+  if (!device_direct_ok(dev, offset, buf, size))
+    return device_read(dev, offset, buf, size);
+
+  if (size > dev->size || offset > dev->size - size) {
+    fprintf(stderr,
+            "btrfs2ext4: read beyond device end: offset=%lu size=%zu "
+            "dev_size=%lu\n",
+            (unsigned long)offset, size, (unsigned long)dev->size);
+    return -1;
+  }
+
+  /* The direct read must see writes still held by the cache */
+  if (cache_before_direct_io(dev, offset, size) < 0)
+    return -1;
+  return device_pread_all(dev->direct_fd, offset, buf, size);
+}
+
+int device_write_bulk(struct device *dev, uint64_t offset, const void *buf,
+                      size_t size) {
+  if (dev->read_only || !device_direct_ok(dev, offset, buf, size))
+    return device_write(dev, offset, buf, size);
+
+  if (size > dev->size || offset > dev->size - size) {
+    fprintf(stderr,
+            "btrfs2ext4: write beyond device end: offset=%lu size=%zu "
+            "dev_size=%lu\n",
+            (unsigned long)offset, size, (unsigned long)dev->size);
+    return -1;
+  }
+
+  /* A cached page flushed later would overwrite this write */
+  if (cache_before_direct_io(dev, offset, size) < 0)
+    return -1;
+  return device_pwrite_all(dev->direct_fd, offset, buf, size);
+}
+
+/*
+ * Aligned buffer pool. Released buffers wait on one free list per
+ * power-of-two class (linked through their first bytes) until the pool
+ * holds DEVICE_BUF_POOL_LIMIT bytes; beyond that, or above the largest
+ * class, they go straight back to the allocator.
+ */
+static struct {
+  pthread_mutex_t lock;
+  void *free[DEVICE_BUF_CLASSES];
+  struct device_buf_stats stats;
+} g_buf_pool = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* mem_track_reclaim() callback: pooled buffers are the cheapest to drop */
+static uint64_t device_buf_reclaim(void *arg, uint64_t want) {
+  (void)arg;
+  (void)want;
+  pthread_mutex_lock(&g_buf_pool.lock);
+  uint64_t pooled = g_buf_pool.stats.pooled;
+  pthread_mutex_unlock(&g_buf_pool.lock);
+  device_buf_pool_drain();
+  return pooled;
+}
+
+static pthread_once_t g_buf_reclaim_once = PTHREAD_ONCE_INIT;
+
+static void device_buf_register_reclaim(void) {
+  mem_track_set_reclaim(MEM_TAG_IO_BUF, device_buf_reclaim, NULL);
+}
+
+/* Class of a request, or -1 if it is never pooled */
+static int device_buf_class(size_t size) {
+  size_t class_size = (size_t)1 << DEVICE_BUF_MIN_SHIFT;
+  for (int cls = 0; cls < DEVICE_BUF_CLASSES; cls++, class_size <<= 1) {
+    if (size <= class_size)
+      return cls;
+  }
+  return -1;
+}
+
+void *device_buf_alloc(size_t size) {
+  if (size == 0)
+    size = 1;
+  int cls = device_buf_class(size);
+  size_t alloc_size = size;
+  if (cls >= 0) {
+    alloc_size = (size_t)1 << (DEVICE_BUF_MIN_SHIFT + cls);
+    pthread_mutex_lock(&g_buf_pool.lock);
+    void *buf = g_buf_pool.free[cls];
+    if (buf) {
+      memcpy(&g_buf_pool.free[cls], buf, sizeof(void *));
+      g_buf_pool.stats.pooled -= alloc_size;
+      g_buf_pool.stats.reuses++;
+    }
+    pthread_mutex_unlock(&g_buf_pool.lock);
+    if (buf)
+      return buf;
+  }
+
+  void *buf = NULL;
+  if (posix_memalign(&buf, DEVICE_DIRECT_ALIGN, alloc_size) != 0)
+    return NULL;
+  pthread_once(&g_buf_reclaim_once, device_buf_register_reclaim);
+  mem_track_alloc_tag(MEM_TAG_IO_BUF, alloc_size);
+  pthread_mutex_lock(&g_buf_pool.lock);
+  g_buf_pool.stats.allocs++;
+  pthread_mutex_unlock(&g_buf_pool.lock);
+  return buf;
+}
+
+void device_buf_free(void *buf, size_t size) {
+  if (!buf)
+    return;
+  if (size == 0)
+    size = 1;
+  int cls = device_buf_class(size);
+  size_t alloc_size =
+      cls >= 0 ? (size_t)1 << (DEVICE_BUF_MIN_SHIFT + cls) : size;
+
+  if (cls >= 0) {
+    pthread_mutex_lock(&g_buf_pool.lock);
+    int keep = g_buf_pool.stats.pooled + alloc_size <= DEVICE_BUF_POOL_LIMIT;
+    if (keep) {
+      memcpy(buf, &g_buf_pool.free[cls], sizeof(void *));
+      g_buf_pool.free[cls] = buf;
+      g_buf_pool.stats.pooled += alloc_size;
+    }
+    pthread_mutex_unlock(&g_buf_pool.lock);
+    if (keep)
+      return;
+  }
+  free(buf);
+  mem_track_free_tag(MEM_TAG_IO_BUF, alloc_size);
+}
+
+void device_buf_pool_drain(void) {
+  pthread_mutex_lock(&g_buf_pool.lock);
+  for (int cls = 0; cls < DEVICE_BUF_CLASSES; cls++) {
+    size_t alloc_size = (size_t)1 << (DEVICE_BUF_MIN_SHIFT + cls);
+    void *buf = g_buf_pool.free[cls];
+    while (buf) {
+      void *next;
+      memcpy(&next, buf, sizeof(void *));
+      free(buf);
+      mem_track_free_tag(MEM_TAG_IO_BUF, alloc_size);
+      buf = next;
+    }
+    g_buf_pool.free[cls] = NULL;
+  }
+  g_buf_pool.stats.pooled = 0;
+  pthread_mutex_unlock(&g_buf_pool.lock);
+}
+
+void device_buf_get_stats(struct device_buf_stats *out) {
+  pthread_mutex_lock(&g_buf_pool.lock);
+  *out = g_buf_pool.stats;
+  pthread_mutex_unlock(&g_buf_pool.lock);
+}
+
+/* ========================================================================
+ * Data mover
+ *
+ * Each method copies one piece at a time and returns the bytes it moved,
+ * -1 on an I/O error, or COPY_REFUSED when the kernel will not do this
+ * kind of copy at all (the piece is then retried with the next method;
+ * rewriting bytes a refused piece may already have written is harmless).
+ * ======================================================================== */
+
+#define COPY_REFUSED (-2)
+
+/* copy_file_range() pieces: large enough that the syscall count does not
+ * matter, small enough to stay under MAX_RW_COUNT */
+#define COPY_RANGE_MAX (1u << 30)
+
+static int copy_refused(int err) {
+  return err == EXDEV || err == EINVAL || err == EOPNOTSUPP ||
+         err == ENOSYS || err == EBADF;
+}
+
+static void copy_pipe_close(struct device *dev) {
+  for (int i = 0; i < 2; i++) {
+    if (dev->copy_pipe[i] >= 0)
+      close(dev->copy_pipe[i]);
+    dev->copy_pipe[i] = -1;
+  }
+}
+
+static int copy_pipe_open(struct device *dev) {
+  if (dev->copy_pipe[0] >= 0)
+    return 0;
+  if (pipe2(dev->copy_pipe, O_CLOEXEC) < 0) {
+    dev->copy_pipe[0] = dev->copy_pipe[1] = -1;
+    return -1;
+  }
+  /* May be capped by /proc/sys/fs/pipe-max-size; use what we get */
+  fcntl(dev->copy_pipe[1], F_SETPIPE_SZ, DEVICE_COPY_CHUNK);
+  int size = fcntl(dev->copy_pipe[1], F_GETPIPE_SZ);
+  dev->copy_pipe_size = size > 0 ? (uint32_t)size : 65536;
+  return 0;
+}
+
+static int64_t copy_range_piece(struct device *dev, uint64_t src,
+                                uint64_t dst, uint64_t len) {
+  loff_t in = (loff_t)src;
+  loff_t out = (loff_t)dst;
+  size_t want = len > COPY_RANGE_MAX ? COPY_RANGE_MAX : (size_t)len;
+  for (;;) {
+    io_stats_syscall();
+    ssize_t n = copy_file_range(dev->fd, &in, dev->fd, &out, want, 0);
+    if (n > 0) {
+      io_stats_read(src, (uint64_t)n);
+      io_stats_write(dst, (uint64_t)n);
+      return n;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && copy_refused(errno))
+      return COPY_REFUSED;
+    fprintf(stderr, "btrfs2ext4: copy error at offset %lu: %s\n",
+            (unsigned long)src, n < 0 ? strerror(errno) : "unexpected EOF");
+    return -1;
+  }
+}
+
+/* Write `left` bytes queued in the pipe to dst */
+static int copy_pipe_drain(struct device *dev, uint64_t dst, size_t left) {
+  loff_t out = (loff_t)dst;
+  while (left > 0) {
+    io_stats_syscall();
+    ssize_t n = splice(dev->copy_pipe[0], NULL, dev->fd, &out, left,
+                       SPLICE_F_MOVE);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      int err = n < 0 ? errno : EIO;
+      copy_pipe_close(dev); /* drop what is left in it */
+      if (copy_refused(err))
+        return COPY_REFUSED;
+      fprintf(stderr, "btrfs2ext4: copy write error at offset %lu: %s\n",
+              (unsigned long)out, strerror(err));
+      return -1;
+    }
+    left -= (size_t)n;
+  }
+  return 0;
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * Both halves of a splice piece in one submission: the write is linked to
+ * the read, so a short read cancels it and the rest is drained here.
+ * Returns 0 when the ring cannot be used, so the caller falls back to the
+ * syscalls.
+ */
+static int64_t copy_splice_ring(struct device *dev, uint64_t src,
+                                uint64_t dst, size_t want) {
+  if (dev->copy_no_ring || !dev->ring_initialized || dev->batch_pending > 0)
+    return 0;
+  struct io_uring_sqe *in_sqe = io_uring_get_sqe(&dev->ring);
+  struct io_uring_sqe *out_sqe = in_sqe ? io_uring_get_sqe(&dev->ring) : NULL;
+  if (!out_sqe)
+    return 0;
+
+  io_uring_prep_splice(in_sqe, dev->fd, (int64_t)src, dev->copy_pipe[1], -1,
+                       (unsigned)want, SPLICE_F_MOVE);
+  in_sqe->flags |= IOSQE_IO_LINK;
+  io_uring_sqe_set_data(in_sqe, (void *)1);
+  io_uring_prep_splice(out_sqe, dev->copy_pipe[0], -1, dev->fd, (int64_t)dst,
+                       (unsigned)want, SPLICE_F_MOVE);
+  io_uring_sqe_set_data(out_sqe, (void *)2);
+
+  io_stats_uring_submit(2);
+  int ret = io_uring_submit(&dev->ring);
+  if (ret < 0) {
+    fprintf(stderr, "btrfs2ext4: io_uring_submit failed: %s\n", strerror(-ret));
+    return -1;
+  }
+  int res_in = -ECANCELED, res_out = -ECANCELED;
+  for (int i = 0; i < 2; i++) {
+    struct io_uring_cqe *cqe;
+    ret = io_uring_wait_cqe(&dev->ring, &cqe);
+    if (ret < 0) {
+      fprintf(stderr, "btrfs2ext4: io_uring_wait_cqe failed: %s\n",
+              strerror(-ret));
+      copy_pipe_close(dev);
+      return -1;
+    }
+    if (io_uring_cqe_get_data(cqe) == (void *)1)
+      res_in = cqe->res;
+    else
+      res_out = cqe->res;
+    io_uring_cqe_seen(&dev->ring, cqe);
+  }
+
+  if (res_in <= 0) {
+    if (res_in < 0 && copy_refused(-res_in)) {
+      dev->copy_no_ring = 1; /* no splice on this ring; try the syscall */
+      return 0;
+    }
+    fprintf(stderr, "btrfs2ext4: copy error at offset %lu: %s\n",
+            (unsigned long)src,
+            res_in < 0 ? strerror(-res_in) : "unexpected EOF");
+    return -1;
+  }
+  io_stats_read(src, (uint64_t)res_in);
+  io_stats_write(dst, (uint64_t)res_in);
+
+  size_t written = res_out > 0 ? (size_t)res_out : 0;
+  if (res_out < 0 && res_out != -ECANCELED) {
+    copy_pipe_close(dev);
+    if (copy_refused(-res_out))
+      return COPY_REFUSED;
+    fprintf(stderr, "btrfs2ext4: copy write error at offset %lu: %s\n",
+            (unsigned long)dst, strerror(-res_out));
+    return -1;
+  }
+  if (written < (size_t)res_in) {
+    int r = copy_pipe_drain(dev, dst + written, (size_t)res_in - written);
+    if (r < 0)
+      return r;
+  }
+  return res_in;
+}
+#endif
+
+static int64_t copy_splice_piece(struct device *dev, uint64_t src,
+                                 uint64_t dst, uint64_t len) {
+  if (copy_pipe_open(dev) < 0)
+    return COPY_REFUSED;
+  size_t want = len > dev->copy_pipe_size ? dev->copy_pipe_size : (size_t)len;
+
+#ifdef HAVE_IO_URING
+  int64_t done = copy_splice_ring(dev, src, dst, want);
+  if (done != 0)
+    return done;
+#endif
+
+  loff_t in = (loff_t)src;
+  ssize_t n;
+  do {
+    io_stats_syscall();
+    n = splice(dev->fd, &in, dev->copy_pipe[1], NULL, want, SPLICE_F_MOVE);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0 && copy_refused(errno))
+    return COPY_REFUSED;
+  if (n <= 0) {
+    fprintf(stderr, "btrfs2ext4: copy error at offset %lu: %s\n",
+            (unsigned long)src, n < 0 ? strerror(errno) : "unexpected EOF");
+    return -1;
+  }
+  io_stats_read(src, (uint64_t)n);
+  io_stats_write(dst, (uint64_t)n);
+  int r = copy_pipe_drain(dev, dst, (size_t)n);
+  return r < 0 ? r : n;
+}
+
+static int64_t copy_buffer_piece(struct device *dev, uint64_t src,
+                                 uint64_t dst, uint64_t len, uint8_t **bounce) {
+  if (!*bounce && !(*bounce = device_buf_alloc(DEVICE_COPY_CHUNK))) {
+    fprintf(stderr, "btrfs2ext4: out of memory for copy buffer\n");
+    return -1;
+  }
+  size_t want = len > DEVICE_COPY_CHUNK ? DEVICE_COPY_CHUNK : (size_t)len;
+  if (device_read_bulk(dev, src, *bounce, want) < 0 ||
+      device_write_bulk(dev, dst, *bounce, want) < 0)
+    return -1;
+  return (int64_t)want;
+}
+
+enum device_copy_mode device_copy_mode(struct device *dev) {
+  if (dev->copy_mode == DEVICE_COPY_AUTO) {
+    /* An empty request still goes through the kernel's checks. A
+     * read-only descriptor fails them anyway; there only regular files
+     * are expected to take copy_file_range(). */
+    int refused;
+    if (dev->read_only) {
+      struct stat st;
+      refused = fstat(dev->fd, &st) < 0 || !S_ISREG(st.st_mode);
+    } else {
+      loff_t in = 0, out = 0;
+      io_stats_syscall();
+      refused = copy_file_range(dev->fd, &in, dev->fd, &out, 0, 0) < 0 &&
+                copy_refused(errno);
+    }
+    dev->copy_mode = refused ? DEVICE_COPY_SPLICE : DEVICE_COPY_RANGE;
+#ifdef HAVE_IO_URING
+    if (!dev->read_only && !dev->ring_initialized)
+      device_write_batch_begin(dev);
+#endif
+  }
+  return (enum device_copy_mode)dev->copy_mode;
+}
+
+void device_copy_set_mode(struct device *dev, enum device_copy_mode mode) {
+  dev->copy_mode = mode;
+  dev->copy_no_ring = 0;
+}
+
+const char *device_copy_mode_name(enum device_copy_mode mode) {
+  switch (mode) {
+  case DEVICE_COPY_RANGE:
+    return "copy_file_range";
+  case DEVICE_COPY_SPLICE:
+    return "splice";
+  case DEVICE_COPY_BUFFER:
+    return "buffer";
+  default:
+    return "auto";
+  }
+}
+
+int device_copy(struct device *dev, uint64_t src, uint64_t dst, uint64_t len) {
+  if (dev->read_only) {
+    fprintf(stderr,
+            "btrfs2ext4: cannot write: device opened read-only (dry-run)\n");
+    return -1;
+  }
+  if (len > dev->size || src > dev->size - len || dst > dev->size - len) {
+    fprintf(stderr,
+            "btrfs2ext4: copy beyond device end: src=%lu dst=%lu len=%lu "
+            "dev_size=%lu\n",
+            (unsigned long)src, (unsigned long)dst, (unsigned long)len,
+            (unsigned long)dev->size);
+    return -1;
+  }
+  if (len == 0)
+    return 0;
+  if (src < dst + len && dst < src + len) {
+    fprintf(stderr, "btrfs2ext4: overlapping copy: src=%lu dst=%lu len=%lu\n",
+            (unsigned long)src, (unsigned long)dst, (unsigned long)len);
+    return -1;
+  }
+
+  /* The kernel must see writes still held by the cache, and a page
+   * flushed later would overwrite the copy */
+  if (cache_before_direct_io(dev, src, len) < 0 ||
+      cache_before_direct_io(dev, dst, len) < 0)
+    return -1;
+
+  uint8_t *bounce = NULL;
+  uint64_t done = 0;
+  int ret = 0;
+  while (done < len) {
+    enum device_copy_mode mode = device_copy_mode(dev);
+    int64_t n;
+    if (mode == DEVICE_COPY_RANGE)
+      n = copy_range_piece(dev, src + done, dst + done, len - done);
+    else if (mode == DEVICE_COPY_SPLICE)
+      n = copy_splice_piece(dev, src + done, dst + done, len - done);
+    else
+      n = copy_buffer_piece(dev, src + done, dst + done, len - done, &bounce);
+
+    if (n == COPY_REFUSED) {
+      dev->copy_mode = mode + 1;
+      continue;
+    }
+    if (n < 0) {
+      ret = -1;
+      break;
+    }
+    done += (uint64_t)n;
+  }
+  device_buf_free(bounce, DEVICE_COPY_CHUNK);
+  return ret;
+}
+
+/* ========================================================================
+ * Zeroing
+ *
+ * Offloaded pieces cover whole DEVICE_DIRECT_ALIGN blocks, which every
+ * logical block size this tool accepts divides, so a refusal means the
+ * method, not the request. Only the fallocate()/ioctl errors that say
+ * "not supported here" demote the method; others fail the call.
+ * ======================================================================== */
+
+/* Never written: its pages stay the kernel's shared zero page */
+static _Alignas(DEVICE_DIRECT_ALIGN) uint8_t g_zero_chunk[DEVICE_ZERO_CHUNK];
+
+static int zero_refused(int err) {
+  return err == EOPNOTSUPP || err == ENOTTY || err == EINVAL ||
+         err == ENOSYS || err == ENODEV;
+}
+
+/* One offloaded request over [offset, offset + len): 0, -1 on an I/O
+ * error, or COPY_REFUSED */
+static int zero_offload(struct device *dev, enum device_zero_mode mode,
+                        uint64_t offset, uint64_t len) {
+  for (;;) {
+    int r;
+    io_stats_syscall();
+    if (mode == DEVICE_ZERO_PUNCH) {
+      r = fallocate(dev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    (off_t)offset, (off_t)len);
+    } else if (!dev->is_blkdev) {
+      r = fallocate(dev->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+                    (off_t)offset, (off_t)len);
+    } else {
+      uint64_t range[2] = {offset, len};
+      r = ioctl(dev->fd, BLKZEROOUT, range);
+    }
+    if (r == 0)
+      return 0;
+    if (errno == EINTR)
+      continue;
+    if (zero_refused(errno))
+      return COPY_REFUSED;
+    fprintf(stderr, "btrfs2ext4: zeroing error at offset %lu: %s\n",
+            (unsigned long)offset, strerror(errno));
+    return -1;
+  }
+}
+
+/* Write zeros from the shared buffer, one batch */
+static int zero_write(struct device *dev, uint64_t offset, uint64_t len) {
+  device_write_batch_begin(dev);
+  while (len > 0) {
+    size_t n = len > DEVICE_ZERO_CHUNK ? DEVICE_ZERO_CHUNK : (size_t)len;
+    if (device_write_batch_add(dev, offset, g_zero_chunk, n) < 0)
+      return -1;
+    offset += n;
+    len -= n;
+  }
+  return device_write_batch_submit(dev);
+}
+
+int device_zero_range(struct device *dev, uint64_t offset, uint64_t len) {
+  if (dev->read_only) {
+    fprintf(stderr,
+            "btrfs2ext4: cannot write: device opened read-only (dry-run)\n");
+    return -1;
+  }
+  if (len > dev->size || offset > dev->size - len) {
+    fprintf(stderr,
+            "btrfs2ext4: zeroing beyond device end: offset=%lu len=%lu "
+            "dev_size=%lu\n",
+            (unsigned long)offset, (unsigned long)len,
+            (unsigned long)dev->size);
+    return -1;
+  }
+  if (len == 0)
+    return 0;
+
+  /* Whole blocks go to the kernel, the edges are written */
+  uint64_t lo = (offset + DEVICE_DIRECT_ALIGN - 1) / DEVICE_DIRECT_ALIGN *
+                DEVICE_DIRECT_ALIGN;
+  uint64_t hi = (offset + len) / DEVICE_DIRECT_ALIGN * DEVICE_DIRECT_ALIGN;
+  if (lo >= hi)
+    return zero_write(dev, offset, len);
+  if (lo > offset && zero_write(dev, offset, lo - offset) < 0)
+    return -1;
+  if (offset + len > hi && zero_write(dev, hi, offset + len - hi) < 0)
+    return -1;
+
+  /* A page flushed later would overwrite the zeros */
+  if (cache_before_direct_io(dev, lo, hi - lo) < 0)
+    return -1;
+
+  for (;;) {
+    if (dev->zero_mode == DEVICE_ZERO_AUTO)
+      dev->zero_mode = DEVICE_ZERO_PUNCH;
+    if (dev->zero_mode == DEVICE_ZERO_WRITE)
+      return zero_write(dev, lo, hi - lo);
+    int r = zero_offload(dev, dev->zero_mode, lo, hi - lo);
+    if (r != COPY_REFUSED)
+      return r;
+    dev->zero_mode++;
+  }
+}
+
+enum device_zero_mode device_zero_mode(const struct device *dev) {
+  return (enum device_zero_mode)dev->zero_mode;
+}
+
+void device_zero_set_mode(struct device *dev, enum device_zero_mode mode) {
+  dev->zero_mode = mode;
+}
+
+const char *device_zero_mode_name(const struct device *dev,
+                                  enum device_zero_mode mode) {
+  switch (mode) {
+  case DEVICE_ZERO_PUNCH:
+    return "punch";
+  case DEVICE_ZERO_RANGE:
+    return dev->is_blkdev ? "blkzeroout" : "zero_range";
+  case DEVICE_ZERO_WRITE:
+    return "write";
+  default:
+    return "auto";
+  }
+}
+
+/* ========================================================================
+ * Write-combining cache
+ *
+ * Small writes are copied into DEVICE_CACHE_PAGE-aligned pages (looked up
+ * by page index in an open-addressing table) and only reach the device
+ * at a flush, sorted by offset, with runs of adjacent dirty bytes merged
+ * into one pwritev(). Each page keeps one dirty byte range; a write that
+ * does not touch it first reads the gap from disk so the range stays
+ * contiguous. Larger writes and batch I/O bypass the cache, flushing it
+ * first if they overlap a cached page, and reads see cached bytes.
+ * ======================================================================== */
+
+struct cache_page {
+  uint64_t index;  /* offset / DEVICE_CACHE_PAGE */
+  uint32_t lo, hi; /* dirty bytes [lo, hi) */
+  uint8_t data[DEVICE_CACHE_PAGE];
+};
+
+struct device_cache {
+  pthread_mutex_t lock;
+  struct cache_page **slots;
+  uint32_t mask;  /* slot count - 1 */
+  uint32_t count; /* pages held */
+  uint64_t min_index, max_index;
+  uint64_t budget; /* bytes of pages before a forced flush */
+  struct device_cache_stats stats;
+};
+
+static inline uint32_t cache_hash(uint64_t index, uint32_t mask) {
+  return (uint32_t)((index * 2654435761ULL) >> 7) & mask;
+}
+
+static struct cache_page *cache_find(const struct device_cache *c,
+                                     uint64_t index) {
+  if (c->count == 0 || index < c->min_index || index > c->max_index)
+    return NULL;
+  for (uint32_t i = cache_hash(index, c->mask);; i = (i + 1) & c->mask) {
+    struct cache_page *pg = c->slots[i];
+    if (!pg)
+      return NULL;
+    if (pg->index == index)
+      return pg;
+  }
+}
+
+static int cache_grow(struct device_cache *c) {
+  uint32_t new_size = (c->mask + 1) * 2;
+  struct cache_page **slots = calloc(new_size, sizeof(*slots));
+  if (!slots)
+    return -1;
+  for (uint32_t i = 0; i <= c->mask; i++) {
+    struct cache_page *pg = c->slots[i];
+    if (!pg)
+      continue;
+    uint32_t j = cache_hash(pg->index, new_size - 1);
+    while (slots[j])
+      j = (j + 1) & (new_size - 1);
+    slots[j] = pg;
+  }
+  free(c->slots);
+  c->slots = slots;
+  c->mask = new_size - 1;
+  return 0;
+}
+
+static struct cache_page *cache_insert(struct device_cache *c,
+                                       uint64_t index) {
+  if ((c->count + 1) * 2 > c->mask + 1 && cache_grow(c) < 0)
+    return NULL;
+  struct cache_page *pg = malloc(sizeof(*pg));
+  if (!pg)
+    return NULL;
+  pg->index = index;
+  pg->lo = pg->hi = 0;
+  uint32_t i = cache_hash(index, c->mask);
+  while (c->slots[i])
+    i = (i + 1) & c->mask;
+  c->slots[i] = pg;
+  if (c->count == 0 || index < c->min_index)
+    c->min_index = index;
+  if (c->count == 0 || index > c->max_index)
+    c->max_index = index;
+  c->count++;
+  mem_track_alloc_tag(MEM_TAG_WRITE_CACHE, sizeof(*pg));
+  return pg;
+}
+
+static int cache_page_cmp(const void *a, const void *b) {
+  const struct cache_page *pa = *(const struct cache_page *const *)a;
+  const struct cache_page *pb = *(const struct cache_page *const *)b;
+  return (pa->index > pb->index) - (pa->index < pb->index);
+}
+
+/* pwritev() until every byte of iov[0..n) is written */
+static int cache_pwritev_all(struct device *dev, struct iovec *iov, int n,
+                             uint64_t offset) {
+  uint64_t bytes = 0;
+  for (int i = 0; i < n; i++)
+    bytes += iov[i].iov_len;
+  io_stats_write(offset, bytes);
+
+  while (n > 0) {
+    io_stats_syscall();
+    ssize_t w = pwritev(dev->fd, iov, n, (off_t)offset);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "btrfs2ext4: write error at offset %lu: %s\n",
+              (unsigned long)offset, strerror(errno));
+      return -1;
+    }
+    offset += (uint64_t)w;
+    while (n > 0 && (size_t)w >= iov->iov_len) {
+      w -= (ssize_t)iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + w;
+      iov->iov_len -= (size_t)w;
+    }
+  }
+  return 0;
+}
+
+/* Write every page out in offset order and empty the cache; lock held */
+static int cache_flush_locked(struct device *dev, struct device_cache *c) {
+  if (c->count == 0)
+    return 0;
+
+  uint32_t n = 0;
+  struct cache_page **pages = malloc((size_t)c->count * sizeof(*pages));
+  if (!pages) {
+    fprintf(stderr, "btrfs2ext4: OOM flushing write cache\n");
+    return -1;
+  }
+  for (uint32_t i = 0; i <= c->mask; i++) {
+    if (c->slots[i])
+      pages[n++] = c->slots[i];
+    c->slots[i] = NULL;
+  }
+  qsort(pages, n, sizeof(*pages), cache_page_cmp);
+
+  struct iovec iov[IOV_MAX < 1024 ? IOV_MAX : 1024];
+  int max_iov = (int)(sizeof(iov) / sizeof(iov[0]));
+  int ret = 0;
+  for (uint32_t k = 0; k < n;) {
+    /* A run continues while the dirty bytes meet at page boundaries */
+    int cnt = 0;
+    uint64_t offset = pages[k]->index * DEVICE_CACHE_PAGE + pages[k]->lo;
+    do {
+      struct cache_page *pg = pages[k + cnt];
+      iov[cnt].iov_base = pg->data + pg->lo;
+      iov[cnt].iov_len = pg->hi - pg->lo;
+      cnt++;
+    } while (k + cnt < n && cnt < max_iov &&
+             pages[k + cnt - 1]->hi == DEVICE_CACHE_PAGE &&
+             pages[k + cnt]->lo == 0 &&
+             pages[k + cnt]->index == pages[k + cnt - 1]->index + 1);
+    if (ret == 0 && cache_pwritev_all(dev, iov, cnt, offset) < 0)
+      ret = -1;
+    c->stats.flush_ios++;
+    k += (uint32_t)cnt;
+  }
+
+  for (uint32_t k = 0; k < n; k++)
+    free(pages[k]);
+  free(pages);
+  mem_track_free_tag(MEM_TAG_WRITE_CACHE,
+                    (size_t)n * sizeof(struct cache_page));
+  c->count = 0;
+  c->stats.flushes++;
+  return ret;
+}
+
+/*
+ * Copy a small write into the cache. Returns 1 if absorbed, 0 if the
+ * write must go to the device, -1 on error.
+ */
+static int cache_absorb(struct device *dev, uint64_t offset, const void *buf,
+                        size_t size) {
+  struct device_cache *c = dev->cache;
+  if (size == 0 || size > DEVICE_CACHE_MAX_WRITE)
+    return 0;
+
+  pthread_mutex_lock(&c->lock);
+  const uint8_t *src = buf;
+  uint64_t end = offset + size;
+  int ret = 1;
+  while (offset < end) {
+    uint64_t index = offset / DEVICE_CACHE_PAGE;
+    uint32_t lo = (uint32_t)(offset % DEVICE_CACHE_PAGE);
+    uint32_t hi = end - index * DEVICE_CACHE_PAGE < DEVICE_CACHE_PAGE
+                      ? (uint32_t)(end - index * DEVICE_CACHE_PAGE)
+                      : DEVICE_CACHE_PAGE;
+
+    struct cache_page *pg = cache_find(c, index);
+    if (!pg) {
+      pg = cache_insert(c, index);
+      if (!pg) {
+        /* No memory for the page: write this piece through */
+        ret = cache_flush_locked(dev, c) < 0 ||
+                      device_pwrite_all(dev->fd, offset, src, hi - lo) < 0
+                  ? -1
+                  : 1;
+        if (ret < 0)
+          break;
+        src += hi - lo;
+        offset += hi - lo;
+        continue;
+      }
+      pg->lo = lo;
+      pg->hi = hi;
+    } else {
+      /* Keep a single dirty range: read whatever lies between */
+      uint64_t base = index * DEVICE_CACHE_PAGE;
+      if (hi < pg->lo && device_pread_all(dev->fd, base + hi, pg->data + hi,
+                                          pg->lo - hi) < 0) {
+        ret = -1;
+        break;
+      }
+      if (lo > pg->hi && device_pread_all(dev->fd, base + pg->hi,
+                                          pg->data + pg->hi, lo - pg->hi) < 0) {
+        ret = -1;
+        break;
+      }
+      if (lo < pg->lo)
+        pg->lo = lo;
+      if (hi > pg->hi)
+        pg->hi = hi;
+    }
+    memcpy(pg->data + lo, src, hi - lo);
+    src += hi - lo;
+    offset += hi - lo;
+  }
+  c->stats.writes_absorbed++;
+
+  if (ret > 0 && ((uint64_t)c->count * sizeof(struct cache_page) >=
+                      c->budget ||
+                  mem_track_exceeded())) {
+    if (cache_flush_locked(dev, c) < 0)
+      ret = -1;
+  }
+  pthread_mutex_unlock(&c->lock);
+  return ret;
+}
+
+/* A write or batch I/O is about to bypass the cache: flush any page it
+ * overlaps so the device sees the writes in program order */
+static int cache_before_direct_io(struct device *dev, uint64_t offset,
+                                  size_t size) {
+  struct device_cache *c = dev->cache;
+  if (!c || size == 0)
+    return 0;
+
+  int ret = 0;
+  pthread_mutex_lock(&c->lock);
+  uint64_t first = offset / DEVICE_CACHE_PAGE;
+  uint64_t last = (offset + size - 1) / DEVICE_CACHE_PAGE;
+  if (c->count > 0 && first <= c->max_index && last >= c->min_index) {
+    if (first < c->min_index)
+      first = c->min_index;
+    if (last > c->max_index)
+      last = c->max_index;
+    for (uint64_t index = first; index <= last; index++) {
+      if (cache_find(c, index)) {
+        ret = cache_flush_locked(dev, c);
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&c->lock);
+  return ret;
+}
+
+/* Patch cached bytes into a buffer just read from the device */
+static void cache_overlay(struct device *dev, uint64_t offset, void *buf,
+                          size_t size) {
+  struct device_cache *c = dev->cache;
+  if (!c || size == 0)
+    return;
+
+  pthread_mutex_lock(&c->lock);
+  uint64_t end = offset + size;
+  uint64_t first = offset / DEVICE_CACHE_PAGE;
+  uint64_t last = (end - 1) / DEVICE_CACHE_PAGE;
+  if (c->count > 0 && first <= c->max_index && last >= c->min_index) {
+    if (first < c->min_index)
+      first = c->min_index;
+    if (last > c->max_index)
+      last = c->max_index;
+    for (uint64_t index = first; index <= last; index++) {
+      const struct cache_page *pg = cache_find(c, index);
+      if (!pg)
+        continue;
+      uint64_t lo = index * DEVICE_CACHE_PAGE + pg->lo;
+      uint64_t hi = index * DEVICE_CACHE_PAGE + pg->hi;
+      if (lo < offset)
+        lo = offset;
+      if (hi > end)
+        hi = end;
+      if (lo < hi)
+        memcpy((uint8_t *)buf + (lo - offset),
+               pg->data + (lo - index * DEVICE_CACHE_PAGE), hi - lo);
+    }
+  }
+  pthread_mutex_unlock(&c->lock);
+}
+
+/* mem_track_reclaim() callback: write the dirty pages back */
+static uint64_t device_cache_reclaim(void *arg, uint64_t want) {
+  struct device *dev = arg;
+  struct device_cache *c = dev->cache;
+  (void)want;
+  if (!c)
+    return 0;
+  pthread_mutex_lock(&c->lock);
+  uint64_t held = (uint64_t)c->count * sizeof(struct cache_page);
+  int ret = cache_flush_locked(dev, c);
+  pthread_mutex_unlock(&c->lock);
+  return ret < 0 ? 0 : held;
+}
+
+int device_cache_enable(struct device *dev, uint64_t budget) {
+  if (dev->cache || dev->read_only)
+    return 0;
+
+  struct device_cache *c = calloc(1, sizeof(*c));
+  if (!c)
+    return -1;
+  c->mask = 1024 - 1;
+  c->slots = calloc(c->mask + 1, sizeof(*c->slots));
+  if (!c->slots) {
+    free(c);
+    return -1;
+  }
+  c->budget = budget ? budget : DEVICE_CACHE_DEFAULT_BUDGET;
+  pthread_mutex_init(&c->lock, NULL);
+  dev->cache = c;
+  mem_track_set_reclaim(MEM_TAG_WRITE_CACHE, device_cache_reclaim, dev);
+  return 0;
+}
+
+int device_cache_flush(struct device *dev) {
+  struct device_cache *c = dev->cache;
+  if (!c)
+    return 0;
+  pthread_mutex_lock(&c->lock);
+  int ret = cache_flush_locked(dev, c);
+  pthread_mutex_unlock(&c->lock);
+  return ret;
+}
+
+int device_cache_disable(struct device *dev) {
+  struct device_cache *c = dev->cache;
+  if (!c)
+    return 0;
+  mem_track_set_reclaim(MEM_TAG_WRITE_CACHE, NULL, NULL);
+  int ret = device_cache_flush(dev);
+  dev->cache = NULL;
+  pthread_mutex_destroy(&c->lock);
+  free(c->slots);
+  free(c);
+  return ret;
+}
+
+void device_cache_get_stats(const struct device *dev,
+                            struct device_cache_stats *out) {
+  memset(out, 0, sizeof(*out));
+  if (dev->cache) {
+    pthread_mutex_lock(&dev->cache->lock);
+    *out = dev->cache->stats;
+    pthread_mutex_unlock(&dev->cache->lock);
+  }
+}
+
 /* ========================================================================
  * Batch Write API — io_uring accelerated
  * ======================================================================== */
@@ -193,6 +1287,9 @@ int device_write_batch_add(struct device *dev, uint64_t offset, const void *buf,
     return device_write(dev, offset, buf, size);
   }
 
+  if (cache_before_direct_io(dev, offset, size) < 0)
+    return -1;
+
   /* Auto-flush if queue is full */
   if (dev->batch_pending >= DEVICE_BATCH_QUEUE_DEPTH) {
     if (device_write_batch_submit(dev) < 0)
@@ -214,6 +1311,7 @@ int device_write_batch_add(struct device *dev, uint64_t offset, const void *buf,
   io_uring_prep_write(sqe, dev->fd, buf, (unsigned)size, (__s64)offset);
   io_uring_sqe_set_data(sqe, NULL); /* No per-SQE user data needed */
   dev->batch_pending++;
+  io_stats_write(offset, size);
 
   return 0;
 }
@@ -222,6 +1320,7 @@ int device_write_batch_submit(struct device *dev) {
   if (!dev->ring_initialized || dev->batch_pending == 0)
     return 0;
 
+  io_stats_uring_submit(dev->batch_pending);
   int ret = io_uring_submit(&dev->ring);
   if (ret < 0) {
     fprintf(stderr, "btrfs2ext4: io_uring_submit failed: %s\n", strerror(-ret));
@@ -263,9 +1362,12 @@ int device_read_batch_add(struct device *dev, uint64_t offset, void *buf,
                           size_t size) {
   if (!dev->ring_initialized) {
     /* Fallback: io_uring not initialized, use synchronous read */
-    return device_read(dev, offset, buf, size);
+    return device_read_bulk(dev, offset, buf, size);
   }
 
+  if (cache_before_direct_io(dev, offset, size) < 0)
+    return -1;
+
   /* Auto-flush if queue is full */
   if (dev->batch_pending >= DEVICE_BATCH_QUEUE_DEPTH) {
     if (device_read_batch_submit(dev) < 0)
@@ -284,9 +1386,11 @@ int device_read_batch_add(struct device *dev, uint64_t offset, void *buf,
     }
   }
 
-  io_uring_prep_read(sqe, dev->fd, buf, (unsigned)size, (__s64)offset);
+  int fd = device_direct_ok(dev, offset, buf, size) ? dev->direct_fd : dev->fd;
+  io_uring_prep_read(sqe, fd, buf, (unsigned)size, (__s64)offset);
   io_uring_sqe_set_data(sqe, NULL);
   dev->batch_pending++;
+  io_stats_read(offset, size);
 
   return 0;
 }
@@ -319,7 +1423,7 @@ int device_read_batch_begin(struct device *dev) {
 
 int device_read_batch_add(struct device *dev, uint64_t offset, void *buf,
                           size_t size) {
-  return device_read(dev, offset, buf, size);
+  return device_read_bulk(dev, offset, buf, size);
 }
 
 int device_read_batch_submit(struct device *dev) {
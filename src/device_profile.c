@@ -0,0 +1,409 @@
+/*
+ * device_profile.c — Device performance profile and dry-run time model
+ *
+ * Read tests go through the bulk path of the device handle so they use
+ * its O_DIRECT descriptor when there is one; on a buffered handle each
+ * range is dropped from the page cache just before it is read. Write
+ * tests need a writable descriptor, which a dry run does not have: they
+ * open their own (O_DIRECT when the file system takes it) and only ever
+ * write back bytes they have just read from free space.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "device_io.h"
+#include "device_profile.h"
+#include "usage_map.h"
+
+extern uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* Block size of the random read and commit tests */
+#define PROFILE_SMALL_IO 4096
+#define PROFILE_LARGE_IO 65536
+
+/* Write tests need at least this much contiguous free space */
+#define PROFILE_MIN_FREE (4ULL * 1024 * 1024)
+
+/* Stay clear of the start of the device (boot area, primary superblock) */
+#define PROFILE_SKIP_HEAD (1024ULL * 1024)
+
+/* Cache flush cost assumed when commits were not timed */
+#define PROFILE_GUESS_FLUSH_HDD 0.0083 /* one revolution at 7200 rpm */
+#define PROFILE_GUESS_FLUSH_SSD 0.0005
+
+static const uint32_t g_depths[DEVICE_PROFILE_DEPTHS] =
+    DEVICE_PROFILE_DEPTH_LIST;
+
+static const char *const g_eta_names[ETA_PHASE_COUNT] = {
+    [ETA_PHASE_SCAN] = "scan",
+    [ETA_PHASE_RELOCATE] = "relocate",
+    [ETA_PHASE_DECOMPRESS] = "decompress",
+    [ETA_PHASE_CLONE] = "clone",
+    [ETA_PHASE_METADATA] = "metadata",
+};
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Keep the page cache from answering a read test */
+static void profile_drop(const struct device *dev, uint64_t off, uint64_t len) {
+  if (dev->direct_fd < 0)
+    posix_fadvise(dev->fd, (off_t)off, (off_t)len, POSIX_FADV_DONTNEED);
+}
+
+/* xorshift64*: offsets only need to be spread, not unpredictable */
+static uint64_t profile_rand(uint64_t *s) {
+  *s ^= *s >> 12;
+  *s ^= *s << 25;
+  *s ^= *s >> 27;
+  return *s * 0x2545f4914f6cdd1dULL;
+}
+
+/* Bytes per second over `len` bytes read from the middle of the device */
+static double profile_seq_read(struct device *dev, uint8_t *buf) {
+  uint64_t len = DEVICE_PROFILE_SEQ_BYTES;
+  if (len > dev->size)
+    len = dev->size;
+  if (len == 0)
+    return 0.0;
+  uint64_t start =
+      ((dev->size - len) / 2) & ~(uint64_t)(DEVICE_PROFILE_SEQ_IO - 1);
+
+  profile_drop(dev, start, len);
+  double t0 = now_sec();
+  for (uint64_t done = 0; done < len;) {
+    size_t n = len - done < DEVICE_PROFILE_SEQ_IO ? (size_t)(len - done)
+                                                  : DEVICE_PROFILE_SEQ_IO;
+    if (device_read_bulk(dev, start + done, buf, n) < 0)
+      return 0.0;
+    done += n;
+  }
+  double t = now_sec() - t0;
+  return t > 0.0 ? (double)len / t : 0.0;
+}
+
+/* Reads per second of `io`-byte requests at random aligned offsets */
+static double profile_rand_read(struct device *dev, uint8_t *buf, uint32_t io,
+                                uint64_t seed) {
+  uint64_t slots = dev->size / io;
+  if (slots == 0)
+    return 0.0;
+
+  uint32_t ops = 0;
+  double t0 = now_sec(), t = 0.0;
+  while (ops < DEVICE_PROFILE_RAND_OPS && t * 1000.0 < DEVICE_PROFILE_RAND_MS) {
+    uint64_t off = (profile_rand(&seed) % slots) * io;
+    profile_drop(dev, off, io);
+    if (device_read_bulk(dev, off, buf, io) < 0)
+      return 0.0;
+    ops++;
+    t = now_sec() - t0;
+  }
+  return t > 0.0 ? ops / t : 0.0;
+}
+
+/* First free run of at least PROFILE_MIN_FREE bytes; its length in *len */
+static uint64_t profile_free_run(const struct usage_map *um, uint64_t size,
+                                 uint64_t *len) {
+  uint64_t end_of_map = um->granules * (uint64_t)um->granule;
+  if (end_of_map > size)
+    end_of_map = size;
+  uint64_t pos = PROFILE_SKIP_HEAD;
+  while (pos < end_of_map) {
+    uint64_t start = usage_map_next(um, pos, 0);
+    if (start >= end_of_map)
+      break;
+    uint64_t end = usage_map_next(um, start, 1);
+    if (end > end_of_map)
+      end = end_of_map;
+    start = (start + DEVICE_PROFILE_SEQ_IO - 1) &
+            ~(uint64_t)(DEVICE_PROFILE_SEQ_IO - 1);
+    if (end > start && end - start >= PROFILE_MIN_FREE) {
+      *len = (end - start) & ~(uint64_t)(PROFILE_SMALL_IO - 1);
+      return start;
+    }
+    pos = end;
+  }
+  return UINT64_MAX;
+}
+
+static int profile_pread(int fd, uint8_t *buf, size_t n, uint64_t off) {
+  for (size_t done = 0; done < n;) {
+    ssize_t r = pread(fd, buf + done, n - done, (off_t)(off + done));
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return -1;
+    done += (size_t)r;
+  }
+  return 0;
+}
+
+/* Write all of buf; callers only ever write back what they read */
+static int profile_pwrite(int fd, const uint8_t *buf, size_t n, uint64_t off) {
+  for (size_t done = 0; done < n;) {
+    ssize_t r = pwrite(fd, buf + done, n - done, (off_t)(off + done));
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return -1;
+    done += (size_t)r;
+  }
+  return 0;
+}
+
+/*
+ * Sequential write rate and commit times over the free run [start,
+ * start + len). Every block written holds what was read from it.
+ */
+static int profile_writes(struct device_profile *p, const char *path,
+                          uint64_t start, uint64_t len, uint8_t *buf) {
+  int fd = open(path, O_RDWR | O_DIRECT | O_CLOEXEC);
+  if (fd < 0)
+    fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  int ret = -1;
+  uint64_t seq =
+      len < DEVICE_PROFILE_SEQ_BYTES ? len : DEVICE_PROFILE_SEQ_BYTES;
+  double spent = 0.0;
+  for (uint64_t done = 0; done < seq;) {
+    size_t n = seq - done < DEVICE_PROFILE_SEQ_IO ? (size_t)(seq - done)
+                                                  : DEVICE_PROFILE_SEQ_IO;
+    if (profile_pread(fd, buf, n, start + done) < 0)
+      goto out;
+    double t0 = now_sec();
+    if (profile_pwrite(fd, buf, n, start + done) < 0)
+      goto out;
+    spent += now_sec() - t0;
+    done += n;
+  }
+  double t0 = now_sec();
+  if (fdatasync(fd) < 0)
+    goto out;
+  spent += now_sec() - t0;
+  if (spent > 0.0)
+    p->seq_write = (double)seq / spent;
+
+  /* Commits: `depth` blocks spread over the run, then one fdatasync. The
+   * blocks' contents fit in the sequential buffer. */
+  for (int k = 0; k < DEVICE_PROFILE_DEPTHS; k++) {
+    uint32_t depth = g_depths[k];
+    uint64_t stride = (len / depth) & ~(uint64_t)(PROFILE_SMALL_IO - 1);
+    if (stride < PROFILE_SMALL_IO)
+      break;
+    for (uint32_t i = 0; i < depth; i++)
+      if (profile_pread(fd, buf + (size_t)i * PROFILE_SMALL_IO,
+                        PROFILE_SMALL_IO, start + i * stride) < 0)
+        goto out;
+    t0 = now_sec();
+    for (uint32_t c = 0; c < DEVICE_PROFILE_COMMITS; c++) {
+      for (uint32_t i = 0; i < depth; i++)
+        if (profile_pwrite(fd, buf + (size_t)i * PROFILE_SMALL_IO,
+                           PROFILE_SMALL_IO, start + i * stride) < 0)
+          goto out;
+      if (fdatasync(fd) < 0)
+        goto out;
+    }
+    p->commit_sec[k] = (now_sec() - t0) / DEVICE_PROFILE_COMMITS;
+  }
+  p->writes = 1;
+  ret = 0;
+out:
+  close(fd);
+  return ret;
+}
+
+int device_profile_measure(struct device_profile *p, struct device *dev,
+                           const struct usage_map *usage, uint32_t flags) {
+  memset(p, 0, sizeof(*p));
+  p->device_size = dev->size;
+  p->measured_at = (int64_t)time(NULL);
+  p->rotational = device_is_rotational(dev);
+  for (int k = 0; k < DEVICE_PROFILE_DEPTHS; k++)
+    p->depth[k] = g_depths[k];
+
+  uint8_t *buf = device_buf_alloc(DEVICE_PROFILE_SEQ_IO);
+  if (!buf)
+    return -1;
+
+  int ret = -1;
+  p->seq_read = profile_seq_read(dev, buf);
+  p->rand_4k_iops = profile_rand_read(dev, buf, PROFILE_SMALL_IO, 0x9e3779b9);
+  p->rand_64k_iops = profile_rand_read(dev, buf, PROFILE_LARGE_IO, 0x7f4a7c15);
+  if (p->seq_read <= 0.0 || p->rand_4k_iops <= 0.0 || p->rand_64k_iops <= 0.0)
+    goto out;
+
+  if ((flags & DEVICE_PROFILE_WRITES) && usage) {
+    uint64_t len = 0;
+    uint64_t start = profile_free_run(usage, dev->size, &len);
+    if (start != UINT64_MAX &&
+        profile_writes(p, dev->path, start, len, buf) < 0)
+      fprintf(stderr, "btrfs2ext4: write profile of %s failed: %s\n",
+              dev->path, strerror(errno));
+  }
+  ret = 0;
+out:
+  device_buf_free(buf, DEVICE_PROFILE_SEQ_IO);
+  return ret;
+}
+
+/* ========================================================================
+ * Profile file
+ * ======================================================================== */
+
+struct profile_file {
+  char magic[8];
+  uint32_t version;
+  uint32_t crc; /* CRC32C of the profile */
+  struct device_profile profile;
+};
+
+int device_profile_load(struct device_profile *p, const char *path,
+                        uint64_t device_size) {
+  struct profile_file f;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  ssize_t n = read(fd, &f, sizeof(f));
+  close(fd);
+  if (n != (ssize_t)sizeof(f) ||
+      memcmp(f.magic, DEVICE_PROFILE_MAGIC, sizeof(f.magic)) != 0 ||
+      f.version != DEVICE_PROFILE_VERSION ||
+      f.crc != crc32c(0, &f.profile, sizeof(f.profile)) ||
+      f.profile.device_size != device_size)
+    return -1;
+  *p = f.profile;
+  return 0;
+}
+
+int device_profile_save(const struct device_profile *p, const char *path) {
+  struct profile_file f;
+  memset(&f, 0, sizeof(f));
+  memcpy(f.magic, DEVICE_PROFILE_MAGIC, sizeof(f.magic));
+  f.version = DEVICE_PROFILE_VERSION;
+  f.profile = *p;
+  f.crc = crc32c(0, &f.profile, sizeof(f.profile));
+
+  char tmp[4096 + 8];
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+    return -1;
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+  if (write(fd, &f, sizeof(f)) != (ssize_t)sizeof(f) || fsync(fd) < 0) {
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+  close(fd);
+  if (rename(tmp, path) < 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+/* ========================================================================
+ * Time model
+ * ======================================================================== */
+
+/*
+ * Positioning time of one request: the intercept of the line through the
+ * 4 KiB and 64 KiB random read times, or, when they do not slope upward,
+ * the 4 KiB time less its transfer at the sequential rate.
+ */
+double device_profile_access(const struct device_profile *p) {
+  double t4 = 1.0 / p->rand_4k_iops, t64 = 1.0 / p->rand_64k_iops;
+  double access;
+  if (t64 > t4) {
+    double rate = (double)(PROFILE_LARGE_IO - PROFILE_SMALL_IO) / (t64 - t4);
+    access = t4 - PROFILE_SMALL_IO / rate;
+  } else {
+    access = t4 - PROFILE_SMALL_IO / p->seq_read;
+  }
+  return access > 0.0 ? access : 0.0;
+}
+
+/*
+ * Cost of a cache flush behind `depth` queued writes: the commit time at
+ * the nearest measured depths, interpolated, less the writes themselves.
+ */
+static double profile_flush(const struct device_profile *p, double depth,
+                            double write_4k) {
+  if (!p->writes || p->commit_sec[0] <= 0.0)
+    return p->rotational == 1 ? PROFILE_GUESS_FLUSH_HDD
+                              : PROFILE_GUESS_FLUSH_SSD;
+
+  /* Past the deepest test the flush is taken to cost what it did there */
+  double d = depth < p->depth[0] ? p->depth[0] : depth;
+  double commit = p->commit_sec[0];
+  int k = 1;
+  for (; k < DEVICE_PROFILE_DEPTHS && p->commit_sec[k] > 0.0; k++) {
+    double d0 = p->depth[k - 1], d1 = p->depth[k];
+    if (d <= d0)
+      break;
+    double t = d >= d1 ? 1.0 : (d - d0) / (d1 - d0);
+    commit = p->commit_sec[k - 1] +
+             t * (p->commit_sec[k] - p->commit_sec[k - 1]);
+  }
+  if (d > p->depth[k - 1])
+    d = p->depth[k - 1];
+  double flush = commit - d * write_4k;
+  return flush > 0.0 ? flush : 0.0;
+}
+
+void device_profile_estimate(const struct device_profile *p,
+                             const struct eta_workload *w,
+                             struct eta_estimate *out) {
+  memset(out, 0, sizeof(*out));
+  double access = device_profile_access(p);
+  double rd = p->seq_read;
+  double wr = p->writes && p->seq_write > 0.0 ? p->seq_write : p->seq_read;
+  double write_4k = access + PROFILE_SMALL_IO / wr;
+
+  out->phase_sec[ETA_PHASE_SCAN] = w->scan_sec;
+
+  /* Each move is a scattered read and a scattered write. The relocator
+   * journals nothing; the checkpoint syncs the device once per window of
+   * moves, which flushes what the window queued. */
+  double move_sec =
+      w->reloc_moves * 2 * access + w->reloc_bytes / rd + w->reloc_bytes / wr;
+  double syncs = (double)w->reloc_syncs;
+  if (w->reloc_sync_sec > 0.0 && move_sec / w->reloc_sync_sec > syncs)
+    syncs = move_sec / w->reloc_sync_sec;
+  double per_sync = syncs > 0.0 ? w->reloc_moves / syncs : 0.0;
+  out->phase_sec[ETA_PHASE_RELOCATE] =
+      move_sec + syncs * profile_flush(p, per_sync, write_4k);
+
+  out->phase_sec[ETA_PHASE_DECOMPRESS] =
+      w->decomp_extents * 2 * access + w->decomp_read_bytes / rd +
+      w->decomp_write_bytes / wr;
+
+  out->phase_sec[ETA_PHASE_CLONE] =
+      w->clone_reads * access + w->clone_read_bytes / rd +
+      w->clone_writes * access + w->clone_write_bytes / wr;
+
+  out->phase_sec[ETA_PHASE_METADATA] =
+      w->meta_runs * access + w->meta_bytes / wr +
+      w->syncs * profile_flush(p, 1, write_4k);
+
+  for (int i = 0; i < ETA_PHASE_COUNT; i++)
+    out->total_sec += out->phase_sec[i];
+}
+
+const char *eta_phase_name(enum eta_phase phase) {
+  return (unsigned)phase < ETA_PHASE_COUNT ? g_eta_names[phase] : "unknown";
+}
@@ -8,7 +8,6 @@
 #include <string.h>
 
 #include "device_io.h"
-#include "ext4/ext4_crc16.h"
 #include "ext4/ext4_planner.h"
 #include "ext4/ext4_structures.h"
 #include "ext4/ext4_writer.h"
@@ -20,101 +19,284 @@ static inline void bitmap_set(uint8_t *bitmap, uint64_t bit,
     bitmap[bit / 8] |= (1 << (bit % 8));
 }
 
+static inline int bitmap_test(const uint8_t *bitmap, uint64_t bit) {
+  return (bitmap[bit / 8] >> (bit % 8)) & 1;
+}
+
+/* Copy `nbits` bits starting at bit `from` of `src` to the start of `dst` */
+static void bitmap_copy_bits(uint8_t *dst, const uint8_t *src, uint64_t from,
+                             uint64_t nbits) {
+  uint64_t b = 0;
+  if (from % 8 == 0) {
+    memcpy(dst, src + from / 8, nbits / 8);
+    b = nbits & ~7ULL;
+  }
+  for (; b < nbits; b++)
+    if (bitmap_test(src, from + b))
+      dst[b / 8] |= (uint8_t)(1 << (b % 8));
+}
+
+/* OR `nbits` bits starting at bit `from` of `src` into the start of `dst`;
+ * returns nonzero if any bit of `dst` changed */
+static int bitmap_or_bits(uint8_t *dst, const uint8_t *src, uint64_t from,
+                          uint64_t nbits) {
+  int changed = 0;
+  uint64_t b = 0;
+  if (from % 8 == 0) {
+    for (; b + 8 <= nbits; b += 8) {
+      uint8_t add = src[(from + b) / 8] & (uint8_t)~dst[b / 8];
+      dst[b / 8] |= add;
+      changed |= add != 0;
+    }
+  }
+  for (; b < nbits; b++)
+    if (bitmap_test(src, from + b) && !bitmap_test(dst, b)) {
+      dst[b / 8] |= (uint8_t)(1 << (b % 8));
+      changed = 1;
+    }
+  return changed;
+}
+
+/* Clear bits among the first `nbits` of `bitmap` */
+static uint32_t bitmap_count_free(const uint8_t *bitmap, uint32_t nbits) {
+  uint32_t used = 0;
+  uint32_t i = 0;
+  for (; i + 64 <= nbits; i += 64) {
+    uint64_t w;
+    memcpy(&w, bitmap + i / 8, sizeof(w));
+    used += (uint32_t)__builtin_popcountll(w);
+  }
+  for (; i < nbits; i++)
+    used += bitmap_test(bitmap, i);
+  return nbits - used;
+}
+
+/* One past the last set bit among the first `nbits`, 0 if none is set */
+static uint32_t bitmap_used_prefix(const uint8_t *bitmap, uint32_t nbits) {
+  for (uint32_t i = nbits; i > 0; i--)
+    if (bitmap_test(bitmap, i - 1))
+      return i;
+  return 0;
+}
+
+/* Blocks of group `g` the kernel marks in use when it builds the block
+ * bitmap of a BLOCK_UNINIT group itself: superblock and GDT copies plus
+ * the group's own bitmaps and inode table, if they lie in the group */
+static uint32_t group_base_meta(const struct ext4_layout *layout,
+                                uint32_t g) {
+  const struct ext4_bg_layout *bg = &layout->groups[g];
+  uint64_t start = bg->group_start_block;
+  uint64_t end = start + layout->blocks_per_group;
+  uint32_t meta = 0;
+  if (bg->has_super)
+    meta += 1 + bg->gdt_blocks + bg->reserved_gdt_blocks;
+  if (bg->block_bitmap_block >= start && bg->block_bitmap_block < end)
+    meta++;
+  if (bg->inode_bitmap_block >= start && bg->inode_bitmap_block < end)
+    meta++;
+  if (bg->inode_table_start >= start && bg->inode_table_start < end)
+    meta += bg->inode_table_blocks;
+  return meta;
+}
+
+/*
+ * Bitmaps are handled BITMAP_WINDOW_GROUPS groups at a time. The window
+ * buffer holds their block and inode bitmaps sorted by disk block, so
+ * bitmaps that are adjacent on disk (the two of a group, or the whole
+ * flex group with flex_bg packing) are adjacent in memory too and move
+ * with a single read or write.
+ */
+#define BITMAP_WINDOW_GROUPS 1024
+
+struct bitmap_ref {
+  uint64_t block;
+  uint32_t slot; /* 2 * (g - first) for the block bitmap, + 1 for inodes */
+};
+
+struct bitmap_window {
+  uint32_t first;
+  uint32_t count;
+  uint8_t *buf;  /* 2 * count blocks, in disk order */
+  uint32_t *pos; /* slot → block index in buf */
+  struct bitmap_ref *refs;
+};
+
+static int bitmap_ref_cmp(const void *a, const void *b) {
+  const struct bitmap_ref *ra = a, *rb = b;
+  return (ra->block > rb->block) - (ra->block < rb->block);
+}
+
+static int bitmap_window_init(struct bitmap_window *w,
+                              const struct ext4_layout *layout) {
+  memset(w, 0, sizeof(*w));
+  uint32_t n = layout->num_groups < BITMAP_WINDOW_GROUPS
+                   ? layout->num_groups
+                   : BITMAP_WINDOW_GROUPS;
+  w->buf = malloc((size_t)2 * n * layout->block_size);
+  w->pos = malloc((size_t)2 * n * sizeof(uint32_t));
+  w->refs = malloc((size_t)2 * n * sizeof(struct bitmap_ref));
+  if (!w->buf || !w->pos || !w->refs) {
+    fprintf(stderr, "btrfs2ext4: OOM allocating bitmap window\n");
+    free(w->buf);
+    free(w->pos);
+    free(w->refs);
+    return -1;
+  }
+  return 0;
+}
+
+static void bitmap_window_free(struct bitmap_window *w) {
+  free(w->buf);
+  free(w->pos);
+  free(w->refs);
+}
+
+/* Select groups [first, first + count) and sort their bitmaps by block */
+static void bitmap_window_plan(struct bitmap_window *w,
+                               const struct ext4_layout *layout,
+                               uint32_t first, uint32_t count) {
+  w->first = first;
+  w->count = count;
+  for (uint32_t i = 0; i < count; i++) {
+    const struct ext4_bg_layout *bg = &layout->groups[first + i];
+    w->refs[2 * i].block = bg->block_bitmap_block;
+    w->refs[2 * i].slot = 2 * i;
+    w->refs[2 * i + 1].block = bg->inode_bitmap_block;
+    w->refs[2 * i + 1].slot = 2 * i + 1;
+  }
+  qsort(w->refs, 2 * count, sizeof(struct bitmap_ref), bitmap_ref_cmp);
+  for (uint32_t k = 0; k < 2 * count; k++)
+    w->pos[w->refs[k].slot] = k;
+}
+
+static uint8_t *bitmap_window_block(const struct bitmap_window *w,
+                                    uint32_t block_size, uint32_t g,
+                                    int inode) {
+  uint32_t slot = 2 * (g - w->first) + (inode ? 1 : 0);
+  return w->buf + (size_t)w->pos[slot] * block_size;
+}
+
+/* Read or write the window, one I/O per run of consecutive blocks */
+static int bitmap_window_io(struct device *dev, const struct bitmap_window *w,
+                            uint32_t block_size, int write) {
+  uint32_t n = 2 * w->count;
+  for (uint32_t k = 0; k < n;) {
+    uint32_t run = 1;
+    while (k + run < n && w->refs[k + run].block == w->refs[k].block + run)
+      run++;
+    uint64_t offset = w->refs[k].block * block_size;
+    uint8_t *buf = w->buf + (size_t)k * block_size;
+    size_t len = (size_t)run * block_size;
+    int ret = write ? device_write(dev, offset, buf, len)
+                    : device_read(dev, offset, buf, len);
+    if (ret < 0)
+      return -1;
+    k += run;
+  }
+  return 0;
+}
+
 int ext4_write_bitmaps(struct device *dev, const struct ext4_layout *layout,
                        const struct ext4_block_allocator *alloc,
                        const struct inode_map *inode_map) {
   uint32_t block_size = layout->block_size;
+  uint32_t max_bits = 8 * block_size;
 
   printf("Writing block and inode bitmaps...\n");
 
-  for (uint32_t g = 0; g < layout->num_groups; g++) {
-    const struct ext4_bg_layout *bg = &layout->groups[g];
-
-    /* --- Block bitmap --- */
-    uint8_t *block_bitmap = calloc(1, block_size);
-    if (!block_bitmap)
-      return -1;
-
-    uint64_t group_start = bg->group_start_block;
-    uint64_t group_end = group_start + layout->blocks_per_group;
-    if (group_end > layout->total_blocks)
-      group_end = layout->total_blocks;
-
-    /* Marcar todos los bloques utilizados según el bitmap global del
-     * allocator (incluye metadatos y datos, tanto Btrfs reutilizados
-     * como bloques nuevos asignados por Ext4). */
-    if (alloc && alloc->reserved_bitmap) {
-      for (uint64_t b = group_start; b < group_end; b++) {
-        if (alloc->reserved_bitmap[b / 8] & (1 << (b % 8))) {
-          uint64_t local = b - group_start;
-          if (local < (uint64_t)(8 * block_size))
-            bitmap_set(block_bitmap, local, 8 * block_size);
-        }
-      }
-    }
-
-    /* Bug P fix: Mark bits beyond total_blocks in the last group as "used".
-     * The last group may be partial — bits for blocks that don't exist on
-     * disk must be set to 1, otherwise e2fsck will count them as free. */
-    if (g == layout->num_groups - 1) {
-      uint64_t bits_in_group = layout->total_blocks - group_start;
-      for (uint64_t b = bits_in_group; b < layout->blocks_per_group; b++) {
-        if (b < (uint64_t)(8 * block_size))
-          bitmap_set(block_bitmap, b, 8 * block_size);
-      }
-    }
+  /* Bug A fix: Mark all active inodes as used in the bitmap.
+   * Previously the inode bitmap was written with only reserved inodes,
+   * leaving all real inodes (11..N) as "free". This caused e2fsck to
+   * delete all user files on the first check.
+   * One pass over the map; bit (ino - 1) for every inode of the fs. */
+  uint64_t total_inodes =
+      (uint64_t)layout->num_groups * layout->inodes_per_group;
+  uint8_t *inode_bits = calloc((total_inodes + 7) / 8 + 1, 1);
+  if (!inode_bits)
+    return -1;
 
-    /* Write block bitmap */
-    if (device_write(dev, bg->block_bitmap_block * block_size, block_bitmap,
-                     block_size) < 0) {
-      free(block_bitmap);
-      return -1;
+  /* Mark reserved inodes as used (inodes 1-10 in group 0) */
+  for (uint32_t i = 0; i < EXT4_GOOD_OLD_FIRST_INO - 1 && i < total_inodes;
+       i++)
+    bitmap_set(inode_bits, i, UINT32_MAX);
+  if (inode_map) {
+    for (uint32_t idx = 0; idx < inode_map->count; idx++) {
+      uint32_t ext4_ino = inode_map->entries[idx].ext4_ino;
+      if (ext4_ino >= 1 && ext4_ino <= total_inodes)
+        bitmap_set(inode_bits, ext4_ino - 1, UINT32_MAX);
     }
-    free(block_bitmap);
+  }
 
-    /* --- Inode bitmap --- */
-    uint8_t *inode_bitmap = calloc(1, block_size);
-    if (!inode_bitmap)
-      return -1;
+  struct bitmap_window w;
+  if (bitmap_window_init(&w, layout) < 0) {
+    free(inode_bits);
+    return -1;
+  }
 
-    /* Mark reserved inodes as used (inodes 1-10 in group 0) */
-    if (g == 0) {
-      for (uint32_t i = 0; i < EXT4_GOOD_OLD_FIRST_INO - 1; i++) {
-        bitmap_set(inode_bitmap, i, 8 * block_size);
+  for (uint32_t first = 0; first < layout->num_groups;
+       first += BITMAP_WINDOW_GROUPS) {
+    uint32_t count = layout->num_groups - first;
+    if (count > BITMAP_WINDOW_GROUPS)
+      count = BITMAP_WINDOW_GROUPS;
+    bitmap_window_plan(&w, layout, first, count);
+    memset(w.buf, 0, (size_t)2 * count * block_size);
+
+    for (uint32_t g = first; g < first + count; g++) {
+      const struct ext4_bg_layout *bg = &layout->groups[g];
+
+      /* --- Block bitmap --- */
+      uint8_t *block_bitmap = bitmap_window_block(&w, block_size, g, 0);
+
+      uint64_t group_start = bg->group_start_block;
+      uint64_t group_end = group_start + layout->blocks_per_group;
+      if (group_end > layout->total_blocks)
+        group_end = layout->total_blocks;
+
+      /* Marcar todos los bloques utilizados según el bitmap global del
+       * allocator (incluye metadatos y datos, tanto Btrfs reutilizados
+       * como bloques nuevos asignados por Ext4). */
+      if (alloc && alloc->reserved_bitmap) {
+        uint64_t nbits = group_end > group_start ? group_end - group_start : 0;
+        if (nbits > max_bits)
+          nbits = max_bits;
+        bitmap_copy_bits(block_bitmap, alloc->reserved_bitmap, group_start,
+                         nbits);
       }
-    }
 
-    /* Bug A fix: Mark all active inodes as used in the bitmap.
-     * Previously the inode bitmap was written with only reserved inodes,
-     * leaving all real inodes (11..N) as "free". This caused e2fsck to
-     * delete all user files on the first check. */
-    if (inode_map) {
-      uint32_t ino_start = g * layout->inodes_per_group + 1;
-      uint32_t ino_end = ino_start + layout->inodes_per_group;
-      for (uint32_t idx = 0; idx < inode_map->count; idx++) {
-        uint32_t ext4_ino = inode_map->entries[idx].ext4_ino;
-        if (ext4_ino >= ino_start && ext4_ino < ino_end) {
-          uint32_t local_bit = ext4_ino - ino_start;
-          bitmap_set(inode_bitmap, local_bit, 8 * block_size);
-        }
+      /* Bug P fix: Mark bits beyond total_blocks in the last group as "used".
+       * The last group may be partial — bits for blocks that don't exist on
+       * disk must be set to 1, otherwise e2fsck will count them as free. */
+      if (g == layout->num_groups - 1) {
+        uint64_t bits_in_group = layout->total_blocks - group_start;
+        for (uint64_t b = bits_in_group; b < layout->blocks_per_group; b++)
+          bitmap_set(block_bitmap, b, max_bits);
       }
+
+      /* --- Inode bitmap --- */
+      uint8_t *inode_bitmap = bitmap_window_block(&w, block_size, g, 1);
+      uint64_t nbits = layout->inodes_per_group;
+      if (nbits > max_bits)
+        nbits = max_bits;
+      bitmap_copy_bits(inode_bitmap, inode_bits,
+                       (uint64_t)g * layout->inodes_per_group, nbits);
     }
 
-    /* Write inode bitmap */
-    if (device_write(dev, bg->inode_bitmap_block * block_size, inode_bitmap,
-                     block_size) < 0) {
-      free(inode_bitmap);
+    if (bitmap_window_io(dev, &w, block_size, 1) < 0) {
+      bitmap_window_free(&w);
+      free(inode_bits);
       return -1;
     }
-    free(inode_bitmap);
   }
 
+  bitmap_window_free(&w);
+  free(inode_bits);
   printf("  Bitmaps written for %u groups\n", layout->num_groups);
   return 0;
 }
 
 int ext4_update_free_counts(struct device *dev,
-                            const struct ext4_layout *layout) {
+                            const struct ext4_layout *layout,
+                            const struct ext4_block_allocator *alloc) {
   uint32_t block_size = layout->block_size;
   uint64_t total_free_blocks = 0;
   uint64_t total_free_inodes = 0;
@@ -127,102 +309,133 @@ int ext4_update_free_counts(struct device *dev,
     return -1;
   }
 
-  uint8_t *bitmap = malloc(block_size);
-  if (!bitmap)
+  /* The primary GDT is updated in memory and written back once */
+  uint64_t gdt_bytes = (uint64_t)layout->num_groups * layout->desc_size;
+  uint64_t gdt_len = (gdt_bytes + block_size - 1) / block_size * block_size;
+  uint64_t gdt_offset = layout->groups[0].gdt_start_block * block_size;
+  uint8_t *gdt_buf = malloc(gdt_len);
+  if (!gdt_buf)
+    return -1;
+  if (device_read(dev, gdt_offset, gdt_buf, gdt_len) < 0) {
+    free(gdt_buf);
     return -1;
+  }
 
-  for (uint32_t g = 0; g < layout->num_groups; g++) {
-    const struct ext4_bg_layout *bg = &layout->groups[g];
+  struct bitmap_window w;
+  if (bitmap_window_init(&w, layout) < 0) {
+    free(gdt_buf);
+    return -1;
+  }
 
-    /* Read block bitmap */
-    if (device_read(dev, bg->block_bitmap_block * block_size, bitmap,
-                    block_size) < 0) {
-      free(bitmap);
+  for (uint32_t first = 0; first < layout->num_groups;
+       first += BITMAP_WINDOW_GROUPS) {
+    uint32_t count = layout->num_groups - first;
+    if (count > BITMAP_WINDOW_GROUPS)
+      count = BITMAP_WINDOW_GROUPS;
+    bitmap_window_plan(&w, layout, first, count);
+    if (bitmap_window_io(dev, &w, block_size, 0) < 0) {
+      bitmap_window_free(&w);
+      free(gdt_buf);
       return -1;
     }
 
-    uint32_t free_blocks = 0;
-    uint32_t bits_to_check =
-        (g == layout->num_groups - 1)
-            ? (layout->total_blocks - bg->group_start_block)
-            : layout->blocks_per_group;
-
-    for (uint32_t i = 0; i < bits_to_check; i++) {
-      if (!(bitmap[i / 8] & (1 << (i % 8)))) {
-        free_blocks++;
-      }
+    /* The block bitmaps were written before the directories and the
+     * journal took their blocks: fold in what the allocator holds now,
+     * or the counts and BLOCK_UNINIT would treat those blocks as free */
+    int dirty = 0;
+    for (uint32_t g = first; g < first + count && alloc &&
+                             alloc->reserved_bitmap;
+         g++) {
+      const struct ext4_bg_layout *bg = &layout->groups[g];
+      uint64_t nbits = (g == layout->num_groups - 1)
+                           ? layout->total_blocks - bg->group_start_block
+                           : layout->blocks_per_group;
+      if (nbits > 8ULL * block_size)
+        nbits = 8ULL * block_size;
+      dirty |= bitmap_or_bits(bitmap_window_block(&w, block_size, g, 0),
+                              alloc->reserved_bitmap, bg->group_start_block,
+                              nbits);
     }
-    total_free_blocks += free_blocks;
-
-    /* Read inode bitmap */
-    if (device_read(dev, bg->inode_bitmap_block * block_size, bitmap,
-                    block_size) < 0) {
-      free(bitmap);
+    if (dirty && bitmap_window_io(dev, &w, block_size, 1) < 0) {
+      bitmap_window_free(&w);
+      free(gdt_buf);
       return -1;
     }
 
-    uint32_t free_inodes = 0;
-    uint32_t inodes_to_check =
-        (g == layout->num_groups - 1)
-            ? (layout->total_inodes - g * layout->inodes_per_group)
-            : layout->inodes_per_group;
-
-    for (uint32_t i = 0; i < inodes_to_check; i++) {
-      if (!(bitmap[i / 8] & (1 << (i % 8)))) {
-        free_inodes++;
-      }
-    }
-    total_free_inodes += free_inodes;
-
-    /* Bug C fix: Update GDT using layout->desc_size as stride.
-     * Previously used sizeof(struct ext4_group_desc) which is 32 bytes,
-     * but in 64-bit mode each descriptor is 64 bytes. Using the wrong
-     * stride corrupted every other group descriptor's high fields. */
-    uint64_t gdt_offset = layout->groups[0].gdt_start_block * block_size +
-                          (uint64_t)g * layout->desc_size;
-
-    uint8_t gd_buf[64];
-    memset(gd_buf, 0, sizeof(gd_buf));
-
-    if (device_read(dev, gdt_offset, gd_buf, layout->desc_size) < 0) {
-      free(bitmap);
-      return -1;
+    for (uint32_t g = first; g < first + count; g++) {
+      const struct ext4_bg_layout *bg = &layout->groups[g];
+
+      uint32_t bits_to_check =
+          (g == layout->num_groups - 1)
+              ? (layout->total_blocks - bg->group_start_block)
+              : layout->blocks_per_group;
+      uint32_t free_blocks = bitmap_count_free(
+          bitmap_window_block(&w, block_size, g, 0), bits_to_check);
+      total_free_blocks += free_blocks;
+
+      uint32_t inodes_to_check =
+          (g == layout->num_groups - 1)
+              ? (layout->total_inodes - g * layout->inodes_per_group)
+              : layout->inodes_per_group;
+      const uint8_t *inode_bitmap = bitmap_window_block(&w, block_size, g, 1);
+      uint32_t free_inodes = bitmap_count_free(inode_bitmap, inodes_to_check);
+      total_free_inodes += free_inodes;
+
+      /* Bug C fix: Update GDT using layout->desc_size as stride.
+       * Previously used sizeof(struct ext4_group_desc) which is 32 bytes,
+       * but in 64-bit mode each descriptor is 64 bytes. Using the wrong
+       * stride corrupted every other group descriptor's high fields. */
+      uint8_t *gd_buf = gdt_buf + (uint64_t)g * layout->desc_size;
+      struct ext4_group_desc *desc = (struct ext4_group_desc *)gd_buf;
+
+      /* Modify free counts at known offsets (bg_free_blocks_count_lo @ 12,
+       * bg_free_inodes_count_lo @ 14) */
+      *(uint16_t *)(gd_buf + 12) = htole16((uint16_t)(free_blocks & 0xFFFF));
+      *(uint16_t *)(gd_buf + 14) = htole16((uint16_t)(free_inodes & 0xFFFF));
+
+      /* The inode table was written up to the last inode in use (rounded
+       * up to a block), or whole without lazy tables; the kernel zeroes
+       * the rest of a table without INODE_ZEROED after mounting */
+      uint32_t used = bitmap_used_prefix(inode_bitmap, inodes_to_check);
+      uint32_t unused = layout->inodes_per_group - used;
+      uint16_t flags = 0;
+      if (used == 0)
+        flags |= EXT4_BG_INODE_UNINIT;
+      uint64_t used_blocks =
+          ((uint64_t)used * layout->inode_size + block_size - 1) / block_size;
+      if (!ext4_itable_lazy_policy() || used_blocks >= bg->inode_table_blocks)
+        flags |= EXT4_BG_INODE_ZEROED;
+      /* Nothing but the group's base metadata in use: the kernel can
+       * rebuild the block bitmap (never for the first and last groups) */
+      if (g != 0 && g != layout->num_groups - 1 &&
+          free_blocks == bits_to_check - group_base_meta(layout, g))
+        flags |= EXT4_BG_BLOCK_UNINIT;
+      desc->bg_flags = htole16(flags);
+      desc->bg_itable_unused_lo = htole16((uint16_t)(unused & 0xFFFF));
+      if (layout->desc_size >= sizeof(struct ext4_group_desc))
+        desc->bg_itable_unused_hi = htole16((uint16_t)(unused >> 16));
+
+      /* Bug B-6: checksum as the declared features require */
+      desc->bg_checksum =
+          htole16(ext4_group_desc_csum(&sb, g, desc, layout->desc_size));
     }
+  }
+  bitmap_window_free(&w);
 
-    /* Modify free counts at known offsets (bg_free_blocks_count_lo @ 12,
-     * bg_free_inodes_count_lo @ 14) */
-    *(uint16_t *)(gd_buf + 12) = htole16((uint16_t)(free_blocks & 0xFFFF));
-    *(uint16_t *)(gd_buf + 14) = htole16((uint16_t)(free_inodes & 0xFFFF));
-
-    /* Calculate GDT checksum if CSUM feature is enabled
-     * (We always enable EXT4_FEATURE_RO_COMPAT_GDT_CSUM)
-     * bg_checksum = crc16(uuid + group_number + gdt_desc) */
-    struct ext4_group_desc *desc = (struct ext4_group_desc *)gd_buf;
-    desc->bg_checksum = 0; /* Seed with 0 for calculation */
-
-    uint16_t crc = ext4_crc16(~0, sb.s_uuid, sizeof(sb.s_uuid));
-    uint32_t le_group = htole32(g);
-    crc = ext4_crc16(crc, &le_group, sizeof(le_group));
-    crc = ext4_crc16(crc, desc, layout->desc_size);
-    desc->bg_checksum = htole16(crc);
-
-    if (device_write(dev, gdt_offset, gd_buf, layout->desc_size) < 0) {
-      free(bitmap);
-      return -1;
-    }
+  if (device_write(dev, gdt_offset, gdt_buf, gdt_len) < 0) {
+    free(gdt_buf);
+    return -1;
   }
+  free(gdt_buf);
 
   /* Final Superblock Update */
   sb.s_free_blocks_count_lo =
       htole32((uint32_t)(total_free_blocks & 0xFFFFFFFF));
   sb.s_free_inodes_count = htole32((uint32_t)(total_free_inodes & 0xFFFFFFFF));
 
-  if (device_write(dev, EXT4_SUPER_OFFSET, &sb, sizeof(sb)) < 0) {
-    free(bitmap);
+  if (device_write(dev, EXT4_SUPER_OFFSET, &sb, sizeof(sb)) < 0)
     return -1;
-  }
 
-  free(bitmap);
   printf("  Total free blocks: %lu\n", (unsigned long)total_free_blocks);
   printf("  Total free inodes: %lu\n", (unsigned long)total_free_inodes);
 
@@ -5,6 +5,10 @@
  * Supports multi-block directories for large directories.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* qsort_r */
+#endif
+
 #include <endian.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,6 +20,9 @@
 #include "ext4/ext4_planner.h"
 #include "ext4/ext4_structures.h"
 #include "ext4/ext4_writer.h"
+#include "mem_tracker.h"
+#include "progress.h"
+#include "thread_pool.h"
 
 /*
  * Calculate the actual record length for a directory entry.
@@ -98,7 +105,7 @@ static void finalize_dir_block(uint8_t *block, uint32_t used,
 /*
  * Ext4 Legacy Hash Algorithm for HTree directories
  */
-static uint32_t ext4_legacy_hash(const char *name, uint8_t len) {
+uint32_t ext4_legacy_hash(const char *name, uint8_t len) {
   uint32_t hash = 0x12a3fe2d, padding = 0x37abe8f9;
   for (int i = 0; i < len; i++) {
     uint32_t p0 = padding;
@@ -109,11 +116,15 @@ static uint32_t ext4_legacy_hash(const char *name, uint8_t len) {
   return hash;
 }
 
-static int compare_file_entry_hash(const void *a, const void *b) {
+/* qsort_r comparator; `arg` is the fs_info owning the name pool */
+static int compare_file_entry_hash(const void *a, const void *b, void *arg) {
+  const struct btrfs_fs_info *fs_info = (const struct btrfs_fs_info *)arg;
   const struct dir_entry_link *la = (const struct dir_entry_link *)a;
   const struct dir_entry_link *lb = (const struct dir_entry_link *)b;
-  uint32_t ha = ext4_legacy_hash(la->name, (uint8_t)la->name_len);
-  uint32_t hb = ext4_legacy_hash(lb->name, (uint8_t)lb->name_len);
+  uint32_t ha =
+      ext4_legacy_hash(btrfs_link_name(fs_info, la), (uint8_t)la->name_len);
+  uint32_t hb =
+      ext4_legacy_hash(btrfs_link_name(fs_info, lb), (uint8_t)lb->name_len);
   if (ha < hb)
     return -1;
   if (ha > hb)
@@ -121,445 +132,492 @@ static int compare_file_entry_hash(const void *a, const void *b) {
   return 0;
 }
 
-int ext4_write_directories(struct device *dev, const struct ext4_layout *layout,
-                           const struct btrfs_fs_info *fs_info,
-                           const struct inode_map *inode_map,
-                           struct ext4_block_allocator *alloc) {
-  uint32_t block_size = layout->block_size;
-
-  printf("Writing directory entries...\n");
-
-  /* For each directory in the filesystem */
-  for (uint32_t i = 0; i < fs_info->inode_count; i++) {
-    const struct file_entry *dir = fs_info->inode_table[i];
-    if (!S_ISDIR(dir->mode))
-      continue;
+/*
+ * Parallel directory builder.
+ *
+ * Directory blocks refer to each other only by logical block number (the
+ * HTree index), so hashing, sorting, dirent packing and index construction
+ * run on the pool before a directory owns any disk block. A single writer
+ * then walks each batch in directory order: it claims one run per
+ * directory near its inode, builds the extent tree and stages the blocks
+ * into large sequential writes. Two batches are in flight: the next one
+ * is built while the current one is written.
+ */
+#define DIR_BATCH_DIRS 1024
+#define DIR_BATCH_BYTES (64ULL * 1024 * 1024) /* estimated dirent bytes */
+#define DIR_WRITE_STAGE (4U * 1024 * 1024)
+#define DIR_JOB_KEEP_BLOCKS 64 /* job buffers are reused up to this size */
+
+struct dir_build_ctx {
+  const struct btrfs_fs_info *fs_info;
+  const struct inode_map *inode_map;
+  uint32_t block_size;
+};
+
+struct dir_job {
+  const struct dir_build_ctx *ctx;
+  const struct file_entry *dir;
+  uint32_t dir_ino;
+  uint32_t parent_ino;
+  uint32_t dir_size; /* estimated bytes of dirents */
+  uint8_t *blocks;   /* num_blocks * block_size, in logical order */
+  uint32_t num_blocks;
+  uint32_t cap_blocks;
+  int largedir; /* the HTree needed EXT4_HTREE_LEVEL levels */
+  int err;
+};
+
+struct dir_batch {
+  struct dir_job *jobs;
+  uint32_t count;
+  struct thread_pool_wait_group *wg;
+};
+
+/* Consecutive device blocks waiting to go out as one write */
+struct dir_stage {
+  uint8_t *buf;
+  uint64_t start; /* first block */
+  uint32_t blocks;
+  uint32_t cap_blocks;
+};
+
+static uint8_t *dir_job_block(const struct dir_job *job, uint32_t b) {
+  return job->blocks + (size_t)b * job->ctx->block_size;
+}
 
-    uint32_t dir_ino = inode_map_lookup(inode_map, dir->ino);
-    uint32_t parent_ino;
-    if (dir->ino == BTRFS_FIRST_FREE_OBJECTID) {
-      parent_ino = EXT4_ROOT_INO;
-    } else {
-      parent_ino = inode_map_lookup(inode_map, dir->parent_ino);
-      if (parent_ino == 0)
-        parent_ino = EXT4_ROOT_INO;
+/* Append a zeroed block; returns its logical number or -1 on OOM */
+static int64_t dir_job_add_block(struct dir_job *job) {
+  uint32_t block_size = job->ctx->block_size;
+  if (job->num_blocks == job->cap_blocks) {
+    uint32_t new_cap = job->cap_blocks ? job->cap_blocks * 2 : 4;
+    uint8_t *grown = realloc(job->blocks, (size_t)new_cap * block_size);
+    if (!grown) {
+      fprintf(stderr, "btrfs2ext4: OOM growing directory blocks (ino %u)\n",
+              job->dir_ino);
+      return -1;
     }
+    mem_track_alloc_tag(MEM_TAG_DIR,
+                        (size_t)(new_cap - job->cap_blocks) * block_size);
+    job->blocks = grown;
+    job->cap_blocks = new_cap;
+  }
+  memset(dir_job_block(job, job->num_blocks), 0, block_size);
+  return job->num_blocks++;
+}
 
-    if (dir_ino == 0)
-      continue;
+/*
+ * Index entries that fit after byte `off` of a block. One slot is left
+ * for the checksum tail metadata_csum puts at the end of index blocks.
+ */
+static uint16_t dx_limit(uint32_t block_size, uint32_t off) {
+  return (uint16_t)((block_size - off) / sizeof(struct ext4_dx_entry) - 1);
+}
 
-    /*
-     * Build directory blocks.
-     * Support for multi-block directories via Ext4 HTree index (EXT4_INDEX_FL).
-     */
-    uint32_t dir_size = 24;
-    for (uint32_t c = 0; c < dir->child_count; c++) {
-      uint8_t nl = (uint8_t)dir->children[c].name_len;
-      if (nl > 0)
-        dir_size += dir_entry_len(nl);
-    }
+/* Empty HTree node: a fake dirent spanning the block, then the index */
+static void dx_init_node(uint8_t *blk, uint32_t block_size) {
+  struct ext4_dir_entry_2 *nf = (void *)blk;
+  nf->inode = 0;
+  nf->rec_len = htole16(block_size);
+  nf->name_len = 0;
+  nf->file_type = 0;
+
+  struct ext4_dx_countlimit *limit = (void *)(blk + 8);
+  limit->limit = htole16(dx_limit(block_size, 8));
+  limit->count = htole16(0);
+}
 
-    int use_htree = (dir_size > block_size);
-    if (use_htree) {
-      /* Signal to inode_writer that this directory needs EXT4_INDEX_FL */
-      ((struct file_entry *)dir)->ext4_flags |= EXT4_INDEX_FL;
-      qsort(((struct file_entry *)dir)->children, dir->child_count,
-            sizeof(struct dir_entry_link), compare_file_entry_hash);
-    }
+/* Append (hash, block) to an index starting at blk + off. Entry 0 has no
+ * hash: the countlimit takes its place. */
+static void dx_append(uint8_t *blk, uint32_t off, uint32_t hash,
+                      uint32_t block) {
+  struct ext4_dx_countlimit *limit = (void *)(blk + off);
+  struct ext4_dx_entry *entries = (void *)(blk + off);
+  uint16_t count = le16toh(limit->count);
+  if (count > 0)
+    entries[count].hash = htole32(hash);
+  entries[count].block = htole32(block);
+  limit->count = htole16(count + 1);
+}
 
-    /* Max ~260,000 blocks per directory (v1 2-Level HTree)
-     * Start with a reasonable allocation and grow if needed. */
-    uint32_t max_dir_blocks = use_htree ? (dir_size / block_size + 10) : 1;
-    if (max_dir_blocks < 4)
-      max_dir_blocks = 4;
-
-    uint64_t *dir_block_nums = calloc(max_dir_blocks, sizeof(uint64_t));
-    uint8_t **dir_blocks = calloc(max_dir_blocks, sizeof(uint8_t *));
-    if (!dir_block_nums || !dir_blocks) {
-      free(dir_block_nums);
-      free(dir_blocks);
+/* Lowest hash under an index entry of the level being built */
+struct dx_ref {
+  uint32_t hash;
+  uint32_t block;
+};
+
+/*
+ * Build the HTree index over the leaves in `refs` bottom-up: while more
+ * entries remain than the root holds, group them into index nodes
+ * appended after the leaves, then point the root at what is left.
+ * `refs` is overwritten with each level. Returns 0 or -1.
+ */
+static int dx_build_index(struct dir_job *job, struct dx_ref *refs,
+                          uint32_t n) {
+  uint32_t block_size = job->ctx->block_size;
+  uint16_t node_limit = dx_limit(block_size, 8);
+  uint8_t levels = 0;
+  while (n > dx_limit(block_size, 32)) {
+    if (levels + 1 >= EXT4_HTREE_LEVEL) {
+      fprintf(stderr,
+              "btrfs2ext4: error: dir inode %u exceeds the %d-level HTree "
+              "limit\n",
+              job->dir_ino, EXT4_HTREE_LEVEL);
       return -1;
     }
+    uint32_t parents = 0;
+    for (uint32_t i = 0; i < n; i += node_limit) {
+      int64_t node = dir_job_add_block(job);
+      if (node < 0)
+        return -1;
+      uint8_t *blk = dir_job_block(job, (uint32_t)node);
+      dx_init_node(blk, block_size);
+      for (uint32_t k = i; k < n && k < i + node_limit; k++)
+        dx_append(blk, 8, refs[k].hash, refs[k].block);
+      refs[parents].hash = refs[i].hash;
+      refs[parents].block = (uint32_t)node;
+      parents++;
+    }
+    n = parents;
+    levels++;
+  }
 
-    uint32_t num_blocks = 0;
-    uint32_t offset = 0;
+  uint8_t *root = dir_job_block(job, 0);
+  struct ext4_dx_root_info *info = (void *)(root + 24);
+  info->indirect_levels = levels;
+  for (uint32_t k = 0; k < n; k++)
+    dx_append(root, 32, refs[k].hash, refs[k].block);
+  job->largedir = levels + 1 > EXT4_HTREE_LEVEL_COMPAT;
+  return 0;
+}
 
-    /* Allocate block 0 */
-    dir_blocks[0] = calloc(1, block_size);
-    dir_block_nums[0] = ext4_alloc_block(alloc, layout);
-    if (!dir_blocks[0] || dir_block_nums[0] == (uint64_t)-1) {
-      free(dir_blocks[0]);
-      free(dir_blocks);
-      free(dir_block_nums);
-      fprintf(stderr, "btrfs2ext4: no space for dir block (ino %u)\n", dir_ino);
-      return -1;
-    }
-    num_blocks = 1;
-
-    struct ext4_dx_entry *root_entries = NULL;
-    uint32_t root_count = 0;
-    struct ext4_dx_countlimit *root_limit = NULL;
-
-    struct ext4_dx_entry *node_entries = NULL;
-    uint32_t node_count = 0;
-    struct ext4_dx_countlimit *node_limit = NULL;
-    uint32_t current_node_block = 0;
-
-    if (use_htree) {
-      /* Block 0 is the HTree root */
-      struct ext4_dir_entry_2 *dot = (void *)dir_blocks[0];
-      dot->inode = htole32(dir_ino);
-      dot->rec_len = htole16(12);
-      dot->name_len = 1;
-      dot->file_type = EXT4_FT_DIR;
-      dot->name[0] = '.';
-
-      struct ext4_dir_entry_2 *dotdot = (void *)(dir_blocks[0] + 12);
-      dotdot->inode = htole32(parent_ino);
-      dotdot->rec_len = htole16(block_size - 12);
-      dotdot->name_len = 2;
-      dotdot->file_type = EXT4_FT_DIR;
-      dotdot->name[0] = '.';
-      dotdot->name[1] = '.';
-
-      struct ext4_dx_root_info *info = (void *)(dir_blocks[0] + 24);
-      info->hash_version =
-          EXT4_HASH_HALF_MD4; /* Must match sb.s_def_hash_version */
-      info->info_length = 8;
-      info->indirect_levels = 1; /* 2-level HTree */
-      info->unused_flags = 0;
-
-      root_limit = (void *)(dir_blocks[0] + 32);
-      root_limit->limit =
-          htole16((block_size - 32) / sizeof(struct ext4_dx_entry));
-      root_limit->count = htole16(0);
-
-      root_entries = (void *)(dir_blocks[0] + 40);
-
-      /* Spawn the first Node Block (Block 1) */
-      current_node_block = 1;
-      dir_blocks[1] = calloc(1, block_size);
-      dir_block_nums[1] = ext4_alloc_block(alloc, layout);
-      num_blocks = 2;
-
-      struct ext4_dir_entry_2 *nf = (void *)dir_blocks[1];
-      nf->inode = 0;
-      nf->rec_len = htole16(block_size);
-      nf->name_len = 0;
-      nf->file_type = 0;
-
-      node_limit = (void *)(dir_blocks[1] + 8);
-      node_limit->limit =
-          htole16((block_size - 16) / sizeof(struct ext4_dx_entry));
-      node_limit->count = htole16(0);
-
-      node_entries = (void *)(dir_blocks[1] + 16);
-      node_count = 0;
-
-      /* Register Node Block in Root Block */
-      root_entries[0].hash = 0;
-      root_entries[0].block = htole32(1);
-      root_count = 1;
-      root_limit->count = htole16(root_count);
-
-      /* Spawn the first Leaf Block (Block 2) */
-      dir_blocks[2] = calloc(1, block_size);
-      dir_block_nums[2] = ext4_alloc_block(alloc, layout);
-      num_blocks = 3;
-      offset = 0;
+/*
+ * Hash, sort and pack one directory into job->blocks. Touches nothing but
+ * the directory's own children, so jobs for different directories can run
+ * concurrently.
+ */
+static void dir_build_task(void *arg) {
+  struct dir_job *job = arg;
+  const struct dir_build_ctx *ctx = job->ctx;
+  const struct btrfs_fs_info *fs_info = ctx->fs_info;
+  const struct file_entry *dir = job->dir;
+  uint32_t block_size = ctx->block_size;
+  uint32_t dir_ino = job->dir_ino;
+
+  /*
+   * Build directory blocks.
+   * Support for multi-block directories via Ext4 HTree index (EXT4_INDEX_FL).
+   */
+  int use_htree = (job->dir_size > block_size);
+  if (use_htree) {
+    /* Signal to inode_writer that this directory needs EXT4_INDEX_FL */
+    ((struct file_entry *)dir)->ext4_flags |= EXT4_INDEX_FL;
+    qsort_r(((struct file_entry *)dir)->children, dir->child_count,
+            sizeof(struct dir_entry_link), compare_file_entry_hash,
+            (void *)fs_info);
+  }
 
-      /* Register Leaf Block in Node Block */
-      node_entries[0].hash = 0;
-      node_entries[0].block = htole32(2);
-      node_count = 1;
-      node_limit->count = htole16(node_count);
+  job->num_blocks = 0;
+  job->largedir = 0;
+  if (dir_job_add_block(job) < 0) {
+    job->err = -1;
+    return;
+  }
+  uint32_t offset = 0;
+
+  /* First hash and block of every leaf, for the index built at the end */
+  struct dx_ref *refs = NULL;
+  uint32_t num_refs = 0, cap_refs = 0;
+
+  if (use_htree) {
+    /* Block 0 is the HTree root and block 1 the first leaf; the index
+     * nodes follow the last leaf */
+    cap_refs = job->dir_size / block_size + 2;
+    refs = malloc(cap_refs * sizeof(*refs));
+    if (!refs || dir_job_add_block(job) < 0) {
+      free(refs);
+      job->err = -1;
+      return;
+    }
+    uint8_t *root = dir_job_block(job, 0);
+    struct ext4_dir_entry_2 *dot = (void *)root;
+    dot->inode = htole32(dir_ino);
+    dot->rec_len = htole16(12);
+    dot->name_len = 1;
+    dot->file_type = EXT4_FT_DIR;
+    dot->name[0] = '.';
+
+    struct ext4_dir_entry_2 *dotdot = (void *)(root + 12);
+    dotdot->inode = htole32(job->parent_ino);
+    dotdot->rec_len = htole16(block_size - 12);
+    dotdot->name_len = 2;
+    dotdot->file_type = EXT4_FT_DIR;
+    dotdot->name[0] = '.';
+    dotdot->name[1] = '.';
+
+    struct ext4_dx_root_info *info = (void *)(root + 24);
+    info->hash_version =
+        EXT4_HASH_HALF_MD4; /* Must match sb.s_def_hash_version */
+    info->info_length = 8;
+    info->unused_flags = 0;
+
+    struct ext4_dx_countlimit *root_limit = (void *)(root + 32);
+    root_limit->limit = htole16(dx_limit(block_size, 32));
+    root_limit->count = htole16(0);
+
+    refs[num_refs++] = (struct dx_ref){0, 1};
+  } else {
+    /* Linear directory Block 0 */
+    uint32_t written = write_dir_entry(dir_job_block(job, 0), offset,
+                                       block_size, dir_ino, 1, EXT4_FT_DIR,
+                                       ".");
+    offset += written;
+    written = write_dir_entry(dir_job_block(job, 0), offset, block_size,
+                              job->parent_ino, 2, EXT4_FT_DIR, "..");
+    offset += written;
+  }
 
-    } else {
-      /* Linear directory Block 0 */
-      uint32_t written = write_dir_entry(dir_blocks[0], offset, block_size,
-                                         dir_ino, 1, EXT4_FT_DIR, ".");
-      offset += written;
-      written = write_dir_entry(dir_blocks[0], offset, block_size, parent_ino,
-                                2, EXT4_FT_DIR, "..");
-      offset += written;
+  /* Write child entries, resolving their inode numbers a batch at a time */
+  uint64_t batch_btrfs[INODE_MAP_BATCH];
+  uint32_t batch_ext4[INODE_MAP_BATCH];
+  for (uint32_t c = 0; c < dir->child_count; c++) {
+    const struct dir_entry_link *link = &dir->children[c];
+    if (c % INODE_MAP_BATCH == 0) {
+      uint32_t n = dir->child_count - c < INODE_MAP_BATCH
+                       ? dir->child_count - c
+                       : INODE_MAP_BATCH;
+      for (uint32_t k = 0; k < n; k++)
+        batch_btrfs[k] = link[k].target->ino;
+      inode_map_lookup_batch(ctx->inode_map, batch_btrfs, n, batch_ext4);
     }
+    const struct file_entry *child = link->target;
+    uint32_t child_ino = batch_ext4[c % INODE_MAP_BATCH];
+    if (child_ino == 0)
+      continue;
 
-    /* Write child entries */
-    for (uint32_t c = 0; c < dir->child_count; c++) {
-      const struct dir_entry_link *link = &dir->children[c];
-      const struct file_entry *child = link->target;
-      uint32_t child_ino = inode_map_lookup(inode_map, child->ino);
-      if (child_ino == 0)
-        continue;
-
-      uint8_t name_len = (uint8_t)link->name_len;
-      if (name_len == 0)
-        continue;
-
-      uint16_t entry_len = dir_entry_len(name_len);
-
-      if (offset + entry_len > block_size) {
-        finalize_dir_block(dir_blocks[num_blocks - 1], offset, block_size);
-
-        if (num_blocks + 2 >= max_dir_blocks) {
-          uint32_t new_max = max_dir_blocks * 2;
-          /* Bug I fix: Use temp variables for realloc to avoid dangling
-           * pointers if one succeeds and the other fails. */
-          uint64_t *new_nums =
-              realloc(dir_block_nums, new_max * sizeof(uint64_t));
-          if (!new_nums) {
-            fprintf(stderr,
-                    "btrfs2ext4: OOM reallocating directory pointer array\n");
-            break;
-          }
-          dir_block_nums = new_nums;
+    uint8_t name_len = (uint8_t)link->name_len;
+    if (name_len == 0)
+      continue;
 
-          uint8_t **new_blks = realloc(dir_blocks, new_max * sizeof(uint8_t *));
-          if (!new_blks) {
-            fprintf(stderr,
-                    "btrfs2ext4: OOM reallocating directory block array\n");
-            break;
-          }
-          dir_blocks = new_blks;
+    uint16_t entry_len = dir_entry_len(name_len);
+
+    if (offset + entry_len > block_size) {
+      finalize_dir_block(dir_job_block(job, job->num_blocks - 1), offset,
+                         block_size);
 
-          /* Need to safely zero out the new trailing portion of the array */
-          for (uint32_t i = max_dir_blocks; i < new_max; i++) {
-            dir_blocks[i] = NULL;
-            dir_block_nums[i] = 0;
+      int64_t leaf = dir_job_add_block(job);
+      if (leaf < 0) {
+        free(refs);
+        job->err = -1;
+        return;
+      }
+      if (use_htree) {
+        if (num_refs == cap_refs) {
+          struct dx_ref *grown =
+              realloc(refs, (size_t)cap_refs * 2 * sizeof(*refs));
+          if (!grown) {
+            free(refs);
+            job->err = -1;
+            return;
           }
-          max_dir_blocks = new_max;
+          refs = grown;
+          cap_refs *= 2;
         }
+        refs[num_refs].hash =
+            ext4_legacy_hash(btrfs_link_name(fs_info, link), name_len);
+        refs[num_refs++].block = (uint32_t)leaf;
+      }
+      offset = 0;
+    }
 
-        uint32_t h = use_htree ? ext4_legacy_hash(link->name, name_len) : 0;
-
-        if (use_htree && node_count >= le16toh(node_limit->limit)) {
-          /* Node block is full, spawn a new Node Block! */
-          if (root_count >= le16toh(root_limit->limit)) {
-            fprintf(stderr,
-                    "btrfs2ext4: error: dir inode %u exceeds massive 2-level "
-                    "HTree limit\n",
-                    dir_ino);
-            for (uint32_t j = 0; j < num_blocks; j++)
-              free(dir_blocks[j]);
-            free(dir_blocks);
-            free(dir_block_nums);
-            return -1;
-          }
+    uint32_t written = write_dir_entry(
+        dir_job_block(job, job->num_blocks - 1), offset, block_size,
+        child_ino, name_len, btrfs_to_ext4_filetype(child->mode),
+        btrfs_link_name(fs_info, link));
+    offset += written;
+  }
 
-          current_node_block = num_blocks;
-          dir_blocks[current_node_block] = calloc(1, block_size);
-          dir_block_nums[current_node_block] = ext4_alloc_block(alloc, layout);
-          num_blocks++;
-
-          struct ext4_dir_entry_2 *nf = (void *)dir_blocks[current_node_block];
-          nf->inode = 0;
-          nf->rec_len = htole16(block_size);
-          nf->name_len = 0;
-          nf->file_type = 0;
-          node_limit = (void *)(dir_blocks[current_node_block] + 8);
-          node_limit->limit =
-              htole16((block_size - 16) / sizeof(struct ext4_dx_entry));
-          node_limit->count = htole16(0);
-          node_entries = (void *)(dir_blocks[current_node_block] + 16);
-          node_count = 0;
-
-          /* Add Node Block to Root */
-          root_entries[root_count].hash = htole32(h);
-          root_entries[root_count].block = htole32(current_node_block);
-          root_count++;
-          root_limit->count = htole16(root_count);
-        }
+  /* Finalize last block */
+  finalize_dir_block(dir_job_block(job, job->num_blocks - 1), offset,
+                     block_size);
 
-        dir_blocks[num_blocks] = calloc(1, block_size);
-        dir_block_nums[num_blocks] = ext4_alloc_block(alloc, layout);
-        if (!dir_blocks[num_blocks] ||
-            dir_block_nums[num_blocks] == (uint64_t)-1) {
-          fprintf(stderr, "btrfs2ext4: no space for directory leaf block\n");
-          break;
-        }
+  if (use_htree && dx_build_index(job, refs, num_refs) < 0)
+    job->err = -1;
+  free(refs);
+}
 
-        if (use_htree) {
-          /* Add this leaf block to the current node index */
-          node_entries[node_count].hash = htole32(h);
-          node_entries[node_count].block = htole32(num_blocks);
-          node_count++;
-          node_limit->count = htole16(node_count);
-        }
-        num_blocks++;
-        offset = 0;
-      }
+static int dir_stage_flush(struct device *dev, struct dir_stage *st,
+                           uint32_t block_size) {
+  if (st->blocks == 0)
+    return 0;
+  int ret = device_write(dev, st->start * block_size, st->buf,
+                         (size_t)st->blocks * block_size);
+  st->blocks = 0;
+  return ret;
+}
 
-      uint32_t written = write_dir_entry(
-          dir_blocks[num_blocks - 1], offset, block_size, child_ino, name_len,
-          btrfs_to_ext4_filetype(child->mode), link->name);
-      offset += written;
-    }
+/* Queue `count` blocks for `start`, merging with the pending write when
+ * they follow it on disk */
+static int dir_stage_add(struct device *dev, struct dir_stage *st,
+                         uint32_t block_size, uint64_t start,
+                         const uint8_t *data, uint32_t count) {
+  if (st->blocks > 0 && (start != st->start + st->blocks ||
+                         st->blocks + count > st->cap_blocks)) {
+    if (dir_stage_flush(dev, st, block_size) < 0)
+      return -1;
+  }
+  if (count > st->cap_blocks)
+    return device_write(dev, start * block_size, data,
+                        (size_t)count * block_size);
+  if (st->blocks == 0)
+    st->start = start;
+  memcpy(st->buf + (size_t)st->blocks * block_size, data,
+         (size_t)count * block_size);
+  st->blocks += count;
+  return 0;
+}
 
-    /* Finalize last block */
-    finalize_dir_block(dir_blocks[num_blocks - 1], offset, block_size);
+/*
+ * Writer stage for one built directory: claim its blocks near the inode,
+ * queue them and write the inode with the matching extent tree.
+ */
+static int dir_commit(struct device *dev, const struct ext4_layout *layout,
+                      struct ext4_block_allocator *alloc,
+                      struct dir_stage *st, struct dir_job *job) {
+  uint32_t block_size = layout->block_size;
+  uint32_t num_blocks = job->num_blocks;
+  uint32_t dir_ino = job->dir_ino;
+
+  /* All blocks claimed as one run near the directory's inode */
+  ext4_alloc_set_goal(alloc, layout, dir_ino);
+  struct ext4_block_reserve dir_res = {0, 0, num_blocks};
+
+  /* Compile blocks into contiguous extents */
+  struct _dir_ext {
+    uint32_t len;
+    uint64_t phys;
+  } *exts = calloc(num_blocks, sizeof(*exts));
+  if (!exts)
+    return -1;
+  uint16_t n_extents = 0;
 
-    /* Bug J fix: Write contiguous directory blocks in a single I/O.
-     * If allocator placed them sequentially, one device_write replaces
-     * potentially hundreds of 4KB pwrite() calls. */
-    int contiguous = 1;
-    for (uint32_t b = 1; b < num_blocks; b++) {
-      if (dir_block_nums[b] != dir_block_nums[b - 1] + 1) {
-        contiguous = 0;
-        break;
-      }
+  for (uint32_t b = 0; b < num_blocks; b++) {
+    uint64_t blk = ext4_reserve_take(&dir_res, alloc, layout);
+    if (blk == (uint64_t)-1) {
+      fprintf(stderr, "btrfs2ext4: no space for dir block (ino %u)\n", dir_ino);
+      free(exts);
+      return -1;
     }
-
-    if (contiguous && num_blocks > 1) {
-      uint8_t *combined = malloc((size_t)num_blocks * block_size);
-      if (combined) {
-        for (uint32_t b = 0; b < num_blocks; b++)
-          memcpy(combined + (size_t)b * block_size, dir_blocks[b], block_size);
-        if (device_write(dev, dir_block_nums[0] * block_size, combined,
-                         (size_t)num_blocks * block_size) < 0) {
-          free(combined);
-          for (uint32_t j = 0; j < num_blocks; j++)
-            free(dir_blocks[j]);
-          free(dir_blocks);
-          free(dir_block_nums);
-          return -1;
-        }
-        free(combined);
-      } else {
-        /* OOM fallback: write per-block with batch API */
-        goto write_per_block;
-      }
+    if (n_extents > 0 &&
+        blk == exts[n_extents - 1].phys + exts[n_extents - 1].len &&
+        exts[n_extents - 1].len < 32768) {
+      exts[n_extents - 1].len++;
     } else {
-    write_per_block:
-      /* Use batch API: queue all blocks, submit in one syscall */
-      device_write_batch_begin(dev);
-      for (uint32_t b = 0; b < num_blocks; b++) {
-        if (device_write_batch_add(dev, dir_block_nums[b] * block_size,
-                                   dir_blocks[b], block_size) < 0) {
-          for (uint32_t j = 0; j < num_blocks; j++)
-            free(dir_blocks[j]);
-          free(dir_blocks);
-          free(dir_block_nums);
-          return -1;
-        }
-      }
-      if (device_write_batch_submit(dev) < 0) {
-        for (uint32_t j = 0; j < num_blocks; j++)
-          free(dir_blocks[j]);
-        free(dir_blocks);
-        free(dir_block_nums);
-        return -1;
-      }
+      exts[n_extents].len = 1;
+      exts[n_extents].phys = blk;
+      n_extents++;
     }
+  }
 
-    /*
-     * Update the inode's extent tree to point to the directory blocks.
-     * We need to find the inode in the table and update its i_block.
-     * For now, we do this by writing directly to the inode table on disk.
-     */
-    uint32_t ino_group = (dir_ino - 1) / layout->inodes_per_group;
-    uint32_t ino_local = (dir_ino - 1) % layout->inodes_per_group;
-
-    if (ino_group < layout->num_groups) {
-      const struct ext4_bg_layout *bg = &layout->groups[ino_group];
-      uint64_t inode_offset = bg->inode_table_start * block_size +
-                              (uint64_t)ino_local * layout->inode_size;
-
-      /* Bug K fix: Build inode directly instead of Read-Modify-Write.
-       * We construct the directory inode in RAM from scratch, avoiding
-       * the device_read() that doubled I/O for every directory. */
-      uint8_t *inode_buf = calloc(1, layout->inode_size);
-      if (inode_buf) {
-        struct ext4_inode *tmp_inode = (struct ext4_inode *)inode_buf;
-
-        /* Set directory inode fields */
-        tmp_inode->i_mode = htole16(040755);   /* Directory, rwxr-xr-x */
-        tmp_inode->i_links_count = htole16(2); /* . and .. */
-        tmp_inode->i_flags = htole32(EXT4_EXTENTS_FL | EXT4_INDEX_FL);
-
-        /* Directory size = num_blocks * block_size */
-        uint64_t dir_size = (uint64_t)num_blocks * block_size;
-        tmp_inode->i_size_lo = htole32((uint32_t)(dir_size & 0xFFFFFFFF));
-        tmp_inode->i_size_high = htole32((uint32_t)(dir_size >> 32));
-
-        /* Block count (in 512-byte sectors) */
-        uint64_t sectors = (dir_size + 511) / 512;
-        tmp_inode->i_blocks_lo = htole32((uint32_t)(sectors & 0xFFFFFFFF));
-        tmp_inode->i_blocks_high = htole16((uint16_t)(sectors >> 32));
-
-        /* Compile blocks into contiguous extents */
-        struct _dir_ext {
-          uint32_t len;
-          uint64_t phys;
-        } *exts = calloc(num_blocks, sizeof(*exts));
-        uint16_t n_extents = 0;
-
-        if (num_blocks > 0) {
-          exts[0].len = 1;
-          exts[0].phys = dir_block_nums[0];
-          n_extents = 1;
-          for (uint32_t b = 1; b < num_blocks; b++) {
-            if (dir_block_nums[b] ==
-                    exts[n_extents - 1].phys + exts[n_extents - 1].len &&
-                exts[n_extents - 1].len < 32768) {
-              exts[n_extents - 1].len++;
-            } else {
-              exts[n_extents].len = 1;
-              exts[n_extents].phys = dir_block_nums[b];
-              n_extents++;
-            }
-          }
-        }
-
-        uint16_t max_inline = 4;
-
-        if (n_extents <= max_inline) {
-          /* Inline extent tree (depth=0) */
-          struct ext4_extent_header *eh =
-              (struct ext4_extent_header *)tmp_inode->i_block;
-          eh->eh_magic = htole16(EXT4_EXT_MAGIC);
-          eh->eh_depth = htole16(0);
-          eh->eh_entries = htole16(n_extents);
-          eh->eh_max = htole16(max_inline);
-
-          struct ext4_extent *ext =
-              (struct ext4_extent *)((uint8_t *)tmp_inode->i_block +
-                                     sizeof(struct ext4_extent_header));
+  int ret = 0;
+  uint32_t logical_block = 0;
+  for (uint16_t e = 0; e < n_extents && ret == 0; e++) {
+    ret = dir_stage_add(dev, st, block_size, exts[e].phys,
+                        dir_job_block(job, logical_block), exts[e].len);
+    logical_block += exts[e].len;
+  }
+  if (ret < 0) {
+    free(exts);
+    ext4_reserve_release(&dir_res, alloc, layout);
+    return -1;
+  }
 
-          uint32_t logical_block = 0;
-          for (uint16_t e = 0; e < n_extents; e++) {
-            ext[e].ee_block = htole32(logical_block);
-            ext[e].ee_len = htole16((uint16_t)exts[e].len);
-            ext[e].ee_start_lo = htole32((uint32_t)(exts[e].phys & 0xFFFFFFFF));
-            ext[e].ee_start_hi = htole16((uint16_t)(exts[e].phys >> 32));
-            logical_block += exts[e].len;
-          }
-        } else {
-          /* Depth=1 extent tree */
-          uint64_t leaf_block = ext4_alloc_block(alloc, layout);
-          if (leaf_block == (uint64_t)-1) {
-            fprintf(stderr, "btrfs2ext4: no space for dir extent tree leaf\n");
-            free(exts);
-            free(inode_buf);
-            goto cleanup;
-          }
+  /*
+   * Update the inode's extent tree to point to the directory blocks.
+   * We need to find the inode in the table and update its i_block.
+   * For now, we do this by writing directly to the inode table on disk.
+   */
+  uint32_t ino_group = (dir_ino - 1) / layout->inodes_per_group;
+  uint32_t ino_local = (dir_ino - 1) % layout->inodes_per_group;
+
+  if (ino_group < layout->num_groups) {
+    const struct ext4_bg_layout *bg = &layout->groups[ino_group];
+    uint64_t inode_offset = bg->inode_table_start * block_size +
+                            (uint64_t)ino_local * layout->inode_size;
+
+    /* Bug K fix: Build inode directly instead of Read-Modify-Write.
+     * We construct the directory inode in RAM from scratch, avoiding
+     * the device_read() that doubled I/O for every directory. */
+    uint8_t *inode_buf = calloc(1, layout->inode_size);
+    if (inode_buf) {
+      struct ext4_inode *tmp_inode = (struct ext4_inode *)inode_buf;
+
+      /* Set directory inode fields */
+      tmp_inode->i_mode = htole16(040755);   /* Directory, rwxr-xr-x */
+      tmp_inode->i_links_count = htole16(2); /* . and .. */
+      tmp_inode->i_flags = htole32(EXT4_EXTENTS_FL | EXT4_INDEX_FL);
+
+      /* Directory size = num_blocks * block_size */
+      uint64_t dir_size = (uint64_t)num_blocks * block_size;
+      tmp_inode->i_size_lo = htole32((uint32_t)(dir_size & 0xFFFFFFFF));
+      tmp_inode->i_size_high = htole32((uint32_t)(dir_size >> 32));
+
+      /* Block count (in 512-byte sectors) */
+      uint64_t sectors = (dir_size + 511) / 512;
+      tmp_inode->i_blocks_lo = htole32((uint32_t)(sectors & 0xFFFFFFFF));
+      tmp_inode->i_blocks_high = htole16((uint16_t)(sectors >> 32));
+
+      uint16_t max_inline = 4;
+
+      if (n_extents <= max_inline) {
+        /* Inline extent tree (depth=0) */
+        struct ext4_extent_header *eh =
+            (struct ext4_extent_header *)tmp_inode->i_block;
+        eh->eh_magic = htole16(EXT4_EXT_MAGIC);
+        eh->eh_depth = htole16(0);
+        eh->eh_entries = htole16(n_extents);
+        eh->eh_max = htole16(max_inline);
+
+        struct ext4_extent *ext =
+            (struct ext4_extent *)((uint8_t *)tmp_inode->i_block +
+                                   sizeof(struct ext4_extent_header));
+
+        logical_block = 0;
+        for (uint16_t e = 0; e < n_extents; e++) {
+          ext[e].ee_block = htole32(logical_block);
+          ext[e].ee_len = htole16((uint16_t)exts[e].len);
+          ext[e].ee_start_lo = htole32((uint32_t)(exts[e].phys & 0xFFFFFFFF));
+          ext[e].ee_start_hi = htole16((uint16_t)(exts[e].phys >> 32));
+          logical_block += exts[e].len;
+        }
+      } else {
+        /* Depth=1 extent tree */
+        uint64_t leaf_block = ext4_reserve_take(&dir_res, alloc, layout);
+        if (leaf_block == (uint64_t)-1) {
+          fprintf(stderr, "btrfs2ext4: no space for dir extent tree leaf\n");
+          free(exts);
+          free(inode_buf);
+          ext4_reserve_release(&dir_res, alloc, layout);
+          return 0;
+        }
 
-          struct ext4_extent_header *root_eh =
-              (struct ext4_extent_header *)tmp_inode->i_block;
-          root_eh->eh_magic = htole16(EXT4_EXT_MAGIC);
-          root_eh->eh_depth = htole16(1);
-          root_eh->eh_entries = htole16(1);
-          root_eh->eh_max = htole16(max_inline);
-
-          struct ext4_extent_idx *idx =
-              (struct ext4_extent_idx *)((uint8_t *)tmp_inode->i_block +
-                                         sizeof(struct ext4_extent_header));
-          idx->ei_block = htole32(0);
-          idx->ei_leaf_lo = htole32((uint32_t)(leaf_block & 0xFFFFFFFF));
-          idx->ei_leaf_hi = htole16((uint16_t)(leaf_block >> 32));
-          idx->ei_unused = 0;
-
-          /* Create leaf block */
-          uint8_t *leaf_buf = calloc(1, block_size);
+        struct ext4_extent_header *root_eh =
+            (struct ext4_extent_header *)tmp_inode->i_block;
+        root_eh->eh_magic = htole16(EXT4_EXT_MAGIC);
+        root_eh->eh_depth = htole16(1);
+        root_eh->eh_entries = htole16(1);
+        root_eh->eh_max = htole16(max_inline);
+
+        struct ext4_extent_idx *idx =
+            (struct ext4_extent_idx *)((uint8_t *)tmp_inode->i_block +
+                                       sizeof(struct ext4_extent_header));
+        idx->ei_block = htole32(0);
+        idx->ei_leaf_lo = htole32((uint32_t)(leaf_block & 0xFFFFFFFF));
+        idx->ei_leaf_hi = htole16((uint16_t)(leaf_block >> 32));
+        idx->ei_unused = 0;
+
+        /* Create leaf block */
+        uint8_t *leaf_buf = calloc(1, block_size);
+        if (leaf_buf) {
           struct ext4_extent_header *leaf_eh =
               (struct ext4_extent_header *)leaf_buf;
           leaf_eh->eh_magic = htole16(EXT4_EXT_MAGIC);
@@ -573,7 +631,7 @@ int ext4_write_directories(struct device *dev, const struct ext4_layout *layout,
               (struct ext4_extent *)(leaf_buf +
                                      sizeof(struct ext4_extent_header));
 
-          uint32_t logical_block = 0;
+          logical_block = 0;
           for (uint16_t e = 0; e < n_extents; e++) {
             leaf_ext[e].ee_block = htole32(logical_block);
             leaf_ext[e].ee_len = htole16((uint16_t)exts[e].len);
@@ -583,36 +641,214 @@ int ext4_write_directories(struct device *dev, const struct ext4_layout *layout,
             logical_block += exts[e].len;
           }
 
-          if (device_write(dev, leaf_block * block_size, leaf_buf, block_size) <
+          if (dir_stage_add(dev, st, block_size, leaf_block, leaf_buf, 1) <
               0) {
             fprintf(stderr,
                     "btrfs2ext4: failed to write dir extent tree leaf\n");
           }
           free(leaf_buf);
-
-          /* Extra dir block adds to inode block count */
-          uint64_t sectors_including_leaf =
-              ((dir_size + block_size) + 511) / 512;
-          tmp_inode->i_blocks_lo =
-              htole32((uint32_t)(sectors_including_leaf & 0xFFFFFFFF));
-          tmp_inode->i_blocks_high =
-              htole16((uint16_t)(sectors_including_leaf >> 32));
         }
 
-        device_write(dev, inode_offset, inode_buf, layout->inode_size);
-        free(exts);
-        free(inode_buf);
+        /* Extra dir block adds to inode block count */
+        uint64_t sectors_including_leaf =
+            ((dir_size + block_size) + 511) / 512;
+        tmp_inode->i_blocks_lo =
+            htole32((uint32_t)(sectors_including_leaf & 0xFFFFFFFF));
+        tmp_inode->i_blocks_high =
+            htole16((uint16_t)(sectors_including_leaf >> 32));
       }
+
+      device_write(dev, inode_offset, inode_buf, layout->inode_size);
+      free(inode_buf);
     }
+  }
+
+  free(exts);
+  ext4_reserve_release(&dir_res, alloc, layout);
+  return 0;
+}
+
+/* Collect the next directories in inode_table order, starting at *cursor */
+static void dir_batch_fill(struct dir_batch *batch,
+                           const struct dir_build_ctx *ctx, uint32_t *cursor) {
+  const struct btrfs_fs_info *fs_info = ctx->fs_info;
+  uint64_t bytes = 0;
 
-  cleanup:
-    /* Cleanup */
-    for (uint32_t b = 0; b < num_blocks; b++)
-      free(dir_blocks[b]);
-    free(dir_blocks);
-    free(dir_block_nums);
+  batch->count = 0;
+  while (*cursor < fs_info->inode_count && batch->count < DIR_BATCH_DIRS &&
+         bytes < DIR_BATCH_BYTES) {
+    const struct file_entry *dir = fs_info->inode_table[(*cursor)++];
+    if (!S_ISDIR(dir->mode))
+      continue;
+
+    uint32_t dir_ino = inode_map_lookup(ctx->inode_map, dir->ino);
+    if (dir_ino == 0)
+      continue;
+
+    uint32_t parent_ino;
+    if (dir->ino == BTRFS_FIRST_FREE_OBJECTID) {
+      parent_ino = EXT4_ROOT_INO;
+    } else {
+      parent_ino = inode_map_lookup(ctx->inode_map, dir->parent_ino);
+      if (parent_ino == 0)
+        parent_ino = EXT4_ROOT_INO;
+    }
+
+    uint32_t dir_size = 24;
+    for (uint32_t c = 0; c < dir->child_count; c++) {
+      uint8_t nl = (uint8_t)dir->children[c].name_len;
+      if (nl > 0)
+        dir_size += dir_entry_len(nl);
+    }
+
+    struct dir_job *job = &batch->jobs[batch->count++];
+    if (job->cap_blocks > DIR_JOB_KEEP_BLOCKS) {
+      /* Do not keep a huge directory's buffer around for the next one */
+      mem_track_free_tag(MEM_TAG_DIR,
+                         (size_t)job->cap_blocks * ctx->block_size);
+      free(job->blocks);
+      job->blocks = NULL;
+      job->cap_blocks = 0;
+    }
+    job->ctx = ctx;
+    job->dir = dir;
+    job->dir_ino = dir_ino;
+    job->parent_ino = parent_ino;
+    job->dir_size = dir_size;
+    job->num_blocks = 0;
+    job->err = 0;
+    bytes += dir_size;
   }
+}
 
+static void dir_batch_submit(struct dir_batch *batch,
+                             struct thread_pool *pool) {
+  for (uint32_t j = 0; j < batch->count; j++) {
+    struct dir_job *job = &batch->jobs[j];
+    thread_pool_wg_add(batch->wg, 1);
+    if (!pool ||
+        thread_pool_submit(pool, dir_build_task, job, batch->wg) < 0) {
+      /* Inline fallback if the pool is missing or full */
+      thread_pool_wg_done(batch->wg);
+      dir_build_task(job);
+    }
+  }
+}
+
+/* Turn on INCOMPAT_LARGEDIR in the superblock and its backups, which were
+ * written before any directory was built */
+static int dir_set_largedir(struct device *dev,
+                            const struct ext4_layout *layout) {
+  uint32_t block_size = layout->block_size;
+  for (uint32_t g = 0; g < layout->num_groups; g++) {
+    if (g > 0 && !layout->groups[g].has_super)
+      continue;
+    uint64_t off = g == 0 ? EXT4_SUPER_OFFSET
+                          : layout->groups[g].superblock_block * block_size;
+    struct ext4_super_block sb;
+    if (device_read(dev, off, &sb, sizeof(sb)) < 0)
+      return -1;
+    sb.s_feature_incompat |= htole32(EXT4_FEATURE_INCOMPAT_LARGEDIR);
+    if (device_write(dev, off, &sb, sizeof(sb)) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+int ext4_write_directories(struct device *dev, const struct ext4_layout *layout,
+                           const struct btrfs_fs_info *fs_info,
+                           const struct inode_map *inode_map,
+                           struct ext4_block_allocator *alloc) {
+  uint32_t block_size = layout->block_size;
+
+  printf("Writing directory entries...\n");
+
+  struct dir_build_ctx ctx = {fs_info, inode_map, block_size};
+  struct dir_batch batches[2];
+  memset(batches, 0, sizeof(batches));
+  struct dir_stage stage = {0};
+  stage.cap_blocks = DIR_WRITE_STAGE / block_size;
+  stage.buf = malloc(DIR_WRITE_STAGE);
+  if (stage.buf)
+    mem_track_alloc_tag(MEM_TAG_DIR, DIR_WRITE_STAGE);
+
+  int ret = stage.buf ? 0 : -1;
+  for (int k = 0; k < 2 && ret == 0; k++) {
+    batches[k].jobs = calloc(DIR_BATCH_DIRS, sizeof(struct dir_job));
+    batches[k].wg = thread_pool_wg_create();
+    if (!batches[k].jobs || !batches[k].wg)
+      ret = -1;
+  }
+  if (ret < 0) {
+    fprintf(stderr, "btrfs2ext4: OOM allocating directory batches\n");
+  } else {
+    struct thread_pool *pool = thread_pool_create(0, 1024);
+    uint32_t cursor = 0;
+    uint64_t dirs = 0, total = 0, largedirs = 0;
+    for (uint32_t i = 0; i < fs_info->inode_count; i++)
+      total += S_ISDIR(fs_info->inode_table[i]->mode) != 0;
+    progress_begin("directories", total, "dirs");
+
+    dir_batch_fill(&batches[0], &ctx, &cursor);
+    dir_batch_submit(&batches[0], pool);
+    for (uint32_t k = 0; batches[k & 1].count > 0; k++) {
+      struct dir_batch *cur = &batches[k & 1];
+      struct dir_batch *next = &batches[(k + 1) & 1];
+
+      /* Build the next batch while this one is written */
+      dir_batch_fill(next, &ctx, &cursor);
+      dir_batch_submit(next, pool);
+
+      thread_pool_wg_wait(cur->wg);
+      for (uint32_t j = 0; j < cur->count && ret == 0; j++) {
+        if (cur->jobs[j].err < 0 ||
+            dir_commit(dev, layout, alloc, &stage, &cur->jobs[j]) < 0)
+          ret = -1;
+        largedirs += cur->jobs[j].largedir;
+      }
+      if (dir_stage_flush(dev, &stage, block_size) < 0)
+        ret = -1;
+      dirs += cur->count;
+      progress_add(cur->count);
+      cur->count = 0;
+      if (ret < 0)
+        break;
+    }
+
+    /* Jobs still building after an error must finish before teardown */
+    for (int k = 0; k < 2; k++)
+      thread_pool_wg_wait(batches[k].wg);
+    thread_pool_destroy(pool);
+    progress_end();
+    if (ret == 0)
+      printf("  %lu directories built on the worker pool\n",
+             (unsigned long)dirs);
+    if (ret == 0 && largedirs > 0) {
+      printf("  %lu directories use a %d-level HTree (largedir)\n",
+             (unsigned long)largedirs, EXT4_HTREE_LEVEL);
+      ret = dir_set_largedir(dev, layout);
+    }
+  }
+
+  for (int k = 0; k < 2; k++) {
+    if (batches[k].jobs) {
+      for (uint32_t j = 0; j < DIR_BATCH_DIRS; j++) {
+        mem_track_free_tag(MEM_TAG_DIR, (size_t)batches[k].jobs[j].cap_blocks *
+                                            block_size);
+        free(batches[k].jobs[j].blocks);
+      }
+      free(batches[k].jobs);
+    }
+    if (batches[k].wg)
+      thread_pool_wg_destroy(batches[k].wg);
+  }
+  if (stage.buf)
+    mem_track_free_tag(MEM_TAG_DIR, DIR_WRITE_STAGE);
+  free(stage.buf);
+
+  ext4_alloc_set_goal(alloc, layout, 0);
+  if (ret < 0)
+    return -1;
   printf("  Directory entries written\n");
   return 0;
 }
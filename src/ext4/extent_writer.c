@@ -21,13 +21,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "btrfs/btrfs_reader.h"
 #include "btrfs/chunk_tree.h"
+#include "btrfs/extent_store.h"
 #include "device_io.h"
 #include "ext4/ext4_planner.h"
 #include "ext4/ext4_structures.h"
 #include "ext4/ext4_writer.h"
+#include "mem_tracker.h"
+#include "progress.h"
+#include "usage_map.h"
 
 /* Maximum extents in an inline (inode) extent tree */
 #define INLINE_EXTENT_MAX 4
@@ -41,18 +46,26 @@
   (((bs) - sizeof(struct ext4_extent_header)) / sizeof(struct ext4_extent_idx))
 
 /* ========================================================================
- * Block allocator (bitmap-based, O(1) per allocation)
+ * Block allocator (bitmap-based, scanned a 64-bit word at a time)
  * ======================================================================== */
 
+/* Groups scanned past the best short run before settling for it */
+#define ALLOC_RUN_LOOKAHEAD_GROUPS 16
+
+#define ALLOC_NO_GOAL UINT32_MAX
+
+/* Goal-based allocation on by default; --no-alloc-goal turns it off */
+static int g_alloc_goal = 1;
+
+void ext4_alloc_set_goal_policy(int enabled) { g_alloc_goal = enabled; }
+
 void ext4_block_alloc_init(struct ext4_block_allocator *alloc,
                            const struct ext4_layout *layout) {
   memset(alloc, 0, sizeof(*alloc));
 
   /* Start allocating near the end of the data area to reduce early clashes. */
   if (layout->num_groups > 0) {
-    uint32_t last = layout->num_groups - 1;
-    alloc->next_alloc_block = layout->groups[last].data_start_block +
-                              layout->groups[last].data_blocks;
+    alloc->next_alloc_block = layout->total_blocks;
     uint64_t reserve;
     if (layout->total_blocks > 10240) {
       reserve = layout->total_blocks / 10;
@@ -69,6 +82,18 @@ void ext4_block_alloc_init(struct ext4_block_allocator *alloc,
   }
   alloc->max_blocks = layout->total_blocks;
 
+  /* One cursor per flex group, each starting at the flex group's first
+   * group; without them every allocation uses the global cursor */
+  alloc->goal_flex = ALLOC_NO_GOAL;
+  alloc->num_flex = (layout->num_groups + EXT4_GROUPS_PER_FLEX - 1) >>
+                    EXT4_LOG_GROUPS_PER_FLEX;
+  if (g_alloc_goal && alloc->num_flex > 1) {
+    alloc->flex_cursors =
+        calloc(alloc->num_flex, sizeof(struct ext4_alloc_cursor));
+    for (uint32_t f = 0; alloc->flex_cursors && f < alloc->num_flex; f++)
+      alloc->flex_cursors[f].group = f << EXT4_LOG_GROUPS_PER_FLEX;
+  }
+
   /* Build reserved bitmap for O(1) conflict checks and global usage map. */
   alloc->reserved_bitmap = calloc((layout->total_blocks + 7) / 8, 1);
   if (alloc->reserved_bitmap) {
@@ -84,56 +109,282 @@ void ext4_block_alloc_init(struct ext4_block_allocator *alloc,
 void ext4_block_alloc_free(struct ext4_block_allocator *alloc) {
   free(alloc->reserved_bitmap);
   alloc->reserved_bitmap = NULL;
+  free(alloc->flex_cursors);
+  alloc->flex_cursors = NULL;
 }
 
-uint64_t ext4_alloc_block(struct ext4_block_allocator *alloc,
-                          const struct ext4_layout *layout) {
-  /* Bug E fix: O(1) amortized allocator with cursor.
-   * Instead of scanning from group 0 every time (O(N²) total),
-   * resume from where we last left off (O(1) amortized). */
-  for (uint32_t gpass = 0; gpass < layout->num_groups; gpass++) {
-    uint32_t g = (alloc->current_group + gpass) % layout->num_groups;
-    const struct ext4_bg_layout *bg = &layout->groups[g];
+uint32_t ext4_alloc_set_goal(struct ext4_block_allocator *alloc,
+                             const struct ext4_layout *layout,
+                             uint32_t ext4_ino) {
+  uint32_t prev = alloc->goal_ino;
+  alloc->goal_ino = ext4_ino;
+  alloc->goal_flex = ALLOC_NO_GOAL;
+  if (ext4_ino != 0 && alloc->flex_cursors && layout->inodes_per_group) {
+    uint32_t group = (ext4_ino - 1) / layout->inodes_per_group;
+    if (group < layout->num_groups)
+      alloc->goal_flex = group >> EXT4_LOG_GROUPS_PER_FLEX;
+  }
+  return prev;
+}
+
+/* Bitmap word `wi` (bit i = block wi*64 + i); bytes past the end read as 0 */
+static inline uint64_t
+alloc_bitmap_word(const struct ext4_block_allocator *alloc, uint64_t wi) {
+  uint64_t nbytes = (alloc->max_blocks + 7) / 8;
+  uint64_t off = wi * 8;
+  uint64_t w = 0;
+  if (off + 8 <= nbytes) {
+    memcpy(&w, alloc->reserved_bitmap + off, sizeof(w));
+    return le64toh(w);
+  }
+  for (uint64_t i = 0; off + i < nbytes; i++)
+    w |= (uint64_t)alloc->reserved_bitmap[off + i] << (8 * i);
+  return w;
+}
+
+/* First block in [b, end) whose bit equals `used`, or `end` */
+static uint64_t alloc_bitmap_find(const struct ext4_block_allocator *alloc,
+                                  uint64_t b, uint64_t end, int used) {
+  while (b < end) {
+    uint64_t w = alloc_bitmap_word(alloc, b / 64);
+    if (!used)
+      w = ~w;
+    w &= ~0ULL << (b % 64);
+    if (w) {
+      uint64_t hit = (b & ~63ULL) + (uint64_t)__builtin_ctzll(w);
+      return hit < end ? hit : end;
+    }
+    b = (b & ~63ULL) + 64;
+  }
+  return end;
+}
+
+static void alloc_bitmap_set(uint8_t *bitmap, uint64_t start, uint64_t count,
+                             int used) {
+  uint64_t b = start, end = start + count;
+  for (; b < end && b % 8; b++) {
+    if (used)
+      bitmap[b / 8] |= (1 << (b % 8));
+    else
+      bitmap[b / 8] &= ~(1 << (b % 8));
+  }
+  if (end - b >= 8) {
+    memset(bitmap + b / 8, used ? 0xFF : 0, (end - b) / 8);
+    b += (end - b) & ~7ULL;
+  }
+  for (; b < end; b++) {
+    if (used)
+      bitmap[b / 8] |= (1 << (b % 8));
+    else
+      bitmap[b / 8] &= ~(1 << (b % 8));
+  }
+}
 
-    uint32_t start_i =
-        (g == alloc->current_group) ? alloc->current_block_in_group : 0;
+/* The cursor allocations currently move: the goal flex group's, if any */
+static struct ext4_alloc_cursor *
+alloc_active_cursor(struct ext4_block_allocator *alloc) {
+  if (alloc->goal_flex != ALLOC_NO_GOAL)
+    return &alloc->flex_cursors[alloc->goal_flex];
+  return &alloc->cursor;
+}
 
-    for (uint32_t i = start_i; i < bg->data_blocks; i++) {
-      uint64_t block = bg->data_start_block + i;
+static uint64_t alloc_claim(struct ext4_block_allocator *alloc,
+                            const struct ext4_layout *layout,
+                            struct ext4_alloc_cursor *cur, uint32_t g,
+                            uint64_t start, uint32_t len, uint32_t *got) {
+  if (alloc->reserved_bitmap)
+    alloc_bitmap_set(alloc->reserved_bitmap, start, len, 1);
+  cur->group = g;
+  cur->block_in_group =
+      (uint32_t)(start + len - layout->groups[g].data_start_block);
+  alloc->next_alloc_block = start + len - 1;
+  *got = len;
+  return start;
+}
 
-      /* O(1) bitmap check: skip any block already marked as used. */
-      if (alloc->reserved_bitmap &&
-          (alloc->reserved_bitmap[block / 8] & (1 << (block % 8)))) {
-        continue;
+/*
+ * Search groups [first, first + n) starting at `cur`, wrapping inside the
+ * range; the extra last pass revisits the cursor group's blocks before the
+ * cursor. Finds the first run of `want` free blocks, else the longest one
+ * seen within ALLOC_RUN_LOOKAHEAD_GROUPS of it. Claims it and moves `cur`.
+ */
+static uint64_t alloc_search(struct ext4_block_allocator *alloc,
+                             const struct ext4_layout *layout,
+                             struct ext4_alloc_cursor *cur, uint32_t first,
+                             uint32_t n, uint32_t want, uint32_t *got) {
+  uint64_t best_start = (uint64_t)-1;
+  uint32_t best_len = 0, best_group = 0, groups_since_best = 0;
+  uint32_t cur_group = cur->group >= first && cur->group < first + n
+                           ? cur->group
+                           : first;
+  uint32_t cur_off = cur_group == cur->group ? cur->block_in_group : 0;
+
+  for (uint32_t gpass = 0; gpass <= n; gpass++) {
+    uint32_t g = first + (cur_group - first + gpass) % n;
+    const struct ext4_bg_layout *bg = &layout->groups[g];
+
+    /* A packed flex group's metadata may sit inside the span; the
+     * reserved bitmap keeps it out */
+    uint64_t lo = bg->data_start_block;
+    uint64_t hi = bg->group_start_block + layout->blocks_per_group;
+    if (hi < lo + bg->data_blocks)
+      hi = lo + bg->data_blocks;
+    if (hi > alloc->max_blocks)
+      hi = alloc->max_blocks;
+    uint32_t span = hi > lo ? (uint32_t)(hi - lo) : 0;
+    uint32_t off = cur_off < span ? cur_off : span;
+    if (gpass == 0)
+      lo += off;
+    else if (gpass == n && lo + off < hi)
+      hi = lo + off;
+
+    if (!alloc->reserved_bitmap) {
+      if (lo < hi)
+        return alloc_claim(alloc, layout, cur, g, lo,
+                           hi - lo < want ? (uint32_t)(hi - lo) : want, got);
+      continue;
+    }
+
+    uint64_t b = lo;
+    while (b < hi) {
+      uint64_t s = alloc_bitmap_find(alloc, b, hi, 0);
+      if (s >= hi)
+        break;
+      uint64_t limit = hi - s < want ? hi : s + want;
+      uint64_t e = alloc_bitmap_find(alloc, s, limit, 1);
+      uint32_t len = (uint32_t)(e - s);
+      if (len >= want)
+        return alloc_claim(alloc, layout, cur, g, s, len, got);
+      if (len > best_len) {
+        best_start = s;
+        best_len = len;
+        best_group = g;
+        groups_since_best = 0;
       }
+      b = e;
+    }
+    if (best_len > 0 && ++groups_since_best > ALLOC_RUN_LOOKAHEAD_GROUPS)
+      break;
+  }
 
-      /* Claim the block in the global usage bitmap. */
-      if (alloc->reserved_bitmap)
-        alloc->reserved_bitmap[block / 8] |= (1 << (block % 8));
+  if (best_len == 0)
+    return (uint64_t)-1;
+  return alloc_claim(alloc, layout, cur, best_group, best_start, best_len,
+                     got);
+}
 
-      alloc->current_group = g;
-      alloc->current_block_in_group = i + 1;
-      alloc->next_alloc_block = block;
-      return block;
+uint64_t ext4_alloc_run(struct ext4_block_allocator *alloc,
+                        const struct ext4_layout *layout, uint32_t want,
+                        uint32_t *got) {
+  *got = 0;
+  if (want == 0 || layout->num_groups == 0)
+    return (uint64_t)-1;
+
+  if (alloc->goal_flex == ALLOC_NO_GOAL)
+    /* Bug E fix: resume from the cursor instead of group 0 */
+    return alloc_search(alloc, layout, &alloc->cursor, 0, layout->num_groups,
+                        want, got);
+
+  /* Goal flex group first, then the following ones. A short run near the
+   * inode beats a full one far away: callers loop for the remainder. */
+  for (uint32_t i = 0; i < alloc->num_flex; i++) {
+    uint32_t f = (alloc->goal_flex + i) % alloc->num_flex;
+    uint32_t first = f << EXT4_LOG_GROUPS_PER_FLEX;
+    uint32_t n = layout->num_groups - first < EXT4_GROUPS_PER_FLEX
+                     ? layout->num_groups - first
+                     : EXT4_GROUPS_PER_FLEX;
+    uint64_t start = alloc_search(alloc, layout, &alloc->flex_cursors[f],
+                                  first, n, want, got);
+    if (start != (uint64_t)-1) {
+      if (i > 0)
+        alloc->goal_spills++;
+      return start;
     }
-    /* Exhausted this group, next pass starts from block 0 */
-    alloc->current_block_in_group = 0;
   }
   return (uint64_t)-1; /* No free blocks */
 }
 
+uint64_t ext4_alloc_block(struct ext4_block_allocator *alloc,
+                          const struct ext4_layout *layout) {
+  uint32_t got;
+  return ext4_alloc_run(alloc, layout, 1, &got);
+}
+
+void ext4_release_run(struct ext4_block_allocator *alloc,
+                      const struct ext4_layout *layout, uint64_t start,
+                      uint32_t count) {
+  if (count == 0 || !alloc->reserved_bitmap)
+    return;
+  alloc_bitmap_set(alloc->reserved_bitmap, start, count, 0);
+
+  /* Giving back the tail of the latest run: rewind so it is reused next */
+  struct ext4_alloc_cursor *cur = alloc_active_cursor(alloc);
+  if (cur->group < layout->num_groups &&
+      layout->groups[cur->group].data_start_block + cur->block_in_group ==
+          start + count &&
+      cur->block_in_group >= count) {
+    cur->block_in_group -= count;
+  }
+}
+
+uint64_t ext4_reserve_take_run(struct ext4_block_reserve *r,
+                               struct ext4_block_allocator *alloc,
+                               const struct ext4_layout *layout, uint32_t want,
+                               uint32_t *got) {
+  *got = 0;
+  if (want == 0)
+    return (uint64_t)-1;
+  if (r->left == 0) {
+    uint32_t claimed = 0;
+    uint64_t start =
+        ext4_alloc_run(alloc, layout, r->want ? r->want : 1, &claimed);
+    if (start == (uint64_t)-1)
+      return (uint64_t)-1;
+    r->next = start;
+    r->left = claimed;
+    r->want = r->want > claimed ? r->want - claimed : 1;
+  }
+  *got = want < r->left ? want : r->left;
+  uint64_t start = r->next;
+  r->next += *got;
+  r->left -= *got;
+  return start;
+}
+
+uint64_t ext4_reserve_take(struct ext4_block_reserve *r,
+                           struct ext4_block_allocator *alloc,
+                           const struct ext4_layout *layout) {
+  uint32_t got;
+  return ext4_reserve_take_run(r, alloc, layout, 1, &got);
+}
+
+void ext4_reserve_release(struct ext4_block_reserve *r,
+                          struct ext4_block_allocator *alloc,
+                          const struct ext4_layout *layout) {
+  ext4_release_run(alloc, layout, r->next, r->left);
+  r->left = 0;
+}
+
 void ext4_block_alloc_mark_fs_data(struct ext4_block_allocator *alloc,
                                    const struct ext4_layout *layout,
                                    const struct btrfs_fs_info *fs_info) {
   if (!alloc || !alloc->reserved_bitmap || !fs_info)
     return;
 
+  /* The usage map already follows relocated data to its new place */
+  if (fs_info->usage.bits) {
+    usage_map_mark_data(&fs_info->usage, alloc->reserved_bitmap,
+                        layout->block_size, layout->total_blocks);
+    return;
+  }
+
   uint32_t block_size = layout->block_size;
 
   for (uint32_t i = 0; i < fs_info->inode_count; i++) {
-    const struct file_entry *fe = fs_info->inode_table[i];
-    for (uint32_t j = 0; j < fe->extent_count; j++) {
-      const struct file_extent *ext = &fe->extents[j];
+    struct extent_iter it;
+    const struct file_extent *ext;
+    extent_iter_init(&it, fs_info, fs_info->inode_table[i]);
+    while ((ext = extent_iter_next(&it)) != NULL) {
       if (ext->type == BTRFS_FILE_EXTENT_INLINE || ext->disk_bytenr == 0)
         continue;
 
@@ -156,6 +407,392 @@ void ext4_block_alloc_mark_fs_data(struct ext4_block_allocator *alloc,
   }
 }
 
+/* ========================================================================
+ * Internal: blocks mapped by a data extent
+ * ======================================================================== */
+
+/*
+ * File block, physical block and length of a data extent as its extent
+ * tree entry records them. Returns 0 for inline extents, holes and
+ * addresses no chunk maps.
+ */
+static int extent_blocks(const struct btrfs_fs_info *fs_info,
+                         const struct file_extent *bext, uint32_t block_size,
+                         uint32_t *file_block, uint64_t *phys_block,
+                         uint32_t *num_blocks) {
+  if (bext->type == BTRFS_FILE_EXTENT_INLINE || bext->disk_bytenr == 0)
+    return 0;
+
+  uint64_t phys = chunk_map_resolve(fs_info->chunk_map, bext->disk_bytenr);
+  if (phys == (uint64_t)-1)
+    return 0;
+
+  *file_block = (uint32_t)(bext->file_offset / block_size);
+  *phys_block = phys / block_size;
+  *num_blocks = (uint32_t)(bext->num_bytes / block_size);
+  if (*num_blocks == 0)
+    *num_blocks = 1;
+  return 1;
+}
+
+/* ========================================================================
+ * Public: CoW clone plan
+ * ======================================================================== */
+
+/* Append without merging; the caller accounts for the blocks */
+static int clone_plan_append(struct ext4_clone_plan *plan,
+                             const struct ext4_clone *c) {
+  if (plan->count >= plan->capacity) {
+    uint32_t cap = plan->capacity ? plan->capacity * 2 : 256;
+    struct ext4_clone *n = realloc(plan->clones, cap * sizeof(*n));
+    if (!n)
+      return -1;
+    mem_track_alloc_tag(MEM_TAG_RELOC,
+                        (uint64_t)(cap - plan->capacity) * sizeof(*n));
+    plan->clones = n;
+    plan->capacity = cap;
+  }
+  plan->clones[plan->count++] = *c;
+  return 0;
+}
+
+static int clone_plan_push(struct ext4_clone_plan *plan,
+                           const struct file_entry *fe, uint32_t file_block,
+                           uint64_t src_block) {
+  plan->blocks++;
+
+  /* Extend the last run when contiguous in both the file and the source */
+  if (plan->count > 0) {
+    struct ext4_clone *last = &plan->clones[plan->count - 1];
+    if (last->fe == fe && last->file_block + last->num_blocks == file_block &&
+        last->src_block + last->num_blocks == src_block &&
+        last->num_blocks < 32768) {
+      last->num_blocks++;
+      return 0;
+    }
+  }
+
+  struct ext4_clone c = {
+      .fe = fe,
+      .file_block = file_block,
+      .num_blocks = 1,
+      .src_block = src_block,
+      .dst_block = EXT4_CLONE_NO_DST,
+  };
+  return clone_plan_append(plan, &c);
+}
+
+static int cmp_clone_src(const void *a, const void *b) {
+  const struct ext4_clone *ca = a, *cb = b;
+  if (ca->src_block != cb->src_block)
+    return ca->src_block < cb->src_block ? -1 : 1;
+  if (ca->dst_block != cb->dst_block)
+    return ca->dst_block < cb->dst_block ? -1 : 1;
+  return 0;
+}
+
+static int cmp_clone_file(const void *a, const void *b) {
+  const struct ext4_clone *ca = a, *cb = b;
+  if (ca->fe != cb->fe)
+    return (uintptr_t)ca->fe < (uintptr_t)cb->fe ? -1 : 1;
+  if (ca->file_block != cb->file_block)
+    return ca->file_block < cb->file_block ? -1 : 1;
+  return 0;
+}
+
+/*
+ * Destinations in file order, each near its inode. A short run splits the
+ * clone; the remainder is appended and allocated when the loop reaches it.
+ */
+static int clone_plan_allocate(struct ext4_clone_plan *plan,
+                               struct ext4_block_allocator *alloc,
+                               const struct ext4_layout *layout,
+                               const struct inode_map *inode_map) {
+  uint32_t prev_goal = alloc->goal_ino;
+  const struct file_entry *goal_fe = NULL;
+  int ret = 0;
+
+  for (uint32_t i = 0; i < plan->count; i++) {
+    struct ext4_clone *c = &plan->clones[i];
+    if (c->fe != goal_fe) {
+      goal_fe = c->fe;
+      ext4_alloc_set_goal(alloc, layout,
+                          inode_map ? inode_map_lookup(inode_map, c->fe->ino)
+                                    : 0);
+    }
+
+    uint32_t got = 0;
+    uint64_t dst = ext4_alloc_run(alloc, layout, c->num_blocks, &got);
+    if (dst == (uint64_t)-1) {
+      fprintf(stderr,
+              "btrfs2ext4: no free blocks for %u shared blocks of inode "
+              "%lu\n",
+              c->num_blocks, (unsigned long)c->fe->ino);
+      ret = -1;
+      break;
+    }
+    c->dst_block = dst;
+    if (got < c->num_blocks) {
+      struct ext4_clone rest = *c;
+      rest.file_block += got;
+      rest.src_block += got;
+      rest.num_blocks -= got;
+      rest.dst_block = EXT4_CLONE_NO_DST;
+      c->num_blocks = got;
+      if (clone_plan_append(plan, &rest) < 0) {
+        fprintf(stderr, "btrfs2ext4: OOM splitting a CoW clone\n");
+        ret = -1;
+        break;
+      }
+    }
+  }
+
+  ext4_alloc_set_goal(alloc, layout, prev_goal);
+  return ret;
+}
+
+int ext4_clone_plan_build(struct ext4_clone_plan *plan,
+                          const struct ext4_layout *layout,
+                          const struct btrfs_fs_info *fs_info,
+                          struct ext4_block_allocator *alloc,
+                          const struct inode_map *inode_map) {
+  memset(plan, 0, sizeof(*plan));
+  uint32_t block_size = layout->block_size;
+  uint64_t total = layout->total_blocks;
+
+  /* One bit per device block: set once some file has mapped it */
+  size_t owned_bytes = (size_t)((total + 7) / 8);
+  uint8_t *owned = calloc(owned_bytes ? owned_bytes : 1, 1);
+  if (!owned)
+    return -1;
+  mem_track_alloc_tag(MEM_TAG_RELOC, owned_bytes);
+
+  int ret = 0;
+  for (uint32_t i = 0; i < fs_info->inode_count && ret == 0; i++) {
+    const struct file_entry *fe = fs_info->inode_table[i];
+    if (!fe || !S_ISREG(fe->mode) || fe->extent_count == 0)
+      continue;
+
+    struct extent_iter it;
+    const struct file_extent *bext;
+    extent_iter_init(&it, fs_info, fe);
+    while ((bext = extent_iter_next(&it)) != NULL && ret == 0) {
+      /* Compressed extents are decompressed into blocks of their own */
+      if (bext->compression != BTRFS_COMPRESS_NONE)
+        continue;
+
+      uint32_t file_block, num_blocks;
+      uint64_t phys_block;
+      if (!extent_blocks(fs_info, bext, block_size, &file_block, &phys_block,
+                         &num_blocks))
+        continue;
+
+      for (uint32_t b = 0; b < num_blocks && ret == 0; b++) {
+        uint64_t pb = phys_block + b;
+        if (pb >= total)
+          break;
+        if (owned[pb / 8] & (1 << (pb % 8)))
+          ret = clone_plan_push(plan, fe, file_block + b, pb);
+        else
+          owned[pb / 8] |= (uint8_t)(1 << (pb % 8));
+      }
+    }
+  }
+
+  free(owned);
+  mem_track_free_tag(MEM_TAG_RELOC, owned_bytes);
+  if (ret < 0) {
+    fprintf(stderr, "btrfs2ext4: OOM building the CoW clone plan\n");
+    ext4_clone_plan_free(plan);
+    return -1;
+  }
+
+  if (alloc && clone_plan_allocate(plan, alloc, layout, inode_map) < 0) {
+    ext4_clone_plan_free(plan);
+    return -1;
+  }
+
+  /* Source order; overlapping and adjacent sources form one range */
+  if (plan->count > 1)
+    qsort(plan->clones, plan->count, sizeof(*plan->clones), cmp_clone_src);
+  uint64_t end = 0;
+  for (uint32_t i = 0; i < plan->count; i++) {
+    uint64_t s = plan->clones[i].src_block;
+    uint64_t e = s + plan->clones[i].num_blocks;
+    if (i == 0 || s > end) {
+      plan->source_ranges++;
+      plan->source_blocks += e - s;
+      end = e;
+    } else if (e > end) {
+      plan->source_blocks += e - end;
+      end = e;
+    }
+  }
+  return 0;
+}
+
+/* One device_copy() per clone, in source order; no byte leaves the kernel */
+static int clone_plan_copy(struct ext4_clone_plan *plan, struct device *dev,
+                           uint32_t block_size) {
+  for (uint32_t i = 0; i < plan->count; i++) {
+    const struct ext4_clone *c = &plan->clones[i];
+    uint64_t len = (uint64_t)c->num_blocks * block_size;
+    if (device_copy(dev, c->src_block * block_size, c->dst_block * block_size,
+                    len) < 0) {
+      fprintf(stderr, "btrfs2ext4: failed to copy shared blocks %lu-%lu\n",
+              (unsigned long)c->src_block,
+              (unsigned long)(c->src_block + c->num_blocks - 1));
+      return -1;
+    }
+    plan->bytes_read += len;
+    plan->bytes_written += len;
+    progress_add(len);
+  }
+  return 0;
+}
+
+/* Read each merged source range once and fan it out to its clones */
+static int clone_plan_fan_out(struct ext4_clone_plan *plan,
+                              struct device *dev, uint32_t block_size) {
+  uint32_t chunk_blocks = EXT4_CLONE_IO_MAX / block_size;
+  if (chunk_blocks == 0)
+    chunk_blocks = 1;
+  size_t buf_size = (size_t)chunk_blocks * block_size;
+  uint8_t *buf = device_buf_alloc(buf_size);
+  if (!buf) {
+    fprintf(stderr, "btrfs2ext4: OOM allocating the CoW clone buffer\n");
+    return -1;
+  }
+
+  int ret = 0;
+  device_write_batch_begin(dev);
+
+  /* Clones [first, last) share one source range [start, end) */
+  uint32_t first = 0;
+  while (first < plan->count && ret == 0) {
+    uint64_t start = plan->clones[first].src_block;
+    uint64_t end = start + plan->clones[first].num_blocks;
+    uint32_t last = first + 1;
+    while (last < plan->count && plan->clones[last].src_block <= end) {
+      uint64_t e =
+          plan->clones[last].src_block + plan->clones[last].num_blocks;
+      if (e > end)
+        end = e;
+      last++;
+    }
+
+    for (uint64_t cs = start; cs < end && ret == 0; cs += chunk_blocks) {
+      uint64_t ce = end - cs < chunk_blocks ? end : cs + chunk_blocks;
+      size_t len = (size_t)(ce - cs) * block_size;
+      if (device_read_bulk(dev, cs * block_size, buf, len) < 0) {
+        fprintf(stderr,
+                "btrfs2ext4: failed to read shared blocks %lu-%lu\n",
+                (unsigned long)cs, (unsigned long)(ce - 1));
+        ret = -1;
+        break;
+      }
+      plan->bytes_read += len;
+
+      /* Every destination of this piece in one batch */
+      for (uint32_t i = first; i < last; i++) {
+        const struct ext4_clone *c = &plan->clones[i];
+        uint64_t s = c->src_block > cs ? c->src_block : cs;
+        uint64_t e = c->src_block + c->num_blocks < ce
+                         ? c->src_block + c->num_blocks
+                         : ce;
+        if (s >= e)
+          continue;
+        size_t n = (size_t)(e - s) * block_size;
+        if (device_write_batch_add(dev,
+                                   (c->dst_block + (s - c->src_block)) *
+                                       block_size,
+                                   buf + (s - cs) * block_size, n) < 0) {
+          ret = -1;
+          break;
+        }
+        plan->bytes_written += n;
+        progress_add(n);
+      }
+      /* The buffer is reused for the next piece */
+      if (device_write_batch_submit(dev) < 0)
+        ret = -1;
+    }
+    first = last;
+  }
+
+  device_buf_free(buf, buf_size);
+  return ret;
+}
+
+int ext4_clone_plan_execute(struct ext4_clone_plan *plan, struct device *dev,
+                            uint32_t block_size) {
+  if (plan->count == 0)
+    return 0;
+
+  /* copy_file_range() keeps the bytes in the kernel, and a host file system
+   * that shares extents may not copy them at all. A splice() copy would
+   * still read each destination's bytes again, so there the fan-out wins. */
+  progress_begin("clones", plan->blocks * block_size, NULL);
+  int ret = device_copy_mode(dev) == DEVICE_COPY_RANGE
+                ? clone_plan_copy(plan, dev, block_size)
+                : clone_plan_fan_out(plan, dev, block_size);
+  progress_end();
+  if (ret < 0)
+    fprintf(stderr, "btrfs2ext4: failed to copy shared blocks\n");
+
+  /* Lookup order for resolve_extents() */
+  qsort(plan->clones, plan->count, sizeof(*plan->clones), cmp_clone_file);
+  return ret;
+}
+
+const struct ext4_clone *
+ext4_clone_plan_find(const struct ext4_clone_plan *plan,
+                     const struct file_entry *fe, uint32_t *n) {
+  *n = 0;
+  if (!plan || plan->count == 0)
+    return NULL;
+
+  /* First clone of fe, then its extent */
+  uint32_t lo = 0, hi = plan->count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if ((uintptr_t)plan->clones[mid].fe < (uintptr_t)fe)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  uint32_t end = lo;
+  while (end < plan->count && plan->clones[end].fe == fe)
+    end++;
+  *n = end - lo;
+  return *n ? &plan->clones[lo] : NULL;
+}
+
+void ext4_clone_plan_free(struct ext4_clone_plan *plan) {
+  if (plan->capacity)
+    mem_track_free_tag(MEM_TAG_RELOC,
+                       (uint64_t)plan->capacity * sizeof(*plan->clones));
+  free(plan->clones);
+  memset(plan, 0, sizeof(*plan));
+}
+
+/* Destination of file block `fb` if it was cloned, else EXT4_CLONE_NO_DST */
+static uint64_t clone_lookup(const struct ext4_clone *clones, uint32_t n,
+                             uint32_t fb) {
+  uint32_t lo = 0, hi = n;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (clones[mid].file_block + clones[mid].num_blocks <= fb)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo < n && clones[lo].file_block <= fb &&
+      clones[lo].dst_block != EXT4_CLONE_NO_DST)
+    return clones[lo].dst_block + (fb - clones[lo].file_block);
+  return EXT4_CLONE_NO_DST;
+}
+
 /* ========================================================================
  * Internal: rebuild sorted extent list from btrfs data
  * ======================================================================== */
@@ -164,8 +801,15 @@ struct resolved_extent {
   uint32_t file_block; /* logical file block */
   uint32_t num_blocks; /* number of blocks */
   uint64_t phys_block; /* physical block on disk */
+  uint8_t unwritten;   /* Btrfs PREALLOC: allocated, reads as zeros */
 };
 
+/* ee_len of an extent: unwritten ones are flagged by the length's top */
+static inline uint16_t resolved_ee_len(const struct resolved_extent *e) {
+  return (uint16_t)(e->unwritten ? e->num_blocks + EXT4_EXT_INIT_MAX_LEN
+                                 : e->num_blocks);
+}
+
 static int cmp_resolved_extent(const void *a, const void *b) {
   const struct resolved_extent *ea = (const struct resolved_extent *)a;
   const struct resolved_extent *eb = (const struct resolved_extent *)b;
@@ -177,14 +821,15 @@ static int cmp_resolved_extent(const void *a, const void *b) {
 }
 
 /*
- * Build a sorted list of resolved extents from a btrfs file entry.
- * Physically clones CoW blocks to avoid Ext4 multiply-claimed metadata
- * corruption. Returns the number of extents, or -1 on error.
+ * Build a sorted list of resolved extents from a btrfs file entry. Blocks
+ * the clone plan copied for this file map to their copies, so no two
+ * inodes claim a block. PREALLOC extents become unwritten extents, which
+ * only merge with each other. Returns the number of extents, or -1 on
+ * error.
  */
-static int resolve_extents(struct ext4_block_allocator *alloc,
-                           struct device *dev, const struct ext4_layout *layout,
+static int resolve_extents(const struct ext4_block_allocator *alloc,
                            const struct file_entry *fe,
-                           const struct chunk_map *chunk_map,
+                           const struct btrfs_fs_info *fs_info,
                            uint32_t block_size,
                            struct resolved_extent **out_extents) {
   if (fe->extent_count == 0) {
@@ -197,67 +842,28 @@ static int resolve_extents(struct ext4_block_allocator *alloc,
   if (!exts)
     return -1;
 
-  uint32_t count = 0;
-  for (uint32_t i = 0; i < fe->extent_count; i++) {
-    const struct file_extent *bext = &fe->extents[i];
-    if (bext->type == BTRFS_FILE_EXTENT_INLINE || bext->disk_bytenr == 0)
-      continue;
+  uint32_t nclones = 0;
+  const struct ext4_clone *clones =
+      ext4_clone_plan_find(alloc->clones, fe, &nclones);
 
-    uint64_t phys = chunk_map_resolve(chunk_map, bext->disk_bytenr);
-    if (phys == (uint64_t)-1)
+  uint32_t count = 0;
+  struct extent_iter it;
+  const struct file_extent *bext;
+  extent_iter_init(&it, fs_info, fe);
+  while ((bext = extent_iter_next(&it)) != NULL) {
+    uint32_t file_block_start, num_blocks;
+    uint64_t phys_block_start;
+    if (!extent_blocks(fs_info, bext, block_size, &file_block_start,
+                       &phys_block_start, &num_blocks))
       continue;
 
-    uint32_t file_block_start = (uint32_t)(bext->file_offset / block_size);
-    uint32_t num_blocks = (uint32_t)(bext->num_bytes / block_size);
-    uint64_t phys_block_start = phys / block_size;
-
-    if (num_blocks == 0)
-      num_blocks = 1;
-
     for (uint32_t b = 0; b < num_blocks; b++) {
-      uint64_t current_phys = phys_block_start + b;
       uint32_t current_file_block = file_block_start + b;
-      uint64_t final_phys = current_phys;
-
-      if (alloc->reserved_bitmap && (alloc->reserved_bitmap[current_phys / 8] &
-                                     (1 << (current_phys % 8)))) {
-        /* Block already claimed! Need to clone it. */
-        uint64_t new_phys = ext4_alloc_block(alloc, layout);
-        if (new_phys != (uint64_t)-1) {
-          if (alloc->reserved_bitmap) {
-            alloc->reserved_bitmap[new_phys / 8] |= (1 << (new_phys % 8));
-          }
-
-/* Bug N fix: Batch CoW clones into contiguous runs.
- * If the source and destination blocks are both sequential,
- * accumulate them and do a single large read+write.
- * For non-sequential blocks, flush and clone individually. */
-#define COW_BATCH_MAX (1024) /* up to 4MB per batch at 4KB blocks */
-
-          /* Simple single-block clone (batching would require tracking
-           * source runs too — keep it simple for now with a reusable buffer) */
-          static __thread uint8_t *cow_buf = NULL;
-          static __thread size_t cow_buf_size = 0;
-
-          if (!cow_buf || cow_buf_size < block_size) {
-            free(cow_buf);
-            cow_buf = malloc(block_size);
-            cow_buf_size = cow_buf ? block_size : 0;
-          }
-
-          if (cow_buf) {
-            if (device_read(dev, current_phys * block_size, cow_buf,
-                            block_size) == 0) {
-              device_write(dev, new_phys * block_size, cow_buf, block_size);
-            }
-          }
-          final_phys = new_phys;
-        }
-      } else {
-        /* Claim the physical block for this inode */
-        if (alloc->reserved_bitmap) {
-          alloc->reserved_bitmap[current_phys / 8] |= (1 << (current_phys % 8));
-        }
+      uint64_t final_phys = phys_block_start + b;
+      if (nclones) {
+        uint64_t dst = clone_lookup(clones, nclones, current_file_block);
+        if (dst != EXT4_CLONE_NO_DST)
+          final_phys = dst;
       }
 
       if (count >= capacity) {
@@ -275,6 +881,7 @@ static int resolve_extents(struct ext4_block_allocator *alloc,
       exts[count].file_block = current_file_block;
       exts[count].num_blocks = 1;
       exts[count].phys_block = final_phys;
+      exts[count].unwritten = bext->type == BTRFS_FILE_EXTENT_PREALLOC;
       count++;
     }
   }
@@ -283,15 +890,19 @@ static int resolve_extents(struct ext4_block_allocator *alloc,
   if (count > 1)
     qsort(exts, count, sizeof(*exts), cmp_resolved_extent);
 
-  /* Merge adjacent extents and enforce Ext4 limit (32768 blocks per extent) */
+  /* Merge adjacent extents and enforce Ext4 limit (32768 blocks per
+   * extent, 32767 if unwritten) */
   uint32_t merged = 0;
   for (uint32_t i = 0; i < count; i++) {
+    uint32_t max_len = exts[i].unwritten ? EXT4_EXT_UNWRITTEN_MAX_LEN
+                                         : EXT4_EXT_INIT_MAX_LEN;
     if (merged > 0 &&
         exts[merged - 1].file_block + exts[merged - 1].num_blocks ==
             exts[i].file_block &&
         exts[merged - 1].phys_block + exts[merged - 1].num_blocks ==
             exts[i].phys_block &&
-        exts[merged - 1].num_blocks + exts[i].num_blocks <= 32768) {
+        exts[merged - 1].unwritten == exts[i].unwritten &&
+        exts[merged - 1].num_blocks + exts[i].num_blocks <= max_len) {
       exts[merged - 1].num_blocks += exts[i].num_blocks;
     } else {
       exts[merged++] = exts[i];
@@ -302,6 +913,181 @@ static int resolve_extents(struct ext4_block_allocator *alloc,
   return (int)merged;
 }
 
+/* ========================================================================
+ * Extent-tree regions
+ * ======================================================================== */
+
+/* On by default; --no-tree-region puts tree blocks next to each file */
+static int g_tree_region = 1;
+
+void ext4_tree_region_set_policy(int enabled) { g_tree_region = enabled; }
+
+uint32_t ext4_extent_tree_blocks(uint32_t extents, uint32_t block_size) {
+  if (extents <= INLINE_EXTENT_MAX)
+    return 0;
+  uint32_t epb = (uint32_t)EXTENTS_PER_BLOCK(block_size);
+  uint32_t ipb = (uint32_t)INDEX_PER_BLOCK(block_size);
+  uint32_t n = (extents + epb - 1) / epb;
+  uint32_t total = n;
+  while (n > INLINE_EXTENT_MAX) {
+    n = (n + ipb - 1) / ipb;
+    total += n;
+  }
+  return total;
+}
+
+int ext4_tree_regions_init(struct ext4_tree_regions *r,
+                           const struct ext4_block_allocator *alloc,
+                           struct device *dev, const struct ext4_layout *layout,
+                           const struct btrfs_fs_info *fs_info,
+                           const struct inode_map *map) {
+  memset(r, 0, sizeof(*r));
+  if (!g_tree_region)
+    return 0;
+  uint32_t count = alloc->flex_cursors ? alloc->num_flex : 1;
+  r->flex = calloc(count, sizeof(*r->flex));
+  if (!r->flex)
+    return -1;
+  r->count = count;
+  r->block_size = layout->block_size;
+  r->dev = dev;
+
+  for (uint32_t i = 0; i < fs_info->inode_count; i++) {
+    const struct file_entry *fe = fs_info->inode_table[i];
+    if (!S_ISREG(fe->mode))
+      continue;
+    uint32_t n = ext4_extent_tree_blocks(fe->extent_count, layout->block_size);
+    if (n == 0)
+      continue;
+    uint32_t f = 0;
+    if (count > 1 && layout->inodes_per_group) {
+      uint32_t ino = inode_map_lookup(map, fe->ino);
+      uint32_t group = ino ? (ino - 1) / layout->inodes_per_group : 0;
+      f = group >> EXT4_LOG_GROUPS_PER_FLEX;
+      if (f >= count)
+        f = count - 1;
+    }
+    r->flex[f].reserve.want += n;
+    r->planned += n;
+  }
+  return 0;
+}
+
+/* Queue the staged blocks as one write and wait for it */
+static int tree_region_flush(struct ext4_tree_regions *r,
+                             struct ext4_tree_region *reg) {
+  if (reg->staged == 0)
+    return 0;
+  int ret = device_write_batch_add(r->dev, reg->stage_block * r->block_size,
+                                   reg->stage,
+                                   (size_t)reg->staged * r->block_size);
+  if (device_write_batch_submit(r->dev) < 0)
+    ret = -1;
+  r->writes++;
+  reg->staged = 0;
+  if (ret < 0)
+    r->error = 1;
+  return ret;
+}
+
+/* Stage `n` built blocks for blocks [blk, blk + n) */
+static int tree_region_stage(struct ext4_tree_regions *r,
+                             struct ext4_tree_region *reg, uint64_t blk,
+                             const uint8_t *data, uint32_t n) {
+  uint32_t cap = EXT4_TREE_REGION_STAGE / r->block_size;
+  if (!reg->stage) {
+    reg->stage = malloc(EXT4_TREE_REGION_STAGE);
+    if (!reg->stage)
+      return -1;
+  }
+  while (n > 0) {
+    if (reg->staged > 0 &&
+        (reg->stage_block + reg->staged != blk || reg->staged == cap) &&
+        tree_region_flush(r, reg) < 0)
+      return -1;
+    if (reg->staged == 0)
+      reg->stage_block = blk;
+    uint32_t take = cap - reg->staged < n ? cap - reg->staged : n;
+    memcpy(reg->stage + (size_t)reg->staged * r->block_size, data,
+           (size_t)take * r->block_size);
+    reg->staged += take;
+    r->blocks += take;
+    blk += take;
+    data += (size_t)take * r->block_size;
+    n -= take;
+  }
+  return 0;
+}
+
+int ext4_tree_regions_finish(struct ext4_tree_regions *r,
+                             struct ext4_block_allocator *alloc,
+                             const struct ext4_layout *layout) {
+  for (uint32_t f = 0; f < r->count; f++) {
+    struct ext4_tree_region *reg = &r->flex[f];
+    tree_region_flush(r, reg);
+    ext4_reserve_release(&reg->reserve, alloc, layout);
+    free(reg->stage);
+  }
+  free(r->flex);
+  r->flex = NULL;
+  r->count = 0;
+  return r->error ? -1 : 0;
+}
+
+/* The region of the goal flex group, or NULL without regions */
+static struct ext4_tree_region *
+tree_region_of(const struct ext4_block_allocator *alloc) {
+  struct ext4_tree_regions *r = alloc->tree_regions;
+  if (!r || r->count == 0)
+    return NULL;
+  uint32_t f = alloc->goal_flex;
+  return &r->flex[f != ALLOC_NO_GOAL && f < r->count ? f : 0];
+}
+
+/* Blocks for a tree of `n` blocks: from the region of the goal flex group,
+ * else claimed for this tree alone. Returns 0 or -1 when the device is
+ * full. */
+static int tree_take_blocks(struct ext4_block_allocator *alloc,
+                            const struct ext4_layout *layout, uint32_t n,
+                            uint64_t *blocks) {
+  struct ext4_tree_region *reg = tree_region_of(alloc);
+  struct ext4_block_reserve own = {0, 0, n};
+  struct ext4_block_reserve *res = reg ? &reg->reserve : &own;
+  for (uint32_t k = 0; k < n;) {
+    /* Past its estimate, a region claims at least what this tree needs */
+    if (res->left == 0 && res->want < n - k)
+      res->want = n - k;
+    uint32_t got = 0;
+    uint64_t blk = ext4_reserve_take_run(res, alloc, layout, n - k, &got);
+    if (blk == (uint64_t)-1)
+      return -1;
+    for (uint32_t i = 0; i < got; i++)
+      blocks[k++] = blk + i;
+  }
+  return 0;
+}
+
+/* Write a tree built in memory: staged in its region, or one write per run
+ * of consecutive blocks */
+static int tree_write_blocks(struct ext4_block_allocator *alloc,
+                             struct device *dev, const uint64_t *blocks,
+                             const uint8_t *tree, uint32_t n,
+                             uint32_t block_size) {
+  struct ext4_tree_region *reg = tree_region_of(alloc);
+  for (uint32_t k = 0, run; k < n; k += run) {
+    for (run = 1; k + run < n && blocks[k + run] == blocks[k] + run; run++)
+      ;
+    const uint8_t *data = tree + (size_t)k * block_size;
+    int ret = reg ? tree_region_stage(alloc->tree_regions, reg, blocks[k],
+                                      data, run)
+                  : device_write(dev, blocks[k] * block_size, data,
+                                 (size_t)run * block_size);
+    if (ret < 0)
+      return -1;
+  }
+  return 0;
+}
+
 /* ========================================================================
  * Public: build extent tree (inline or multi-level)
  * ======================================================================== */
@@ -309,14 +1095,13 @@ static int resolve_extents(struct ext4_block_allocator *alloc,
 int ext4_build_extent_tree(struct ext4_block_allocator *alloc,
                            struct device *dev, struct ext4_inode *inode,
                            const struct file_entry *fe,
-                           const struct chunk_map *chunk_map,
+                           const struct btrfs_fs_info *fs_info,
                            const struct ext4_layout *layout) {
   uint32_t block_size = layout->block_size;
 
   /* Resolve and merge all extents */
   struct resolved_extent *exts;
-  int ext_count =
-      resolve_extents(alloc, dev, layout, fe, chunk_map, block_size, &exts);
+  int ext_count = resolve_extents(alloc, fe, fs_info, block_size, &exts);
   if (ext_count < 0)
     return -1;
   if (ext_count == 0) {
@@ -348,7 +1133,7 @@ int ext4_build_extent_tree(struct ext4_block_allocator *alloc,
 
     for (int i = 0; i < ext_count; i++) {
       ext[i].ee_block = htole32(exts[i].file_block);
-      ext[i].ee_len = htole16((uint16_t)exts[i].num_blocks);
+      ext[i].ee_len = htole16(resolved_ee_len(&exts[i]));
       ext[i].ee_start_lo = htole32((uint32_t)(exts[i].phys_block & 0xFFFFFFFF));
       ext[i].ee_start_hi = htole16((uint16_t)(exts[i].phys_block >> 32));
     }
@@ -373,7 +1158,7 @@ int ext4_build_extent_tree(struct ext4_block_allocator *alloc,
     uint32_t num_leaves = ((uint32_t)ext_count + epb - 1) / epb;
 
     /*
-     * Each tree node we've written is tracked as a (block_num,
+     * Each tree node we've built is tracked as a (block_num,
      * first_file_block) pair so the parent level can build index entries
      * pointing to it.
      */
@@ -382,40 +1167,43 @@ int ext4_build_extent_tree(struct ext4_block_allocator *alloc,
       uint32_t first_file_block;
     };
 
+    /* The whole tree is built in memory, leaves first, and written once
+     * its blocks are filled in */
+    uint32_t total = ext4_extent_tree_blocks((uint32_t)ext_count, block_size);
+    uint8_t *tree = calloc(total, block_size);
+    uint64_t *blocks = malloc(total * sizeof(uint64_t));
     struct tree_node *current_level =
         malloc(num_leaves * sizeof(*current_level));
-    if (!current_level) {
+    if (!tree || !blocks || !current_level) {
+      free(tree);
+      free(blocks);
+      free(current_level);
+      free(exts);
+      return -1;
+    }
+    if (tree_take_blocks(alloc, layout, total, blocks) < 0) {
+      fprintf(stderr, "btrfs2ext4: no space for extent tree blocks\n");
+      free(tree);
+      free(blocks);
+      free(current_level);
       free(exts);
       return -1;
     }
     uint32_t current_count = num_leaves;
-    uint16_t depth = 0; /* depth written so far */
-
-    /* --- Step 1: write depth-0 leaf blocks --- */
-    for (uint32_t leaf = 0; leaf < num_leaves; leaf++) {
-      uint64_t blk = ext4_alloc_block(alloc, layout);
-      if (blk == (uint64_t)-1) {
-        fprintf(stderr, "btrfs2ext4: no space for extent tree leaf\n");
-        free(current_level);
-        free(exts);
-        return -1;
-      }
+    uint16_t depth = 0; /* depth built so far */
+    uint32_t node = 0;  /* next block of `tree` */
 
+    /* --- Step 1: build depth-0 leaf blocks --- */
+    for (uint32_t leaf = 0; leaf < num_leaves; leaf++, node++) {
       uint32_t start_idx = leaf * epb;
       uint32_t leaf_count = (uint32_t)ext_count - start_idx;
       if (leaf_count > epb)
         leaf_count = epb;
 
-      current_level[leaf].block_num = blk;
+      current_level[leaf].block_num = blocks[node];
       current_level[leaf].first_file_block = exts[start_idx].file_block;
 
-      uint8_t *leaf_buf = calloc(1, block_size);
-      if (!leaf_buf) {
-        free(current_level);
-        free(exts);
-        return -1;
-      }
-
+      uint8_t *leaf_buf = tree + (size_t)node * block_size;
       struct ext4_extent_header *leh = (struct ext4_extent_header *)leaf_buf;
       leh->eh_magic = htole16(EXT4_EXT_MAGIC);
       leh->eh_entries = htole16((uint16_t)leaf_count);
@@ -428,21 +1216,13 @@ int ext4_build_extent_tree(struct ext4_block_allocator *alloc,
       for (uint32_t i = 0; i < leaf_count; i++) {
         uint32_t idx = start_idx + i;
         le[i].ee_block = htole32(exts[idx].file_block);
-        le[i].ee_len = htole16((uint16_t)exts[idx].num_blocks);
+        le[i].ee_len = htole16(resolved_ee_len(&exts[idx]));
         le[i].ee_start_lo =
             htole32((uint32_t)(exts[idx].phys_block & 0xFFFFFFFF));
         le[i].ee_start_hi = htole16((uint16_t)(exts[idx].phys_block >> 32));
       }
-
-      if (device_write(dev, blk * block_size, leaf_buf, block_size) < 0) {
-        free(leaf_buf);
-        free(current_level);
-        free(exts);
-        return -1;
-      }
-      free(leaf_buf);
     }
-    depth = 1; /* leaf level written → tree has at least depth 1 */
+    depth = 1; /* leaf level built → tree has at least depth 1 */
 
     /* --- Step 2: build index levels until we fit in the inode root --- */
     while (current_count > INLINE_EXTENT_MAX) {
@@ -450,37 +1230,23 @@ int ext4_build_extent_tree(struct ext4_block_allocator *alloc,
 
       struct tree_node *next_level = malloc(num_idx * sizeof(*next_level));
       if (!next_level) {
+        free(tree);
+        free(blocks);
         free(current_level);
         free(exts);
         return -1;
       }
 
-      for (uint32_t n = 0; n < num_idx; n++) {
-        uint64_t blk = ext4_alloc_block(alloc, layout);
-        if (blk == (uint64_t)-1) {
-          fprintf(stderr, "btrfs2ext4: no space for extent tree index block\n");
-          free(next_level);
-          free(current_level);
-          free(exts);
-          return -1;
-        }
-
+      for (uint32_t n = 0; n < num_idx; n++, node++) {
         uint32_t start = n * ipb;
         uint32_t count = current_count - start;
         if (count > ipb)
           count = ipb;
 
-        next_level[n].block_num = blk;
+        next_level[n].block_num = blocks[node];
         next_level[n].first_file_block = current_level[start].first_file_block;
 
-        uint8_t *idx_buf = calloc(1, block_size);
-        if (!idx_buf) {
-          free(next_level);
-          free(current_level);
-          free(exts);
-          return -1;
-        }
-
+        uint8_t *idx_buf = tree + (size_t)node * block_size;
         struct ext4_extent_header *ih = (struct ext4_extent_header *)idx_buf;
         ih->eh_magic = htole16(EXT4_EXT_MAGIC);
         ih->eh_entries = htole16((uint16_t)count);
@@ -499,15 +1265,6 @@ int ext4_build_extent_tree(struct ext4_block_allocator *alloc,
               htole16((uint16_t)(current_level[start + i].block_num >> 32));
           eidx[i].ei_unused = 0;
         }
-
-        if (device_write(dev, blk * block_size, idx_buf, block_size) < 0) {
-          free(idx_buf);
-          free(next_level);
-          free(current_level);
-          free(exts);
-          return -1;
-        }
-        free(idx_buf);
       }
 
       free(current_level);
@@ -516,6 +1273,15 @@ int ext4_build_extent_tree(struct ext4_block_allocator *alloc,
       depth++;
     }
 
+    int wret = tree_write_blocks(alloc, dev, blocks, tree, total, block_size);
+    free(tree);
+    free(blocks);
+    if (wret < 0) {
+      free(current_level);
+      free(exts);
+      return -1;
+    }
+
     if (depth > 1) {
       printf("  inode %lu: %d extents → depth-%u extent tree "
              "(%u index levels)\n",
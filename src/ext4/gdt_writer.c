@@ -6,10 +6,52 @@
 #include "ext4/ext4_crc16.h"
 #include "ext4/ext4_planner.h"
 #include "ext4/ext4_structures.h"
+#include "ext4/ext4_writer.h"
 #include <endian.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+extern uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* The kernel's ext4_chksum(): crc32c without the pre- and post-inversion */
+static uint32_t ext4_chksum(uint32_t crc, const void *buf, size_t len) {
+  return ~crc32c(~crc, buf, len);
+}
+
+uint32_t ext4_csum_seed(const struct ext4_super_block *sb) {
+  if (le32toh(sb->s_feature_incompat) & EXT4_FEATURE_INCOMPAT_CSUM_SEED)
+    return le32toh(sb->s_checksum_seed);
+  return ext4_chksum(~0U, sb->s_uuid, sizeof(sb->s_uuid));
+}
+
+uint16_t ext4_group_desc_csum(const struct ext4_super_block *sb,
+                              uint32_t group, const void *desc,
+                              uint32_t desc_size) {
+  const uint8_t *d = desc;
+  size_t off = offsetof(struct ext4_group_desc, bg_checksum);
+  size_t rest = desc_size > off + 2 ? desc_size - off - 2 : 0;
+  uint32_t le_group = htole32(group);
+
+  if (le32toh(sb->s_feature_ro_compat) &
+      EXT4_FEATURE_RO_COMPAT_METADATA_CSUM) {
+    uint16_t zero = 0;
+    uint32_t crc = ext4_chksum(ext4_csum_seed(sb), &le_group,
+                               sizeof(le_group));
+    crc = ext4_chksum(crc, d, off);
+    crc = ext4_chksum(crc, &zero, sizeof(zero));
+    crc = ext4_chksum(crc, d + off + 2, rest);
+    return (uint16_t)(crc & 0xFFFF);
+  }
+  if (!(le32toh(sb->s_feature_ro_compat) & EXT4_FEATURE_RO_COMPAT_GDT_CSUM))
+    return 0;
+
+  uint16_t crc = ext4_crc16(~0, sb->s_uuid, sizeof(sb->s_uuid));
+  crc = ext4_crc16(crc, &le_group, sizeof(le_group));
+  crc = ext4_crc16(crc, d, off);
+  return ext4_crc16(crc, d + off + 2, rest);
+}
+
 int ext4_write_gdt(struct device *dev, const struct ext4_layout *layout) {
   uint32_t block_size = layout->block_size;
   uint32_t gdt_size = layout->num_groups * layout->desc_size;
@@ -57,19 +99,15 @@ int ext4_write_gdt(struct device *dev, const struct ext4_layout *layout) {
     desc->bg_free_inodes_count_hi = htole16(0);
     desc->bg_used_dirs_count_lo = htole16(0);
 
-    /* Lazy inode init: Mark inode tables as zeroed.
-     * Since we calloc the inode table buffers, they are already zero-filled.
-     * EXT4_BG_INODE_ZEROED tells the kernel's ext4lazyinit thread to skip
-     * re-zeroing, which speeds up the first mount dramatically. */
-    desc->bg_flags = htole16(EXT4_BG_INODE_ZEROED);
+    /* No flags and no unused inodes yet: the inode tables are not written.
+     * ext4_update_free_counts() sets INODE_UNINIT/BLOCK_UNINIT/INODE_ZEROED
+     * and bg_itable_unused in the primary GDT once they are; the backups
+     * keep this conservative state. */
+    desc->bg_flags = 0;
 
     /* Bug B-6 fix: calculate initial checksums for the empty descriptors */
-    desc->bg_checksum = 0;
-    uint16_t crc = ext4_crc16(~0, sb.s_uuid, sizeof(sb.s_uuid));
-    uint32_t le_group = htole32(g);
-    crc = ext4_crc16(crc, &le_group, sizeof(le_group));
-    crc = ext4_crc16(crc, desc, layout->desc_size);
-    desc->bg_checksum = htole16(crc);
+    desc->bg_checksum =
+        htole16(ext4_group_desc_csum(&sb, g, desc, layout->desc_size));
   }
 
   printf("Writing GDT (%u groups, %u blocks)...\n", layout->num_groups,
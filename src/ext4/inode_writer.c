@@ -10,6 +10,7 @@
 
 #include <endian.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,38 +26,494 @@
 #include "ext4/ext4_planner.h"
 #include "ext4/ext4_structures.h"
 #include "ext4/ext4_writer.h"
+#include "mem_tracker.h"
+#include "progress.h"
 #include "relocator.h"
 #include "thread_pool.h"
 
 /* Global decomp pool */
 static struct thread_pool *g_decomp_pool = NULL;
 
+/*
+ * Cross-file decompression pipeline.
+ *
+ * The inode table is written in inode order, but waiting for each file's
+ * extents before moving to the next leaves the pool idle on volumes made of
+ * many small compressed files. Instead the writer runs three stages:
+ *
+ *   scan    — walks ahead of the writer in inode order, allocates the
+ *             destination blocks of every compressed extent it meets and
+ *             submits it to the pool (one batch per file)
+ *   window  — the scan stops once DECOMP_PIPELINE_WINDOW bytes of output,
+ *             or DECOMP_PIPELINE_MAX_FILES files, are in flight
+ *   commit  — when the writer reaches a file, it waits for that file's
+ *             batch only, then rewrites its extents
+ *
+ * Blocks are allocated by the scan on the writer's thread, in inode order,
+ * so the layout does not depend on worker timing.
+ */
+#define DECOMP_PIPELINE_WINDOW (256ULL * 1024 * 1024)
+#define DECOMP_PIPELINE_MAX_FILES 4096
+
+struct decomp_pipeline;
+
+struct decomp_run {
+  uint64_t phys_block;
+  uint32_t count;
+};
+
 struct decomp_job {
   struct device *dev;
   struct chunk_map *chunk_map;
   struct file_extent *ext;
   uint32_t block_size;
+  struct decomp_pipeline *pipe;
+
+  /* Destination blocks, allocated before dispatch */
+  struct decomp_run *runs;
+  uint32_t num_runs;
+
+  /* Sink cursor: position inside runs[] of the next output block */
+  uint32_t cur_run;
+  uint32_t cur_block;
 
-  uint8_t *decomp_buf;
   uint64_t decomp_len;
   int status;
+  int done; /* guarded by pipe->lock */
 };
 
+/* All compressed extents of one file, indexed like fe->extents at scan */
+struct decomp_batch {
+  uint32_t ino;
+  struct file_entry *fe;
+  struct decomp_job *jobs;
+  uint32_t orig_count;
+  uint64_t bytes; /* destination bytes, counted against the window */
+};
+
+struct decomp_pipeline {
+  struct device *dev;
+  const struct ext4_layout *layout;
+  const struct btrfs_fs_info *fs_info;
+  struct ext4_block_allocator *alloc;
+  const uint64_t *btrfs_for_ext4;
+  uint64_t max_ino;
+
+  struct thread_pool_wait_group *wg;
+
+  /* FIFO of scanned files, in inode order */
+  struct decomp_batch *ring;
+  uint32_t head;
+  uint32_t count;
+  uint32_t capacity;
+
+  uint32_t scan_ino; /* next inode the scan stage looks at */
+  uint64_t inflight_bytes;
+  uint64_t peak_bytes;
+  uint64_t files;
+  uint64_t extents;
+
+  pthread_mutex_t lock;
+  pthread_cond_t job_done;
+};
+
+static void decomp_job_finish(struct decomp_job *job) {
+  struct decomp_pipeline *pipe = job->pipe;
+  pthread_mutex_lock(&pipe->lock);
+  job->done = 1;
+  pthread_cond_broadcast(&pipe->job_done);
+  pthread_mutex_unlock(&pipe->lock);
+}
+
+/* Write one window of output straight to its blocks. Workers use pwrite()
+ * (device_write_bulk, O_DIRECT when enabled) rather than the batch ring,
+ * which is shared. */
+static int decomp_sink(const uint8_t *data, size_t len, uint64_t offset,
+                       void *arg) {
+  struct decomp_job *job = arg;
+  uint32_t blocks = (uint32_t)(len / job->block_size);
+  (void)offset; /* chunks arrive in order; the cursor tracks the position */
+
+  while (blocks > 0) {
+    if (job->cur_run >= job->num_runs)
+      return -1;
+    struct decomp_run *r = &job->runs[job->cur_run];
+    uint32_t n = r->count - job->cur_block;
+    if (n > blocks)
+      n = blocks;
+    size_t bytes = (size_t)n * job->block_size;
+    if (device_write_bulk(job->dev,
+                          (r->phys_block + job->cur_block) * job->block_size,
+                          data, bytes) < 0)
+      return -1;
+    data += bytes;
+    blocks -= n;
+    job->cur_block += n;
+    if (job->cur_block == r->count) {
+      job->cur_run++;
+      job->cur_block = 0;
+    }
+  }
+  return 0;
+}
+
 static void decomp_worker(void *arg) {
   struct decomp_job *job = arg;
-  uint8_t *thread_buf = NULL;
-  job->status =
-      btrfs_decompress_extent(job->dev, job->chunk_map, job->ext,
-                              job->block_size, &thread_buf, &job->decomp_len);
-  if (job->status == 0 && thread_buf && job->decomp_len > 0) {
-    job->decomp_buf = malloc(job->decomp_len);
-    if (job->decomp_buf) {
-      memcpy(job->decomp_buf, thread_buf, job->decomp_len);
-    } else {
+
+  /* One aligned output window per worker thread, kept for the whole run */
+  static __thread uint8_t *window = NULL;
+  static __thread size_t window_size = 0;
+
+  size_t want = BTRFS_DECOMP_WINDOW - BTRFS_DECOMP_WINDOW % job->block_size;
+  if (want == 0)
+    want = job->block_size;
+  if (window_size != want) {
+    device_buf_free(window, window_size);
+    window = device_buf_alloc(want);
+    window_size = 0;
+    if (!window) {
       job->status = -1;
+      decomp_job_finish(job);
+      return;
     }
+    window_size = want;
   }
+
+  job->status = btrfs_decompress_extent_stream(
+      job->dev, job->chunk_map, job->ext, job->block_size, window, window_size,
+      decomp_sink, job, &job->decomp_len);
+  decomp_job_finish(job);
 }
+static inline int extent_needs_decompress(const struct file_extent *ext) {
+  return ext->compression != BTRFS_COMPRESS_NONE &&
+         ext->type != BTRFS_FILE_EXTENT_INLINE && ext->disk_bytenr != 0;
+}
+
+/* Same ext4 → btrfs resolution as the writer loop (root and unused inodes) */
+static struct file_entry *pipeline_lookup(const struct decomp_pipeline *pipe,
+                                          uint32_t ino) {
+  uint64_t btrfs_ino = (ino < pipe->max_ino) ? pipe->btrfs_for_ext4[ino] : 0;
+  if (btrfs_ino == 0) {
+    if (ino != EXT4_ROOT_INO)
+      return NULL;
+    btrfs_ino = BTRFS_FIRST_FREE_OBJECTID;
+  }
+  return btrfs_find_inode((struct btrfs_fs_info *)pipe->fs_info, btrfs_ino);
+}
+
+/*
+ * Scan stage for one file: allocate destinations, submit every extent.
+ * The file's decompressed blocks are claimed as one reservation, so its
+ * compressed extents (128 KiB each) land back to back in file order and
+ * the extent tree builder merges them into full-length ext4 extents.
+ */
+static int decomp_batch_prepare(struct decomp_pipeline *pipe,
+                                struct decomp_batch *batch) {
+  struct file_entry *fe = batch->fe;
+  uint32_t block_size = pipe->layout->block_size;
+
+  batch->orig_count = fe->extent_count;
+  batch->bytes = 0;
+  batch->jobs = calloc(fe->extent_count, sizeof(struct decomp_job));
+  uint32_t *needed = calloc(fe->extent_count, sizeof(uint32_t));
+  if (!batch->jobs || !needed) {
+    free(needed);
+    return -1;
+  }
+
+  struct ext4_block_reserve res = {0};
+  for (uint32_t e = 0; e < fe->extent_count; e++) {
+    struct file_extent *ext = &fe->extents[e];
+    if (!extent_needs_decompress(ext))
+      continue;
+    uint64_t decomp_size = btrfs_decompressed_size(ext);
+    needed[e] = (uint32_t)((decomp_size + block_size - 1) / block_size);
+    res.want += needed[e];
+  }
+
+  /* The scan runs ahead of the writer: aim at this file's inode and give
+   * the writer its own goal back afterwards */
+  uint32_t prev_goal =
+      ext4_alloc_set_goal(pipe->alloc, pipe->layout, batch->ino);
+
+  for (uint32_t e = 0; e < fe->extent_count; e++) {
+    struct file_extent *ext = &fe->extents[e];
+    struct decomp_job *job = &batch->jobs[e];
+    job->pipe = pipe;
+    job->status = -1;
+    job->done = 1;
+    uint32_t needed_blocks = needed[e];
+    if (needed_blocks == 0)
+      continue;
+
+    struct decomp_run *runs = calloc(needed_blocks, sizeof(struct decomp_run));
+    if (!runs)
+      continue;
+    uint32_t num_runs = 0;
+    int alloc_failed = 0;
+
+    for (uint32_t b = 0; b < needed_blocks;) {
+      uint32_t got = 0;
+      uint64_t blk = ext4_reserve_take_run(&res, pipe->alloc, pipe->layout,
+                                           needed_blocks - b, &got);
+      if (blk == (uint64_t)-1) {
+        fprintf(stderr,
+                "btrfs2ext4: no space for decompressed block %u "
+                "(inode %lu)\n",
+                b, (unsigned long)fe->ino);
+        alloc_failed = 1;
+        break;
+      }
+
+      if (num_runs > 0 &&
+          runs[num_runs - 1].phys_block + runs[num_runs - 1].count == blk) {
+        runs[num_runs - 1].count += got;
+      } else {
+        runs[num_runs].phys_block = blk;
+        runs[num_runs].count = got;
+        num_runs++;
+      }
+      b += got;
+    }
+    if (alloc_failed || num_runs == 0) {
+      for (uint32_t r = 0; r < num_runs; r++)
+        ext4_release_run(pipe->alloc, pipe->layout, runs[r].phys_block,
+                         runs[r].count);
+      free(runs);
+      continue;
+    }
+
+    job->dev = pipe->dev;
+    job->chunk_map = pipe->fs_info->chunk_map;
+    job->ext = ext;
+    job->block_size = block_size;
+    job->runs = runs;
+    job->num_runs = num_runs;
+    job->done = 0;
+    batch->bytes += (uint64_t)needed_blocks * block_size;
+    pipe->extents++;
+
+    thread_pool_wg_add(pipe->wg, 1);
+    if (thread_pool_submit(g_decomp_pool, decomp_worker, job, pipe->wg) < 0) {
+      /* Fallback if pool is full or fails */
+      thread_pool_wg_done(pipe->wg);
+      decomp_worker(job);
+    }
+  }
+  ext4_reserve_release(&res, pipe->alloc, pipe->layout);
+  ext4_alloc_set_goal(pipe->alloc, pipe->layout, prev_goal);
+  free(needed);
+  return 0;
+}
+
+/*
+ * Run the scan stage ahead of the writer. It always reaches `ino` itself;
+ * past that it stops at the window limits.
+ */
+static int decomp_pipeline_fill(struct decomp_pipeline *pipe, uint32_t ino) {
+  while ((uint64_t)pipe->scan_ino < pipe->max_ino) {
+    if (pipe->scan_ino > ino &&
+        (pipe->inflight_bytes >= DECOMP_PIPELINE_WINDOW ||
+         pipe->count >= DECOMP_PIPELINE_MAX_FILES))
+      break;
+
+    uint32_t scan = pipe->scan_ino++;
+    struct file_entry *fe = pipeline_lookup(pipe, scan);
+    if (!fe || !S_ISREG(fe->mode) || fe->extent_count == 0)
+      continue;
+    /* Packed files hold no compressed extents */
+    int has_compressed = 0;
+    for (uint32_t e = 0; fe->extents && e < fe->extent_count && !has_compressed;
+         e++)
+      has_compressed = extent_needs_decompress(&fe->extents[e]);
+    if (!has_compressed)
+      continue;
+
+    if (pipe->count == pipe->capacity) {
+      uint32_t new_cap = pipe->capacity ? pipe->capacity * 2 : 64;
+      struct decomp_batch *grown =
+          malloc((size_t)new_cap * sizeof(struct decomp_batch));
+      if (!grown)
+        return -1;
+      /* Unwrap the ring while copying */
+      for (uint32_t i = 0; i < pipe->count; i++)
+        grown[i] = pipe->ring[(pipe->head + i) % pipe->capacity];
+      free(pipe->ring);
+      pipe->ring = grown;
+      pipe->head = 0;
+      pipe->capacity = new_cap;
+    }
+
+    struct decomp_batch *batch =
+        &pipe->ring[(pipe->head + pipe->count) % pipe->capacity];
+    memset(batch, 0, sizeof(*batch));
+    batch->ino = scan;
+    batch->fe = fe;
+    if (decomp_batch_prepare(pipe, batch) < 0)
+      return -1;
+    pipe->count++;
+    pipe->files++;
+    pipe->inflight_bytes += batch->bytes;
+    if (pipe->inflight_bytes > pipe->peak_bytes)
+      pipe->peak_bytes = pipe->inflight_bytes;
+  }
+  return 0;
+}
+
+/* Commit stage: point the extents of a finished file at their new blocks */
+static void decomp_batch_apply(struct btrfs_fs_info *fs_info,
+                               struct decomp_batch *b, uint32_t block_size) {
+  struct file_entry *fe = b->fe;
+
+  /* Pass 2: Point the extents at the decompressed copies. Splitting
+   * inserts extents, so `shift` maps job indices to positions. */
+  uint32_t shift = 0;
+  for (uint32_t j = 0; j < b->orig_count; j++) {
+    uint32_t e = j + shift;
+    struct file_extent *ext = &fe->extents[e];
+    if (!extent_needs_decompress(ext))
+      continue;
+
+    struct decomp_run *runs = b->jobs[j].runs;
+    uint32_t num_runs = b->jobs[j].num_runs;
+    uint64_t decomp_len = b->jobs[j].decomp_len;
+
+    if (b->jobs[j].status < 0) {
+      fprintf(stderr, "btrfs2ext4: failed to decompress extent for inode %lu\n",
+              (unsigned long)fe->ino);
+      continue;
+    }
+
+    if (num_runs == 1) {
+      /* Update extent to point to decompressed data (contiguous) */
+      ext->disk_bytenr =
+          runs[0].phys_block * block_size | CHUNK_MAP_PHYSICAL;
+      ext->disk_num_bytes = (uint64_t)runs[0].count * block_size;
+      ext->num_bytes = decomp_len;
+      ext->ram_bytes = decomp_len;
+      ext->compression = BTRFS_COMPRESS_NONE;
+    } else {
+      /* Dynamic extent splitting for fragmented blocks */
+      if (fe->extent_count + num_runs - 1 > fe->extent_capacity) {
+        if (btrfs_reserve_extents(fs_info, fe,
+                                  fe->extent_count + num_runs - 1) < 0)
+          continue; /* OOM */
+        ext = &fe->extents[e]; /* update pointer */
+      }
+
+      /* Shift subsequent extents */
+      if (e + 1 < fe->extent_count) {
+        memmove(&fe->extents[e + num_runs], &fe->extents[e + 1],
+                (fe->extent_count - e - 1) * sizeof(struct file_extent));
+      }
+
+      /* Fill the newly split extents */
+      uint64_t current_file_offset = ext->file_offset;
+      uint64_t remaining_decomp_len = decomp_len;
+
+      /* Save base properties before we overwrite */
+      uint8_t base_type = ext->type;
+
+      for (uint32_t r = 0; r < num_runs; r++) {
+        struct file_extent *r_ext = &fe->extents[e + r];
+        memset(r_ext, 0, sizeof(struct file_extent));
+        r_ext->type = base_type;
+        r_ext->compression = BTRFS_COMPRESS_NONE;
+        r_ext->disk_bytenr =
+            runs[r].phys_block * block_size | CHUNK_MAP_PHYSICAL;
+        r_ext->disk_num_bytes = (uint64_t)runs[r].count * block_size;
+
+        uint64_t run_bytes = (uint64_t)runs[r].count * block_size;
+        if (r == num_runs - 1) {
+          r_ext->num_bytes = remaining_decomp_len;
+          r_ext->ram_bytes = remaining_decomp_len;
+        } else {
+          r_ext->num_bytes = run_bytes;
+          r_ext->ram_bytes = run_bytes;
+          remaining_decomp_len -= run_bytes;
+        }
+        r_ext->file_offset = current_file_offset;
+        current_file_offset += r_ext->num_bytes;
+      }
+
+      fe->extent_count += (num_runs - 1);
+      shift += num_runs - 1;
+    }
+  }
+}
+
+static void decomp_batch_release(struct decomp_batch *b) {
+  for (uint32_t j = 0; j < b->orig_count; j++)
+    free(b->jobs[j].runs);
+  free(b->jobs);
+  b->jobs = NULL;
+}
+
+static void decomp_batch_wait(struct decomp_pipeline *pipe,
+                              struct decomp_batch *b) {
+  pthread_mutex_lock(&pipe->lock);
+  for (uint32_t j = 0; j < b->orig_count; j++)
+    while (!b->jobs[j].done)
+      pthread_cond_wait(&pipe->job_done, &pipe->lock);
+  pthread_mutex_unlock(&pipe->lock);
+}
+
+/* Called by the writer for every inode, in order */
+static int decomp_pipeline_commit(struct decomp_pipeline *pipe, uint32_t ino) {
+  if (decomp_pipeline_fill(pipe, ino) < 0)
+    return -1;
+
+  /* Batches of inodes the writer skipped are retired on the way */
+  while (pipe->count > 0 && pipe->ring[pipe->head].ino <= ino) {
+    struct decomp_batch *b = &pipe->ring[pipe->head];
+    decomp_batch_wait(pipe, b);
+    decomp_batch_apply((struct btrfs_fs_info *)pipe->fs_info, b,
+                       pipe->layout->block_size);
+    pipe->inflight_bytes -= b->bytes;
+    decomp_batch_release(b);
+    pipe->head = (pipe->head + 1) % pipe->capacity;
+    pipe->count--;
+  }
+  return 0;
+}
+
+static int decomp_pipeline_init(struct decomp_pipeline *pipe,
+                                struct device *dev,
+                                const struct ext4_layout *layout,
+                                const struct btrfs_fs_info *fs_info,
+                                struct ext4_block_allocator *alloc,
+                                const uint64_t *btrfs_for_ext4,
+                                uint64_t max_ino) {
+  memset(pipe, 0, sizeof(*pipe));
+  pipe->dev = dev;
+  pipe->layout = layout;
+  pipe->fs_info = fs_info;
+  pipe->alloc = alloc;
+  pipe->btrfs_for_ext4 = btrfs_for_ext4;
+  pipe->max_ino = max_ino;
+  pipe->scan_ino = 1;
+  pipe->wg = thread_pool_wg_create();
+  if (!pipe->wg)
+    return -1;
+  pthread_mutex_init(&pipe->lock, NULL);
+  pthread_cond_init(&pipe->job_done, NULL);
+  return 0;
+}
+
+/* Wait for every submitted job (workers write to the device) and free */
+static void decomp_pipeline_destroy(struct decomp_pipeline *pipe) {
+  if (!pipe->wg)
+    return;
+  thread_pool_wg_wait(pipe->wg);
+  thread_pool_wg_destroy(pipe->wg);
+  for (uint32_t i = 0; i < pipe->count; i++)
+    decomp_batch_release(&pipe->ring[(pipe->head + i) % pipe->capacity]);
+  free(pipe->ring);
+  pthread_mutex_destroy(&pipe->lock);
+  pthread_cond_destroy(&pipe->job_done);
+  memset(pipe, 0, sizeof(*pipe));
+}
+
 /* ========================================================================
  * Inode number mapping
  * ======================================================================== */
@@ -92,6 +549,8 @@ int inode_map_add(struct inode_map *map, uint64_t btrfs_ino,
           return -1;
 
         memcpy(p, map->entries, map->count * sizeof(struct inode_map_entry));
+        mem_track_free_tag(MEM_TAG_INODE_MAP,
+                           map->capacity * sizeof(struct inode_map_entry));
         free(map->entries);
         map->entries = p;
         map->mapped_entries_size = new_size;
@@ -114,6 +573,9 @@ int inode_map_add(struct inode_map *map, uint64_t btrfs_ino,
         fprintf(stderr, "btrfs2ext4: OOM reallocating inode map\n");
         return -1;
       }
+      mem_track_alloc_tag(MEM_TAG_INODE_MAP,
+                          (size_t)(new_cap - map->capacity) *
+                              sizeof(struct inode_map_entry));
       map->entries = new_entries;
     }
     map->capacity = new_cap;
@@ -128,84 +590,186 @@ int inode_map_add(struct inode_map *map, uint64_t btrfs_ino,
 }
 
 /*
- * Build the hash table from the existing linear entries.
- * Call once after all inode_map_add() calls are done, before lookups begin.
+ * Lookup index. Btrfs objectids are usually close to dense from 256 up, so
+ * when the id span is at most INODE_MAP_DENSE_SPAN times the entry count
+ * the index is a flat uint32_t array indexed by btrfs_ino - base: one
+ * access per lookup and 4 bytes per id. Sparser maps get a Robin Hood
+ * table with keys and values in separate arrays (12 bytes per slot, at
+ * most INODE_MAP_RH_LOAD full), which keeps probe sequences short and
+ * lets a miss stop as soon as it passes where the key would have been.
+ * Either one moves to an mmap()ed workdir file past the memory threshold.
  */
-static void inode_map_build_hash(struct inode_map *map) {
-  /* 2× overprovisioned for low collision rate */
-  map->ht_size = map->count < 64 ? 128 : map->count * 2;
-  size_t hash_size = map->ht_size * sizeof(struct inode_map_entry);
+#define INODE_MAP_DENSE_SPAN 4
+#define INODE_MAP_RH_LOAD 80 /* percent */
+
+/* Fibonacci hashing: the top bits of the product spread runs of ids */
+static inline uint32_t inode_map_home(const struct inode_map *map,
+                                      uint64_t btrfs_ino) {
+  return (uint32_t)((btrfs_ino * 0x9e3779b97f4a7c15ULL) >> map->rh_shift);
+}
 
+/* Where a lookup of btrfs_ino starts, or NULL if it needs no access */
+static inline const void *inode_map_slot(const struct inode_map *map,
+                                         uint64_t btrfs_ino) {
+  if (map->index == INODE_MAP_DIRECT) {
+    uint64_t off = btrfs_ino - map->direct_base;
+    return off < map->direct_len ? &map->direct[off] : NULL;
+  }
+  if (map->index == INODE_MAP_ROBIN_HOOD)
+    return &map->rh_keys[inode_map_home(map, btrfs_ino)];
+  return NULL;
+}
+
+/* Zeroed index memory: RAM, or a workdir file past the threshold */
+static void *inode_map_index_alloc(struct inode_map *map, size_t size) {
   uint64_t threshold =
       map->mem_cfg ? map->mem_cfg->mmap_threshold : (16ULL * 1024 * 1024);
 
-  if (hash_size >= threshold) {
+  if (size >= threshold) {
     char tmp_path[1024];
     snprintf(tmp_path, sizeof(tmp_path), "%s/.btrfs2ext4.tmp.ht",
              map->mem_cfg ? map->mem_cfg->workdir : ".");
 
     unlink(tmp_path);
     map->fd_ht = open(tmp_path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
-    if (map->fd_ht >= 0 && ftruncate(map->fd_ht, (off_t)hash_size) == 0) {
-      map->ht_buckets = mmap(NULL, hash_size, PROT_READ | PROT_WRITE,
-                             MAP_SHARED, map->fd_ht, 0);
-      if (map->ht_buckets == MAP_FAILED)
-        map->ht_buckets = NULL;
+    void *mem = MAP_FAILED;
+    if (map->fd_ht >= 0 && ftruncate(map->fd_ht, (off_t)size) == 0)
+      mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd_ht,
+                 0);
+    if (mem != MAP_FAILED) {
+      map->index_mem = mem;
+      map->index_size = size;
+      return mem;
     }
-    if (!map->ht_buckets && map->fd_ht >= 0) {
+    if (map->fd_ht >= 0) {
       close(map->fd_ht);
-      map->fd_ht = 0;
-    } else if (map->ht_buckets) {
-      map->mapped_ht_size = hash_size;
+      unlink(tmp_path);
+    }
+    map->fd_ht = 0;
+  }
+
+  void *mem = calloc(1, size);
+  if (mem) {
+    mem_track_alloc_tag(MEM_TAG_INODE_MAP, size);
+    map->index_mem = mem;
+    map->index_size = size;
+  }
+  return mem;
+}
+
+static void inode_map_rh_insert(struct inode_map *map, uint64_t key,
+                                uint32_t val) {
+  uint32_t i = inode_map_home(map, key);
+  uint32_t dist = 0;
+  for (;;) {
+    uint64_t cur = map->rh_keys[i];
+    if (cur == 0) {
+      map->rh_keys[i] = key;
+      map->rh_vals[i] = val;
+      return;
+    }
+    if (cur == key)
+      return; /* first mapping wins, as with a linear scan */
+    /* Take the slot from an entry closer to its home */
+    uint32_t cur_dist = (i - inode_map_home(map, cur)) & map->rh_mask;
+    if (cur_dist < dist) {
+      uint32_t cur_val = map->rh_vals[i];
+      map->rh_keys[i] = key;
+      map->rh_vals[i] = val;
+      key = cur;
+      val = cur_val;
+      dist = cur_dist;
     }
+    i = (i + 1) & map->rh_mask;
+    dist++;
   }
+}
 
-  if (!map->ht_buckets) {
-    map->ht_buckets = calloc(map->ht_size, sizeof(struct inode_map_entry));
+/*
+ * Build the lookup index from the existing linear entries.
+ * Call once after all inode_map_add() calls are done, before lookups begin.
+ */
+void inode_map_build_hash(struct inode_map *map) {
+  if (map->count == 0)
+    return;
+
+  uint64_t lo = UINT64_MAX, hi = 0;
+  for (uint32_t i = 0; i < map->count; i++) {
+    uint64_t key = map->entries[i].btrfs_ino;
+    lo = key < lo ? key : lo;
+    hi = key > hi ? key : hi;
+  }
+  uint64_t span = hi - lo + 1;
+
+  if (span <= (uint64_t)map->count * INODE_MAP_DENSE_SPAN) {
+    map->direct = inode_map_index_alloc(map, span * sizeof(uint32_t));
+    if (map->direct) {
+      map->index = INODE_MAP_DIRECT;
+      map->direct_base = lo;
+      map->direct_len = span;
+      for (uint32_t i = 0; i < map->count; i++) {
+        uint32_t *slot = &map->direct[map->entries[i].btrfs_ino - lo];
+        if (*slot == 0)
+          *slot = map->entries[i].ext4_ino;
+      }
+      return;
+    }
   }
 
-  if (!map->ht_buckets)
+  uint64_t slots = 64;
+  uint32_t shift = 64 - 6;
+  while (slots * INODE_MAP_RH_LOAD / 100 < map->count) {
+    slots *= 2;
+    shift--;
+  }
+  size_t key_bytes = slots * sizeof(uint64_t);
+  uint8_t *mem =
+      inode_map_index_alloc(map, key_bytes + slots * sizeof(uint32_t));
+  if (!mem)
     return; /* fallback to linear scan */
+  map->index = INODE_MAP_ROBIN_HOOD;
+  map->rh_keys = (uint64_t *)mem;
+  map->rh_vals = (uint32_t *)(mem + key_bytes);
+  map->rh_mask = (uint32_t)(slots - 1);
+  map->rh_shift = shift;
 
   /* Initialize bloom filter if doing mmap hash table to pre-filter disk access
    */
   if (map->fd_ht > 0) {
     map->bloom = calloc(1, sizeof(struct bloom_filter));
-    if (map->bloom) {
-      bloom_init(map->bloom, map->count);
+    if (map->bloom && bloom_init(map->bloom, map->count) < 0) {
+      free(map->bloom);
+      map->bloom = NULL;
     }
   }
 
   for (uint32_t i = 0; i < map->count; i++) {
     uint64_t key = map->entries[i].btrfs_ino;
-    if (map->bloom) {
+    if (map->bloom)
       bloom_add(map->bloom, key);
-    }
-    uint32_t idx = (uint32_t)(key * 2654435761ULL) % map->ht_size;
-    while (map->ht_buckets[idx].ext4_ino != 0) {
-      idx = (idx + 1) % map->ht_size;
-    }
-    map->ht_buckets[idx] = map->entries[i];
+    inode_map_rh_insert(map, key, map->entries[i].ext4_ino);
   }
 }
 
-uint32_t inode_map_lookup(const struct inode_map *map, uint64_t btrfs_ino) {
-  /* Pre-filter via Bloom if available (saves HDD page-ins) */
-  if (map->bloom && !bloom_test(map->bloom, btrfs_ino))
-    return 0;
-
-  /* Use hash table if available (O(1) average) */
-  if (map->ht_buckets) {
-    uint32_t idx = (uint32_t)(btrfs_ino * 2654435761ULL) % map->ht_size;
-    uint32_t start = idx;
-    do {
-      if (map->ht_buckets[idx].ext4_ino == 0)
-        return 0; /* Empty slot = not found */
-      if (map->ht_buckets[idx].btrfs_ino == btrfs_ino)
-        return map->ht_buckets[idx].ext4_ino;
-      idx = (idx + 1) % map->ht_size;
-    } while (idx != start);
-    return 0;
+/* Index (or linear) lookup, past the Bloom filter */
+static uint32_t inode_map_probe(const struct inode_map *map,
+                                uint64_t btrfs_ino) {
+  if (map->index == INODE_MAP_DIRECT) {
+    uint64_t off = btrfs_ino - map->direct_base;
+    return off < map->direct_len ? map->direct[off] : 0;
+  }
+  if (map->index == INODE_MAP_ROBIN_HOOD) {
+    uint32_t i = inode_map_home(map, btrfs_ino);
+    for (uint32_t dist = 0;; dist++) {
+      uint64_t cur = map->rh_keys[i];
+      if (cur == btrfs_ino)
+        return map->rh_vals[i];
+      /* An empty slot, or one whose entry is closer to home than we
+       * are, means the key would have been placed before it */
+      if (cur == 0 || ((i - inode_map_home(map, cur)) & map->rh_mask) < dist)
+        return 0;
+      i = (i + 1) & map->rh_mask;
+    }
   }
   /* Fallback: linear scan O(N) */
   for (uint32_t i = 0; i < map->count; i++) {
@@ -215,6 +779,37 @@ uint32_t inode_map_lookup(const struct inode_map *map, uint64_t btrfs_ino) {
   return 0; /* Not found */
 }
 
+uint32_t inode_map_lookup(const struct inode_map *map, uint64_t btrfs_ino) {
+  /* Pre-filter via Bloom if available (saves HDD page-ins) */
+  if (map->bloom && !bloom_test(map->bloom, btrfs_ino))
+    return 0;
+  return inode_map_probe(map, btrfs_ino);
+}
+
+void inode_map_lookup_batch(const struct inode_map *map,
+                            const uint64_t *btrfs_inos, uint32_t n,
+                            uint32_t *ext4_inos) {
+  uint8_t maybe[INODE_MAP_BATCH];
+  for (uint32_t base = 0; base < n; base += INODE_MAP_BATCH) {
+    uint32_t cnt = n - base < INODE_MAP_BATCH ? n - base : INODE_MAP_BATCH;
+    if (map->bloom)
+      bloom_test_batch(map->bloom, btrfs_inos + base, cnt, maybe);
+    else
+      memset(maybe, 1, cnt);
+
+    /* Touch every surviving slot before probing the first one */
+    for (uint32_t i = 0; i < cnt; i++) {
+      const void *slot = maybe[i] ? inode_map_slot(map, btrfs_inos[base + i])
+                                  : NULL;
+      if (slot)
+        __builtin_prefetch(slot);
+    }
+    for (uint32_t i = 0; i < cnt; i++)
+      ext4_inos[base + i] =
+          maybe[i] ? inode_map_probe(map, btrfs_inos[base + i]) : 0;
+  }
+}
+
 void inode_map_free(struct inode_map *map) {
   if (map->bloom) {
     bloom_free(map->bloom);
@@ -222,16 +817,18 @@ void inode_map_free(struct inode_map *map) {
     map->bloom = NULL;
   }
 
-  if (map->fd_ht > 0 && map->ht_buckets) {
+  if (map->fd_ht > 0 && map->index_mem) {
     char tmp_path[1024];
     snprintf(tmp_path, sizeof(tmp_path), "%s/.btrfs2ext4.tmp.ht",
              map->mem_cfg ? map->mem_cfg->workdir : ".");
 
-    munmap(map->ht_buckets, map->mapped_ht_size);
+    munmap(map->index_mem, map->index_size);
     close(map->fd_ht);
     unlink(tmp_path);
   } else {
-    free(map->ht_buckets);
+    if (map->index_mem)
+      mem_track_free_tag(MEM_TAG_INODE_MAP, map->index_size);
+    free(map->index_mem);
   }
 
   if (map->fd_entries > 0 && map->entries) {
@@ -243,12 +840,457 @@ void inode_map_free(struct inode_map *map) {
     close(map->fd_entries);
     unlink(tmp_path);
   } else {
+    if (map->entries)
+      mem_track_free_tag(MEM_TAG_INODE_MAP,
+                         map->capacity * sizeof(struct inode_map_entry));
     free(map->entries);
   }
 
   memset(map, 0, sizeof(*map));
 }
 
+/* ========================================================================
+ * Per-group inode table construction
+ *
+ * Serializing an inode only reads its file_entry, so the tables of a
+ * window of groups are filled on the pool while the writer finishes the
+ * previous window. What needs the allocator (decompressed extents, extent
+ * tree blocks, long symlink targets) stays on the writer's thread and runs
+ * in inode order, so the resulting layout does not depend on worker timing.
+ * ======================================================================== */
+
+/* Groups per window; two windows of table buffers are in flight */
+#define ITABLE_WINDOW_GROUPS 8
+
+static int g_lazy_itable = 1;
+
+void ext4_itable_set_lazy_policy(int enabled) { g_lazy_itable = enabled; }
+
+int ext4_itable_lazy_policy(void) { return g_lazy_itable; }
+
+struct itable_slot {
+  const struct decomp_pipeline *pipe;
+  uint32_t group;
+  uint8_t *buf;
+  struct thread_pool_wait_group *wg;
+  uint32_t used;  /* inodes up to the last one in use */
+  size_t bytes;   /* table bytes written: `used` rounded up to a block */
+};
+
+/* In the inode bitmap: reserved, or mapped to a btrfs inode */
+static inline int itable_ino_used(const struct decomp_pipeline *pipe,
+                                  uint32_t ino) {
+  return ino < EXT4_GOOD_OLD_FIRST_INO ||
+         (ino < pipe->max_ino && pipe->btrfs_for_ext4[ino] != 0);
+}
+
+/* The journal inode: a single extent over the blocks the journal got */
+static void itable_fill_journal(struct ext4_inode *jnl_inode,
+                                uint32_t block_size) {
+  uint32_t jnl_blocks = ext4_journal_block_count();
+  uint64_t jnl_start = ext4_journal_start_block();
+  if (jnl_blocks == 0 || jnl_start == 0)
+    return;
+
+  jnl_inode->i_mode = htole16(S_IFREG | 0600);
+  uint64_t jnl_size = (uint64_t)jnl_blocks * block_size;
+  jnl_inode->i_size_lo = htole32((uint32_t)(jnl_size & 0xFFFFFFFF));
+  jnl_inode->i_size_high = htole32((uint32_t)(jnl_size >> 32));
+  jnl_inode->i_links_count = htole16(1);
+  uint64_t jnl_sectors = (jnl_size + 511) / 512;
+  jnl_inode->i_blocks_lo = htole32((uint32_t)(jnl_sectors & 0xFFFFFFFF));
+  jnl_inode->i_blocks_high = htole16((uint16_t)(jnl_sectors >> 32));
+  jnl_inode->i_flags |= htole32(EXT4_EXTENTS_FL);
+  jnl_inode->i_extra_isize = htole16(32);
+  jnl_inode->i_generation = htole32(1);
+
+  /* Build extent tree for journal (single extent) */
+  struct ext4_extent_header *jeh =
+      (struct ext4_extent_header *)jnl_inode->i_block;
+  jeh->eh_magic = htole16(EXT4_EXT_MAGIC);
+  jeh->eh_entries = htole16(1);
+  jeh->eh_max = htole16(4);
+  jeh->eh_depth = htole16(0);
+  jeh->eh_generation = htole32(0);
+
+  struct ext4_extent *jext =
+      (struct ext4_extent *)((uint8_t *)jnl_inode->i_block +
+                             sizeof(struct ext4_extent_header));
+  jext->ee_block = htole32(0);
+  jext->ee_len = htole16(jnl_blocks > 32768 ? 32768 : (uint16_t)jnl_blocks);
+  jext->ee_start_lo = htole32((uint32_t)(jnl_start & 0xFFFFFFFF));
+  jext->ee_start_hi = htole16((uint16_t)(jnl_start >> 32));
+}
+
+/* Everything of an inode that comes straight from its file_entry */
+static void itable_fill_inode(struct ext4_inode *ext_inode,
+                              const struct file_entry *fe,
+                              const struct ext4_layout *layout) {
+  /* Translate btrfs inode to ext4 */
+  ext_inode->i_mode = htole16((uint16_t)fe->mode);
+  ext_inode->i_uid = htole16((uint16_t)(fe->uid & 0xFFFF));
+  ext_inode->i_uid_high = htole16((uint16_t)(fe->uid >> 16));
+  ext_inode->i_gid = htole16((uint16_t)(fe->gid & 0xFFFF));
+  ext_inode->i_gid_high = htole16((uint16_t)(fe->gid >> 16));
+  ext_inode->i_links_count = htole16((uint16_t)fe->nlink);
+
+  uint64_t size = fe->size;
+  ext_inode->i_size_lo = htole32((uint32_t)(size & 0xFFFFFFFF));
+  ext_inode->i_size_high = htole32((uint32_t)(size >> 32));
+
+  /* Timestamps */
+  ext_inode->i_atime = htole32((uint32_t)fe->atime_sec);
+  ext_inode->i_ctime = htole32((uint32_t)fe->ctime_sec);
+  ext_inode->i_mtime = htole32((uint32_t)fe->mtime_sec);
+  ext_inode->i_crtime = htole32((uint32_t)fe->crtime_sec);
+
+  /* Nanosecond precision in extra fields */
+  ext_inode->i_atime_extra =
+      htole32(((uint32_t)fe->atime_nsec << 2) |
+              ((uint32_t)((fe->atime_sec >> 32) & 0x3)));
+  ext_inode->i_mtime_extra =
+      htole32(((uint32_t)fe->mtime_nsec << 2) |
+              ((uint32_t)((fe->mtime_sec >> 32) & 0x3)));
+  ext_inode->i_ctime_extra =
+      htole32(((uint32_t)fe->ctime_nsec << 2) |
+              ((uint32_t)((fe->ctime_sec >> 32) & 0x3)));
+  ext_inode->i_crtime_extra =
+      htole32(((uint32_t)fe->crtime_nsec << 2) |
+              ((uint32_t)((fe->crtime_sec >> 32) & 0x3)));
+
+  /* Extra inode size (256-128 = 128, but actual extra = 32 for timestamps)
+   */
+  ext_inode->i_extra_isize = htole16(32);
+
+  /* Blocks count (in 512-byte sectors) */
+  uint64_t blocks_512 = (size + 511) / 512;
+  ext_inode->i_blocks_lo = htole32((uint32_t)(blocks_512 & 0xFFFFFFFF));
+  ext_inode->i_blocks_high = htole16((uint16_t)(blocks_512 >> 32));
+
+  if (S_ISREG(fe->mode) && fe->extent_count > 0) {
+    /* Check if we can store it as Native Inline Data (Phase 5) */
+    if (fe->extent_count == 1 && fe->extents &&
+        fe->extents[0].type == BTRFS_FILE_EXTENT_INLINE &&
+        fe->extents[0].inline_data_len > 0) {
+      size_t inline_len = fe->extents[0].inline_data_len;
+      size_t max_inline_len = 60;
+      if (layout->inode_size > 128) {
+        /* 128 (extra space) - 32 (timestamp extra) - 4 (xattr magic) -
+         * xattr header overhead */
+        max_inline_len += (layout->inode_size - 128 - 32 -
+                           sizeof(struct ext4_xattr_ibody_header) -
+                           sizeof(struct ext4_xattr_entry));
+      }
+
+      if (inline_len <= max_inline_len) {
+        ext_inode->i_flags |= htole32(EXT4_INLINE_DATA_FL);
+        size_t iblock_len = inline_len < 60 ? inline_len : 60;
+        memcpy(ext_inode->i_block, fe->extents[0].inline_data, iblock_len);
+
+        if (inline_len > 60) {
+          /* Store remainder in extra inode space as system.data xattr */
+          uint8_t *extra = (uint8_t *)ext_inode + 128 +
+                           32; /* After basic extra fields */
+          struct ext4_xattr_ibody_header *xhdr =
+              (struct ext4_xattr_ibody_header *)extra;
+          xhdr->h_magic = htole32(EXT4_XATTR_MAGIC);
+
+          struct ext4_xattr_entry *xentry =
+              (struct ext4_xattr_entry
+                   *)(extra + sizeof(struct ext4_xattr_ibody_header));
+          xentry->e_name_len = 4; /* "data" */
+          xentry->e_name_index = EXT4_XATTR_INDEX_SYSTEM;
+          xentry->e_value_size = htole32((uint32_t)(inline_len - 60));
+          xentry->e_value_offs =
+              htole16((uint16_t)(sizeof(struct ext4_xattr_ibody_header) +
+                                 sizeof(struct ext4_xattr_entry) +
+                                 8 /* padded name */));
+          xentry->e_value_block = 0;
+          xentry->e_hash = 0;
+          memcpy(xentry->e_name, "data\0\0\0\0",
+                 8); /* padded to 4-byte boundary */
+
+          uint8_t *xval =
+              (uint8_t *)xentry + sizeof(struct ext4_xattr_entry) + 8;
+          memcpy(xval, fe->extents[0].inline_data + 60, inline_len - 60);
+
+          /* Mark end of xattr entries */
+          uint32_t *xend =
+              (uint32_t *)(xval + ((inline_len - 60 + 3) & ~3));
+          *xend = 0;
+        }
+      }
+    }
+  } else if (S_ISDIR(fe->mode)) {
+    /* Directories will have their data blocks set during dir writing */
+    ext_inode->i_flags |= htole32(EXT4_EXTENTS_FL | fe->ext4_flags);
+    struct ext4_extent_header *eh =
+        (struct ext4_extent_header *)ext_inode->i_block;
+    eh->eh_magic = htole16(EXT4_EXT_MAGIC);
+    eh->eh_entries = htole16(0);
+    eh->eh_max = htole16(4);
+    eh->eh_depth = htole16(0);
+  } else if (S_ISLNK(fe->mode) && fe->symlink_target) {
+    /* Fast symlink: target stored directly in i_block (<60 bytes); longer
+     * targets get a data block in itable_commit_inode() */
+    size_t target_len = strlen(fe->symlink_target);
+    if (target_len < 60)
+      memcpy(ext_inode->i_block, fe->symlink_target, target_len);
+  } else if (S_ISCHR(fe->mode) || S_ISBLK(fe->mode)) {
+    /* Device nodes: store rdev in i_block */
+    uint32_t major = (uint32_t)(fe->rdev >> 8) & 0xFFF;
+    uint32_t minor = (uint32_t)(fe->rdev & 0xFF) |
+                     ((uint32_t)(fe->rdev >> 12) & 0xFFF00);
+    /* Old encoding in i_block[0] */
+    ((uint32_t *)ext_inode->i_block)[0] =
+        htole32((major << 8) | (minor & 0xFF));
+    /* New encoding in i_block[1] */
+    ((uint32_t *)ext_inode->i_block)[1] = htole32((major << 20) | minor);
+  }
+
+  /* Write security xattrs (Phase 6) */
+  if (fe->xattrs && !(ext_inode->i_flags & htole32(EXT4_INLINE_DATA_FL))) {
+    /* Only write if we haven't already used the ibody for inline data */
+    if (layout->inode_size >
+        128 + 32 + sizeof(struct ext4_xattr_ibody_header)) {
+      uint8_t *extra = (uint8_t *)ext_inode + 128 + 32;
+      struct ext4_xattr_ibody_header *xhdr =
+          (struct ext4_xattr_ibody_header *)extra;
+      xhdr->h_magic = htole32(EXT4_XATTR_MAGIC);
+
+      struct ext4_xattr_entry *xentry =
+          (struct ext4_xattr_entry *)(extra +
+                                      sizeof(
+                                          struct ext4_xattr_ibody_header));
+      uint8_t *xval_area = extra + layout->inode_size - 128 -
+                           32; /* Start values from end of inode */
+      int space_left = layout->inode_size - 128 - 32 -
+                       sizeof(struct ext4_xattr_ibody_header) -
+                       4; /* -4 for end null eq */
+
+      struct xattr_entry *xa = fe->xattrs;
+      while (xa) {
+        /* Determine name index (security vs system vs user) */
+        uint8_t name_index = 0; /* EXT4_XATTR_INDEX_USER default */
+        const char *name_rem = xa->name;
+        if (strncmp(xa->name, "security.", 9) == 0) {
+          name_index = EXT4_XATTR_INDEX_SECURITY;
+          name_rem += 9;
+        } else if (strncmp(xa->name, "system.", 7) == 0) {
+          name_index = EXT4_XATTR_INDEX_SYSTEM;
+          name_rem += 7;
+        } else if (strncmp(xa->name, "user.", 5) == 0) {
+          name_index = 1; /* EXT4_XATTR_INDEX_USER */
+          name_rem += 5;
+        }
+
+        size_t rem_len = strlen(name_rem);
+        size_t name_pad = (rem_len + 3) & ~3;
+        size_t val_pad = (xa->value_len + 3) & ~3;
+        size_t entry_size = sizeof(struct ext4_xattr_entry) + name_pad;
+
+        /* Check for integer overflow */
+        if (xa->value_len > 4096 || entry_size + val_pad > 4096) {
+          xa = xa->next;
+          continue;
+        }
+
+        if (space_left >= (int)(entry_size + val_pad)) {
+          xentry->e_name_len = rem_len;
+          xentry->e_name_index = name_index;
+          xentry->e_value_block = 0;
+          xentry->e_value_size = htole32(xa->value_len);
+          xval_area -= val_pad;
+          xentry->e_value_offs = htole16((uint16_t)(xval_area - extra));
+          xentry->e_hash = 0;
+
+          memset(xentry->e_name, 0, name_pad);
+          memcpy(xentry->e_name, name_rem, rem_len);
+
+          if (xa->value_len > 0) {
+            memcpy(xval_area, xa->value, xa->value_len);
+          }
+
+          space_left -= (entry_size + val_pad);
+          xentry =
+              (struct ext4_xattr_entry *)((uint8_t *)xentry + entry_size);
+        }
+        xa = xa->next;
+      }
+      /* Terminate entry list */
+      *(uint32_t *)xentry = 0;
+    }
+  }
+
+  ext_inode->i_generation = htole32(1); /* Generation number */
+}
+
+static void itable_fill_task(void *arg) {
+  struct itable_slot *slot = arg;
+  const struct decomp_pipeline *pipe = slot->pipe;
+  const struct ext4_layout *layout = pipe->layout;
+  uint32_t inode_size = layout->inode_size;
+  uint32_t ino_start = slot->group * layout->inodes_per_group + 1;
+
+  /* Zero the buffer only as far as the inodes in use reach */
+  size_t zeroed = 0;
+  slot->used = 0;
+  for (uint32_t i = 0; i < layout->inodes_per_group; i++) {
+    uint32_t ino = ino_start + i;
+    if (!itable_ino_used(pipe, ino))
+      continue;
+    size_t end = (size_t)(i + 1) * inode_size;
+    memset(slot->buf + zeroed, 0, end - zeroed);
+    zeroed = end;
+    slot->used = i + 1;
+
+    struct ext4_inode *ext_inode =
+        (struct ext4_inode *)(slot->buf + (size_t)i * inode_size);
+    if (ino == EXT4_JOURNAL_INO) {
+      itable_fill_journal(ext_inode, layout->block_size);
+      continue;
+    }
+    const struct file_entry *fe = pipeline_lookup(pipe, ino);
+    if (fe)
+      itable_fill_inode(ext_inode, fe, layout);
+  }
+
+  size_t table_bytes = (size_t)layout->inodes_per_group * inode_size;
+  size_t bs = layout->block_size;
+  slot->bytes = ((size_t)slot->used * inode_size + bs - 1) / bs * bs;
+  if (slot->bytes > table_bytes)
+    slot->bytes = table_bytes;
+  memset(slot->buf + zeroed, 0, slot->bytes - zeroed);
+}
+
+/* Queue the fills of groups [first, first + ITABLE_WINDOW_GROUPS) */
+static void itable_submit_window(struct itable_slot *slots,
+                                 const struct decomp_pipeline *pipe,
+                                 uint32_t first, uint32_t num_groups) {
+  for (uint32_t i = 0; i < ITABLE_WINDOW_GROUPS; i++) {
+    if (first + i >= num_groups)
+      break;
+    struct itable_slot *slot = &slots[i];
+    slot->pipe = pipe;
+    slot->group = first + i;
+    thread_pool_wg_add(slot->wg, 1);
+    if (!g_decomp_pool ||
+        thread_pool_submit(g_decomp_pool, itable_fill_task, slot, slot->wg) <
+            0) {
+      /* Inline fallback if the pool is missing or full */
+      thread_pool_wg_done(slot->wg);
+      itable_fill_task(slot);
+    }
+  }
+}
+
+/* The allocator-dependent part of an inode, after itable_fill_inode() */
+static void itable_commit_inode(struct decomp_pipeline *pipe,
+                                struct ext4_inode *ext_inode,
+                                const struct file_entry *fe, uint32_t ino) {
+  const struct ext4_layout *layout = pipe->layout;
+  struct ext4_block_allocator *alloc = pipe->alloc;
+  struct device *dev = pipe->dev;
+  uint32_t block_size = layout->block_size;
+
+  /* Extent tree, clone and symlink blocks go near the inode */
+  ext4_alloc_set_goal(alloc, layout, ino);
+
+  /* Decompress compressed extents and rewrite to new blocks */
+  if (S_ISREG(fe->mode) && fe->extent_count > 0) {
+    if (decomp_pipeline_commit(pipe, ino) < 0)
+      fprintf(stderr, "btrfs2ext4: OOM in decompression pipeline\n");
+
+    if (!(ext_inode->i_flags & htole32(EXT4_INLINE_DATA_FL))) {
+      /* Build extent tree for regular files (supports multi-level) */
+      ext4_build_extent_tree(alloc, dev, ext_inode, fe, pipe->fs_info,
+                             layout);
+    }
+  } else if (S_ISLNK(fe->mode) && fe->symlink_target) {
+    size_t target_len = strlen(fe->symlink_target);
+    if (target_len < 60)
+      return;
+
+    /* Security check: Linux limits symlinks to PATH_MAX.
+     * Prevent heap buffer overflow if Btrfs inline extent is maliciously
+     * huge. */
+    if (target_len >= block_size) {
+      target_len = block_size - 1;
+    }
+
+    /* Long symlink: allocate a data block and store target there */
+    uint64_t sym_block = ext4_alloc_block(alloc, layout);
+    if (sym_block != (uint64_t)-1) {
+      uint8_t *sym_buf = calloc(1, block_size);
+      if (sym_buf) {
+        memcpy(sym_buf, fe->symlink_target, target_len);
+        device_write(dev, sym_block * block_size, sym_buf, block_size);
+        free(sym_buf);
+
+        /* Build inline extent pointing to the data block */
+        struct ext4_extent_header *eh =
+            (struct ext4_extent_header *)ext_inode->i_block;
+        eh->eh_magic = htole16(EXT4_EXT_MAGIC);
+        eh->eh_entries = htole16(1);
+        eh->eh_max = htole16(4);
+        eh->eh_depth = htole16(0);
+        struct ext4_extent *ext =
+            (struct ext4_extent *)((uint8_t *)ext_inode->i_block +
+                                   sizeof(struct ext4_extent_header));
+        ext->ee_block = htole32(0);
+        ext->ee_len = htole16(1);
+        ext->ee_start_lo = htole32((uint32_t)(sym_block & 0xFFFFFFFF));
+        ext->ee_start_hi = htole16((uint16_t)(sym_block >> 32));
+        ext_inode->i_flags |= htole32(EXT4_EXTENTS_FL);
+      }
+    }
+  }
+}
+
+/* Wait for a group's fill, finish its inodes in order and queue the table */
+static int itable_commit_group(struct decomp_pipeline *pipe,
+                               struct itable_slot *slot) {
+  const struct ext4_layout *layout = pipe->layout;
+  uint32_t inode_size = layout->inode_size;
+  uint32_t ino_start = slot->group * layout->inodes_per_group + 1;
+
+  thread_pool_wg_wait(slot->wg);
+
+  for (uint32_t i = 0; i < slot->used; i++) {
+    uint32_t ino = ino_start + i;
+    if (ino == EXT4_JOURNAL_INO)
+      continue;
+    const struct file_entry *fe = pipeline_lookup(pipe, ino);
+    if (!fe)
+      continue;
+    itable_commit_inode(
+        pipe, (struct ext4_inode *)(slot->buf + (size_t)i * inode_size), fe,
+        ino);
+  }
+
+  uint64_t table_offset =
+      layout->groups[slot->group].inode_table_start * layout->block_size;
+  if (slot->bytes > 0 && device_write_batch_add(pipe->dev, table_offset,
+                                                slot->buf, slot->bytes) < 0)
+    return -1;
+  return 0;
+}
+
+/* Past the prefix a lazy table is left to the kernel; otherwise it is
+ * zeroed, by the kernel or the device where they can. device_zero_range()
+ * runs its own batch, so this comes after the window's is submitted. */
+static int itable_zero_tail(struct decomp_pipeline *pipe,
+                            const struct itable_slot *slot) {
+  const struct ext4_layout *layout = pipe->layout;
+  size_t table_bytes = (size_t)layout->inodes_per_group * layout->inode_size;
+  if (g_lazy_itable || slot->bytes == table_bytes)
+    return 0;
+  uint64_t table_offset =
+      layout->groups[slot->group].inode_table_start * layout->block_size;
+  return device_zero_range(pipe->dev, table_offset + slot->bytes,
+                           table_bytes - slot->bytes);
+}
+
 /* ========================================================================
  * Write inode table for all groups
  * ======================================================================== */
@@ -257,12 +1299,11 @@ int ext4_write_inode_table(struct device *dev, const struct ext4_layout *layout,
                            const struct btrfs_fs_info *fs_info,
                            struct inode_map *inode_map,
                            struct ext4_block_allocator *alloc) {
-  uint32_t block_size = layout->block_size;
   uint32_t inode_size = layout->inode_size;
 
   printf("Writing inode tables...\n");
 
-  g_decomp_pool = thread_pool_create(4, 1024);
+  g_decomp_pool = thread_pool_create(0, 1024);
 
   /* Step 1: Assign ext4 inode numbers to btrfs inodes.
    * Inode 2 = root directory, inodes 1-10 are reserved. */
@@ -284,563 +1325,184 @@ int ext4_write_inode_table(struct device *dev, const struct ext4_layout *layout,
   /* Build hash table for O(1) lookups from here on */
   inode_map_build_hash(inode_map);
 
+  /* Copy blocks several files share before any extent tree points at
+   * them: each shared source is read once for all of its copies */
+  struct ext4_clone_plan clones;
+  if (ext4_clone_plan_build(&clones, layout, fs_info, alloc, inode_map) < 0)
+    return -1;
+  if (clones.count > 0) {
+    printf("  CoW clones: %u runs, %lu blocks from %lu source ranges\n",
+           clones.count, (unsigned long)clones.blocks,
+           (unsigned long)clones.source_ranges);
+    if (ext4_clone_plan_execute(&clones, dev, layout->block_size) < 0) {
+      ext4_clone_plan_free(&clones);
+      return -1;
+    }
+    printf("  CoW clones: %.1f MiB read, %.1f MiB written\n",
+           clones.bytes_read / (1024.0 * 1024.0),
+           clones.bytes_written / (1024.0 * 1024.0));
+  }
+  alloc->clones = &clones;
+
+  /* Extent-tree blocks of each flex group go to one region of it, written
+   * in large batches instead of a block next to every file */
+  struct ext4_tree_regions regions;
+  if (ext4_tree_regions_init(&regions, alloc, dev, layout, fs_info,
+                             inode_map) < 0) {
+    alloc->clones = NULL;
+    ext4_clone_plan_free(&clones);
+    return -1;
+  }
+  alloc->tree_regions = &regions;
+
   /* Build auxiliar mapping Ext4→Btrfs para lookups O(1) en el bucle
    * principal de escritura (evita O(N^2)). Tamaño = total_inodes+1
    * porque los inodos empiezan en 1. */
   uint64_t max_ino = layout->total_inodes + 1ULL;
   uint64_t *btrfs_for_ext4 = calloc(max_ino, sizeof(uint64_t));
-  if (!btrfs_for_ext4)
+  if (!btrfs_for_ext4) {
+    alloc->tree_regions = NULL;
+    ext4_tree_regions_finish(&regions, alloc, layout);
+    alloc->clones = NULL;
+    ext4_clone_plan_free(&clones);
     return -1;
+  }
   for (uint32_t i = 0; i < inode_map->count; i++) {
     uint32_t e = inode_map->entries[i].ext4_ino;
     if (e > 0 && (uint64_t)e < max_ino)
       btrfs_for_ext4[e] = inode_map->entries[i].btrfs_ino;
   }
 
-  /* Step 2: For each block group, write the inode table */
-  for (uint32_t g = 0; g < layout->num_groups; g++) {
-    const struct ext4_bg_layout *bg = &layout->groups[g];
-    uint32_t table_bytes = layout->inodes_per_group * inode_size;
-    uint8_t *table_buf = calloc(1, table_bytes);
-    if (!table_buf)
-      return -1;
+  struct decomp_pipeline pipe;
+  if (decomp_pipeline_init(&pipe, dev, layout, fs_info, alloc, btrfs_for_ext4,
+                           max_ino) < 0) {
+    free(btrfs_for_ext4);
+    alloc->tree_regions = NULL;
+    ext4_tree_regions_finish(&regions, alloc, layout);
+    alloc->clones = NULL;
+    ext4_clone_plan_free(&clones);
+    return -1;
+  }
 
-    uint32_t ino_start = g * layout->inodes_per_group + 1;
-    uint32_t ino_end = ino_start + layout->inodes_per_group;
-
-    for (uint32_t ino = ino_start; ino < ino_end; ino++) {
-      /* Find the btrfs file entry for this ext4 inode (O(1) lookup) */
-      uint64_t btrfs_ino = (ino < max_ino) ? btrfs_for_ext4[ino] : 0;
-      if (btrfs_ino == 0) {
-        /* Special handling for reserved inodes */
-        if (ino == EXT4_ROOT_INO) {
-          btrfs_ino = BTRFS_FIRST_FREE_OBJECTID;
-        } else if (ino == EXT4_JOURNAL_INO) {
-          /* Journal inode — handled separately below */
-          uint32_t jnl_blocks = ext4_journal_block_count();
-          uint64_t jnl_start = ext4_journal_start_block();
-
-          if (jnl_blocks > 0 && jnl_start > 0) {
-            struct ext4_inode *jnl_inode =
-                (struct ext4_inode *)(table_buf +
-                                      (ino - ino_start) * inode_size);
-            jnl_inode->i_mode = htole16(S_IFREG | 0600);
-            uint64_t jnl_size = (uint64_t)jnl_blocks * block_size;
-            jnl_inode->i_size_lo = htole32((uint32_t)(jnl_size & 0xFFFFFFFF));
-            jnl_inode->i_size_high = htole32((uint32_t)(jnl_size >> 32));
-            jnl_inode->i_links_count = htole16(1);
-            uint64_t jnl_sectors = (jnl_size + 511) / 512;
-            jnl_inode->i_blocks_lo =
-                htole32((uint32_t)(jnl_sectors & 0xFFFFFFFF));
-            jnl_inode->i_blocks_high = htole16((uint16_t)(jnl_sectors >> 32));
-            jnl_inode->i_flags |= htole32(EXT4_EXTENTS_FL);
-            jnl_inode->i_extra_isize = htole16(32);
-            jnl_inode->i_generation = htole32(1);
-
-            /* Build extent tree for journal (single extent) */
-            struct ext4_extent_header *jeh =
-                (struct ext4_extent_header *)jnl_inode->i_block;
-            jeh->eh_magic = htole16(EXT4_EXT_MAGIC);
-            jeh->eh_entries = htole16(1);
-            jeh->eh_max = htole16(4);
-            jeh->eh_depth = htole16(0);
-            jeh->eh_generation = htole32(0);
-
-            struct ext4_extent *jext =
-                (struct ext4_extent *)((uint8_t *)jnl_inode->i_block +
-                                       sizeof(struct ext4_extent_header));
-            jext->ee_block = htole32(0);
-            jext->ee_len =
-                htole16(jnl_blocks > 32768 ? 32768 : (uint16_t)jnl_blocks);
-            jext->ee_start_lo = htole32((uint32_t)(jnl_start & 0xFFFFFFFF));
-            jext->ee_start_hi = htole16((uint16_t)(jnl_start >> 32));
-          }
-          continue;
-        } else {
-          continue; /* Unused inode */
-        }
+  /* Step 2: Build the inode tables, ITABLE_WINDOW_GROUPS groups at a time.
+   * Window w+1 is filled on the pool while window w is committed and its
+   * tables are queued, in group order, as one write batch. */
+  size_t table_bytes = (size_t)layout->inodes_per_group * inode_size;
+  struct itable_slot slots[2][ITABLE_WINDOW_GROUPS];
+  memset(slots, 0, sizeof(slots));
+  int ret = 0;
+  for (int w = 0; w < 2 && ret == 0; w++) {
+    for (uint32_t i = 0; i < ITABLE_WINDOW_GROUPS; i++) {
+      slots[w][i].buf = malloc(table_bytes);
+      slots[w][i].wg = thread_pool_wg_create();
+      if (!slots[w][i].buf || !slots[w][i].wg) {
+        fprintf(stderr, "btrfs2ext4: OOM allocating inode table buffers\n");
+        ret = -1;
+        break;
       }
+    }
+  }
 
-      const struct file_entry *fe =
-          btrfs_find_inode((struct btrfs_fs_info *)fs_info, btrfs_ino);
-      if (!fe)
-        continue;
-
-      /* Calculate position in table buffer */
-      uint32_t local_ino = ino - ino_start;
-      struct ext4_inode *ext_inode =
-          (struct ext4_inode *)(table_buf + local_ino * inode_size);
-
-      /* Translate btrfs inode to ext4 */
-      ext_inode->i_mode = htole16((uint16_t)fe->mode);
-      ext_inode->i_uid = htole16((uint16_t)(fe->uid & 0xFFFF));
-      ext_inode->i_uid_high = htole16((uint16_t)(fe->uid >> 16));
-      ext_inode->i_gid = htole16((uint16_t)(fe->gid & 0xFFFF));
-      ext_inode->i_gid_high = htole16((uint16_t)(fe->gid >> 16));
-      ext_inode->i_links_count = htole16((uint16_t)fe->nlink);
-
-      uint64_t size = fe->size;
-      ext_inode->i_size_lo = htole32((uint32_t)(size & 0xFFFFFFFF));
-      ext_inode->i_size_high = htole32((uint32_t)(size >> 32));
-
-      /* Timestamps */
-      ext_inode->i_atime = htole32((uint32_t)fe->atime_sec);
-      ext_inode->i_ctime = htole32((uint32_t)fe->ctime_sec);
-      ext_inode->i_mtime = htole32((uint32_t)fe->mtime_sec);
-      ext_inode->i_crtime = htole32((uint32_t)fe->crtime_sec);
-
-      /* Nanosecond precision in extra fields */
-      ext_inode->i_atime_extra =
-          htole32(((uint32_t)fe->atime_nsec << 2) |
-                  ((uint32_t)((fe->atime_sec >> 32) & 0x3)));
-      ext_inode->i_mtime_extra =
-          htole32(((uint32_t)fe->mtime_nsec << 2) |
-                  ((uint32_t)((fe->mtime_sec >> 32) & 0x3)));
-      ext_inode->i_ctime_extra =
-          htole32(((uint32_t)fe->ctime_nsec << 2) |
-                  ((uint32_t)((fe->ctime_sec >> 32) & 0x3)));
-      ext_inode->i_crtime_extra =
-          htole32(((uint32_t)fe->crtime_nsec << 2) |
-                  ((uint32_t)((fe->crtime_sec >> 32) & 0x3)));
-
-      /* Extra inode size (256-128 = 128, but actual extra = 32 for timestamps)
-       */
-      ext_inode->i_extra_isize = htole16(32);
-
-      /* Blocks count (in 512-byte sectors) */
-      uint64_t blocks_512 = (size + 511) / 512;
-      ext_inode->i_blocks_lo = htole32((uint32_t)(blocks_512 & 0xFFFFFFFF));
-      ext_inode->i_blocks_high = htole16((uint16_t)(blocks_512 >> 32));
-
-      /* Decompress compressed extents and rewrite to new blocks */
-      if (S_ISREG(fe->mode) && fe->extent_count > 0) {
-        struct file_entry *fe_mut = (struct file_entry *)fe;
-        int has_compressed = 0;
-        for (uint32_t e = 0; e < fe_mut->extent_count; e++) {
-          if (fe_mut->extents[e].compression != BTRFS_COMPRESS_NONE &&
-              fe_mut->extents[e].type != BTRFS_FILE_EXTENT_INLINE &&
-              fe_mut->extents[e].disk_bytenr != 0) {
-            has_compressed = 1;
-            break;
-          }
-        }
-
-        if (has_compressed) {
-          struct thread_pool_wait_group *wg = thread_pool_wg_create();
-          struct decomp_job *jobs =
-              calloc(fe_mut->extent_count, sizeof(struct decomp_job));
-
-          /* Pass 1: Dispatch to pool */
-          for (uint32_t e = 0; e < fe_mut->extent_count; e++) {
-            struct file_extent *ext = &fe_mut->extents[e];
-            if (ext->compression == BTRFS_COMPRESS_NONE ||
-                ext->type == BTRFS_FILE_EXTENT_INLINE || ext->disk_bytenr == 0)
-              continue;
-
-            jobs[e].dev = dev;
-            jobs[e].chunk_map = fs_info->chunk_map;
-            jobs[e].ext = ext;
-            jobs[e].block_size = block_size;
-            jobs[e].status = -1;
-
-            thread_pool_wg_add(wg, 1);
-            if (thread_pool_submit(g_decomp_pool, decomp_worker, &jobs[e], wg) <
-                0) {
-              /* Fallback if pool is full or fails */
-              thread_pool_wg_done(wg);
-              decomp_worker(&jobs[e]);
-            }
-          }
-
-          thread_pool_wg_wait(wg);
-          thread_pool_wg_destroy(wg);
-
-          /* Pass 2: Allocate blocks and queue I/O sequentially */
-          for (uint32_t e = 0; e < fe_mut->extent_count; e++) {
-            struct file_extent *ext = &fe_mut->extents[e];
-            if (ext->compression == BTRFS_COMPRESS_NONE ||
-                ext->type == BTRFS_FILE_EXTENT_INLINE || ext->disk_bytenr == 0)
-              continue;
-
-            if (jobs[e].status < 0) {
-              fprintf(stderr,
-                      "btrfs2ext4: failed to decompress extent for inode %lu\n",
-                      (unsigned long)fe->ino);
-              free(jobs[e].decomp_buf);
-              continue;
-            }
-
-            uint8_t *decomp_buf = jobs[e].decomp_buf;
-            uint64_t decomp_len = jobs[e].decomp_len;
-
-            /* Allocate new blocks and write decompressed data */
-            uint32_t needed_blocks =
-                (uint32_t)((decomp_len + block_size - 1) / block_size);
-
-            struct run {
-              uint64_t phys_block;
-              uint32_t count;
-            };
-            struct run *runs = calloc(needed_blocks, sizeof(struct run));
-            if (!runs) {
-              continue;
-            }
-            uint32_t num_runs = 0;
-            int alloc_failed = 0;
-
-            /* First: allocate blocks and build runs array */
-            for (uint32_t b = 0; b < needed_blocks; b++) {
-              uint64_t blk = ext4_alloc_block(alloc, layout);
-              if (blk == (uint64_t)-1) {
-                fprintf(stderr,
-                        "btrfs2ext4: no space for decompressed block %u "
-                        "(inode %lu)\n",
-                        b, (unsigned long)fe->ino);
-                alloc_failed = 1;
-                break;
-              }
-
-              if (num_runs > 0 &&
-                  runs[num_runs - 1].phys_block + runs[num_runs - 1].count ==
-                      blk) {
-                runs[num_runs - 1].count++;
-              } else {
-                runs[num_runs].phys_block = blk;
-                runs[num_runs].count = 1;
-                num_runs++;
-              }
-            }
-
-            /* Bug D fix + io_uring: Write decompressed data per contiguous
-             * run using batch API. Buffers are deferred-freed after submit
-             * so they remain valid for async I/O. */
-            device_write_batch_begin(dev);
-
-            /* Collect run buffers for deferred free after submit */
-            uint8_t **run_bufs = calloc(num_runs, sizeof(uint8_t *));
-            uint32_t blocks_written = 0;
-            for (uint32_t r = 0; r < num_runs && !alloc_failed; r++) {
-              uint64_t run_byte_offset = runs[r].phys_block * block_size;
-              size_t run_bytes = (size_t)runs[r].count * block_size;
-
-              uint64_t src_offset = (uint64_t)blocks_written * block_size;
-              size_t write_len = run_bytes;
-              if (src_offset + write_len > decomp_len)
-                write_len = (size_t)(decomp_len - src_offset);
-
-              uint8_t *run_buf = calloc(1, run_bytes);
-              if (run_buf) {
-                if (write_len > 0)
-                  memcpy(run_buf, decomp_buf + src_offset, write_len);
-                device_write_batch_add(dev, run_byte_offset, run_buf,
-                                       run_bytes);
-                if (run_bufs)
-                  run_bufs[r] = run_buf;
-              }
-              blocks_written += runs[r].count;
-            }
-
-            /* Submit all queued run writes at once */
-            device_write_batch_submit(dev);
-
-            /* Now safe to free all run buffers */
-            if (run_bufs) {
-              for (uint32_t r = 0; r < num_runs; r++)
-                free(run_bufs[r]);
-              free(run_bufs);
-            }
-
-            if (alloc_failed || num_runs == 0) {
-              free(runs);
-              continue;
-            }
-
-            if (num_runs == 1) {
-              /* Update extent to point to decompressed data (contiguous) */
-              ext->disk_bytenr = runs[0].phys_block * block_size;
-              ext->disk_num_bytes = (uint64_t)runs[0].count * block_size;
-              ext->num_bytes = decomp_len;
-              ext->ram_bytes = decomp_len;
-              ext->compression = BTRFS_COMPRESS_NONE;
-            } else {
-              /* Dynamic extent splitting for fragmented blocks */
-              if (fe_mut->extent_count + num_runs - 1 >
-                  fe_mut->extent_capacity) {
-                fe_mut->extent_capacity = fe_mut->extent_count + num_runs - 1;
-                struct file_extent *new_exts =
-                    realloc(fe_mut->extents, fe_mut->extent_capacity *
-                                                 sizeof(struct file_extent));
-                if (!new_exts) {
-                  free(runs);
-                  continue; /* OOM */
-                }
-                fe_mut->extents = new_exts;
-                ext = &fe_mut->extents[e]; /* update pointer */
-              }
-
-              /* Shift subsequent extents */
-              if (e + 1 < fe_mut->extent_count) {
-                memmove(&fe_mut->extents[e + num_runs], &fe_mut->extents[e + 1],
-                        (fe_mut->extent_count - e - 1) *
-                            sizeof(struct file_extent));
-              }
-
-              /* Fill the newly split extents */
-              uint64_t current_file_offset = ext->file_offset;
-              uint64_t remaining_decomp_len = decomp_len;
-
-              /* Save base properties before we overwrite */
-              uint8_t base_type = ext->type;
-
-              for (uint32_t r = 0; r < num_runs; r++) {
-                struct file_extent *r_ext = &fe_mut->extents[e + r];
-                memset(r_ext, 0, sizeof(struct file_extent));
-                r_ext->type = base_type;
-                r_ext->compression = BTRFS_COMPRESS_NONE;
-                r_ext->disk_bytenr = runs[r].phys_block * block_size;
-                r_ext->disk_num_bytes = (uint64_t)runs[r].count * block_size;
-
-                uint64_t run_bytes = (uint64_t)runs[r].count * block_size;
-                if (r == num_runs - 1) {
-                  r_ext->num_bytes = remaining_decomp_len;
-                  r_ext->ram_bytes = remaining_decomp_len;
-                } else {
-                  r_ext->num_bytes = run_bytes;
-                  r_ext->ram_bytes = run_bytes;
-                  remaining_decomp_len -= run_bytes;
-                }
-                r_ext->file_offset = current_file_offset;
-                current_file_offset += r_ext->num_bytes;
-              }
-
-              fe_mut->extent_count += (num_runs - 1);
-              e += (num_runs - 1); /* skip the newly inserted extents so outer
-                                      loop continues correctly */
-            }
-
-            /* Cleanup original thread buffer replica */
-            free(decomp_buf);
-            free(runs);
-          }
-          free(jobs);
-        }
-
-        /* Check if we can store it as Native Inline Data (Phase 5) */
-        int stored_inline = 0;
-        if (fe->extent_count == 1 &&
-            fe->extents[0].type == BTRFS_FILE_EXTENT_INLINE &&
-            fe->extents[0].inline_data_len > 0) {
-          size_t inline_len = fe->extents[0].inline_data_len;
-          size_t max_inline_len = 60;
-          if (layout->inode_size > 128) {
-            /* 128 (extra space) - 32 (timestamp extra) - 4 (xattr magic) -
-             * xattr header overhead */
-            max_inline_len += (layout->inode_size - 128 - 32 -
-                               sizeof(struct ext4_xattr_ibody_header) -
-                               sizeof(struct ext4_xattr_entry));
-          }
-
-          if (inline_len <= max_inline_len) {
-            ext_inode->i_flags |= htole32(EXT4_INLINE_DATA_FL);
-            size_t iblock_len = inline_len < 60 ? inline_len : 60;
-            memcpy(ext_inode->i_block, fe->extents[0].inline_data, iblock_len);
-
-            if (inline_len > 60) {
-              /* Store remainder in extra inode space as system.data xattr */
-              uint8_t *extra = (uint8_t *)ext_inode + 128 +
-                               32; /* After basic extra fields */
-              struct ext4_xattr_ibody_header *xhdr =
-                  (struct ext4_xattr_ibody_header *)extra;
-              xhdr->h_magic = htole32(EXT4_XATTR_MAGIC);
-
-              struct ext4_xattr_entry *xentry =
-                  (struct ext4_xattr_entry
-                       *)(extra + sizeof(struct ext4_xattr_ibody_header));
-              xentry->e_name_len = 4; /* "data" */
-              xentry->e_name_index = EXT4_XATTR_INDEX_SYSTEM;
-              xentry->e_value_size = htole32((uint32_t)(inline_len - 60));
-              xentry->e_value_offs =
-                  htole16((uint16_t)(sizeof(struct ext4_xattr_ibody_header) +
-                                     sizeof(struct ext4_xattr_entry) +
-                                     8 /* padded name */));
-              xentry->e_value_block = 0;
-              xentry->e_hash = 0;
-              memcpy(xentry->e_name, "data\0\0\0\0",
-                     8); /* padded to 4-byte boundary */
-
-              uint8_t *xval =
-                  (uint8_t *)xentry + sizeof(struct ext4_xattr_entry) + 8;
-              memcpy(xval, fe->extents[0].inline_data + 60, inline_len - 60);
-
-              /* Mark end of xattr entries */
-              uint32_t *xend =
-                  (uint32_t *)(xval + ((inline_len - 60 + 3) & ~3));
-              *xend = 0;
-            }
-            stored_inline = 1;
-          }
-        }
-
-        if (!stored_inline) {
-          /* Build extent tree for regular files (supports multi-level) */
-          ext4_build_extent_tree(alloc, dev, ext_inode, fe, fs_info->chunk_map,
-                                 layout);
-        }
-      } else if (S_ISDIR(fe->mode)) {
-        /* Directories will have their data blocks set during dir writing */
-        ext_inode->i_flags |= htole32(EXT4_EXTENTS_FL | fe->ext4_flags);
-        struct ext4_extent_header *eh =
-            (struct ext4_extent_header *)ext_inode->i_block;
-        eh->eh_magic = htole16(EXT4_EXT_MAGIC);
-        eh->eh_entries = htole16(0);
-        eh->eh_max = htole16(4);
-        eh->eh_depth = htole16(0);
-      } else if (S_ISLNK(fe->mode) && fe->symlink_target) {
-        /* Symlinks: store target in i_block if short enough (<60 bytes),
-         * otherwise need an extent-based data block */
-        size_t target_len = strlen(fe->symlink_target);
-        if (target_len < 60) {
-          /* Fast symlink: target stored directly in i_block */
-          memcpy(ext_inode->i_block, fe->symlink_target, target_len);
-        } else {
-          /* Security check: Linux limits symlinks to PATH_MAX.
-           * Prevent heap buffer overflow if Btrfs inline extent is maliciously
-           * huge. */
-          if (target_len >= block_size) {
-            target_len = block_size - 1;
-          }
-
-          /* Long symlink: allocate a data block and store target there */
-          uint64_t sym_block = ext4_alloc_block(alloc, layout);
-          if (sym_block != (uint64_t)-1) {
-            uint8_t *sym_buf = calloc(1, block_size);
-            if (sym_buf) {
-              memcpy(sym_buf, fe->symlink_target, target_len);
-              device_write(dev, sym_block * block_size, sym_buf, block_size);
-              free(sym_buf);
-
-              /* Build inline extent pointing to the data block */
-              struct ext4_extent_header *eh =
-                  (struct ext4_extent_header *)ext_inode->i_block;
-              eh->eh_magic = htole16(EXT4_EXT_MAGIC);
-              eh->eh_entries = htole16(1);
-              eh->eh_max = htole16(4);
-              eh->eh_depth = htole16(0);
-              struct ext4_extent *ext =
-                  (struct ext4_extent *)((uint8_t *)ext_inode->i_block +
-                                         sizeof(struct ext4_extent_header));
-              ext->ee_block = htole32(0);
-              ext->ee_len = htole16(1);
-              ext->ee_start_lo = htole32((uint32_t)(sym_block & 0xFFFFFFFF));
-              ext->ee_start_hi = htole16((uint16_t)(sym_block >> 32));
-              ext_inode->i_flags |= htole32(EXT4_EXTENTS_FL);
-            }
-          }
-        }
-      } else if (S_ISCHR(fe->mode) || S_ISBLK(fe->mode)) {
-        /* Device nodes: store rdev in i_block */
-        uint32_t major = (uint32_t)(fe->rdev >> 8) & 0xFFF;
-        uint32_t minor = (uint32_t)(fe->rdev & 0xFF) |
-                         ((uint32_t)(fe->rdev >> 12) & 0xFFF00);
-        /* Old encoding in i_block[0] */
-        ((uint32_t *)ext_inode->i_block)[0] =
-            htole32((major << 8) | (minor & 0xFF));
-        /* New encoding in i_block[1] */
-        ((uint32_t *)ext_inode->i_block)[1] = htole32((major << 20) | minor);
+  uint32_t num_windows =
+      (layout->num_groups + ITABLE_WINDOW_GROUPS - 1) / ITABLE_WINDOW_GROUPS;
+  uint64_t itable_written = 0;
+  uint32_t itable_skipped = 0;
+  progress_begin("inode_tables", layout->num_groups, "groups");
+  if (ret == 0 && num_windows > 0)
+    itable_submit_window(slots[0], &pipe, 0, layout->num_groups);
+
+  for (uint32_t w = 0; w < num_windows && ret == 0; w++) {
+    struct itable_slot *cur = slots[w & 1];
+    if (w + 1 < num_windows)
+      itable_submit_window(slots[(w + 1) & 1], &pipe,
+                           (w + 1) * ITABLE_WINDOW_GROUPS, layout->num_groups);
+
+    uint32_t n = 0;
+    device_write_batch_begin(dev);
+    for (; n < ITABLE_WINDOW_GROUPS; n++) {
+      if (w * ITABLE_WINDOW_GROUPS + n >= layout->num_groups)
+        break;
+      if (itable_commit_group(&pipe, &cur[n]) < 0) {
+        ret = -1;
+        break;
       }
+      itable_written += cur[n].bytes;
+      if (cur[n].bytes == 0)
+        itable_skipped++;
+      progress_add(1);
+    }
+    /* The window's buffers are refilled only after this returns */
+    if (device_write_batch_submit(dev) < 0)
+      ret = -1;
+    for (uint32_t i = 0; i < n && ret == 0; i++) {
+      if (itable_zero_tail(&pipe, &cur[i]) < 0)
+        ret = -1;
+    }
+  }
 
-      /* Write security xattrs (Phase 6) */
-      if (fe->xattrs && !(ext_inode->i_flags & htole32(EXT4_INLINE_DATA_FL))) {
-        /* Only write if we haven't already used the ibody for inline data */
-        if (layout->inode_size >
-            128 + 32 + sizeof(struct ext4_xattr_ibody_header)) {
-          uint8_t *extra = (uint8_t *)ext_inode + 128 + 32;
-          struct ext4_xattr_ibody_header *xhdr =
-              (struct ext4_xattr_ibody_header *)extra;
-          xhdr->h_magic = htole32(EXT4_XATTR_MAGIC);
+  progress_end();
 
-          struct ext4_xattr_entry *xentry =
-              (struct ext4_xattr_entry *)(extra +
-                                          sizeof(
-                                              struct ext4_xattr_ibody_header));
-          uint8_t *xval_area = extra + layout->inode_size - 128 -
-                               32; /* Start values from end of inode */
-          int space_left = layout->inode_size - 128 - 32 -
-                           sizeof(struct ext4_xattr_ibody_header) -
-                           4; /* -4 for end null eq */
-
-          struct xattr_entry *xa = fe->xattrs;
-          while (xa) {
-            /* Determine name index (security vs system vs user) */
-            uint8_t name_index = 0; /* EXT4_XATTR_INDEX_USER default */
-            const char *name_rem = xa->name;
-            if (strncmp(xa->name, "security.", 9) == 0) {
-              name_index = EXT4_XATTR_INDEX_SECURITY;
-              name_rem += 9;
-            } else if (strncmp(xa->name, "system.", 7) == 0) {
-              name_index = EXT4_XATTR_INDEX_SYSTEM;
-              name_rem += 7;
-            } else if (strncmp(xa->name, "user.", 5) == 0) {
-              name_index = 1; /* EXT4_XATTR_INDEX_USER */
-              name_rem += 5;
-            }
-
-            size_t rem_len = strlen(name_rem);
-            size_t name_pad = (rem_len + 3) & ~3;
-            size_t val_pad = (xa->value_len + 3) & ~3;
-            size_t entry_size = sizeof(struct ext4_xattr_entry) + name_pad;
-
-            /* Check for integer overflow */
-            if (xa->value_len > 4096 || entry_size + val_pad > 4096) {
-              xa = xa->next;
-              continue;
-            }
-
-            if (space_left >= (int)(entry_size + val_pad)) {
-              xentry->e_name_len = rem_len;
-              xentry->e_name_index = name_index;
-              xentry->e_value_block = 0;
-              xentry->e_value_size = htole32(xa->value_len);
-              xval_area -= val_pad;
-              xentry->e_value_offs = htole16((uint16_t)(xval_area - extra));
-              xentry->e_hash = 0;
-
-              memset(xentry->e_name, 0, name_pad);
-              memcpy(xentry->e_name, name_rem, rem_len);
-
-              if (xa->value_len > 0) {
-                memcpy(xval_area, xa->value, xa->value_len);
-              }
-
-              space_left -= (entry_size + val_pad);
-              xentry =
-                  (struct ext4_xattr_entry *)((uint8_t *)xentry + entry_size);
-            }
-            xa = xa->next;
-          }
-          /* Terminate entry list */
-          *(uint32_t *)xentry = 0;
-        }
+  /* Fills still in flight after an error must not outlive their buffers */
+  for (int w = 0; w < 2; w++) {
+    for (uint32_t i = 0; i < ITABLE_WINDOW_GROUPS; i++) {
+      if (slots[w][i].wg) {
+        thread_pool_wg_wait(slots[w][i].wg);
+        thread_pool_wg_destroy(slots[w][i].wg);
       }
-
-      ext_inode->i_generation = htole32(1); /* Generation number */
-    }
-
-    /* Write the inode table for this group */
-    uint64_t table_offset = bg->inode_table_start * block_size;
-    if (device_write(dev, table_offset, table_buf, table_bytes) < 0) {
-      free(table_buf);
-      free(btrfs_for_ext4);
-      return -1;
+      free(slots[w][i].buf);
     }
-
-    free(table_buf);
+  }
+  alloc->tree_regions = NULL;
+  if (ext4_tree_regions_finish(&regions, alloc, layout) < 0)
+    ret = -1;
+  alloc->clones = NULL;
+  ext4_clone_plan_free(&clones);
+  if (ret < 0) {
+    decomp_pipeline_destroy(&pipe);
+    free(btrfs_for_ext4);
+    return -1;
   }
 
+  ext4_alloc_set_goal(alloc, layout, 0);
   printf("  Inode tables written\n");
+  if (g_lazy_itable)
+    printf("  Lazy inode tables: %.1f MiB of %.1f MiB written, %u of %u "
+           "groups left to the kernel\n",
+           itable_written / (1024.0 * 1024.0),
+           (double)layout->num_groups * table_bytes / (1024.0 * 1024.0),
+           itable_skipped, layout->num_groups);
+  else
+    printf("  Inode tables: %.1f MiB written, %.1f MiB zeroed by %s\n",
+           itable_written / (1024.0 * 1024.0),
+           ((double)layout->num_groups * table_bytes - itable_written) /
+               (1024.0 * 1024.0),
+           device_zero_mode_name(dev, device_zero_mode(dev)));
+  if (alloc->goal_spills > 0)
+    printf("  Goal allocation: %lu runs placed outside the inode's "
+           "flex group\n",
+           (unsigned long)alloc->goal_spills);
+  if (regions.blocks > 0)
+    printf("  Extent-tree regions: %lu blocks in %lu writes "
+           "(%lu estimated)\n",
+           (unsigned long)regions.blocks, (unsigned long)regions.writes,
+           (unsigned long)regions.planned);
+  if (pipe.files > 0)
+    printf("  Decompression pipeline: %lu extents from %lu files, "
+           "peak %lu MiB in flight\n",
+           (unsigned long)pipe.extents, (unsigned long)pipe.files,
+           (unsigned long)(pipe.peak_bytes / (1024 * 1024)));
+  decomp_pipeline_destroy(&pipe);
   free(btrfs_for_ext4);
 
   if (g_decomp_pool) {
+    struct thread_pool_stats ps;
+    thread_pool_get_stats(g_decomp_pool, &ps);
+    if (ps.tasks_run > 0)
+      printf("  Inode writer pool: %u workers, %lu tasks (%lu stolen, "
+             "%lu idle waits, %lu run inline)\n",
+             g_decomp_pool->num_threads, (unsigned long)ps.tasks_run,
+             (unsigned long)ps.tasks_stolen, (unsigned long)ps.idle_sleeps,
+             (unsigned long)ps.submit_rejected);
     thread_pool_destroy(g_decomp_pool);
     g_decomp_pool = NULL;
   }
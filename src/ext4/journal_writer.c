@@ -6,7 +6,8 @@
  *
  * The journal is stored as inode 8 (EXT4_JOURNAL_INO) and consists of:
  *   - A JBD2 superblock at the first journal block
- *   - Remaining blocks zeroed (empty journal)
+ *   - Remaining blocks zeroed (empty journal) with device_zero_range(),
+ *     which lets the kernel punch or zero the range instead of writing it
  */
 
 #include <endian.h>
@@ -115,39 +116,20 @@ int ext4_write_journal(struct device *dev, const struct ext4_layout *layout,
     }
   }
 
-  /* Fallback: allocate from front if end-of-device search failed */
+  /* Fallback: longest contiguous run the allocator can find. The journal
+   * is described as a single run, so it is shrunk to what was found. */
   if (first_block == (uint64_t)-1) {
-    first_block = ext4_alloc_block(alloc, layout);
+    first_block = ext4_alloc_run(alloc, layout, journal_blocks, &got_blocks);
     if (first_block == (uint64_t)-1) {
       fprintf(stderr, "btrfs2ext4: no space for journal\n");
       return -1;
     }
-    got_blocks = 1;
-
-    /* Try to claim contiguous blocks after first_block via bitmap */
-    for (uint32_t i = 1; i < journal_blocks; i++) {
-      uint64_t blk = first_block + i;
-      if (blk >= alloc->max_blocks)
-        break;
-      if (alloc->reserved_bitmap &&
-          (alloc->reserved_bitmap[blk / 8] & (1 << (blk % 8)))) {
-        break;
-      }
-      if (alloc->reserved_bitmap)
-        alloc->reserved_bitmap[blk / 8] |= (1 << (blk % 8));
-      got_blocks++;
-    }
-  }
-
-  /* If we still couldn't get enough contiguous blocks, fall back to allocator
-   */
-  if (got_blocks < journal_blocks) {
-    for (uint32_t i = got_blocks; i < journal_blocks; i++) {
-      uint64_t blk = ext4_alloc_block(alloc, layout);
-      if (blk == (uint64_t)-1) {
-        journal_blocks = i;
-        break;
-      }
+    if (got_blocks < journal_blocks) {
+      fprintf(stderr,
+              "btrfs2ext4: warning: journal shrunk to %u blocks "
+              "(no larger contiguous run)\n",
+              got_blocks);
+      journal_blocks = got_blocks;
     }
   }
 
@@ -174,61 +156,23 @@ int ext4_write_journal(struct device *dev, const struct ext4_layout *layout,
   jsb->s_start = htobe32(0); /* 0 = clean journal */
   jsb->s_errno = htobe32(0);
 
-/* Bug G fix: Write journal in large chunks instead of 32768 × 4KB pwrite().
- * Use 16MB chunks to limit RAM usage while reducing syscall overhead. */
-#define JOURNAL_CHUNK_SIZE (16 * 1024 * 1024)
-  uint32_t chunk_blocks = JOURNAL_CHUNK_SIZE / block_size;
-  if (chunk_blocks > journal_blocks)
-    chunk_blocks = journal_blocks;
-
-  size_t chunk_bytes = (size_t)chunk_blocks * block_size;
-  uint8_t *zero_chunk = calloc(1, chunk_bytes);
-  if (!zero_chunk) {
-    free(jbd_buf);
-    return -1;
-  }
-
-  /* Use batch write API for async I/O when io_uring is available */
-  device_write_batch_begin(dev);
-
-  /* Write JBD2 superblock as the first block */
-  if (device_write_batch_add(dev, first_block * block_size, jbd_buf,
-                             block_size) < 0) {
-    free(zero_chunk);
+  /* Write the JBD2 superblock as the first block */
+  if (device_write(dev, first_block * block_size, jbd_buf, block_size) < 0) {
     free(jbd_buf);
     return -1;
   }
+  free(jbd_buf);
 
-  /* Write remaining chunks (all zeros) */
-  uint32_t written = 1;
-  while (written < journal_blocks) {
-    uint32_t remaining = journal_blocks - written;
-    uint32_t to_write = remaining < chunk_blocks ? remaining : chunk_blocks;
-    uint64_t offset = (first_block + written) * block_size;
-
-    if (device_write_batch_add(dev, offset, zero_chunk,
-                               (size_t)to_write * block_size) < 0) {
-      free(zero_chunk);
-      free(jbd_buf);
-      return -1;
-    }
-    written += to_write;
-  }
-
-  /* Submit all queued journal writes at once */
-  if (device_write_batch_submit(dev) < 0) {
-    free(zero_chunk);
-    free(jbd_buf);
+  /* The rest only has to read as zeros: let the kernel (or the device)
+   * zero it instead of writing journal_blocks - 1 blocks of zeros */
+  if (device_zero_range(dev, (first_block + 1) * block_size,
+                        (uint64_t)(journal_blocks - 1) * block_size) < 0)
     return -1;
-  }
-
-  free(zero_chunk);
-  free(jbd_buf);
 
   printf("  Journal written (JBD2 v2 superblock + %u empty blocks, "
-         "%u chunk writes)\n",
+         "zeroed by %s)\n",
          journal_blocks - 1,
-         (journal_blocks + chunk_blocks - 1) / chunk_blocks);
+         device_zero_mode_name(dev, device_zero_mode(dev)));
 
   return 0;
 }
@@ -253,7 +197,7 @@ int ext4_finalize_journal_inode(struct device *dev,
                        (uint64_t)ino_local * layout->inode_size;
 
   struct ext4_inode jinode;
-  memset(&jinode, 0, layout->inode_size);
+  memset(&jinode, 0, sizeof(jinode));
 
   jinode.i_mode = htole16(0100600); /* Regular file, rw------- */
   jinode.i_uid = htole16(0);
@@ -1,7 +1,9 @@
 /*
  * planner.c — Ext4 layout planner
  *
- * Calculates the ext4 block group layout for a given device size.
+ * Calculates the ext4 block group layout for a given device size. With
+ * flex_bg packing the bitmaps and inode tables of each flex group form one
+ * run, placed where it covers the fewest blocks of Btrfs data.
  */
 
 #include <stdio.h>
@@ -12,12 +14,175 @@
 
 #include "btrfs/btrfs_reader.h"
 #include "btrfs/chunk_tree.h"
+#include "btrfs/extent_store.h"
 #include "ext4/ext4_planner.h"
 #include "ext4/ext4_structures.h"
+#include "thread_pool.h"
 
-int ext4_plan_layout(struct ext4_layout *layout, uint64_t device_size,
-                     uint32_t block_size, uint32_t inode_ratio,
-                     const struct btrfs_fs_info *fs_info) {
+/* Flex group packing on by default; --no-flex-pack keeps each group's
+ * metadata in the group */
+static int g_flex_pack = 1;
+
+void ext4_plan_set_flex_pack(int enabled) { g_flex_pack = enabled; }
+
+/* Append [start, start + count) to the reserved block list. A layout
+ * without a list (a layout search candidate) only counts them. */
+static int layout_reserve(struct ext4_layout *layout, uint64_t start,
+                          uint64_t count) {
+  if (!layout->reserved_blocks) {
+    layout->reserved_block_count += (uint32_t)count;
+    return 0;
+  }
+  for (uint64_t b = start; b < start + count; b++) {
+    if (layout->reserved_block_count >= layout->reserved_block_capacity) {
+      uint32_t new_cap = layout->reserved_block_capacity * 2;
+      uint64_t *new_blocks =
+          realloc(layout->reserved_blocks, new_cap * sizeof(uint64_t));
+      if (!new_blocks) {
+        fprintf(stderr, "btrfs2ext4: OOM reallocating reserved blocks\n");
+        return -1;
+      }
+      layout->reserved_blocks = new_blocks;
+      layout->reserved_block_capacity = new_cap;
+    }
+    layout->reserved_blocks[layout->reserved_block_count++] = b;
+  }
+  return 0;
+}
+
+static uint64_t group_end_block(const struct ext4_layout *layout, uint32_t g) {
+  uint64_t end = (uint64_t)(g + 1) * layout->blocks_per_group;
+  return end < layout->total_blocks ? end : layout->total_blocks;
+}
+
+static inline uint64_t data_bit(const uint8_t *data, uint64_t b) {
+  return data ? (data[b / 8] >> (b % 8)) & 1 : 0;
+}
+
+/*
+ * Where the packed metadata of groups [first, first + n) goes: `len`
+ * blocks inside the flex group, clear of every superblock/GDT copy,
+ * covering the fewest blocks set in `data` (NULL: no Btrfs data known).
+ * Ties keep the earliest start, so with nothing in the way the run
+ * follows the first group's superblock and GDT as mke2fs puts it. Returns
+ * the start block, or UINT64_MAX if the run does not fit; *cost receives
+ * the data blocks it covers.
+ */
+static uint64_t flex_place(const struct ext4_layout *layout, uint32_t first,
+                           uint32_t n, uint64_t len, const uint8_t *data,
+                           uint64_t *cost) {
+  uint64_t lo = layout->groups[first].data_start_block;
+  uint64_t hi = group_end_block(layout, first + n - 1);
+  uint64_t best = UINT64_MAX, best_cost = UINT64_MAX;
+
+  uint64_t a = lo;
+  for (uint32_t g = first + 1; a < hi; g++) {
+    /* Free stretch [a, b) up to the next superblock/GDT copy */
+    uint64_t b = hi, next = hi;
+    for (; g < first + n; g++) {
+      const struct ext4_bg_layout *bg = &layout->groups[g];
+      if (bg->data_start_block > bg->group_start_block) {
+        b = bg->group_start_block;
+        next = bg->data_start_block;
+        break;
+      }
+    }
+    if (b >= a + len) {
+      /* Slide a window over the stretch, counting the data it covers */
+      uint64_t covered = 0;
+      for (uint64_t x = a; data && x < a + len; x++)
+        covered += data_bit(data, x);
+      for (uint64_t s = a;; s++) {
+        if (covered < best_cost) {
+          best = s;
+          best_cost = covered;
+          if (covered == 0)
+            goto done;
+        }
+        if (s + len >= b)
+          break;
+        covered += data_bit(data, s + len) - data_bit(data, s);
+      }
+    }
+    a = next;
+  }
+done:
+  *cost = best_cost;
+  return best;
+}
+
+/* What one planning run works from, and what it reports back */
+struct plan_ctx {
+  const struct btrfs_fs_info *fs_info;
+  const uint8_t *data;    /* Btrfs data blocks, NULL if unknown */
+  uint64_t data_required; /* blocks the files will need */
+  int quiet;              /* layout search: no report, no messages */
+  uint32_t packed;        /* flex groups packed */
+  uint64_t default_cost;  /* data blocks under the runs at the default place */
+  uint64_t chosen_cost;   /* ... and where they went */
+};
+
+/*
+ * Pre-calculate actual utilized space & Data blocks scaling footprint:
+ * Ext4 requires physically allocating blocks for index trees and
+ * long symlinks, while ignoring sparse holes.
+ */
+static uint64_t plan_data_required(const struct btrfs_fs_info *fs_info,
+                                   uint32_t block_size) {
+  uint64_t data_blocks_required = 0;
+  if (!fs_info)
+    return 0;
+  for (uint32_t i = 0; i < fs_info->inode_count; i++) {
+    struct file_entry *fe = fs_info->inode_table[i];
+
+    if (fe->mode & S_IFLNK) {
+      if (fe->size > 59) {
+        data_blocks_required++; /* Symlinks > 59B take 1 data block */
+      }
+    } else if (fe->mode & S_IFREG) {
+      /* Extent tree index blocks for fragmented files */
+      if (fe->extent_count > 4) {
+        /* Each extent node takes roughly 340 extents (4096 / 12) */
+        uint32_t index_blocks = (fe->extent_count + 339) / 340;
+        data_blocks_required += index_blocks;
+      }
+
+      /* Actual data blocks (ignoring sparse holes) */
+      struct extent_iter it;
+      const struct file_extent *ext;
+      extent_iter_init(&it, fs_info, fe);
+      while ((ext = extent_iter_next(&it)) != NULL) {
+        if (ext->type != BTRFS_FILE_EXTENT_INLINE && ext->disk_bytenr != 0) {
+          data_blocks_required +=
+              (ext->num_bytes + block_size - 1) / block_size;
+        }
+      }
+    } else if (fe->mode & S_IFDIR) {
+      /* Base directory size */
+      data_blocks_required += (fe->size + block_size - 1) / block_size;
+    }
+  }
+  return data_blocks_required;
+}
+
+/* Btrfs data blocks, to steer the packed runs around them; NULL if there
+ * is no usage map or no memory for the bitmap */
+static uint8_t *plan_data_bitmap(const struct btrfs_fs_info *fs_info,
+                                 uint32_t block_size, uint64_t total_blocks) {
+  if (!fs_info || !fs_info->usage.bits)
+    return NULL;
+  uint8_t *data = calloc((total_blocks + 7) / 8, 1);
+  if (data)
+    usage_map_mark_data(&fs_info->usage, data, block_size, total_blocks);
+  return data;
+}
+
+static int plan_geometry(struct ext4_layout *layout, uint64_t device_size,
+                         uint32_t block_size,
+                         const struct ext4_plan_params *params,
+                         struct plan_ctx *ctx) {
+  const struct btrfs_fs_info *fs_info = ctx->fs_info;
+  uint32_t inode_ratio = params->inode_ratio;
   memset(layout, 0, sizeof(*layout));
 
   if (block_size == 0)
@@ -27,8 +192,9 @@ int ext4_plan_layout(struct ext4_layout *layout, uint64_t device_size,
 
   /* Reject zero-size or impossibly small devices */
   if (device_size == 0 || device_size < block_size) {
-    fprintf(stderr, "btrfs2ext4: device too small (%lu bytes)\n",
-            (unsigned long)device_size);
+    if (!ctx->quiet)
+      fprintf(stderr, "btrfs2ext4: device too small (%lu bytes)\n",
+              (unsigned long)device_size);
     return -1;
   }
 
@@ -37,7 +203,9 @@ int ext4_plan_layout(struct ext4_layout *layout, uint64_t device_size,
   uint64_t total_blocks;
   if (__builtin_mul_overflow(device_size, 1, &total_blocks) ||
       device_size / block_size == 0) {
-    fprintf(stderr, "btrfs2ext4: block calculation overflow or zero blocks\n");
+    if (!ctx->quiet)
+      fprintf(stderr,
+              "btrfs2ext4: block calculation overflow or zero blocks\n");
     return -1;
   }
   layout->total_blocks = device_size / block_size;
@@ -78,6 +246,8 @@ int ext4_plan_layout(struct ext4_layout *layout, uint64_t device_size,
    * out-of-bounds.
    */
   if (fs_info && layout->total_inodes < fs_info->inode_count + 16) {
+    if (ctx->quiet)
+      return -1;
     fprintf(stderr,
             "\n[FATAL] btrfs2ext4: Architecture Limitation Exceeded!\n");
     fprintf(stderr,
@@ -87,55 +257,20 @@ int ext4_plan_layout(struct ext4_layout *layout, uint64_t device_size,
     return -1;
   }
 
-  /*
-   * Pre-calculate actual utilized space & Data blocks scaling footprint:
-   * Ext4 requires physically allocating blocks for index trees and
-   * long symlinks, while ignoring sparse holes.
-   */
-  uint64_t data_blocks_required = 0;
-  if (fs_info) {
-    for (uint32_t i = 0; i < fs_info->inode_count; i++) {
-      struct file_entry *fe = fs_info->inode_table[i];
-
-      if (fe->mode & S_IFLNK) {
-        if (fe->size > 59) {
-          data_blocks_required++; /* Symlinks > 59B take 1 data block */
-        }
-      } else if (fe->mode & S_IFREG) {
-        /* Extent tree index blocks for fragmented files */
-        if (fe->extent_count > 4) {
-          /* Each extent node takes roughly 340 extents (4096 / 12) */
-          uint32_t index_blocks = (fe->extent_count + 339) / 340;
-          data_blocks_required += index_blocks;
-        }
-
-        /* Actual data blocks (ignoring sparse holes) */
-        for (uint32_t e = 0; e < fe->extent_count; e++) {
-          struct file_extent *ext = &fe->extents[e];
-          if (ext->type != BTRFS_FILE_EXTENT_INLINE && ext->disk_bytenr != 0) {
-            data_blocks_required +=
-                (ext->num_bytes + block_size - 1) / block_size;
-          }
-        }
-      } else if (fe->mode & S_IFDIR) {
-        /* Base directory size */
-        data_blocks_required += (fe->size + block_size - 1) / block_size;
-      }
-    }
+  if (!ctx->quiet) {
+    printf("=== Ext4 Constraints & Pre-Calculation ===\n");
+    printf("  Device size:       %lu bytes (%.1f GiB)\n",
+           (unsigned long)device_size,
+           (double)device_size / (1024.0 * 1024.0 * 1024.0));
+    printf("  Block size:        %u\n", layout->block_size);
+    printf("  Total blocks:      %lu\n", (unsigned long)layout->total_blocks);
+    printf("  Blocks per group:  %u\n", layout->blocks_per_group);
+    printf("  Number of groups:  %u\n", layout->num_groups);
+    printf("  Inodes per group:  %u\n", layout->inodes_per_group);
+    printf("  Total inodes:      %u\n", layout->total_inodes);
+    printf("  Inode size:        %u\n", layout->inode_size);
   }
 
-  printf("=== Ext4 Constraints & Pre-Calculation ===\n");
-  printf("  Device size:       %lu bytes (%.1f GiB)\n",
-         (unsigned long)device_size,
-         (double)device_size / (1024.0 * 1024.0 * 1024.0));
-  printf("  Block size:        %u\n", layout->block_size);
-  printf("  Total blocks:      %lu\n", (unsigned long)layout->total_blocks);
-  printf("  Blocks per group:  %u\n", layout->blocks_per_group);
-  printf("  Number of groups:  %u\n", layout->num_groups);
-  printf("  Inodes per group:  %u\n", layout->inodes_per_group);
-  printf("  Total inodes:      %u\n", layout->total_inodes);
-  printf("  Inode size:        %u\n", layout->inode_size);
-
   /* Allocate group layouts */
   layout->groups = calloc(layout->num_groups, sizeof(struct ext4_bg_layout));
   if (!layout->groups) {
@@ -149,7 +284,9 @@ int ext4_plan_layout(struct ext4_layout *layout, uint64_t device_size,
 
   /* Reserved GDT blocks for future growth */
   uint32_t reserved_gdt = 0;
-  if (layout->total_blocks > 1024)
+  if (params->reserved_gdt != EXT4_PLAN_RESERVED_GDT_AUTO)
+    reserved_gdt = params->reserved_gdt;
+  else if (layout->total_blocks > 1024)
     reserved_gdt = gdt_blocks; /* Reserve same amount for growth */
 
   /* Inode table blocks per group */
@@ -157,16 +294,18 @@ int ext4_plan_layout(struct ext4_layout *layout, uint64_t device_size,
       (layout->inodes_per_group * layout->inode_size + block_size - 1) /
       block_size;
 
-  /* Initialize reserved blocks list */
-  layout->reserved_block_capacity = 1024;
-  layout->reserved_blocks =
-      calloc(layout->reserved_block_capacity, sizeof(uint64_t));
-  if (!layout->reserved_blocks) {
-    free(layout->groups);
-    return -1;
+  /* Initialize reserved blocks list; a search candidate only counts */
+  if (!ctx->quiet) {
+    layout->reserved_block_capacity = 1024;
+    layout->reserved_blocks =
+        calloc(layout->reserved_block_capacity, sizeof(uint64_t));
+    if (!layout->reserved_blocks) {
+      free(layout->groups);
+      return -1;
+    }
   }
 
-  /* Plan each block group */
+  /* Superblock and GDT copies first: they have fixed places */
   for (uint32_t g = 0; g < layout->num_groups; g++) {
     struct ext4_bg_layout *bg = &layout->groups[g];
     bg->group_start_block = (uint64_t)g * layout->blocks_per_group;
@@ -192,71 +331,94 @@ int ext4_plan_layout(struct ext4_layout *layout, uint64_t device_size,
       bg->reserved_gdt_blocks = reserved_gdt;
       cursor += reserved_gdt;
 
-      /* Mark these as reserved */
-      for (uint64_t b = first_block; b < cursor; b++) {
-        if (layout->reserved_block_count >= layout->reserved_block_capacity) {
-          uint32_t new_cap = layout->reserved_block_capacity * 2;
-          uint64_t *new_blocks =
-              realloc(layout->reserved_blocks, new_cap * sizeof(uint64_t));
-          if (!new_blocks) {
-            fprintf(stderr,
-                    "btrfs2ext4: OOM reallocating reserved blocks (gdt)\n");
-            free(layout->groups);
-            free(layout->reserved_blocks);
-            return -1;
-          }
-          layout->reserved_blocks = new_blocks;
-          layout->reserved_block_capacity = new_cap;
-        }
-        layout->reserved_blocks[layout->reserved_block_count++] = b;
+      if (layout_reserve(layout, first_block, cursor - first_block) < 0) {
+        free(layout->groups);
+        free(layout->reserved_blocks);
+        return -1;
       }
     }
+    bg->data_start_block = cursor;
+  }
 
-    /* Block bitmap (1 block) */
-    bg->block_bitmap_block = cursor;
-    cursor++;
-
-    /* Inode bitmap (1 block) */
-    bg->inode_bitmap_block = cursor;
-    cursor++;
-
-    /* Inode table */
-    bg->inode_table_start = cursor;
-    bg->inode_table_blocks = inode_table_blocks;
-    cursor += inode_table_blocks;
-
-    /* Mark bitmaps and inode table as reserved */
-    for (uint64_t b = bg->block_bitmap_block; b < cursor; b++) {
-      if (layout->reserved_block_count >= layout->reserved_block_capacity) {
-        uint32_t new_cap = layout->reserved_block_capacity * 2;
-        uint64_t *new_blocks =
-            realloc(layout->reserved_blocks, new_cap * sizeof(uint64_t));
-        if (!new_blocks) {
-          fprintf(stderr, "btrfs2ext4: OOM reallocating reserved blocks "
-                          "(bitmaps/itable)\n");
-          free(layout->groups);
-          free(layout->reserved_blocks);
-          return -1;
-        }
-        layout->reserved_blocks = new_blocks;
-        layout->reserved_block_capacity = new_cap;
+  /*
+   * Bitmaps and inode tables. Packed, a flex group's block bitmaps, inode
+   * bitmaps and inode tables follow each other in one run; otherwise, or
+   * when the run does not fit, each group keeps its own after its
+   * superblock and GDT.
+   */
+  const uint8_t *data = ctx->data;
+  uint32_t per_group = 2 + inode_table_blocks;
+  for (uint32_t first = 0; first < layout->num_groups;
+       first += EXT4_GROUPS_PER_FLEX) {
+    uint32_t n = layout->num_groups - first < EXT4_GROUPS_PER_FLEX
+                     ? layout->num_groups - first
+                     : EXT4_GROUPS_PER_FLEX;
+    uint64_t len = (uint64_t)n * per_group;
+    uint64_t cost = 0;
+    uint64_t start = params->flex_pack
+                         ? flex_place(layout, first, n, len, data, &cost)
+                         : UINT64_MAX;
+    if (start != UINT64_MAX) {
+      uint64_t def = layout->groups[first].data_start_block;
+      for (uint64_t b = def; data && b < def + len; b++)
+        ctx->default_cost += data_bit(data, b);
+      ctx->chosen_cost += cost;
+      ctx->packed++;
+      for (uint32_t i = 0; i < n; i++) {
+        struct ext4_bg_layout *bg = &layout->groups[first + i];
+        bg->block_bitmap_block = start + i;
+        bg->inode_bitmap_block = start + n + i;
+        bg->inode_table_start =
+            start + 2 * n + (uint64_t)i * inode_table_blocks;
+        bg->inode_table_blocks = inode_table_blocks;
+
+        /* Data runs from the end of the group's superblock and GDT (or of
+         * the packed run, if it starts there) to the end of the group,
+         * less what of the run lies in between */
+        uint64_t group_end = group_end_block(layout, first + i);
+        uint64_t run_end = start + len < group_end ? start + len : group_end;
+        if (bg->data_start_block >= start && bg->data_start_block < run_end)
+          bg->data_start_block = run_end;
+        uint64_t from = start > bg->data_start_block ? start
+                                                     : bg->data_start_block;
+        uint64_t inside = run_end > from ? run_end - from : 0;
+        bg->data_blocks =
+            (uint32_t)(group_end - bg->data_start_block - inside);
       }
-      layout->reserved_blocks[layout->reserved_block_count++] = b;
+      if (layout_reserve(layout, start, len) < 0)
+        goto fail;
+      continue;
     }
 
-    /* Remaining blocks are data */
-    uint64_t group_end = bg->group_start_block + layout->blocks_per_group;
-    if (group_end > layout->total_blocks)
-      group_end = layout->total_blocks;
-
-    bg->data_start_block = cursor;
-    bg->data_blocks = (cursor < group_end) ? (uint32_t)(group_end - cursor) : 0;
+    for (uint32_t g = first; g < first + n; g++) {
+      struct ext4_bg_layout *bg = &layout->groups[g];
+      bg->block_bitmap_block = bg->data_start_block;
+      bg->inode_bitmap_block = bg->data_start_block + 1;
+      bg->inode_table_start = bg->data_start_block + 2;
+      bg->inode_table_blocks = inode_table_blocks;
+      if (layout_reserve(layout, bg->data_start_block, per_group) < 0)
+        goto fail;
+      bg->data_start_block += per_group;
+
+      uint64_t group_end = group_end_block(layout, g);
+      bg->data_blocks = group_end > bg->data_start_block
+                            ? (uint32_t)(group_end - bg->data_start_block)
+                            : 0;
+    }
+  }
+  uint64_t data_blocks_required = ctx->data_required;
+  if (!ctx->quiet) {
+    if (ctx->packed > 0)
+      printf("  Flex groups:       %u packed (%u groups each), %lu Btrfs "
+             "data blocks under metadata (%lu at the default place)\n",
+             ctx->packed, EXT4_GROUPS_PER_FLEX,
+             (unsigned long)ctx->chosen_cost,
+             (unsigned long)ctx->default_cost);
+    printf("  Reserved blocks:   %u (metadata zones)\n",
+           layout->reserved_block_count);
+    printf("  Data blocks req:   %lu (files, index, dirs)\n",
+           (unsigned long)data_blocks_required);
   }
-
-  printf("  Reserved blocks:   %u (metadata zones)\n",
-         layout->reserved_block_count);
-  printf("  Data blocks req:   %lu (files, index, dirs)\n",
-         (unsigned long)data_blocks_required);
 
   /*
    * Phase 2.2: Deadlock Prevention (The 5% Rule)
@@ -265,6 +427,8 @@ int ext4_plan_layout(struct ext4_layout *layout, uint64_t device_size,
   uint64_t physically_usable =
       layout->total_blocks - layout->reserved_block_count;
   if (data_blocks_required >= physically_usable) {
+    if (ctx->quiet)
+      goto fail;
     fprintf(stderr,
             "\n[FATAL] btrfs2ext4: Insufficient space for conversion!\n");
     fprintf(stderr, "  Total blocks: %lu\n",
@@ -272,15 +436,15 @@ int ext4_plan_layout(struct ext4_layout *layout, uint64_t device_size,
     fprintf(stderr, "  Metadata rsrv:%u\n", layout->reserved_block_count);
     fprintf(stderr, "  Data to write:%lu\n",
             (unsigned long)data_blocks_required);
-    free(layout->groups);
-    free(layout->reserved_blocks);
-    return -1;
+    goto fail;
   }
 
   uint64_t free_blocks = physically_usable - data_blocks_required;
   uint64_t margin = layout->total_blocks / 20; /* 5% */
 
   if (free_blocks < margin && margin > 0) {
+    if (ctx->quiet)
+      goto fail;
     fprintf(stderr, "\n[FATAL] btrfs2ext4: Conversion blocked by Deadlock "
                     "Prevention Rule!\n");
     fprintf(stderr,
@@ -288,17 +452,315 @@ int ext4_plan_layout(struct ext4_layout *layout, uint64_t device_size,
             "5%% (%lu MiB).\n",
             (unsigned long)(free_blocks * block_size) / (1024 * 1024),
             (unsigned long)(margin * block_size) / (1024 * 1024));
-    free(layout->groups);
-    free(layout->reserved_blocks);
-    return -1;
+    goto fail;
   }
 
-  printf("  Free Space Margin: %lu blocks (%.1f MiB)\n",
-         (unsigned long)free_blocks,
-         (double)(free_blocks * block_size) / (1024.0 * 1024.0));
-  printf("========================\n\n");
-
+  if (!ctx->quiet) {
+    printf("  Free Space Margin: %lu blocks (%.1f MiB)\n",
+           (unsigned long)free_blocks,
+           (double)(free_blocks * block_size) / (1024.0 * 1024.0));
+    printf("========================\n\n");
+  }
   return 0;
+
+fail:
+  free(layout->groups);
+  free(layout->reserved_blocks);
+  memset(layout, 0, sizeof(*layout));
+  return -1;
+}
+
+int ext4_plan_layout_params(struct ext4_layout *layout, uint64_t device_size,
+                            uint32_t block_size,
+                            const struct ext4_plan_params *params,
+                            const struct btrfs_fs_info *fs_info) {
+  if (block_size == 0)
+    block_size = EXT4_DEFAULT_BLOCK_SIZE;
+  struct plan_ctx ctx;
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.fs_info = fs_info;
+  ctx.data_required = plan_data_required(fs_info, block_size);
+  uint8_t *data = NULL;
+  if (params->flex_pack && device_size >= block_size) {
+    data = plan_data_bitmap(fs_info, block_size, device_size / block_size);
+    ctx.data = data;
+  }
+  int ret = plan_geometry(layout, device_size, block_size, params, &ctx);
+  free(data);
+  return ret;
+}
+
+int ext4_plan_layout(struct ext4_layout *layout, uint64_t device_size,
+                     uint32_t block_size, uint32_t inode_ratio,
+                     const struct btrfs_fs_info *fs_info) {
+  struct ext4_plan_params params = {
+      .inode_ratio = inode_ratio,
+      .reserved_gdt = EXT4_PLAN_RESERVED_GDT_AUTO,
+      .flex_pack = g_flex_pack,
+  };
+  return ext4_plan_layout_params(layout, device_size, block_size, &params,
+                                 fs_info);
+}
+
+/* ========================================================================
+ * Layout search
+ * ======================================================================== */
+
+/* A stretch of a candidate's metadata, [start, end) */
+struct plan_run {
+  uint64_t start;
+  uint64_t end;
+};
+
+static int plan_run_cmp(const void *a, const void *b) {
+  const struct plan_run *x = a, *y = b;
+  return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* The layout's metadata as sorted, merged runs, from the group table, so a
+ * candidate never needs its reserved block list */
+static struct plan_run *plan_layout_runs(const struct ext4_layout *layout,
+                                         uint32_t *count) {
+  struct plan_run *runs = malloc((size_t)layout->num_groups * 4 *
+                                 sizeof(*runs));
+  if (!runs)
+    return NULL;
+  uint32_t n = 0;
+  for (uint32_t g = 0; g < layout->num_groups; g++) {
+    const struct ext4_bg_layout *bg = &layout->groups[g];
+    if (bg->has_super)
+      runs[n++] = (struct plan_run){bg->superblock_block,
+                                    bg->superblock_block + 1 +
+                                        bg->gdt_blocks +
+                                        bg->reserved_gdt_blocks};
+    runs[n++] = (struct plan_run){bg->block_bitmap_block,
+                                  bg->block_bitmap_block + 1};
+    runs[n++] = (struct plan_run){bg->inode_bitmap_block,
+                                  bg->inode_bitmap_block + 1};
+    runs[n++] = (struct plan_run){bg->inode_table_start,
+                                  bg->inode_table_start +
+                                      bg->inode_table_blocks};
+  }
+  qsort(runs, n, sizeof(*runs), plan_run_cmp);
+  uint32_t m = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    if (m > 0 && runs[i].start <= runs[m - 1].end) {
+      if (runs[i].end > runs[m - 1].end)
+        runs[m - 1].end = runs[i].end;
+    } else {
+      runs[m++] = runs[i];
+    }
+  }
+  *count = m;
+  return runs;
+}
+
+/* Btrfs extents over the metadata runs, and the bytes the relocator would
+ * copy for them: whole extents, nothing for preallocated ones */
+static void plan_score(const struct plan_run *runs, uint32_t nruns,
+                       uint32_t block_size,
+                       const struct btrfs_fs_info *fs_info,
+                       struct ext4_plan_candidate *c) {
+  for (uint32_t i = 0; i < fs_info->inode_count; i++) {
+    struct extent_iter it;
+    const struct file_extent *ext;
+    extent_iter_init(&it, fs_info, fs_info->inode_table[i]);
+    while ((ext = extent_iter_next(&it)) != NULL) {
+      if (ext->type == BTRFS_FILE_EXTENT_INLINE || ext->disk_bytenr == 0)
+        continue;
+      uint64_t phys = chunk_map_resolve(fs_info->chunk_map, ext->disk_bytenr);
+      if (phys == (uint64_t)-1)
+        continue;
+      uint64_t first = phys / block_size;
+      uint64_t end = (phys + ext->disk_num_bytes + block_size - 1) / block_size;
+
+      /* First run ending past the extent's start */
+      uint32_t lo = 0, hi = nruns;
+      while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (runs[mid].end <= first)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      if (lo < nruns && runs[lo].start < end) {
+        c->conflicts++;
+        if (ext->type != BTRFS_FILE_EXTENT_PREALLOC)
+          c->reloc_bytes += ext->disk_num_bytes;
+      }
+    }
+  }
+}
+
+struct plan_search_task {
+  uint64_t device_size;
+  uint32_t block_size;
+  const struct plan_ctx *base;
+  struct ext4_plan_candidate *cand;
+};
+
+static void plan_search_task(void *arg) {
+  struct plan_search_task *t = arg;
+  struct ext4_plan_candidate *c = t->cand;
+  struct plan_ctx ctx = *t->base;
+  struct ext4_layout layout;
+  if (plan_geometry(&layout, t->device_size, t->block_size, &c->params,
+                    &ctx) < 0)
+    return;
+  c->total_inodes = layout.total_inodes;
+  c->reserved_blocks = layout.reserved_block_count;
+  uint32_t nruns = 0;
+  struct plan_run *runs = plan_layout_runs(&layout, &nruns);
+  if (runs) {
+    if (ctx.fs_info)
+      plan_score(runs, nruns, layout.block_size, ctx.fs_info, c);
+    c->ok = 1;
+    free(runs);
+  }
+  ext4_free_layout(&layout);
+}
+
+static void plan_search_add(struct ext4_plan_search *s, uint32_t inode_ratio,
+                            uint32_t reserved_gdt, int flex_pack) {
+  if (s->count >= EXT4_PLAN_SEARCH_MAX)
+    return;
+  struct ext4_plan_candidate *c = &s->cand[s->count++];
+  memset(c, 0, sizeof(*c));
+  c->params.inode_ratio = inode_ratio;
+  c->params.reserved_gdt = reserved_gdt;
+  c->params.flex_pack = flex_pack;
+}
+
+int ext4_plan_search(struct ext4_plan_search *s, uint64_t device_size,
+                     uint32_t block_size,
+                     const struct ext4_plan_params *base,
+                     uint32_t max_inode_ratio,
+                     const struct btrfs_fs_info *fs_info) {
+  memset(s, 0, sizeof(*s));
+  if (block_size == 0)
+    block_size = EXT4_DEFAULT_BLOCK_SIZE;
+  uint32_t ratio = base->inode_ratio ? base->inode_ratio
+                                     : EXT4_DEFAULT_INODE_RATIO;
+  if (max_inode_ratio < ratio)
+    max_inode_ratio = ratio;
+
+  /* Most preferred first: the configured layout, then fewer inodes, then
+   * no reserved GDT, then no packing. Ties keep the earlier one. */
+  uint32_t ratios[8];
+  uint32_t nratios = 0;
+  for (uint64_t r = ratio; r <= max_inode_ratio && nratios < 7; r *= 2)
+    ratios[nratios++] = (uint32_t)r;
+  if (ratios[nratios - 1] != max_inode_ratio)
+    ratios[nratios++] = max_inode_ratio;
+  for (uint32_t i = 0; i < nratios; i++) {
+    plan_search_add(s, ratios[i], base->reserved_gdt, base->flex_pack);
+    if (base->reserved_gdt != 0)
+      plan_search_add(s, ratios[i], 0, base->flex_pack);
+    if (base->flex_pack) {
+      plan_search_add(s, ratios[i], base->reserved_gdt, 0);
+      if (base->reserved_gdt != 0)
+        plan_search_add(s, ratios[i], 0, 0);
+    }
+  }
+
+  struct plan_ctx ctx;
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.fs_info = fs_info;
+  ctx.quiet = 1;
+  ctx.data_required = plan_data_required(fs_info, block_size);
+  uint8_t *data =
+      device_size >= block_size
+          ? plan_data_bitmap(fs_info, block_size, device_size / block_size)
+          : NULL;
+  ctx.data = data;
+
+  struct plan_search_task tasks[EXT4_PLAN_SEARCH_MAX];
+  struct thread_pool_wait_group *wg = thread_pool_wg_create();
+  uint32_t threads = thread_pool_default_threads();
+  if (threads > s->count)
+    threads = s->count;
+  struct thread_pool *pool =
+      wg && threads > 1 ? thread_pool_create(threads, s->count) : NULL;
+  s->threads = pool ? threads : 1;
+  for (uint32_t i = 0; i < s->count; i++) {
+    tasks[i] = (struct plan_search_task){device_size, block_size, &ctx,
+                                         &s->cand[i]};
+    if (wg)
+      thread_pool_wg_add(wg, 1);
+    if (!pool ||
+        thread_pool_submit(pool, plan_search_task, &tasks[i], wg) < 0) {
+      /* Inline fallback if the pool is missing or full */
+      if (wg)
+        thread_pool_wg_done(wg);
+      plan_search_task(&tasks[i]);
+    }
+  }
+  if (wg) {
+    thread_pool_wg_wait(wg);
+    thread_pool_wg_destroy(wg);
+  }
+  if (pool)
+    thread_pool_destroy(pool);
+  free(data);
+
+  int found = 0;
+  for (uint32_t i = 0; i < s->count; i++) {
+    const struct ext4_plan_candidate *c = &s->cand[i];
+    if (c->ok && (!found || c->reloc_bytes < s->cand[s->chosen].reloc_bytes)) {
+      s->chosen = i;
+      found = 1;
+    }
+  }
+  return found ? 0 : -1;
+}
+
+static void plan_search_describe(char *buf, size_t len,
+                                 const struct ext4_plan_params *p) {
+  char rsv[16];
+  if (p->reserved_gdt == EXT4_PLAN_RESERVED_GDT_AUTO)
+    snprintf(rsv, sizeof(rsv), "auto");
+  else
+    snprintf(rsv, sizeof(rsv), "%u", p->reserved_gdt);
+  snprintf(buf, len, "%-11u  %-7s  %-4s", p->inode_ratio, rsv,
+           p->flex_pack ? "on" : "off");
+}
+
+void ext4_plan_search_report(const struct ext4_plan_search *s) {
+  const struct ext4_plan_candidate *base = &s->cand[0];
+  const struct ext4_plan_candidate *best = &s->cand[s->chosen];
+  char desc[64];
+
+  printf("=== Layout Search ===\n");
+  printf("  Candidates:        %u on %u thread%s\n", s->count, s->threads,
+         s->threads == 1 ? "" : "s");
+  printf("  inode ratio  rsv GDT  flex  inodes      conflicts  relocate\n");
+  for (uint32_t i = 0; i < s->count; i++) {
+    const struct ext4_plan_candidate *c = &s->cand[i];
+    plan_search_describe(desc, sizeof(desc), &c->params);
+    if (!c->ok) {
+      printf("  %s  (does not fit)\n", desc);
+      continue;
+    }
+    printf("  %s  %-10u  %-9lu  %8.1f MiB%s\n", desc, c->total_inodes,
+           (unsigned long)c->conflicts,
+           (double)c->reloc_bytes / (1024.0 * 1024.0),
+           i == s->chosen ? "  <- chosen" : i == 0 ? "  (configured)" : "");
+  }
+  if (s->chosen == 0) {
+    printf("  Keeping the configured layout\n");
+  } else if (!base->ok) {
+    printf("  Chosen:            the configured layout does not fit\n");
+  } else {
+    printf("  Chosen:            %.1f MiB less to relocate",
+           (double)(base->reloc_bytes - best->reloc_bytes) /
+               (1024.0 * 1024.0));
+    if (best->total_inodes < base->total_inodes)
+      printf(", %u fewer inodes", base->total_inodes - best->total_inodes);
+    if (best->params.reserved_gdt == 0 && base->params.reserved_gdt != 0)
+      printf(", no reserved GDT for growth");
+    printf("\n");
+  }
+  printf("=====================\n\n");
 }
 
 uint32_t ext4_find_conflicts(const struct ext4_layout *layout,
@@ -326,9 +788,10 @@ uint32_t ext4_find_conflicts(const struct ext4_layout *layout,
 
   /* For each file entry in the btrfs filesystem */
   for (uint32_t i = 0; i < fs_info->inode_count; i++) {
-    const struct file_entry *fe = fs_info->inode_table[i];
-    for (uint32_t j = 0; j < fe->extent_count; j++) {
-      const struct file_extent *ext = &fe->extents[j];
+    struct extent_iter it;
+    const struct file_extent *ext;
+    extent_iter_init(&it, fs_info, fs_info->inode_table[i]);
+    while ((ext = extent_iter_next(&it)) != NULL) {
       if (ext->type == BTRFS_FILE_EXTENT_INLINE || ext->disk_bytenr == 0)
         continue;
 
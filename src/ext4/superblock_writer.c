@@ -92,6 +92,12 @@ int ext4_write_superblock(struct device *dev, const struct ext4_layout *layout,
   /* Generate UUID */
   uuid_generate(sb.s_uuid);
 
+  /* metadata_csum is crc32c; with CSUM_SEED the seed is stored rather than
+   * derived from the UUID, so store what the UUID would give (the kernel's
+   * ext4_chksum(~0, uuid), i.e. the un-inverted crc32c) */
+  sb.s_checksum_type = EXT4_CRC32C_CHKSUM;
+  sb.s_checksum_seed = htole32(~crc32c(0, sb.s_uuid, sizeof(sb.s_uuid)));
+
   /* Volume name — copy from btrfs label if available */
   if (fs_info->sb.label[0]) {
     strncpy(sb.s_volume_name, fs_info->sb.label, EXT4_LABEL_MAX - 1);
@@ -115,11 +121,14 @@ int ext4_write_superblock(struct device *dev, const struct ext4_layout *layout,
   sb.s_want_extra_isize = htole16(32);
 
   /* Flex block group size: 16 groups per flex */
-  sb.s_log_groups_per_flex = 4; /* 2^4 = 16 */
+  sb.s_log_groups_per_flex = EXT4_LOG_GROUPS_PER_FLEX; /* 2^4 = 16 */
 
-  /* Reserved GDT blocks */
+  /* Reserved GDT blocks; a layout without them (--layout-search) cannot
+   * claim the resize inode */
   sb.s_reserved_gdt_blocks =
       htole16((uint16_t)layout->groups[0].reserved_gdt_blocks);
+  if (layout->groups[0].reserved_gdt_blocks == 0)
+    sb.s_feature_compat &= ~htole32(EXT4_FEATURE_COMPAT_RESIZE_INODE);
 
   /* Write primary superblock at offset 1024 */
   printf("Writing ext4 superblock at offset %u...\n", EXT4_SUPER_OFFSET);
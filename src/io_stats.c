@@ -0,0 +1,326 @@
+/*
+ * io_stats.c — Per-phase I/O and CPU statistics
+ *
+ * Each thread that issues I/O gets a counter block on first use and links
+ * it into a global list (the only lock taken, once per thread). Blocks of
+ * exited threads keep their counts and are handed to the next new thread,
+ * so thread pools created per phase do not grow the list. The hot path is
+ * a relaxed load and store on the thread's own block.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "io_stats.h"
+
+enum io_counter {
+  IO_CTR_READ_OPS,
+  IO_CTR_READ_BYTES,
+  IO_CTR_WRITE_OPS,
+  IO_CTR_WRITE_BYTES,
+  IO_CTR_SYSCALLS,
+  IO_CTR_FSYNCS,
+  IO_CTR_URING_SUBMITS,
+  IO_CTR_URING_SQES,
+  IO_CTR_SEEK_BYTES,
+  IO_CTR_COUNT
+};
+
+#define IO_NO_LAST UINT64_MAX
+
+struct io_thread_stats {
+  uint64_t c[IO_PHASE_COUNT][IO_CTR_COUNT];
+  uint64_t last_end; /* end of this thread's last request */
+  int live;          /* owned by a running thread */
+  struct io_thread_stats *next;
+};
+
+static struct io_thread_stats *g_blocks;
+static pthread_mutex_t g_blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t g_key;
+static pthread_once_t g_key_once = PTHREAD_ONCE_INIT;
+static __thread struct io_thread_stats *t_stats;
+
+static int g_phase = IO_PHASE_SETUP;
+
+/* Time charged to each phase, and where the current phase started */
+struct io_clock {
+  double wall, user, sys;
+};
+static struct io_clock g_spent[IO_PHASE_COUNT];
+static struct io_clock g_mark;
+static int g_marked;
+
+static const char *const g_phase_names[IO_PHASE_COUNT] = {
+    [IO_PHASE_SETUP] = "setup",
+    [IO_PHASE_SCAN] = "scan",
+    [IO_PHASE_PLAN] = "plan",
+    [IO_PHASE_RELOCATE] = "relocate",
+    [IO_PHASE_METADATA] = "metadata",
+    [IO_PHASE_INODES] = "inode_tables",
+    [IO_PHASE_DIRS] = "directories",
+    [IO_PHASE_JOURNAL] = "journal",
+};
+
+static void io_thread_exit(void *arg) {
+  struct io_thread_stats *s = arg;
+  __atomic_store_n(&s->live, 0, __ATOMIC_RELEASE);
+}
+
+static void io_key_create(void) { pthread_key_create(&g_key, io_thread_exit); }
+
+static struct io_thread_stats *io_thread_block(void) {
+  if (t_stats)
+    return t_stats;
+
+  pthread_once(&g_key_once, io_key_create);
+  pthread_mutex_lock(&g_blocks_lock);
+  struct io_thread_stats *s = g_blocks;
+  while (s && __atomic_load_n(&s->live, __ATOMIC_ACQUIRE))
+    s = s->next;
+  if (!s) {
+    s = calloc(1, sizeof(*s));
+    if (!s) {
+      pthread_mutex_unlock(&g_blocks_lock);
+      return NULL;
+    }
+    s->next = g_blocks;
+    g_blocks = s;
+  }
+  s->live = 1;
+  s->last_end = IO_NO_LAST;
+  pthread_mutex_unlock(&g_blocks_lock);
+
+  pthread_setspecific(g_key, s);
+  t_stats = s;
+  return s;
+}
+
+/* Only the owning thread writes a block; collectors read it concurrently */
+static inline void io_bump(uint64_t *p, uint64_t v) {
+  __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + v,
+                   __ATOMIC_RELAXED);
+}
+
+static inline uint64_t *io_counters(void) {
+  struct io_thread_stats *s = io_thread_block();
+  if (!s)
+    return NULL;
+  return s->c[__atomic_load_n(&g_phase, __ATOMIC_RELAXED)];
+}
+
+static void io_request(int ops, int bytes_ctr, uint64_t offset,
+                       uint64_t bytes) {
+  uint64_t *c = io_counters();
+  if (!c)
+    return;
+  io_bump(&c[ops], 1);
+  io_bump(&c[bytes_ctr], bytes);
+  if (t_stats->last_end != IO_NO_LAST)
+    io_bump(&c[IO_CTR_SEEK_BYTES], offset > t_stats->last_end
+                                       ? offset - t_stats->last_end
+                                       : t_stats->last_end - offset);
+  t_stats->last_end = offset + bytes;
+}
+
+void io_stats_read(uint64_t offset, uint64_t bytes) {
+  io_request(IO_CTR_READ_OPS, IO_CTR_READ_BYTES, offset, bytes);
+}
+
+void io_stats_write(uint64_t offset, uint64_t bytes) {
+  io_request(IO_CTR_WRITE_OPS, IO_CTR_WRITE_BYTES, offset, bytes);
+}
+
+uint64_t io_stats_last_offset(void) {
+  return t_stats ? t_stats->last_end : IO_NO_LAST;
+}
+
+void io_stats_syscall(void) {
+  uint64_t *c = io_counters();
+  if (c)
+    io_bump(&c[IO_CTR_SYSCALLS], 1);
+}
+
+void io_stats_fsync(void) {
+  uint64_t *c = io_counters();
+  if (!c)
+    return;
+  io_bump(&c[IO_CTR_SYSCALLS], 1);
+  io_bump(&c[IO_CTR_FSYNCS], 1);
+}
+
+void io_stats_uring_submit(uint32_t sqes) {
+  uint64_t *c = io_counters();
+  if (!c)
+    return;
+  io_bump(&c[IO_CTR_SYSCALLS], 1);
+  io_bump(&c[IO_CTR_URING_SUBMITS], 1);
+  io_bump(&c[IO_CTR_URING_SQES], sqes);
+}
+
+static struct io_clock io_clock_now(void) {
+  struct io_clock now = {0, 0, 0};
+  struct timespec ts;
+  struct rusage ru;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  now.wall = (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+  if (getrusage(RUSAGE_SELF, &ru) == 0) {
+    now.user = (double)ru.ru_utime.tv_sec + (double)ru.ru_utime.tv_usec / 1e6;
+    now.sys = (double)ru.ru_stime.tv_sec + (double)ru.ru_stime.tv_usec / 1e6;
+  }
+  return now;
+}
+
+void io_stats_phase(enum io_phase phase) {
+  if ((unsigned)phase >= IO_PHASE_COUNT)
+    phase = IO_PHASE_SETUP;
+
+  struct io_clock now = io_clock_now();
+  if (g_marked) {
+    struct io_clock *t = &g_spent[g_phase];
+    t->wall += now.wall - g_mark.wall;
+    t->user += now.user - g_mark.user;
+    t->sys += now.sys - g_mark.sys;
+  }
+  g_mark = now;
+  g_marked = 1;
+  __atomic_store_n(&g_phase, (int)phase, __ATOMIC_RELAXED);
+}
+
+void io_stats_collect(struct io_phase_stats out[IO_PHASE_COUNT]) {
+  uint64_t sum[IO_PHASE_COUNT][IO_CTR_COUNT];
+  memset(sum, 0, sizeof(sum));
+
+  pthread_mutex_lock(&g_blocks_lock);
+  for (struct io_thread_stats *s = g_blocks; s; s = s->next)
+    for (unsigned p = 0; p < IO_PHASE_COUNT; p++)
+      for (unsigned k = 0; k < IO_CTR_COUNT; k++)
+        sum[p][k] += __atomic_load_n(&s->c[p][k], __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&g_blocks_lock);
+
+  struct io_clock now = io_clock_now();
+  for (unsigned p = 0; p < IO_PHASE_COUNT; p++) {
+    struct io_phase_stats *o = &out[p];
+    o->read_ops = sum[p][IO_CTR_READ_OPS];
+    o->read_bytes = sum[p][IO_CTR_READ_BYTES];
+    o->write_ops = sum[p][IO_CTR_WRITE_OPS];
+    o->write_bytes = sum[p][IO_CTR_WRITE_BYTES];
+    o->syscalls = sum[p][IO_CTR_SYSCALLS];
+    o->fsyncs = sum[p][IO_CTR_FSYNCS];
+    o->uring_submits = sum[p][IO_CTR_URING_SUBMITS];
+    o->uring_sqes = sum[p][IO_CTR_URING_SQES];
+    o->seek_bytes = sum[p][IO_CTR_SEEK_BYTES];
+    o->wall_sec = g_spent[p].wall;
+    o->user_sec = g_spent[p].user;
+    o->sys_sec = g_spent[p].sys;
+    if (g_marked && (int)p == g_phase) {
+      o->wall_sec += now.wall - g_mark.wall;
+      o->user_sec += now.user - g_mark.user;
+      o->sys_sec += now.sys - g_mark.sys;
+    }
+  }
+}
+
+void io_stats_reset(void) {
+  pthread_mutex_lock(&g_blocks_lock);
+  for (struct io_thread_stats *s = g_blocks; s; s = s->next) {
+    for (unsigned p = 0; p < IO_PHASE_COUNT; p++)
+      for (unsigned k = 0; k < IO_CTR_COUNT; k++)
+        __atomic_store_n(&s->c[p][k], 0, __ATOMIC_RELAXED);
+    s->last_end = IO_NO_LAST;
+  }
+  pthread_mutex_unlock(&g_blocks_lock);
+
+  memset(g_spent, 0, sizeof(g_spent));
+  g_marked = 0;
+  __atomic_store_n(&g_phase, IO_PHASE_SETUP, __ATOMIC_RELAXED);
+}
+
+const char *io_phase_name(enum io_phase phase) {
+  if ((unsigned)phase >= IO_PHASE_COUNT)
+    return "unknown";
+  return g_phase_names[phase];
+}
+
+static void io_stats_add(struct io_phase_stats *total,
+                         const struct io_phase_stats *s) {
+  total->read_ops += s->read_ops;
+  total->read_bytes += s->read_bytes;
+  total->write_ops += s->write_ops;
+  total->write_bytes += s->write_bytes;
+  total->syscalls += s->syscalls;
+  total->fsyncs += s->fsyncs;
+  total->uring_submits += s->uring_submits;
+  total->uring_sqes += s->uring_sqes;
+  total->seek_bytes += s->seek_bytes;
+  total->wall_sec += s->wall_sec;
+  total->user_sec += s->user_sec;
+  total->sys_sec += s->sys_sec;
+}
+
+static int io_stats_json_one(FILE *f, const char *name,
+                             const struct io_phase_stats *s) {
+  return fprintf(f,
+                 "{\"name\": \"%s\", \"wall_sec\": %.6f, \"user_sec\": %.6f, "
+                 "\"sys_sec\": %.6f, \"read_ops\": %lu, \"read_bytes\": %lu, "
+                 "\"write_ops\": %lu, \"write_bytes\": %lu, "
+                 "\"syscalls\": %lu, \"fsyncs\": %lu, "
+                 "\"uring_submits\": %lu, \"uring_sqes\": %lu, "
+                 "\"seek_bytes\": %lu}",
+                 name, s->wall_sec, s->user_sec, s->sys_sec,
+                 (unsigned long)s->read_ops, (unsigned long)s->read_bytes,
+                 (unsigned long)s->write_ops, (unsigned long)s->write_bytes,
+                 (unsigned long)s->syscalls, (unsigned long)s->fsyncs,
+                 (unsigned long)s->uring_submits,
+                 (unsigned long)s->uring_sqes,
+                 (unsigned long)s->seek_bytes) < 0;
+}
+
+int io_stats_print(FILE *f, int format) {
+  struct io_phase_stats st[IO_PHASE_COUNT], total;
+  io_stats_collect(st);
+  memset(&total, 0, sizeof(total));
+  for (unsigned p = 0; p < IO_PHASE_COUNT; p++)
+    io_stats_add(&total, &st[p]);
+
+  int err = 0;
+  if (format == IO_STATS_JSON) {
+    err |= fprintf(f, "{\"phases\": [") < 0;
+    for (unsigned p = 0; p < IO_PHASE_COUNT; p++) {
+      err |= fprintf(f, "%s", p ? ", " : "") < 0;
+      err |= io_stats_json_one(f, g_phase_names[p], &st[p]);
+    }
+    err |= fprintf(f, "], \"total\": ") < 0;
+    err |= io_stats_json_one(f, "total", &total);
+    err |= fprintf(f, "}\n") < 0;
+    return err ? -1 : 0;
+  }
+
+  err |= fprintf(f, "\n=== I/O Statistics ===\n"
+                    "  %-13s %8s %8s %8s %10s %10s %9s %7s %10s\n",
+                 "phase", "wall s", "user s", "sys s", "read MiB",
+                 "write MiB", "syscalls", "syncs", "seek GiB") < 0;
+  for (unsigned p = 0; p <= IO_PHASE_COUNT; p++) {
+    const struct io_phase_stats *s = p < IO_PHASE_COUNT ? &st[p] : &total;
+    if (p < IO_PHASE_COUNT && s->syscalls == 0 && s->read_ops == 0 &&
+        s->write_ops == 0 && s->wall_sec < 0.0005)
+      continue;
+    err |= fprintf(f, "  %-13s %8.2f %8.2f %8.2f %10.1f %10.1f %9lu %7lu "
+                      "%10.2f\n",
+                   p < IO_PHASE_COUNT ? g_phase_names[p] : "total",
+                   s->wall_sec, s->user_sec, s->sys_sec,
+                   (double)s->read_bytes / (1024.0 * 1024.0),
+                   (double)s->write_bytes / (1024.0 * 1024.0),
+                   (unsigned long)s->syscalls, (unsigned long)s->fsyncs,
+                   (double)s->seek_bytes / (1024.0 * 1024.0 * 1024.0)) < 0;
+  }
+  if (total.uring_submits)
+    err |= fprintf(f, "  io_uring: %lu requests in %lu submissions\n",
+                   (unsigned long)total.uring_sqes,
+                   (unsigned long)total.uring_submits) < 0;
+  return err ? -1 : 0;
+}
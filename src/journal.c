@@ -1,14 +1,19 @@
 /*
- * journal.c — Crash-recovery journal (stub for v1)
+ * journal.c — Crash-recovery journal for the block relocator
  *
- * A minimal journaling implementation for the block relocator.
- * In v1, this provides basic write-ahead logging for relocation ops.
+ * Write-ahead log for relocation ops. Entries are staged in memory and
+ * committed in groups: each group is written as one contiguous,
+ * block-aligned record carrying a batch CRC, followed by a single fsync.
+ * Journals written by v1 (one entry per slot, fsync per entry) are still
+ * understood by journal_check() and the replay functions.
  */
 
 #include <endian.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "device_io.h"
 #include "journal.h"
@@ -17,57 +22,286 @@
 /* CRC32C from superblock.c */
 extern uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
 
+/* v1 header ended at the checksum field; entries followed immediately */
+#define JOURNAL_V1_HEADER_SIZE offsetof(struct journal_header, nonce)
+
+/* Limit each replay chunk to 16 MiB para evitar OOM en footers corruptos. */
+#define MAX_JOURNAL_CHUNK (16ULL * 1024 * 1024)
+
+/* Sanity cap on a single group record read back during recovery */
+#define JOURNAL_MAX_GROUP_ENTRIES (1U << 20)
+
 static uint64_t g_journal_offset = 0;
 static uint32_t g_journal_entries = 0;
+static uint32_t g_journal_groups = 0;
+static uint32_t g_journal_nonce = 0;
+static uint64_t g_next_record = 0; /* device offset of the next group record */
+
+/* Group-commit window and staging area */
+static uint32_t g_window_entries = JOURNAL_DEFAULT_GROUP_ENTRIES;
+static uint64_t g_window_bytes = JOURNAL_DEFAULT_GROUP_BYTES;
+static uint32_t g_window_ms = JOURNAL_DEFAULT_GROUP_MS;
+
+static struct relocation_entry *g_staged = NULL;
+static uint32_t g_staged_count = 0;
+static uint32_t g_staged_capacity = 0;
+static uint64_t g_staged_bytes = 0;
+static struct timespec g_staged_since;
+
+/* seq → device offset of the committed entry, for journal_mark_complete() */
+struct journal_seq_slot {
+  uint64_t offset; /* 0 = empty (never a valid entry offset) */
+  uint32_t seq;
+};
+static struct journal_seq_slot *g_seq_index = NULL;
+static uint32_t g_seq_index_cap = 0;
+static uint32_t g_seq_index_count = 0;
 
 uint64_t journal_current_offset(void) { return g_journal_offset; }
 
-int journal_init(struct device *dev, uint64_t journal_offset) {
-  g_journal_offset = journal_offset;
-  g_journal_entries = 0;
+static uint32_t journal_header_csum(struct journal_header hdr) {
+  size_t len = le32toh(hdr.version) >= JOURNAL_VERSION_GROUPED
+                   ? sizeof(hdr)
+                   : JOURNAL_V1_HEADER_SIZE;
+  hdr.checksum = 0;
+  return crc32c(0, &hdr, len);
+}
 
+static int journal_write_header(struct device *dev, uint32_t state) {
   struct journal_header hdr;
   memset(&hdr, 0, sizeof(hdr));
   hdr.magic = htole32(JOURNAL_MAGIC);
-  hdr.version = htole32(1);
-  hdr.entry_count = htole32(0);
-  hdr.state = htole32(JOURNAL_STATE_IN_PROGRESS);
-  hdr.journal_offset = htole64(journal_offset);
+  hdr.version = htole32(JOURNAL_VERSION_GROUPED);
+  hdr.entry_count = htole32(g_journal_entries);
+  hdr.state = htole32(state);
+  hdr.journal_offset = htole64(g_journal_offset);
+  hdr.nonce = htole32(g_journal_nonce);
+  hdr.group_count = htole32(g_journal_groups);
+  hdr.checksum = htole32(journal_header_csum(hdr));
+
+  return device_write(dev, g_journal_offset, &hdr, sizeof(hdr));
+}
 
-  /* Compute checksum */
-  hdr.checksum = 0;
-  hdr.checksum = htole32(crc32c(0, &hdr, sizeof(hdr)));
+/* CRC of a group record with every `completed` flag read as 0, so that
+ * journal_mark_complete() can flip flags in place without a rewrite. */
+static uint32_t journal_group_csum(struct journal_group_header ghdr,
+                                   const struct relocation_entry *entries,
+                                   uint32_t count) {
+  ghdr.checksum = 0;
+  uint32_t crc = crc32c(0, &ghdr, sizeof(ghdr));
+  for (uint32_t i = 0; i < count; i++) {
+    struct relocation_entry e = entries[i];
+    e.completed = 0;
+    crc = crc32c(crc, &e, sizeof(e));
+  }
+  return crc;
+}
 
-  if (device_write(dev, journal_offset, &hdr, sizeof(hdr)) < 0)
+static void journal_seq_index_reset(void) {
+  free(g_seq_index);
+  g_seq_index = NULL;
+  g_seq_index_cap = 0;
+  g_seq_index_count = 0;
+}
+
+static int journal_seq_index_put(uint32_t seq, uint64_t offset) {
+  if (g_seq_index_count * 2 >= g_seq_index_cap) {
+    uint32_t new_cap = g_seq_index_cap ? g_seq_index_cap * 2 : 1024;
+    struct journal_seq_slot *slots =
+        calloc(new_cap, sizeof(struct journal_seq_slot));
+    if (!slots)
+      return -1;
+    for (uint32_t i = 0; i < g_seq_index_cap; i++) {
+      if (g_seq_index[i].offset == 0)
+        continue;
+      uint32_t idx = (uint32_t)(g_seq_index[i].seq * 2654435761ULL) % new_cap;
+      while (slots[idx].offset != 0)
+        idx = (idx + 1) % new_cap;
+      slots[idx] = g_seq_index[i];
+    }
+    free(g_seq_index);
+    g_seq_index = slots;
+    g_seq_index_cap = new_cap;
+  }
+
+  uint32_t idx = (uint32_t)(seq * 2654435761ULL) % g_seq_index_cap;
+  while (g_seq_index[idx].offset != 0 && g_seq_index[idx].seq != seq)
+    idx = (idx + 1) % g_seq_index_cap;
+  if (g_seq_index[idx].offset == 0)
+    g_seq_index_count++;
+  g_seq_index[idx].seq = seq;
+  g_seq_index[idx].offset = offset;
+  return 0;
+}
+
+static uint64_t journal_seq_index_get(uint32_t seq) {
+  if (g_seq_index_cap == 0)
+    return 0;
+  uint32_t idx = (uint32_t)(seq * 2654435761ULL) % g_seq_index_cap;
+  while (g_seq_index[idx].offset != 0) {
+    if (g_seq_index[idx].seq == seq)
+      return g_seq_index[idx].offset;
+    idx = (idx + 1) % g_seq_index_cap;
+  }
+  return 0;
+}
+
+static uint32_t journal_new_nonce(uint32_t previous) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  uint32_t nonce = crc32c((uint32_t)getpid(), &now, sizeof(now));
+  if (nonce == 0 || nonce == previous)
+    nonce = previous + 1 ? previous + 1 : 1;
+  return nonce;
+}
+
+int journal_init(struct device *dev, uint64_t journal_offset) {
+  /* Never reuse the nonce of a journal already at this offset, so its
+   * stale group records cannot be mistaken for ours during recovery. */
+  struct journal_header old;
+  uint32_t previous = 0;
+  if (device_read(dev, journal_offset, &old, sizeof(old)) == 0 &&
+      le32toh(old.magic) == JOURNAL_MAGIC)
+    previous = le32toh(old.nonce);
+
+  g_journal_offset = journal_offset;
+  g_journal_entries = 0;
+  g_journal_groups = 0;
+  g_journal_nonce = journal_new_nonce(previous);
+  g_next_record = journal_offset + JOURNAL_BLOCK_SIZE;
+  g_staged_count = 0;
+  g_staged_bytes = 0;
+  journal_seq_index_reset();
+
+  if (journal_write_header(dev, JOURNAL_STATE_IN_PROGRESS) < 0)
     return -1;
 
   return device_sync(dev);
 }
 
-int journal_log_move(struct device *dev, const struct relocation_entry *entry) {
-  /* Write relocation entry after the header + existing entries */
-  uint64_t entry_offset = g_journal_offset + sizeof(struct journal_header) +
-                          g_journal_entries * sizeof(struct relocation_entry);
+void journal_set_group_window(uint32_t max_entries, uint64_t max_bytes,
+                              uint32_t max_delay_ms) {
+  g_window_entries = max_entries ? max_entries : 1;
+  g_window_bytes = max_bytes;
+  g_window_ms = max_delay_ms;
+}
+
+uint32_t journal_staged_count(void) { return g_staged_count; }
+
+int journal_commit(struct device *dev) {
+  if (g_staged_count == 0)
+    return 0;
 
-  if (device_write(dev, entry_offset, entry, sizeof(*entry)) < 0)
+  struct journal_group_header ghdr;
+  memset(&ghdr, 0, sizeof(ghdr));
+  ghdr.magic = htole32(JOURNAL_GROUP_MAGIC);
+  ghdr.nonce = htole32(g_journal_nonce);
+  ghdr.group_seq = htole32(g_journal_groups);
+  ghdr.entry_count = htole32(g_staged_count);
+
+  size_t payload = sizeof(ghdr) +
+                   (size_t)g_staged_count * sizeof(struct relocation_entry);
+  size_t record_len =
+      (payload + JOURNAL_BLOCK_SIZE - 1) & ~((size_t)JOURNAL_BLOCK_SIZE - 1);
+  ghdr.record_blocks = htole32((uint32_t)(record_len / JOURNAL_BLOCK_SIZE));
+  ghdr.checksum =
+      htole32(journal_group_csum(ghdr, g_staged, g_staged_count));
+
+  uint8_t *record = calloc(1, record_len);
+  if (!record) {
+    fprintf(stderr, "btrfs2ext4: OOM building journal group record\n");
     return -1;
+  }
+  memcpy(record, &ghdr, sizeof(ghdr));
+  memcpy(record + sizeof(ghdr), g_staged,
+         (size_t)g_staged_count * sizeof(struct relocation_entry));
+
+  int ret = device_write(dev, g_next_record, record, record_len);
+  free(record);
+  if (ret < 0)
+    return -1;
+
+  uint64_t entry_base = g_next_record + sizeof(ghdr);
+  for (uint32_t i = 0; i < g_staged_count; i++) {
+    if (journal_seq_index_put(g_staged[i].seq,
+                              entry_base +
+                                  i * sizeof(struct relocation_entry)) < 0) {
+      fprintf(stderr, "btrfs2ext4: OOM indexing journal entries\n");
+      return -1;
+    }
+  }
 
-  g_journal_entries++;
+  g_next_record += record_len;
+  g_journal_entries += g_staged_count;
+  g_journal_groups++;
+  g_staged_count = 0;
+  g_staged_bytes = 0;
 
-  /* Update header entry count */
-  uint32_t count_le = htole32(g_journal_entries);
-  if (device_write(
-          dev, g_journal_offset + offsetof(struct journal_header, entry_count),
-          &count_le, sizeof(count_le)) < 0)
+  /* Header and record share one flush: recovery trusts the record CRC,
+   * not the header count, so either landing first is safe. */
+  if (journal_write_header(dev, JOURNAL_STATE_IN_PROGRESS) < 0)
     return -1;
 
   return device_sync(dev);
 }
 
+int journal_stage_move(struct device *dev,
+                       const struct relocation_entry *entry) {
+  if (g_staged_count >= g_staged_capacity) {
+    uint32_t new_cap = g_staged_capacity ? g_staged_capacity * 2 : 64;
+    struct relocation_entry *grown =
+        realloc(g_staged, new_cap * sizeof(struct relocation_entry));
+    if (!grown) {
+      fprintf(stderr, "btrfs2ext4: OOM staging journal entries\n");
+      return -1;
+    }
+    g_staged = grown;
+    g_staged_capacity = new_cap;
+  }
+
+  if (g_staged_count == 0)
+    clock_gettime(CLOCK_MONOTONIC, &g_staged_since);
+
+  struct relocation_entry *e = &g_staged[g_staged_count++];
+  memset(e, 0, sizeof(*e));
+  e->src_offset = entry->src_offset;
+  e->dst_offset = entry->dst_offset;
+  e->length = entry->length;
+  e->checksum = entry->checksum;
+  e->seq = entry->seq;
+  g_staged_bytes += entry->length;
+
+  int full = g_staged_count >= g_window_entries ||
+             (g_window_bytes && g_staged_bytes >= g_window_bytes);
+  if (!full && g_window_ms) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t elapsed_ms =
+        (uint64_t)(now.tv_sec - g_staged_since.tv_sec) * 1000 +
+        (uint64_t)((now.tv_nsec - g_staged_since.tv_nsec) / 1000000);
+    full = elapsed_ms >= g_window_ms;
+  }
+
+  if (!full)
+    return 0;
+  return journal_commit(dev) < 0 ? -1 : 1;
+}
+
+int journal_log_move(struct device *dev, const struct relocation_entry *entry) {
+  /* Single-entry group: durable on return, as before */
+  if (journal_stage_move(dev, entry) < 0)
+    return -1;
+  return journal_commit(dev);
+}
+
 int journal_mark_complete(struct device *dev, uint32_t seq) {
-  /* Find the entry with this sequence number and mark completed */
-  uint64_t entry_offset = g_journal_offset + sizeof(struct journal_header) +
-                          seq * sizeof(struct relocation_entry);
+  uint64_t entry_offset = journal_seq_index_get(seq);
+  if (entry_offset == 0) {
+    fprintf(stderr,
+            "btrfs2ext4: journal_mark_complete: seq %u was never committed\n",
+            seq);
+    return -1;
+  }
 
   uint8_t completed = 1;
   if (device_write(dev,
@@ -78,18 +312,26 @@ int journal_mark_complete(struct device *dev, uint32_t seq) {
   return 0;
 }
 
-int journal_check(struct device *dev, uint64_t journal_offset) {
-  struct journal_header hdr;
-  if (device_read(dev, journal_offset, &hdr, sizeof(hdr)) < 0)
+/* ========================================================================
+ * Recovery
+ * ======================================================================== */
+
+/*
+ * Read and validate the header. Returns 1 if a valid journal is present,
+ * 0 if there is none (or it is unusable), -1 on I/O error.
+ */
+static int journal_read_header(struct device *dev, uint64_t journal_offset,
+                               struct journal_header *hdr) {
+  memset(hdr, 0, sizeof(*hdr));
+  if (device_read(dev, journal_offset, hdr, sizeof(*hdr)) < 0)
     return -1;
 
-  if (le32toh(hdr.magic) != JOURNAL_MAGIC)
+  if (le32toh(hdr->magic) != JOURNAL_MAGIC)
     return 0; /* No journal found, clean */
 
   /* Verify header checksum to detect partial/corrupt journals. */
-  uint32_t stored_csum = le32toh(hdr.checksum);
-  hdr.checksum = 0;
-  uint32_t computed_csum = crc32c(0, &hdr, sizeof(hdr));
+  uint32_t stored_csum = le32toh(hdr->checksum);
+  uint32_t computed_csum = journal_header_csum(*hdr);
   if (stored_csum != computed_csum) {
     fprintf(stderr,
             "btrfs2ext4: journal header checksum mismatch "
@@ -97,147 +339,253 @@ int journal_check(struct device *dev, uint64_t journal_offset) {
             stored_csum, computed_csum);
     return 0;
   }
+  return 1;
+}
 
-  uint32_t state = le32toh(hdr.state);
-  if (state == JOURNAL_STATE_CLEAN)
-    return 0;
-
-  if (state == JOURNAL_STATE_IN_PROGRESS) {
-    /* Count incomplete entries */
-    uint32_t count = le32toh(hdr.entry_count);
-    int incomplete = 0;
+/*
+ * Load every committed entry in log order. v2 records are accepted while
+ * their magic, nonce, group sequence and CRC all check out; the first
+ * record that fails ends the log (a torn or never-committed group).
+ * Returns the entry count (>= 0), -1 on error. *out must be freed.
+ */
+static int journal_load_entries(struct device *dev, uint64_t journal_offset,
+                                const struct journal_header *hdr,
+                                struct relocation_entry **out) {
+  *out = NULL;
+  uint32_t version = le32toh(hdr->version);
+
+  if (version < JOURNAL_VERSION_GROUPED) {
+    uint32_t count = le32toh(hdr->entry_count);
+    if ((uint64_t)count * sizeof(struct relocation_entry) > dev->size)
+      return -1;
+    if (count == 0)
+      return 0;
+    struct relocation_entry *entries =
+        malloc((size_t)count * sizeof(struct relocation_entry));
+    if (!entries)
+      return -1;
+    if (device_read(dev, journal_offset + JOURNAL_V1_HEADER_SIZE, entries,
+                    (size_t)count * sizeof(struct relocation_entry)) < 0) {
+      free(entries);
+      return -1;
+    }
+    *out = entries;
+    return (int)count;
+  }
 
-    for (uint32_t i = 0; i < count; i++) {
-      struct relocation_entry entry;
-      uint64_t entry_offset = journal_offset + sizeof(struct journal_header) +
-                              i * sizeof(struct relocation_entry);
-      if (device_read(dev, entry_offset, &entry, sizeof(entry)) < 0)
+  uint32_t nonce = le32toh(hdr->nonce);
+  uint64_t pos = journal_offset + JOURNAL_BLOCK_SIZE;
+  struct relocation_entry *entries = NULL;
+  uint32_t count = 0;
+  uint32_t capacity = 0;
+
+  for (uint32_t group = 0;; group++) {
+    struct journal_group_header ghdr;
+    if (pos + sizeof(ghdr) > dev->size ||
+        device_read(dev, pos, &ghdr, sizeof(ghdr)) < 0)
+      break;
+
+    uint32_t n = le32toh(ghdr.entry_count);
+    uint32_t blocks = le32toh(ghdr.record_blocks);
+    if (le32toh(ghdr.magic) != JOURNAL_GROUP_MAGIC ||
+        le32toh(ghdr.nonce) != nonce || le32toh(ghdr.group_seq) != group ||
+        n == 0 || n > JOURNAL_MAX_GROUP_ENTRIES ||
+        (uint64_t)blocks * JOURNAL_BLOCK_SIZE <
+            sizeof(ghdr) + (uint64_t)n * sizeof(struct relocation_entry) ||
+        pos + (uint64_t)blocks * JOURNAL_BLOCK_SIZE > dev->size)
+      break;
+
+    if (count + n > capacity) {
+      uint32_t new_cap = capacity ? capacity : 256;
+      while (new_cap < count + n)
+        new_cap *= 2;
+      struct relocation_entry *grown =
+          realloc(entries, (size_t)new_cap * sizeof(struct relocation_entry));
+      if (!grown) {
+        free(entries);
         return -1;
-      if (!entry.completed)
-        incomplete++;
+      }
+      entries = grown;
+      capacity = new_cap;
     }
 
-    return incomplete;
+    if (device_read(dev, pos + sizeof(ghdr), &entries[count],
+                    (size_t)n * sizeof(struct relocation_entry)) < 0) {
+      free(entries);
+      return -1;
+    }
+    if (journal_group_csum(ghdr, &entries[count], n) !=
+        le32toh(ghdr.checksum)) {
+      fprintf(stderr,
+              "btrfs2ext4: journal group %u failed its CRC — treating it as "
+              "uncommitted\n",
+              group);
+      break;
+    }
+
+    count += n;
+    pos += (uint64_t)blocks * JOURNAL_BLOCK_SIZE;
   }
 
+  *out = entries;
+  return (int)count;
+}
+
+/*
+ * Move a completed relocation back from dst to src.
+ * Returns 0 on success (or nothing to do), -1 on invalid entry / I/O error.
+ */
+static int journal_reverse_move(struct device *dev,
+                                const struct relocation_entry *entry,
+                                uint32_t idx) {
+  uint64_t len = entry->length;
+  if (len == 0)
+    return 0;
+
+  if (len > MAX_JOURNAL_CHUNK)
+    len = MAX_JOURNAL_CHUNK;
+
+  /* Validar rangos dentro del dispositivo. */
+  if (entry->dst_offset > dev->size || entry->src_offset > dev->size ||
+      len > dev->size || entry->dst_offset > dev->size - len ||
+      entry->src_offset > dev->size - len) {
+    fprintf(stderr,
+            "btrfs2ext4: journal replay entry %u has invalid offsets or "
+            "length (src=0x%lx dst=0x%lx len=%lu)\n",
+            idx, (unsigned long)entry->src_offset,
+            (unsigned long)entry->dst_offset, (unsigned long)entry->length);
+    return -1;
+  }
+
+  uint8_t *buf = malloc((size_t)len);
+  if (!buf)
+    return -1;
+
+  if (device_read(dev, entry->dst_offset, buf, (size_t)len) == 0) {
+    device_write(dev, entry->src_offset, buf, (size_t)len);
+  }
+  free(buf);
   return 0;
 }
 
-int journal_replay(struct device *dev, uint64_t journal_offset) {
+int journal_check(struct device *dev, uint64_t journal_offset) {
   struct journal_header hdr;
-  if (device_read(dev, journal_offset, &hdr, sizeof(hdr)) < 0)
-    return -1;
+  int valid = journal_read_header(dev, journal_offset, &hdr);
+  if (valid <= 0)
+    return valid;
 
-  uint32_t count = le32toh(hdr.entry_count);
-  printf("Replaying journal (%u entries)...\n", count);
+  uint32_t state = le32toh(hdr.state);
+  if (state != JOURNAL_STATE_IN_PROGRESS)
+    return 0;
 
-  /* For each incomplete entry, reverse the move */
-  for (int i = (int)count - 1; i >= 0; i--) {
-    struct relocation_entry entry;
-    uint64_t entry_offset = journal_offset + sizeof(struct journal_header) +
-                            (uint32_t)i * sizeof(struct relocation_entry);
-    if (device_read(dev, entry_offset, &entry, sizeof(entry)) < 0)
-      return -1;
+  /* Count incomplete entries */
+  struct relocation_entry *entries;
+  int count = journal_load_entries(dev, journal_offset, &hdr, &entries);
+  if (count < 0)
+    return -1;
 
-    if (entry.completed) {
-      /* Completed move: reverse it (move back from dst to src) */
-      uint64_t len = entry.length;
-      if (len == 0) {
-        continue;
-      }
+  int incomplete = 0;
+  for (int i = 0; i < count; i++) {
+    if (!entries[i].completed)
+      incomplete++;
+  }
+  free(entries);
+  return incomplete;
+}
 
-      /* Limit each replay chunk to 16 MiB para evitar OOM en footers corruptos.
-       */
-      const uint64_t MAX_JOURNAL_CHUNK = 16ULL * 1024 * 1024;
-      if (len > MAX_JOURNAL_CHUNK)
-        len = MAX_JOURNAL_CHUNK;
-
-      /* Validar rangos dentro del dispositivo. */
-      if (entry.dst_offset > dev->size || entry.src_offset > dev->size ||
-          len > dev->size || entry.dst_offset > dev->size - len ||
-          entry.src_offset > dev->size - len) {
-        fprintf(stderr,
-                "btrfs2ext4: journal replay entry %d has invalid offsets or "
-                "length (src=0x%lx dst=0x%lx len=%lu)\n",
-                i, (unsigned long)entry.src_offset,
-                (unsigned long)entry.dst_offset, (unsigned long)entry.length);
-        return -1;
-      }
+int journal_replay(struct device *dev, uint64_t journal_offset) {
+  struct journal_header hdr;
+  int valid = journal_read_header(dev, journal_offset, &hdr);
+  if (valid < 0)
+    return -1;
+  if (valid == 0)
+    return 0;
 
-      uint8_t *buf = malloc((size_t)len);
-      if (!buf)
-        return -1;
+  struct relocation_entry *entries;
+  int count = journal_load_entries(dev, journal_offset, &hdr, &entries);
+  if (count < 0)
+    return -1;
+  printf("Replaying journal (%d entries)...\n", count);
 
-      if (device_read(dev, entry.dst_offset, buf, (size_t)len) == 0) {
-        device_write(dev, entry.src_offset, buf, (size_t)len);
-      }
-      free(buf);
+  /* For each completed entry, reverse the move (newest first) */
+  for (int i = count - 1; i >= 0; i--) {
+    if (entries[i].completed &&
+        journal_reverse_move(dev, &entries[i], (uint32_t)i) < 0) {
+      free(entries);
+      return -1;
     }
   }
 
+  free(entries);
   return journal_clear(dev, journal_offset);
 }
 
 int journal_replay_partial(struct device *dev, uint64_t journal_offset,
                            uint32_t limit_seq) {
   struct journal_header hdr;
-  if (device_read(dev, journal_offset, &hdr, sizeof(hdr)) < 0)
+  int valid = journal_read_header(dev, journal_offset, &hdr);
+  if (valid < 0)
     return -1;
+  if (valid == 0)
+    return 0;
 
-  uint32_t count = le32toh(hdr.entry_count);
-  printf("Replaying partial journal (up to %u entries)...\n", limit_seq);
-
-  uint32_t start_idx = limit_seq < count ? limit_seq : count - 1;
-
-  /* For each completed entry up to failed_seq, reverse the move */
-  for (int i = (int)start_idx; i >= 0; i--) {
-    struct relocation_entry entry;
-    uint64_t entry_offset = journal_offset + sizeof(struct journal_header) +
-                            (uint32_t)i * sizeof(struct relocation_entry);
-    if (device_read(dev, entry_offset, &entry, sizeof(entry)) < 0)
-      continue;
-
-    if (entry.completed) {
-      /* Completed move: reverse it (move back from dst to src) */
-      uint64_t len = entry.length;
-      if (len == 0)
-        continue;
-
-      const uint64_t MAX_JOURNAL_CHUNK = 16ULL * 1024 * 1024;
-      if (len > MAX_JOURNAL_CHUNK)
-        len = MAX_JOURNAL_CHUNK;
-
-      if (entry.dst_offset > dev->size || entry.src_offset > dev->size ||
-          len > dev->size || entry.dst_offset > dev->size - len ||
-          entry.src_offset > dev->size - len) {
-        fprintf(stderr,
-                "btrfs2ext4: journal replay entry %d has invalid offsets\n", i);
-        continue;
-      }
-
-      uint8_t *buf = malloc((size_t)len);
-      if (!buf)
-        continue;
-
-      if (device_read(dev, entry.dst_offset, buf, (size_t)len) == 0) {
-        device_write(dev, entry.src_offset, buf, (size_t)len);
+  struct relocation_entry *entries;
+  int count = journal_load_entries(dev, journal_offset, &hdr, &entries);
+  if (count < 0)
+    return -1;
+  printf("Replaying partial journal (up to seq %u)...\n", limit_seq);
+
+  /* v1 addressed entries by position; v2 stops at the entry holding
+   * limit_seq, or replays everything committed if it was never logged. */
+  int start_idx = count - 1;
+  if (le32toh(hdr.version) < JOURNAL_VERSION_GROUPED) {
+    if (limit_seq < (uint32_t)count)
+      start_idx = (int)limit_seq;
+  } else {
+    for (int i = 0; i < count; i++) {
+      if (entries[i].seq == limit_seq) {
+        start_idx = i;
+        break;
       }
-      free(buf);
     }
   }
 
+  /* For each completed entry up to limit_seq, reverse the move */
+  for (int i = start_idx; i >= 0; i--) {
+    if (entries[i].completed)
+      journal_reverse_move(dev, &entries[i], (uint32_t)i);
+  }
+
+  free(entries);
   return journal_clear(dev, journal_offset);
 }
 
 int journal_clear(struct device *dev, uint64_t journal_offset) {
+  /* Keep the nonce so a later journal_init() at this offset picks a new one
+   * and this run's (now dead) group records can never be replayed. */
+  struct journal_header old;
+  uint32_t nonce = 0;
+  if (device_read(dev, journal_offset, &old, sizeof(old)) == 0 &&
+      le32toh(old.magic) == JOURNAL_MAGIC)
+    nonce = le32toh(old.nonce);
+
   struct journal_header hdr;
   memset(&hdr, 0, sizeof(hdr));
   hdr.magic = htole32(JOURNAL_MAGIC);
-  hdr.version = htole32(1);
+  hdr.version = htole32(JOURNAL_VERSION_GROUPED);
   hdr.state = htole32(JOURNAL_STATE_CLEAN);
+  hdr.journal_offset = htole64(journal_offset);
+  hdr.nonce = htole32(nonce);
+  hdr.checksum = htole32(journal_header_csum(hdr));
 
   if (device_write(dev, journal_offset, &hdr, sizeof(hdr)) < 0)
     return -1;
 
+  if (journal_offset == g_journal_offset) {
+    g_staged_count = 0;
+    g_staged_bytes = 0;
+    journal_seq_index_reset();
+  }
+
   return device_sync(dev);
 }
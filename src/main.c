@@ -5,6 +5,8 @@
  */
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <math.h>
 #include <stdio.h>
@@ -15,15 +17,22 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "btrfs/btree.h"
 #include "btrfs/btrfs_reader.h"
 #include "btrfs/chunk_tree.h"
+#include "btrfs/extent_store.h"
 #include "btrfs2ext4.h"
+#include "checkpoint.h"
 #include "device_io.h"
+#include "device_profile.h"
 #include "ext4/ext4_planner.h"
+#include "ext4/ext4_structures.h"
 #include "ext4/ext4_writer.h"
+#include "io_stats.h"
 #include "journal.h"
 #include "mem_tracker.h"
 #include "migration_map.h"
+#include "progress.h"
 #include "relocator.h"
 
 #define VERSION "0.1.0-alpha"
@@ -44,6 +53,56 @@ static void print_usage(const char *prog) {
       "  -w, --workdir <path>    Working directory for temp files (default: "
       "cwd)\n"
       "  -m, --memory-limit N    Max RAM in MB (0=auto 60%% of physical)\n"
+      "  -j, --scan-threads N    Threads for the metadata scan (0=auto, "
+      "1=serial)\n"
+      "      --scan-split-level N  B-tree level split into parallel subtrees "
+      "(default: auto)\n"
+      "      --scan-order O      Metadata read order: key, physical or auto "
+      "(physical on HDDs)\n"
+      "      --reloc-depth N     Relocation reads kept in flight (default: "
+      "4, 1=serial)\n"
+      "      --verify-moves      Checksum relocated data in user space "
+      "instead of copying\n"
+      "                          it in the kernel\n"
+      "      --no-alloc-goal     Allocate ext4 blocks in one sweep instead "
+      "of near their inode\n"
+      "      --no-tree-region    Put extent-tree blocks next to each file "
+      "instead of\n"
+      "                          in one region per flex group\n"
+      "      --no-flex-pack      Keep each group's bitmaps and inode table "
+      "in the group\n"
+      "                          instead of packing them per flex group\n"
+      "      --no-lazy-itable    Write every inode table in full instead "
+      "of up to its\n"
+      "                          last used inode\n"
+      "      --layout-search     Try candidate layouts and keep the one "
+      "with the least\n"
+      "                          data to relocate\n"
+      "      --max-inode-ratio N Largest inode ratio the search may use "
+      "(default: -i)\n"
+      "      --no-write-cache    Write ext4 metadata straight through "
+      "(no combining)\n"
+      "      --direct-io         Move file data with O_DIRECT, bypassing "
+      "the page cache\n"
+      "      --mem-report FILE   Write per-subsystem memory peaks as JSON "
+      "(- = stdout)\n"
+      "      --stats[=FORMAT]    Print per-phase I/O and CPU statistics: "
+      "text or json\n"
+      "      --resume            Continue an interrupted conversion from the "
+      "checkpoint\n"
+      "                          in --workdir\n"
+      "      --plan-only         Scan and plan ahead of time (read-only); "
+      "convert later\n"
+      "                          with --resume\n"
+      "      --profile-writes    Dry run: also time writes and fsyncs, "
+      "rewriting free\n"
+      "                          space with its own contents\n"
+      "      --device-profile FILE  Dry run: reuse the device profile in FILE, "
+      "or save it\n"
+      "                          there\n"
+      "      --no-progress       Don't show the live progress status\n"
+      "      --progress-fd N     Write progress as one JSON object per line "
+      "to descriptor N\n"
       "  -h, --help              Show this help\n"
       "  -V, --version           Show version\n"
       "\n"
@@ -56,6 +115,23 @@ static void print_usage(const char *prog) {
       prog);
 }
 
+/* --mem-report: peaks per subsystem and pass, for sizing --memory-limit */
+static void write_mem_report(const char *path) {
+  FILE *f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+  if (!f) {
+    fprintf(stderr, "btrfs2ext4: cannot write memory report %s: %s\n", path,
+            strerror(errno));
+    return;
+  }
+  int err = mem_track_write_json(f);
+  if (f == stdout)
+    err |= fflush(f) == EOF ? -1 : 0;
+  else
+    err |= fclose(f) == EOF ? -1 : 0;
+  if (err)
+    fprintf(stderr, "btrfs2ext4: error writing memory report %s\n", path);
+}
+
 void btrfs2ext4_version(void) { printf("btrfs2ext4 version " VERSION "\n"); }
 
 static void progress_print(const char *phase, uint32_t percent,
@@ -202,6 +278,141 @@ static int compare_file_entry(const void *a, const void *b) {
   return 0;
 }
 
+/* ========================================================================
+ * Dry-run ETA: device profile and time model
+ * ======================================================================== */
+
+static void print_duration(double sec) {
+  if (sec >= 3600)
+    printf("%.0fh%02.0fm", floor(sec / 3600), floor(fmod(sec, 3600) / 60));
+  else if (sec >= 60)
+    printf("%.0fm%02.0fs", floor(sec / 60), floor(fmod(sec, 60)));
+  else
+    printf("%.1fs", sec);
+}
+
+/*
+ * Profile the device (or load --device-profile) and estimate the real
+ * conversion phase by phase from what Pass 2 planned. `clones` may be
+ * NULL when the clone plan could not be built.
+ */
+static void dry_run_eta(const struct convert_options *opts, struct device *dev,
+                        const struct btrfs_fs_info *fs_info,
+                        const struct ext4_layout *layout,
+                        const struct relocation_plan *plan,
+                        const struct ext4_clone_plan *clones) {
+  const double mib = 1024.0 * 1024.0;
+  struct eta_workload w;
+  memset(&w, 0, sizeof(w));
+
+  /* The real run repeats Pass 1 and 2; they were just timed */
+  struct io_phase_stats st[IO_PHASE_COUNT];
+  io_stats_collect(st);
+  w.scan_sec = st[IO_PHASE_SCAN].wall_sec + st[IO_PHASE_PLAN].wall_sec;
+
+  printf("\n=== DRY RUN: Device Profile ===\n");
+  struct device_profile prof;
+  int loaded =
+      opts->device_profile &&
+      device_profile_load(&prof, opts->device_profile, dev->size) == 0 &&
+      (prof.writes || !opts->profile_writes);
+  if (loaded) {
+    time_t at = (time_t)prof.measured_at;
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&at));
+    printf("  Profile:                %s (measured %s)\n", opts->device_profile,
+           when);
+  } else {
+    printf("  Profiling %s%s...\n", dev->path,
+           opts->profile_writes ? " (free space is rewritten in place)" : "");
+    if (device_profile_measure(&prof, dev, &fs_info->usage,
+                               opts->profile_writes ? DEVICE_PROFILE_WRITES
+                                                    : 0) < 0) {
+      printf("  Profile failed: the device could not be read.\n");
+      printf("===============================\n");
+      return;
+    }
+    if (opts->device_profile &&
+        device_profile_save(&prof, opts->device_profile) < 0)
+      fprintf(stderr, "btrfs2ext4: cannot save device profile %s: %s\n",
+              opts->device_profile, strerror(errno));
+  }
+
+  printf("  Sequential read:        %.1f MiB/s\n", prof.seq_read / mib);
+  if (prof.writes)
+    printf("  Sequential write:       %.1f MiB/s\n", prof.seq_write / mib);
+  else
+    printf("  Sequential write:       not measured (--profile-writes); "
+           "taken as read speed\n");
+  printf("  Random read 4K / 64K:   %.0f / %.0f IOPS (%.2f ms per access)\n",
+         prof.rand_4k_iops, prof.rand_64k_iops,
+         device_profile_access(&prof) * 1000.0);
+  if (prof.writes) {
+    printf("  Writes + fdatasync:     ");
+    for (int k = 0; k < DEVICE_PROFILE_DEPTHS && prof.commit_sec[k] > 0.0; k++)
+      printf("%s%u: %.2f ms", k ? ", " : "", prof.depth[k],
+             prof.commit_sec[k] * 1000.0);
+    printf("\n");
+  }
+
+  /* Unwritten entries cost no I/O. The relocator journals nothing, but
+   * the checkpoint syncs the device every so many entries, bytes or
+   * milliseconds (checkpoint_reloc_progress()). */
+  w.reloc_moves = 0;
+  for (uint32_t i = 0; i < plan->count; i++)
+    w.reloc_moves += !(plan->entries[i].flags & RELOC_FLAG_UNWRITTEN);
+  w.reloc_bytes = plan->total_bytes_to_move;
+  uint64_t by_entries = (plan->count + JOURNAL_DEFAULT_GROUP_ENTRIES - 1) /
+                        JOURNAL_DEFAULT_GROUP_ENTRIES;
+  uint64_t by_bytes = (plan->total_bytes_to_move +
+                       JOURNAL_DEFAULT_GROUP_BYTES - 1) /
+                      JOURNAL_DEFAULT_GROUP_BYTES;
+  w.reloc_syncs = by_entries > by_bytes ? by_entries : by_bytes;
+  w.reloc_sync_sec = JOURNAL_DEFAULT_GROUP_MS / 1000.0;
+
+  w.decomp_extents = fs_info->compressed_extent_count;
+  w.decomp_read_bytes = fs_info->total_compressed_bytes;
+  w.decomp_write_bytes = fs_info->total_decompressed_bytes;
+
+  if (clones) {
+    w.clone_reads = clones->source_ranges;
+    w.clone_read_bytes = clones->source_blocks * layout->block_size;
+    w.clone_writes = clones->count;
+    w.clone_write_bytes = clones->blocks * layout->block_size;
+  }
+
+  /* Inode tables, GDT and both bitmaps, one region per group. Lazy
+   * tables stop at the last inode, and inode numbers are handed out in
+   * order from the first free one. */
+  uint64_t itable_inodes = layout->total_inodes;
+  if (!opts->no_lazy_itable) {
+    uint64_t used =
+        EXT4_GOOD_OLD_FIRST_INO - 1 + (uint64_t)fs_info->inode_count;
+    if (used < itable_inodes)
+      itable_inodes = used;
+  }
+  w.meta_runs = layout->num_groups;
+  w.meta_bytes = itable_inodes * layout->inode_size +
+                 (uint64_t)layout->num_groups * layout->desc_size +
+                 (uint64_t)layout->num_groups * layout->block_size * 2;
+  /* Migration map, end of relocation, end of Pass 3 */
+  w.syncs = 3;
+
+  struct eta_estimate est;
+  device_profile_estimate(&prof, &w, &est);
+
+  printf("\n=== DRY RUN: Estimated Conversion Time ===\n");
+  for (int i = 0; i < ETA_PHASE_COUNT; i++) {
+    printf("  %-12s ", eta_phase_name(i));
+    print_duration(est.phase_sec[i]);
+    printf("\n");
+  }
+  printf("\n  >> Estimated Real Conversion Time: ");
+  print_duration(est.total_sec);
+  printf("%s <<\n", prof.writes ? "" : " (writes estimated)");
+  printf("==========================================\n");
+}
+
 int btrfs2ext4_convert(const struct convert_options *opts,
                        progress_callback progress) {
   struct device dev;
@@ -209,12 +420,17 @@ int btrfs2ext4_convert(const struct convert_options *opts,
   struct ext4_layout layout;
   struct relocation_plan reloc_plan;
   struct inode_map ino_map;
+  struct ext4_block_allocator alloc;
+  struct checkpoint ckpt;
+  int resumed = CHECKPOINT_NONE;
   int ret = -1;
 
   memset(&fs_info, 0, sizeof(fs_info));
   memset(&layout, 0, sizeof(layout));
   memset(&reloc_plan, 0, sizeof(reloc_plan));
   memset(&ino_map, 0, sizeof(ino_map));
+  memset(&alloc, 0, sizeof(alloc));
+  io_stats_phase(IO_PHASE_SETUP);
 
   printf("==============================================\n");
   printf("   btrfs2ext4 v" VERSION "\n");
@@ -223,6 +439,8 @@ int btrfs2ext4_convert(const struct convert_options *opts,
 
   if (opts->dry_run) {
     printf("*** DRY RUN MODE — no changes will be written ***\n\n");
+  } else if (opts->plan_only) {
+    printf("*** PLAN-ONLY MODE — the device is only read ***\n\n");
   }
 
   /* ================================================
@@ -282,23 +500,55 @@ int btrfs2ext4_convert(const struct convert_options *opts,
    * estructuras opcionales (hashes grandes, bloom filters, etc.)
    * empiecen a llamar a mem_track_exceeded(). */
   mem_track_init();
-
-  /* Open device */
-  if (device_open(&dev, opts->device_path, opts->dry_run) < 0)
+  if (opts->memory_limit_mb > 0)
+    mem_track_set_limit(mem_cfg.mmap_threshold);
+
+  /* Open device. Bulk data (relocation, decompressed extents) can bypass
+   * the page cache; metadata stays buffered. */
+  int open_flags =
+      (opts->dry_run || opts->plan_only ? DEVICE_OPEN_READ_ONLY : 0) |
+                   (opts->direct_io ? DEVICE_OPEN_DIRECT : 0);
+  if (device_open_flags(&dev, opts->device_path, open_flags) < 0)
     return -1;
 
-  printf("Device: %s (%.1f GiB)\n\n", opts->device_path,
+  printf("Device: %s (%.1f GiB)\n", opts->device_path,
          (double)dev.size / (1024.0 * 1024.0 * 1024.0));
+  if (dev.direct_fd >= 0)
+    printf("Direct I/O: bulk data via O_DIRECT (%u-byte alignment)\n",
+           dev.direct_align);
+  printf("\n");
+
+  /* Snapshots after each phase let --resume skip what already finished */
+  checkpoint_init(&ckpt, mem_cfg.workdir, &dev, opts->block_size,
+                  opts->inode_ratio);
+  if (opts->resume) {
+    resumed = checkpoint_load(&ckpt, &fs_info, &layout, &reloc_plan);
+    if (resumed < 0)
+      goto cleanup;
+  }
 
   /* ================================================
    * PASS 1: Read Btrfs metadata
    * ================================================ */
   if (progress)
     progress("Pass 1", 0, "Reading btrfs metadata...");
-
-  if (btrfs_read_fs(&dev, &fs_info) < 0) {
-    fprintf(stderr, "btrfs2ext4: failed to read btrfs metadata\n");
-    goto cleanup;
+  mem_track_phase("pass1");
+  io_stats_phase(IO_PHASE_SCAN);
+
+  if (resumed < CHECKPOINT_SCANNED) {
+    btrfs_set_scan_parallelism(opts->scan_threads, opts->scan_split_level);
+    btrfs_set_scan_order((enum btrfs_scan_order)opts->scan_order);
+    btrfs_set_memory_config(&mem_cfg);
+    /* Metadata bytes read; the tree sizes are not known up front */
+    progress_begin("scan", 0, NULL);
+    int scanned = btrfs_read_fs(&dev, &fs_info);
+    progress_end();
+    if (scanned < 0) {
+      fprintf(stderr, "btrfs2ext4: failed to read btrfs metadata\n");
+      goto cleanup;
+    }
+    if (!opts->dry_run && !opts->plan_only)
+      checkpoint_save(&ckpt, CHECKPOINT_SCANNED, &fs_info, NULL, NULL);
   }
 
   if (progress)
@@ -309,9 +559,31 @@ int btrfs2ext4_convert(const struct convert_options *opts,
    * ================================================ */
   if (progress)
     progress("Pass 2", 0, "Planning ext4 layout...");
-
-  if (ext4_plan_layout(&layout, dev.size, opts->block_size, opts->inode_ratio,
-                       &fs_info) < 0) {
+  mem_track_phase("pass2");
+  mem_track_reclaim();
+  io_stats_phase(IO_PHASE_PLAN);
+
+  ext4_plan_set_flex_pack(!opts->no_flex_pack);
+  struct ext4_plan_params plan_params = {
+      .inode_ratio = opts->inode_ratio,
+      .reserved_gdt = EXT4_PLAN_RESERVED_GDT_AUTO,
+      .flex_pack = !opts->no_flex_pack,
+  };
+  struct ext4_plan_search search;
+  int searched = 0;
+  if (resumed < CHECKPOINT_PLANNED && opts->layout_search) {
+    if (progress)
+      progress("Pass 2", 10, "Searching layouts...");
+    if (ext4_plan_search(&search, dev.size, opts->block_size, &plan_params,
+                         opts->max_inode_ratio, &fs_info) == 0) {
+      ext4_plan_search_report(&search);
+      plan_params = search.cand[search.chosen].params;
+      searched = 1;
+    }
+  }
+  if (resumed < CHECKPOINT_PLANNED &&
+      ext4_plan_layout_params(&layout, dev.size, opts->block_size,
+                              &plan_params, &fs_info) < 0) {
     fprintf(stderr, "btrfs2ext4: failed to plan ext4 layout\n");
     goto cleanup;
   }
@@ -324,14 +596,42 @@ int btrfs2ext4_convert(const struct convert_options *opts,
   if (progress)
     progress("Pass 2", 50, "Planning relocation...");
 
-  if (relocator_plan(&reloc_plan, &layout, &fs_info) < 0) {
-    fprintf(stderr, "btrfs2ext4: failed to plan block relocation\n");
+  relocator_set_pipeline_depth(opts->reloc_depth);
+  relocator_set_verify(opts->verify_moves);
+  if (resumed < CHECKPOINT_PLANNED) {
+    if (relocator_plan(&reloc_plan, &layout, &fs_info) < 0) {
+      fprintf(stderr, "btrfs2ext4: failed to plan block relocation\n");
+      goto cleanup;
+    }
+    if (!opts->dry_run &&
+        checkpoint_save(&ckpt, CHECKPOINT_PLANNED, &fs_info, &layout,
+                        &reloc_plan) < 0 &&
+        opts->plan_only)
+      goto cleanup;
+  }
+
+  /* The plan is keyed by the Btrfs generation: any commit until the
+   * conversion runs invalidates it */
+  if (opts->plan_only) {
+    printf("\nPlan saved: %u inodes, %u conflicts, %u relocations "
+           "(%.1f MiB) for generation %llu.\n",
+           fs_info.inode_count, conflicts, reloc_plan.count,
+           (double)reloc_plan.total_bytes_to_move / (1024.0 * 1024.0),
+           (unsigned long long)le64toh(fs_info.sb.generation));
+    printf("Convert with: btrfs2ext4 --resume -w %s", mem_cfg.workdir);
+    if (opts->block_size != EXT4_DEFAULT_BLOCK_SIZE)
+      printf(" -b %u", opts->block_size);
+    if (opts->inode_ratio != EXT4_DEFAULT_INODE_RATIO)
+      printf(" -i %u", opts->inode_ratio);
+    printf(" %s\n\n", opts->device_path);
+    ret = 0;
     goto cleanup;
   }
 
-  if (!opts->dry_run) {
+  if (!opts->dry_run && resumed < CHECKPOINT_RELOCATED) {
     if (progress)
       progress("Pass 2", 60, "Saving migration map and btrfs backup...");
+    io_stats_phase(IO_PHASE_RELOCATE);
 
     /* plan.v1 fix: Save migration map UNCONDITIONALLY (even when count=0).
      * This ensures a rollback checkpoint exists before Pass 3 writes begin,
@@ -347,16 +647,29 @@ int btrfs2ext4_convert(const struct convert_options *opts,
       if (progress)
         progress("Pass 2", 70, "Relocating conflicting blocks...");
 
-      if (relocator_execute(&reloc_plan, &dev, &fs_info, layout.block_size) <
-          0) {
+      checkpoint_reloc_begin(&ckpt, &reloc_plan);
+      int reloc_ret =
+          relocator_execute(&reloc_plan, &dev, &fs_info, layout.block_size);
+      checkpoint_reloc_end(&ckpt);
+      if (reloc_ret < 0) {
         fprintf(stderr, "btrfs2ext4: block relocation failed!\n");
         goto cleanup;
       }
+      /* Rollback checks the CRCs --verify-moves took */
+      if (opts->verify_moves && migration_map_update(&dev, &reloc_plan) < 0)
+        fprintf(stderr, "btrfs2ext4: warning: could not record relocation "
+                        "checksums in the migration map\n");
     }
+
+    /* From here on only the snapshot knows the Btrfs layout: Pass 3
+     * overwrites the trees it was read from */
+    checkpoint_save(&ckpt, CHECKPOINT_RELOCATED, &fs_info, &layout,
+                    &reloc_plan);
   }
 
   if (progress)
     progress("Pass 2", 100, "Layout planned, relocation complete");
+  io_stats_phase(IO_PHASE_PLAN);
 
   printf("\n=== Hardware Viability Audit (Pre-flight Check) ===\n");
   printf("  RAM total detected:     %.1f GiB\n",
@@ -386,13 +699,13 @@ int btrfs2ext4_convert(const struct convert_options *opts,
   /* Subtract blocks already used by existing data */
   uint64_t used_data_blocks = 0;
   for (uint32_t i = 0; i < fs_info.inode_count; i++) {
-    const struct file_entry *fe = fs_info.inode_table[i];
-    for (uint32_t j = 0; j < fe->extent_count; j++) {
-      if (fe->extents[j].type != BTRFS_FILE_EXTENT_INLINE &&
-          fe->extents[j].disk_bytenr != 0) {
+    struct extent_iter it;
+    const struct file_extent *ext;
+    extent_iter_init(&it, &fs_info, fs_info.inode_table[i]);
+    while ((ext = extent_iter_next(&it)) != NULL) {
+      if (ext->type != BTRFS_FILE_EXTENT_INLINE && ext->disk_bytenr != 0) {
         used_data_blocks +=
-            (fe->extents[j].disk_num_bytes + layout.block_size - 1) /
-            layout.block_size;
+            (ext->disk_num_bytes + layout.block_size - 1) / layout.block_size;
       }
     }
   }
@@ -429,81 +742,6 @@ int btrfs2ext4_convert(const struct convert_options *opts,
                        : 0.0);
   printf("===================================================\n\n");
 
-  /* ================================================
-   * DRY-RUN Benchmark and ETA Estimation
-   * ================================================ */
-  if (opts->dry_run) {
-    printf("=== DRY RUN: ETA Benchmark ===\n");
-    printf("  Benchmarking device read speed to estimate real conversion "
-           "time...\n");
-
-    /* Benchmark 128 MB or total device size, whichever is smaller */
-    uint64_t bench_size = 128ULL * 1024 * 1024;
-    if (bench_size > dev.size)
-      bench_size = dev.size;
-
-    uint32_t chunk = 1048576; /* 1 MB */
-    uint8_t *bench_buf = malloc(chunk);
-    if (!bench_buf) {
-      printf("  WARNING: Could not allocate benchmark buffer.\n");
-    } else {
-      struct timespec tb_start, tb_end;
-      clock_gettime(CLOCK_MONOTONIC, &tb_start);
-
-      uint64_t read_bytes = 0;
-      uint64_t offset = 0;
-
-      while (read_bytes < bench_size) {
-        if (device_read(&dev, offset, bench_buf, chunk) < 0)
-          break;
-        read_bytes += chunk;
-        offset += chunk;
-      }
-
-      clock_gettime(CLOCK_MONOTONIC, &tb_end);
-      free(bench_buf);
-
-      double elapsed_sec = (tb_end.tv_sec - tb_start.tv_sec) +
-                           (tb_end.tv_nsec - tb_start.tv_nsec) / 1e9;
-
-      if (elapsed_sec > 0.0 && read_bytes > 0) {
-        double speed_mb_s =
-            ((double)read_bytes / (1024.0 * 1024.0)) / elapsed_sec;
-        printf("  Read speed measured:    %.1f MB/s\n", speed_mb_s);
-
-        /* Calculate approximate write footprint to be deployed in Phase 3 */
-        uint64_t inode_tbl_bytes =
-            (uint64_t)layout.total_inodes * layout.inode_size;
-        uint64_t gdt_bytes = (uint64_t)layout.num_groups * layout.desc_size;
-        uint64_t bitmap_bytes =
-            (uint64_t)layout.num_groups * layout.block_size * 2;
-        uint64_t total_meta_write_bytes =
-            inode_tbl_bytes + gdt_bytes + bitmap_bytes;
-
-        /* Penalize speed: 40% efficiency for sequential-ish, 10% efficiency for
-         * scattered */
-        double write_speed_optimistic = speed_mb_s * 0.40;
-        double write_speed_pessimistic = speed_mb_s * 0.10;
-
-        double eta_min_sec =
-            ((double)total_meta_write_bytes / (1024.0 * 1024.0)) /
-            write_speed_optimistic;
-        double eta_max_sec =
-            ((double)total_meta_write_bytes / (1024.0 * 1024.0)) /
-            write_speed_pessimistic;
-
-        printf("  Phase 3 Write footprint:%.1f MB\n",
-               (double)total_meta_write_bytes / (1024.0 * 1024.0));
-        printf(
-            "\n  >> Estimated Real Conversion Time: %.0f to %.0f seconds <<\n",
-            eta_min_sec, eta_max_sec);
-      } else {
-        printf("  Benchmark failed to complete.\n");
-      }
-    }
-    printf("==============================\n\n");
-  }
-
   /* ================================================
    * PASS 3: Write ext4 structures
    * ================================================ */
@@ -514,6 +752,61 @@ int btrfs2ext4_convert(const struct convert_options *opts,
     printf("  - %u data/metadata conflicts detected\n", conflicts);
     printf("  - %u blocks would be relocated\n", reloc_plan.count);
     printf("  - %lu total blocks\n", (unsigned long)layout.total_blocks);
+    if (searched) {
+      const struct ext4_plan_candidate *c = &search.cand[search.chosen];
+      printf("  - layout search: inode ratio %u, %s reserved GDT, flex "
+             "packing %s (%.1f MiB to relocate, %.1f MiB configured)\n",
+             c->params.inode_ratio,
+             c->params.reserved_gdt == 0 ? "no" : "default",
+             c->params.flex_pack ? "on" : "off",
+             (double)c->reloc_bytes / (1024.0 * 1024.0),
+             search.cand[0].ok
+                 ? (double)search.cand[0].reloc_bytes / (1024.0 * 1024.0)
+                 : 0.0);
+    }
+
+    /* Relocation schedule: estimated head travel, planner vs. scheduled */
+    if (reloc_plan.count > 0) {
+      const struct reloc_schedule_stats *rs = &reloc_plan.sched;
+      double before_gib = (double)rs->seek_before / (1024.0 * 1024.0 * 1024.0);
+      double after_gib = (double)rs->seek_after / (1024.0 * 1024.0 * 1024.0);
+      printf("\n=== Relocation Schedule ===\n");
+      printf("  Move dependencies:      %u (%u cycles via scratch, %.1f MiB)\n",
+             rs->dependencies, rs->cycles_broken,
+             (double)rs->scratch_bytes / (1024.0 * 1024.0));
+      printf("  Est. seek distance:     %.2f GiB -> %.2f GiB", before_gib,
+             after_gib);
+      if (rs->seek_before > 0)
+        printf(" (%.0f%% less)",
+               100.0 * (1.0 - (double)rs->seek_after / rs->seek_before));
+      printf("\n===========================\n");
+    }
+
+    /* Blocks shared by reflinks and snapshots that Pass 3 has to copy */
+    struct ext4_clone_plan clones;
+    int have_clones =
+        ext4_clone_plan_build(&clones, &layout, &fs_info, NULL, NULL) == 0;
+    if (have_clones) {
+      if (clones.count > 0) {
+        double mib = (double)layout.block_size / (1024.0 * 1024.0);
+        printf("\n=== CoW Clone Plan ===\n");
+        printf("  Shared runs to copy:    %u (%lu blocks, %.1f MiB)\n",
+               clones.count, (unsigned long)clones.blocks,
+               clones.blocks * mib);
+        printf("  Source ranges:          %lu (%.1f MiB read once, "
+               "in %u MiB pieces)\n",
+               (unsigned long)clones.source_ranges,
+               clones.source_blocks * mib, EXT4_CLONE_IO_MAX >> 20);
+        printf("  Reads saved by fan-out: %.1f MiB\n",
+               (clones.blocks - clones.source_blocks) * mib);
+        printf("======================\n");
+      }
+    }
+
+    dry_run_eta(opts, &dev, &fs_info, &layout, &reloc_plan,
+                have_clones ? &clones : NULL);
+    if (have_clones)
+      ext4_clone_plan_free(&clones);
 
     /* Dry-run integrity check: physically read all conflicting blocks
      * and compute CRC32C to detect I/O errors / bad sectors */
@@ -584,10 +877,15 @@ int btrfs2ext4_convert(const struct convert_options *opts,
   printf("::\n");
   printf(":: If interrupted, DO NOT run fsck! Instead, run:\n");
   printf("::     btrfs2ext4 --rollback %s\n", opts->device_path);
+  printf(":: or finish the conversion with the same options plus\n");
+  printf("::     --resume (the checkpoint is in %s)\n", mem_cfg.workdir);
   printf(":::::::::::::::::::::::::::::::::::::::::::::::::::::::::::\n\n");
 
   if (progress)
     progress("Pass 3", 0, "Writing ext4 filesystem...");
+  mem_track_phase("pass3");
+  mem_track_reclaim();
+  io_stats_phase(IO_PHASE_METADATA);
 
   printf("=== Phase 3: Writing Ext4 Structures ===\n\n");
 
@@ -601,13 +899,22 @@ int btrfs2ext4_convert(const struct convert_options *opts,
 
   /* Inicializar el allocator global de bloques Ext4 y marcar bloques de datos
    * ya usados por Btrfs (tras la relocación) para que no se reutilicen. */
-  struct ext4_block_allocator alloc;
+  ext4_alloc_set_goal_policy(!opts->no_alloc_goal);
+  ext4_tree_region_set_policy(!opts->no_tree_region);
+  ext4_itable_set_lazy_policy(!opts->no_lazy_itable);
   ext4_block_alloc_init(&alloc, &layout);
   ext4_block_alloc_mark_fs_data(&alloc, &layout, &fs_info);
 
   /* Link adaptive memory management to the Ext4 inode map */
   ino_map.mem_cfg = &mem_cfg;
 
+  /* Metadata writers issue many small writes (a 256-byte inode, one
+   * extent leaf, one directory block): combine them into page-sized
+   * writes flushed in offset order at each phase barrier below. */
+  if (!opts->no_write_cache && device_cache_enable(&dev, 0) < 0)
+    fprintf(stderr, "btrfs2ext4: write cache unavailable, writing "
+                    "through\n");
+
   if (ext4_write_superblock(&dev, &layout, &fs_info) < 0) {
     fprintf(stderr, "btrfs2ext4: failed to write superblock\n");
     goto cleanup;
@@ -623,14 +930,21 @@ int btrfs2ext4_convert(const struct convert_options *opts,
 
   if (progress)
     progress("Pass 3", 40, "Writing inode tables...");
+  io_stats_phase(IO_PHASE_INODES);
 
   if (ext4_write_inode_table(&dev, &layout, &fs_info, &ino_map, &alloc) < 0) {
     fprintf(stderr, "btrfs2ext4: failed to write inode tables\n");
     goto cleanup;
   }
 
+  if (device_cache_flush(&dev) < 0) {
+    fprintf(stderr, "btrfs2ext4: failed to flush inode tables\n");
+    goto cleanup;
+  }
+
   if (progress)
     progress("Pass 3", 55, "Writing bitmaps...");
+  io_stats_phase(IO_PHASE_METADATA);
 
   /* Bug A fix: bitmaps are written AFTER inode tables so the inode_map
    * is fully populated and ext4_write_bitmaps can mark active inodes. */
@@ -639,22 +953,39 @@ int btrfs2ext4_convert(const struct convert_options *opts,
     goto cleanup;
   }
 
+  if (device_cache_flush(&dev) < 0) {
+    fprintf(stderr, "btrfs2ext4: failed to flush bitmaps\n");
+    goto cleanup;
+  }
+
   if (progress)
     progress("Pass 3", 60, "Writing directory entries...");
+  io_stats_phase(IO_PHASE_DIRS);
 
   if (ext4_write_directories(&dev, &layout, &fs_info, &ino_map, &alloc) < 0) {
     fprintf(stderr, "btrfs2ext4: failed to write directories\n");
     goto cleanup;
   }
 
+  if (device_cache_flush(&dev) < 0) {
+    fprintf(stderr, "btrfs2ext4: failed to flush directories\n");
+    goto cleanup;
+  }
+
   if (progress)
     progress("Pass 3", 85, "Writing journal...");
+  io_stats_phase(IO_PHASE_JOURNAL);
 
   if (ext4_write_journal(&dev, &layout, &alloc, dev.size) < 0) {
     fprintf(stderr, "btrfs2ext4: failed to write journal\n");
     goto cleanup;
   }
 
+  if (device_cache_flush(&dev) < 0) {
+    fprintf(stderr, "btrfs2ext4: failed to flush journal\n");
+    goto cleanup;
+  }
+
   if (ext4_finalize_journal_inode(&dev, &layout) < 0) {
     fprintf(stderr, "btrfs2ext4: failed to finalize journal inode\n");
     goto cleanup;
@@ -662,13 +993,22 @@ int btrfs2ext4_convert(const struct convert_options *opts,
 
   if (progress)
     progress("Pass 3", 90, "Updating free block counts (GDT/Superblock)...");
+  io_stats_phase(IO_PHASE_METADATA);
 
-  if (ext4_update_free_counts(&dev, &layout) < 0) {
+  if (ext4_update_free_counts(&dev, &layout, &alloc) < 0) {
     fprintf(stderr, "btrfs2ext4: failed to update free counts\n");
     goto cleanup;
   }
 
+  if (dev.cache) {
+    struct device_cache_stats cst;
+    device_cache_get_stats(&dev, &cst);
+    printf("Write cache: %lu small writes merged into %lu I/Os\n",
+           (unsigned long)cst.writes_absorbed, (unsigned long)cst.flush_ios);
+  }
+
   device_sync(&dev);
+  checkpoint_remove(mem_cfg.workdir);
 
   if (progress)
     progress("Pass 3", 100, "Ext4 filesystem written!");
@@ -690,12 +1030,19 @@ int btrfs2ext4_convert(const struct convert_options *opts,
   ret = 0;
 
 cleanup:
+  if (opts->mem_report)
+    write_mem_report(opts->mem_report);
+  if (opts->verbose)
+    mem_track_report();
+  if (opts->stats != IO_STATS_OFF)
+    io_stats_print(stdout, opts->stats);
   ext4_block_alloc_free(&alloc);
   inode_map_free(&ino_map);
   relocator_free(&reloc_plan);
   ext4_free_layout(&layout);
   btrfs_free_fs(&fs_info);
   device_close(&dev);
+  device_buf_pool_drain();
 
   return ret;
 }
@@ -728,6 +1075,31 @@ int main(int argc, char **argv) {
   memset(&opts, 0, sizeof(opts));
   opts.block_size = 4096;
   opts.inode_ratio = 16384;
+  opts.scan_split_level = BTREE_SPLIT_AUTO;
+  opts.progress_fd = -1;
+
+  enum {
+    OPT_SCAN_SPLIT_LEVEL = 256,
+    OPT_RELOC_DEPTH,
+    OPT_NO_ALLOC_GOAL,
+    OPT_NO_TREE_REGION,
+    OPT_NO_FLEX_PACK,
+    OPT_NO_LAZY_ITABLE,
+    OPT_LAYOUT_SEARCH,
+    OPT_MAX_INODE_RATIO,
+    OPT_NO_WRITE_CACHE,
+    OPT_DIRECT_IO,
+    OPT_SCAN_ORDER,
+    OPT_MEM_REPORT,
+    OPT_STATS,
+    OPT_RESUME,
+    OPT_PLAN_ONLY,
+    OPT_VERIFY_MOVES,
+    OPT_PROFILE_WRITES,
+    OPT_DEVICE_PROFILE,
+    OPT_NO_PROGRESS,
+    OPT_PROGRESS_FD
+  };
 
   static struct option long_options[] = {
       {"dry-run", no_argument, NULL, 'n'},
@@ -737,12 +1109,33 @@ int main(int argc, char **argv) {
       {"rollback", no_argument, NULL, 'r'},
       {"workdir", required_argument, NULL, 'w'},
       {"memory-limit", required_argument, NULL, 'm'},
+      {"scan-threads", required_argument, NULL, 'j'},
+      {"scan-split-level", required_argument, NULL, OPT_SCAN_SPLIT_LEVEL},
+      {"scan-order", required_argument, NULL, OPT_SCAN_ORDER},
+      {"reloc-depth", required_argument, NULL, OPT_RELOC_DEPTH},
+      {"no-alloc-goal", no_argument, NULL, OPT_NO_ALLOC_GOAL},
+      {"no-tree-region", no_argument, NULL, OPT_NO_TREE_REGION},
+      {"no-flex-pack", no_argument, NULL, OPT_NO_FLEX_PACK},
+      {"no-lazy-itable", no_argument, NULL, OPT_NO_LAZY_ITABLE},
+      {"layout-search", no_argument, NULL, OPT_LAYOUT_SEARCH},
+      {"max-inode-ratio", required_argument, NULL, OPT_MAX_INODE_RATIO},
+      {"no-write-cache", no_argument, NULL, OPT_NO_WRITE_CACHE},
+      {"direct-io", no_argument, NULL, OPT_DIRECT_IO},
+      {"mem-report", required_argument, NULL, OPT_MEM_REPORT},
+      {"stats", optional_argument, NULL, OPT_STATS},
+      {"resume", no_argument, NULL, OPT_RESUME},
+      {"plan-only", no_argument, NULL, OPT_PLAN_ONLY},
+      {"verify-moves", no_argument, NULL, OPT_VERIFY_MOVES},
+      {"profile-writes", no_argument, NULL, OPT_PROFILE_WRITES},
+      {"device-profile", required_argument, NULL, OPT_DEVICE_PROFILE},
+      {"no-progress", no_argument, NULL, OPT_NO_PROGRESS},
+      {"progress-fd", required_argument, NULL, OPT_PROGRESS_FD},
       {"help", no_argument, NULL, 'h'},
       {"version", no_argument, NULL, 'V'},
       {NULL, 0, NULL, 0}};
 
   int opt;
-  while ((opt = getopt_long(argc, argv, "nvb:i:rw:m:hV", long_options, NULL)) !=
+  while ((opt = getopt_long(argc, argv, "nvb:i:rw:m:j:hV", long_options, NULL)) !=
          -1) {
     switch (opt) {
     case 'n':
@@ -772,6 +1165,110 @@ int main(int argc, char **argv) {
     case 'm':
       opts.memory_limit_mb = (uint32_t)atoi(optarg);
       break;
+    case 'j':
+      opts.scan_threads = (uint32_t)atoi(optarg);
+      break;
+    case OPT_SCAN_SPLIT_LEVEL: {
+      int level = atoi(optarg);
+      if (level < 0 || level > 7) {
+        fprintf(stderr, "Invalid scan split level %d (must be 0-7)\n", level);
+        return 1;
+      }
+      opts.scan_split_level = (uint8_t)level;
+      break;
+    }
+    case OPT_SCAN_ORDER:
+      if (strcmp(optarg, "key") == 0) {
+        opts.scan_order = BTRFS_SCAN_KEY;
+      } else if (strcmp(optarg, "physical") == 0) {
+        opts.scan_order = BTRFS_SCAN_PHYSICAL;
+      } else if (strcmp(optarg, "auto") == 0) {
+        opts.scan_order = BTRFS_SCAN_AUTO;
+      } else {
+        fprintf(stderr,
+                "Invalid scan order '%s' (must be key, physical or auto)\n",
+                optarg);
+        return 1;
+      }
+      break;
+    case OPT_RELOC_DEPTH: {
+      int depth = atoi(optarg);
+      if (depth < 1 || depth > RELOCATOR_MAX_DEPTH) {
+        fprintf(stderr, "Invalid relocation depth %d (must be 1-%d)\n", depth,
+                RELOCATOR_MAX_DEPTH);
+        return 1;
+      }
+      opts.reloc_depth = (uint32_t)depth;
+      break;
+    }
+    case OPT_VERIFY_MOVES:
+      opts.verify_moves = 1;
+      break;
+    case OPT_NO_ALLOC_GOAL:
+      opts.no_alloc_goal = 1;
+      break;
+    case OPT_NO_TREE_REGION:
+      opts.no_tree_region = 1;
+      break;
+    case OPT_NO_FLEX_PACK:
+      opts.no_flex_pack = 1;
+      break;
+    case OPT_NO_LAZY_ITABLE:
+      opts.no_lazy_itable = 1;
+      break;
+    case OPT_LAYOUT_SEARCH:
+      opts.layout_search = 1;
+      break;
+    case OPT_MAX_INODE_RATIO:
+      opts.max_inode_ratio = (uint32_t)atoi(optarg);
+      break;
+    case OPT_NO_WRITE_CACHE:
+      opts.no_write_cache = 1;
+      break;
+    case OPT_DIRECT_IO:
+      opts.direct_io = 1;
+      break;
+    case OPT_MEM_REPORT:
+      opts.mem_report = optarg;
+      break;
+    case OPT_STATS:
+      if (!optarg || strcmp(optarg, "text") == 0) {
+        opts.stats = IO_STATS_TEXT;
+      } else if (strcmp(optarg, "json") == 0) {
+        opts.stats = IO_STATS_JSON;
+      } else {
+        fprintf(stderr, "Invalid stats format '%s' (must be text or json)\n",
+                optarg);
+        return 1;
+      }
+      break;
+    case OPT_RESUME:
+      opts.resume = 1;
+      break;
+    case OPT_PLAN_ONLY:
+      opts.plan_only = 1;
+      break;
+    case OPT_PROFILE_WRITES:
+      opts.profile_writes = 1;
+      break;
+    case OPT_DEVICE_PROFILE:
+      opts.device_profile = optarg;
+      break;
+    case OPT_NO_PROGRESS:
+      opts.no_progress = 1;
+      break;
+    case OPT_PROGRESS_FD: {
+      char *end;
+      long fd = strtol(optarg, &end, 10);
+      if (*optarg == '\0' || *end != '\0' || fd < 0 || fd > INT32_MAX ||
+          fcntl((int)fd, F_GETFD) < 0) {
+        fprintf(stderr, "Invalid progress descriptor '%s' (not open)\n",
+                optarg);
+        return 1;
+      }
+      opts.progress_fd = (int)fd;
+      break;
+    }
     case 'h':
       print_usage(argv[0]);
       return 0;
@@ -792,6 +1289,18 @@ int main(int argc, char **argv) {
 
   opts.device_path = argv[optind];
 
+  if (opts.plan_only && (opts.dry_run || opts.resume || opts.rollback)) {
+    fprintf(stderr, "Error: --plan-only cannot be combined with --dry-run, "
+                    "--resume or --rollback\n");
+    return 1;
+  }
+
+  if ((opts.profile_writes || opts.device_profile) && !opts.dry_run) {
+    fprintf(stderr,
+            "Error: --profile-writes and --device-profile need --dry-run\n");
+    return 1;
+  }
+
   /* Check that device exists */
   struct stat st;
   if (stat(opts.device_path, &st) < 0) {
@@ -811,9 +1320,20 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  if (progress_start(opts.no_progress ? NULL : stdout, opts.progress_fd,
+                     0) < 0)
+    fprintf(stderr, "Warning: cannot start the progress reporter\n");
+
+  int ret;
   if (opts.rollback) {
-    return btrfs2ext4_rollback(opts.device_path);
+    ret = btrfs2ext4_rollback(opts.device_path) < 0 ? 1 : 0;
+    /* The snapshot describes a conversion that no longer exists */
+    if (ret == 0)
+      checkpoint_remove(opts.workdir);
+  } else {
+    ret = btrfs2ext4_convert(&opts, progress_print);
   }
 
-  return btrfs2ext4_convert(&opts, progress_print);
+  progress_stop();
+  return ret;
 }
@@ -4,9 +4,14 @@
  * Reads MemAvailable from /proc/meminfo at init time and tracks the
  * cumulative allocations made by the converter. If the tracked usage
  * exceeds 75% of available memory, callers can disable optional data
- * structures (e.g., hash tables) and fall back to linear scans.
+ * structures (e.g., hash tables) and fall back to linear scans, and
+ * mem_track_reclaim() asks the registered subsystems to shrink.
+ *
+ * Counters are plain uint64_t updated with __atomic builtins, so the
+ * Pass 1 workers and the Pass 3 writer threads never take a lock here.
  */
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,21 +19,73 @@
 #include "mem_tracker.h"
 
 static uint64_t g_mem_used = 0;
+static uint64_t g_mem_peak = 0;
 static uint64_t g_mem_threshold = 0;
 static uint64_t g_mem_available = 0;
+static uint64_t g_mem_limit = 0; /* mem_track_set_limit(), 0 = 75% rule */
 static int g_initialized = 0;
 
+static uint64_t g_tag_used[MEM_TAG_COUNT];
+static uint64_t g_tag_peak[MEM_TAG_COUNT];
+
+struct mem_phase {
+  const char *name;
+  uint64_t peak;
+  uint64_t tag_peak[MEM_TAG_COUNT];
+};
+
+static struct mem_phase g_phases[MEM_TRACK_MAX_PHASES];
+static uint32_t g_phase_count = 0;
+
+static struct {
+  mem_reclaim_fn fn;
+  void *arg;
+} g_reclaim[MEM_TAG_COUNT];
+static pthread_mutex_t g_reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *const g_tag_names[MEM_TAG_COUNT] = {
+    [MEM_TAG_OTHER] = "other",
+    [MEM_TAG_PASS1] = "pass1",
+    [MEM_TAG_CHUNK_MAP] = "chunk_map",
+    [MEM_TAG_USAGE_MAP] = "usage_map",
+    [MEM_TAG_NODE_CACHE] = "node_cache",
+    [MEM_TAG_RELOC] = "relocation",
+    [MEM_TAG_INODE_MAP] = "inode_map",
+    [MEM_TAG_BLOOM] = "bloom",
+    [MEM_TAG_DIR] = "dir_builder",
+    [MEM_TAG_IO_BUF] = "io_buffers",
+    [MEM_TAG_WRITE_CACHE] = "write_cache",
+};
+
+static inline void atomic_max_u64(uint64_t *p, uint64_t v) {
+  uint64_t cur = __atomic_load_n(p, __ATOMIC_RELAXED);
+  while (v > cur && !__atomic_compare_exchange_n(p, &cur, v, 1,
+                                                 __ATOMIC_RELAXED,
+                                                 __ATOMIC_RELAXED)) {
+  }
+}
+
+/* Subtract, stopping at 0 (a free that was never counted) */
+static inline uint64_t atomic_sub_clamp_u64(uint64_t *p, uint64_t v) {
+  uint64_t cur = __atomic_load_n(p, __ATOMIC_RELAXED);
+  uint64_t next;
+  do {
+    next = cur > v ? cur - v : 0;
+  } while (!__atomic_compare_exchange_n(p, &cur, next, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED));
+  return next;
+}
+
 void mem_track_init(void) {
-  g_mem_used = 0;
   g_mem_threshold = 0;
   g_mem_available = 0;
-  g_initialized = 1;
 
   FILE *f = fopen("/proc/meminfo", "r");
   if (!f) {
     /* Non-Linux or /proc not available — set very high threshold */
     g_mem_available = (uint64_t)16 * 1024 * 1024 * 1024; /* 16 GiB fallback */
-    g_mem_threshold = g_mem_available;
+    g_mem_threshold = g_mem_limit ? g_mem_limit : g_mem_available;
+    g_initialized = 1;
     return;
   }
 
@@ -50,44 +107,200 @@ void mem_track_init(void) {
   }
 
   /* Set threshold to 75% of available memory */
-  g_mem_threshold = (g_mem_available * 3) / 4;
+  g_mem_threshold = g_mem_limit ? g_mem_limit : (g_mem_available * 3) / 4;
+  g_initialized = 1;
+}
+
+void mem_track_set_limit(uint64_t bytes) {
+  if (!g_initialized)
+    mem_track_init();
+  if (bytes == 0)
+    return;
+  g_mem_limit = bytes;
+  g_mem_threshold = bytes;
 }
 
-void mem_track_alloc(size_t bytes) {
+void mem_track_alloc_tag(enum mem_tag tag, size_t bytes) {
   if (!g_initialized)
     mem_track_init();
-  g_mem_used += bytes;
+  if ((unsigned)tag >= MEM_TAG_COUNT)
+    tag = MEM_TAG_OTHER;
+
+  uint64_t t = __atomic_add_fetch(&g_tag_used[tag], bytes, __ATOMIC_RELAXED);
+  uint64_t all = __atomic_add_fetch(&g_mem_used, bytes, __ATOMIC_RELAXED);
+  atomic_max_u64(&g_tag_peak[tag], t);
+  atomic_max_u64(&g_mem_peak, all);
+
+  uint32_t n = __atomic_load_n(&g_phase_count, __ATOMIC_ACQUIRE);
+  if (n > 0) {
+    struct mem_phase *ph = &g_phases[n - 1];
+    atomic_max_u64(&ph->tag_peak[tag], t);
+    atomic_max_u64(&ph->peak, all);
+  }
 }
 
-void mem_track_free(size_t bytes) {
-  if (bytes <= g_mem_used)
-    g_mem_used -= bytes;
-  else
-    g_mem_used = 0;
+void mem_track_free_tag(enum mem_tag tag, size_t bytes) {
+  if ((unsigned)tag >= MEM_TAG_COUNT)
+    tag = MEM_TAG_OTHER;
+  atomic_sub_clamp_u64(&g_tag_used[tag], bytes);
+  atomic_sub_clamp_u64(&g_mem_used, bytes);
 }
 
-uint64_t mem_track_usage(void) { return g_mem_used; }
+void mem_track_alloc(size_t bytes) { mem_track_alloc_tag(MEM_TAG_OTHER, bytes); }
+
+void mem_track_free(size_t bytes) { mem_track_free_tag(MEM_TAG_OTHER, bytes); }
+
+uint64_t mem_track_usage(void) {
+  return __atomic_load_n(&g_mem_used, __ATOMIC_RELAXED);
+}
+
+uint64_t mem_track_tag_usage(enum mem_tag tag) {
+  if ((unsigned)tag >= MEM_TAG_COUNT)
+    return 0;
+  return __atomic_load_n(&g_tag_used[tag], __ATOMIC_RELAXED);
+}
+
+uint64_t mem_track_tag_peak(enum mem_tag tag) {
+  if ((unsigned)tag >= MEM_TAG_COUNT)
+    return 0;
+  return __atomic_load_n(&g_tag_peak[tag], __ATOMIC_RELAXED);
+}
 
 int mem_track_exceeded(void) {
   if (!g_initialized)
     mem_track_init();
-  return g_mem_used > g_mem_threshold;
+  return mem_track_usage() > g_mem_threshold;
+}
+
+void mem_track_phase(const char *name) {
+  uint32_t n = __atomic_load_n(&g_phase_count, __ATOMIC_RELAXED);
+  if (n >= MEM_TRACK_MAX_PHASES)
+    return; /* the last phase keeps collecting */
+
+  struct mem_phase *ph = &g_phases[n];
+  ph->name = name;
+  ph->peak = mem_track_usage();
+  for (unsigned t = 0; t < MEM_TAG_COUNT; t++)
+    ph->tag_peak[t] = mem_track_tag_usage((enum mem_tag)t);
+  __atomic_store_n(&g_phase_count, n + 1, __ATOMIC_RELEASE);
+}
+
+const char *mem_track_tag_name(enum mem_tag tag) {
+  if ((unsigned)tag >= MEM_TAG_COUNT)
+    return "unknown";
+  return g_tag_names[tag];
+}
+
+void mem_track_set_reclaim(enum mem_tag tag, mem_reclaim_fn fn, void *arg) {
+  if ((unsigned)tag >= MEM_TAG_COUNT)
+    return;
+  pthread_mutex_lock(&g_reclaim_lock);
+  g_reclaim[tag].fn = fn;
+  g_reclaim[tag].arg = fn ? arg : NULL;
+  pthread_mutex_unlock(&g_reclaim_lock);
+}
+
+uint64_t mem_track_reclaim(void) {
+  if (!mem_track_exceeded())
+    return 0;
+  if (pthread_mutex_trylock(&g_reclaim_lock) != 0)
+    return 0; /* someone else is already reclaiming */
+
+  uint64_t released = 0;
+  int tried[MEM_TAG_COUNT] = {0};
+  while (mem_track_exceeded()) {
+    int best = -1;
+    for (unsigned t = 0; t < MEM_TAG_COUNT; t++) {
+      if (!g_reclaim[t].fn || tried[t])
+        continue;
+      if (best < 0 || mem_track_tag_usage((enum mem_tag)t) >
+                          mem_track_tag_usage((enum mem_tag)best))
+        best = (int)t;
+    }
+    if (best < 0)
+      break;
+    tried[best] = 1;
+
+    uint64_t used = mem_track_usage();
+    uint64_t want = used > g_mem_threshold ? used - g_mem_threshold : 0;
+    released += g_reclaim[best].fn(g_reclaim[best].arg, want);
+  }
+  pthread_mutex_unlock(&g_reclaim_lock);
+  return released;
+}
+
+static int json_tags(FILE *f, const uint64_t *values) {
+  int err = fprintf(f, "{") < 0;
+  for (unsigned t = 0; t < MEM_TAG_COUNT; t++)
+    err |= fprintf(f, "%s\"%s\": %lu", t ? ", " : "", g_tag_names[t],
+                   (unsigned long)values[t]) < 0;
+  err |= fprintf(f, "}") < 0;
+  return err;
+}
+
+int mem_track_write_json(FILE *f) {
+  if (!g_initialized)
+    mem_track_init();
+
+  uint64_t cur[MEM_TAG_COUNT], peak[MEM_TAG_COUNT];
+  for (unsigned t = 0; t < MEM_TAG_COUNT; t++) {
+    cur[t] = mem_track_tag_usage((enum mem_tag)t);
+    peak[t] = mem_track_tag_peak((enum mem_tag)t);
+  }
+
+  int err = fprintf(f,
+                    "{\n  \"available\": %lu,\n  \"threshold\": %lu,\n"
+                    "  \"current\": %lu,\n  \"peak\": %lu,\n",
+                    (unsigned long)g_mem_available,
+                    (unsigned long)g_mem_threshold,
+                    (unsigned long)mem_track_usage(),
+                    (unsigned long)__atomic_load_n(&g_mem_peak,
+                                                   __ATOMIC_RELAXED)) < 0;
+  err |= fprintf(f, "  \"tags_current\": ") < 0;
+  err |= json_tags(f, cur);
+  err |= fprintf(f, ",\n  \"tags_peak\": ") < 0;
+  err |= json_tags(f, peak);
+  err |= fprintf(f, ",\n  \"phases\": [") < 0;
+
+  uint32_t n = __atomic_load_n(&g_phase_count, __ATOMIC_ACQUIRE);
+  for (uint32_t i = 0; i < n; i++) {
+    const struct mem_phase *ph = &g_phases[i];
+    uint64_t tp[MEM_TAG_COUNT];
+    for (unsigned t = 0; t < MEM_TAG_COUNT; t++)
+      tp[t] = __atomic_load_n(&ph->tag_peak[t], __ATOMIC_RELAXED);
+    err |= fprintf(f, "%s\n    {\"name\": \"%s\", \"peak\": %lu, \"tags\": ",
+                   i ? "," : "", ph->name ? ph->name : "",
+                   (unsigned long)__atomic_load_n(&ph->peak,
+                                                  __ATOMIC_RELAXED)) < 0;
+    err |= json_tags(f, tp);
+    err |= fprintf(f, "}") < 0;
+  }
+  err |= fprintf(f, "%s]\n}\n", n ? "\n  " : "") < 0;
+  return err ? -1 : 0;
 }
 
 void mem_track_report(void) {
   if (!g_initialized)
     return;
 
+  uint64_t used = mem_track_usage();
   printf("  Memory usage:     %.1f MiB / %.1f MiB available (%.0f%% of "
          "threshold)\n",
-         (double)g_mem_used / (1024.0 * 1024.0),
+         (double)used / (1024.0 * 1024.0),
          (double)g_mem_available / (1024.0 * 1024.0),
-         g_mem_threshold > 0 ? (double)g_mem_used * 100.0 / g_mem_threshold
-                             : 0.0);
+         g_mem_threshold > 0 ? (double)used * 100.0 / g_mem_threshold : 0.0);
+  for (unsigned t = 0; t < MEM_TAG_COUNT; t++) {
+    uint64_t peak = mem_track_tag_peak((enum mem_tag)t);
+    if (peak == 0)
+      continue;
+    printf("    %-12s    %.1f MiB now, %.1f MiB peak\n", g_tag_names[t],
+           (double)mem_track_tag_usage((enum mem_tag)t) / (1024.0 * 1024.0),
+           (double)peak / (1024.0 * 1024.0));
+  }
 
-  if (g_mem_used > g_mem_threshold) {
+  if (used > g_mem_threshold) {
     fprintf(stderr,
-            "  WARNING: memory usage exceeds 75%% of available RAM!\n"
+            "  WARNING: memory usage exceeds the tracker threshold!\n"
             "  Disabling optional hash tables to reduce memory pressure.\n");
   }
 }
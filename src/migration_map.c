@@ -14,15 +14,10 @@
 
 extern uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
 
-int migration_map_save(struct device *dev, const struct relocation_plan *plan) {
-  /* Write btrfs superblock backup */
-  struct btrfs_super_block sb_backup;
-  if (device_read(dev, BTRFS_SUPER_OFFSET, &sb_backup, sizeof(sb_backup)) < 0)
-    return -1;
-
+/* Entries and footer, below the superblock backup */
+static int migration_map_write(struct device *dev,
+                               const struct relocation_plan *plan) {
   uint64_t backup_offset = (dev->size - SUPERBLOCK_BACKUP_OFFSET) & ~4095ULL;
-  if (device_write(dev, backup_offset, &sb_backup, sizeof(sb_backup)) < 0)
-    return -1;
 
   /* Calculate map size and offset */
   if (plan->count == 0)
@@ -74,6 +69,24 @@ int migration_map_save(struct device *dev, const struct relocation_plan *plan) {
   return 0;
 }
 
+int migration_map_save(struct device *dev, const struct relocation_plan *plan) {
+  /* Write btrfs superblock backup */
+  struct btrfs_super_block sb_backup;
+  if (device_read(dev, BTRFS_SUPER_OFFSET, &sb_backup, sizeof(sb_backup)) < 0)
+    return -1;
+
+  uint64_t backup_offset = (dev->size - SUPERBLOCK_BACKUP_OFFSET) & ~4095ULL;
+  if (device_write(dev, backup_offset, &sb_backup, sizeof(sb_backup)) < 0)
+    return -1;
+
+  return migration_map_write(dev, plan);
+}
+
+int migration_map_update(struct device *dev,
+                         const struct relocation_plan *plan) {
+  return migration_map_write(dev, plan);
+}
+
 int migration_map_rollback(struct device *dev) {
   uint64_t backup_offset = (dev->size - SUPERBLOCK_BACKUP_OFFSET) & ~4095ULL;
   uint64_t footer_offset = backup_offset - MIGRATION_FOOTER_OFFSET;
@@ -123,48 +136,51 @@ int migration_map_rollback(struct device *dev) {
       return -1;
     }
 
-    printf("Reversing block relocations...\n");
-
-    /* Buffer for copying data */
-    uint8_t *buf = malloc(1024 * 1024); /* 1MB copy buffer */
-    if (!buf) {
-      free(entries);
-      return -1;
-    }
-
-    /* Iterate backwards. */
-    for (int32_t i = footer.entry_count - 1; i >= 0; i--) {
+    /* Copies recorded with a CRC are checked before anything is written,
+     * so a damaged copy aborts the rollback with the device untouched */
+    struct relocation_plan undo;
+    memset(&undo, 0, sizeof(undo));
+    undo.entries = entries;
+    undo.count = footer.entry_count;
+    uint32_t checked = 0;
+    for (uint32_t i = 0; i < undo.count; i++) {
       struct relocation_entry *re = &entries[i];
-
-      uint64_t remaining = re->length;
-      uint64_t src = re->dst_offset; /* reading from where we copied TO */
-      uint64_t dst = re->src_offset; /* writing back to where we copied FROM */
-
-      while (remaining > 0) {
-        uint32_t chunk = remaining > 1024 * 1024 ? 1024 * 1024 : remaining;
-        if (device_read(dev, src, buf, chunk) < 0) {
-          fprintf(stderr,
-                  "btrfs2ext4: rollback failed to read block at 0x%lx\n",
-                  (unsigned long)src);
-          free(buf);
-          free(entries);
-          return -1;
-        }
-        if (device_write(dev, dst, buf, chunk) < 0) {
+      uint64_t src = re->src_offset;
+      re->src_offset = re->dst_offset; /* read from where we copied TO */
+      re->dst_offset = src;            /* write back to where it came FROM */
+      re->completed = 0;
+      checked += (re->flags & RELOC_FLAG_CHECKSUM) != 0;
+    }
+    if (checked > 0) {
+      printf("Verifying %u relocated extents...\n", checked);
+      int64_t bad = relocator_verify(&undo, dev,
+                                     device_is_rotational(dev) == 1 ? 1 : 0);
+      if (bad != 0) {
+        if (bad > 0)
           fprintf(stderr,
-                  "btrfs2ext4: rollback failed to restore block at 0x%lx\n",
-                  (unsigned long)dst);
-          free(buf);
-          free(entries);
-          return -1;
-        }
-        src += chunk;
-        dst += chunk;
-        remaining -= chunk;
+                  "btrfs2ext4: %ld relocated extents fail their CRC. "
+                  "Rollback aborted, nothing was changed.\n",
+                  (long)bad);
+        free(entries);
+        return -1;
       }
     }
 
-    free(buf);
+    /* Undo the moves last to first: a move that overwrote the source of an
+     * earlier one is reversed before that one reads it back */
+    for (uint32_t i = 0, j = undo.count - 1; i < j; i++, j--) {
+      struct relocation_entry tmp = entries[i];
+      entries[i] = entries[j];
+      entries[j] = tmp;
+    }
+
+    printf("Reversing block relocations...\n");
+    if (relocator_move(&undo, dev) < 0) {
+      fprintf(stderr, "btrfs2ext4: rollback failed to restore moved blocks\n");
+      free(entries);
+      return -1;
+    }
+
     free(entries);
     printf("Block relocations reversed.\n");
   }
@@ -0,0 +1,303 @@
+/*
+ * progress.c — Live progress of the long phases
+ *
+ * The work counter sits alone on its cache line; everything else (the
+ * phase description and the reporter's state) is guarded by one mutex that
+ * only the reporter and the begin/end calls take. The reporter sleeps on a
+ * condition variable so progress_stop() does not wait out an interval.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "progress.h"
+
+/* Alone on its cache line: the only thing the workers touch */
+static struct {
+  _Alignas(64) uint64_t done;
+  char pad[64 - sizeof(uint64_t)];
+} g_work;
+
+struct progress_phase {
+  const char *name;
+  const char *unit; /* NULL = bytes */
+  uint64_t total;
+  double start;
+  uint32_t seq; /* bumped by every progress_begin() */
+  int active;
+};
+
+/* Reporter's view of the phase it last sampled */
+struct progress_view {
+  uint32_t seq;
+  uint64_t prev_done;
+  double prev_time;
+  double rate_avg; /* < 0 until the first sample */
+  double last_log;
+  int shown; /* a status line or log line went out for this phase */
+};
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t g_thread;
+static int g_running;
+static int g_stop;
+static FILE *g_out;
+static int g_tty;
+static int g_json_fd = -1;
+static uint32_t g_interval_ms;
+static double g_epoch;
+static struct progress_phase g_phase;
+static struct progress_view g_view;
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void progress_add(uint64_t n) {
+  __atomic_fetch_add(&g_work.done, n, __ATOMIC_RELAXED);
+}
+
+uint64_t progress_done(void) {
+  return __atomic_load_n(&g_work.done, __ATOMIC_RELAXED);
+}
+
+/* "1.2 GiB" / "840.0 MiB" for bytes, the plain count for items */
+static void format_amount(char *buf, size_t len, double v, const char *unit) {
+  if (unit)
+    snprintf(buf, len, "%.0f", v);
+  else if (v >= 1024.0 * 1024 * 1024)
+    snprintf(buf, len, "%.1f GiB", v / (1024.0 * 1024 * 1024));
+  else
+    snprintf(buf, len, "%.1f MiB", v / (1024.0 * 1024));
+}
+
+static void format_duration(char *buf, size_t len, double sec) {
+  if (sec >= 3600)
+    snprintf(buf, len, "%.0fh%02.0fm", floor(sec / 3600),
+             floor(fmod(sec, 3600) / 60));
+  else if (sec >= 60)
+    snprintf(buf, len, "%.0fm%02.0fs", floor(sec / 60),
+             floor(fmod(sec, 60)));
+  else
+    snprintf(buf, len, "%.0fs", sec);
+}
+
+/* Whole record in one write(); a failing reader turns JSON output off */
+static void json_emit(const char *line, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(g_json_fd, line, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      g_json_fd = -1;
+      return;
+    }
+    line += n;
+    len -= (size_t)n;
+  }
+}
+
+static void json_record(const char *event, double now, uint64_t done,
+                        double rate, double rate_avg, double eta) {
+  if (g_json_fd < 0)
+    return;
+  char line[512];
+  int n = snprintf(
+      line, sizeof(line),
+      "{\"event\":\"%s\",\"time\":%.3f,\"phase\":\"%s\",\"unit\":\"%s\","
+      "\"elapsed\":%.3f,\"done\":%lu,\"total\":%lu,\"rate\":%.1f,"
+      "\"rate_avg\":%.1f,\"eta\":",
+      event, now - g_epoch, g_phase.name,
+      g_phase.unit ? g_phase.unit : "bytes", now - g_phase.start,
+      (unsigned long)done, (unsigned long)g_phase.total, rate, rate_avg);
+  if (n < 0 || (size_t)n >= sizeof(line) - 32)
+    return;
+  n += eta >= 0.0 ? snprintf(line + n, sizeof(line) - n, "%.1f}\n", eta)
+                  : snprintf(line + n, sizeof(line) - n, "null}\n");
+  json_emit(line, (size_t)n);
+}
+
+/* Status text: "[relocate]  45.2%  1.2 GiB / 2.6 GiB  85.3 MiB/s  ETA 4m" */
+static void status_text(char *buf, size_t len, uint64_t done, double rate,
+                        double eta) {
+  char d[32], t[32], r[32], e[32];
+  format_amount(d, sizeof(d), (double)done, g_phase.unit);
+  format_amount(r, sizeof(r), rate, g_phase.unit);
+  const char *per = g_phase.unit ? g_phase.unit : "";
+  if (g_phase.total > 0) {
+    format_amount(t, sizeof(t), (double)g_phase.total, g_phase.unit);
+    double pct = 100.0 * (double)done / (double)g_phase.total;
+    int n = snprintf(buf, len, "[%s] %5.1f%%  %s / %s %s  %s %s/s",
+                     g_phase.name, pct > 100.0 ? 100.0 : pct, d, t, per, r,
+                     per);
+    if (eta >= 0.0 && n > 0 && (size_t)n < len) {
+      format_duration(e, sizeof(e), eta);
+      snprintf(buf + n, len - n, "  ETA %s", e);
+    }
+  } else {
+    snprintf(buf, len, "[%s] %s %s  %s %s/s", g_phase.name, d, per, r, per);
+  }
+}
+
+/* One sample of the current phase; g_lock held */
+static void progress_sample(double now) {
+  struct progress_view *v = &g_view;
+  if (v->seq != g_phase.seq) {
+    memset(v, 0, sizeof(*v));
+    v->seq = g_phase.seq;
+    v->prev_time = g_phase.start;
+    v->last_log = g_phase.start;
+    v->rate_avg = -1.0;
+  }
+
+  uint64_t done = progress_done();
+  double dt = now - v->prev_time;
+  if (dt <= 0.0)
+    return;
+  double rate = (double)(done - v->prev_done) / dt;
+  if (v->rate_avg < 0.0)
+    v->rate_avg = rate;
+  else
+    v->rate_avg +=
+        (1.0 - exp(-dt / PROGRESS_SMOOTH_SEC)) * (rate - v->rate_avg);
+  v->prev_done = done;
+  v->prev_time = now;
+
+  double eta = -1.0;
+  if (g_phase.total > 0 && done >= g_phase.total)
+    eta = 0.0;
+  else if (g_phase.total > 0 && v->rate_avg > 0.0)
+    eta = (double)(g_phase.total - done) / v->rate_avg;
+
+  json_record("progress", now, done, rate, v->rate_avg, eta);
+
+  if (!g_out)
+    return;
+  char line[256];
+  if (g_tty) {
+    status_text(line, sizeof(line), done, v->rate_avg, eta);
+    fprintf(g_out, "\r  %s\033[K", line);
+    fflush(g_out);
+    v->shown = 1;
+  } else if ((now - v->last_log) * 1000.0 >= PROGRESS_LOG_INTERVAL_MS) {
+    status_text(line, sizeof(line), done, v->rate_avg, eta);
+    fprintf(g_out, "  %s\n", line);
+    fflush(g_out);
+    v->last_log = now;
+    v->shown = 1;
+  }
+}
+
+static void *progress_thread(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&g_lock);
+  while (!g_stop) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += g_interval_ms / 1000;
+    ts.tv_nsec += (long)(g_interval_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+    }
+    int rc = 0;
+    while (!g_stop && rc == 0)
+      rc = pthread_cond_timedwait(&g_wake, &g_lock, &ts);
+    if (!g_stop && g_phase.active)
+      progress_sample(now_sec());
+  }
+  pthread_mutex_unlock(&g_lock);
+  return NULL;
+}
+
+int progress_start(FILE *out, int json_fd, uint32_t interval_ms) {
+  if (g_running)
+    return 0;
+  g_out = out;
+  g_tty = out && isatty(fileno(out));
+  g_json_fd = json_fd;
+  g_interval_ms = interval_ms ? interval_ms : PROGRESS_INTERVAL_MS;
+  g_epoch = now_sec();
+  g_stop = 0;
+  if (json_fd >= 0)
+    signal(SIGPIPE, SIG_IGN);
+  if (pthread_create(&g_thread, NULL, progress_thread, NULL) != 0) {
+    g_out = NULL;
+    g_json_fd = -1;
+    return -1;
+  }
+  g_running = 1;
+  return 0;
+}
+
+/* g_lock held */
+static void progress_finish(void) {
+  if (!g_phase.active)
+    return;
+  g_phase.active = 0;
+  if (!g_running)
+    return;
+
+  double now = now_sec();
+  double elapsed = now - g_phase.start;
+  uint64_t done = progress_done();
+  double rate = elapsed > 0.0 ? (double)done / elapsed : 0.0;
+  json_record("end", now, done, rate, rate, 0.0);
+
+  if (g_out && g_view.seq == g_phase.seq && g_view.shown) {
+    char d[32], r[32], e[32];
+    format_amount(d, sizeof(d), (double)done, g_phase.unit);
+    format_amount(r, sizeof(r), rate, g_phase.unit);
+    format_duration(e, sizeof(e), elapsed);
+    const char *per = g_phase.unit ? g_phase.unit : "";
+    fprintf(g_out, "%s  [%s] %s %s in %s (%s %s/s)\n",
+            g_tty ? "\r\033[K" : "", g_phase.name, d, per, e, r, per);
+    fflush(g_out);
+  }
+}
+
+void progress_begin(const char *phase, uint64_t total, const char *unit) {
+  pthread_mutex_lock(&g_lock);
+  progress_finish();
+  __atomic_store_n(&g_work.done, 0, __ATOMIC_RELAXED);
+  g_phase.name = phase;
+  g_phase.unit = unit;
+  g_phase.total = total;
+  g_phase.start = now_sec();
+  g_phase.seq++;
+  g_phase.active = 1;
+  if (g_running)
+    json_record("begin", g_phase.start, 0, 0.0, 0.0, -1.0);
+  pthread_mutex_unlock(&g_lock);
+}
+
+void progress_end(void) {
+  pthread_mutex_lock(&g_lock);
+  progress_finish();
+  pthread_mutex_unlock(&g_lock);
+}
+
+void progress_stop(void) {
+  pthread_mutex_lock(&g_lock);
+  progress_finish();
+  int running = g_running;
+  g_stop = 1;
+  pthread_cond_signal(&g_wake);
+  pthread_mutex_unlock(&g_lock);
+  if (running)
+    pthread_join(g_thread, NULL);
+
+  pthread_mutex_lock(&g_lock);
+  g_running = 0;
+  g_out = NULL;
+  g_json_fd = -1;
+  pthread_mutex_unlock(&g_lock);
+}
@@ -0,0 +1,318 @@
+/*
+ * reloc_schedule.c — Seek-minimizing relocation scheduler
+ *
+ * relocator_plan() produces moves sorted by source offset. Executed one by
+ * one, an HDD head then swings between the low ext4 metadata regions (the
+ * sources) and the free space the destinations were carved from, twice per
+ * move. This stage reorders the plan so it can run as sweeps instead:
+ *
+ * - Dependency graph: entry A must read its source before entry B writes
+ *   over it (edge A → B). Sources never overlap each other, so the entries
+ *   whose source intersects B's destination form a contiguous range of the
+ *   source-sorted array and are found with one binary search.
+ * - Elevator order: among the entries whose predecessors have all run, the
+ *   next one is the closest source in the current sweep direction; the
+ *   direction only reverses when nothing is left ahead (SCAN).
+ * - Cycles: when nothing is ready, one pending entry is split into
+ *   src → scratch (which releases everything waiting on its source) and
+ *   scratch → dst, emitted once its own predecessors have run.
+ * - Unwritten entries (RELOC_FLAG_UNWRITTEN) copy nothing, so they have no
+ *   edges and cost no head travel.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "relocator.h"
+
+/* ========================================================================
+ * Seek model
+ * ======================================================================== */
+
+static inline uint64_t seek_delta(uint64_t a, uint64_t b) {
+  return a > b ? a - b : b - a;
+}
+
+uint64_t relocator_seek_distance(const struct relocation_plan *plan,
+                                 uint32_t batch) {
+  if (plan->count == 0)
+    return 0;
+  if (batch == 0)
+    batch = 1;
+
+  uint64_t head = plan->entries[0].src_offset;
+  uint64_t travel = 0;
+
+  for (uint32_t w = 0; w < plan->count; w += batch) {
+    uint32_t end = w + batch < plan->count ? w + batch : plan->count;
+    for (uint32_t i = w; i < end; i++) {
+      if (plan->entries[i].flags & RELOC_FLAG_UNWRITTEN)
+        continue; /* no I/O */
+      travel += seek_delta(head, plan->entries[i].src_offset);
+      head = plan->entries[i].src_offset + plan->entries[i].length;
+    }
+    for (uint32_t i = w; i < end; i++) {
+      if (plan->entries[i].flags & RELOC_FLAG_UNWRITTEN)
+        continue;
+      travel += seek_delta(head, plan->entries[i].dst_offset);
+      head = plan->entries[i].dst_offset + plan->entries[i].length;
+    }
+  }
+  return travel;
+}
+
+/* ========================================================================
+ * Ready set — one bit per entry, in source order
+ * ======================================================================== */
+
+static inline void bit_set(uint64_t *bm, uint32_t i) {
+  bm[i / 64] |= 1ULL << (i % 64);
+}
+
+static inline void bit_clear(uint64_t *bm, uint32_t i) {
+  bm[i / 64] &= ~(1ULL << (i % 64));
+}
+
+/* First set bit >= from, or UINT32_MAX */
+static uint32_t bit_next(const uint64_t *bm, uint32_t n, uint32_t from) {
+  if (from >= n)
+    return UINT32_MAX;
+  uint32_t w = from / 64;
+  uint64_t word = bm[w] & (~0ULL << (from % 64));
+  uint32_t words = (n + 63) / 64;
+  for (;;) {
+    if (word)
+      return w * 64 + (uint32_t)__builtin_ctzll(word);
+    if (++w >= words)
+      return UINT32_MAX;
+    word = bm[w];
+  }
+}
+
+/* Last set bit <= from, or UINT32_MAX */
+static uint32_t bit_prev(const uint64_t *bm, uint32_t from) {
+  uint32_t w = from / 64;
+  uint32_t shift = 63 - from % 64;
+  uint64_t word = (bm[w] << shift) >> shift;
+  for (;;) {
+    if (word)
+      return w * 64 + 63 - (uint32_t)__builtin_clzll(word);
+    if (w-- == 0)
+      return UINT32_MAX;
+    word = bm[w];
+  }
+}
+
+/* Nearest set bit from `pos` in sweep direction `*dir`, reversing if the
+ * sweep is exhausted. */
+static uint32_t scan_pick(const uint64_t *bm, uint32_t n, uint32_t pos,
+                          int *dir) {
+  for (int attempt = 0; attempt < 2; attempt++) {
+    uint32_t i = *dir > 0 ? bit_next(bm, n, pos) : bit_prev(bm, pos);
+    if (i != UINT32_MAX)
+      return i;
+    *dir = -*dir;
+  }
+  return UINT32_MAX;
+}
+
+/* ========================================================================
+ * Scheduler
+ * ======================================================================== */
+
+static int cmp_entry_src(const void *a, const void *b) {
+  const struct relocation_entry *ea = a;
+  const struct relocation_entry *eb = b;
+  if (ea->src_offset < eb->src_offset)
+    return -1;
+  if (ea->src_offset > eb->src_offset)
+    return 1;
+  return 0;
+}
+
+/* First entry (source order) whose source ends after `offset` */
+static uint32_t first_src_ending_after(const struct relocation_entry *e,
+                                       uint32_t n, uint64_t offset) {
+  uint32_t lo = 0, hi = n;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (e[mid].src_offset + e[mid].length <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+int relocator_schedule(struct relocation_plan *plan, uint32_t batch,
+                       reloc_scratch_fn scratch, void *scratch_arg) {
+  struct reloc_schedule_stats *st = &plan->sched;
+  memset(st, 0, sizeof(*st));
+
+  uint32_t n = plan->count;
+  st->seek_before = relocator_seek_distance(plan, 1);
+  if (n < 2) {
+    st->seek_after = st->seek_before;
+    return 0;
+  }
+
+  struct relocation_entry *e = plan->entries;
+  qsort(e, n, sizeof(*e), cmp_entry_src);
+  for (uint32_t i = 0; i < n; i++)
+    e[i].flags &= RELOC_FLAG_UNWRITTEN;
+
+  size_t words = (n + 63) / 64;
+  uint32_t *indeg = calloc(n, sizeof(uint32_t));
+  uint32_t *edge_start = calloc((size_t)n + 1, sizeof(uint32_t));
+  uint64_t *ready = calloc(words, sizeof(uint64_t));
+  uint64_t *unstarted = calloc(words, sizeof(uint64_t));
+  uint32_t out_capacity = n + 1;
+  struct relocation_entry *out = malloc(out_capacity * sizeof(*out));
+  uint32_t *edges = NULL;
+  uint64_t *scratch_at = NULL; /* per entry, once split */
+  uint32_t out_count = 0;
+  int ret = -1;
+
+  if (!indeg || !edge_start || !ready || !unstarted || !out)
+    goto oom;
+
+  /* Build edges A → B (A reads what B overwrites) in CSR form: the first
+   * pass counts, the second fills */
+  uint64_t edge_count = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    for (uint32_t b = 0; b < n; b++) {
+      uint64_t d = e[b].dst_offset, d_end = d + e[b].length;
+      for (uint32_t a = first_src_ending_after(e, n, d);
+           a < n && e[a].src_offset < d_end; a++) {
+        /* Unwritten space is neither read nor written */
+        if (a == b || ((e[a].flags | e[b].flags) & RELOC_FLAG_UNWRITTEN))
+          continue;
+        if (pass == 0) {
+          edge_start[a + 1]++;
+          edge_count++;
+        } else {
+          edges[edge_start[a]++] = b;
+          indeg[b]++;
+        }
+      }
+    }
+    if (pass == 0) {
+      if (edge_count > UINT32_MAX)
+        goto oom;
+      for (uint32_t a = 0; a < n; a++)
+        edge_start[a + 1] += edge_start[a];
+      edges = malloc((edge_count ? edge_count : 1) * sizeof(uint32_t));
+      if (!edges)
+        goto oom;
+    }
+  }
+  /* The fill pass advanced every edge_start[a] to the end of a's edges */
+  for (uint32_t a = n; a > 0; a--)
+    edge_start[a] = edge_start[a - 1];
+  edge_start[0] = 0;
+  st->dependencies = (uint32_t)edge_count;
+
+  for (uint32_t i = 0; i < n; i++) {
+    bit_set(unstarted, i);
+    if (indeg[i] == 0)
+      bit_set(ready, i);
+  }
+
+  uint32_t pos = 0;
+  int dir = 1;
+  uint32_t left = n;
+
+  while (left > 0) {
+    uint32_t x = scan_pick(ready, n, pos, &dir);
+    int split = 0;
+
+    if (x == UINT32_MAX) {
+      /* Every remaining entry waits on another: break the cycle at the
+       * unstarted entry nearest the head. One always exists — an entry
+       * that was already split has released its successors. */
+      x = scan_pick(unstarted, n, pos, &dir);
+      if (x == UINT32_MAX)
+        break;
+      split = 1;
+    }
+
+    if (out_count >= out_capacity) {
+      out_capacity *= 2;
+      struct relocation_entry *grown =
+          realloc(out, (size_t)out_capacity * sizeof(*out));
+      if (!grown)
+        goto oom;
+      out = grown;
+    }
+
+    struct relocation_entry *re = &out[out_count++];
+    *re = e[x];
+    re->completed = 0;
+    re->checksum = 0;
+    bit_clear(unstarted, x);
+
+    if (split) {
+      if (!scratch_at) {
+        scratch_at = calloc(n, sizeof(uint64_t));
+        if (!scratch_at)
+          goto oom;
+      }
+      uint64_t t = scratch ? scratch(e[x].length, scratch_arg) : (uint64_t)-1;
+      if (t == (uint64_t)-1) {
+        fprintf(stderr, "btrfs2ext4: relocation plan has a dependency cycle "
+                        "and no scratch space is left to break it\n");
+        goto out;
+      }
+      scratch_at[x] = t;
+      re->dst_offset = t;
+      re->flags = RELOC_FLAG_SCRATCH_OUT;
+      e[x].flags = RELOC_FLAG_SCRATCH_OUT; /* second leg still owed */
+      st->cycles_broken++;
+      st->scratch_bytes += e[x].length;
+      plan->total_bytes_to_move += e[x].length;
+    } else {
+      if (e[x].flags & RELOC_FLAG_SCRATCH_OUT) {
+        re->src_offset = scratch_at[x];
+        re->flags = RELOC_FLAG_SCRATCH_IN;
+      }
+      bit_clear(ready, x);
+      left--;
+    }
+
+    /* Once an entry's source has been read, its successors may write */
+    if (!(re->flags & RELOC_FLAG_SCRATCH_IN)) {
+      for (uint32_t k = edge_start[x]; k < edge_start[x + 1]; k++) {
+        uint32_t b = edges[k];
+        if (--indeg[b] == 0)
+          bit_set(ready, b);
+      }
+    }
+    pos = x;
+  }
+
+  for (uint32_t i = 0; i < out_count; i++)
+    out[i].seq = i;
+
+  free(plan->entries);
+  plan->entries = out;
+  plan->count = out_count;
+  plan->capacity = out_capacity;
+  out = NULL;
+
+  st->seek_after = relocator_seek_distance(plan, batch);
+  ret = 0;
+  goto out;
+
+oom:
+  fprintf(stderr, "btrfs2ext4: OOM scheduling relocation plan\n");
+out:
+  free(indeg);
+  free(edge_start);
+  free(edges);
+  free(ready);
+  free(unstarted);
+  free(scratch_at);
+  free(out);
+  return ret;
+}
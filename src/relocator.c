@@ -9,23 +9,53 @@
  * - Adjacent conflicting blocks coalesced into single I/O ops (was per-block)
  * - Extent map update via hash lookup (O(1) per relocation, was
  * O(inodes×extents))
+ * - Pipelined execution: reads run ahead of writes through a buffer ring
+ * - Free space as indexed runs with best-fit allocation (was a block scan)
  */
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "btrfs/btrfs_reader.h"
 #include "btrfs/chunk_tree.h"
+#include "btrfs/extent_store.h"
 #include "device_io.h"
 #include "ext4/ext4_planner.h"
 #include "journal.h"
 #include "mem_tracker.h"
+#include "progress.h"
 #include "relocator.h"
+#include "thread_pool.h"
+#include "usage_map.h"
 
 /* CRC32C from superblock.c */
 extern uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
 
+/* Pipeline depth for relocator_execute(); the scheduler batches for it too */
+static uint32_t g_reloc_depth = RELOCATOR_DEFAULT_DEPTH;
+
+/* Checksum moved data in user space instead of copying it in the kernel */
+static int g_reloc_verify = 0;
+
+/* Completion hook for relocator_execute() */
+static reloc_progress_fn g_reloc_progress = NULL;
+static void *g_reloc_progress_arg = NULL;
+
+void relocator_set_progress_hook(reloc_progress_fn fn, void *arg) {
+  g_reloc_progress = fn;
+  g_reloc_progress_arg = arg;
+}
+
+void relocator_set_pipeline_depth(uint32_t depth) {
+  if (depth == 0)
+    depth = RELOCATOR_DEFAULT_DEPTH;
+  g_reloc_depth = depth > RELOCATOR_MAX_DEPTH ? RELOCATOR_MAX_DEPTH : depth;
+}
+
+void relocator_set_verify(int verify) { g_reloc_verify = verify != 0; }
+
 /* ========================================================================
  * Conflict bitmap — O(1) per-block conflict check
  * ======================================================================== */
@@ -35,6 +65,7 @@ static uint8_t *build_conflict_bitmap(const struct ext4_layout *layout) {
   uint8_t *bitmap = calloc((total_blocks + 7) / 8, 1);
   if (!bitmap)
     return NULL;
+  mem_track_alloc_tag(MEM_TAG_RELOC, (total_blocks + 7) / 8);
 
   for (uint32_t i = 0; i < layout->reserved_block_count; i++) {
     uint64_t b = layout->reserved_blocks[i];
@@ -44,148 +75,280 @@ static uint8_t *build_conflict_bitmap(const struct ext4_layout *layout) {
   return bitmap;
 }
 
+static void free_conflict_bitmap(uint8_t *bitmap,
+                                 const struct ext4_layout *layout) {
+  mem_track_free_tag(MEM_TAG_RELOC, (layout->total_blocks + 7) / 8);
+  free(bitmap);
+}
+
 static inline int is_conflict(const uint8_t *bitmap, uint64_t block) {
   return (bitmap[block / 8] >> (block % 8)) & 1;
 }
 
 /* ========================================================================
- * Free space tracker
+ * Free space index — runs of free blocks, best-fit by length
+ *
+ * Free space is kept as the disjoint runs left between ext4 reserved blocks
+ * and Btrfs data, so memory follows fragmentation rather than device size.
+ * Runs sit in address order; a treap keyed by (length, start) over their
+ * indices finds the smallest run that fits in O(log n). Allocation takes
+ * blocks from the front of a run, so runs only ever shrink and the index
+ * never has to split one.
  * ======================================================================== */
 
+#define FREE_RUN_NIL UINT32_MAX
+
+struct free_run {
+  uint64_t start; /* first free block */
+  uint64_t len;   /* 0 once exhausted */
+};
+
 struct free_space {
-  uint8_t *bitmap;
+  struct free_run *runs;
+  uint32_t count;
+  /* Treap over run indices */
+  uint32_t *left;
+  uint32_t *right;
+  uint32_t root;
   uint64_t total_blocks;
-  uint64_t current_block;
   uint64_t free_count;
+  uint32_t block_size;
+  size_t tracked; /* bytes reported to mem_tracker */
 };
 
-static inline int fs_is_used(const uint8_t *bitmap, uint64_t block) {
-  return (bitmap[block / 8] >> (block % 8)) & 1;
+/* Treap priority: Knuth multiplicative hash of the run index */
+static inline uint32_t free_run_prio(uint32_t i) {
+  return (i + 1) * 2654435761U;
 }
 
-static int free_space_init(struct free_space *fs,
-                           const struct ext4_layout *layout,
-                           const struct btrfs_fs_info *fs_info) {
-  uint32_t block_size = layout->block_size;
-  uint64_t total_blocks = layout->total_blocks;
-
-  memset(fs, 0, sizeof(*fs));
-  fs->total_blocks = total_blocks;
-
-  /* Allocate bitmap (1 bit per block) */
-  fs->bitmap = calloc((total_blocks + 7) / 8, 1);
-  if (!fs->bitmap)
-    return -1;
+/* (len, start) ordering; starts of live runs are unique */
+static inline int free_run_less(const struct free_space *fs, uint32_t a,
+                                uint32_t b) {
+  const struct free_run *ra = &fs->runs[a];
+  const struct free_run *rb = &fs->runs[b];
+  if (ra->len != rb->len)
+    return ra->len < rb->len;
+  return ra->start < rb->start;
+}
 
-  /* Mark ext4 reserved blocks */
-  for (uint32_t i = 0; i < layout->reserved_block_count; i++) {
-    uint64_t b = layout->reserved_blocks[i];
-    if (b < total_blocks)
-      fs->bitmap[b / 8] |= (1 << (b % 8));
+static uint32_t free_treap_merge(struct free_space *fs, uint32_t a,
+                                 uint32_t b) {
+  if (a == FREE_RUN_NIL)
+    return b;
+  if (b == FREE_RUN_NIL)
+    return a;
+  if (free_run_prio(a) > free_run_prio(b)) {
+    fs->right[a] = free_treap_merge(fs, fs->right[a], b);
+    return a;
   }
+  fs->left[b] = free_treap_merge(fs, a, fs->left[b]);
+  return b;
+}
 
-  /* Mark btrfs data blocks */
-  for (uint32_t i = 0; i < fs_info->inode_count; i++) {
-    const struct file_entry *fe = fs_info->inode_table[i];
-    for (uint32_t j = 0; j < fe->extent_count; j++) {
-      const struct file_extent *ext = &fe->extents[j];
-      if (ext->type == BTRFS_FILE_EXTENT_INLINE || ext->disk_bytenr == 0)
-        continue;
+/* Split `t` into keys < node `i` and keys >= node `i` */
+static void free_treap_split(struct free_space *fs, uint32_t t, uint32_t i,
+                             uint32_t *lo, uint32_t *hi) {
+  if (t == FREE_RUN_NIL) {
+    *lo = *hi = FREE_RUN_NIL;
+    return;
+  }
+  if (free_run_less(fs, t, i)) {
+    free_treap_split(fs, fs->right[t], i, &fs->right[t], hi);
+    *lo = t;
+  } else {
+    free_treap_split(fs, fs->left[t], i, lo, &fs->left[t]);
+    *hi = t;
+  }
+}
 
-      uint64_t phys = chunk_map_resolve(fs_info->chunk_map, ext->disk_bytenr);
-      if (phys == (uint64_t)-1)
-        continue;
+static void free_treap_insert(struct free_space *fs, uint32_t i) {
+  uint32_t lo, hi;
+  fs->left[i] = fs->right[i] = FREE_RUN_NIL;
+  free_treap_split(fs, fs->root, i, &lo, &hi);
+  fs->root = free_treap_merge(fs, free_treap_merge(fs, lo, i), hi);
+}
 
-      uint64_t start_block = phys / block_size;
-      uint64_t num_blocks = (ext->disk_num_bytes + block_size - 1) / block_size;
+static void free_treap_erase(struct free_space *fs, uint32_t i) {
+  uint32_t *link = &fs->root;
+  while (*link != i) {
+    if (*link == FREE_RUN_NIL)
+      return;
+    link = free_run_less(fs, i, *link) ? &fs->left[*link] : &fs->right[*link];
+  }
+  *link = free_treap_merge(fs, fs->left[i], fs->right[i]);
+}
 
-      for (uint64_t b = start_block;
-           b < start_block + num_blocks && b < total_blocks; b++) {
-        fs->bitmap[b / 8] |= (1 << (b % 8));
-      }
+/* Smallest run with len >= count, or FREE_RUN_NIL */
+static uint32_t free_treap_best_fit(const struct free_space *fs,
+                                    uint64_t count) {
+  uint32_t best = FREE_RUN_NIL;
+  uint32_t t = fs->root;
+  while (t != FREE_RUN_NIL) {
+    if (fs->runs[t].len >= count) {
+      best = t;
+      t = fs->left[t];
+    } else {
+      t = fs->right[t];
     }
   }
+  return best;
+}
+
+static uint32_t free_treap_largest(const struct free_space *fs) {
+  uint32_t t = fs->root;
+  if (t == FREE_RUN_NIL)
+    return FREE_RUN_NIL;
+  while (fs->right[t] != FREE_RUN_NIL)
+    t = fs->right[t];
+  return t;
+}
 
-  /* Count free blocks */
-  for (uint64_t b = 0; b < total_blocks; b++) {
-    if (!fs_is_used(fs->bitmap, b)) {
-      fs->free_count++;
+static int free_space_push_run(struct free_space *fs, uint32_t *capacity,
+                               uint64_t start, uint64_t end) {
+  if (end <= start)
+    return 0;
+  if (fs->count >= *capacity) {
+    if (*capacity >= FREE_RUN_NIL / 2) {
+      fprintf(stderr, "btrfs2ext4: free space too fragmented to index\n");
+      return -1;
+    }
+    uint32_t new_cap = *capacity ? *capacity * 2 : 256;
+    struct free_run *grown = realloc(fs->runs, new_cap * sizeof(*grown));
+    if (!grown) {
+      fprintf(stderr, "btrfs2ext4: OOM building free space index\n");
+      return -1;
     }
+    fs->runs = grown;
+    *capacity = new_cap;
   }
-
-  printf("  Free blocks available: %lu\n", (unsigned long)fs->free_count);
+  fs->runs[fs->count].start = start;
+  fs->runs[fs->count].len = end - start;
+  fs->count++;
+  fs->free_count += end - start;
   return 0;
 }
 
-/*
- * Allocate 'count' consecutive free blocks (best-effort).
- * Returns the first block number, or (uint64_t)-1 if none available.
- * Falls back to single-block allocation if no consecutive run found.
- */
-static uint64_t free_space_alloc_run(struct free_space *fs, uint32_t count,
-                                     uint32_t *actual_count) {
-  if (fs->free_count == 0) {
-    *actual_count = 0;
-    return (uint64_t)-1;
-  }
+static void free_space_free(struct free_space *fs) {
+  mem_track_free_tag(MEM_TAG_RELOC, fs->tracked);
+  free(fs->runs);
+  free(fs->left);
+  free(fs->right);
+  memset(fs, 0, sizeof(*fs));
+  fs->root = FREE_RUN_NIL;
+}
 
-  /* Bug H fix: Save cursor start to enable wrap-around.
-   * If we reach total_blocks without finding space, wrap to 0
-   * and scan up to the original position. */
-  uint64_t saved_cursor = fs->current_block;
-  uint64_t start_block = (uint64_t)-1;
-  uint32_t run = 0;
-  int wrapped = 0;
-
-  for (;;) {
-    if (fs->current_block >= fs->total_blocks) {
-      if (wrapped)
-        break; /* Already wrapped, no space */
-      fs->current_block = 0;
-      wrapped = 1;
-    }
-    if (wrapped && fs->current_block >= saved_cursor)
-      break; /* Back to start, no space */
+static int free_space_init(struct free_space *fs,
+                           const struct ext4_layout *layout,
+                           const struct btrfs_fs_info *fs_info,
+                           const uint8_t *conflict_bmp) {
+  uint32_t block_size = layout->block_size;
+  uint64_t total_blocks = layout->total_blocks;
 
-    if (!fs_is_used(fs->bitmap, fs->current_block)) {
-      if (run == 0) {
-        start_block = fs->current_block;
+  memset(fs, 0, sizeof(*fs));
+  fs->root = FREE_RUN_NIL;
+  fs->total_blocks = total_blocks;
+  fs->block_size = block_size;
+
+  /*
+   * Sweep the device once: free runs are the gaps between the blocks the
+   * shared usage map marks (Btrfs data and, when the extent tree was read,
+   * metadata), further cut wherever the conflict bitmap marks a reserved
+   * block. Both bitmaps are read a 64-bit word at a time so clean stretches
+   * cost nothing.
+   */
+  const struct usage_map *um = &fs_info->usage;
+  uint64_t map_end = um->granules << um->granule_shift;
+  uint32_t capacity = 0;
+  uint64_t b = 0;
+  while (b < total_blocks) {
+    /* A block is used if any byte of it is */
+    uint64_t used_at = usage_map_next(um, b * block_size, 1);
+    uint64_t gap_end = used_at / block_size;
+    if (used_at >= map_end || gap_end > total_blocks)
+      gap_end = total_blocks;
+
+    /* [b, gap_end) is free of Btrfs blocks; split it at reserved blocks */
+    uint64_t run_start = b;
+    while (b < gap_end) {
+      if (b % 64 == 0 && b + 64 <= gap_end) {
+        uint64_t word;
+        memcpy(&word, conflict_bmp + b / 8, sizeof(word));
+        if (word == 0) {
+          b += 64;
+          continue;
+        }
       }
-      run++;
-      fs->current_block++;
-      if (run == count)
-        break;
-    } else {
-      if (run > 0) {
-        fs->current_block++;
-        break;
+      if (is_conflict(conflict_bmp, b)) {
+        if (free_space_push_run(fs, &capacity, run_start, b) < 0)
+          goto fail;
+        run_start = b + 1;
       }
-      fs->current_block++;
+      b++;
     }
+    if (free_space_push_run(fs, &capacity, run_start, gap_end) < 0)
+      goto fail;
+    if (gap_end >= total_blocks)
+      break;
+
+    /* Skip the used stretch, rounding its end up to a whole block */
+    uint64_t free_at = usage_map_next(um, used_at, 0);
+    b = (free_at + block_size - 1) / block_size;
   }
 
-  if (run > 0) {
-    *actual_count = run;
-    for (uint32_t i = 0; i < run; i++) {
-      uint64_t b = start_block + i;
-      fs->bitmap[b / 8] |= (1 << (b % 8));
+  if (fs->count > 0) {
+    fs->left = malloc(fs->count * sizeof(uint32_t));
+    fs->right = malloc(fs->count * sizeof(uint32_t));
+    if (!fs->left || !fs->right) {
+      fprintf(stderr, "btrfs2ext4: OOM building free space index\n");
+      goto fail;
     }
-    fs->free_count -= run;
-    return start_block;
+    for (uint32_t i = 0; i < fs->count; i++)
+      free_treap_insert(fs, i);
   }
+  fs->tracked = (size_t)capacity * sizeof(struct free_run) +
+                (size_t)fs->count * 2 * sizeof(uint32_t);
+  mem_track_alloc_tag(MEM_TAG_RELOC, fs->tracked);
 
-  *actual_count = 0;
-  return (uint64_t)-1;
-}
+  printf("  Free blocks available: %lu in %u runs\n",
+         (unsigned long)fs->free_count, fs->count);
+  return 0;
 
-static uint64_t free_space_alloc(struct free_space *fs) {
-  uint32_t actual = 0;
-  return free_space_alloc_run(fs, 1, &actual);
+fail:
+  free_space_free(fs);
+  return -1;
 }
 
-static void free_space_free(struct free_space *fs) {
-  free(fs->bitmap);
-  memset(fs, 0, sizeof(*fs));
+/*
+ * Allocate up to 'count' consecutive free blocks from the smallest run that
+ * holds them all; if none does, the largest run is used and *actual_count
+ * comes back short. Returns the first block number, or (uint64_t)-1 if no
+ * free space is left.
+ */
+static uint64_t free_space_alloc_run(struct free_space *fs, uint32_t count,
+                                     uint32_t *actual_count) {
+  *actual_count = 0;
+  if (count == 0 || fs->free_count == 0)
+    return (uint64_t)-1;
+
+  uint32_t i = free_treap_best_fit(fs, count);
+  if (i == FREE_RUN_NIL)
+    i = free_treap_largest(fs);
+  if (i == FREE_RUN_NIL)
+    return (uint64_t)-1;
+
+  struct free_run *r = &fs->runs[i];
+  uint32_t got = r->len < count ? (uint32_t)r->len : count;
+  uint64_t start = r->start;
+
+  free_treap_erase(fs, i);
+  r->start += got;
+  r->len -= got;
+  if (r->len > 0)
+    free_treap_insert(fs, i);
+
+  fs->free_count -= got;
+  *actual_count = got;
+  return start;
 }
 
 /* ========================================================================
@@ -215,6 +378,7 @@ static int extent_hash_init(struct extent_hash *eh,
   eh->size = total < 64 ? 128 : (uint64_t)total * 2;
 
   size_t hash_bytes = eh->size * sizeof(struct extent_hash_entry);
+  mem_track_reclaim(); /* let caches shrink before giving the hash up */
   if (mem_track_exceeded()) {
     printf(
         "  [Relocator] High memory usage detected, disabling extent hash.\n");
@@ -225,14 +389,15 @@ static int extent_hash_init(struct extent_hash *eh,
   if (!eh->buckets)
     return -1;
 
-  mem_track_alloc(hash_bytes);
+  mem_track_alloc_tag(MEM_TAG_RELOC, hash_bytes);
   eh->count = 0;
 
   /* Populate: map physical_offset → (inode_idx, extent_idx) */
   for (uint32_t i = 0; i < fs_info->inode_count; i++) {
-    const struct file_entry *fe = fs_info->inode_table[i];
-    for (uint32_t j = 0; j < fe->extent_count; j++) {
-      const struct file_extent *ext = &fe->extents[j];
+    struct extent_iter it;
+    const struct file_extent *ext;
+    extent_iter_init(&it, fs_info, fs_info->inode_table[i]);
+    while ((ext = extent_iter_next(&it)) != NULL) {
       if (ext->type == BTRFS_FILE_EXTENT_INLINE || ext->disk_bytenr == 0)
         continue;
 
@@ -261,7 +426,7 @@ static int extent_hash_init(struct extent_hash *eh,
 
       eh->buckets[slot].phys_offset = phys_block_offset;
       eh->buckets[slot].inode_idx = i;
-      eh->buckets[slot].extent_idx = j;
+      eh->buckets[slot].extent_idx = it.index;
       eh->count++;
     }
   }
@@ -269,6 +434,9 @@ static int extent_hash_init(struct extent_hash *eh,
 }
 
 static void extent_hash_free(struct extent_hash *eh) {
+  if (eh->buckets)
+    mem_track_free_tag(MEM_TAG_RELOC,
+                       eh->size * sizeof(struct extent_hash_entry));
   free(eh->buckets);
   memset(eh, 0, sizeof(*eh));
 }
@@ -287,6 +455,109 @@ static int cmp_relocation_entry(const void *a, const void *b) {
   return 0;
 }
 
+/* reloc_scratch_fn over the planner's free space index: the run must be
+ * contiguous, since a scratch leg is a single entry */
+static uint64_t reloc_scratch_alloc(uint64_t length, void *arg) {
+  struct free_space *fs = (struct free_space *)arg;
+  uint32_t block_size = fs->block_size;
+  uint64_t want = (length + block_size - 1) / block_size;
+
+  if (want > UINT32_MAX || free_treap_best_fit(fs, want) == FREE_RUN_NIL)
+    return (uint64_t)-1;
+  uint32_t got = 0;
+  uint64_t start = free_space_alloc_run(fs, (uint32_t)want, &got);
+  return start == (uint64_t)-1 ? start : start * block_size;
+}
+
+/*
+ * Moved disk extents by first block, so every file extent sharing one
+ * (reflinks, snapshots) reuses its entries instead of moving it again
+ */
+struct reloc_src {
+  uint64_t block1; /* first block + 1, 0 = empty slot */
+  uint64_t blocks;
+  uint32_t first;  /* plan entry of the first piece */
+  uint32_t pieces; /* consecutive entries, in disk order */
+};
+
+struct reloc_src_index {
+  struct reloc_src *slots;
+  uint32_t capacity; /* power of two */
+  uint32_t count;
+};
+
+static inline uint32_t reloc_src_slot(const struct reloc_src_index *ix,
+                                      uint64_t block) {
+  uint64_t x = block * 0x9e3779b97f4a7c15ULL;
+  return (uint32_t)(x >> 32) & (ix->capacity - 1);
+}
+
+static struct reloc_src *reloc_src_find(const struct reloc_src_index *ix,
+                                        uint64_t block) {
+  if (!ix->slots)
+    return NULL;
+  for (uint32_t i = reloc_src_slot(ix, block); ix->slots[i].block1 != 0;
+       i = (i + 1) & (ix->capacity - 1)) {
+    if (ix->slots[i].block1 == block + 1)
+      return &ix->slots[i];
+  }
+  return NULL;
+}
+
+static int reloc_src_add(struct reloc_src_index *ix, const struct reloc_src *s) {
+  if (ix->count * 2 >= ix->capacity) {
+    uint32_t old_cap = ix->capacity;
+    struct reloc_src *old = ix->slots;
+    uint32_t cap = old_cap ? old_cap * 2 : 1024;
+    struct reloc_src *slots = calloc(cap, sizeof(*slots));
+    if (!slots)
+      return -1;
+    ix->slots = slots;
+    ix->capacity = cap;
+    for (uint32_t i = 0; i < old_cap; i++) {
+      if (old[i].block1 == 0)
+        continue;
+      uint32_t j = reloc_src_slot(ix, old[i].block1 - 1);
+      while (slots[j].block1 != 0)
+        j = (j + 1) & (cap - 1);
+      slots[j] = old[i];
+    }
+    free(old);
+  }
+  uint32_t j = reloc_src_slot(ix, s->block1 - 1);
+  while (ix->slots[j].block1 != 0)
+    j = (j + 1) & (ix->capacity - 1);
+  ix->slots[j] = *s;
+  ix->count++;
+  return 0;
+}
+
+static int reloc_plan_push(struct relocation_plan *plan, uint64_t src_offset,
+                           uint64_t dst_offset, uint64_t length,
+                           uint8_t flags) {
+  if (plan->count >= plan->capacity) {
+    struct relocation_entry *new_ent =
+        realloc(plan->entries,
+                plan->capacity * 2 * sizeof(struct relocation_entry));
+    if (!new_ent) {
+      fprintf(stderr, "btrfs2ext4: OOM reallocating relocation plan\n");
+      return -1;
+    }
+    plan->entries = new_ent;
+    plan->capacity *= 2;
+  }
+
+  struct relocation_entry *re = &plan->entries[plan->count];
+  memset(re, 0, sizeof(*re));
+  re->src_offset = src_offset;
+  re->dst_offset = dst_offset;
+  re->length = length;
+  re->seq = plan->count;
+  re->flags = flags;
+  plan->count++;
+  return 0;
+}
+
 int relocator_plan(struct relocation_plan *plan,
                    const struct ext4_layout *layout,
                    struct btrfs_fs_info *fs_info) {
@@ -300,6 +571,12 @@ int relocator_plan(struct relocation_plan *plan,
 
   printf("=== Phase 2: Planning Block Relocation ===\n\n");
 
+  /* Pass 1 streams the usage map out of the extent tree; fs_info built by
+   * hand only has its file extents */
+  if (!fs_info->usage.bits &&
+      btrfs_build_usage_map(fs_info, layout->total_blocks * block_size) < 0)
+    return -1;
+
   /* Build conflict bitmap for O(1) lookups */
   uint8_t *conflict_bmp = build_conflict_bitmap(layout);
   if (!conflict_bmp)
@@ -307,16 +584,23 @@ int relocator_plan(struct relocation_plan *plan,
 
   /* Build free space tracker */
   struct free_space fspace;
-  if (free_space_init(&fspace, layout, fs_info) < 0) {
-    free(conflict_bmp);
+  if (free_space_init(&fspace, layout, fs_info, conflict_bmp) < 0) {
+    free_conflict_bitmap(conflict_bmp, layout);
     return -1;
   }
 
+  struct reloc_src_index srcs = {0};
+  uint64_t *piece_len = NULL; /* bytes of each piece, for splitting */
+  uint32_t piece_cap = 0;
+  uint32_t shared = 0, split = 0;
+
   /* Find conflicting data blocks and coalesce adjacent ones */
   for (uint32_t i = 0; i < fs_info->inode_count; i++) {
     struct file_entry *fe = fs_info->inode_table[i];
-    for (uint32_t j = 0; j < fe->extent_count; j++) {
-      struct file_extent *ext = &fe->extents[j];
+    struct extent_iter it;
+    const struct file_extent *ext;
+    extent_iter_init(&it, fs_info, fe);
+    while ((ext = extent_iter_next(&it)) != NULL) {
       if (ext->type == BTRFS_FILE_EXTENT_INLINE || ext->disk_bytenr == 0)
         continue;
 
@@ -326,103 +610,95 @@ int relocator_plan(struct relocation_plan *plan,
 
       uint64_t start_block = phys / block_size;
       uint64_t num_blocks = (ext->disk_num_bytes + block_size - 1) / block_size;
+      uint8_t flags =
+          ext->type == BTRFS_FILE_EXTENT_PREALLOC ? RELOC_FLAG_UNWRITTEN : 0;
 
-      /* Scan for runs of consecutive conflicting blocks */
+      /* An extent is one pointer: if any of its blocks conflicts, all of
+       * them move, or the pointer would be moved (or left) with only part
+       * of the data behind it */
       uint64_t b = start_block;
-      while (b < start_block + num_blocks) {
-        if (!is_conflict(conflict_bmp, b)) {
-          b++;
-          continue;
-        }
-
-        /* Found a conflict — find the run length */
-        uint64_t run_start = b;
-        uint32_t run_len = 0;
-        while (b < start_block + num_blocks && is_conflict(conflict_bmp, b)) {
-          run_len++;
-          b++;
-        }
-
-        /* Allocate a destination run (try consecutive, fall back to individual)
-         */
-        uint32_t dst_got = 0;
-        uint64_t dst_start = free_space_alloc_run(&fspace, run_len, &dst_got);
-
-        if (dst_start == (uint64_t)-1) {
-          fprintf(stderr,
-                  "btrfs2ext4: ERROR: not enough free space for relocation\n");
-          free(conflict_bmp);
-          free_space_free(&fspace);
-          return -1;
-        }
-
-        /* If we couldn't get the full run consecutively, handle remainder */
-        uint32_t allocated = dst_got;
-
-        /* Create relocation entry for the coalesced run */
-        if (plan->count >= plan->capacity) {
-          plan->capacity *= 2;
-          struct relocation_entry *new_ent = realloc(
-              plan->entries, plan->capacity * sizeof(struct relocation_entry));
-          if (!new_ent) {
-            fprintf(stderr, "btrfs2ext4: OOM reallocating relocation plan\n");
-            free(conflict_bmp);
-            free_space_free(&fspace);
-            return -1;
-          }
-          plan->entries = new_ent;
-        }
+      while (b < start_block + num_blocks && !is_conflict(conflict_bmp, b))
+        b++;
+      if (b == start_block + num_blocks)
+        continue;
 
-        struct relocation_entry *re = &plan->entries[plan->count];
-        re->src_offset = run_start * block_size;
-        re->dst_offset = dst_start * block_size;
-        re->length = (uint64_t)allocated * block_size;
-        re->seq = plan->count;
-        re->completed = 0;
-        plan->count++;
-        plan->total_bytes_to_move += re->length;
-
-        /* Handle remaining blocks that didn't fit in consecutive run */
-        for (uint32_t r = allocated; r < run_len; r++) {
-          uint64_t single_dst = free_space_alloc(&fspace);
-          if (single_dst == (uint64_t)-1) {
-            fprintf(
-                stderr,
-                "btrfs2ext4: ERROR: not enough free space for relocation\n");
-            free(conflict_bmp);
-            free_space_free(&fspace);
-            return -1;
-          }
+      /* Already moving for another file: the data is copied for every
+       * reference unless all of them are unwritten (PREALLOC) */
+      struct reloc_src *src = reloc_src_find(&srcs, start_block);
+      if (src && src->blocks == num_blocks) {
+        for (uint32_t k = 0; k < src->pieces; k++)
+          plan->entries[src->first + k].flags &= flags;
+        shared++;
+        if (src->pieces == 1)
+          continue;
+        for (uint32_t k = 0; k < src->pieces; k++)
+          piece_len[k] = plan->entries[src->first + k].length;
+        piece_len[src->pieces - 1] -= num_blocks * block_size -
+                                      ext->disk_num_bytes;
+        int n = btrfs_extent_split(fs_info, fe, it.index, piece_len,
+                                   src->pieces);
+        if (n < 0)
+          goto fail;
+        it.next = it.index + (uint32_t)n;
+        continue;
+      }
 
-          if (plan->count >= plan->capacity) {
-            plan->capacity *= 2;
-            struct relocation_entry *new_ent =
-                realloc(plan->entries,
-                        plan->capacity * sizeof(struct relocation_entry));
-            if (!new_ent) {
-              fprintf(stderr, "btrfs2ext4: OOM reallocating relocation plan\n");
-              free(conflict_bmp);
-              free_space_free(&fspace);
-              return -1;
-            }
-            plan->entries = new_ent;
-          }
+      /* One run if any is big enough; otherwise the data is split over
+       * the largest runs, and the extent with it. Compressed data is one
+       * stream and cannot be split. */
+      if (free_treap_best_fit(&fspace, num_blocks) == FREE_RUN_NIL &&
+          (ext->compression != BTRFS_COMPRESS_NONE ||
+           num_blocks > fspace.free_count)) {
+        fprintf(stderr,
+                "btrfs2ext4: ERROR: not enough free space to relocate a "
+                "%lu-block extent\n",
+                (unsigned long)num_blocks);
+        goto fail;
+      }
 
-          re = &plan->entries[plan->count];
-          re->src_offset = (run_start + r) * block_size;
-          re->dst_offset = single_dst * block_size;
-          re->length = block_size;
-          re->seq = plan->count;
-          re->completed = 0;
-          plan->count++;
-          plan->total_bytes_to_move += block_size;
+      struct reloc_src s = {.block1 = start_block + 1,
+                            .blocks = num_blocks,
+                            .first = plan->count};
+      for (uint64_t done = 0; done < num_blocks; s.pieces++) {
+        uint64_t want = num_blocks - done;
+        uint32_t got = 0;
+        uint64_t dst_start = free_space_alloc_run(
+            &fspace, want > UINT32_MAX ? UINT32_MAX : (uint32_t)want, &got);
+        if (dst_start == (uint64_t)-1)
+          goto fail;
+        if (s.pieces >= piece_cap) {
+          uint32_t cap = piece_cap ? piece_cap * 2 : 16;
+          uint64_t *p = realloc(piece_len, cap * sizeof(uint64_t));
+          if (!p)
+            goto fail;
+          piece_len = p;
+          piece_cap = cap;
         }
+        piece_len[s.pieces] = (uint64_t)got * block_size;
+        if (reloc_plan_push(plan, (start_block + done) * block_size,
+                            dst_start * block_size,
+                            (uint64_t)got * block_size, flags) < 0)
+          goto fail;
+        done += got;
+      }
+      if (reloc_src_add(&srcs, &s) < 0)
+        goto fail;
+      if (s.pieces > 1) {
+        piece_len[s.pieces - 1] -= num_blocks * block_size -
+                                   ext->disk_num_bytes;
+        int n = btrfs_extent_split(fs_info, fe, it.index, piece_len,
+                                   s.pieces);
+        if (n < 0)
+          goto fail;
+        it.next = it.index + (uint32_t)n;
+        split++;
       }
     }
   }
 
-  free(conflict_bmp);
-  free_space_free(&fspace);
+  free(srcs.slots);
+  free(piece_len);
+  free_conflict_bitmap(conflict_bmp, layout);
 
   /* Phase 2.1: Sort relocation entries by source physical offset to optimize
    * HDD seeks radially */
@@ -438,7 +714,8 @@ int relocator_plan(struct relocation_plan *plan,
       struct relocation_entry *curr = &plan->entries[i];
 
       if (prev->src_offset + prev->length == curr->src_offset &&
-          prev->dst_offset + prev->length == curr->dst_offset) {
+          prev->dst_offset + prev->length == curr->dst_offset &&
+          prev->flags == curr->flags) {
         prev->length += curr->length;
       } else {
         active++;
@@ -450,20 +727,547 @@ int relocator_plan(struct relocation_plan *plan,
     plan->count = active + 1;
   }
 
+  uint64_t unwritten_bytes = 0;
+  for (uint32_t i = 0; i < plan->count; i++) {
+    if (plan->entries[i].flags & RELOC_FLAG_UNWRITTEN)
+      unwritten_bytes += plan->entries[i].length;
+    else
+      plan->total_bytes_to_move += plan->entries[i].length;
+  }
+
+  /* Phase 2.5: Reorder for the disk head; cycles borrow free space */
+  if (relocator_schedule(plan, RELOCATOR_REFILL(g_reloc_depth),
+                         reloc_scratch_alloc, &fspace) < 0) {
+    free_space_free(&fspace);
+    return -1;
+  }
+  free_space_free(&fspace);
+  mem_track_alloc_tag(MEM_TAG_RELOC,
+                      plan->capacity * sizeof(struct relocation_entry));
+
   printf("  Relocation entries: %u (coalesced from individual blocks)\n",
          plan->count);
   printf("  Total bytes to move: %lu (%.1f MiB)\n",
          (unsigned long)plan->total_bytes_to_move,
          (double)plan->total_bytes_to_move / (1024.0 * 1024.0));
+  if (unwritten_bytes > 0)
+    printf("  Unwritten (PREALLOC) bytes remapped without copying: %lu "
+           "(%.1f MiB)\n",
+           (unsigned long)unwritten_bytes,
+           (double)unwritten_bytes / (1024.0 * 1024.0));
+  if (plan->sched.dependencies > 0)
+    printf("  Move dependencies: %u (%u cycles broken via scratch)\n",
+           plan->sched.dependencies, plan->sched.cycles_broken);
+  if (shared > 0 || split > 0)
+    printf("  Shared extents moved once: %u; split over free runs: %u\n",
+           shared, split);
   printf("==========================================\n\n");
 
   return 0;
+
+fail:
+  free(srcs.slots);
+  free(piece_len);
+  free_conflict_bitmap(conflict_bmp, layout);
+  free_space_free(&fspace);
+  return -1;
 }
 
 /* ========================================================================
- * Relocation executor — with batched I/O and hash-based extent update
+ * Relocation executor — zero-copy or pipelined moves, hash-based extent
+ * update
+ *
+ * Where the kernel can copy in place (device_copy()) each entry is one
+ * copy and its bytes never reach user space. Otherwise, or when checksums
+ * are asked for, a reader thread fills a ring of `depth` buffers through the batch read
+ * path while the calling thread checksums and writes the oldest one, so
+ * the device always has reads queued behind the current write. Entries are
+ * split into chunks of one buffer each; chunk c may only be read once
+ * every earlier chunk whose destination overlaps c's source is on disk.
+ * Only chunks in the ring can still be pending, so the check is O(depth).
  * ======================================================================== */
 
+struct reloc_chunk {
+  uint64_t src;
+  uint64_t dst;
+  uint64_t len;
+  uint32_t entry; /* index into plan->entries */
+};
+
+struct reloc_pipeline {
+  struct device *dev;
+  const struct reloc_chunk *chunks;
+  uint32_t chunk_count;
+  uint8_t **bufs; /* chunk c lives in bufs[c % depth] */
+  uint32_t depth;
+  uint32_t refill; /* free buffers wanted before a new read batch */
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint32_t read_done; /* chunks [0, read_done) are buffered or written */
+  uint32_t written;   /* chunks [0, written) are on disk */
+  int read_error;
+  int abort; /* writer gave up; reader must stop */
+};
+
+static inline int ranges_overlap(uint64_t a, uint64_t a_len, uint64_t b,
+                                 uint64_t b_len) {
+  return a < b + b_len && b < a + a_len;
+}
+
+/* Caller holds p->lock. 1 if chunk c may not be read yet. */
+static int reloc_chunk_blocked(const struct reloc_pipeline *p, uint32_t c) {
+  if (c - p->written >= p->depth)
+    return 1; /* no free buffer */
+  const struct reloc_chunk *ch = &p->chunks[c];
+  for (uint32_t k = p->written; k < c; k++) {
+    if (ranges_overlap(p->chunks[k].dst, p->chunks[k].len, ch->src, ch->len))
+      return 1; /* would read data an earlier move has not written yet */
+  }
+  return 0;
+}
+
+static void *reloc_reader_thread(void *arg) {
+  struct reloc_pipeline *p = (struct reloc_pipeline *)arg;
+  device_read_batch_begin(p->dev);
+
+  uint32_t c = 0;
+  while (c < p->chunk_count) {
+    pthread_mutex_lock(&p->lock);
+    /* Wait for `refill` free buffers so reads go out in runs and the head
+     * is not dragged back to the source region for every single chunk */
+    uint32_t want = p->chunk_count - c < p->refill ? p->chunk_count - c
+                                                   : p->refill;
+    while (!p->abort && (reloc_chunk_blocked(p, c) ||
+                         p->depth - (c - p->written) < want))
+      pthread_cond_wait(&p->cond, &p->lock);
+    if (p->abort) {
+      pthread_mutex_unlock(&p->lock);
+      break;
+    }
+    /* Batch every chunk that is ready right now into one submission */
+    uint32_t n = 1;
+    while (c + n < p->chunk_count && !reloc_chunk_blocked(p, c + n))
+      n++;
+    pthread_mutex_unlock(&p->lock);
+
+    int ret = 0;
+    for (uint32_t k = c; k < c + n && ret == 0; k++) {
+      ret = device_read_batch_add(p->dev, p->chunks[k].src,
+                                  p->bufs[k % p->depth],
+                                  (size_t)p->chunks[k].len);
+    }
+    if (device_read_batch_submit(p->dev) < 0)
+      ret = -1;
+
+    pthread_mutex_lock(&p->lock);
+    if (ret < 0)
+      p->read_error = 1;
+    else
+      p->read_done = c + n;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    if (ret < 0)
+      break;
+    c += n;
+  }
+  return NULL;
+}
+
+/* Point every extent that referenced a moved block at its new location */
+static void relocator_update_extents(uint64_t src_offset,
+                                     const struct relocation_entry *re,
+                                     struct btrfs_fs_info *fs_info,
+                                     const struct extent_hash *ehash,
+                                     int have_hash, uint32_t block_size) {
+  /* Update in-memory extent maps using hash (O(1) per block - supports CoW
+   * dupes) */
+  uint32_t blocks_in_entry = (uint32_t)(re->length / block_size);
+  for (uint32_t bi = 0; bi < blocks_in_entry; bi++) {
+    uint64_t src_block_offset = src_offset + (uint64_t)bi * block_size;
+
+    if (have_hash) {
+      uint32_t slot =
+          (uint32_t)((src_block_offset * 2654435761ULL) >> 16) % ehash->size;
+      uint32_t start = slot;
+      int first_extent = 1;
+
+      do {
+        if (ehash->buckets[slot].phys_offset == 0)
+          break;
+
+        /* Phase 4.2: CoW Cloning inside Relocator */
+        if (ehash->buckets[slot].phys_offset == src_block_offset) {
+          uint32_t fi = ehash->buckets[slot].inode_idx;
+          uint32_t ej = ehash->buckets[slot].extent_idx;
+          if (fi < fs_info->inode_count &&
+              ej < fs_info->inode_table[fi]->extent_count) {
+            if (first_extent) {
+              /* Primary extent update */
+              btrfs_extent_set_bytenr(fs_info, fs_info->inode_table[fi], ej,
+                                      (re->dst_offset +
+                                       (uint64_t)bi * block_size) |
+                                          CHUNK_MAP_PHYSICAL);
+              first_extent = 0;
+            } else {
+              /* Secondary extent (CoW duplication)
+               * We point the secondary inode's extent directly to the newly
+               * relocated block alongside the primary inode.
+               * The actual physical cloning of these Shared Blocks (to
+               * prevent Ext4 'Multiply-Claimed' metadata corruption) is
+               * universally handled downstream by `resolve_extents` in
+               * `extent_writer.c`.
+               */
+              btrfs_extent_set_bytenr(fs_info, fs_info->inode_table[fi], ej,
+                                      (re->dst_offset +
+                                       (uint64_t)bi * block_size) |
+                                          CHUNK_MAP_PHYSICAL);
+            }
+          }
+        }
+        slot = (slot + 1) % ehash->size;
+      } while (slot != start);
+    } else {
+      /* Fallback: linear scan (original behavior) */
+      for (uint32_t fi = 0; fi < fs_info->inode_count; fi++) {
+        struct file_entry *fe = fs_info->inode_table[fi];
+        struct extent_iter it;
+        const struct file_extent *ext;
+        extent_iter_init(&it, fs_info, fe);
+        while ((ext = extent_iter_next(&it)) != NULL) {
+          if (ext->type == BTRFS_FILE_EXTENT_INLINE || ext->disk_bytenr == 0)
+            continue;
+          uint64_t phys =
+              chunk_map_resolve(fs_info->chunk_map, ext->disk_bytenr);
+          if (phys == src_block_offset) {
+            btrfs_extent_set_bytenr(fs_info, fe, it.index,
+                                    (re->dst_offset +
+                                     (uint64_t)bi * block_size) |
+                                        CHUNK_MAP_PHYSICAL);
+          }
+        }
+      }
+    }
+  }
+}
+
+/*
+ * Where the data of each entry originally lived. A scratch → dst leg
+ * carries the source of its src → scratch leg, which is what the extent
+ * hash is keyed on. Returns NULL (no allocation) when the plan has no
+ * scratch legs; *err is set on OOM.
+ */
+static uint64_t *relocator_scratch_origins(const struct relocation_plan *plan,
+                                           int *err) {
+  uint32_t legs = 0;
+  *err = 0;
+  for (uint32_t i = 0; i < plan->count; i++) {
+    if (plan->entries[i].flags & RELOC_FLAG_SCRATCH_OUT)
+      legs++;
+  }
+  if (legs == 0)
+    return NULL;
+
+  uint64_t *origin = malloc(plan->count * sizeof(uint64_t));
+  uint32_t size = legs * 2;
+  uint32_t *slots = malloc(size * sizeof(uint32_t)); /* entry index + 1 */
+  if (!origin || !slots) {
+    free(origin);
+    free(slots);
+    *err = 1;
+    return NULL;
+  }
+  memset(slots, 0, size * sizeof(uint32_t));
+
+  for (uint32_t i = 0; i < plan->count; i++) {
+    const struct relocation_entry *re = &plan->entries[i];
+    origin[i] = re->src_offset;
+    if (re->flags & RELOC_FLAG_SCRATCH_OUT) {
+      uint32_t slot = (uint32_t)((re->dst_offset * 2654435761ULL) >> 16) % size;
+      while (slots[slot] != 0)
+        slot = (slot + 1) % size;
+      slots[slot] = i + 1;
+    } else if (re->flags & RELOC_FLAG_SCRATCH_IN) {
+      uint32_t slot = (uint32_t)((re->src_offset * 2654435761ULL) >> 16) % size;
+      for (uint32_t probe = 0; probe < size && slots[slot] != 0; probe++) {
+        const struct relocation_entry *out = &plan->entries[slots[slot] - 1];
+        if (out->dst_offset == re->src_offset) {
+          origin[i] = out->src_offset;
+          break;
+        }
+        slot = (slot + 1) % size;
+      }
+    }
+  }
+  free(slots);
+  return origin;
+}
+
+/*
+ * Carry the usage map over the moves: sources are all cleared before any
+ * destination is set, so a block that is both stays in use. Scratch space
+ * is never marked, as its data moves on again.
+ */
+static void relocator_update_usage(const struct relocation_plan *plan,
+                                   struct usage_map *um) {
+  for (uint32_t i = 0; i < plan->count; i++) {
+    const struct relocation_entry *re = &plan->entries[i];
+    if (!(re->flags & RELOC_FLAG_SCRATCH_IN))
+      usage_map_set(um, re->src_offset, re->length, 0);
+  }
+  for (uint32_t i = 0; i < plan->count; i++) {
+    const struct relocation_entry *re = &plan->entries[i];
+    if (!(re->flags & RELOC_FLAG_SCRATCH_OUT))
+      usage_map_set(um, re->dst_offset, re->length, 1);
+  }
+}
+
+/*
+ * Split the plan into ring-buffer sized chunks, in execution order,
+ * leaving out entries already completed and unwritten ones. Returns the
+ * chunk count, or -1 on OOM.
+ */
+static int64_t relocator_build_chunks(const struct relocation_plan *plan,
+                                      uint64_t chunk_size,
+                                      struct reloc_chunk **out) {
+  uint64_t count = 0;
+  for (uint32_t i = 0; i < plan->count; i++) {
+    const struct relocation_entry *re = &plan->entries[i];
+    if (!re->completed && !(re->flags & RELOC_FLAG_UNWRITTEN))
+      count += (re->length + chunk_size - 1) / chunk_size;
+  }
+  if (count > UINT32_MAX)
+    return -1;
+
+  struct reloc_chunk *chunks = malloc(count * sizeof(struct reloc_chunk));
+  if (!chunks && count > 0)
+    return -1;
+
+  uint64_t n = 0;
+  for (uint32_t i = 0; i < plan->count; i++) {
+    const struct relocation_entry *re = &plan->entries[i];
+    if (re->completed || (re->flags & RELOC_FLAG_UNWRITTEN))
+      continue;
+    for (uint64_t off = 0; off < re->length; off += chunk_size) {
+      chunks[n].src = re->src_offset + off;
+      chunks[n].dst = re->dst_offset + off;
+      chunks[n].len =
+          re->length - off > chunk_size ? chunk_size : re->length - off;
+      chunks[n].entry = i;
+      n++;
+    }
+  }
+  *out = chunks;
+  return (int64_t)n;
+}
+
+/* What a finished entry updates; fs_info is NULL for raw moves */
+struct reloc_update {
+  struct btrfs_fs_info *fs_info;
+  const uint64_t *origin;
+  const struct extent_hash *ehash;
+  int have_hash;
+  uint32_t block_size;
+};
+
+/* Bytes the entries not yet completed will copy */
+static uint64_t relocator_pending_bytes(const struct relocation_plan *plan) {
+  uint64_t bytes = 0;
+  for (uint32_t i = 0; i < plan->count; i++) {
+    const struct relocation_entry *re = &plan->entries[i];
+    if (!re->completed && !(re->flags & RELOC_FLAG_UNWRITTEN))
+      bytes += re->length;
+  }
+  return bytes;
+}
+
+/*
+ * Work an entry is done with: tell the progress hook and, unless it is the
+ * first leg of a move staged through scratch (the second one points the
+ * extents at the final destination), repoint the extents. Its bytes count
+ * for the progress reporter unless nothing was copied.
+ */
+static void relocator_entry_done(struct relocation_plan *plan, uint32_t i,
+                                 const struct reloc_update *u) {
+  struct relocation_entry *re = &plan->entries[i];
+  re->completed = 1;
+  if (u->fs_info) {
+    if (g_reloc_progress)
+      g_reloc_progress(re, g_reloc_progress_arg);
+    if (!(re->flags & RELOC_FLAG_SCRATCH_OUT))
+      relocator_update_extents(u->origin ? u->origin[i] : re->src_offset, re,
+                               u->fs_info, u->ehash, u->have_hash,
+                               u->block_size);
+  }
+  if (!(re->flags & RELOC_FLAG_UNWRITTEN))
+    progress_add(re->length);
+}
+
+/*
+ * Zero-copy executor: one device_copy() per entry, in execution order, so
+ * every move sees the ones it depends on on disk. The data never reaches
+ * user space, so entries carry no checksum; unwritten entries are only
+ * marked done. Returns 0, or -1 with
+ * *failed_seq set to the entry that failed.
+ */
+static int relocator_copy_entries(struct relocation_plan *plan,
+                                  struct device *dev,
+                                  const struct reloc_update *u,
+                                  uint32_t *failed_seq) {
+  for (uint32_t i = 0; i < plan->count; i++) {
+    struct relocation_entry *re = &plan->entries[i];
+    if (re->completed)
+      continue;
+    if (!(re->flags & RELOC_FLAG_UNWRITTEN) &&
+        device_copy(dev, re->src_offset, re->dst_offset, re->length) < 0) {
+      *failed_seq = re->seq;
+      return -1;
+    }
+    relocator_entry_done(plan, i, u);
+  }
+  return 0;
+}
+
+/*
+ * Pipelined executor (see above) with `depth` buffers sharing `budget`
+ * bytes, in multiples of `gran`: the data passes through user space, which
+ * is where each entry's CRC32C is taken. Returns 0, -1 on a read error or
+ * OOM, or -1 with *write_failed and *failed_seq set.
+ */
+static int relocator_pipeline(struct relocation_plan *plan, struct device *dev,
+                              uint32_t depth, uint64_t budget, uint32_t gran,
+                              const struct reloc_update *u, int *write_failed,
+                              uint32_t *failed_seq) {
+  /* Find max relocation entry size to size the ring buffers */
+  uint64_t max_len = 0;
+  for (uint32_t i = 0; i < plan->count; i++) {
+    const struct relocation_entry *re = &plan->entries[i];
+    if (!(re->flags & RELOC_FLAG_UNWRITTEN) && re->length > max_len)
+      max_len = re->length;
+  }
+  if (max_len == 0) {
+    for (uint32_t i = 0; i < plan->count; i++)
+      if (!plan->entries[i].completed)
+        relocator_entry_done(plan, i, u);
+    return 0;
+  }
+
+  uint64_t chunk_size = budget / depth;
+  chunk_size -= chunk_size % gran;
+  if (chunk_size < gran)
+    chunk_size = gran;
+  if (max_len < chunk_size)
+    chunk_size = max_len;
+
+  struct reloc_chunk *chunks = NULL;
+  int64_t chunk_count = relocator_build_chunks(plan, chunk_size, &chunks);
+  uint8_t **bufs = calloc(depth, sizeof(uint8_t *));
+  int setup_ok = chunk_count >= 0 && bufs != NULL;
+  for (uint32_t i = 0; setup_ok && i < depth; i++) {
+    bufs[i] = device_buf_alloc(chunk_size);
+    if (!bufs[i])
+      setup_ok = 0;
+  }
+  if (!setup_ok) {
+    fprintf(stderr, "btrfs2ext4: out of memory for relocation pipeline\n");
+    for (uint32_t i = 0; bufs && i < depth; i++)
+      device_buf_free(bufs[i], chunk_size);
+    free(bufs);
+    free(chunks);
+    return -1;
+  }
+
+  struct reloc_pipeline p;
+  memset(&p, 0, sizeof(p));
+  p.dev = dev;
+  p.chunks = chunks;
+  p.chunk_count = (uint32_t)chunk_count;
+  p.bufs = bufs;
+  p.depth = depth;
+  p.refill = RELOCATOR_REFILL(depth);
+  pthread_mutex_init(&p.lock, NULL);
+  pthread_cond_init(&p.cond, NULL);
+
+  pthread_t reader;
+  int ret = 0;
+  uint32_t next = 0; /* entries before it are done */
+
+  if (pthread_create(&reader, NULL, reloc_reader_thread, &p) != 0) {
+    fprintf(stderr, "btrfs2ext4: cannot start relocation reader thread\n");
+    ret = -1;
+    goto out;
+  }
+
+  for (uint32_t c = 0; c < p.chunk_count; c++) {
+    pthread_mutex_lock(&p.lock);
+    while (p.read_done <= c && !p.read_error)
+      pthread_cond_wait(&p.cond, &p.lock);
+    int read_error = p.read_done <= c;
+    pthread_mutex_unlock(&p.lock);
+    if (read_error) {
+      ret = -1;
+      break;
+    }
+
+    const struct reloc_chunk *ch = &chunks[c];
+    struct relocation_entry *re = &plan->entries[ch->entry];
+    uint8_t *buf = bufs[c % depth];
+
+    /* Compute checksum of chunk for migration map integrity */
+    re->checksum = crc32c(re->checksum, buf, (size_t)ch->len);
+    re->flags |= RELOC_FLAG_CHECKSUM;
+
+    /* Write to destination */
+    if (device_write_bulk(dev, ch->dst, buf, (size_t)ch->len) < 0) {
+      *write_failed = 1;
+      *failed_seq = re->seq;
+      ret = -1;
+      break;
+    }
+
+    /* Bug F fix: Read-back verification removed by default.
+     * The in-memory CRC stored in re->checksum is sufficient for
+     * rollback integrity via the migration map. The old readback
+     * doubled I/O time on HDDs (each write requires a full disk
+     * rotation before the readback can start). */
+
+    pthread_mutex_lock(&p.lock);
+    p.written = c + 1;
+    pthread_cond_broadcast(&p.cond);
+    pthread_mutex_unlock(&p.lock);
+
+    if (c + 1 < p.chunk_count && chunks[c + 1].entry == ch->entry)
+      continue; /* entry not finished yet */
+
+    /* Entries finish in plan order: unwritten ones, which have no chunks,
+     * as the copies around them do */
+    for (; next < ch->entry; next++)
+      if (!plan->entries[next].completed)
+        relocator_entry_done(plan, next, u);
+    relocator_entry_done(plan, ch->entry, u);
+    next = ch->entry + 1;
+  }
+  for (; ret == 0 && next < plan->count; next++)
+    if (!plan->entries[next].completed)
+      relocator_entry_done(plan, next, u);
+
+  pthread_mutex_lock(&p.lock);
+  p.abort = 1;
+  pthread_cond_broadcast(&p.cond);
+  pthread_mutex_unlock(&p.lock);
+  pthread_join(reader, NULL);
+
+out:
+  pthread_mutex_destroy(&p.lock);
+  pthread_cond_destroy(&p.cond);
+  for (uint32_t i = 0; i < depth; i++)
+    device_buf_free(bufs[i], chunk_size);
+  free(bufs);
+  free(chunks);
+  return ret;
+}
+
 int relocator_execute(struct relocation_plan *plan, struct device *dev,
                       struct btrfs_fs_info *fs_info, uint32_t block_size) {
   if (plan->count == 0) {
@@ -471,156 +1275,221 @@ int relocator_execute(struct relocation_plan *plan, struct device *dev,
     return 0;
   }
 
-  printf("Executing %u block relocations...\n", plan->count);
+  /* Kernel-side copies unless the CRCs were asked for or the kernel
+   * would bounce the data through user space anyway */
+  enum device_copy_mode mode = device_copy_mode(dev);
+  int zero_copy = !g_reloc_verify && device_copy_in_kernel(mode);
+  if (zero_copy)
+    printf("Executing %u block relocations (%s)...\n", plan->count,
+           device_copy_mode_name(mode));
+  else
+    printf("Executing %u block relocations (pipeline depth %u)...\n",
+           plan->count, g_reloc_depth);
 
   /* Build extent hash for O(1) updates (#7) */
   struct extent_hash ehash;
   int have_hash = (extent_hash_init(&ehash, fs_info, block_size) == 0);
 
-  /* Find max relocation entry size to allocate buffer */
-  uint64_t max_len = 0;
-  for (uint32_t i = 0; i < plan->count; i++) {
-    if (plan->entries[i].length > max_len)
-      max_len = plan->entries[i].length;
-  }
-
-  if (max_len > 16 * 1024 * 1024)
-    max_len = 16 * 1024 * 1024;
-
-  uint8_t *buf = malloc(max_len);
-  if (!buf) {
+  int origin_err;
+  uint64_t *origin = relocator_scratch_origins(plan, &origin_err);
+  if (origin_err) {
+    fprintf(stderr, "btrfs2ext4: out of memory for relocation pipeline\n");
     if (have_hash)
       extent_hash_free(&ehash);
     return -1;
   }
 
+  /* Moves a previous run finished only need their extents repointed */
+  uint32_t resumed = 0;
   for (uint32_t i = 0; i < plan->count; i++) {
     struct relocation_entry *re = &plan->entries[i];
+    if (!re->completed) {
+      re->checksum = 0;
+      re->flags &= ~RELOC_FLAG_CHECKSUM;
+      continue;
+    }
+    if (!(re->flags & RELOC_FLAG_SCRATCH_OUT))
+      relocator_update_extents(origin ? origin[i] : re->src_offset, re,
+                               fs_info, &ehash, have_hash, block_size);
+    resumed++;
+  }
+  if (resumed > 0)
+    printf("  Resuming: %u of %u entries already relocated\n", resumed,
+           plan->count);
+
+  struct reloc_update u = {fs_info, origin, &ehash, have_hash, block_size};
+  int write_failed = 0;
+  uint32_t failed_seq = 0;
+  int ret;
+  progress_begin("relocate", relocator_pending_bytes(plan), NULL);
+  if (zero_copy) {
+    ret = relocator_copy_entries(plan, dev, &u, &failed_seq);
+    write_failed = ret < 0;
+  } else {
+    /* The ring as a whole keeps the old 16 MiB budget */
+    ret = relocator_pipeline(plan, dev, g_reloc_depth, RELOCATOR_BUFFER_BUDGET,
+                             block_size, &u, &write_failed, &failed_seq);
+  }
+  progress_end();
 
-    uint64_t remaining = re->length;
-    uint64_t current_src = re->src_offset;
-    uint64_t current_dst = re->dst_offset;
-    re->checksum = 0;
+  free(origin);
+  if (have_hash)
+    extent_hash_free(&ehash);
 
-    while (remaining > 0) {
-      uint64_t chunk = remaining > max_len ? max_len : remaining;
+  if (write_failed) {
+    fprintf(stderr,
+            "btrfs2ext4: relocation write failed at seq %u, initiating "
+            "partial rollback...\n",
+            failed_seq);
+    journal_replay_partial(dev, journal_current_offset(), failed_seq);
+    return -1;
+  }
+  if (ret < 0)
+    return -1;
 
-      /* Read source blocks */
-      if (device_read(dev, current_src, buf, chunk) < 0) {
-        free(buf);
-        if (have_hash)
-          extent_hash_free(&ehash);
-        return -1;
-      }
+  relocator_update_usage(plan, &fs_info->usage);
+  device_sync(dev);
 
-      /* Compute checksum of chunk for migration map integrity */
-      re->checksum = crc32c(re->checksum, buf, chunk);
+  printf("  Block relocation complete\n\n");
+  return 0;
+}
 
-      /* Write to destination */
-      if (device_write(dev, current_dst, buf, chunk) < 0) {
-        free(buf);
-        if (have_hash)
-          extent_hash_free(&ehash);
+int relocator_move(struct relocation_plan *plan, struct device *dev) {
+  if (plan->count == 0)
+    return 0;
+  struct reloc_update u = {0};
+  int write_failed = 0;
+  uint32_t failed_seq = 0;
+  int ret;
+  progress_begin("move", relocator_pending_bytes(plan), NULL);
+  if (!g_reloc_verify && device_copy_in_kernel(device_copy_mode(dev)))
+    ret = relocator_copy_entries(plan, dev, &u, &failed_seq);
+  else
+    ret = relocator_pipeline(plan, dev, RELOCATOR_MOVE_DEPTH,
+                             RELOCATOR_MOVE_BUDGET, DEVICE_DIRECT_ALIGN, &u,
+                             &write_failed, &failed_seq);
+  progress_end();
+  return ret;
+}
 
-        fprintf(stderr,
-                "btrfs2ext4: relocation write failed at seq %u, initiating "
-                "partial rollback...\n",
-                re->seq);
-        journal_replay_partial(dev, journal_current_offset(), re->seq);
-        return -1;
-      }
+/* ========================================================================
+ * Verification — CRC32C of moved data, in worker threads
+ * ======================================================================== */
 
-      /* Bug F fix: Read-back verification removed by default.
-       * The in-memory CRC stored in re->checksum is sufficient for
-       * rollback integrity via the migration map. The old readback
-       * doubled I/O time on HDDs (each write requires a full disk
-       * rotation before the readback can start). */
+/* Read size of a verification worker */
+#define RELOC_VERIFY_CHUNK (4u << 20)
 
-      current_src += chunk;
-      current_dst += chunk;
-      remaining -= chunk;
-    }
+/* Entries [first, last) for one worker */
+struct reloc_verify_task {
+  const struct relocation_plan *plan;
+  struct device *dev;
+  uint32_t first, last;
+  int64_t mismatches; /* -1 on a read error or OOM */
+};
 
-    re->completed = 1;
-
-    /* Update in-memory extent maps using hash (O(1) per block - supports CoW
-     * dupes) */
-    uint32_t blocks_in_entry = (uint32_t)(re->length / block_size);
-    for (uint32_t bi = 0; bi < blocks_in_entry; bi++) {
-      uint64_t src_block_offset = re->src_offset + (uint64_t)bi * block_size;
-
-      if (have_hash) {
-        uint32_t slot =
-            (uint32_t)((src_block_offset * 2654435761ULL) >> 16) % ehash.size;
-        uint32_t start = slot;
-        int first_extent = 1;
-
-        do {
-          if (ehash.buckets[slot].phys_offset == 0)
-            break;
-
-          /* Phase 4.2: CoW Cloning inside Relocator */
-          if (ehash.buckets[slot].phys_offset == src_block_offset) {
-            uint32_t fi = ehash.buckets[slot].inode_idx;
-            uint32_t ej = ehash.buckets[slot].extent_idx;
-            if (fi < fs_info->inode_count &&
-                ej < fs_info->inode_table[fi]->extent_count) {
-              if (first_extent) {
-                /* Primary extent update */
-                fs_info->inode_table[fi]->extents[ej].disk_bytenr =
-                    re->dst_offset + (uint64_t)bi * block_size;
-                first_extent = 0;
-              } else {
-                /* Secondary extent (CoW duplication)
-                 * We point the secondary inode's extent directly to the newly
-                 * relocated block alongside the primary inode.
-                 * The actual physical cloning of these Shared Blocks (to
-                 * prevent Ext4 'Multiply-Claimed' metadata corruption) is
-                 * universally handled downstream by `resolve_extents` in
-                 * `extent_writer.c`.
-                 */
-                fs_info->inode_table[fi]->extents[ej].disk_bytenr =
-                    re->dst_offset + (uint64_t)bi * block_size;
-              }
-            }
-          }
-          slot = (slot + 1) % ehash.size;
-        } while (slot != start);
-      } else {
-        /* Fallback: linear scan (original behavior) */
-        for (uint32_t fi = 0; fi < fs_info->inode_count; fi++) {
-          struct file_entry *fe = fs_info->inode_table[fi];
-          for (uint32_t ej = 0; ej < fe->extent_count; ej++) {
-            struct file_extent *ext = &fe->extents[ej];
-            if (ext->type == BTRFS_FILE_EXTENT_INLINE || ext->disk_bytenr == 0)
-              continue;
-            uint64_t phys =
-                chunk_map_resolve(fs_info->chunk_map, ext->disk_bytenr);
-            if (phys == src_block_offset) {
-              ext->disk_bytenr = re->dst_offset + (uint64_t)bi * block_size;
-            }
-          }
-        }
+static void reloc_verify_task(void *arg) {
+  struct reloc_verify_task *t = arg;
+  uint8_t *buf = device_buf_alloc(RELOC_VERIFY_CHUNK);
+  if (!buf) {
+    t->mismatches = -1;
+    return;
+  }
+  for (uint32_t i = t->first; i < t->last && t->mismatches >= 0; i++) {
+    const struct relocation_entry *re = &t->plan->entries[i];
+    if (!(re->flags & RELOC_FLAG_CHECKSUM))
+      continue;
+    uint32_t crc = 0;
+    for (uint64_t off = 0; off < re->length; off += RELOC_VERIFY_CHUNK) {
+      size_t n = re->length - off < RELOC_VERIFY_CHUNK
+                     ? (size_t)(re->length - off)
+                     : RELOC_VERIFY_CHUNK;
+      if (device_read_bulk(t->dev, re->src_offset + off, buf, n) < 0) {
+        t->mismatches = -1;
+        break;
       }
+      crc = crc32c(crc, buf, n);
     }
-
-    /* Progress */
-    if ((i + 1) % 100 == 0 || i + 1 == plan->count) {
-      printf("  Relocated %u/%u entries (%.1f%%)\n", i + 1, plan->count,
-             100.0 * (i + 1) / plan->count);
+    if (t->mismatches >= 0 && crc != re->checksum) {
+      fprintf(stderr,
+              "btrfs2ext4: CRC mismatch in %lu bytes at 0x%lx (moved from "
+              "0x%lx)\n",
+              (unsigned long)re->length, (unsigned long)re->src_offset,
+              (unsigned long)re->dst_offset);
+      t->mismatches++;
     }
   }
+  device_buf_free(buf, RELOC_VERIFY_CHUNK);
+}
 
-  free(buf);
-  if (have_hash)
-    extent_hash_free(&ehash);
-  device_sync(dev);
+int64_t relocator_verify(const struct relocation_plan *plan,
+                         struct device *dev, uint32_t threads) {
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < plan->count; i++) {
+    if (plan->entries[i].flags & RELOC_FLAG_CHECKSUM)
+      total += plan->entries[i].length;
+  }
+  if (total == 0)
+    return 0;
+  if (threads == 0)
+    threads = thread_pool_default_threads();
+
+  /* A few slices per worker, cut at equal byte counts, so one huge entry
+   * does not leave the others idle */
+  uint32_t slices = threads * 4 < plan->count ? threads * 4 : plan->count;
+  struct reloc_verify_task *tasks = calloc(slices, sizeof(*tasks));
+  struct thread_pool_wait_group *wg = thread_pool_wg_create();
+  struct thread_pool *pool =
+      threads > 1 ? thread_pool_create(threads, slices) : NULL;
+  if (!tasks || !wg) {
+    fprintf(stderr, "btrfs2ext4: out of memory for verification\n");
+    free(tasks);
+    if (wg)
+      thread_pool_wg_destroy(wg);
+    if (pool)
+      thread_pool_destroy(pool);
+    return -1;
+  }
 
-  printf("  Block relocation complete\n\n");
-  return 0;
+  uint32_t n = 0, first = 0;
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < plan->count && n < slices; i++) {
+    if (plan->entries[i].flags & RELOC_FLAG_CHECKSUM)
+      seen += plan->entries[i].length;
+    if (i + 1 < plan->count && seen * slices < total * (n + 1))
+      continue;
+    struct reloc_verify_task *t = &tasks[n++];
+    t->plan = plan;
+    t->dev = dev;
+    t->first = first;
+    t->last = i + 1;
+    first = i + 1;
+    thread_pool_wg_add(wg, 1);
+    if (!pool || thread_pool_submit(pool, reloc_verify_task, t, wg) < 0) {
+      /* Inline fallback if the pool is missing or full */
+      thread_pool_wg_done(wg);
+      reloc_verify_task(t);
+    }
+  }
+  thread_pool_wg_wait(wg);
+
+  int64_t mismatches = 0;
+  for (uint32_t k = 0; k < n; k++) {
+    if (tasks[k].mismatches < 0)
+      mismatches = -1;
+    else if (mismatches >= 0)
+      mismatches += tasks[k].mismatches;
+  }
+  if (pool)
+    thread_pool_destroy(pool);
+  thread_pool_wg_destroy(wg);
+  free(tasks);
+  return mismatches;
 }
 
 void relocator_free(struct relocation_plan *plan) {
+  if (plan->entries)
+    mem_track_free_tag(MEM_TAG_RELOC,
+                       plan->capacity * sizeof(struct relocation_entry));
   free(plan->entries);
   memset(plan, 0, sizeof(*plan));
 }
@@ -1,61 +1,382 @@
+#define _GNU_SOURCE
 #include "thread_pool.h"
+
+#include <sched.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
-static void *thread_worker(void *arg) {
-  struct thread_pool *pool = (struct thread_pool *)arg;
+/* Worker running on this thread, if any (routes nested submits) */
+static __thread struct thread_pool_worker *tls_worker;
+
+static uint32_t round_pow2(uint32_t v) {
+  uint32_t p = 1;
+  while (p < v && p < (1U << 30))
+    p <<= 1;
+  return p;
+}
+
+static inline void stat_inc(uint64_t *counter) {
+  __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+/* ========================================================================
+ * Default sizing — online CPUs, affinity mask, cgroup CPU quota
+ * ======================================================================== */
+
+/* ceil(quota / period) from a cgroup, or 0 if unlimited/unknown */
+static uint32_t quota_cpus(long long quota, long long period) {
+  if (quota <= 0 || period <= 0)
+    return 0;
+  long long cpus = (quota + period - 1) / period;
+  return cpus > 0 ? (uint32_t)cpus : 1;
+}
+
+static uint32_t cgroup_v2_limit(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return 0;
+  char quota[32];
+  long long period = 0;
+  uint32_t cpus = 0;
+  if (fscanf(f, "%31s %lld", quota, &period) == 2 &&
+      strcmp(quota, "max") != 0)
+    cpus = quota_cpus(atoll(quota), period);
+  fclose(f);
+  return cpus;
+}
+
+static long long read_ll(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return -1;
+  long long v = -1;
+  if (fscanf(f, "%lld", &v) != 1)
+    v = -1;
+  fclose(f);
+  return v;
+}
+
+static uint32_t cgroup_cpu_limit(void) {
+  /* cgroup v2: our own group first (from /proc/self/cgroup), then root */
+  FILE *f = fopen("/proc/self/cgroup", "r");
+  if (f) {
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+      if (strncmp(line, "0::", 3) != 0)
+        continue;
+      line[strcspn(line, "\n")] = '\0';
+      char path[600];
+      snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", line + 3);
+      uint32_t cpus = cgroup_v2_limit(path);
+      if (cpus) {
+        fclose(f);
+        return cpus;
+      }
+    }
+    fclose(f);
+  }
+  uint32_t cpus = cgroup_v2_limit("/sys/fs/cgroup/cpu.max");
+  if (cpus)
+    return cpus;
+
+  /* cgroup v1 */
+  return quota_cpus(read_ll("/sys/fs/cgroup/cpu/cpu.cfs_quota_us"),
+                    read_ll("/sys/fs/cgroup/cpu/cpu.cfs_period_us"));
+}
+
+uint32_t thread_pool_default_threads(void) {
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t threads = online > 0 ? (uint32_t)online : 1;
+
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    int allowed = CPU_COUNT(&set);
+    if (allowed > 0 && (uint32_t)allowed < threads)
+      threads = (uint32_t)allowed;
+  }
+
+  uint32_t quota = cgroup_cpu_limit();
+  if (quota > 0 && quota < threads)
+    threads = quota;
+  return threads;
+}
+
+/* ========================================================================
+ * Chase-Lev work-stealing deque (bounded)
+ * ======================================================================== */
+
+static inline void task_store(struct thread_task *slot,
+                              const struct thread_task *t) {
+  __atomic_store_n(&slot->fn, t->fn, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->arg, t->arg, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->wg, t->wg, __ATOMIC_RELAXED);
+}
 
+static inline void task_load(struct thread_task *t,
+                             const struct thread_task *slot) {
+  t->fn = __atomic_load_n(&slot->fn, __ATOMIC_RELAXED);
+  t->arg = __atomic_load_n(&slot->arg, __ATOMIC_RELAXED);
+  t->wg = __atomic_load_n(&slot->wg, __ATOMIC_RELAXED);
+}
+
+/* Owner only. Returns -1 if full. */
+static int deque_push(struct thread_pool_deque *dq,
+                      const struct thread_task *t) {
+  int64_t b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED);
+  int64_t top = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+  if (b - top > (int64_t)dq->mask)
+    return -1;
+  task_store(&dq->slots[b & dq->mask], t);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/* Owner only, LIFO end. Returns 1 if a task was taken. */
+static int deque_take(struct thread_pool_deque *dq, struct thread_task *t) {
+  int64_t b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&dq->bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t top = __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+
+  if (top > b) {
+    __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  task_load(t, &dq->slots[b & dq->mask]);
+  if (top == b) {
+    /* Last task: race the thieves for it */
+    int won = __atomic_compare_exchange_n(&dq->top, &top, top + 1, 0,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+    return won;
+  }
+  return 1;
+}
+
+/* Any thread, FIFO end. Returns 1 if a task was stolen. */
+static int deque_steal(struct thread_pool_deque *dq, struct thread_task *t) {
+  int64_t top = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t b = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+  if (top >= b)
+    return 0;
+  task_load(t, &dq->slots[top & dq->mask]);
+  return __atomic_compare_exchange_n(&dq->top, &top, top + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/* ========================================================================
+ * Injection queue — bounded MPMC (Vyukov)
+ * ======================================================================== */
+
+static int inject_init(struct thread_pool_inject *q, uint32_t capacity) {
+  q->cells = calloc(capacity, sizeof(*q->cells));
+  if (!q->cells)
+    return -1;
+  q->mask = capacity - 1;
+  for (uint32_t i = 0; i < capacity; i++)
+    q->cells[i].seq = i;
+  return 0;
+}
+
+static int inject_push(struct thread_pool_inject *q,
+                       const struct thread_task *t) {
+  uint64_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  struct thread_pool_inject_cell *cell;
   for (;;) {
-    struct thread_task task;
+    cell = &q->cells[pos & q->mask];
+    uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    int64_t diff = (int64_t)(seq - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return -1; /* full */
+    } else {
+      pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+  }
+  cell->task = *t;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  return 0;
+}
 
-    pthread_mutex_lock(&pool->lock);
-    while (pool->count == 0 && !pool->shutdown) {
-      pthread_cond_wait(&pool->notify, &pool->lock);
+static int inject_pop(struct thread_pool_inject *q, struct thread_task *t) {
+  uint64_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+  struct thread_pool_inject_cell *cell;
+  for (;;) {
+    cell = &q->cells[pos & q->mask];
+    uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    int64_t diff = (int64_t)(seq - (pos + 1));
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return 0; /* empty */
+    } else {
+      pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
     }
+  }
+  *t = cell->task;
+  __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+  return 1;
+}
 
-    if (pool->shutdown && pool->count == 0) {
-      pthread_mutex_unlock(&pool->lock);
-      break;
+/* ========================================================================
+ * Workers
+ * ======================================================================== */
+
+static uint32_t worker_rand(struct thread_pool_worker *w) {
+  /* xorshift64 */
+  w->rng ^= w->rng << 13;
+  w->rng ^= w->rng >> 7;
+  w->rng ^= w->rng << 17;
+  return (uint32_t)w->rng;
+}
+
+/* Own deque, then the injection queue, then one sweep over the others
+ * starting at a random victim */
+static int worker_find_task(struct thread_pool_worker *w,
+                            struct thread_task *t) {
+  struct thread_pool *pool = w->pool;
+  if (deque_take(&w->deque, t))
+    return 1;
+  if (inject_pop(&pool->inject, t))
+    return 1;
+
+  uint32_t n = pool->num_threads;
+  if (n > 1) {
+    uint32_t start = worker_rand(w) % n;
+    for (uint32_t k = 0; k < n; k++) {
+      uint32_t v = (start + k) % n;
+      if (v == w->index)
+        continue;
+      if (deque_steal(&pool->workers[v].deque, t)) {
+        stat_inc(&w->stats.tasks_stolen);
+        return 1;
+      }
     }
+    stat_inc(&w->stats.steal_failures);
+  }
+  return 0;
+}
 
-    task = pool->tasks[pool->head];
-    pool->head = (pool->head + 1) % pool->queue_capacity;
-    pool->count--;
-    pthread_mutex_unlock(&pool->lock);
+static void *thread_worker(void *arg) {
+  struct thread_pool_worker *w = (struct thread_pool_worker *)arg;
+  struct thread_pool *pool = w->pool;
+  tls_worker = w;
+
+  for (;;) {
+    struct thread_task task;
 
-    /* Execute task */
-    if (task.fn) {
-      task.fn(task.arg);
+    if (worker_find_task(w, &task)) {
+      __atomic_fetch_sub(&pool->queued, 1, __ATOMIC_SEQ_CST);
+
+      /* Execute task */
+      if (task.fn) {
+        task.fn(task.arg);
+      }
+      /* Count before signalling, so stats read after a wait add up */
+      stat_inc(&w->stats.tasks_run);
+      if (task.wg) {
+        thread_pool_wg_done(task.wg);
+      }
+      continue;
     }
-    if (task.wg) {
-      thread_pool_wg_done(task.wg);
+
+    /* Nothing found. `queued` may still be non-zero while another worker
+     * is between taking a task and decrementing it; then we just retry. */
+    pthread_mutex_lock(&pool->lock);
+    __atomic_fetch_add(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0 &&
+           !pool->shutdown) {
+      stat_inc(&w->stats.idle_sleeps);
+      pthread_cond_wait(&pool->notify, &pool->lock);
     }
+    __atomic_fetch_sub(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+    int done = pool->shutdown &&
+               __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0;
+    pthread_mutex_unlock(&pool->lock);
+    if (done)
+      break;
   }
+  tls_worker = NULL;
   return NULL;
 }
 
+/* ========================================================================
+ * Pool API
+ * ======================================================================== */
+
+static void pool_free(struct thread_pool *pool) {
+  if (pool->workers) {
+    for (uint32_t i = 0; i < pool->num_threads; i++)
+      free(pool->workers[i].deque.slots);
+  }
+  free(pool->workers);
+  free(pool->inject.cells);
+  free(pool->threads);
+  free(pool);
+}
+
 struct thread_pool *thread_pool_create(uint32_t num_threads,
                                        uint32_t queue_capacity) {
-  if (num_threads == 0 || queue_capacity == 0)
+  if (queue_capacity == 0)
     return NULL;
+  if (num_threads == 0)
+    num_threads = thread_pool_default_threads();
 
   struct thread_pool *pool = calloc(1, sizeof(*pool));
   if (!pool)
     return NULL;
 
+  uint32_t capacity = round_pow2(queue_capacity);
   pool->num_threads = num_threads;
-  pool->queue_capacity = queue_capacity;
-  pool->tasks = calloc(queue_capacity, sizeof(struct thread_task));
-  if (!pool->tasks) {
-    free(pool);
+  pool->queue_capacity = capacity;
+  pool->workers = calloc(num_threads, sizeof(struct thread_pool_worker));
+  pool->threads = calloc(num_threads, sizeof(pthread_t));
+  if (!pool->workers || !pool->threads ||
+      inject_init(&pool->inject, capacity) < 0) {
+    pool_free(pool);
     return NULL;
   }
 
+  for (uint32_t i = 0; i < num_threads; i++) {
+    struct thread_pool_worker *w = &pool->workers[i];
+    w->pool = pool;
+    w->index = i;
+    w->rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+    w->deque.mask = capacity - 1;
+    w->deque.slots = calloc(capacity, sizeof(struct thread_task));
+    if (!w->deque.slots) {
+      pool_free(pool);
+      return NULL;
+    }
+  }
+
   pthread_mutex_init(&pool->lock, NULL);
   pthread_cond_init(&pool->notify, NULL);
 
-  pool->threads = calloc(num_threads, sizeof(pthread_t));
   for (uint32_t i = 0; i < num_threads; i++) {
-    pthread_create(&pool->threads[i], NULL, thread_worker, pool);
+    if (pthread_create(&pool->threads[i], NULL, thread_worker,
+                       &pool->workers[i]) != 0) {
+      fprintf(stderr, "btrfs2ext4: thread pool: started %u of %u workers\n",
+              i, num_threads);
+      /* Run with the workers we have; thieves only look at those */
+      pool->num_threads = i;
+      break;
+    }
+  }
+  if (pool->num_threads == 0) {
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->notify);
+    pool_free(pool);
+    return NULL;
   }
 
   return pool;
@@ -65,31 +386,54 @@ int thread_pool_submit(struct thread_pool *pool, thread_task_fn fn, void *arg,
                        struct thread_pool_wait_group *wg) {
   if (!pool || !fn)
     return -1;
+  if (__atomic_load_n(&pool->shutdown, __ATOMIC_ACQUIRE))
+    return -1;
 
-  pthread_mutex_lock(&pool->lock);
-  if (pool->count == pool->queue_capacity || pool->shutdown) {
-    pthread_mutex_unlock(&pool->lock);
+  /* Count first so a worker that takes the task never sees `queued` go
+   * below zero */
+  __atomic_fetch_add(&pool->queued, 1, __ATOMIC_SEQ_CST);
+
+  struct thread_task task = {fn, arg, wg};
+  struct thread_pool_worker *w = tls_worker;
+  int ret = (w && w->pool == pool) ? deque_push(&w->deque, &task)
+                                   : inject_push(&pool->inject, &task);
+  if (ret < 0) {
+    __atomic_fetch_sub(&pool->queued, 1, __ATOMIC_SEQ_CST);
+    stat_inc(&pool->rejected);
     return -1;
   }
 
-  pool->tasks[pool->tail].fn = fn;
-  pool->tasks[pool->tail].arg = arg;
-  pool->tasks[pool->tail].wg = wg;
-  pool->tail = (pool->tail + 1) % pool->queue_capacity;
-  pool->count++;
-
-  pthread_cond_signal(&pool->notify);
-  pthread_mutex_unlock(&pool->lock);
+  if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->notify);
+    pthread_mutex_unlock(&pool->lock);
+  }
 
   return 0;
 }
 
+void thread_pool_get_stats(const struct thread_pool *pool,
+                           struct thread_pool_stats *out) {
+  memset(out, 0, sizeof(*out));
+  if (!pool)
+    return;
+  for (uint32_t i = 0; i < pool->num_threads; i++) {
+    const struct thread_pool_stats *s = &pool->workers[i].stats;
+    out->tasks_run += __atomic_load_n(&s->tasks_run, __ATOMIC_RELAXED);
+    out->tasks_stolen += __atomic_load_n(&s->tasks_stolen, __ATOMIC_RELAXED);
+    out->steal_failures +=
+        __atomic_load_n(&s->steal_failures, __ATOMIC_RELAXED);
+    out->idle_sleeps += __atomic_load_n(&s->idle_sleeps, __ATOMIC_RELAXED);
+  }
+  out->submit_rejected = __atomic_load_n(&pool->rejected, __ATOMIC_RELAXED);
+}
+
 void thread_pool_destroy(struct thread_pool *pool) {
   if (!pool)
     return;
 
   pthread_mutex_lock(&pool->lock);
-  pool->shutdown = 1;
+  __atomic_store_n(&pool->shutdown, 1, __ATOMIC_RELEASE);
   pthread_cond_broadcast(&pool->notify);
   pthread_mutex_unlock(&pool->lock);
 
@@ -99,9 +443,7 @@ void thread_pool_destroy(struct thread_pool *pool) {
 
   pthread_mutex_destroy(&pool->lock);
   pthread_cond_destroy(&pool->notify);
-  free(pool->tasks);
-  free(pool->threads);
-  free(pool);
+  pool_free(pool);
 }
 
 struct thread_pool_wait_group *thread_pool_wg_create(void) {
@@ -0,0 +1,210 @@
+/*
+ * usage_map.c — Device-wide map of the blocks Btrfs occupies
+ *
+ * A flat bitmap at Btrfs sector granularity. Every Btrfs allocation is
+ * sector-aligned, so the map is exact for any ext4 block size. Runs are
+ * set and searched a 64-bit word at a time; metadata ranges are also kept
+ * as a short merged list so the ext4 allocator can leave them out.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem_tracker.h"
+#include "usage_map.h"
+
+static size_t usage_map_bytes(const struct usage_map *um) {
+  return (size_t)((um->granules + 63) / 64) * sizeof(uint64_t);
+}
+
+int usage_map_init(struct usage_map *um, uint64_t device_size,
+                   uint32_t granule) {
+  memset(um, 0, sizeof(*um));
+  if (granule == 0)
+    granule = 4096;
+  if (granule & (granule - 1))
+    return -1;
+
+  um->granule = granule;
+  um->granule_shift = (uint32_t)__builtin_ctz(granule);
+  um->granules = (device_size + granule - 1) >> um->granule_shift;
+  um->bits = calloc(1, usage_map_bytes(um) ? usage_map_bytes(um) : 8);
+  if (!um->bits) {
+    fprintf(stderr, "btrfs2ext4: OOM allocating device usage map\n");
+    return -1;
+  }
+  mem_track_alloc_tag(MEM_TAG_USAGE_MAP, usage_map_bytes(um));
+  return 0;
+}
+
+void usage_map_free(struct usage_map *um) {
+  if (um->bits)
+    mem_track_free_tag(MEM_TAG_USAGE_MAP, usage_map_bytes(um));
+  free(um->bits);
+  free(um->meta);
+  memset(um, 0, sizeof(*um));
+}
+
+/* Set or clear granules [g, g + n) */
+static void usage_bits_set(uint64_t *bits, uint64_t g, uint64_t n, int used) {
+  uint64_t end = g + n;
+  while (g < end) {
+    uint64_t span = 64 - g % 64;
+    if (span > end - g)
+      span = end - g;
+    uint64_t mask = span == 64 ? ~0ULL : ((1ULL << span) - 1) << (g % 64);
+    if (used)
+      bits[g / 64] |= mask;
+    else
+      bits[g / 64] &= ~mask;
+    g += span;
+  }
+}
+
+void usage_map_set(struct usage_map *um, uint64_t phys, uint64_t len,
+                   int used) {
+  if (!um->bits || len == 0)
+    return;
+  uint64_t first = phys >> um->granule_shift;
+  uint64_t last = (phys + len + um->granule - 1) >> um->granule_shift;
+  if (first >= um->granules)
+    return;
+  if (last > um->granules)
+    last = um->granules;
+  usage_bits_set(um->bits, first, last - first, used);
+}
+
+int usage_map_add_meta(struct usage_map *um, uint64_t phys, uint64_t len) {
+  if (len == 0)
+    return 0;
+  usage_map_set(um, phys, len, 1);
+
+  /* Tree blocks of one chunk tend to arrive together: extend the last */
+  if (um->meta_count > 0) {
+    struct usage_range *last = &um->meta[um->meta_count - 1];
+    if (phys >= last->start && phys <= last->end) {
+      if (phys + len > last->end)
+        last->end = phys + len;
+      return 0;
+    }
+  }
+  if (um->meta_count >= um->meta_capacity) {
+    uint32_t new_cap = um->meta_capacity ? um->meta_capacity * 2 : 256;
+    struct usage_range *grown = realloc(um->meta, new_cap * sizeof(*grown));
+    if (!grown) {
+      fprintf(stderr, "btrfs2ext4: OOM growing metadata usage list\n");
+      return -1;
+    }
+    um->meta = grown;
+    um->meta_capacity = new_cap;
+  }
+  um->meta[um->meta_count].start = phys;
+  um->meta[um->meta_count].end = phys + len;
+  um->meta_count++;
+  return 0;
+}
+
+static int cmp_usage_range(const void *a, const void *b) {
+  const struct usage_range *ra = a;
+  const struct usage_range *rb = b;
+  if (ra->start < rb->start)
+    return -1;
+  if (ra->start > rb->start)
+    return 1;
+  return 0;
+}
+
+void usage_map_finish(struct usage_map *um) {
+  if (um->meta_count < 2)
+    return;
+  qsort(um->meta, um->meta_count, sizeof(struct usage_range),
+        cmp_usage_range);
+  uint32_t out = 0;
+  for (uint32_t i = 1; i < um->meta_count; i++) {
+    if (um->meta[i].start <= um->meta[out].end) {
+      if (um->meta[i].end > um->meta[out].end)
+        um->meta[out].end = um->meta[i].end;
+    } else {
+      um->meta[++out] = um->meta[i];
+    }
+  }
+  um->meta_count = out + 1;
+}
+
+uint64_t usage_map_next(const struct usage_map *um, uint64_t phys, int used) {
+  uint64_t end = um->granules;
+  uint64_t g = phys >> um->granule_shift;
+  while (g < end) {
+    uint64_t w = um->bits[g / 64];
+    if (!used)
+      w = ~w;
+    w &= ~0ULL << (g % 64);
+    if (w) {
+      uint64_t hit = (g & ~63ULL) + (uint64_t)__builtin_ctzll(w);
+      if (hit > end)
+        hit = end;
+      return hit << um->granule_shift;
+    }
+    g = (g & ~63ULL) + 64;
+  }
+  return end << um->granule_shift;
+}
+
+int usage_map_test(const struct usage_map *um, uint64_t phys, uint64_t len) {
+  if (!um->bits || len == 0)
+    return 0;
+  uint64_t hit = usage_map_next(um, phys, 1);
+  return hit < phys + len;
+}
+
+/* Set bits [start, end) of a byte bitmap */
+static void byte_bitmap_set(uint8_t *bitmap, uint64_t start, uint64_t end) {
+  uint64_t b = start;
+  for (; b < end && b % 8; b++)
+    bitmap[b / 8] |= (uint8_t)(1 << (b % 8));
+  if (end - b >= 8) {
+    memset(bitmap + b / 8, 0xFF, (end - b) / 8);
+    b += (end - b) & ~7ULL;
+  }
+  for (; b < end; b++)
+    bitmap[b / 8] |= (uint8_t)(1 << (b % 8));
+}
+
+void usage_map_mark_data(const struct usage_map *um, uint8_t *bitmap,
+                         uint32_t block_size, uint64_t total_blocks) {
+  if (!um->bits)
+    return;
+  uint64_t limit = um->granules << um->granule_shift;
+  uint32_t m = 0;
+  uint64_t pos = 0;
+
+  while (pos < limit) {
+    uint64_t s = usage_map_next(um, pos, 1);
+    if (s >= limit)
+      break;
+    uint64_t e = usage_map_next(um, s, 0);
+
+    /* [s, e) is in use: keep the parts no metadata range covers */
+    uint64_t cur = s;
+    while (cur < e) {
+      while (m < um->meta_count && um->meta[m].end <= cur)
+        m++;
+      if (m < um->meta_count && um->meta[m].start <= cur) {
+        cur = um->meta[m].end;
+        continue;
+      }
+      uint64_t stop = e;
+      if (m < um->meta_count && um->meta[m].start < e)
+        stop = um->meta[m].start;
+      uint64_t first = cur / block_size;
+      uint64_t last = (stop + block_size - 1) / block_size;
+      if (last > total_blocks)
+        last = total_blocks;
+      if (first < last)
+        byte_bitmap_set(bitmap, first, last);
+      cur = stop;
+    }
+    pos = e;
+  }
+}
@@ -0,0 +1,903 @@
+/*
+ * bench_btrfs2ext4.c — Microbenchmarks for the converter's hot kernels
+ *
+ * Every input is generated from a fixed seed, so two builds run exactly
+ * the same work and their numbers can be compared. Each benchmark is
+ * calibrated until one sample takes at least --min-ms, then sampled
+ * --repeat times; the fastest sample is reported as ns/op and, where a
+ * byte count is meaningful, GB/s.
+ *
+ * Usage: bench_btrfs2ext4 [--json] [--quick] [--filter SUBSTR]
+ *                         [--repeat N] [--min-ms N]
+ *
+ * --json prints one JSON object (on stdout) for diffing between releases.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef HAVE_LZO
+#include <lzo/lzo1x.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "btrfs/btrfs_reader.h"
+#include "btrfs/btrfs_structures.h"
+#include "btrfs/checksum.h"
+#include "btrfs/chunk_tree.h"
+#include "btrfs/decompress.h"
+#include "device_io.h"
+#include "ext4/ext4_planner.h"
+#include "ext4/ext4_structures.h"
+#include "ext4/ext4_writer.h"
+
+#define BENCH_SEED 0x62327e34626e6368ULL
+#define BENCH_MAX_RESULTS 64
+
+struct bench_result {
+  const char *name;
+  double ns_per_op;
+  double gb_per_s; /* 0 when the benchmark has no byte count */
+  uint64_t ops;    /* operations in the reported sample */
+};
+
+static struct {
+  int json;
+  int quick;
+  const char *filter;
+  uint32_t repeat;
+  double min_sample; /* seconds */
+  char workdir[64];
+} g_opt = {0, 0, NULL, 5, 0.05, ""};
+
+static struct bench_result g_results[BENCH_MAX_RESULTS];
+static unsigned g_nresults;
+static volatile uint64_t g_sink; /* keeps results alive */
+
+/* Runs `iters` iterations; the return value is folded into g_sink */
+typedef uint64_t (*bench_body)(void *ctx, uint64_t iters);
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static uint64_t rng_next(uint64_t *s) {
+  /* xorshift64* */
+  uint64_t x = *s;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *s = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+static int bench_enabled(const char *name) {
+  return !g_opt.filter || strstr(name, g_opt.filter) != NULL;
+}
+
+/* Library writers print progress; keep it out of the report */
+static int quiet_begin(void) {
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  int null = open("/dev/null", O_WRONLY);
+  if (null >= 0) {
+    dup2(null, STDOUT_FILENO);
+    close(null);
+  }
+  return saved;
+}
+
+static void quiet_end(int saved) {
+  fflush(stdout);
+  if (saved >= 0) {
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+  }
+}
+
+/*
+ * Time `body`. One iteration performs `ops_per_iter` operations over
+ * `bytes_per_iter` bytes.
+ */
+static void bench_run(const char *name, bench_body body, void *ctx,
+                      uint64_t ops_per_iter, uint64_t bytes_per_iter) {
+  if (g_nresults >= BENCH_MAX_RESULTS)
+    return;
+
+  /* Calibrate: grow the iteration count until a sample is long enough */
+  uint64_t iters = 1;
+  double dt;
+  for (;;) {
+    double t0 = now_sec();
+    g_sink ^= body(ctx, iters);
+    dt = now_sec() - t0;
+    if (dt >= g_opt.min_sample || iters >= (1ULL << 40))
+      break;
+    double scale = dt > 0 ? g_opt.min_sample / dt * 1.2 : 100.0;
+    if (scale < 2.0)
+      scale = 2.0;
+    if (scale > 100.0)
+      scale = 100.0;
+    iters = (uint64_t)((double)iters * scale);
+  }
+
+  double best = dt;
+  for (uint32_t r = 0; r < g_opt.repeat; r++) {
+    double t0 = now_sec();
+    g_sink ^= body(ctx, iters);
+    dt = now_sec() - t0;
+    if (dt < best)
+      best = dt;
+  }
+
+  struct bench_result *res = &g_results[g_nresults++];
+  res->name = name;
+  res->ops = iters * ops_per_iter;
+  res->ns_per_op = best * 1e9 / (double)res->ops;
+  res->gb_per_s =
+      bytes_per_iter ? (double)(iters * bytes_per_iter) / best / 1e9 : 0.0;
+
+  if (!g_opt.json) {
+    if (res->gb_per_s > 0)
+      printf("  %-28s %12.2f ns/op %9.3f GB/s\n", name, res->ns_per_op,
+             res->gb_per_s);
+    else
+      printf("  %-28s %12.2f ns/op\n", name, res->ns_per_op);
+  }
+}
+
+/* ========================================================================
+ * Checksums
+ * ======================================================================== */
+
+struct crc_ctx {
+  uint8_t buf[65536];
+  size_t len;
+  uint32_t (*fn)(uint32_t, const void *, size_t);
+};
+
+static uint64_t crc_body(void *arg, uint64_t iters) {
+  struct crc_ctx *c = arg;
+  uint32_t crc = ~0U;
+  for (uint64_t i = 0; i < iters; i++)
+    crc = c->fn(crc, c->buf, c->len);
+  return crc;
+}
+
+static void bench_crc32c(void) {
+  static const struct {
+    const char *name;
+    size_t len;
+    int sw;
+  } cases[] = {
+      {"crc32c_4k", 4096, 0},
+      {"crc32c_64k", 65536, 0},
+      {"crc32c_sw_4k", 4096, 1},
+  };
+  struct crc_ctx *c = malloc(sizeof(*c));
+  if (!c)
+    return;
+  uint64_t seed = BENCH_SEED;
+  for (size_t i = 0; i < sizeof(c->buf); i++)
+    c->buf[i] = (uint8_t)rng_next(&seed);
+
+  for (size_t k = 0; k < sizeof(cases) / sizeof(cases[0]); k++) {
+    if (!bench_enabled(cases[k].name))
+      continue;
+    c->len = cases[k].len;
+    c->fn = cases[k].sw ? btrfs_crc32c_sw : btrfs_crc32c;
+    bench_run(cases[k].name, crc_body, c, 1, c->len);
+  }
+  free(c);
+}
+
+/* ========================================================================
+ * Bloom filter
+ * ======================================================================== */
+
+#define BLOOM_ITEMS (1u << 20)
+
+struct bloom_ctx {
+  struct bloom_filter bf;
+  uint64_t *keys; /* BLOOM_ITEMS present, then BLOOM_ITEMS absent */
+  uint64_t pos;
+};
+
+static uint64_t bloom_add_body(void *arg, uint64_t iters) {
+  struct bloom_ctx *c = arg;
+  for (uint64_t i = 0; i < iters; i++)
+    bloom_add(&c->bf, c->keys[c->pos++ & (BLOOM_ITEMS - 1)]);
+  return c->pos;
+}
+
+static uint64_t bloom_test_body(void *arg, uint64_t iters) {
+  struct bloom_ctx *c = arg;
+  uint64_t hits = 0;
+  for (uint64_t i = 0; i < iters; i++)
+    hits += (uint64_t)bloom_test(&c->bf,
+                                 c->keys[c->pos++ & (2 * BLOOM_ITEMS - 1)]);
+  return hits;
+}
+
+/* Batches of 64, as the directory builder resolves its children */
+static uint64_t bloom_batch_body(void *arg, uint64_t iters) {
+  struct bloom_ctx *c = arg;
+  uint8_t out[64];
+  uint64_t hits = 0;
+  for (uint64_t i = 0; i < iters; i += 64) {
+    uint32_t n = iters - i < 64 ? (uint32_t)(iters - i) : 64;
+    c->pos &= 2 * BLOOM_ITEMS - 1;
+    hits += bloom_test_batch(&c->bf, c->keys + c->pos, n, out);
+    c->pos = (c->pos + 64) & (2 * BLOOM_ITEMS - 1);
+  }
+  return hits;
+}
+
+static void bench_bloom(void) {
+  if (!bench_enabled("bloom_add") && !bench_enabled("bloom_test") &&
+      !bench_enabled("bloom_test_batch"))
+    return;
+
+  struct bloom_ctx c;
+  memset(&c, 0, sizeof(c));
+  c.keys = malloc(2 * BLOOM_ITEMS * sizeof(uint64_t));
+  if (!c.keys || bloom_init(&c.bf, BLOOM_ITEMS) < 0) {
+    free(c.keys);
+    return;
+  }
+  uint64_t seed = BENCH_SEED ^ 1;
+  for (uint32_t i = 0; i < 2 * BLOOM_ITEMS; i++)
+    c.keys[i] = 256 + (rng_next(&seed) >> 24);
+
+  if (bench_enabled("bloom_add"))
+    bench_run("bloom_add", bloom_add_body, &c, 1, 0);
+  for (uint32_t i = 0; i < BLOOM_ITEMS; i++)
+    bloom_add(&c.bf, c.keys[i]);
+  c.pos = 0;
+  if (bench_enabled("bloom_test"))
+    bench_run("bloom_test", bloom_test_body, &c, 1, 0);
+  c.pos = 0;
+  if (bench_enabled("bloom_test_batch"))
+    bench_run("bloom_test_batch", bloom_batch_body, &c, 1, 0);
+
+  bloom_free(&c.bf);
+  free(c.keys);
+}
+
+/* ========================================================================
+ * Inode map
+ * ======================================================================== */
+
+struct imap_ctx {
+  struct inode_map map;
+  uint64_t *probe;
+  uint32_t nprobe; /* power of two */
+  uint64_t pos;
+};
+
+static uint64_t imap_body(void *arg, uint64_t iters) {
+  struct imap_ctx *c = arg;
+  uint64_t sum = 0;
+  for (uint64_t i = 0; i < iters; i++)
+    sum += inode_map_lookup(&c->map, c->probe[c->pos++ & (c->nprobe - 1)]);
+  return sum;
+}
+
+static void bench_inode_map_mode(const char *name, uint64_t threshold,
+                                 uint32_t stride) {
+  if (!bench_enabled(name))
+    return;
+
+  uint32_t count = g_opt.quick ? 1u << 16 : 1u << 20;
+  struct adaptive_mem_config cfg;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.mmap_threshold = threshold;
+  cfg.workdir = g_opt.workdir;
+
+  struct imap_ctx c;
+  memset(&c, 0, sizeof(c));
+  c.map.mem_cfg = &cfg;
+  c.nprobe = 1u << 16;
+  c.probe = malloc(c.nprobe * sizeof(uint64_t));
+  if (!c.probe)
+    return;
+
+  /* Gaps between btrfs objectids, as left by deleted files */
+  uint64_t seed = BENCH_SEED ^ 2;
+  for (uint32_t i = 0; i < count; i++) {
+    if (inode_map_add(&c.map, 256 + (uint64_t)i * stride,
+                      EXT4_GOOD_OLD_FIRST_INO + i) < 0) {
+      fprintf(stderr, "bench: inode_map_add failed (%s)\n", name);
+      inode_map_free(&c.map);
+      free(c.probe);
+      return;
+    }
+  }
+  inode_map_build_hash(&c.map);
+  for (uint32_t i = 0; i < c.nprobe; i++)
+    c.probe[i] = 256 + (rng_next(&seed) % count) * stride;
+
+  bench_run(name, imap_body, &c, 1, 0);
+  inode_map_free(&c.map);
+  free(c.probe);
+}
+
+static void bench_inode_map(void) {
+  /* Stride 3 is dense enough for the direct index, 16 is not */
+  bench_inode_map_mode("inode_map_lookup_ram", 1ULL << 40, 3);
+  bench_inode_map_mode("inode_map_lookup_mmap", 1ULL << 20, 3);
+  bench_inode_map_mode("inode_map_lookup_sparse", 1ULL << 40, 16);
+}
+
+/* ========================================================================
+ * Pass 1 inode ingestion
+ * ======================================================================== */
+
+#define INGEST_ITEMS 4 /* INODE_ITEM, INODE_REF, XATTR, EXTENT_DATA */
+
+struct ingest_ctx {
+  int sorted;
+  uint32_t count;
+};
+
+/* Build an inode table the way a key-order FS-tree walk does */
+static uint64_t ingest_body(void *arg, uint64_t iters) {
+  struct ingest_ctx *c = arg;
+  uint64_t sum = 0;
+  for (uint64_t it = 0; it < iters; it++) {
+    struct btrfs_fs_info fs;
+    memset(&fs, 0, sizeof(fs));
+    fs.use_hash = 1;
+    fs.sorted_append = c->sorted;
+    for (uint32_t i = 0; i < c->count; i++) {
+      for (uint32_t k = 0; k < INGEST_ITEMS; k++) {
+        struct file_entry *fe = btrfs_get_inode(&fs, 256 + (uint64_t)i * 2);
+        sum += fe ? fe->ino : 0;
+      }
+    }
+    btrfs_resolve_links(&fs);
+    btrfs_free_fs(&fs);
+  }
+  return sum;
+}
+
+static void bench_ingest(void) {
+  static const struct {
+    const char *name;
+    int sorted;
+  } cases[] = {
+      {"pass1_ingest_sorted", 1},
+      {"pass1_ingest_hashed", 0},
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    if (!bench_enabled(cases[i].name))
+      continue;
+    struct ingest_ctx c = {cases[i].sorted,
+                           g_opt.quick ? 1u << 16 : 1u << 20};
+    bench_run(cases[i].name, ingest_body, &c, (uint64_t)c.count * INGEST_ITEMS,
+              0);
+  }
+}
+
+/* ========================================================================
+ * Chunk map
+ * ======================================================================== */
+
+#define CHUNK_COUNT 4096
+#define CHUNK_PROBES (1u << 16)
+
+struct chunk_ctx {
+  struct chunk_map map;
+  uint64_t probe[CHUNK_PROBES];
+  uint64_t pos;
+};
+
+static uint64_t chunk_body(void *arg, uint64_t iters) {
+  struct chunk_ctx *c = arg;
+  uint64_t sum = 0;
+  for (uint64_t i = 0; i < iters; i++)
+    sum += chunk_map_resolve(&c->map, c->probe[c->pos++ & (CHUNK_PROBES - 1)]);
+  return sum;
+}
+
+static void bench_chunk_map(void) {
+  if (!bench_enabled("chunk_map_resolve"))
+    return;
+
+  struct chunk_ctx *c = calloc(1, sizeof(*c));
+  if (!c)
+    return;
+  c->map.capacity = CHUNK_COUNT;
+  c->map.entries = calloc(CHUNK_COUNT, sizeof(struct chunk_mapping));
+  if (!c->map.entries) {
+    free(c);
+    return;
+  }
+  /* 1 GiB data chunks, 256 MiB apart, scattered physically */
+  for (uint32_t i = 0; i < CHUNK_COUNT; i++) {
+    c->map.entries[i].logical = (1ULL << 30) + (uint64_t)i * (1280ULL << 20);
+    c->map.entries[i].physical =
+        (uint64_t)((i * 2654435761u) % CHUNK_COUNT) << 30;
+    c->map.entries[i].length = 1ULL << 30;
+  }
+  c->map.count = CHUNK_COUNT;
+  chunk_map_build_resolver(&c->map);
+
+  uint64_t seed = BENCH_SEED ^ 3;
+  for (uint32_t i = 0; i < CHUNK_PROBES; i++) {
+    const struct chunk_mapping *m = &c->map.entries[rng_next(&seed) %
+                                                    CHUNK_COUNT];
+    c->probe[i] = m->logical + (rng_next(&seed) % m->length & ~4095ULL);
+  }
+
+  bench_run("chunk_map_resolve", chunk_body, c, 1, 0);
+  chunk_map_free(&c->map);
+  free(c);
+}
+
+/* ========================================================================
+ * Block allocator
+ * ======================================================================== */
+
+struct alloc_ctx {
+  struct ext4_layout layout;
+  struct ext4_block_allocator alloc;
+};
+
+static uint64_t alloc_body(void *arg, uint64_t iters) {
+  struct alloc_ctx *c = arg;
+  uint64_t sum = 0;
+  for (uint64_t i = 0; i < iters; i++) {
+    uint64_t b = ext4_alloc_block(&c->alloc, &c->layout);
+    if (b == (uint64_t)-1) {
+      ext4_block_alloc_free(&c->alloc);
+      ext4_block_alloc_init(&c->alloc, &c->layout);
+      b = ext4_alloc_block(&c->alloc, &c->layout);
+    }
+    sum += b;
+  }
+  return sum;
+}
+
+static void bench_alloc(void) {
+  if (!bench_enabled("ext4_alloc_block"))
+    return;
+
+  struct alloc_ctx c;
+  memset(&c, 0, sizeof(c));
+  int saved = quiet_begin();
+  int rc = ext4_plan_layout(&c.layout, 64ULL << 30, 4096, 16384, NULL);
+  quiet_end(saved);
+  if (rc < 0) {
+    fprintf(stderr, "bench: layout planning failed\n");
+    return;
+  }
+  ext4_block_alloc_init(&c.alloc, &c.layout);
+  bench_run("ext4_alloc_block", alloc_body, &c, 1, 0);
+  ext4_block_alloc_free(&c.alloc);
+  ext4_free_layout(&c.layout);
+}
+
+/* ========================================================================
+ * Directories: hash and packing
+ * ======================================================================== */
+
+#define HASH_NAMES 4096
+
+struct hash_ctx {
+  char names[HASH_NAMES][48];
+  uint8_t lens[HASH_NAMES];
+  uint64_t bytes;
+  uint64_t pos;
+};
+
+static uint64_t hash_body(void *arg, uint64_t iters) {
+  struct hash_ctx *c = arg;
+  uint64_t sum = 0;
+  for (uint64_t i = 0; i < iters; i++) {
+    uint32_t k = (uint32_t)(c->pos++ & (HASH_NAMES - 1));
+    sum += ext4_legacy_hash(c->names[k], c->lens[k]);
+  }
+  return sum;
+}
+
+static void bench_dir_hash(void) {
+  if (!bench_enabled("ext4_legacy_hash"))
+    return;
+
+  struct hash_ctx *c = calloc(1, sizeof(*c));
+  if (!c)
+    return;
+  uint64_t seed = BENCH_SEED ^ 4;
+  for (uint32_t i = 0; i < HASH_NAMES; i++) {
+    c->lens[i] = (uint8_t)(8 + rng_next(&seed) % 33);
+    for (uint8_t k = 0; k < c->lens[i]; k++)
+      c->names[i][k] = (char)('a' + rng_next(&seed) % 26);
+    c->bytes += c->lens[i];
+  }
+  bench_run("ext4_legacy_hash", hash_body, c, 1, c->bytes / HASH_NAMES);
+  free(c);
+}
+
+struct dirpack_ctx {
+  struct device dev;
+  struct ext4_layout layout;
+  struct btrfs_fs_info fs;
+  struct inode_map imap;
+  struct file_entry *entries;
+};
+
+static uint64_t dirpack_body(void *arg, uint64_t iters) {
+  struct dirpack_ctx *c = arg;
+  uint64_t sum = 0;
+  int saved = quiet_begin();
+  for (uint64_t i = 0; i < iters; i++) {
+    struct ext4_block_allocator alloc;
+    ext4_block_alloc_init(&alloc, &c->layout);
+    if (ext4_write_directories(&c->dev, &c->layout, &c->fs, &c->imap,
+                               &alloc) == 0)
+      sum++;
+    ext4_block_alloc_free(&alloc);
+  }
+  quiet_end(saved);
+  return sum;
+}
+
+static void bench_dir_pack(void) {
+  if (!bench_enabled("dir_pack"))
+    return;
+
+  uint32_t nchild = g_opt.quick ? 2000 : 20000;
+  uint64_t size = 256ULL << 20;
+  char path[128];
+  snprintf(path, sizeof(path), "%s/dirpack.img", g_opt.workdir);
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0 || ftruncate(fd, (off_t)size) < 0) {
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  close(fd);
+
+  struct dirpack_ctx *c = calloc(1, sizeof(*c));
+  if (!c || device_open(&c->dev, path, 0) < 0) {
+    free(c);
+    unlink(path);
+    return;
+  }
+  int saved = quiet_begin();
+  int rc = ext4_plan_layout(&c->layout, size, 4096, 16384, NULL);
+  quiet_end(saved);
+  if (rc < 0)
+    goto out;
+
+  c->entries = calloc(nchild + 1, sizeof(struct file_entry));
+  c->fs.inode_table = calloc(nchild + 1, sizeof(struct file_entry *));
+  struct file_entry *root = c->entries;
+  if (!c->entries || !c->fs.inode_table)
+    goto out;
+  root->children = calloc(nchild, sizeof(struct dir_entry_link));
+  if (!root->children)
+    goto out;
+  root->ino = 256;
+  root->mode = S_IFDIR | 0755;
+  root->nlink = 2;
+  root->child_count = root->child_capacity = nchild;
+  c->fs.root_dir = root;
+  c->fs.inode_table[0] = root;
+  c->fs.inode_count = nchild + 1;
+  inode_map_add(&c->imap, 256, EXT4_ROOT_INO);
+
+  uint64_t seed = BENCH_SEED ^ 5;
+  for (uint32_t i = 0; i < nchild; i++) {
+    struct file_entry *fe = &c->entries[i + 1];
+    fe->ino = 257 + i;
+    fe->mode = S_IFREG | 0644;
+    fe->nlink = 1;
+    fe->parent_ino = 256;
+    c->fs.inode_table[i + 1] = fe;
+    inode_map_add(&c->imap, fe->ino, EXT4_GOOD_OLD_FIRST_INO + i);
+
+    char name[64];
+    int len = snprintf(name, sizeof(name), "file_%08lx_%u.dat",
+                       (unsigned long)(rng_next(&seed) >> 32), i);
+    struct dir_entry_link *link = &root->children[i];
+    link->target = fe;
+    link->name_len = (uint16_t)len;
+    link->name_off = btrfs_intern_name(&c->fs, name, (uint16_t)len);
+  }
+
+  /* One operation is one directory entry hashed, sorted and packed */
+  bench_run("dir_pack", dirpack_body, c, nchild, 0);
+
+out:
+  inode_map_free(&c->imap);
+  if (c->entries)
+    free(c->entries[0].children);
+  free(c->entries);
+  free(c->fs.inode_table);
+  str_pool_free(&c->fs.names);
+  ext4_free_layout(&c->layout);
+  device_close(&c->dev);
+  free(c);
+  unlink(path);
+}
+
+/* ========================================================================
+ * Decompression, per codec
+ * ======================================================================== */
+
+#define DECOMP_RAM (128 * 1024) /* BTRFS_MAX_COMPRESSED */
+#define DECOMP_PHYS (1024 * 1024)
+
+struct decomp_ctx {
+  struct device dev;
+  struct chunk_mapping cm;
+  struct chunk_map map;
+  struct file_extent ext;
+  uint8_t window[BTRFS_DECOMP_WINDOW];
+};
+
+static int decomp_discard(const uint8_t *data, size_t len, uint64_t offset,
+                          void *arg) {
+  (void)offset;
+  *(uint64_t *)arg += data[len - 1];
+  return 0;
+}
+
+static uint64_t decomp_body(void *arg, uint64_t iters) {
+  struct decomp_ctx *c = arg;
+  uint64_t sum = 0;
+  for (uint64_t i = 0; i < iters; i++) {
+    uint64_t out_len = 0;
+    if (btrfs_decompress_extent_stream(&c->dev, &c->map, &c->ext, 4096,
+                                       c->window, sizeof(c->window),
+                                       decomp_discard, &sum, &out_len) < 0)
+      return sum;
+    sum += out_len;
+  }
+  return sum;
+}
+
+/* Text-like input: compresses about as well as typical file data */
+static void decomp_fill(uint8_t *buf, size_t len) {
+  static const char *const words[] = {
+      "btrfs", "extent", "inode ", "the ",  "block", "\n",
+      "group", "data ",  "0x1f",   "tree ", "leaf ", "key "};
+  uint64_t seed = BENCH_SEED ^ 6;
+  size_t pos = 0;
+  while (pos < len) {
+    const char *w = words[rng_next(&seed) % 12];
+    size_t n = strlen(w);
+    if (n > len - pos)
+      n = len - pos;
+    memcpy(buf + pos, w, n);
+    pos += n;
+  }
+}
+
+static size_t compress_zlib(const uint8_t *in, size_t len, uint8_t *out,
+                            size_t cap) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, 3, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return 0;
+  zs.next_in = (uint8_t *)in;
+  zs.avail_in = (uInt)len;
+  zs.next_out = out;
+  zs.avail_out = (uInt)cap;
+  int r = deflate(&zs, Z_FINISH);
+  size_t n = zs.total_out;
+  deflateEnd(&zs);
+  return r == Z_STREAM_END ? n : 0;
+}
+
+#ifdef HAVE_LZO
+/* Btrfs framing: total length, then a length-prefixed segment per page */
+static size_t compress_lzo(const uint8_t *in, size_t len, uint8_t *out,
+                           size_t cap) {
+  static uint8_t wrkmem[LZO1X_1_MEM_COMPRESS];
+  if (lzo_init() != LZO_E_OK)
+    return 0;
+  size_t pos = 4;
+  for (size_t off = 0; off < len; off += 4096) {
+    size_t n = len - off < 4096 ? len - off : 4096;
+    if (pos + 4 + n + n / 16 + 64 + 3 > cap)
+      return 0;
+    lzo_uint seg = 0;
+    if (lzo1x_1_compress(in + off, n, out + pos + 4, &seg, wrkmem) !=
+        LZO_E_OK)
+      return 0;
+    for (int b = 0; b < 4; b++)
+      out[pos + b] = (uint8_t)(seg >> (8 * b));
+    pos += 4 + seg;
+  }
+  for (int b = 0; b < 4; b++)
+    out[b] = (uint8_t)(pos >> (8 * b));
+  return pos;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static size_t compress_zstd(const uint8_t *in, size_t len, uint8_t *out,
+                            size_t cap) {
+  size_t n = ZSTD_compress(out, cap, in, len, 3);
+  return ZSTD_isError(n) ? 0 : n;
+}
+#endif
+
+static void bench_decompress_codec(const char *name, uint8_t type,
+                                   size_t (*compress)(const uint8_t *, size_t,
+                                                      uint8_t *, size_t)) {
+  if (!bench_enabled(name))
+    return;
+
+  char path[128];
+  snprintf(path, sizeof(path), "%s/decomp.img", g_opt.workdir);
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0 || ftruncate(fd, 4 << 20) < 0) {
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  close(fd);
+
+  struct decomp_ctx *c = calloc(1, sizeof(*c));
+  size_t cap = 2 * DECOMP_RAM;
+  uint8_t *plain = malloc(DECOMP_RAM);
+  uint8_t *comp = calloc(1, cap);
+  if (!c || !plain || !comp || device_open(&c->dev, path, 0) < 0) {
+    free(c);
+    free(plain);
+    free(comp);
+    unlink(path);
+    return;
+  }
+
+  decomp_fill(plain, DECOMP_RAM);
+  size_t clen = compress(plain, DECOMP_RAM, comp, cap);
+  uint64_t disk_len = (clen + 4095) & ~4095ULL;
+  if (clen == 0 || device_write(&c->dev, DECOMP_PHYS, comp, disk_len) < 0) {
+    fprintf(stderr, "bench: %s setup failed\n", name);
+    goto out;
+  }
+
+  /* Identity mapping: logical == physical */
+  c->cm.length = 4 << 20;
+  c->map.entries = &c->cm;
+  c->map.count = c->map.capacity = 1;
+  c->ext.type = BTRFS_FILE_EXTENT_REG;
+  c->ext.compression = type;
+  c->ext.disk_bytenr = DECOMP_PHYS;
+  c->ext.disk_num_bytes = disk_len;
+  c->ext.num_bytes = DECOMP_RAM;
+  c->ext.ram_bytes = DECOMP_RAM;
+
+  bench_run(name, decomp_body, c, 1, DECOMP_RAM);
+
+out:
+  device_close(&c->dev);
+  free(c);
+  free(plain);
+  free(comp);
+  unlink(path);
+}
+
+static void bench_decompress(void) {
+  bench_decompress_codec("decompress_zlib", BTRFS_COMPRESS_ZLIB,
+                         compress_zlib);
+#ifdef HAVE_LZO
+  bench_decompress_codec("decompress_lzo", BTRFS_COMPRESS_LZO, compress_lzo);
+#endif
+#ifdef HAVE_ZSTD
+  bench_decompress_codec("decompress_zstd", BTRFS_COMPRESS_ZSTD,
+                         compress_zstd);
+#endif
+}
+
+/* ======================================================================== */
+
+static void print_json(void) {
+  printf("{\"seed\": \"0x%016llx\", \"crc32c_impl\": \"%s\", \"quick\": %d, "
+         "\"results\": [",
+         (unsigned long long)BENCH_SEED, btrfs_crc32c_impl(), g_opt.quick);
+  for (unsigned i = 0; i < g_nresults; i++) {
+    const struct bench_result *r = &g_results[i];
+    printf("%s\n  {\"name\": \"%s\", \"ns_per_op\": %.3f, \"gb_per_s\": %.4f, "
+           "\"ops\": %lu}",
+           i ? "," : "", r->name, r->ns_per_op, r->gb_per_s,
+           (unsigned long)r->ops);
+  }
+  printf("\n]}\n");
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [--json] [--quick] [--filter SUBSTR] [--repeat N] "
+          "[--min-ms N]\n",
+          prog);
+}
+
+int main(int argc, char **argv) {
+  static struct option long_options[] = {
+      {"json", no_argument, NULL, 'J'},
+      {"quick", no_argument, NULL, 'q'},
+      {"filter", required_argument, NULL, 'f'},
+      {"repeat", required_argument, NULL, 'r'},
+      {"min-ms", required_argument, NULL, 'm'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0}};
+  int min_ms_set = 0;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "qf:r:m:h", long_options, NULL)) !=
+         -1) {
+    switch (opt) {
+    case 'J':
+      g_opt.json = 1;
+      break;
+    case 'q':
+      g_opt.quick = 1;
+      break;
+    case 'f':
+      g_opt.filter = optarg;
+      break;
+    case 'r':
+      g_opt.repeat = (uint32_t)atoi(optarg);
+      break;
+    case 'm':
+      g_opt.min_sample = atof(optarg) / 1000.0;
+      min_ms_set = 1;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (g_opt.quick) {
+    if (!min_ms_set)
+      g_opt.min_sample = 0.005;
+    if (g_opt.repeat > 2)
+      g_opt.repeat = 2;
+  }
+
+  snprintf(g_opt.workdir, sizeof(g_opt.workdir), "/tmp/b2e4_bench.XXXXXX");
+  if (!mkdtemp(g_opt.workdir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  if (!g_opt.json)
+    printf("btrfs2ext4 microbenchmarks (crc32c: %s, seed 0x%016llx)\n",
+           btrfs_crc32c_impl(), (unsigned long long)BENCH_SEED);
+
+  bench_crc32c();
+  bench_bloom();
+  bench_inode_map();
+  bench_ingest();
+  bench_chunk_map();
+  bench_alloc();
+  bench_dir_hash();
+  bench_dir_pack();
+  bench_decompress();
+
+  rmdir(g_opt.workdir);
+  if (g_opt.json)
+    print_json();
+  return 0;
+}
@@ -0,0 +1,117 @@
+#!/bin/bash
+# bench_e2e.sh - End-to-end scaling benchmark on synthetic Btrfs images
+#
+# For each inode count, builds an image with gen_btrfs_image, converts it
+# with btrfs2ext4 --stats=json and prints the wall time of every phase.
+# One JSON object per run is appended to the results file, so two builds
+# can be compared with any JSON diff tool. Images are sparse and removed
+# after each run unless --keep is given.
+#
+# Usage: tests/bench_e2e.sh [-b BUILD_DIR] [-w WORKDIR] [-o RESULTS]
+#                           [-s "10000 100000 1000000"] [--dry-run] [--keep]
+#                           [-- GENERATOR_OPTIONS...]
+#
+# Example: tests/bench_e2e.sh -s "100000 1000000" -- -F 1000 -f 40 -c zlib:30
+
+set -e
+
+BUILD_DIR=build
+WORKDIR=
+RESULTS=bench_e2e.jsonl
+SCALES="10000 100000 1000000"
+DRY_RUN=
+KEEP=0
+GEN_OPTS=()
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        -b) BUILD_DIR=$2; shift 2 ;;
+        -w) WORKDIR=$2; shift 2 ;;
+        -o) RESULTS=$2; shift 2 ;;
+        -s) SCALES=$2; shift 2 ;;
+        --dry-run) DRY_RUN=--dry-run; shift ;;
+        --keep) KEEP=1; shift ;;
+        --) shift; GEN_OPTS=("$@"); break ;;
+        -h|--help) sed -n '2,15p' "$0" | sed 's/^# \{0,1\}//'; exit 0 ;;
+        *) echo "bench_e2e.sh: unknown option $1" >&2; exit 1 ;;
+    esac
+done
+
+GEN="$BUILD_DIR/gen_btrfs_image"
+CONVERT="$BUILD_DIR/btrfs2ext4"
+for bin in "$GEN" "$CONVERT"; do
+    if [ ! -x "$bin" ]; then
+        echo "bench_e2e.sh: $bin not found; build first (cmake --build $BUILD_DIR)" >&2
+        exit 1
+    fi
+done
+
+if [ -z "$WORKDIR" ]; then
+    WORKDIR=$(mktemp -d "${TMPDIR:-/tmp}/b2e4_e2e.XXXXXX")
+    CLEAN_WORKDIR=1
+fi
+mkdir -p "$WORKDIR"
+
+now() { date +%s.%N; }
+elapsed() { awk -v a="$1" -v b="$2" 'BEGIN { printf "%.3f", b - a }'; }
+
+# Wall seconds of one phase from the --stats=json line
+phase_wall() {
+    local json=$1 phase=$2
+    echo "$json" | grep -o "\"name\": \"$phase\", \"wall_sec\": [0-9.]*" |
+        sed 's/.*: //'
+}
+
+run_scale() {
+    local inodes=$1
+    local img="$WORKDIR/e2e_$inodes.img"
+    local log="$WORKDIR/e2e_$inodes.log"
+
+    echo "=== $inodes inodes ==="
+    local t0 t1 t2
+    t0=$(now)
+    "$GEN" -q -n "$inodes" "${GEN_OPTS[@]}" "$img"
+    t1=$(now)
+
+    local rc=0
+    "$CONVERT" $DRY_RUN --stats=json -w "$WORKDIR" \
+        --mem-report "$WORKDIR/mem_$inodes.json" "$img" > "$log" 2>&1 || rc=$?
+    t2=$(now)
+
+    local stats mem
+    stats=$(grep '^{"phases"' "$log" | tail -n 1)
+    mem=$(cat "$WORKDIR/mem_$inodes.json" 2>/dev/null || true)
+    [ -n "$stats" ] || stats=null
+    [ -n "$mem" ] || mem=null
+
+    local gen_sec conv_sec
+    gen_sec=$(elapsed "$t0" "$t1")
+    conv_sec=$(elapsed "$t1" "$t2")
+    printf "  %-12s %8.2f s\n" generate "$gen_sec"
+    for phase in scan plan relocate metadata inode_tables directories journal; do
+        local w
+        w=$(phase_wall "$stats" "$phase")
+        [ -n "$w" ] && printf "  %-12s %8.2f s\n" "$phase" "$w"
+    done
+    printf "  %-12s %8.2f s (exit %d)\n" convert "$conv_sec" "$rc"
+    if [ "$rc" -ne 0 ]; then
+        echo "  conversion failed, log: $log"
+        KEEP=1
+    fi
+
+    printf '{"inodes": %s, "generator": "%s", "dry_run": %s, "exit": %d, "generate_sec": %s, "convert_sec": %s, "stats": %s, "memory": %s}\n' \
+        "$inodes" "${GEN_OPTS[*]}" "$([ -n "$DRY_RUN" ] && echo true || echo false)" \
+        "$rc" "$gen_sec" "$conv_sec" "$stats" "$(echo "$mem" | tr -d '\n')" >> "$RESULTS"
+
+    [ "$KEEP" -eq 1 ] || rm -f "$img" "$log" "$WORKDIR/mem_$inodes.json"
+    return 0
+}
+
+for n in $SCALES; do
+    run_scale "$n"
+done
+
+echo "Results appended to $RESULTS"
+if [ "${CLEAN_WORKDIR:-0}" -eq 1 ] && [ "$KEEP" -eq 0 ]; then
+    rmdir "$WORKDIR" 2>/dev/null || true
+fi
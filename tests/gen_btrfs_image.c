@@ -0,0 +1,1686 @@
+/*
+ * gen_btrfs_image.c — Synthetic Btrfs image generator for scaling benchmarks
+ *
+ * Writes a single-device Btrfs image straight into a sparse file, without
+ * mkfs.btrfs, a loop mount or root: chunk tree, root tree, FS tree and
+ * extent tree are packed bottom-up into checksummed 16 KiB nodes, and only
+ * compressed extents (and, with --fill, file data) are actually written.
+ * Everything is derived from --seed, so a given command line always
+ * produces the same image.
+ *
+ * The namespace is a complete tree: inode 256 + i is a directory when it
+ * has children, and the children of i are fanout*i+1 .. fanout*i+fanout.
+ * Regular files get exponentially distributed sizes around --file-size;
+ * small ones are inlined. --frag splits files into short extents and
+ * leaves gaps between them, --compress assigns files to codecs,
+ * --reflink makes files share earlier files' extents and --prealloc
+ * leaves files' extents preallocated (fallocate) and never written.
+ *
+ * The images carry what btrfs2ext4 reads (superblock and system chunk
+ * array, chunk, root, FS and extent trees with back-references); the
+ * device, checksum and free-space trees and block group items are left
+ * out, so the kernel will not mount them.
+ *
+ * Usage: gen_btrfs_image [options] IMAGE   (see --help)
+ */
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef HAVE_LZO
+#include <lzo/lzo1x.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "btrfs/btrfs_structures.h"
+#include "btrfs/checksum.h"
+
+#define GEN_SECTOR 4096u
+#define GEN_SYS_START (1ULL << 20) /* system chunk, logical == physical */
+#define GEN_SYS_LEN (4ULL << 20)
+#define GEN_LOGICAL_START (16ULL << 20)
+#define GEN_META_CHUNK (256ULL << 20)
+#define GEN_DATA_CHUNK (1ULL << 30)
+#define GEN_MAX_EXTENT (128ULL << 20)    /* uncompressed extent cap */
+#define GEN_MAX_COMPRESSED (128u * 1024) /* compressed extent cap */
+#define GEN_MAX_INLINE 2048u
+#define GEN_WBUF (4u << 20)
+#define GEN_TIME_BASE 1700000000LL
+
+#define GEN_DEV_ITEMS_OBJECTID 1ULL
+#define GEN_HEADER_FLAG_WRITTEN (1ULL << 0)
+#define GEN_MIXED_BACKREF_REV (1ULL << 56)
+#define GEN_INCOMPAT_MIXED_BACKREF (1ULL << 0)
+#define GEN_INCOMPAT_COMPRESS_LZO (1ULL << 3)
+#define GEN_INCOMPAT_COMPRESS_ZSTD (1ULL << 4)
+#define GEN_INCOMPAT_BIG_METADATA (1ULL << 5)
+#define GEN_INCOMPAT_EXTENDED_IREF (1ULL << 6)
+#define GEN_INCOMPAT_SKINNY_METADATA (1ULL << 8)
+
+/* Inline back-reference payloads in extent items */
+#define GEN_DATA_ITEM_SIZE (sizeof(struct btrfs_extent_item) + 1 + 28)
+#define GEN_META_ITEM_SIZE (sizeof(struct btrfs_extent_item) + 1 + 8)
+
+#define HDR_SIZE sizeof(struct btrfs_header)
+
+/* ========================================================================
+ * Parameters and state
+ * ======================================================================== */
+
+struct gen_params {
+  uint64_t inodes;
+  uint32_t fanout;
+  uint64_t file_size; /* mean */
+  uint32_t frag;      /* 0..100 */
+  uint32_t reflink;   /* 0..100 */
+  uint32_t prealloc;  /* 0..100 */
+  uint32_t codec_pct[4]; /* by BTRFS_COMPRESS_*; [0] unused */
+  uint32_t nodesize;
+  uint64_t size; /* 0 = fit the contents */
+  uint64_t seed;
+  int fill;
+  int quiet;
+};
+
+struct gen_chunk {
+  uint64_t logical;
+  uint64_t physical;
+  uint64_t length;
+  uint64_t type;
+};
+
+/* Bump allocator over the current chunk of one block group type */
+struct gen_space {
+  uint64_t type;
+  uint64_t chunk_len;
+  uint64_t chunk_logical;
+  uint64_t chunk_physical;
+  uint64_t cur; /* next free logical byte */
+  uint64_t end; /* end of the current chunk; cur == end forces a new one */
+};
+
+/* Coalesces sequential writes into large pwrites */
+struct gen_wbuf {
+  uint8_t *buf;
+  uint64_t start;
+  size_t len;
+};
+
+/* A data extent and its first reference */
+struct gen_extent {
+  uint64_t bytenr;
+  uint64_t owner;  /* inode of the first reference */
+  uint64_t offset; /* file offset of the first reference */
+  uint32_t disk_len;
+  uint32_t ram_len;
+  uint32_t refs;
+  uint8_t compression;
+  uint8_t prealloc; /* referenced as BTRFS_FILE_EXTENT_PREALLOC */
+};
+
+/* A tree block, for the extent tree's METADATA_ITEMs */
+struct gen_block {
+  uint64_t bytenr;
+  uint64_t physical;
+  uint64_t owner;
+  uint8_t level;
+};
+
+struct gen_template {
+  uint8_t *data;
+  uint32_t len; /* compressed bytes; disk length is this rounded up */
+};
+
+struct gen {
+  const struct gen_params *p;
+  int fd;
+  uint8_t fsid[BTRFS_FSID_SIZE];
+  uint8_t chunk_uuid[BTRFS_UUID_SIZE];
+  uint8_t dev_uuid[BTRFS_UUID_SIZE];
+  uint8_t fs_uuid[BTRFS_UUID_SIZE];
+
+  struct gen_chunk *chunks;
+  uint32_t nchunks;
+  uint32_t chunks_cap;
+  uint64_t phys_next;
+  uint64_t logical_next;
+  struct gen_space meta;
+  struct gen_space data;
+  struct gen_space sys;
+
+  struct gen_wbuf wmeta;
+  struct gen_wbuf wdata;
+
+  struct gen_extent *ext;
+  size_t next;
+  size_t ext_cap;
+  struct gen_block *blocks; /* FS and root tree blocks, allocation order */
+  size_t nblocks;
+  size_t blocks_cap;
+
+  struct gen_template tmpl[4][GEN_MAX_COMPRESSED / GEN_SECTOR + 1];
+  uint8_t *plain; /* text-like content behind every compressed extent */
+  uint8_t *pattern; /* --fill content */
+
+  /* Totals for the summary */
+  uint64_t dirs;
+  uint64_t files;
+  uint64_t inline_files;
+  uint64_t shared_refs;
+  uint64_t compressed;
+  uint64_t preallocated;
+  uint64_t data_bytes;
+  uint64_t expansion; /* decompressed minus on-disk bytes */
+  uint64_t incompat;
+};
+
+/* splitmix64: per-inode streams that do not depend on generation order */
+static uint64_t mix64(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+static uint64_t rng_next(uint64_t *s) {
+  *s += 0x9E3779B97F4A7C15ULL;
+  return mix64(*s);
+}
+
+static double rng_unit(uint64_t *s) {
+  return (double)(rng_next(s) >> 11) / 9007199254740992.0;
+}
+
+/* ========================================================================
+ * Output
+ * ======================================================================== */
+
+static int pwrite_all(int fd, const void *buf, size_t len, uint64_t off) {
+  const uint8_t *p = buf;
+  while (len > 0) {
+    ssize_t n = pwrite(fd, p, len, (off_t)off);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("pwrite");
+      return -1;
+    }
+    p += n;
+    len -= (size_t)n;
+    off += (uint64_t)n;
+  }
+  return 0;
+}
+
+static int wbuf_flush(struct gen *g, struct gen_wbuf *w) {
+  if (w->len == 0)
+    return 0;
+  int ret = pwrite_all(g->fd, w->buf, w->len, w->start);
+  w->len = 0;
+  return ret;
+}
+
+static int wbuf_write(struct gen *g, struct gen_wbuf *w, uint64_t phys,
+                      const void *data, size_t len) {
+  if (w->len && (phys != w->start + w->len || w->len + len > GEN_WBUF) &&
+      wbuf_flush(g, w) < 0)
+    return -1;
+  if (len > GEN_WBUF)
+    return pwrite_all(g->fd, data, len, phys);
+  if (w->len == 0)
+    w->start = phys;
+  memcpy(w->buf + w->len, data, len);
+  w->len += len;
+  return 0;
+}
+
+/* ========================================================================
+ * Chunks and allocation
+ * ======================================================================== */
+
+static int gen_add_chunk(struct gen *g, uint64_t logical, uint64_t physical,
+                         uint64_t length, uint64_t type) {
+  if (g->nchunks == g->chunks_cap) {
+    uint32_t cap = g->chunks_cap ? g->chunks_cap * 2 : 64;
+    struct gen_chunk *c = realloc(g->chunks, cap * sizeof(*c));
+    if (!c)
+      return -1;
+    g->chunks = c;
+    g->chunks_cap = cap;
+  }
+  g->chunks[g->nchunks++] =
+      (struct gen_chunk){logical, physical, length, type};
+  return 0;
+}
+
+/* Keep chunks clear of the superblock mirrors */
+static uint64_t gen_avoid_mirrors(uint64_t phys, uint64_t len) {
+  static const uint64_t mirrors[] = {BTRFS_SUPER_MIRROR_1,
+                                     BTRFS_SUPER_MIRROR_2};
+  for (size_t i = 0; i < sizeof(mirrors) / sizeof(mirrors[0]); i++) {
+    if (phys < mirrors[i] + BTRFS_SUPER_INFO_SIZE && phys + len > mirrors[i])
+      phys = mirrors[i] + (1ULL << 20);
+  }
+  return phys;
+}
+
+/* Allocate `len` logical bytes from `sp`, opening a new chunk if needed */
+static uint64_t gen_space_alloc(struct gen *g, struct gen_space *sp,
+                                uint64_t len) {
+  if (sp->cur + len > sp->end) {
+    if (sp->type & BTRFS_BLOCK_GROUP_SYSTEM) {
+      fprintf(stderr, "gen_btrfs_image: system chunk full\n");
+      return (uint64_t)-1;
+    }
+    uint64_t phys = gen_avoid_mirrors(g->phys_next, sp->chunk_len);
+    if (gen_add_chunk(g, g->logical_next, phys, sp->chunk_len, sp->type) < 0)
+      return (uint64_t)-1;
+    sp->chunk_logical = g->logical_next;
+    sp->chunk_physical = phys;
+    sp->cur = g->logical_next;
+    sp->end = g->logical_next + sp->chunk_len;
+    g->logical_next += sp->chunk_len;
+    g->phys_next = phys + sp->chunk_len;
+  }
+  uint64_t logical = sp->cur;
+  sp->cur += len;
+  return logical;
+}
+
+static uint64_t gen_space_phys(const struct gen_space *sp, uint64_t logical) {
+  return sp->chunk_physical + (logical - sp->chunk_logical);
+}
+
+/* ========================================================================
+ * Bottom-up B-tree builder
+ *
+ * Items must arrive in key order. Each level keeps one open node; a full
+ * node is sealed, written and linked into the level above, and
+ * tb_finish() closes the levels upwards until one node is left, the root.
+ * Nodes take their addresses from a chunk space, from a pre-reserved list
+ * or, in a dry run, from a counter, which is how the extent tree is sized
+ * before it is written.
+ * ======================================================================== */
+
+enum tb_mode { TB_SPACE, TB_RESERVED, TB_DRY };
+
+struct tree_builder {
+  struct gen *g;
+  uint64_t owner;
+  enum tb_mode mode;
+  struct gen_space *space;   /* TB_SPACE */
+  int record;                /* TB_SPACE: append blocks to g->blocks */
+  const struct gen_block *reserved; /* TB_RESERVED */
+  size_t nreserved;
+  uint64_t dry_next;         /* TB_DRY */
+  struct gen_block *out;     /* TB_DRY: blocks, allocation order */
+  size_t out_cap;
+
+  uint32_t nodesize;
+  uint8_t *node[BTRFS_MAX_LEVEL];
+  uint32_t nritems[BTRFS_MAX_LEVEL];
+  uint32_t leaf_data; /* payload bytes in the open leaf */
+  uint8_t height;     /* levels that have held entries */
+  size_t blocks;      /* nodes written */
+  uint64_t items;
+  uint64_t root;
+  uint8_t root_level;
+};
+
+static int tb_init(struct tree_builder *tb, struct gen *g, uint64_t owner,
+                   enum tb_mode mode) {
+  memset(tb, 0, sizeof(*tb));
+  tb->g = g;
+  tb->owner = owner;
+  tb->mode = mode;
+  tb->nodesize = g->p->nodesize;
+  tb->height = 1;
+  for (int l = 0; l < BTRFS_MAX_LEVEL; l++) {
+    tb->node[l] = calloc(1, tb->nodesize);
+    if (!tb->node[l])
+      return -1;
+  }
+  return 0;
+}
+
+static void tb_free(struct tree_builder *tb) {
+  for (int l = 0; l < BTRFS_MAX_LEVEL; l++)
+    free(tb->node[l]);
+  free(tb->out);
+}
+
+static int tb_next_block(struct tree_builder *tb, uint8_t level,
+                         uint64_t *logical, uint64_t *physical) {
+  struct gen *g = tb->g;
+  switch (tb->mode) {
+  case TB_SPACE:
+    *logical = gen_space_alloc(g, tb->space, tb->nodesize);
+    if (*logical == (uint64_t)-1)
+      return -1;
+    *physical = gen_space_phys(tb->space, *logical);
+    if (tb->record) {
+      if (g->nblocks == g->blocks_cap) {
+        size_t cap = g->blocks_cap ? g->blocks_cap * 2 : 4096;
+        struct gen_block *b = realloc(g->blocks, cap * sizeof(*b));
+        if (!b)
+          return -1;
+        g->blocks = b;
+        g->blocks_cap = cap;
+      }
+      g->blocks[g->nblocks++] =
+          (struct gen_block){*logical, *physical, tb->owner, level};
+    }
+    return 0;
+  case TB_RESERVED:
+    if (tb->blocks >= tb->nreserved) {
+      fprintf(stderr, "gen_btrfs_image: tree %lu outgrew its reservation\n",
+              (unsigned long)tb->owner);
+      return -1;
+    }
+    *logical = tb->reserved[tb->blocks].bytenr;
+    *physical = tb->reserved[tb->blocks].physical;
+    return 0;
+  case TB_DRY:
+    if (tb->blocks == tb->out_cap) {
+      size_t cap = tb->out_cap ? tb->out_cap * 2 : 256;
+      struct gen_block *b = realloc(tb->out, cap * sizeof(*b));
+      if (!b)
+        return -1;
+      tb->out = b;
+      tb->out_cap = cap;
+    }
+    *logical = *physical = tb->dry_next;
+    tb->dry_next += tb->nodesize;
+    tb->out[tb->blocks] =
+        (struct gen_block){*logical, *physical, tb->owner, level};
+    return 0;
+  }
+  return -1;
+}
+
+/* Seal and write the open node of `level`; returns its first key */
+static int tb_write_node(struct tree_builder *tb, uint8_t level,
+                         struct btrfs_disk_key *first, uint64_t *logical) {
+  struct gen *g = tb->g;
+  uint8_t *node = tb->node[level];
+  uint64_t physical;
+  if (tb_next_block(tb, level, logical, &physical) < 0)
+    return -1;
+  tb->blocks++;
+
+  if (level == 0)
+    *first = ((struct btrfs_item *)(node + HDR_SIZE))->key;
+  else
+    *first = ((struct btrfs_key_ptr *)(node + HDR_SIZE))->key;
+  if (tb->mode == TB_DRY)
+    return 0;
+
+  struct btrfs_header *hdr = (struct btrfs_header *)node;
+  memcpy(hdr->fsid, g->fsid, sizeof(hdr->fsid));
+  memcpy(hdr->chunk_tree_uuid, g->chunk_uuid, sizeof(hdr->chunk_tree_uuid));
+  hdr->bytenr = htole64(*logical);
+  hdr->flags = htole64(GEN_HEADER_FLAG_WRITTEN | GEN_MIXED_BACKREF_REV);
+  hdr->generation = htole64(1);
+  hdr->owner = htole64(tb->owner);
+  hdr->nritems = htole32(tb->nritems[level]);
+  hdr->level = level;
+  uint32_t crc = htole32(btrfs_crc32c(~0U, node + BTRFS_CSUM_SIZE,
+                                      tb->nodesize - BTRFS_CSUM_SIZE));
+  memset(hdr->csum, 0, BTRFS_CSUM_SIZE);
+  memcpy(hdr->csum, &crc, sizeof(crc));
+  return wbuf_write(g, &g->wmeta, physical, node, tb->nodesize);
+}
+
+static int tb_flush(struct tree_builder *tb, uint8_t level);
+
+static int tb_push_ptr(struct tree_builder *tb, uint8_t level,
+                       const struct btrfs_disk_key *key, uint64_t blockptr) {
+  if (level >= BTRFS_MAX_LEVEL) {
+    fprintf(stderr, "gen_btrfs_image: tree too deep\n");
+    return -1;
+  }
+  uint32_t cap = (tb->nodesize - HDR_SIZE) / sizeof(struct btrfs_key_ptr);
+  if (tb->nritems[level] == cap && tb_flush(tb, level) < 0)
+    return -1;
+  struct btrfs_key_ptr *ptrs =
+      (struct btrfs_key_ptr *)(tb->node[level] + HDR_SIZE);
+  struct btrfs_key_ptr *kp = &ptrs[tb->nritems[level]++];
+  kp->key = *key;
+  kp->blockptr = htole64(blockptr);
+  kp->generation = htole64(1);
+  if (tb->height < level + 1)
+    tb->height = level + 1;
+  return 0;
+}
+
+static int tb_flush(struct tree_builder *tb, uint8_t level) {
+  if (tb->nritems[level] == 0)
+    return 0;
+  struct btrfs_disk_key first;
+  uint64_t logical;
+  if (tb_write_node(tb, level, &first, &logical) < 0)
+    return -1;
+  memset(tb->node[level], 0, tb->nodesize);
+  tb->nritems[level] = 0;
+  if (level == 0)
+    tb->leaf_data = 0;
+  return tb_push_ptr(tb, level + 1, &first, logical);
+}
+
+static int tb_add(struct tree_builder *tb, uint64_t objectid, uint8_t type,
+                  uint64_t offset, const void *data, uint32_t size) {
+  uint32_t room = tb->nodesize - HDR_SIZE;
+  if (size + sizeof(struct btrfs_item) > room) {
+    fprintf(stderr, "gen_btrfs_image: item of %u bytes does not fit a leaf\n",
+            size);
+    return -1;
+  }
+  if ((tb->nritems[0] + 1) * sizeof(struct btrfs_item) + tb->leaf_data +
+              size >
+          room &&
+      tb_flush(tb, 0) < 0)
+    return -1;
+
+  uint8_t *leaf = tb->node[0];
+  struct btrfs_item *it =
+      &((struct btrfs_item *)(leaf + HDR_SIZE))[tb->nritems[0]++];
+  tb->leaf_data += size;
+  uint32_t off = room - tb->leaf_data;
+  it->key.objectid = htole64(objectid);
+  it->key.type = type;
+  it->key.offset = htole64(offset);
+  it->offset = htole32(off);
+  it->size = htole32(size);
+  if (size && tb->mode != TB_DRY)
+    memcpy(leaf + HDR_SIZE + off, data, size);
+  tb->items++;
+  return 0;
+}
+
+static int tb_finish(struct tree_builder *tb) {
+  for (uint8_t level = 0; level < BTRFS_MAX_LEVEL; level++) {
+    if (tb->height == level + 1) {
+      struct btrfs_disk_key first;
+      if (tb_write_node(tb, level, &first, &tb->root) < 0)
+        return -1;
+      tb->root_level = level;
+      return 0;
+    }
+    if (tb_flush(tb, level) < 0)
+      return -1;
+  }
+  return -1;
+}
+
+/* ========================================================================
+ * Compressed payloads
+ * ======================================================================== */
+
+static size_t compress_zlib(const uint8_t *in, size_t len, uint8_t *out,
+                            size_t cap) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return 0;
+  zs.next_in = (uint8_t *)in;
+  zs.avail_in = (uInt)len;
+  zs.next_out = out;
+  zs.avail_out = (uInt)cap;
+  int r = deflate(&zs, Z_FINISH);
+  size_t n = zs.total_out;
+  deflateEnd(&zs);
+  return r == Z_STREAM_END ? n : 0;
+}
+
+#ifdef HAVE_LZO
+/* Total length, then a length-prefixed LZO1X segment per 4 KiB page */
+static size_t compress_lzo(const uint8_t *in, size_t len, uint8_t *out,
+                           size_t cap) {
+  static uint8_t wrkmem[LZO1X_1_MEM_COMPRESS];
+  if (lzo_init() != LZO_E_OK)
+    return 0;
+  size_t pos = 4;
+  for (size_t off = 0; off < len; off += GEN_SECTOR) {
+    size_t n = len - off < GEN_SECTOR ? len - off : GEN_SECTOR;
+    if (pos + 4 + n + n / 16 + 64 + 3 > cap)
+      return 0;
+    lzo_uint seg = 0;
+    if (lzo1x_1_compress(in + off, n, out + pos + 4, &seg, wrkmem) !=
+        LZO_E_OK)
+      return 0;
+    for (int b = 0; b < 4; b++)
+      out[pos + b] = (uint8_t)(seg >> (8 * b));
+    pos += 4 + seg;
+  }
+  for (int b = 0; b < 4; b++)
+    out[b] = (uint8_t)(pos >> (8 * b));
+  return pos;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static size_t compress_zstd(const uint8_t *in, size_t len, uint8_t *out,
+                            size_t cap) {
+  size_t n = ZSTD_compress(out, cap, in, len, 3);
+  return ZSTD_isError(n) ? 0 : n;
+}
+#endif
+
+/* Compressed form of the first `blocks` sectors of g->plain, cached */
+static const struct gen_template *gen_template(struct gen *g, uint8_t codec,
+                                               uint32_t blocks) {
+  struct gen_template *t = &g->tmpl[codec][blocks];
+  if (t->data)
+    return t;
+  size_t len = (size_t)blocks * GEN_SECTOR;
+  size_t cap = 2 * len + 4096;
+  uint8_t *out = calloc(1, cap);
+  if (!out)
+    return NULL;
+  size_t n = 0;
+  switch (codec) {
+  case BTRFS_COMPRESS_ZLIB:
+    n = compress_zlib(g->plain, len, out, cap);
+    break;
+#ifdef HAVE_LZO
+  case BTRFS_COMPRESS_LZO:
+    n = compress_lzo(g->plain, len, out, cap);
+    break;
+#endif
+#ifdef HAVE_ZSTD
+  case BTRFS_COMPRESS_ZSTD:
+    n = compress_zstd(g->plain, len, out, cap);
+    break;
+#endif
+  }
+  if (n == 0 || n >= len) {
+    fprintf(stderr, "gen_btrfs_image: compressing a template failed\n");
+    free(out);
+    return NULL;
+  }
+  t->data = out;
+  t->len = (uint32_t)n;
+  return t;
+}
+
+/* Text-like content: compresses about as well as typical file data */
+static void gen_fill_plain(uint8_t *buf, size_t len, uint64_t seed) {
+  static const char *const words[] = {
+      "btrfs ", "extent ", "inode ", "the ",  "block ", "\n",
+      "group ", "data ",   "0x1f ",  "tree ", "leaf ",  "key "};
+  size_t pos = 0;
+  while (pos < len) {
+    const char *w = words[rng_next(&seed) % 12];
+    size_t n = strlen(w);
+    if (n > len - pos)
+      n = len - pos;
+    memcpy(buf + pos, w, n);
+    pos += n;
+  }
+}
+
+/* ========================================================================
+ * FS tree
+ * ======================================================================== */
+
+static int gen_add_extent(struct gen *g, const struct gen_extent *e) {
+  if (g->next == g->ext_cap) {
+    size_t cap = g->ext_cap ? g->ext_cap * 2 : 65536;
+    struct gen_extent *x = realloc(g->ext, cap * sizeof(*x));
+    if (!x) {
+      fprintf(stderr, "gen_btrfs_image: out of memory for extent records\n");
+      return -1;
+    }
+    g->ext = x;
+    g->ext_cap = cap;
+  }
+  g->ext[g->next++] = *e;
+  return 0;
+}
+
+/* Deterministic name of BFS node `i`: 6..24 characters */
+static uint16_t gen_name(const struct gen *g, uint64_t i, int is_dir,
+                         char *buf) {
+  static const char alnum[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+  uint64_t s = g->p->seed ^ (i * 0xD1B54A32D192ED03ULL);
+  uint16_t len = (uint16_t)(6 + rng_next(&s) % 19);
+  buf[0] = is_dir ? 'd' : 'f';
+  for (uint16_t k = 1; k < len; k++)
+    buf[k] = alnum[rng_next(&s) % 36];
+  /* The index keeps siblings unique */
+  len += (uint16_t)sprintf(buf + len, "_%lx", (unsigned long)i);
+  return len;
+}
+
+static int gen_is_dir(const struct gen *g, uint64_t i) {
+  return i == 0 || (uint64_t)g->p->fanout * i + 1 < g->p->inodes;
+}
+
+static uint32_t btrfs_name_hash(const char *name, uint16_t len) {
+  return ~btrfs_crc32c(~1U, name, len);
+}
+
+struct dir_slot {
+  uint32_t hash;
+  uint32_t k; /* child position */
+};
+
+static int dir_slot_cmp(const void *a, const void *b) {
+  const struct dir_slot *x = a, *y = b;
+  if (x->hash != y->hash)
+    return x->hash < y->hash ? -1 : 1;
+  return x->k < y->k ? -1 : (x->k > y->k);
+}
+
+static void gen_inode_item(struct btrfs_inode_item *ii, uint32_t mode,
+                           uint32_t nlink, uint64_t size, uint64_t nbytes,
+                           uint64_t r) {
+  memset(ii, 0, sizeof(*ii));
+  ii->generation = htole64(1);
+  ii->transid = htole64(1);
+  ii->size = htole64(size);
+  ii->nbytes = htole64(nbytes);
+  ii->nlink = htole32(nlink);
+  ii->uid = htole32(1000);
+  ii->gid = htole32(1000);
+  ii->mode = htole32(mode);
+  int64_t t = GEN_TIME_BASE + (int64_t)(r % 100000000);
+  ii->atime.sec = ii->mtime.sec = ii->ctime.sec = ii->otime.sec =
+      (int64_t)htole64((uint64_t)t);
+  ii->mtime.nsec = htole32((uint32_t)(r >> 40) % 1000000000u);
+}
+
+static int gen_dir_entries(struct gen *g, struct tree_builder *tb,
+                           uint64_t ino, uint64_t first, uint64_t count) {
+  struct dir_slot *slots = malloc((count ? count : 1) * sizeof(*slots));
+  uint8_t *buf = malloc(tb->nodesize);
+  if (!slots || !buf) {
+    free(slots);
+    free(buf);
+    return -1;
+  }
+  char name[64];
+  for (uint64_t k = 0; k < count; k++) {
+    uint16_t len = gen_name(g, first + k, gen_is_dir(g, first + k), name);
+    slots[k].hash = btrfs_name_hash(name, len);
+    slots[k].k = (uint32_t)k;
+  }
+  qsort(slots, count, sizeof(*slots), dir_slot_cmp);
+
+  /* DIR_ITEMs by name hash; colliding names share one item */
+  int ret = 0;
+  for (uint64_t k = 0; k < count && ret == 0;) {
+    uint32_t size = 0;
+    uint32_t hash = slots[k].hash;
+    for (; k < count && slots[k].hash == hash; k++) {
+      uint64_t c = first + slots[k].k;
+      int is_dir = gen_is_dir(g, c);
+      uint16_t len = gen_name(g, c, is_dir, name);
+      struct btrfs_dir_item di;
+      memset(&di, 0, sizeof(di));
+      di.location.objectid = htole64(BTRFS_FIRST_FREE_OBJECTID + c);
+      di.location.type = BTRFS_INODE_ITEM_KEY;
+      di.transid = htole64(1);
+      di.name_len = htole16(len);
+      di.type = is_dir ? BTRFS_FT_DIR : BTRFS_FT_REG_FILE;
+      memcpy(buf + size, &di, sizeof(di));
+      memcpy(buf + size + sizeof(di), name, len);
+      size += sizeof(di) + len;
+    }
+    ret = tb_add(tb, ino, BTRFS_DIR_ITEM_KEY, hash, buf, size);
+  }
+
+  /* DIR_INDEXes in creation order */
+  for (uint64_t k = 0; k < count && ret == 0; k++) {
+    uint64_t c = first + k;
+    int is_dir = gen_is_dir(g, c);
+    uint16_t len = gen_name(g, c, is_dir, name);
+    struct btrfs_dir_item di;
+    memset(&di, 0, sizeof(di));
+    di.location.objectid = htole64(BTRFS_FIRST_FREE_OBJECTID + c);
+    di.location.type = BTRFS_INODE_ITEM_KEY;
+    di.transid = htole64(1);
+    di.name_len = htole16(len);
+    di.type = is_dir ? BTRFS_FT_DIR : BTRFS_FT_REG_FILE;
+    memcpy(buf, &di, sizeof(di));
+    memcpy(buf + sizeof(di), name, len);
+    ret = tb_add(tb, ino, BTRFS_DIR_INDEX_KEY, 2 + k, buf,
+                 sizeof(di) + len);
+  }
+  free(slots);
+  free(buf);
+  return ret;
+}
+
+/* One file extent item referencing data extent `e` as a whole */
+static void gen_file_extent(struct btrfs_file_extent_item *fi,
+                            const struct gen_extent *e) {
+  memset(fi, 0, sizeof(*fi));
+  fi->generation = htole64(1);
+  fi->ram_bytes = htole64(e->ram_len);
+  fi->compression = e->compression;
+  fi->type = e->prealloc ? BTRFS_FILE_EXTENT_PREALLOC : BTRFS_FILE_EXTENT_REG;
+  fi->disk_bytenr = htole64(e->bytenr);
+  fi->disk_num_bytes = htole64(e->disk_len);
+  fi->num_bytes = htole64(e->ram_len);
+}
+
+static int gen_write_data(struct gen *g, uint64_t logical, const void *buf,
+                          size_t len) {
+  return wbuf_write(g, &g->wdata, gen_space_phys(&g->data, logical), buf,
+                    len);
+}
+
+/* Allocate one extent of `blocks` sectors for `ino` at `file_off`;
+ * preallocated ones are never written */
+static int gen_new_extent(struct gen *g, uint64_t ino, uint64_t file_off,
+                          uint32_t blocks, uint8_t codec, int prealloc,
+                          uint64_t *r, struct gen_extent *out) {
+  memset(out, 0, sizeof(*out));
+  out->owner = ino;
+  out->offset = file_off;
+  out->refs = 1;
+  out->ram_len = blocks * GEN_SECTOR;
+  out->compression = codec;
+  out->prealloc = (uint8_t)prealloc;
+
+  if (codec != BTRFS_COMPRESS_NONE) {
+    const struct gen_template *t = gen_template(g, codec, blocks);
+    if (!t)
+      return -1;
+    out->disk_len = (t->len + GEN_SECTOR - 1) / GEN_SECTOR * GEN_SECTOR;
+    out->bytenr = gen_space_alloc(g, &g->data, out->disk_len);
+    if (out->bytenr == (uint64_t)-1 ||
+        gen_write_data(g, out->bytenr, t->data, t->len) < 0)
+      return -1;
+    g->compressed++;
+    g->expansion += out->ram_len - out->disk_len;
+  } else {
+    out->disk_len = out->ram_len;
+    out->bytenr = gen_space_alloc(g, &g->data, out->disk_len);
+    if (out->bytenr == (uint64_t)-1)
+      return -1;
+    if (prealloc)
+      g->preallocated += out->disk_len;
+    for (uint64_t off = 0; g->p->fill && !prealloc && off < out->disk_len;
+         off += GEN_WBUF) {
+      uint64_t n = out->disk_len - off < GEN_WBUF ? out->disk_len - off
+                                                  : GEN_WBUF;
+      if (gen_write_data(g, out->bytenr + off, g->pattern, n) < 0)
+        return -1;
+    }
+  }
+  g->data_bytes += out->disk_len;
+
+  /* Free-space fragmentation: leave a hole after the extent */
+  if (g->p->frag && rng_next(r) % 100 < g->p->frag)
+    g->data.cur += (1 + rng_next(r) % 8) * GEN_SECTOR;
+  return gen_add_extent(g, out);
+}
+
+/* Length in sectors of the next extent of a file with `left` sectors */
+static uint32_t gen_extent_blocks(const struct gen *g, uint64_t left,
+                                  uint8_t codec, uint64_t *r) {
+  uint64_t cap = codec != BTRFS_COMPRESS_NONE
+                     ? GEN_MAX_COMPRESSED / GEN_SECTOR
+                     : GEN_MAX_EXTENT / GEN_SECTOR;
+  if (g->p->frag) {
+    /* Mean run of 4 * (100 - frag) / frag sectors; 1 at 100% */
+    double mean = 4.0 * (100 - g->p->frag) / g->p->frag;
+    uint64_t run = 1 + (uint64_t)(-mean * log(1.0 - rng_unit(r)));
+    if (run < cap)
+      cap = run;
+  }
+  return (uint32_t)(left < cap ? left : cap);
+}
+
+static int gen_file(struct gen *g, struct tree_builder *tb, uint64_t i,
+                    uint64_t ino, uint64_t parent, uint64_t index) {
+  uint64_t r = mix64(g->p->seed ^ (ino * 0x9E3779B97F4A7C15ULL));
+  uint64_t size = (uint64_t)(-(double)g->p->file_size *
+                             log(1.0 - rng_unit(&r)));
+  uint8_t codec = BTRFS_COMPRESS_NONE;
+  uint32_t pick = (uint32_t)(rng_next(&r) % 100);
+  for (uint8_t c = BTRFS_COMPRESS_ZLIB; c <= BTRFS_COMPRESS_ZSTD; c++) {
+    if (pick < g->p->codec_pct[c]) {
+      codec = c;
+      break;
+    }
+    pick -= g->p->codec_pct[c];
+  }
+  int reflink = g->next > 0 && size > GEN_MAX_INLINE &&
+                rng_next(&r) % 100 < g->p->reflink;
+  int inl = size > 0 && size <= GEN_MAX_INLINE;
+  int prealloc = g->p->prealloc && !reflink && !inl &&
+                 codec == BTRFS_COMPRESS_NONE &&
+                 rng_next(&r) % 100 < g->p->prealloc;
+
+  /* Plan the extents first: the inode item carries the final size */
+  size_t first_ext = g->next;
+  size_t shared_from = 0, nshared = 0;
+  uint64_t nbytes = 0;
+  if (reflink) {
+    uint64_t want = (size + GEN_SECTOR - 1) / GEN_SECTOR;
+    shared_from = rng_next(&r) % g->next;
+    for (size_t e = shared_from; e < g->next && want > 0; e++) {
+      uint64_t blocks = g->ext[e].ram_len / GEN_SECTOR;
+      want = want > blocks ? want - blocks : 0;
+      g->ext[e].refs++;
+      nbytes += g->ext[e].ram_len;
+      nshared++;
+    }
+    size = nbytes;
+    g->shared_refs += nshared;
+  } else if (inl) {
+    nbytes = size;
+    g->inline_files++;
+  } else if (size > 0) {
+    uint64_t left = (size + GEN_SECTOR - 1) / GEN_SECTOR;
+    uint64_t off = 0;
+    while (left > 0) {
+      uint32_t blocks = gen_extent_blocks(g, left, codec, &r);
+      struct gen_extent e;
+      if (gen_new_extent(g, ino, off, blocks, codec, prealloc, &r, &e) < 0)
+        return -1;
+      off += (uint64_t)blocks * GEN_SECTOR;
+      left -= blocks;
+    }
+    nbytes = off;
+  }
+
+  struct btrfs_inode_item ii;
+  gen_inode_item(&ii, S_IFREG | 0644, 1, size, nbytes, r);
+  if (tb_add(tb, ino, BTRFS_INODE_ITEM_KEY, 0, &ii, sizeof(ii)) < 0)
+    return -1;
+
+  uint8_t buf[sizeof(struct btrfs_file_extent_item) + GEN_MAX_INLINE];
+  struct btrfs_inode_ref *ref = (struct btrfs_inode_ref *)buf;
+  uint16_t len = gen_name(g, i, 0, (char *)(ref + 1));
+  ref->index = htole64(index);
+  ref->name_len = htole16(len);
+  if (tb_add(tb, ino, BTRFS_INODE_REF_KEY, parent, buf, sizeof(*ref) + len) <
+      0)
+    return -1;
+
+  struct btrfs_file_extent_item *fi = (struct btrfs_file_extent_item *)buf;
+  if (inl) {
+    size_t hdr = offsetof(struct btrfs_file_extent_item, disk_bytenr);
+    memset(fi, 0, hdr);
+    fi->generation = htole64(1);
+    fi->ram_bytes = htole64(size);
+    fi->type = BTRFS_FILE_EXTENT_INLINE;
+    memcpy(buf + hdr, g->plain, size);
+    return tb_add(tb, ino, BTRFS_EXTENT_DATA_KEY, 0, buf,
+                  (uint32_t)(hdr + size));
+  }
+
+  uint64_t off = 0;
+  size_t from = reflink ? shared_from : first_ext;
+  size_t n = reflink ? nshared : g->next - first_ext;
+  for (size_t e = from; e < from + n; e++) {
+    gen_file_extent(fi, &g->ext[e]);
+    if (tb_add(tb, ino, BTRFS_EXTENT_DATA_KEY, off, fi, sizeof(*fi)) < 0)
+      return -1;
+    off += g->ext[e].ram_len;
+  }
+  return 0;
+}
+
+static int gen_dir(struct gen *g, struct tree_builder *tb, uint64_t i,
+                   uint64_t ino) {
+  uint64_t n = g->p->inodes;
+  uint64_t first = (uint64_t)g->p->fanout * i + 1;
+  uint64_t count = first < n ? n - first : 0;
+  if (count > g->p->fanout)
+    count = g->p->fanout;
+
+  /* Btrfs directory size: twice the sum of the entry name lengths */
+  char name[64];
+  uint64_t size = 0;
+  for (uint64_t k = 0; k < count; k++)
+    size += 2 * (uint64_t)gen_name(g, first + k, gen_is_dir(g, first + k),
+                                   name);
+
+  struct btrfs_inode_item ii;
+  gen_inode_item(&ii, S_IFDIR | 0755, 1, size, 0,
+                 mix64(g->p->seed ^ ino));
+  if (tb_add(tb, ino, BTRFS_INODE_ITEM_KEY, 0, &ii, sizeof(ii)) < 0)
+    return -1;
+
+  uint8_t buf[sizeof(struct btrfs_inode_ref) + 64];
+  struct btrfs_inode_ref *ref = (struct btrfs_inode_ref *)buf;
+  uint16_t len;
+  uint64_t parent;
+  if (i == 0) {
+    len = 2;
+    memcpy(ref + 1, "..", 2);
+    ref->index = 0;
+    parent = ino;
+  } else {
+    uint64_t p = (i - 1) / g->p->fanout;
+    len = gen_name(g, i, 1, (char *)(ref + 1));
+    ref->index = htole64(2 + (i - ((uint64_t)g->p->fanout * p + 1)));
+    parent = BTRFS_FIRST_FREE_OBJECTID + p;
+  }
+  ref->name_len = htole16(len);
+  if (tb_add(tb, ino, BTRFS_INODE_REF_KEY, parent, buf, sizeof(*ref) + len) <
+      0)
+    return -1;
+
+  g->dirs++;
+  return gen_dir_entries(g, tb, ino, first, count);
+}
+
+static int gen_fs_tree(struct gen *g, struct tree_builder *tb) {
+  uint64_t n = g->p->inodes;
+  time_t last = time(NULL);
+  for (uint64_t i = 0; i < n; i++) {
+    uint64_t ino = BTRFS_FIRST_FREE_OBJECTID + i;
+    int ret;
+    if (gen_is_dir(g, i)) {
+      ret = gen_dir(g, tb, i, ino);
+    } else {
+      uint64_t p = (i - 1) / g->p->fanout;
+      ret = gen_file(g, tb, i, ino, BTRFS_FIRST_FREE_OBJECTID + p,
+                     2 + (i - ((uint64_t)g->p->fanout * p + 1)));
+      g->files++;
+    }
+    if (ret < 0)
+      return -1;
+    if (!g->p->quiet && (i & 0xFFFF) == 0 && time(NULL) != last) {
+      last = time(NULL);
+      fprintf(stderr, "\r  inodes: %lu / %lu", (unsigned long)i,
+              (unsigned long)n);
+    }
+  }
+  if (!g->p->quiet && n > 0xFFFF)
+    fprintf(stderr, "\r  inodes: %lu / %lu\n", (unsigned long)n,
+            (unsigned long)n);
+  return tb_finish(tb);
+}
+
+/* ========================================================================
+ * Extent tree
+ * ======================================================================== */
+
+struct block_stream {
+  const struct gen_block *v;
+  size_t n;
+  size_t i;
+};
+
+/*
+ * Feed the extent items of every data extent and tree block, merged into
+ * bytenr order. `self` lists the extent tree's own blocks.
+ */
+static int gen_extent_items(struct gen *g, struct tree_builder *tb,
+                            const struct gen_block *chunk_blocks,
+                            size_t nchunk_blocks,
+                            const struct gen_block *self, size_t nself) {
+  struct block_stream s[3] = {{chunk_blocks, nchunk_blocks, 0},
+                              {g->blocks, g->nblocks, 0},
+                              {self, nself, 0}};
+  size_t d = 0;
+  uint8_t buf[64];
+  struct btrfs_extent_item *ei = (struct btrfs_extent_item *)buf;
+
+  for (;;) {
+    int best = -1;
+    uint64_t at = (uint64_t)-1;
+    for (int k = 0; k < 3; k++) {
+      if (s[k].i < s[k].n && s[k].v[s[k].i].bytenr < at) {
+        at = s[k].v[s[k].i].bytenr;
+        best = k;
+      }
+    }
+    if (d < g->next && g->ext[d].bytenr < at) {
+      const struct gen_extent *e = &g->ext[d++];
+      memset(buf, 0, sizeof(buf));
+      ei->refs = htole64(e->refs);
+      ei->generation = htole64(1);
+      ei->flags = htole64(BTRFS_EXTENT_FLAG_DATA);
+      uint8_t *ref = buf + sizeof(*ei);
+      ref[0] = BTRFS_EXTENT_DATA_REF_KEY;
+      uint64_t root = htole64(BTRFS_FS_TREE_OBJECTID);
+      uint64_t owner = htole64(e->owner);
+      uint64_t offset = htole64(e->offset);
+      uint32_t count = htole32(e->refs);
+      memcpy(ref + 1, &root, 8);
+      memcpy(ref + 9, &owner, 8);
+      memcpy(ref + 17, &offset, 8);
+      memcpy(ref + 25, &count, 4);
+      if (tb_add(tb, e->bytenr, BTRFS_EXTENT_ITEM_KEY, e->disk_len, buf,
+                 GEN_DATA_ITEM_SIZE) < 0)
+        return -1;
+      continue;
+    }
+    if (best < 0)
+      return 0;
+
+    const struct gen_block *b = &s[best].v[s[best].i++];
+    memset(buf, 0, sizeof(buf));
+    ei->refs = htole64(1);
+    ei->generation = htole64(1);
+    ei->flags = htole64(BTRFS_EXTENT_FLAG_TREE_BLOCK);
+    uint8_t *ref = buf + sizeof(*ei);
+    ref[0] = BTRFS_TREE_BLOCK_REF_KEY;
+    uint64_t root = htole64(b->owner);
+    memcpy(ref + 1, &root, 8);
+    if (tb_add(tb, b->bytenr, BTRFS_METADATA_ITEM_KEY, b->level, buf,
+               GEN_META_ITEM_SIZE) < 0)
+      return -1;
+  }
+}
+
+/* ========================================================================
+ * Chunk tree, root tree and superblock
+ * ======================================================================== */
+
+static void gen_dev_item(const struct gen *g, struct btrfs_dev_item *dev,
+                         uint64_t total_bytes) {
+  memset(dev, 0, sizeof(*dev));
+  dev->devid = htole64(1);
+  dev->total_bytes = htole64(total_bytes);
+  uint64_t used = 0;
+  for (uint32_t c = 0; c < g->nchunks; c++)
+    used += g->chunks[c].length;
+  dev->bytes_used = htole64(used);
+  dev->io_align = htole32(GEN_SECTOR);
+  dev->io_width = htole32(GEN_SECTOR);
+  dev->sector_size = htole32(GEN_SECTOR);
+  dev->generation = htole64(1);
+  memcpy(dev->uuid, g->dev_uuid, sizeof(dev->uuid));
+  memcpy(dev->fsid, g->fsid, sizeof(dev->fsid));
+}
+
+/* Chunk item with its single stripe; returns the item size */
+static uint32_t gen_chunk_item(const struct gen *g, const struct gen_chunk *c,
+                               uint8_t *buf) {
+  struct btrfs_chunk *ch = (struct btrfs_chunk *)buf;
+  struct btrfs_stripe *st = (struct btrfs_stripe *)(ch + 1);
+  memset(buf, 0, sizeof(*ch) + sizeof(*st));
+  ch->length = htole64(c->length);
+  ch->owner = htole64(BTRFS_EXTENT_TREE_OBJECTID);
+  ch->stripe_len = htole64(64 * 1024);
+  ch->type = htole64(c->type);
+  ch->io_align = htole32(64 * 1024);
+  ch->io_width = htole32(64 * 1024);
+  ch->sector_size = htole32(GEN_SECTOR);
+  ch->num_stripes = htole16(1);
+  ch->sub_stripes = htole16(1);
+  st->devid = htole64(1);
+  st->offset = htole64(c->physical);
+  memcpy(st->dev_uuid, g->dev_uuid, sizeof(st->dev_uuid));
+  return sizeof(*ch) + sizeof(*st);
+}
+
+static int gen_chunk_tree(struct gen *g, struct tree_builder *tb,
+                          uint64_t total_bytes) {
+  struct btrfs_dev_item dev;
+  gen_dev_item(g, &dev, total_bytes);
+  if (tb_add(tb, GEN_DEV_ITEMS_OBJECTID, BTRFS_DEV_ITEM_KEY, 1, &dev,
+             sizeof(dev)) < 0)
+    return -1;
+  uint8_t buf[sizeof(struct btrfs_chunk) + sizeof(struct btrfs_stripe)];
+  for (uint32_t c = 0; c < g->nchunks; c++) {
+    uint32_t size = gen_chunk_item(g, &g->chunks[c], buf);
+    if (tb_add(tb, BTRFS_FIRST_CHUNK_TREE_OBJECTID, BTRFS_CHUNK_ITEM_KEY,
+               g->chunks[c].logical, buf, size) < 0)
+      return -1;
+  }
+  return tb_finish(tb);
+}
+
+static void gen_root_item(struct btrfs_root_item *ri, uint64_t bytenr,
+                          uint8_t level, uint64_t blocks, uint32_t nodesize,
+                          uint64_t root_dirid) {
+  memset(ri, 0, sizeof(*ri));
+  ri->inode.generation = htole64(1);
+  ri->inode.size = htole64(3);
+  ri->inode.nlink = htole32(1);
+  ri->inode.nbytes = htole64(nodesize);
+  ri->inode.mode = htole32(S_IFDIR | 0755);
+  ri->generation = htole64(1);
+  ri->root_dirid = htole64(root_dirid);
+  ri->bytenr = htole64(bytenr);
+  ri->bytes_used = htole64(blocks * nodesize);
+  ri->refs = htole32(1);
+  ri->level = level;
+  ri->generation_v2 = htole64(1);
+}
+
+static int gen_write_super(struct gen *g, uint64_t total_bytes,
+                           uint64_t bytes_used, uint64_t root,
+                           uint8_t root_level, uint64_t chunk_root,
+                           uint8_t chunk_root_level) {
+  struct btrfs_super_block *sb = calloc(1, sizeof(*sb));
+  if (!sb)
+    return -1;
+  memcpy(sb->fsid, g->fsid, sizeof(sb->fsid));
+  sb->magic = htole64(BTRFS_MAGIC);
+  sb->generation = htole64(1);
+  sb->root = htole64(root);
+  sb->chunk_root = htole64(chunk_root);
+  sb->total_bytes = htole64(total_bytes);
+  sb->bytes_used = htole64(bytes_used);
+  sb->root_dir_objectid = htole64(BTRFS_ROOT_TREE_DIR_OBJECTID);
+  sb->num_devices = htole64(1);
+  sb->sectorsize = htole32(GEN_SECTOR);
+  sb->nodesize = htole32(g->p->nodesize);
+  sb->__unused_leafsize = htole32(g->p->nodesize);
+  sb->stripesize = htole32(GEN_SECTOR);
+  sb->chunk_root_generation = htole64(1);
+  sb->incompat_flags = htole64(g->incompat);
+  sb->csum_type = htole16(BTRFS_CSUM_TYPE_CRC32);
+  sb->root_level = root_level;
+  sb->chunk_root_level = chunk_root_level;
+  gen_dev_item(g, &sb->dev_item, total_bytes);
+  snprintf(sb->label, sizeof(sb->label), "synthetic");
+
+  /* The system chunk is always the first one */
+  struct btrfs_disk_key *key = (struct btrfs_disk_key *)sb->sys_chunk_array;
+  key->objectid = htole64(BTRFS_FIRST_CHUNK_TREE_OBJECTID);
+  key->type = BTRFS_CHUNK_ITEM_KEY;
+  key->offset = htole64(g->chunks[0].logical);
+  uint32_t size = gen_chunk_item(g, &g->chunks[0], (uint8_t *)(key + 1));
+  sb->sys_chunk_array_size = htole32(sizeof(*key) + size);
+
+  static const uint64_t offsets[] = {BTRFS_SUPER_OFFSET, BTRFS_SUPER_MIRROR_1,
+                                     BTRFS_SUPER_MIRROR_2};
+  int ret = 0;
+  for (size_t m = 0; m < sizeof(offsets) / sizeof(offsets[0]); m++) {
+    if (offsets[m] + BTRFS_SUPER_INFO_SIZE > total_bytes)
+      break;
+    sb->bytenr = htole64(offsets[m]);
+    uint32_t crc = htole32(btrfs_crc32c(~0U, (uint8_t *)sb + BTRFS_CSUM_SIZE,
+                                        BTRFS_SUPER_INFO_SIZE -
+                                            BTRFS_CSUM_SIZE));
+    memset(sb->csum, 0, BTRFS_CSUM_SIZE);
+    memcpy(sb->csum, &crc, sizeof(crc));
+    if (pwrite_all(g->fd, sb, sizeof(*sb), offsets[m]) < 0) {
+      ret = -1;
+      break;
+    }
+  }
+  free(sb);
+  return ret;
+}
+
+/* ========================================================================
+ * Driver
+ * ======================================================================== */
+
+/*
+ * Reserve the extent tree's own blocks. Its size depends on the number of
+ * tree blocks, its own included, and on the chunk tree, which may grow when
+ * the reservation opens a chunk, so iterate to a fixed point.
+ */
+static int gen_plan_extent_tree(struct gen *g, struct gen_block **self,
+                                size_t *nself) {
+  size_t want = 1;
+  for (int iter = 0; iter < 32; iter++) {
+    struct gen_space meta = g->meta;
+    uint32_t nchunks = g->nchunks;
+    uint64_t phys_next = g->phys_next, logical_next = g->logical_next;
+
+    struct gen_block *res = calloc(want, sizeof(*res));
+    if (!res)
+      return -1;
+    for (size_t k = 0; k < want; k++) {
+      res[k].bytenr = gen_space_alloc(g, &g->meta, g->p->nodesize);
+      if (res[k].bytenr == (uint64_t)-1) {
+        free(res);
+        return -1;
+      }
+      res[k].physical = gen_space_phys(&g->meta, res[k].bytenr);
+      res[k].owner = BTRFS_EXTENT_TREE_OBJECTID;
+    }
+
+    struct tree_builder ct, et;
+    memset(&et, 0, sizeof(et));
+    int ret = tb_init(&ct, g, BTRFS_CHUNK_TREE_OBJECTID, TB_DRY);
+    ct.dry_next = GEN_SYS_START;
+    if (ret == 0)
+      ret = gen_chunk_tree(g, &ct, 0);
+    if (ret == 0)
+      ret = tb_init(&et, g, BTRFS_EXTENT_TREE_OBJECTID, TB_DRY);
+    if (ret == 0) {
+      ret = gen_extent_items(g, &et, ct.out, ct.blocks, res, want);
+      if (ret == 0)
+        ret = tb_finish(&et);
+    }
+    size_t got = et.blocks;
+    if (ret == 0 && got == want) {
+      /* Levels in allocation order, as the real build will see them */
+      for (size_t k = 0; k < want; k++)
+        res[k].level = et.out[k].level;
+    }
+    tb_free(&ct);
+    tb_free(&et);
+    if (ret < 0) {
+      free(res);
+      return -1;
+    }
+    if (got == want) {
+      *self = res;
+      *nself = want;
+      return 0;
+    }
+
+    free(res);
+    g->meta = meta;
+    g->nchunks = nchunks;
+    g->phys_next = phys_next;
+    g->logical_next = logical_next;
+    want = got;
+  }
+  fprintf(stderr, "gen_btrfs_image: extent tree size did not converge\n");
+  return -1;
+}
+
+static int gen_image(struct gen *g, const char *path) {
+  const struct gen_params *p = g->p;
+  struct tree_builder fs, ex, rt, ch;
+  struct gen_block *self = NULL;
+  size_t nself = 0;
+  int ret = -1;
+
+  memset(&fs, 0, sizeof(fs));
+  memset(&ex, 0, sizeof(ex));
+  memset(&rt, 0, sizeof(rt));
+  memset(&ch, 0, sizeof(ch));
+
+  g->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (g->fd < 0) {
+    perror(path);
+    return -1;
+  }
+
+  /* FS tree, streamed: data extents and tree blocks as they fill */
+  if (tb_init(&fs, g, BTRFS_FS_TREE_OBJECTID, TB_SPACE) < 0)
+    goto out;
+  fs.space = &g->meta;
+  fs.record = 1;
+  if (gen_fs_tree(g, &fs) < 0 || wbuf_flush(g, &g->wdata) < 0)
+    goto out;
+
+  /* Root tree: one leaf, written last but placed now */
+  if (tb_init(&rt, g, BTRFS_ROOT_TREE_OBJECTID, TB_SPACE) < 0)
+    goto out;
+  struct gen_block root_block;
+  root_block.bytenr = gen_space_alloc(g, &g->meta, p->nodesize);
+  if (root_block.bytenr == (uint64_t)-1)
+    goto out;
+  root_block.physical = gen_space_phys(&g->meta, root_block.bytenr);
+  root_block.owner = BTRFS_ROOT_TREE_OBJECTID;
+  root_block.level = 0;
+  if (g->nblocks == g->blocks_cap) {
+    struct gen_block *b =
+        realloc(g->blocks, (g->blocks_cap + 1) * sizeof(*b));
+    if (!b)
+      goto out;
+    g->blocks = b;
+    g->blocks_cap++;
+  }
+  g->blocks[g->nblocks++] = root_block;
+
+  /* Extent tree into its reserved blocks */
+  if (gen_plan_extent_tree(g, &self, &nself) < 0)
+    goto out;
+  if (tb_init(&ch, g, BTRFS_CHUNK_TREE_OBJECTID, TB_DRY) < 0)
+    goto out;
+  ch.dry_next = GEN_SYS_START;
+  if (gen_chunk_tree(g, &ch, 0) < 0)
+    goto out;
+  if (tb_init(&ex, g, BTRFS_EXTENT_TREE_OBJECTID, TB_RESERVED) < 0)
+    goto out;
+  ex.reserved = self;
+  ex.nreserved = nself;
+  if (gen_extent_items(g, &ex, ch.out, ch.blocks, self, nself) < 0 ||
+      tb_finish(&ex) < 0)
+    goto out;
+
+  /* The image size is known once every chunk exists */
+  uint64_t used_end = g->phys_next;
+  uint64_t total = p->size;
+  if (total == 0) {
+    total = used_end + used_end / 2 + g->expansion + (256ULL << 20);
+    total = (total + (1ULL << 20) - 1) & ~((1ULL << 20) - 1);
+  } else if (total < used_end) {
+    fprintf(stderr,
+            "gen_btrfs_image: --size %lu is too small, need at least %lu\n",
+            (unsigned long)total, (unsigned long)used_end);
+    goto out;
+  }
+
+  struct btrfs_root_item ri;
+  rt.mode = TB_RESERVED;
+  rt.reserved = &root_block;
+  rt.nreserved = 1;
+  gen_root_item(&ri, ex.root, ex.root_level, ex.blocks, p->nodesize, 0);
+  if (tb_add(&rt, BTRFS_EXTENT_TREE_OBJECTID, BTRFS_ROOT_ITEM_KEY, 0, &ri,
+             sizeof(ri)) < 0)
+    goto out;
+  gen_root_item(&ri, fs.root, fs.root_level, fs.blocks, p->nodesize,
+                BTRFS_FIRST_FREE_OBJECTID);
+  memcpy(ri.uuid, g->fs_uuid, sizeof(ri.uuid));
+  if (tb_add(&rt, BTRFS_FS_TREE_OBJECTID, BTRFS_ROOT_ITEM_KEY, 0, &ri,
+             sizeof(ri)) < 0 ||
+      tb_finish(&rt) < 0)
+    goto out;
+
+  /* Chunk tree into the system chunk, at the addresses planned above */
+  tb_free(&ch);
+  if (tb_init(&ch, g, BTRFS_CHUNK_TREE_OBJECTID, TB_SPACE) < 0)
+    goto out;
+  ch.space = &g->sys;
+  if (gen_chunk_tree(g, &ch, total) < 0)
+    goto out;
+
+  if (wbuf_flush(g, &g->wmeta) < 0 || wbuf_flush(g, &g->wdata) < 0)
+    goto out;
+  if (ftruncate(g->fd, (off_t)total) < 0) {
+    perror("ftruncate");
+    goto out;
+  }
+
+  uint64_t meta_blocks = fs.blocks + ex.blocks + rt.blocks + ch.blocks;
+  uint64_t bytes_used = g->data_bytes + meta_blocks * p->nodesize;
+  if (gen_write_super(g, total, bytes_used, rt.root, rt.root_level, ch.root,
+                      ch.root_level) < 0)
+    goto out;
+  if (fsync(g->fd) < 0) {
+    perror("fsync");
+    goto out;
+  }
+
+  if (!p->quiet) {
+    printf("Image:           %s (%.1f GiB, %.1f GiB used)\n", path,
+           total / 1073741824.0, bytes_used / 1073741824.0);
+    printf("Inodes:          %lu (%lu directories, %lu files, %lu inline)\n",
+           (unsigned long)p->inodes, (unsigned long)g->dirs,
+           (unsigned long)g->files, (unsigned long)g->inline_files);
+    printf("Data extents:    %lu (%lu compressed, %lu shared references)\n",
+           (unsigned long)g->next, (unsigned long)g->compressed,
+           (unsigned long)g->shared_refs);
+    if (g->preallocated)
+      printf("Preallocated:    %.1f MiB unwritten\n",
+             g->preallocated / 1048576.0);
+    printf("Chunks:          %u\n", g->nchunks);
+    printf("FS tree:         %lu items, %lu nodes, root level %u\n",
+           (unsigned long)fs.items, (unsigned long)fs.blocks,
+           fs.root_level);
+    printf("Extent tree:     %lu items, %lu nodes, root level %u\n",
+           (unsigned long)ex.items, (unsigned long)ex.blocks,
+           ex.root_level);
+  }
+  ret = 0;
+
+out:
+  tb_free(&fs);
+  tb_free(&ex);
+  tb_free(&rt);
+  tb_free(&ch);
+  free(self);
+  close(g->fd);
+  return ret;
+}
+
+static int parse_size(const char *s, uint64_t *out) {
+  char *end;
+  double v = strtod(s, &end);
+  if (end == s || v < 0)
+    return -1;
+  switch (*end) {
+  case 'k': case 'K': v *= 1024.0; end++; break;
+  case 'm': case 'M': v *= 1048576.0; end++; break;
+  case 'g': case 'G': v *= 1073741824.0; end++; break;
+  case 't': case 'T': v *= 1099511627776.0; end++; break;
+  }
+  if (*end != '\0')
+    return -1;
+  *out = (uint64_t)v;
+  return 0;
+}
+
+/* "zlib:20,zstd:10" -> percent of regular files per codec */
+static int parse_compress(const char *spec, uint32_t pct[4]) {
+  static const char *const names[] = {NULL, "zlib", "lzo", "zstd"};
+  char *copy = strdup(spec);
+  if (!copy)
+    return -1;
+  uint32_t total = 0;
+  int ret = 0;
+  for (char *tok = strtok(copy, ","); tok && ret == 0;
+       tok = strtok(NULL, ",")) {
+    char *colon = strchr(tok, ':');
+    uint32_t v = colon ? (uint32_t)atoi(colon + 1) : 100;
+    if (colon)
+      *colon = '\0';
+    int codec = 0;
+    for (int c = 1; c < 4; c++)
+      if (strcmp(tok, names[c]) == 0)
+        codec = c;
+    if (codec == 0) {
+      fprintf(stderr, "gen_btrfs_image: unknown codec '%s'\n", tok);
+      ret = -1;
+      break;
+    }
+#ifndef HAVE_LZO
+    if (codec == BTRFS_COMPRESS_LZO) {
+      fprintf(stderr, "gen_btrfs_image: built without liblzo2\n");
+      ret = -1;
+    }
+#endif
+#ifndef HAVE_ZSTD
+    if (codec == BTRFS_COMPRESS_ZSTD) {
+      fprintf(stderr, "gen_btrfs_image: built without libzstd\n");
+      ret = -1;
+    }
+#endif
+    pct[codec] = v;
+    total += v;
+  }
+  free(copy);
+  if (ret == 0 && total > 100) {
+    fprintf(stderr, "gen_btrfs_image: compression mix exceeds 100%%\n");
+    ret = -1;
+  }
+  return ret;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options] IMAGE\n"
+          "  -n, --inodes N       Inodes including the root (default: "
+          "100000)\n"
+          "  -F, --fanout N       Entries per directory (default: 64)\n"
+          "  -S, --file-size N    Mean file size, K/M/G suffixes (default: "
+          "16K)\n"
+          "  -f, --frag PCT       Fragmentation, 0-100 (default: 0)\n"
+          "  -c, --compress MIX   Percent of files per codec, e.g. "
+          "zlib:20,zstd:10\n"
+          "  -r, --reflink PCT    Percent of files sharing earlier files' "
+          "extents\n"
+          "  -p, --prealloc PCT   Percent of uncompressed files left "
+          "preallocated, unwritten\n"
+          "  -N, --nodesize N     Tree node size (default: 16384)\n"
+          "  -s, --size N         Image size (default: contents + 50%% + "
+          "256 MiB)\n"
+          "      --seed N         Generator seed (default: 1)\n"
+          "      --fill           Write file data instead of leaving holes\n"
+          "  -q, --quiet          Print nothing on success\n",
+          prog);
+}
+
+int main(int argc, char **argv) {
+  static struct option long_options[] = {
+      {"inodes", required_argument, NULL, 'n'},
+      {"fanout", required_argument, NULL, 'F'},
+      {"file-size", required_argument, NULL, 'S'},
+      {"frag", required_argument, NULL, 'f'},
+      {"compress", required_argument, NULL, 'c'},
+      {"reflink", required_argument, NULL, 'r'},
+      {"prealloc", required_argument, NULL, 'p'},
+      {"nodesize", required_argument, NULL, 'N'},
+      {"size", required_argument, NULL, 's'},
+      {"seed", required_argument, NULL, 'E'},
+      {"fill", no_argument, NULL, 'L'},
+      {"quiet", no_argument, NULL, 'q'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0}};
+  struct gen_params p;
+  memset(&p, 0, sizeof(p));
+  p.inodes = 100000;
+  p.fanout = 64;
+  p.file_size = 16384;
+  p.nodesize = 16384;
+  p.seed = 1;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "n:F:S:f:c:r:p:N:s:qh", long_options,
+                            NULL)) != -1) {
+    switch (opt) {
+    case 'n':
+      p.inodes = strtoull(optarg, NULL, 0);
+      break;
+    case 'F':
+      p.fanout = (uint32_t)atoi(optarg);
+      break;
+    case 'S':
+      if (parse_size(optarg, &p.file_size) < 0) {
+        fprintf(stderr, "gen_btrfs_image: bad size '%s'\n", optarg);
+        return 1;
+      }
+      break;
+    case 'f':
+      p.frag = (uint32_t)atoi(optarg);
+      break;
+    case 'c':
+      if (parse_compress(optarg, p.codec_pct) < 0)
+        return 1;
+      break;
+    case 'r':
+      p.reflink = (uint32_t)atoi(optarg);
+      break;
+    case 'p':
+      p.prealloc = (uint32_t)atoi(optarg);
+      break;
+    case 'N':
+      p.nodesize = (uint32_t)atoi(optarg);
+      break;
+    case 's':
+      if (parse_size(optarg, &p.size) < 0) {
+        fprintf(stderr, "gen_btrfs_image: bad size '%s'\n", optarg);
+        return 1;
+      }
+      break;
+    case 'E':
+      p.seed = strtoull(optarg, NULL, 0);
+      break;
+    case 'L':
+      p.fill = 1;
+      break;
+    case 'q':
+      p.quiet = 1;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (p.inodes < 1 || p.fanout < 1 || p.frag > 100 || p.reflink > 100 ||
+      p.prealloc > 100 ||
+      p.nodesize < GEN_SECTOR || p.nodesize > 65536 ||
+      p.nodesize % GEN_SECTOR) {
+    fprintf(stderr, "gen_btrfs_image: parameter out of range\n");
+    return 1;
+  }
+
+  struct gen *g = calloc(1, sizeof(*g));
+  if (!g)
+    return 1;
+  g->p = &p;
+  g->wmeta.buf = malloc(GEN_WBUF);
+  g->wdata.buf = malloc(GEN_WBUF);
+  g->plain = malloc(GEN_MAX_COMPRESSED);
+  g->pattern = p.fill ? malloc(GEN_WBUF) : NULL;
+  if (!g->wmeta.buf || !g->wdata.buf || !g->plain ||
+      (p.fill && !g->pattern)) {
+    fprintf(stderr, "gen_btrfs_image: out of memory\n");
+    return 1;
+  }
+  gen_fill_plain(g->plain, GEN_MAX_COMPRESSED, p.seed);
+  if (g->pattern)
+    gen_fill_plain(g->pattern, GEN_WBUF, p.seed ^ 1);
+
+  uint64_t s = p.seed;
+  for (size_t k = 0; k < BTRFS_FSID_SIZE; k++) {
+    g->fsid[k] = (uint8_t)rng_next(&s);
+    g->chunk_uuid[k] = (uint8_t)rng_next(&s);
+    g->dev_uuid[k] = (uint8_t)rng_next(&s);
+    g->fs_uuid[k] = (uint8_t)rng_next(&s);
+  }
+
+  g->incompat = GEN_INCOMPAT_MIXED_BACKREF | GEN_INCOMPAT_BIG_METADATA |
+                GEN_INCOMPAT_EXTENDED_IREF | GEN_INCOMPAT_SKINNY_METADATA;
+  if (p.codec_pct[BTRFS_COMPRESS_LZO])
+    g->incompat |= GEN_INCOMPAT_COMPRESS_LZO;
+  if (p.codec_pct[BTRFS_COMPRESS_ZSTD])
+    g->incompat |= GEN_INCOMPAT_COMPRESS_ZSTD;
+
+  /* System chunk first; the others follow in allocation order */
+  gen_add_chunk(g, GEN_SYS_START, GEN_SYS_START, GEN_SYS_LEN,
+                BTRFS_BLOCK_GROUP_SYSTEM);
+  g->sys = (struct gen_space){BTRFS_BLOCK_GROUP_SYSTEM, GEN_SYS_LEN,
+                              GEN_SYS_START, GEN_SYS_START, GEN_SYS_START,
+                              GEN_SYS_START + GEN_SYS_LEN};
+  g->meta = (struct gen_space){BTRFS_BLOCK_GROUP_METADATA, GEN_META_CHUNK,
+                               0, 0, 0, 0};
+  g->data = (struct gen_space){BTRFS_BLOCK_GROUP_DATA, GEN_DATA_CHUNK,
+                               0, 0, 0, 0};
+  g->phys_next = GEN_SYS_START + GEN_SYS_LEN;
+  g->logical_next = GEN_LOGICAL_START;
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  int ret = gen_image(g, argv[optind]);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  if (ret == 0 && !p.quiet)
+    printf("Generated in:    %.2f s\n",
+           (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+
+  for (int c = 0; c < 4; c++)
+    for (size_t b = 0; b <= GEN_MAX_COMPRESSED / GEN_SECTOR; b++)
+      free(g->tmpl[c][b].data);
+  free(g->wmeta.buf);
+  free(g->wdata.buf);
+  free(g->plain);
+  free(g->pattern);
+  free(g->ext);
+  free(g->blocks);
+  free(g->chunks);
+  free(g);
+  return ret == 0 ? 0 : 1;
+}
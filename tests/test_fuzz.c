@@ -58,6 +58,7 @@ static void free_fuzzed_fs(struct btrfs_fs_info *fs) {
       }
     }
     free(fs->inode_table);
+    usage_map_free(&fs->usage);
     free(fs);
   }
 }
@@ -226,7 +227,7 @@ __attribute__((unused)) static void test_extent_tree_depth() {
     fe.extents[i].type = BTRFS_FILE_EXTENT_REG;
   }
 
-  struct chunk_map cm;
+  struct chunk_map cm = {0};
   cm.count = 1;
   cm.capacity = 1;
   cm.entries = calloc(1, sizeof(struct chunk_mapping));
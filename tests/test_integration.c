@@ -15,6 +15,7 @@
  *   G. Block allocator    — Bug B-9 (dirección), Bug B-10 (wrap-around)
  *   H. Journal zeroing    — Bug B-7: fallocate/pwrite-chunk path
  *   I. Consistencia E2E   — superbloque, GDT, bitmaps, inodos, free counts
+ *   L. Descompresión      — salida en streaming por ventana alineada
  *
  * Build: añadir test_integration.c a CMakeLists.txt como nuevo target
  *        (mismo patrón que test_stress)
@@ -34,14 +35,21 @@
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
+#include "btrfs/btree.h"
 #include "btrfs/btrfs_reader.h"
+#include "btrfs/checksum.h"
 #include "btrfs/chunk_tree.h"
+#include "btrfs/decompress.h"
+#include "btrfs/node_cache.h"
 #include "device_io.h"
 #include "ext4/ext4_crc16.h"
 #include "ext4/ext4_planner.h"
 #include "ext4/ext4_structures.h"
 #include "ext4/ext4_writer.h"
+#include "journal.h"
+#include "relocator.h"
 
 /* =========================================================================
  * Infrastructure
@@ -138,15 +146,20 @@ static int read_raw(struct device *dev, uint64_t offset, void *buf, size_t n) {
 
 /* Removed erroneous MSB-first crc16_ibm, using ext4_crc16 */
 
-/* Calcula el checksum esperado para el group descriptor g
- * Algoritmo: CRC16(seed=0, UUID || le16(g) || descriptor_con_csum=0) */
-static uint16_t expected_gdt_csum(const uint8_t *uuid, uint32_t group_no,
-                                  const uint8_t *desc_bytes, size_t desc_size) {
-  uint16_t crc = 0xFFFF; /* Seed CRC with ~0 */
-  crc = ext4_crc16(crc, uuid, 16);
+/* crc32c del kernel (ext4_chksum): sin inversión inicial ni final */
+static uint32_t raw_crc32c(uint32_t crc, const void *buf, size_t len) {
+  return ~btrfs_crc32c(crc, buf, len);
+}
+
+/* Calcula el checksum esperado para el group descriptor g, como
+ * ext4_group_desc_csum() del kernel:
+ *   metadata_csum: crc32c(seed || le32(g) || desc con bg_checksum=0) & 0xFFFF
+ *   gdt_csum:      crc16(~0, UUID || le32(g) || desc sin bg_checksum) */
+static uint16_t expected_gdt_csum(const struct ext4_super_block *sb,
+                                  uint32_t group_no, const uint8_t *desc_bytes,
+                                  size_t desc_size) {
   uint32_t le_group =
       htole32(group_no); /* Group number must be le32 for Ext4! */
-  crc = ext4_crc16(crc, &le_group, 4);
 
   /* El checksum se calcula con el campo bg_checksum puesto a 0 */
   uint8_t tmp[64];
@@ -154,7 +167,22 @@ static uint16_t expected_gdt_csum(const uint8_t *uuid, uint32_t group_no,
   /* bg_checksum está en el offset 30 del descriptor */
   tmp[30] = 0;
   tmp[31] = 0;
-  crc = ext4_crc16(crc, tmp, desc_size);
+
+  if (le32toh(sb->s_feature_ro_compat) &
+      EXT4_FEATURE_RO_COMPAT_METADATA_CSUM) {
+    uint32_t seed = raw_crc32c(~0U, sb->s_uuid, 16);
+    if (le32toh(sb->s_feature_incompat) & EXT4_FEATURE_INCOMPAT_CSUM_SEED)
+      seed = le32toh(sb->s_checksum_seed);
+    uint32_t crc = raw_crc32c(seed, &le_group, 4);
+    crc = raw_crc32c(crc, tmp, desc_size);
+    return (uint16_t)(crc & 0xFFFF);
+  }
+
+  uint16_t crc = 0xFFFF; /* Seed CRC with ~0 */
+  crc = ext4_crc16(crc, sb->s_uuid, 16);
+  crc = ext4_crc16(crc, &le_group, 4);
+  crc = ext4_crc16(crc, tmp, 30);
+  crc = ext4_crc16(crc, tmp + 32, desc_size - 32);
   return crc;
 }
 
@@ -350,6 +378,192 @@ static void test_batch_readonly_rejected(void) {
   TEST_PASS();
 }
 
+/* Lee del fichero sin pasar por la caché del device */
+static int read_file_raw(const char *path, uint64_t offset, void *buf,
+                         size_t n) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  ssize_t r = pread(fd, buf, n, (off_t)offset);
+  close(fd);
+  return r == (ssize_t)n ? 0 : -1;
+}
+
+static void test_cache_small_writes_merged(void) {
+  TEST_START("A-7  cache: escrituras pequeñas se combinan al vaciar");
+
+  struct device dev;
+  REQUIRE(make_test_dev(&dev, "cacheA7", 1024 * 1024) == 0,
+          "no se pudo crear imagen");
+  REQUIRE(device_cache_enable(&dev, 0) == 0, "cache_enable falló");
+
+  /* 1024 inodos de 256 bytes escritos en orden inverso: 64 páginas seguidas
+   * más un hueco en medio de una página aparte */
+  uint8_t inode[256];
+  for (int i = 1023; i >= 0; i--) {
+    memset(inode, (uint8_t)(i + 1), sizeof(inode));
+    REQUIRE(device_write(&dev, 4096 + (uint64_t)i * 256, inode,
+                         sizeof(inode)) == 0,
+            "device_write falló");
+  }
+  uint8_t tail[100];
+  memset(tail, 0x5A, sizeof(tail));
+  REQUIRE(device_write(&dev, 512 * 1024 + 10, tail, 50) == 0, "write falló");
+  REQUIRE(device_write(&dev, 512 * 1024 + 1000, tail, 100) == 0,
+          "write falló");
+
+  /* Lectura ve los datos en caché; el fichero todavía no */
+  uint8_t rb[256];
+  REQUIRE(read_raw(&dev, 4096 + 5 * 256, rb, sizeof(rb)) == 0,
+          "lectura falló");
+  CHECK(rb[0] == 6 && rb[255] == 6, "lectura no ve la caché");
+  REQUIRE(read_file_raw(dev.path, 4096, rb, 16) == 0, "pread falló");
+  CHECK(rb[0] == 0, "escritura llegó al disco antes del flush");
+
+  REQUIRE(device_cache_flush(&dev) == 0, "cache_flush falló");
+
+  struct device_cache_stats st;
+  device_cache_get_stats(&dev, &st);
+  CHECK(st.writes_absorbed == 1026, "writes_absorbed incorrecto");
+  CHECK(st.flush_ios == 2, "las páginas contiguas no se combinaron");
+
+  for (int i = 0; i < 1024; i += 97) {
+    REQUIRE(read_file_raw(dev.path, 4096 + (uint64_t)i * 256, rb,
+                          sizeof(rb)) == 0,
+            "pread falló");
+    CHECK(rb[0] == (uint8_t)(i + 1) && rb[255] == (uint8_t)(i + 1),
+          "inodo incorrecto en disco");
+  }
+  uint8_t page[1100];
+  REQUIRE(read_file_raw(dev.path, 512 * 1024, page, sizeof(page)) == 0,
+          "pread falló");
+  CHECK(page[9] == 0 && page[10] == 0x5A && page[59] == 0x5A,
+        "primer trozo incorrecto");
+  CHECK(page[60] == 0 && page[999] == 0, "hueco no conservado");
+  CHECK(page[1000] == 0x5A && page[1099] == 0x5A, "segundo trozo incorrecto");
+
+  cleanup_test_dev(&dev);
+  TEST_PASS();
+}
+
+static void test_cache_direct_write_ordering(void) {
+  TEST_START("A-8  cache: escritura grande posterior prevalece");
+
+  struct device dev;
+  REQUIRE(make_test_dev(&dev, "cacheA8", 1024 * 1024) == 0,
+          "no se pudo crear imagen");
+  REQUIRE(device_cache_enable(&dev, 0) == 0, "cache_enable falló");
+
+  /* Pequeña (a caché) y luego grande (directa) sobre los mismos bytes */
+  uint8_t small[512];
+  memset(small, 0x11, sizeof(small));
+  REQUIRE(device_write(&dev, 8192, small, sizeof(small)) == 0,
+          "write falló");
+  size_t big_len = 2 * DEVICE_CACHE_MAX_WRITE;
+  uint8_t *big = malloc(big_len);
+  REQUIRE(big != NULL, "malloc falló");
+  memset(big, 0x22, big_len);
+  REQUIRE(device_write(&dev, 0, big, big_len) == 0, "write grande falló");
+  free(big);
+
+  /* device_close vacía la caché: nada antiguo debe pisar lo nuevo */
+  char path[128];
+  strncpy(path, dev.path, sizeof(path) - 1);
+  path[sizeof(path) - 1] = '\0';
+  device_close(&dev);
+
+  uint8_t rb[512];
+  int ok = read_file_raw(path, 8192, rb, sizeof(rb)) == 0;
+  unlink(path);
+  REQUIRE(ok, "pread falló");
+  CHECK(rb[0] == 0x22 && rb[511] == 0x22,
+        "escritura en caché pisó la escritura directa");
+  TEST_PASS();
+}
+
+static void test_direct_bulk_roundtrip(void) {
+  TEST_START("A-9  direct: E/S en bloque con O_DIRECT y caída a buffered");
+
+  char path[128];
+  snprintf(path, sizeof(path), "/tmp/b2e4_itest_%d_directA9.img", getpid());
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  REQUIRE(fd >= 0, "no se pudo crear imagen");
+  REQUIRE(ftruncate(fd, 4 * 1024 * 1024) == 0, "ftruncate falló");
+  close(fd);
+
+  struct device dev;
+  REQUIRE(device_open_flags(&dev, path, DEVICE_OPEN_DIRECT) == 0,
+          "device_open_flags falló");
+  /* Sin soporte O_DIRECT el device sigue en buffered: la prueba vale igual */
+
+  size_t len = 256 * 1024;
+  uint8_t *buf = device_buf_alloc(len);
+  REQUIRE(buf != NULL, "device_buf_alloc falló");
+  CHECK(((uintptr_t)buf % DEVICE_DIRECT_ALIGN) == 0, "buffer no alineado");
+  for (size_t i = 0; i < len; i++)
+    buf[i] = (uint8_t)(i * 13 + 1);
+
+  /* Una escritura pequeña en caché debe quedar debajo de la directa */
+  REQUIRE(device_cache_enable(&dev, 0) == 0, "cache_enable falló");
+  uint8_t old[64];
+  memset(old, 0xEE, sizeof(old));
+  REQUIRE(device_write(&dev, 1024 * 1024 + 100, old, sizeof(old)) == 0,
+          "write falló");
+  REQUIRE(device_write_bulk(&dev, 1024 * 1024, buf, len) == 0,
+          "write_bulk falló");
+  /* Desalineada: va por el camino buffered */
+  REQUIRE(device_write_bulk(&dev, 3 * 1024 * 1024 + 7, buf + 1, 1000) == 0,
+          "write_bulk desalineado falló");
+  REQUIRE(device_cache_flush(&dev) == 0, "cache_flush falló");
+
+  uint8_t *rb = device_buf_alloc(len);
+  REQUIRE(rb != NULL, "device_buf_alloc falló");
+  REQUIRE(device_read_bulk(&dev, 1024 * 1024, rb, len) == 0,
+          "read_bulk falló");
+  CHECK(memcmp(rb, buf, len) == 0, "read_bulk devolvió otros datos");
+  REQUIRE(read_raw(&dev, 1024 * 1024, rb, len) == 0, "lectura falló");
+  CHECK(memcmp(rb, buf, len) == 0, "lectura buffered ve datos antiguos");
+  REQUIRE(device_read_bulk(&dev, 3 * 1024 * 1024 + 7, rb, 1000) == 0,
+          "read_bulk desalineado falló");
+  CHECK(memcmp(rb, buf + 1, 1000) == 0, "datos desalineados incorrectos");
+
+  device_buf_free(rb, len);
+  device_buf_free(buf, len);
+  device_close(&dev);
+  unlink(path);
+  TEST_PASS();
+}
+
+static void test_buf_pool_reuse(void) {
+  TEST_START("A-10 direct: el pool reutiliza los buffers alineados");
+
+  device_buf_pool_drain();
+  struct device_buf_stats before, after;
+  device_buf_get_stats(&before);
+
+  /* 100 iteraciones del bucle de copia: una sola reserva real */
+  void *first = device_buf_alloc(1000 * 1000);
+  REQUIRE(first != NULL, "device_buf_alloc falló");
+  device_buf_free(first, 1000 * 1000);
+  int same = 1;
+  for (int i = 0; i < 100; i++) {
+    void *b = device_buf_alloc(1000 * 1000);
+    REQUIRE(b != NULL, "device_buf_alloc falló");
+    same &= b == first;
+    device_buf_free(b, 1000 * 1000);
+  }
+  device_buf_get_stats(&after);
+  CHECK(same, "el pool no devolvió el buffer liberado");
+  CHECK(after.allocs - before.allocs == 1, "reservas de más");
+  CHECK(after.reuses - before.reuses == 100, "reusos incorrectos");
+  CHECK(after.pooled == 1024 * 1024, "bytes en el pool incorrectos");
+
+  device_buf_pool_drain();
+  device_buf_get_stats(&after);
+  CHECK(after.pooled == 0, "drain no vació el pool");
+  TEST_PASS();
+}
+
 /* =========================================================================
  * GROUP B — Inode Bitmaps (Bug B-2)
  *
@@ -496,6 +710,73 @@ static void test_inode_bitmap_cross_group(void) {
   TEST_PASS();
 }
 
+static void test_bitmaps_multi_window(void) {
+  TEST_START("B-4  bitmaps: >1024 grupos, escritura y recuento por ventanas");
+
+  /* Imagen dispersa de 9 GiB con bloques de 1 KiB: 1152 grupos */
+  uint64_t size = 9ULL * 1024 * 1024 * 1024;
+  struct device dev;
+  REQUIRE(make_test_dev(&dev, "bitmapB4", size) == 0,
+          "no se pudo crear imagen");
+
+  struct ext4_layout layout;
+  REQUIRE(ext4_plan_layout(&layout, size, 1024, 16384, NULL) == 0,
+          "planner falló");
+  REQUIRE(layout.num_groups > 1024, "la imagen no cubre dos ventanas");
+
+  /* Un bloque de datos y un inodo en un grupo de la segunda ventana */
+  uint32_t g = 1100;
+  uint64_t blk = layout.groups[g].data_start_block + 5;
+  uint32_t ino = g * layout.inodes_per_group + 3;
+
+  struct inode_map imap;
+  memset(&imap, 0, sizeof(imap));
+  inode_map_add(&imap, 9999ULL, ino);
+
+  struct ext4_block_allocator alloc;
+  ext4_block_alloc_init(&alloc, &layout);
+  alloc.reserved_bitmap[blk / 8] |= (uint8_t)(1 << (blk % 8));
+
+  REQUIRE(ext4_write_gdt(&dev, &layout) == 0, "ext4_write_gdt falló");
+  REQUIRE(ext4_write_bitmaps(&dev, &layout, &alloc, &imap) == 0,
+          "ext4_write_bitmaps falló");
+  REQUIRE(ext4_update_free_counts(&dev, &layout, &alloc) == 0,
+          "ext4_update_free_counts falló");
+
+  uint8_t bbm[1024], ibm[1024];
+  REQUIRE(read_raw(&dev, layout.groups[g].block_bitmap_block * 1024, bbm,
+                   sizeof(bbm)) == 0 &&
+              read_raw(&dev, layout.groups[g].inode_bitmap_block * 1024, ibm,
+                       sizeof(ibm)) == 0,
+          "lectura de bitmaps falló");
+  uint64_t local = blk - layout.groups[g].group_start_block;
+  CHECK(bbm[local / 8] & (1 << (local % 8)), "bloque no marcado");
+  CHECK(ibm[0] == 0x04, "inodo no marcado en su grupo");
+
+  uint32_t used = 0;
+  for (uint32_t b = 0; b < layout.blocks_per_group; b++)
+    used += (bbm[b / 8] >> (b % 8)) & 1;
+
+  uint8_t gd[64];
+  REQUIRE(read_raw(&dev,
+                   layout.groups[0].gdt_start_block * 1024 +
+                       (uint64_t)g * layout.desc_size,
+                   gd, layout.desc_size) == 0,
+          "lectura GDT falló");
+  struct ext4_group_desc *desc = (struct ext4_group_desc *)gd;
+  CHECK(le16toh(desc->bg_free_blocks_count_lo) ==
+            layout.blocks_per_group - used,
+        "bloques libres del grupo incorrectos en la GDT");
+  CHECK(le16toh(desc->bg_free_inodes_count_lo) == layout.inodes_per_group - 1,
+        "inodos libres del grupo incorrectos en la GDT");
+
+  inode_map_free(&imap);
+  ext4_free_layout(&layout);
+  ext4_block_alloc_free(&alloc);
+  cleanup_test_dev(&dev);
+  TEST_PASS();
+}
+
 /* =========================================================================
  * GROUP C — GDT Offsets con desc_size=64 (Bug B-3)
  *
@@ -789,8 +1070,10 @@ static struct btrfs_fs_info *make_big_dir_fs(int n_children) {
 
     struct dir_entry_link *link = &fs->root_dir->children[i];
     link->target = child;
-    snprintf(link->name, sizeof(link->name), "file_%04d.dat", i);
-    link->name_len = (uint16_t)strlen(link->name);
+    char name[32];
+    snprintf(name, sizeof(name), "file_%04d.dat", i);
+    link->name_len = (uint16_t)strlen(name);
+    link->name_off = btrfs_intern_name(fs, name, link->name_len);
   }
 
   return fs;
@@ -814,6 +1097,8 @@ static void free_big_dir_fs(struct btrfs_fs_info *fs) {
     free(fs->chunk_map->entries);
     free(fs->chunk_map);
   }
+  str_pool_free(&fs->names);
+  arena_free(&fs->arena);
   free(fs);
 }
 
@@ -1067,6 +1352,226 @@ static void test_dir_huge_all_blocks_reachable(void) {
   cleanup_test_dev(&dev);
 }
 
+#define DMB_DIRS 2500
+
+static void test_dir_many_dirs_parallel(void) {
+  TEST_START("E-4  dir writer: 2500 subdirectorios en varios lotes");
+
+  struct device dev;
+  REQUIRE(make_test_dev(&dev, "dirE4", 256ULL * 1024 * 1024) == 0,
+          "no se pudo crear imagen");
+
+  struct ext4_layout layout;
+  REQUIRE(ext4_plan_layout(&layout, 256ULL * 1024 * 1024, TEST_BLOCK_SIZE,
+                           16384, NULL) == 0,
+          "planner falló");
+
+  /* Raíz HTree con 2500 hijos, todos directorios vacíos */
+  struct btrfs_fs_info *fs = make_big_dir_fs(DMB_DIRS);
+  struct inode_map imap;
+  memset(&imap, 0, sizeof(imap));
+  inode_map_add(&imap, 256, EXT4_ROOT_INO);
+  for (int i = 0; i < DMB_DIRS; i++) {
+    fs->inode_table[i + 1]->mode = S_IFDIR | 0755;
+    inode_map_add(&imap, (uint64_t)(257 + i),
+                  (uint32_t)(EXT4_GOOD_OLD_FIRST_INO + i));
+  }
+
+  struct ext4_block_allocator alloc;
+  ext4_block_alloc_init(&alloc, &layout);
+  ext4_write_gdt(&dev, &layout);
+  ext4_write_bitmaps(&dev, &layout, &alloc, NULL);
+  REQUIRE(ext4_write_directories(&dev, &layout, fs, &imap, &alloc) == 0,
+          "write_directories falló");
+
+  /* Cada subdirectorio: un bloque con "." y ".." correctos, asignados en
+   * orden de directorio aunque se construyan en paralelo */
+  int bad = 0, bad_order = 0;
+  uint64_t prev_blk = 0;
+  for (int i = 0; i < DMB_DIRS; i++) {
+    uint32_t ino = (uint32_t)(EXT4_GOOD_OLD_FIRST_INO + i);
+    uint32_t grp = (ino - 1) / layout.inodes_per_group;
+    uint32_t loc = (ino - 1) % layout.inodes_per_group;
+    struct ext4_inode inode;
+    if (read_raw(&dev,
+                 layout.groups[grp].inode_table_start * TEST_BLOCK_SIZE +
+                     (uint64_t)loc * layout.inode_size,
+                 &inode, sizeof(inode)) != 0) {
+      bad++;
+      continue;
+    }
+    struct ext4_extent_header *eh = (struct ext4_extent_header *)inode.i_block;
+    struct ext4_extent *ext = (struct ext4_extent *)(eh + 1);
+    if (le16toh(eh->eh_entries) != 1 || le16toh(ext->ee_len) != 1) {
+      bad++;
+      continue;
+    }
+    uint64_t blk = le32toh(ext->ee_start_lo);
+    if (blk <= prev_blk)
+      bad_order++;
+    prev_blk = blk;
+
+    uint8_t buf[TEST_BLOCK_SIZE];
+    if (read_raw(&dev, blk * TEST_BLOCK_SIZE, buf, sizeof(buf)) != 0) {
+      bad++;
+      continue;
+    }
+    struct ext4_dir_entry_2 *dot = (struct ext4_dir_entry_2 *)buf;
+    struct ext4_dir_entry_2 *dotdot =
+        (struct ext4_dir_entry_2 *)(buf + le16toh(dot->rec_len));
+    if (le32toh(dot->inode) != ino || dot->name_len != 1 ||
+        le32toh(dotdot->inode) != EXT4_ROOT_INO || dotdot->name_len != 2)
+      bad++;
+  }
+  CHECK(bad == 0, "bloques de subdirectorio incorrectos");
+  CHECK(bad_order == 0, "bloques no asignados en orden de directorio");
+
+  inode_map_free(&imap);
+  free_big_dir_fs(fs);
+  ext4_free_layout(&layout);
+  ext4_block_alloc_free(&alloc);
+  cleanup_test_dev(&dev);
+  TEST_PASS();
+}
+
+#define DLD_BLOCK 1024
+#define DLD_CHILDREN 64000 /* nombres de 200 bytes: 4 por bloque de 1 KiB */
+#define DLD_NAME_LEN 200
+
+/* Bloque físico del bloque lógico `lblk` de un directorio (depth 0 o 1) */
+static uint64_t dir_phys_block(struct device *dev,
+                               const struct ext4_inode *inode, uint32_t lblk) {
+  const struct ext4_extent_header *eh =
+      (const struct ext4_extent_header *)inode->i_block;
+  uint8_t leaf[DLD_BLOCK];
+  if (le16toh(eh->eh_depth) == 1) {
+    const struct ext4_extent_idx *idx = (const void *)(eh + 1);
+    uint16_t k = 0;
+    while (k + 1 < le16toh(eh->eh_entries) &&
+           le32toh(idx[k + 1].ei_block) <= lblk)
+      k++;
+    uint64_t blk = le32toh(idx[k].ei_leaf_lo) |
+                   ((uint64_t)le16toh(idx[k].ei_leaf_hi) << 32);
+    if (read_raw(dev, blk * DLD_BLOCK, leaf, sizeof(leaf)) != 0)
+      return 0;
+    eh = (const struct ext4_extent_header *)leaf;
+  }
+  const struct ext4_extent *ext = (const void *)(eh + 1);
+  for (uint16_t e = 0; e < le16toh(eh->eh_entries); e++) {
+    uint32_t start = le32toh(ext[e].ee_block);
+    if (lblk >= start && lblk < start + le16toh(ext[e].ee_len))
+      return (le32toh(ext[e].ee_start_lo) |
+              ((uint64_t)le16toh(ext[e].ee_start_hi) << 32)) +
+             (lblk - start);
+  }
+  return 0;
+}
+
+/* Último hijo de un nodo índice cuyo hash inicial es <= h */
+static uint32_t dx_lookup(const uint8_t *blk, uint32_t off, uint32_t h) {
+  const struct ext4_dx_countlimit *cl = (const void *)(blk + off);
+  const struct ext4_dx_entry *e = (const void *)(blk + off);
+  uint16_t k = 0;
+  while (k + 1 < le16toh(cl->count) && le32toh(e[k + 1].hash) <= h)
+    k++;
+  return le32toh(e[k].block);
+}
+
+static void test_dir_htree_three_levels(void) {
+  TEST_START("E-5  dir HTree: 64000 entradas en bloques de 1 KiB → 3 niveles");
+
+  struct device dev;
+  REQUIRE(make_test_dev(&dev, "dirE5", TEST_IMG_SIZE) == 0,
+          "no se pudo crear imagen");
+
+  struct ext4_layout layout;
+  REQUIRE(ext4_plan_layout(&layout, TEST_IMG_SIZE, DLD_BLOCK, 16384, NULL) ==
+              0,
+          "planner falló");
+
+  /* Nombres largos: la capacidad de 2 niveles (123 × 126 hojas con 1 KiB)
+   * no alcanza */
+  struct btrfs_fs_info *fs = make_big_dir_fs(DLD_CHILDREN);
+  struct inode_map imap;
+  memset(&imap, 0, sizeof(imap));
+  inode_map_add(&imap, 256, EXT4_ROOT_INO);
+  char name[DLD_NAME_LEN + 1];
+  for (int i = 0; i < DLD_CHILDREN; i++) {
+    struct dir_entry_link *link = &fs->root_dir->children[i];
+    memset(name, 'n', DLD_NAME_LEN);
+    snprintf(name, sizeof(name), "%06d", i);
+    name[6] = 'n';
+    link->name_len = DLD_NAME_LEN;
+    link->name_off = btrfs_intern_name(fs, name, DLD_NAME_LEN);
+    inode_map_add(&imap, (uint64_t)(257 + i),
+                  (uint32_t)(EXT4_GOOD_OLD_FIRST_INO + i));
+  }
+
+  struct ext4_block_allocator alloc;
+  ext4_block_alloc_init(&alloc, &layout);
+  REQUIRE(ext4_write_superblock(&dev, &layout, fs) == 0, "write_sb falló");
+  ext4_write_gdt(&dev, &layout);
+  ext4_write_bitmaps(&dev, &layout, &alloc, NULL);
+  REQUIRE(ext4_write_directories(&dev, &layout, fs, &imap, &alloc) == 0,
+          "write_directories falló");
+
+  struct ext4_super_block sb;
+  REQUIRE(read_raw(&dev, EXT4_SUPER_OFFSET, &sb, sizeof(sb)) == 0,
+          "lectura superbloque falló");
+  CHECK(le32toh(sb.s_feature_incompat) & EXT4_FEATURE_INCOMPAT_LARGEDIR,
+        "falta INCOMPAT_LARGEDIR");
+
+  struct ext4_inode inode;
+  uint64_t ino_off = layout.groups[0].inode_table_start * DLD_BLOCK +
+                     (uint64_t)(EXT4_ROOT_INO - 1) * layout.inode_size;
+  REQUIRE(read_raw(&dev, ino_off, &inode, sizeof(inode)) == 0,
+          "lectura inode raíz falló");
+
+  uint8_t root[DLD_BLOCK], blk[DLD_BLOCK];
+  REQUIRE(read_raw(&dev, dir_phys_block(&dev, &inode, 0) * DLD_BLOCK, root,
+                   sizeof(root)) == 0,
+          "lectura raíz HTree falló");
+  const struct ext4_dx_root_info *info = (const void *)(root + 24);
+  CHECK(info->indirect_levels == 2, "se esperaban 2 niveles índice");
+
+  /* Cada nombre muestreado se encuentra bajando raíz → nodo → nodo → hoja */
+  int missing = 0;
+  for (int i = 0; i < DLD_CHILDREN; i += 997) {
+    const struct dir_entry_link *link = &fs->root_dir->children[i];
+    const char *n = btrfs_link_name(fs, link);
+    uint32_t h = ext4_legacy_hash(n, DLD_NAME_LEN);
+    uint32_t lblk = dx_lookup(root, 32, h);
+    int found = 0;
+    for (int level = 0; level < 3; level++) {
+      if (read_raw(&dev, dir_phys_block(&dev, &inode, lblk) * DLD_BLOCK, blk,
+                   sizeof(blk)) != 0)
+        break;
+      if (level < 2) {
+        lblk = dx_lookup(blk, 8, h);
+        continue;
+      }
+      for (uint32_t off = 0; off < DLD_BLOCK;) {
+        const struct ext4_dir_entry_2 *de = (const void *)(blk + off);
+        if (le16toh(de->rec_len) == 0)
+          break;
+        if (de->name_len == DLD_NAME_LEN &&
+            memcmp(de->name, n, DLD_NAME_LEN) == 0)
+          found = 1;
+        off += le16toh(de->rec_len);
+      }
+    }
+    missing += !found;
+  }
+  CHECK(missing == 0, "nombres no encontrados a través del índice");
+
+  inode_map_free(&imap);
+  free_big_dir_fs(fs);
+  ext4_free_layout(&layout);
+  ext4_block_alloc_free(&alloc);
+  cleanup_test_dev(&dev);
+  TEST_PASS();
+}
+
 /* =========================================================================
  * GROUP F — GDT Checksums (Bug B-6)
  *
@@ -1117,7 +1622,7 @@ static void test_gdt_checksum_nonzero(void) {
 
 static void test_gdt_checksum_value_correct(void) {
   TEST_START(
-      "F-2  GDT csum: valor de bg_checksum coincide con CRC16 calculado");
+      "F-2  GDT csum: valor de bg_checksum coincide con el del kernel");
 
   struct device dev;
   REQUIRE(make_test_dev(&dev, "csuF2", TEST_IMG_SIZE) == 0,
@@ -1136,6 +1641,8 @@ static void test_gdt_checksum_value_correct(void) {
   struct ext4_super_block sb;
   REQUIRE(read_raw(&dev, EXT4_SUPER_OFFSET, &sb, sizeof(sb)) == 0,
           "lectura superbloque falló");
+  CHECK(le32toh(sb.s_checksum_seed) == raw_crc32c(~0U, sb.s_uuid, 16),
+        "s_checksum_seed no es el derivado del UUID");
 
   uint64_t gdt_start = layout.groups[0].gdt_start_block * TEST_BLOCK_SIZE;
   int mismatches = 0;
@@ -1146,7 +1653,7 @@ static void test_gdt_checksum_value_correct(void) {
     struct ext4_group_desc *d = (struct ext4_group_desc *)raw;
 
     uint16_t written = le16toh(d->bg_checksum);
-    uint16_t expected = expected_gdt_csum(sb.s_uuid, g, raw, layout.desc_size);
+    uint16_t expected = expected_gdt_csum(&sb, g, raw, layout.desc_size);
 
     if (written != expected) {
       mismatches++;
@@ -1286,6 +1793,109 @@ static void test_alloc_no_metadata_collision(void) {
   ext4_block_alloc_free(&alloc);
 }
 
+static void alloc_mark(struct ext4_block_allocator *alloc, uint64_t start,
+                       uint64_t end, int used) {
+  for (uint64_t b = start; b < end; b++) {
+    if (used)
+      alloc->reserved_bitmap[b / 8] |= (1 << (b % 8));
+    else
+      alloc->reserved_bitmap[b / 8] &= ~(1 << (b % 8));
+  }
+}
+
+static void test_alloc_run_contiguous(void) {
+  TEST_START("G-4  allocator: ext4_alloc_run salta huecos cortos y los marca");
+
+  struct ext4_layout layout;
+  REQUIRE(build_test_layout(&layout) == 0, "planner falló");
+
+  struct ext4_block_allocator alloc;
+  ext4_block_alloc_init(&alloc, &layout);
+  REQUIRE(alloc.reserved_bitmap != NULL, "sin bitmap");
+  ext4_alloc_set_goal(&alloc, &layout, 0);
+  alloc.cursor.group = 0;
+  alloc.cursor.block_in_group = 0;
+
+  /* Todo ocupado salvo dos huecos en el grupo 0: 3 (d+10) y 50 (d+70) */
+  for (uint32_t g = 0; g < layout.num_groups; g++)
+    alloc_mark(&alloc, layout.groups[g].data_start_block,
+               layout.groups[g].data_start_block +
+                   layout.groups[g].data_blocks,
+               1);
+  uint64_t d = layout.groups[0].data_start_block;
+  uint64_t group_end = d + layout.groups[0].data_blocks;
+  alloc_mark(&alloc, d + 10, d + 13, 0);
+  alloc_mark(&alloc, d + 70, d + 120, 0);
+
+  uint32_t got = 0;
+  uint64_t blk = ext4_alloc_run(&alloc, &layout, 20, &got);
+  CHECK(blk == d + 70 && got == 20, "no eligió el primer hueco que cabe");
+  CHECK(alloc.reserved_bitmap[(d + 89) / 8] & (1 << ((d + 89) % 8)),
+        "bloques del run no marcados");
+
+  /* Ningún hueco de 64: se queda con el más largo visto (30 en d+90) */
+  blk = ext4_alloc_run(&alloc, &layout, 64, &got);
+  CHECK(blk == d + 90 && got == 30, "no devolvió el run más largo");
+
+  /* Devolver la cola del último run: la siguiente petición la reutiliza */
+  ext4_release_run(&alloc, &layout, d + 110, 10);
+  blk = ext4_alloc_run(&alloc, &layout, 4, &got);
+  CHECK(blk == d + 110 && got == 4, "la cola liberada no se reutilizó");
+
+  /* Una sola petición de bloque sigue devolviendo el hueco corto al final */
+  alloc_mark(&alloc, d + 114, group_end, 1);
+  blk = ext4_alloc_block(&alloc, &layout);
+  CHECK(blk == d + 10, "wrap-around no encontró el hueco de 3");
+
+  ext4_free_layout(&layout);
+  ext4_block_alloc_free(&alloc);
+  TEST_PASS();
+}
+
+static void test_alloc_goal_flex_group(void) {
+  TEST_START("G-5  allocator: objetivo en el flex group del inodo + desborde");
+
+  /* 1 KiB blocks: 8 MiB por grupo, 32 grupos = 2 flex groups */
+  struct ext4_layout layout;
+  REQUIRE(ext4_plan_layout(&layout, 256ULL * 1024 * 1024, 1024, 16384,
+                           NULL) == 0,
+          "planner falló");
+  REQUIRE(layout.num_groups > EXT4_GROUPS_PER_FLEX, "pocos grupos");
+
+  struct ext4_block_allocator alloc;
+  ext4_block_alloc_init(&alloc, &layout);
+  REQUIRE(alloc.flex_cursors != NULL, "sin cursores por flex group");
+
+  uint32_t ino = 20 * layout.inodes_per_group + 5; /* grupo 20 → flex 1 */
+  uint64_t flex1_start = layout.groups[EXT4_GROUPS_PER_FLEX].group_start_block;
+
+  ext4_alloc_set_goal(&alloc, &layout, ino);
+  uint32_t got = 0;
+  uint64_t blk = ext4_alloc_run(&alloc, &layout, 64, &got);
+  CHECK(blk != (uint64_t)-1 && got == 64, "asignación falló");
+  CHECK(blk >= flex1_start, "no se asignó en el flex group del inodo");
+
+  /* Sin objetivo se sigue usando el cursor global (grupo 0 en adelante) */
+  ext4_alloc_set_goal(&alloc, &layout, 0);
+  blk = ext4_alloc_block(&alloc, &layout);
+  CHECK(blk < flex1_start, "sin objetivo no usó el cursor global");
+
+  /* Flex group 1 lleno: desborda al siguiente y lo cuenta */
+  for (uint32_t g = EXT4_GROUPS_PER_FLEX; g < layout.num_groups; g++)
+    alloc_mark(&alloc, layout.groups[g].data_start_block,
+               layout.groups[g].data_start_block +
+                   layout.groups[g].data_blocks,
+               1);
+  ext4_alloc_set_goal(&alloc, &layout, ino);
+  blk = ext4_alloc_run(&alloc, &layout, 8, &got);
+  CHECK(blk != (uint64_t)-1 && blk < flex1_start, "no desbordó");
+  CHECK(alloc.goal_spills == 1, "desborde no contado");
+
+  ext4_free_layout(&layout);
+  ext4_block_alloc_free(&alloc);
+  TEST_PASS();
+}
+
 /* =========================================================================
  * GROUP H — Journal Zeroing (Bug B-7)
  *
@@ -1484,7 +2094,7 @@ static void test_e2e_free_counts_consistent(void) {
   ext4_write_superblock(&dev, &layout, fs);
   ext4_write_gdt(&dev, &layout);
   ext4_write_bitmaps(&dev, &layout, &alloc, NULL);
-  ext4_update_free_counts(&dev, &layout);
+  ext4_update_free_counts(&dev, &layout, &alloc);
 
   /* Leer superbloque y sumar free_blocks de todos los grupos */
   struct ext4_super_block sb;
@@ -1683,10 +2293,1102 @@ static void test_e2e_reserved_inodes_not_free(void) {
   TEST_PASS();
 }
 
+#define LAZY_IMG_SIZE (512ULL * 1024 * 1024)
+#define LAZY_FILES 40
+
+static int read_desc(struct device *dev, const struct ext4_layout *layout,
+                     uint32_t g, uint8_t *raw) {
+  return read_raw(dev,
+                  layout->groups[0].gdt_start_block * TEST_BLOCK_SIZE +
+                      (uint64_t)g * layout->desc_size,
+                  raw, layout->desc_size);
+}
+
+static void test_e2e_lazy_inode_tables(void) {
+  TEST_START("I-7  E2E: tablas de inodos por prefijo y flags uninit_bg");
+
+  struct device dev;
+  REQUIRE(make_test_dev(&dev, "e2eI7", LAZY_IMG_SIZE) == 0,
+          "no se pudo crear imagen");
+
+  struct ext4_layout layout;
+  REQUIRE(ext4_plan_layout(&layout, LAZY_IMG_SIZE, TEST_BLOCK_SIZE, 16384,
+                           NULL) == 0,
+          "planner falló");
+  REQUIRE(layout.num_groups >= 4, "pocos grupos");
+
+  /* Marcar la tabla entera de cada grupo: lo que no se escriba lo conserva */
+  uint8_t mark[TEST_BLOCK_SIZE];
+  memset(mark, 0xA5, sizeof(mark));
+  for (uint32_t g = 0; g < layout.num_groups; g++)
+    for (uint32_t b = 0; b < layout.groups[g].inode_table_blocks; b++)
+      REQUIRE(device_write(&dev,
+                           (layout.groups[g].inode_table_start + b) *
+                               TEST_BLOCK_SIZE,
+                           mark, sizeof(mark)) == 0,
+              "escritura de marca falló");
+
+  struct btrfs_fs_info *fs = make_big_dir_fs(LAZY_FILES);
+  struct inode_map imap;
+  memset(&imap, 0, sizeof(imap));
+  struct ext4_block_allocator alloc;
+  ext4_block_alloc_init(&alloc, &layout);
+  REQUIRE(ext4_write_superblock(&dev, &layout, fs) == 0, "write_sb falló");
+  REQUIRE(ext4_write_gdt(&dev, &layout) == 0, "write_gdt falló");
+  REQUIRE(ext4_write_inode_table(&dev, &layout, fs, &imap, &alloc) == 0,
+          "ext4_write_inode_table falló");
+  REQUIRE(ext4_write_bitmaps(&dev, &layout, &alloc, &imap) == 0,
+          "write_bitmaps falló");
+  REQUIRE(ext4_update_free_counts(&dev, &layout, &alloc) == 0,
+          "update_free_counts falló");
+
+  struct ext4_super_block sb;
+  REQUIRE(read_raw(&dev, EXT4_SUPER_OFFSET, &sb, sizeof(sb)) == 0,
+          "lectura superbloque falló");
+
+  /* Grupo 0: inodos 1..used en uso, la tabla escrita hasta su bloque */
+  uint32_t used = EXT4_GOOD_OLD_FIRST_INO - 1 + LAZY_FILES;
+  uint32_t ipg = layout.inodes_per_group;
+  uint8_t raw[64];
+  REQUIRE(read_desc(&dev, &layout, 0, raw) == 0, "lectura GDT falló");
+  struct ext4_group_desc *d = (struct ext4_group_desc *)raw;
+  uint16_t flags = le16toh(d->bg_flags);
+  CHECK(!(flags & (EXT4_BG_INODE_UNINIT | EXT4_BG_BLOCK_UNINIT)),
+        "grupo 0 marcado uninit");
+  CHECK(!(flags & EXT4_BG_INODE_ZEROED), "grupo 0 marcado zeroed");
+  CHECK(le16toh(d->bg_itable_unused_lo) == ipg - used,
+        "bg_itable_unused del grupo 0 incorrecto");
+
+  uint32_t per_block = TEST_BLOCK_SIZE / layout.inode_size;
+  uint64_t t0 = layout.groups[0].inode_table_start;
+  uint8_t blk[TEST_BLOCK_SIZE];
+  REQUIRE(read_raw(&dev, (t0 + (used - 1) / per_block) * TEST_BLOCK_SIZE, blk,
+                   sizeof(blk)) == 0,
+          "lectura tabla falló");
+  CHECK(blk[sizeof(blk) - 1] == 0, "cola del último bloque usado sin poner "
+                                   "a cero");
+  REQUIRE(read_raw(&dev, (t0 + (used - 1) / per_block + 1) * TEST_BLOCK_SIZE,
+                   blk, sizeof(blk)) == 0,
+          "lectura tabla falló");
+  CHECK(blk[0] == 0xA5, "tabla del grupo 0 escrita más allá del prefijo");
+
+  /* Resto: sin inodos y, salvo el último, sin más bloques que los base */
+  int bad_flags = 0, written = 0, bad_csum = 0;
+  for (uint32_t g = 0; g < layout.num_groups; g++) {
+    REQUIRE(read_desc(&dev, &layout, g, raw) == 0, "lectura GDT falló");
+    if (le16toh(d->bg_checksum) !=
+        expected_gdt_csum(&sb, g, raw, layout.desc_size))
+      bad_csum++;
+    if (g == 0)
+      continue;
+    flags = le16toh(d->bg_flags);
+    uint16_t want = EXT4_BG_INODE_UNINIT;
+    if (g != layout.num_groups - 1)
+      want |= EXT4_BG_BLOCK_UNINIT;
+    if (flags != want || le16toh(d->bg_itable_unused_lo) != ipg)
+      bad_flags++;
+    REQUIRE(read_raw(&dev, layout.groups[g].inode_table_start * TEST_BLOCK_SIZE,
+                     blk, sizeof(blk)) == 0,
+            "lectura tabla falló");
+    if (blk[0] != 0xA5)
+      written++;
+  }
+  CHECK(bad_flags == 0, "flags o bg_itable_unused de grupos vacíos mal");
+  CHECK(written == 0, "tabla de un grupo sin inodos escrita");
+  CHECK(bad_csum == 0, "bg_checksum incorrecto");
+
+  /* Sin tablas perezosas todas constan como puestas a cero */
+  ext4_itable_set_lazy_policy(0);
+  REQUIRE(ext4_update_free_counts(&dev, &layout, &alloc) == 0,
+          "update_free_counts falló");
+  ext4_itable_set_lazy_policy(1);
+  REQUIRE(read_desc(&dev, &layout, 1, raw) == 0, "lectura GDT falló");
+  CHECK(le16toh(d->bg_flags) & EXT4_BG_INODE_ZEROED,
+        "INODE_ZEROED ausente con --no-lazy-itable");
+
+  inode_map_free(&imap);
+  free_big_dir_fs(fs);
+  ext4_free_layout(&layout);
+  ext4_block_alloc_free(&alloc);
+  cleanup_test_dev(&dev);
+  TEST_PASS();
+}
+
+/*
+ * I-8: los bitmaps de bloques se escriben antes de que el journal y los
+ * directorios tomen sus bloques. ext4_update_free_counts debe volcar el
+ * bitmap del allocator: ningún grupo con bloques del journal o de un
+ * extent asignado puede quedar BLOCK_UNINIT ni contarlos como libres.
+ */
+static void test_e2e_block_uninit_respects_alloc(void) {
+  TEST_START("I-8  E2E: BLOCK_UNINIT nunca en grupos con journal o extents");
+
+  struct device dev;
+  REQUIRE(make_test_dev(&dev, "e2eI8", LAZY_IMG_SIZE) == 0,
+          "no se pudo crear imagen");
+
+  struct ext4_layout layout;
+  REQUIRE(ext4_plan_layout(&layout, LAZY_IMG_SIZE, TEST_BLOCK_SIZE, 16384,
+                           NULL) == 0,
+          "planner falló");
+  REQUIRE(layout.num_groups >= 4, "pocos grupos");
+
+  struct btrfs_fs_info *fs = make_big_dir_fs(LAZY_FILES);
+  struct inode_map imap;
+  memset(&imap, 0, sizeof(imap));
+  struct ext4_block_allocator alloc;
+  ext4_block_alloc_init(&alloc, &layout);
+  REQUIRE(ext4_write_superblock(&dev, &layout, fs) == 0, "write_sb falló");
+  REQUIRE(ext4_write_gdt(&dev, &layout) == 0, "write_gdt falló");
+  REQUIRE(ext4_write_inode_table(&dev, &layout, fs, &imap, &alloc) == 0,
+          "ext4_write_inode_table falló");
+  REQUIRE(ext4_write_bitmaps(&dev, &layout, &alloc, &imap) == 0,
+          "write_bitmaps falló");
+
+  /* Tras los bitmaps: el último grupo se llena (datos al final del
+   * dispositivo), así el journal cae en un grupo intermedio, y un extent
+   * de 100 bloques se asigna en el grupo 1 */
+  uint32_t last = layout.num_groups - 1;
+  for (uint64_t b = layout.groups[last].group_start_block;
+       b < layout.total_blocks; b++)
+    alloc.reserved_bitmap[b / 8] |= (uint8_t)(1 << (b % 8));
+  uint64_t ext_start = layout.groups[1].group_start_block +
+                       layout.blocks_per_group / 2;
+  for (uint64_t b = ext_start; b < ext_start + 100; b++)
+    alloc.reserved_bitmap[b / 8] |= (uint8_t)(1 << (b % 8));
+
+  REQUIRE(ext4_write_journal(&dev, &layout, &alloc, LAZY_IMG_SIZE) == 0,
+          "ext4_write_journal falló");
+  uint64_t js = ext4_journal_start_block();
+  uint64_t je = js + ext4_journal_block_count();
+  REQUIRE(js / layout.blocks_per_group < last,
+          "el journal no cayó en un grupo intermedio");
+  REQUIRE(ext4_update_free_counts(&dev, &layout, &alloc) == 0,
+          "update_free_counts falló");
+
+  uint8_t raw[64];
+  struct ext4_group_desc *d = (struct ext4_group_desc *)raw;
+  uint8_t bitmap[TEST_BLOCK_SIZE];
+  int uninit_used = 0, missing = 0, bad_free = 0;
+  for (uint32_t g = 0; g < layout.num_groups; g++) {
+    uint64_t start = layout.groups[g].group_start_block;
+    uint64_t end = g == last ? layout.total_blocks
+                             : start + layout.blocks_per_group;
+    REQUIRE(read_desc(&dev, &layout, g, raw) == 0, "lectura GDT falló");
+    REQUIRE(read_raw(&dev,
+                     layout.groups[g].block_bitmap_block * TEST_BLOCK_SIZE,
+                     bitmap, sizeof(bitmap)) == 0,
+            "lectura bitmap falló");
+    uint32_t free_blocks = 0;
+    for (uint64_t b = start; b < end; b++) {
+      int held = (alloc.reserved_bitmap[b / 8] >> (b % 8)) & 1;
+      int on_disk = (bitmap[(b - start) / 8] >> ((b - start) % 8)) & 1;
+      if (held && !on_disk)
+        missing++;
+      if (!on_disk)
+        free_blocks++;
+    }
+    if (le16toh(d->bg_free_blocks_count_lo) != (free_blocks & 0xFFFF))
+      bad_free++;
+    int journal = js < end && je > start;
+    int extent = ext_start < end && ext_start + 100 > start;
+    if ((journal || extent) &&
+        (le16toh(d->bg_flags) & EXT4_BG_BLOCK_UNINIT))
+      uninit_used++;
+  }
+  CHECK(uninit_used == 0, "grupo con journal o extent marcado BLOCK_UNINIT");
+  CHECK(missing == 0, "bloques del allocator ausentes del bitmap en disco");
+  CHECK(bad_free == 0, "bg_free_blocks_count no cuadra con el bitmap");
+
+  inode_map_free(&imap);
+  free_big_dir_fs(fs);
+  ext4_free_layout(&layout);
+  ext4_block_alloc_free(&alloc);
+  cleanup_test_dev(&dev);
+  TEST_PASS();
+}
+
 /* =========================================================================
  * Main
  * ======================================================================= */
 
+/* ========================================================================
+ * GROUP J: Journal de relocación con group commit
+ * ======================================================================== */
+
+#define JRN_OFFSET (1ULL * 1024 * 1024)
+
+static void jrn_make_entry(struct relocation_entry *e, uint32_t seq) {
+  memset(e, 0, sizeof(*e));
+  e->src_offset = 16ULL * 1024 * 1024 + (uint64_t)seq * TEST_BLOCK_SIZE;
+  e->dst_offset = 64ULL * 1024 * 1024 + (uint64_t)seq * TEST_BLOCK_SIZE;
+  e->length = TEST_BLOCK_SIZE;
+  e->seq = seq;
+}
+
+static void test_journal_group_commit_window(void) {
+  TEST_START("J-1  journal: ventana de N entradas agrupa los commits");
+
+  struct device dev;
+  REQUIRE(make_test_dev(&dev, "jrnJ1", TEST_IMG_SIZE) == 0,
+          "no se pudo crear imagen");
+  REQUIRE(journal_init(&dev, JRN_OFFSET) == 0, "journal_init falló");
+  journal_set_group_window(4, 0, 0);
+
+  int commits = 0;
+  for (uint32_t i = 0; i < 10; i++) {
+    struct relocation_entry e;
+    jrn_make_entry(&e, 100 + i);
+    int r = journal_stage_move(&dev, &e);
+    CHECK(r >= 0, "journal_stage_move falló");
+    commits += r;
+  }
+  CHECK(commits == 2, "se esperaban 2 commits automáticos (4+4)");
+  CHECK(journal_staged_count() == 2, "deberían quedar 2 entradas en staging");
+  CHECK(journal_commit(&dev) == 0, "journal_commit final falló");
+
+  struct journal_header hdr;
+  REQUIRE(read_raw(&dev, JRN_OFFSET, &hdr, sizeof(hdr)) == 0,
+          "lectura header falló");
+  CHECK(le32toh(hdr.version) == JOURNAL_VERSION_GROUPED, "versión != 2");
+  CHECK(le32toh(hdr.group_count) == 3, "group_count != 3");
+  CHECK(le32toh(hdr.entry_count) == 10, "entry_count != 10");
+
+  CHECK(journal_check(&dev, JRN_OFFSET) == 10, "10 entradas incompletas");
+  CHECK(journal_mark_complete(&dev, 101) == 0, "mark_complete(101) falló");
+  CHECK(journal_mark_complete(&dev, 109) == 0, "mark_complete(109) falló");
+  CHECK(journal_mark_complete(&dev, 7) < 0, "seq desconocido aceptado");
+  CHECK(journal_check(&dev, JRN_OFFSET) == 8,
+        "marcar completo rompió el CRC del grupo");
+
+  journal_set_group_window(JOURNAL_DEFAULT_GROUP_ENTRIES,
+                           JOURNAL_DEFAULT_GROUP_BYTES,
+                           JOURNAL_DEFAULT_GROUP_MS);
+  journal_clear(&dev, JRN_OFFSET);
+  cleanup_test_dev(&dev);
+  TEST_PASS();
+}
+
+static void test_journal_group_replay_reverses(void) {
+  TEST_START("J-2  journal: replay revierte movimientos completados");
+
+  struct device dev;
+  REQUIRE(make_test_dev(&dev, "jrnJ2", TEST_IMG_SIZE) == 0,
+          "no se pudo crear imagen");
+  REQUIRE(journal_init(&dev, JRN_OFFSET) == 0, "journal_init falló");
+  journal_set_group_window(3, 0, 0);
+
+  uint8_t data[TEST_BLOCK_SIZE], zero[TEST_BLOCK_SIZE], buf[TEST_BLOCK_SIZE];
+  memset(zero, 0, sizeof(zero));
+
+  /* Mover 5 bloques: src → dst y luego "reutilizar" src con ceros */
+  for (uint32_t i = 0; i < 5; i++) {
+    struct relocation_entry e;
+    jrn_make_entry(&e, i);
+    memset(data, 0x40 + (int)i, sizeof(data));
+    device_write(&dev, e.src_offset, data, sizeof(data));
+    CHECK(journal_stage_move(&dev, &e) >= 0, "stage falló");
+  }
+  CHECK(journal_commit(&dev) == 0, "commit falló");
+
+  for (uint32_t i = 0; i < 4; i++) {
+    struct relocation_entry e;
+    jrn_make_entry(&e, i);
+    device_read(&dev, e.src_offset, data, sizeof(data));
+    device_write(&dev, e.dst_offset, data, sizeof(data));
+    device_write(&dev, e.src_offset, zero, sizeof(zero));
+    CHECK(journal_mark_complete(&dev, i) == 0, "mark_complete falló");
+  }
+
+  CHECK(journal_replay(&dev, JRN_OFFSET) == 0, "journal_replay falló");
+
+  for (uint32_t i = 0; i < 4; i++) {
+    struct relocation_entry e;
+    jrn_make_entry(&e, i);
+    CHECK(read_raw(&dev, e.src_offset, buf, sizeof(buf)) == 0, "read falló");
+    CHECK(buf[0] == 0x40 + i && buf[TEST_BLOCK_SIZE - 1] == 0x40 + i,
+          "src no fue restaurado desde dst");
+  }
+  CHECK(journal_check(&dev, JRN_OFFSET) == 0,
+        "journal no quedó limpio tras replay");
+
+  journal_set_group_window(JOURNAL_DEFAULT_GROUP_ENTRIES,
+                           JOURNAL_DEFAULT_GROUP_BYTES,
+                           JOURNAL_DEFAULT_GROUP_MS);
+  cleanup_test_dev(&dev);
+  TEST_PASS();
+}
+
+static void test_journal_torn_group_ignored(void) {
+  TEST_START("J-3  journal: grupo roto (CRC) y registros viejos se ignoran");
+
+  struct device dev;
+  REQUIRE(make_test_dev(&dev, "jrnJ3", TEST_IMG_SIZE) == 0,
+          "no se pudo crear imagen");
+
+  /* Ejecución anterior: 3 grupos de 2 entradas, luego limpia */
+  REQUIRE(journal_init(&dev, JRN_OFFSET) == 0, "journal_init falló");
+  journal_set_group_window(2, 0, 0);
+  for (uint32_t i = 0; i < 6; i++) {
+    struct relocation_entry e;
+    jrn_make_entry(&e, i);
+    CHECK(journal_stage_move(&dev, &e) >= 0, "stage falló");
+  }
+  CHECK(journal_clear(&dev, JRN_OFFSET) == 0, "clear falló");
+
+  /* Nueva ejecución en el mismo offset: 2 grupos de 2 */
+  REQUIRE(journal_init(&dev, JRN_OFFSET) == 0, "journal_init (2) falló");
+  for (uint32_t i = 0; i < 4; i++) {
+    struct relocation_entry e;
+    jrn_make_entry(&e, 50 + i);
+    CHECK(journal_stage_move(&dev, &e) >= 0, "stage falló");
+  }
+  CHECK(journal_check(&dev, JRN_OFFSET) == 4,
+        "registros de la ejecución anterior fueron aceptados");
+
+  /* Romper el segundo grupo: solo el primero sigue siendo válido */
+  uint8_t junk = 0x5A;
+  device_write(&dev,
+               JRN_OFFSET + 2 * JOURNAL_BLOCK_SIZE +
+                   sizeof(struct journal_group_header) + 3,
+               &junk, 1);
+  CHECK(journal_check(&dev, JRN_OFFSET) == 2,
+        "grupo con CRC inválido fue aceptado");
+
+  journal_set_group_window(JOURNAL_DEFAULT_GROUP_ENTRIES,
+                           JOURNAL_DEFAULT_GROUP_BYTES,
+                           JOURNAL_DEFAULT_GROUP_MS);
+  journal_clear(&dev, JRN_OFFSET);
+  cleanup_test_dev(&dev);
+  TEST_PASS();
+}
+
+/* ========================================================================
+ * GROUP K: Relocación en pipeline (anillo de buffers)
+ * ======================================================================== */
+
+#define RLC_BASE (16ULL * 1024 * 1024)
+#define RLC_SPAN (32ULL * 1024 * 1024)
+#define RLC_BLK(n) (RLC_BASE + (uint64_t)(n) * TEST_BLOCK_SIZE)
+
+/* Cadena de movimientos donde varios src pisan dst anteriores */
+static void rlc_make_plan(struct relocation_entry *e, uint32_t *count) {
+  static const struct {
+    uint64_t src, dst, len;
+  } moves[] = {
+      {RLC_BLK(0), RLC_BLK(4), 4 * TEST_BLOCK_SIZE},
+      {RLC_BLK(4), RLC_BLK(8), 4 * TEST_BLOCK_SIZE},   /* lee lo que escribió 0 */
+      {RLC_BLK(20), RLC_BLK(30), 4 * TEST_BLOCK_SIZE}, /* independiente */
+      {RLC_BLK(31), RLC_BLK(0), 2 * TEST_BLOCK_SIZE},  /* solapa en parte con 2 */
+      {RLC_BLK(40), RLC_BLK(50), 8 * TEST_BLOCK_SIZE},
+      {RLC_BASE + 8ULL * 1024 * 1024, RLC_BASE + 12ULL * 1024 * 1024,
+       3ULL * 1024 * 1024}, /* varios chunks con profundidad 8 */
+      {RLC_BASE + 13ULL * 1024 * 1024, RLC_BASE + 20ULL * 1024 * 1024,
+       1ULL * 1024 * 1024}, /* origen dentro del destino anterior */
+  };
+  *count = (uint32_t)(sizeof(moves) / sizeof(moves[0]));
+  for (uint32_t i = 0; i < *count; i++) {
+    memset(&e[i], 0, sizeof(e[i]));
+    e[i].src_offset = moves[i].src;
+    e[i].dst_offset = moves[i].dst;
+    e[i].length = moves[i].len;
+    e[i].seq = i;
+  }
+}
+
+static int rlc_run(uint32_t depth, const uint8_t *initial, uint8_t *result,
+                   uint32_t *checksums) {
+  struct device dev;
+  if (make_test_dev(&dev, "rlcK", TEST_IMG_SIZE) != 0)
+    return -1;
+  int ret = -1;
+  if (device_write(&dev, RLC_BASE, initial, RLC_SPAN) < 0)
+    goto out;
+
+  struct relocation_entry entries[8];
+  struct relocation_plan plan = {.entries = entries, .capacity = 8};
+  rlc_make_plan(entries, &plan.count);
+
+  struct btrfs_fs_info fs_info;
+  memset(&fs_info, 0, sizeof(fs_info));
+
+  relocator_set_pipeline_depth(depth);
+  int r = relocator_execute(&plan, &dev, &fs_info, TEST_BLOCK_SIZE);
+  relocator_set_pipeline_depth(0);
+  if (r < 0 || read_raw(&dev, RLC_BASE, result, RLC_SPAN) < 0)
+    goto out;
+  ret = 0;
+  for (uint32_t i = 0; i < plan.count; i++) {
+    checksums[i] = entries[i].checksum;
+    if (!entries[i].completed)
+      ret = -1;
+  }
+out:
+  cleanup_test_dev(&dev);
+  return ret;
+}
+
+static void test_relocator_pipeline_matches_serial(void) {
+  TEST_START("K-1  relocator: pipeline depth 1/8 == ejecución serial");
+
+  uint8_t *initial = malloc(RLC_SPAN);
+  uint8_t *expected = malloc(RLC_SPAN);
+  uint8_t *result = malloc(RLC_SPAN);
+  REQUIRE(initial && expected && result, "malloc falló");
+
+  for (uint64_t i = 0; i < RLC_SPAN; i++)
+    initial[i] = (uint8_t)((i / TEST_BLOCK_SIZE) * 7 + i);
+
+  /* Referencia: aplicar los movimientos uno a uno en memoria */
+  struct relocation_entry ref[8];
+  uint32_t n;
+  rlc_make_plan(ref, &n);
+  memcpy(expected, initial, RLC_SPAN);
+  for (uint32_t i = 0; i < n; i++)
+    memmove(expected + (ref[i].dst_offset - RLC_BASE),
+            expected + (ref[i].src_offset - RLC_BASE), ref[i].length);
+
+  uint32_t crc1[8], crc8[8];
+  CHECK(rlc_run(1, initial, result, crc1) == 0, "depth 1 falló");
+  CHECK(memcmp(result, expected, RLC_SPAN) == 0,
+        "depth 1: datos distintos de la referencia");
+  CHECK(rlc_run(8, initial, result, crc8) == 0, "depth 8 falló");
+  CHECK(memcmp(result, expected, RLC_SPAN) == 0,
+        "depth 8: un src se leyó antes de que su dst previo se escribiera");
+  CHECK(memcmp(crc1, crc8, n * sizeof(uint32_t)) == 0,
+        "checksums por entrada dependen de la profundidad");
+
+  free(initial);
+  free(expected);
+  free(result);
+  TEST_PASS();
+}
+
+/* ========================================================================
+ * GROUP L: Descompresión en streaming
+ * ======================================================================== */
+
+#define DCS_PHYS (4ULL * 1024 * 1024)
+#define DCS_LEN (300 * 1024 + 123) /* no múltiplo de bloque */
+
+struct dcs_sink {
+  uint8_t *out;
+  uint64_t expect_offset;
+  uint32_t calls;
+  int bad;
+};
+
+/* Btrfs guarda deflate crudo (windowBits -15); devuelve 0 si falla */
+static uint64_t dcs_deflate(const uint8_t *in, uint32_t len, uint8_t *out,
+                            uint64_t cap) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return 0;
+  zs.next_in = (uint8_t *)in;
+  zs.avail_in = len;
+  zs.next_out = out;
+  zs.avail_out = (uInt)cap;
+  int r = deflate(&zs, Z_FINISH);
+  uint64_t n = zs.total_out;
+  deflateEnd(&zs);
+  return r == Z_STREAM_END ? n : 0;
+}
+
+static int dcs_collect(const uint8_t *data, size_t len, uint64_t offset,
+                       void *arg) {
+  struct dcs_sink *s = arg;
+  if (offset != s->expect_offset || len % TEST_BLOCK_SIZE != 0)
+    s->bad = 1;
+  memcpy(s->out + offset, data, len);
+  s->expect_offset += len;
+  s->calls++;
+  return 0;
+}
+
+static void test_decompress_zlib_stream_window(void) {
+  TEST_START("L-1  decompress: zlib en ventanas de 16 KiB == original");
+
+  uint8_t *plain = malloc(DCS_LEN);
+  uLong bound = compressBound(DCS_LEN);
+  uint8_t *comp = calloc(1, bound + TEST_BLOCK_SIZE);
+  uint32_t padded = (DCS_LEN + TEST_BLOCK_SIZE - 1) / TEST_BLOCK_SIZE *
+                    TEST_BLOCK_SIZE;
+  uint8_t *out = malloc(padded);
+  REQUIRE(plain && comp && out, "malloc falló");
+
+  for (uint32_t i = 0; i < DCS_LEN; i++)
+    plain[i] = (uint8_t)((i % 251) ^ (i / 4096));
+  memset(out, 0xEE, padded);
+
+  uint64_t comp_len = dcs_deflate(plain, DCS_LEN, comp, bound);
+  REQUIRE(comp_len > 0, "deflate falló");
+
+  struct device dev;
+  REQUIRE(make_test_dev(&dev, "dcsL", 8 * 1024 * 1024) == 0,
+          "no se pudo crear imagen");
+  uint64_t disk_len = (comp_len + TEST_BLOCK_SIZE - 1) / TEST_BLOCK_SIZE *
+                      TEST_BLOCK_SIZE;
+  REQUIRE(device_write(&dev, DCS_PHYS, comp, disk_len) == 0,
+          "escritura del extent comprimido falló");
+
+  /* Mapa identidad: lógico == físico */
+  struct chunk_mapping cm = {0};
+  cm.logical = 0;
+  cm.physical = 0;
+  cm.length = 8 * 1024 * 1024;
+  struct chunk_map map = {.entries = &cm, .count = 1, .capacity = 1};
+
+  struct file_extent ext;
+  memset(&ext, 0, sizeof(ext));
+  ext.type = BTRFS_FILE_EXTENT_REG;
+  ext.compression = BTRFS_COMPRESS_ZLIB;
+  ext.disk_bytenr = DCS_PHYS;
+  ext.disk_num_bytes = disk_len;
+  ext.num_bytes = padded;
+  ext.ram_bytes = DCS_LEN;
+
+  uint8_t window[4 * TEST_BLOCK_SIZE];
+  struct dcs_sink sink = {.out = out};
+  uint64_t out_len = 0;
+  int r = btrfs_decompress_extent_stream(&dev, &map, &ext, TEST_BLOCK_SIZE,
+                                         window, sizeof(window), dcs_collect,
+                                         &sink, &out_len);
+  CHECK(r == 0, "btrfs_decompress_extent_stream falló");
+  CHECK(out_len == DCS_LEN, "longitud descomprimida incorrecta");
+  CHECK(!sink.bad, "trozo desalineado o fuera de orden");
+  CHECK(sink.expect_offset == padded, "no se entregó hasta el final de bloque");
+  CHECK(sink.calls > 1, "la salida no se entregó por ventanas");
+  CHECK(memcmp(out, plain, DCS_LEN) == 0, "datos descomprimidos distintos");
+  int tail_zero = 1;
+  for (uint32_t i = DCS_LEN; i < padded; i++)
+    if (out[i] != 0)
+      tail_zero = 0;
+  CHECK(tail_zero, "cola del último bloque no está a cero");
+
+  /* Flujo truncado: debe fallar, no rellenar con ceros */
+  ext.disk_num_bytes = comp_len / 2;
+  sink.expect_offset = 0;
+  r = btrfs_decompress_extent_stream(&dev, &map, &ext, TEST_BLOCK_SIZE, window,
+                                     sizeof(window), dcs_collect, &sink,
+                                     &out_len);
+  CHECK(r < 0, "flujo zlib truncado aceptado");
+
+  cleanup_test_dev(&dev);
+  free(plain);
+  free(comp);
+  free(out);
+  TEST_PASS();
+}
+
+#define DCP_FILES 300
+#define DCP_LEN (3 * TEST_BLOCK_SIZE + 777)
+#define DCP_RAM (4 * TEST_BLOCK_SIZE)
+#define DCP_COMP_BASE (200ULL * 1024 * 1024)
+#define DCP_COMP_SLOT (4 * TEST_BLOCK_SIZE)
+
+/* Como Btrfs, se comprimen páginas completas: la cola tras i_size es cero */
+static void dcp_fill(uint8_t *buf, int file) {
+  memset(buf, 0, DCP_RAM);
+  for (uint32_t i = 0; i < DCP_LEN; i++)
+    buf[i] = (uint8_t)(file * 31 + (i % 97) + (i / 1000));
+}
+
+static void test_decompress_pipeline_many_files(void) {
+  TEST_START("L-2  inode_writer: 300 ficheros zlib por el pipeline");
+
+  struct device dev;
+  REQUIRE(make_test_dev(&dev, "dcpL", 256ULL * 1024 * 1024) == 0,
+          "no se pudo crear imagen");
+
+  struct ext4_layout layout;
+  REQUIRE(ext4_plan_layout(&layout, 256ULL * 1024 * 1024, TEST_BLOCK_SIZE,
+                           16384, NULL) == 0,
+          "planner falló");
+
+  /* Un extent zlib por fichero, en una zona que el allocator no alcanza */
+  struct btrfs_fs_info *fs = make_big_dir_fs(DCP_FILES);
+  uint8_t plain[DCP_RAM];
+  uint8_t comp[DCP_COMP_SLOT];
+  for (int i = 0; i < DCP_FILES; i++) {
+    dcp_fill(plain, i);
+    memset(comp, 0, sizeof(comp));
+    uint64_t clen = dcs_deflate(plain, DCP_RAM, comp, sizeof(comp));
+    REQUIRE(clen > 0, "deflate falló");
+    uint64_t phys = DCP_COMP_BASE + (uint64_t)i * DCP_COMP_SLOT;
+    uint64_t disk_len =
+        (clen + TEST_BLOCK_SIZE - 1) / TEST_BLOCK_SIZE * TEST_BLOCK_SIZE;
+    REQUIRE(device_write(&dev, phys, comp, disk_len) == 0,
+            "escritura comprimida falló");
+
+    struct file_entry *fe = fs->inode_table[i + 1];
+    fe->size = DCP_LEN;
+    fe->extents = calloc(1, sizeof(struct file_extent));
+    fe->extent_count = 1;
+    fe->extent_capacity = 1;
+    fe->extents[0].type = BTRFS_FILE_EXTENT_REG;
+    fe->extents[0].compression = BTRFS_COMPRESS_ZLIB;
+    fe->extents[0].disk_bytenr = phys;
+    fe->extents[0].disk_num_bytes = disk_len;
+    fe->extents[0].num_bytes = DCP_RAM;
+    fe->extents[0].ram_bytes = DCP_RAM;
+  }
+
+  struct inode_map imap;
+  memset(&imap, 0, sizeof(imap));
+  struct ext4_block_allocator alloc;
+  ext4_block_alloc_init(&alloc, &layout);
+  REQUIRE(ext4_write_inode_table(&dev, &layout, fs, &imap, &alloc) == 0,
+          "ext4_write_inode_table falló");
+
+  int bad_data = 0, bad_order = 0;
+  uint64_t prev_blk = 0;
+  for (int i = 0; i < DCP_FILES; i++) {
+    uint32_t ino = inode_map_lookup(&imap, (uint64_t)(257 + i));
+    uint32_t grp = (ino - 1) / layout.inodes_per_group;
+    uint32_t loc = (ino - 1) % layout.inodes_per_group;
+    struct ext4_inode inode;
+    if (read_raw(&dev,
+                 layout.groups[grp].inode_table_start * TEST_BLOCK_SIZE +
+                     (uint64_t)loc * layout.inode_size,
+                 &inode, sizeof(inode)) != 0) {
+      bad_data++;
+      continue;
+    }
+
+    /* Reconstruir el contenido siguiendo los extents (depth 0) */
+    struct ext4_extent_header *eh = (struct ext4_extent_header *)inode.i_block;
+    struct ext4_extent *exts = (struct ext4_extent *)(eh + 1);
+    uint8_t got[DCP_RAM];
+    uint32_t have = 0;
+    uint16_t n_ext = le16toh(eh->eh_depth) == 0 ? le16toh(eh->eh_entries) : 0;
+    for (uint16_t k = 0; k < n_ext; k++) {
+      uint64_t blk = le32toh(exts[k].ee_start_lo) |
+                     ((uint64_t)le16toh(exts[k].ee_start_hi) << 32);
+      uint32_t bytes = le16toh(exts[k].ee_len) * TEST_BLOCK_SIZE;
+      if (k == 0) {
+        if (blk <= prev_blk)
+          bad_order++;
+        prev_blk = blk;
+      }
+      if (have + bytes > sizeof(got) ||
+          read_raw(&dev, blk * TEST_BLOCK_SIZE, got + have, bytes) != 0)
+        break;
+      have += bytes;
+    }
+    dcp_fill(plain, i);
+    if (have < DCP_LEN || memcmp(got, plain, DCP_LEN) != 0)
+      bad_data++;
+  }
+  CHECK(bad_data == 0, "contenido descomprimido incorrecto");
+  CHECK(bad_order == 0, "bloques no asignados en orden de inodo");
+
+  inode_map_free(&imap);
+  free_big_dir_fs(fs);
+  ext4_free_layout(&layout);
+  ext4_block_alloc_free(&alloc);
+  cleanup_test_dev(&dev);
+  TEST_PASS();
+}
+
+#define DCC_CHUNKS 16
+
+static void test_decompress_file_contiguous(void) {
+  TEST_START("L-3  inode_writer: extents comprimidos de un fichero seguidos");
+
+  struct device dev;
+  REQUIRE(make_test_dev(&dev, "dccL", 256ULL * 1024 * 1024) == 0,
+          "no se pudo crear imagen");
+
+  struct ext4_layout layout;
+  REQUIRE(ext4_plan_layout(&layout, 256ULL * 1024 * 1024, TEST_BLOCK_SIZE,
+                           16384, NULL) == 0,
+          "planner falló");
+
+  /* Un fichero de DCC_CHUNKS extents zlib de 4 bloques cada uno */
+  struct btrfs_fs_info *fs = make_big_dir_fs(1);
+  struct file_entry *fe = fs->inode_table[1];
+  fe->size = DCC_CHUNKS * DCP_RAM;
+  fe->extents = calloc(DCC_CHUNKS, sizeof(struct file_extent));
+  fe->extent_count = DCC_CHUNKS;
+  fe->extent_capacity = DCC_CHUNKS;
+  uint8_t plain[DCP_RAM];
+  uint8_t comp[DCP_COMP_SLOT];
+  for (int c = 0; c < DCC_CHUNKS; c++) {
+    dcp_fill(plain, c);
+    memset(comp, 0, sizeof(comp));
+    uint64_t clen = dcs_deflate(plain, DCP_RAM, comp, sizeof(comp));
+    REQUIRE(clen > 0, "deflate falló");
+    uint64_t phys = DCP_COMP_BASE + (uint64_t)c * DCP_COMP_SLOT;
+    uint64_t disk_len =
+        (clen + TEST_BLOCK_SIZE - 1) / TEST_BLOCK_SIZE * TEST_BLOCK_SIZE;
+    REQUIRE(device_write(&dev, phys, comp, disk_len) == 0,
+            "escritura comprimida falló");
+    struct file_extent *ext = &fe->extents[c];
+    ext->file_offset = (uint64_t)c * DCP_RAM;
+    ext->type = BTRFS_FILE_EXTENT_REG;
+    ext->compression = BTRFS_COMPRESS_ZLIB;
+    ext->disk_bytenr = phys;
+    ext->disk_num_bytes = disk_len;
+    ext->num_bytes = DCP_RAM;
+    ext->ram_bytes = DCP_RAM;
+  }
+
+  /* Espacio libre troceado al principio: huecos de 6 bloques, donde cabe
+   * cada extent pero no el fichero entero */
+  struct ext4_block_allocator alloc;
+  ext4_block_alloc_init(&alloc, &layout);
+  uint64_t b = layout.groups[0].data_start_block;
+  while (alloc.reserved_bitmap[b / 8] & (1 << (b % 8)))
+    b++;
+  for (uint32_t i = 0; i < 2 * DCC_CHUNKS; i++, b += 7)
+    alloc.reserved_bitmap[(b + 6) / 8] |= (uint8_t)(1 << ((b + 6) % 8));
+
+  struct inode_map imap;
+  memset(&imap, 0, sizeof(imap));
+  REQUIRE(ext4_write_inode_table(&dev, &layout, fs, &imap, &alloc) == 0,
+          "ext4_write_inode_table falló");
+
+  uint32_t ino = inode_map_lookup(&imap, 257);
+  uint32_t grp = (ino - 1) / layout.inodes_per_group;
+  uint32_t loc = (ino - 1) % layout.inodes_per_group;
+  struct ext4_inode inode;
+  REQUIRE(read_raw(&dev,
+                   layout.groups[grp].inode_table_start * TEST_BLOCK_SIZE +
+                       (uint64_t)loc * layout.inode_size,
+                   &inode, sizeof(inode)) == 0,
+          "lectura del inodo falló");
+  struct ext4_extent_header *eh = (struct ext4_extent_header *)inode.i_block;
+  struct ext4_extent *ee = (struct ext4_extent *)(eh + 1);
+  CHECK(le16toh(eh->eh_depth) == 0 && le16toh(eh->eh_entries) == 1,
+        "el fichero descomprimido no quedó en un solo extent");
+  CHECK(le16toh(ee->ee_len) * TEST_BLOCK_SIZE == DCC_CHUNKS * DCP_RAM,
+        "longitud del extent incorrecta");
+
+  uint64_t blk = le32toh(ee->ee_start_lo) |
+                 ((uint64_t)le16toh(ee->ee_start_hi) << 32);
+  uint8_t got[DCP_RAM];
+  int bad_data = 0;
+  for (int c = 0; c < DCC_CHUNKS; c++) {
+    dcp_fill(plain, c);
+    if (read_raw(&dev, blk * TEST_BLOCK_SIZE + (uint64_t)c * DCP_RAM, got,
+                 DCP_RAM) != 0 ||
+        memcmp(got, plain, DCP_RAM) != 0)
+      bad_data++;
+  }
+  CHECK(bad_data == 0, "contenido descomprimido incorrecto");
+
+  inode_map_free(&imap);
+  free_big_dir_fs(fs);
+  ext4_free_layout(&layout);
+  ext4_block_alloc_free(&alloc);
+  cleanup_test_dev(&dev);
+  TEST_PASS();
+}
+
+#define ITP_FILES 3000
+#define ITP_LINK_EVERY 7
+
+static char itp_target[100];
+
+static void test_inode_table_parallel_groups(void) {
+  TEST_START("M-1  inode_writer: tablas de decenas de grupos en paralelo");
+
+  struct device dev;
+  REQUIRE(make_test_dev(&dev, "itpM", 256ULL * 1024 * 1024) == 0,
+          "no se pudo crear imagen");
+
+  /* Bloques de 1 KiB: 32 grupos de 128 inodos, varias ventanas */
+  struct ext4_layout layout;
+  REQUIRE(ext4_plan_layout(&layout, 256ULL * 1024 * 1024, 1024, 65536,
+                           NULL) == 0,
+          "planner falló");
+  REQUIRE(layout.num_groups > 16,
+          "pocos grupos para cubrir varias ventanas");
+
+  /* Cada fichero con uid/tamaño propios; algunos symlinks largos, que
+   * necesitan un bloque del allocator en el hilo del writer */
+  memset(itp_target, 'x', sizeof(itp_target) - 1);
+  struct btrfs_fs_info *fs = make_big_dir_fs(ITP_FILES);
+  for (int i = 0; i < ITP_FILES; i++) {
+    struct file_entry *fe = fs->inode_table[i + 1];
+    fe->uid = (uint32_t)(1000 + i);
+    if (i % ITP_LINK_EVERY == 0) {
+      fe->mode = S_IFLNK | 0777;
+      fe->symlink_target = itp_target;
+      fe->size = sizeof(itp_target) - 1;
+    } else {
+      fe->size = (uint64_t)i;
+    }
+  }
+
+  struct inode_map imap;
+  memset(&imap, 0, sizeof(imap));
+  struct ext4_block_allocator alloc;
+  ext4_block_alloc_init(&alloc, &layout);
+  REQUIRE(ext4_write_inode_table(&dev, &layout, fs, &imap, &alloc) == 0,
+          "ext4_write_inode_table falló");
+
+  int bad_fields = 0, bad_links = 0;
+  uint64_t prev_blk = 0;
+  for (int i = 0; i < ITP_FILES; i++) {
+    uint32_t ino = inode_map_lookup(&imap, (uint64_t)(257 + i));
+    uint32_t grp = (ino - 1) / layout.inodes_per_group;
+    uint32_t loc = (ino - 1) % layout.inodes_per_group;
+    struct ext4_inode inode;
+    if (read_raw(&dev,
+                 layout.groups[grp].inode_table_start * 1024ULL +
+                     (uint64_t)loc * layout.inode_size,
+                 &inode, sizeof(inode)) != 0) {
+      bad_fields++;
+      continue;
+    }
+    const struct file_entry *fe = fs->inode_table[i + 1];
+    if (le16toh(inode.i_mode) != (uint16_t)fe->mode ||
+        le16toh(inode.i_uid) != (uint16_t)fe->uid ||
+        le32toh(inode.i_size_lo) != (uint32_t)fe->size ||
+        le32toh(inode.i_generation) != 1)
+      bad_fields++;
+
+    if (S_ISLNK(fe->mode)) {
+      /* Bloques del symlink asignados en orden de inodo */
+      struct ext4_extent *ext =
+          (struct ext4_extent *)((uint8_t *)inode.i_block +
+                                 sizeof(struct ext4_extent_header));
+      uint64_t blk = le32toh(ext->ee_start_lo);
+      char got[sizeof(itp_target)];
+      if (blk <= prev_blk ||
+          read_raw(&dev, blk * 1024, got, sizeof(got)) != 0 ||
+          memcmp(got, itp_target, sizeof(got)) != 0)
+        bad_links++;
+      prev_blk = blk;
+    }
+  }
+  CHECK(bad_fields == 0, "campos de inodo incorrectos");
+  CHECK(bad_links == 0, "symlinks largos mal escritos o fuera de orden");
+
+  for (int i = 0; i < ITP_FILES; i++)
+    fs->inode_table[i + 1]->symlink_target = NULL;
+  inode_map_free(&imap);
+  free_big_dir_fs(fs);
+  ext4_free_layout(&layout);
+  ext4_block_alloc_free(&alloc);
+  cleanup_test_dev(&dev);
+  TEST_PASS();
+}
+
+/* =========================================================================
+ * GROUP N — Caché de nodos B-tree y recorrido físico
+ *
+ * Árbol de dos niveles (raíz + 3 hojas de 5 ítems) con CRC32c real y un
+ * chunk map identidad; se recorre con btree_walk() varias veces.
+ * ======================================================================= */
+
+#define NC_NODESIZE 4096
+#define NC_ROOT 0x10000ULL
+#define NC_LEAVES 3
+#define NC_ITEMS 5
+
+static void nc_seal(uint8_t *node, uint64_t logical, uint8_t level,
+                    uint32_t nritems) {
+  struct btrfs_header *hdr = (struct btrfs_header *)node;
+  hdr->bytenr = htole64(logical);
+  hdr->level = level;
+  hdr->nritems = htole32(nritems);
+  uint32_t crc = btrfs_crc32c(~0U, node + BTRFS_CSUM_SIZE,
+                              NC_NODESIZE - BTRFS_CSUM_SIZE);
+  uint32_t le_crc = htole32(crc);
+  memset(hdr->csum, 0, BTRFS_CSUM_SIZE);
+  memcpy(hdr->csum, &le_crc, sizeof(le_crc));
+}
+
+static int nc_write_tree(struct device *dev) {
+  uint8_t node[NC_NODESIZE];
+  memset(node, 0, sizeof(node));
+  struct btrfs_key_ptr *ptrs =
+      (struct btrfs_key_ptr *)(node + sizeof(struct btrfs_header));
+  for (int l = 0; l < NC_LEAVES; l++) {
+    ptrs[l].key.objectid = htole64(256 + (uint64_t)l * NC_ITEMS);
+    ptrs[l].blockptr = htole64(NC_ROOT + (uint64_t)(l + 1) * NC_NODESIZE);
+  }
+  nc_seal(node, NC_ROOT, 1, NC_LEAVES);
+  if (device_write(dev, NC_ROOT, node, sizeof(node)) < 0)
+    return -1;
+
+  for (int l = 0; l < NC_LEAVES; l++) {
+    memset(node, 0, sizeof(node));
+    struct btrfs_item *items =
+        (struct btrfs_item *)(node + sizeof(struct btrfs_header));
+    for (int i = 0; i < NC_ITEMS; i++) {
+      items[i].key.objectid = htole64(256 + (uint64_t)(l * NC_ITEMS + i));
+      items[i].offset = htole32(3000 + (uint32_t)i * 8);
+      items[i].size = htole32(8);
+    }
+    uint64_t logical = NC_ROOT + (uint64_t)(l + 1) * NC_NODESIZE;
+    nc_seal(node, logical, 0, NC_ITEMS);
+    if (device_write(dev, logical, node, sizeof(node)) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int nc_count_cb(const struct btrfs_disk_key *key, const void *data,
+                       uint32_t data_size, void *ctx) {
+  (void)key;
+  (void)data;
+  (void)data_size;
+  (*(int *)ctx)++;
+  return 0;
+}
+
+static int nc_walk(struct device *dev, const struct chunk_map *cm,
+                   int *items) {
+  *items = 0;
+  return btree_walk(dev, cm, NC_ROOT, 1, NC_NODESIZE, BTRFS_CSUM_TYPE_CRC32,
+                    nc_count_cb, items);
+}
+
+static void test_node_cache_verified_once(void) {
+  TEST_START("N-1  caché de nodos: aciertos y checksum verificado una vez");
+
+  struct device dev;
+  REQUIRE(make_test_dev(&dev, "nodecN1", 1024 * 1024) == 0,
+          "no se pudo crear imagen");
+  REQUIRE(nc_write_tree(&dev) == 0, "no se pudo escribir el árbol");
+
+  struct chunk_mapping cme = {.length = 1024 * 1024};
+  struct chunk_map cm = {.entries = &cme, .count = 1, .capacity = 1};
+
+  REQUIRE(node_cache_init(NC_NODESIZE, 0) == 0, "node_cache_init falló");
+  int items = 0;
+  REQUIRE(nc_walk(&dev, &cm, &items) == 0, "primer recorrido falló");
+  CHECK(items == NC_LEAVES * NC_ITEMS, "ítems incorrectos");
+  struct node_cache_stats st;
+  node_cache_get_stats(&st);
+  CHECK(st.misses == 1 + NC_LEAVES && st.hits == 0, "fallos iniciales");
+  CHECK(st.nodes == 1 + NC_LEAVES, "nodos no insertados");
+
+  REQUIRE(nc_walk(&dev, &cm, &items) == 0, "segundo recorrido falló");
+  node_cache_get_stats(&st);
+  CHECK(st.hits == 1 + NC_LEAVES, "el segundo recorrido no acertó");
+
+  /* Corromper una hoja en disco: la copia verificada sigue sirviendo */
+  uint8_t junk = 0x5A;
+  REQUIRE(device_write(&dev, NC_ROOT + 2 * NC_NODESIZE + 2000, &junk, 1) == 0,
+          "write falló");
+  CHECK(nc_walk(&dev, &cm, &items) == 0 && items == NC_LEAVES * NC_ITEMS,
+        "la hoja en caché se verificó otra vez");
+
+  /* Sin caché la corrupción se detecta */
+  node_cache_destroy();
+  CHECK(nc_walk(&dev, &cm, &items) < 0, "checksum corrupto no detectado");
+
+  cleanup_test_dev(&dev);
+  TEST_PASS();
+}
+
+static void test_node_cache_lru_keeps_internal(void) {
+  TEST_START("N-2  caché de nodos: el LRU acotado conserva los internos");
+
+  struct device dev;
+  REQUIRE(make_test_dev(&dev, "nodecN2", 1024 * 1024) == 0,
+          "no se pudo crear imagen");
+  REQUIRE(nc_write_tree(&dev) == 0, "no se pudo escribir el árbol");
+
+  struct chunk_mapping cme = {.length = 1024 * 1024};
+  struct chunk_map cm = {.entries = &cme, .count = 1, .capacity = 1};
+
+  /* Presupuesto para dos nodos: las hojas entran por el extremo frío */
+  REQUIRE(node_cache_init(NC_NODESIZE, 2 * NC_NODESIZE + 256) == 0,
+          "node_cache_init falló");
+  int items = 0;
+  REQUIRE(nc_walk(&dev, &cm, &items) == 0, "primer recorrido falló");
+  struct node_cache_stats st;
+  node_cache_get_stats(&st);
+  CHECK(st.nodes == 2, "el presupuesto no limita la caché");
+  CHECK(st.evictions == NC_LEAVES - 1, "desalojos incorrectos");
+
+  REQUIRE(nc_walk(&dev, &cm, &items) == 0, "segundo recorrido falló");
+  node_cache_get_stats(&st);
+  CHECK(st.hits >= 1, "la raíz fue desalojada por las hojas");
+  CHECK(items == NC_LEAVES * NC_ITEMS, "ítems incorrectos");
+
+  node_cache_destroy();
+  cleanup_test_dev(&dev);
+  TEST_PASS();
+}
+
+/* Registra los objectid en orden de llegada */
+struct nc_order {
+  uint64_t ids[NC_LEAVES * NC_ITEMS];
+  int count;
+};
+
+static int nc_order_cb(const struct btrfs_disk_key *key, const void *data,
+                       uint32_t data_size, void *ctx) {
+  (void)data;
+  (void)data_size;
+  struct nc_order *o = (struct nc_order *)ctx;
+  if (o->count < NC_LEAVES * NC_ITEMS)
+    o->ids[o->count] = le64toh(key->objectid);
+  o->count++;
+  return 0;
+}
+
+static void test_btree_walk_physical_order(void) {
+  TEST_START("N-3  recorrido físico: hojas en orden de disco, no de clave");
+
+  struct device dev;
+  REQUIRE(make_test_dev(&dev, "nodecN3", 1024 * 1024) == 0,
+          "no se pudo crear imagen");
+  REQUIRE(nc_write_tree(&dev) == 0, "no se pudo escribir el árbol");
+
+  /* Mover las hojas a 0x80000 en orden inverso y mapearlas ahí */
+  struct chunk_mapping cme[1 + NC_LEAVES];
+  cme[0] = (struct chunk_mapping){
+      .logical = NC_ROOT, .physical = NC_ROOT, .length = NC_NODESIZE};
+  uint8_t node[NC_NODESIZE];
+  for (int l = 0; l < NC_LEAVES; l++) {
+    uint64_t logical = NC_ROOT + (uint64_t)(l + 1) * NC_NODESIZE;
+    uint64_t physical = 0x80000 + (uint64_t)(NC_LEAVES - 1 - l) * NC_NODESIZE;
+    REQUIRE(device_read(&dev, logical, node, sizeof(node)) == 0,
+            "read falló");
+    REQUIRE(device_write(&dev, physical, node, sizeof(node)) == 0,
+            "write falló");
+    cme[1 + l] = (struct chunk_mapping){
+        .logical = logical, .physical = physical, .length = NC_NODESIZE};
+  }
+  struct chunk_map cm = {
+      .entries = cme, .count = 1 + NC_LEAVES, .capacity = 1 + NC_LEAVES};
+
+  struct nc_order o;
+  memset(&o, 0, sizeof(o));
+  REQUIRE(btree_walk_physical(&dev, &cm, NC_ROOT, 1, NC_NODESIZE,
+                              BTRFS_CSUM_TYPE_CRC32, nc_order_cb, &o) == 0,
+          "recorrido físico falló");
+  REQUIRE(o.count == NC_LEAVES * NC_ITEMS, "ítems perdidos");
+  int ok = 1;
+  for (int l = 0; l < NC_LEAVES; l++) {
+    /* La hoja con mayor clave está primero en disco */
+    uint64_t first = 256 + (uint64_t)(NC_LEAVES - 1 - l) * NC_ITEMS;
+    for (int i = 0; i < NC_ITEMS; i++)
+      ok &= o.ids[l * NC_ITEMS + i] == first + (uint64_t)i;
+  }
+  CHECK(ok, "las hojas no llegaron en orden físico");
+
+  /* El recorrido por claves sobre el mismo mapa sigue en orden de clave */
+  memset(&o, 0, sizeof(o));
+  REQUIRE(btree_walk(&dev, &cm, NC_ROOT, 1, NC_NODESIZE,
+                     BTRFS_CSUM_TYPE_CRC32, nc_order_cb, &o) == 0,
+          "recorrido por claves falló");
+  CHECK(o.count == NC_LEAVES * NC_ITEMS && o.ids[0] == 256 &&
+            o.ids[NC_LEAVES * NC_ITEMS - 1] == 256 + NC_LEAVES * NC_ITEMS - 1,
+        "orden de clave alterado");
+
+  cleanup_test_dev(&dev);
+  TEST_PASS();
+}
+
 int main(void) {
   printf("\n");
   printf("╔════════════════════════════════════════════════════════════════════"
@@ -1706,6 +3408,10 @@ int main(void) {
   test_batch_overflow_auto_flush();
   test_batch_pwrite_equivalence();
   test_batch_readonly_rejected();
+  test_cache_small_writes_merged();
+  test_cache_direct_write_ordering();
+  test_direct_bulk_roundtrip();
+  test_buf_pool_reuse();
 
   /* GROUP B: Inode Bitmaps */
   printf("\n─── GROUP B: Inode Bitmaps (Bug B-2) "
@@ -1713,6 +3419,7 @@ int main(void) {
   test_inode_bitmap_reserved_inodes();
   test_inode_bitmap_user_inodes_marked();
   test_inode_bitmap_cross_group();
+  test_bitmaps_multi_window();
 
   /* GROUP C: GDT Offsets */
   printf("\n─── GROUP C: GDT con desc_size=64 (Bug B-3) "
@@ -1733,6 +3440,8 @@ int main(void) {
   test_dir_small_inline_extents();
   test_dir_large_depth1_extent_tree();
   test_dir_huge_all_blocks_reachable();
+  test_dir_many_dirs_parallel();
+  test_dir_htree_three_levels();
 
   /* GROUP F: GDT Checksums */
   printf("\n─── GROUP F: GDT Checksums (Bug B-6) "
@@ -1746,6 +3455,8 @@ int main(void) {
   test_alloc_direction_forward();
   test_alloc_wraparound();
   test_alloc_no_metadata_collision();
+  test_alloc_run_contiguous();
+  test_alloc_goal_flex_group();
 
   /* GROUP H: Journal Zeroing */
   printf("\n─── GROUP H: Journal Zeroing (Bug B-7) "
@@ -1763,6 +3474,39 @@ int main(void) {
   test_e2e_inode_table_within_bounds();
   test_e2e_superblock_feature_bits();
   test_e2e_reserved_inodes_not_free();
+  test_e2e_lazy_inode_tables();
+  test_e2e_block_uninit_respects_alloc();
+
+  /* GROUP J: Relocation journal */
+  printf("\n─── GROUP J: Journal de relocación (group commit) "
+         "─────────────────────\n");
+  test_journal_group_commit_window();
+  test_journal_group_replay_reverses();
+  test_journal_torn_group_ignored();
+
+  /* GROUP K: Pipelined relocation */
+  printf("\n─── GROUP K: Relocación en pipeline "
+         "──────────────────────────────────\n");
+  test_relocator_pipeline_matches_serial();
+
+  /* GROUP L: Streaming decompression */
+  printf("\n─── GROUP L: Descompresión en streaming "
+         "──────────────────────────────\n");
+  test_decompress_zlib_stream_window();
+  test_decompress_pipeline_many_files();
+  test_decompress_file_contiguous();
+
+  /* GROUP M: Parallel inode tables */
+  printf("\n─── GROUP M: Tablas de inodos en paralelo "
+         "────────────────────────────\n");
+  test_inode_table_parallel_groups();
+
+  /* GROUP N: Node cache */
+  printf("\n─── GROUP N: Caché de nodos B-tree "
+         "───────────────────────────────────\n");
+  test_node_cache_verified_once();
+  test_node_cache_lru_keeps_internal();
+  test_btree_walk_physical_order();
 
   /* Summary */
   printf("\n═══════════════════════════════════════════════════════════════════"
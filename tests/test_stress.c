@@ -20,22 +20,38 @@
 
 #define _GNU_SOURCE
 #include <assert.h>
+#include <endian.h>
 #include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "btrfs/btree.h"
 #include "btrfs/btrfs_reader.h"
 #include "btrfs/btrfs_structures.h"
+#include "btrfs/checksum.h"
 #include "btrfs/chunk_tree.h"
+#include "btrfs/extent_store.h"
+#include "checkpoint.h"
 #include "device_io.h"
+#include "device_profile.h"
 #include "ext4/ext4_planner.h"
 #include "ext4/ext4_structures.h"
 #include "ext4/ext4_writer.h"
+#include "io_stats.h"
+#include "mem_tracker.h"
+#include "migration_map.h"
+#include "progress.h"
 #include "relocator.h"
+#include "thread_pool.h"
+#include "usage_map.h"
 
 /* ========================================================================
  * Test infrastructure
@@ -311,6 +327,105 @@ static void test_inode_map_zero_entries(void) {
   TEST_PASS();
 }
 
+static void test_inode_map_index_modes(void) {
+  TEST_START("Inode map: dense ids index directly, sparse ones Robin Hood");
+
+  struct adaptive_mem_config cfg;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.workdir = "/tmp";
+
+  /* threshold 1 TiB: RAM; 1 byte: every index goes to the workdir file */
+  const uint64_t thresholds[2] = {1ULL << 40, 1};
+  for (int t = 0; t < 2; t++) {
+    cfg.mmap_threshold = thresholds[t];
+    for (uint32_t stride = 1; stride <= 9; stride += 8) {
+      struct inode_map map;
+      memset(&map, 0, sizeof(map));
+      map.mem_cfg = &cfg;
+      const uint32_t N = 20000;
+      for (uint32_t i = 0; i < N; i++)
+        inode_map_add(&map, 256 + (uint64_t)i * stride, 11 + i);
+      inode_map_build_hash(&map);
+
+      enum inode_map_index want =
+          stride == 1 ? INODE_MAP_DIRECT : INODE_MAP_ROBIN_HOOD;
+      ASSERT_TRUE(map.index == want, "wrong index for the density");
+      ASSERT_TRUE((map.fd_ht > 0) == (t == 1), "index not in the file");
+
+      uint32_t bad = 0;
+      for (uint32_t i = 0; i < N; i++) {
+        uint64_t ino = 256 + (uint64_t)i * stride;
+        bad += inode_map_lookup(&map, ino) != 11 + i;
+        bad += stride > 1 && inode_map_lookup(&map, ino + 1) != 0;
+      }
+      bad += inode_map_lookup(&map, 255) != 0;
+      bad += inode_map_lookup(&map, 256 + (uint64_t)N * stride) != 0;
+      ASSERT_TRUE(bad == 0, "lookup mismatch");
+      inode_map_free(&map);
+    }
+  }
+  TEST_PASS();
+}
+
+static void test_bloom_blocked(void) {
+  TEST_START("Bloom: no false negatives, rate near target, batch agrees");
+
+  const uint32_t N = 200000;
+  struct bloom_filter bf;
+  ASSERT_TRUE(bloom_init_fpr(&bf, N, 0.01) == 0, "init failed");
+  ASSERT_TRUE(((uintptr_t)bf.blocks % 64) == 0, "blocks not cache aligned");
+  for (uint32_t i = 0; i < N; i++)
+    bloom_add(&bf, 256 + (uint64_t)i * 3);
+
+  uint32_t missed = 0;
+  for (uint32_t i = 0; i < N; i++)
+    missed += !bloom_test(&bf, 256 + (uint64_t)i * 3);
+  ASSERT_TRUE(missed == 0, "false negative");
+
+  /* Absent keys interleave with present ones, as sparse inode numbers do */
+  uint64_t keys[1000];
+  uint8_t out[1000];
+  uint32_t fp = 0;
+  for (uint32_t base = 0; base < N; base += 1000) {
+    for (uint32_t k = 0; k < 1000; k++)
+      keys[k] = 257 + (uint64_t)(base + k) * 3;
+    uint32_t hits = bloom_test_batch(&bf, keys, 1000, out);
+    uint32_t agree = 1;
+    for (uint32_t k = 0; k < 1000 && agree; k++)
+      agree = out[k] == bloom_test(&bf, keys[k]);
+    ASSERT_TRUE(agree, "batch and single test differ");
+    fp += hits;
+  }
+  double rate = (double)fp / N;
+  printf("(fpr=%.2f%%) ", rate * 100.0);
+  ASSERT_TRUE(rate < 0.015, "false positive rate far above 1%");
+  bloom_free(&bf);
+
+  /* The inode map's batch lookup matches single lookups */
+  struct inode_map map;
+  memset(&map, 0, sizeof(map));
+  for (uint32_t i = 0; i < 5000; i++)
+    inode_map_add(&map, 256 + (uint64_t)i * 2, 11 + i);
+  inode_map_build_hash(&map);
+  map.bloom = calloc(1, sizeof(struct bloom_filter));
+  ASSERT_TRUE(map.bloom && bloom_init(map.bloom, map.count) == 0,
+              "map bloom");
+  for (uint32_t i = 0; i < map.count; i++)
+    bloom_add(map.bloom, map.entries[i].btrfs_ino);
+  uint64_t inos[300];
+  uint32_t got[300];
+  for (uint32_t k = 0; k < 300; k++)
+    inos[k] = 256 + k;
+  inode_map_lookup_batch(&map, inos, 300, got);
+  uint32_t agree = 1;
+  for (uint32_t k = 0; k < 300 && agree; k++)
+    agree = got[k] == inode_map_lookup(&map, inos[k]) &&
+            got[k] == (k % 2 ? 0 : 11 + k / 2);
+  ASSERT_TRUE(agree, "batch lookup wrong");
+  inode_map_free(&map);
+  TEST_PASS();
+}
+
 /* ========================================================================
  * TEST GROUP 3: Chunk map stress tests
  * ======================================================================== */
@@ -390,6 +505,63 @@ static void test_chunk_map_overlapping_ranges(void) {
   TEST_PASS();
 }
 
+static void test_chunk_map_resolver_matches_search(void) {
+  TEST_START("Chunk map: Eytzinger resolver and batch resolve");
+
+  /* 1000 chunks with holes between them, so misses land in gaps too */
+  struct chunk_map map;
+  memset(&map, 0, sizeof(map));
+  map.capacity = 1000;
+  map.entries = calloc(map.capacity, sizeof(struct chunk_mapping));
+  for (uint32_t i = 0; i < 1000; i++) {
+    map.entries[i].logical = 0x100000ULL + (uint64_t)i * 0x300000;
+    map.entries[i].physical = 0x40000000ULL + (uint64_t)(999 - i) * 0x200000;
+    map.entries[i].length = 0x200000;
+  }
+  map.count = 1000;
+
+  /* Reference answers with no resolver, i.e. plain binary search */
+  uint64_t logical[512], expect[512], got[512];
+  for (uint32_t i = 0; i < 512; i++) {
+    logical[i] = (uint64_t)i * 0x5F3A1;
+    expect[i] = chunk_map_resolve(&map, logical[i]);
+  }
+  ASSERT_TRUE(expect[0] == (uint64_t)-1, "address below first chunk");
+
+  ASSERT_TRUE(chunk_map_build_resolver(&map) == 0, "build resolver");
+  int ok = 1;
+  for (uint32_t i = 0; i < 512; i++)
+    ok &= chunk_map_resolve(&map, logical[i]) == expect[i];
+  ASSERT_TRUE(ok, "resolver matches binary search");
+
+  uint32_t mapped = 0;
+  for (uint32_t i = 0; i < 512; i++)
+    mapped += expect[i] != (uint64_t)-1;
+  ASSERT_TRUE(chunk_map_resolve_batch(&map, logical, got, 512) == mapped,
+              "batch resolved count");
+  ASSERT_TRUE(memcmp(got, expect, sizeof(got)) == 0, "ascending batch");
+
+  /* Out-of-order input falls back to a search for each descent */
+  for (uint32_t i = 0; i < 256; i++) {
+    uint64_t t = logical[i];
+    logical[i] = logical[511 - i];
+    logical[511 - i] = t;
+    t = expect[i];
+    expect[i] = expect[511 - i];
+    expect[511 - i] = t;
+  }
+  chunk_map_resolve_batch(&map, logical, got, 512);
+  ASSERT_TRUE(memcmp(got, expect, sizeof(got)) == 0, "descending batch");
+
+  /* Past the last chunk */
+  uint64_t end = 0x100000ULL + 1000ULL * 0x300000;
+  ASSERT_TRUE(chunk_map_resolve(&map, end) == (uint64_t)-1, "past last");
+
+  chunk_map_free(&map);
+  ASSERT_TRUE(map.resolver == NULL, "resolver freed");
+  TEST_PASS();
+}
+
 /* ========================================================================
  * TEST GROUP 4: Ext4 layout planner edge cases
  * ======================================================================== */
@@ -465,6 +637,175 @@ static void test_planner_block_sizes(void) {
   TEST_PASS();
 }
 
+static void test_planner_flex_pack(void) {
+  TEST_START("Planner: flex group metadata packed around Btrfs data");
+
+  /* 2 GiB of 4 KiB blocks: 16 groups, one flex group */
+  uint64_t dev_size = 2ULL * 1024 * 1024 * 1024;
+  struct ext4_layout layout;
+  ASSERT_TRUE(ext4_plan_layout(&layout, dev_size, 4096, 16384, NULL) == 0,
+              "plan");
+  ASSERT_TRUE(layout.num_groups == 16, "one flex group");
+  struct ext4_bg_layout *g0 = &layout.groups[0];
+  uint32_t itb = g0->inode_table_blocks;
+  ASSERT_TRUE(g0->block_bitmap_block == g0->superblock_block + 1 +
+                                            g0->gdt_blocks +
+                                            g0->reserved_gdt_blocks,
+              "run follows the first superblock and GDT");
+  uint64_t data = 0;
+  for (uint32_t i = 0; i < 16; i++) {
+    struct ext4_bg_layout *bg = &layout.groups[i];
+    ASSERT_TRUE(bg->block_bitmap_block == g0->block_bitmap_block + i,
+                "block bitmaps contiguous");
+    ASSERT_TRUE(bg->inode_bitmap_block == g0->block_bitmap_block + 16 + i,
+                "inode bitmaps follow them");
+    ASSERT_TRUE(bg->inode_table_start ==
+                    g0->block_bitmap_block + 32 + (uint64_t)i * itb,
+                "inode tables follow them");
+    data += bg->data_blocks;
+  }
+  ASSERT_TRUE(data + layout.reserved_block_count == layout.total_blocks,
+              "every block is data or metadata");
+  ext4_free_layout(&layout);
+
+  /* Btrfs data over the default place: the run moves past it */
+  struct chunk_mapping cme = {.logical = 0, .physical = 0,
+                              .length = dev_size};
+  struct chunk_map cmap = {.entries = &cme, .count = 1, .capacity = 1};
+  struct file_extent ext;
+  memset(&ext, 0, sizeof(ext));
+  ext.type = 1;
+  ext.disk_bytenr = 3 * 4096;
+  ext.disk_num_bytes = 20000 * 4096 - ext.disk_bytenr;
+  ext.num_bytes = ext.disk_num_bytes;
+  struct file_entry fe;
+  memset(&fe, 0, sizeof(fe));
+  fe.ino = 256;
+  fe.mode = 0100644;
+  fe.extents = &ext;
+  fe.extent_count = 1;
+  struct file_entry *table[] = {&fe};
+  struct btrfs_fs_info fs_info;
+  memset(&fs_info, 0, sizeof(fs_info));
+  fs_info.inode_table = table;
+  fs_info.inode_count = 1;
+  fs_info.chunk_map = &cmap;
+  ASSERT_TRUE(btrfs_build_usage_map(&fs_info, dev_size) == 0, "usage map");
+
+  ASSERT_TRUE(ext4_plan_layout(&layout, dev_size, 4096, 16384, &fs_info) == 0,
+              "plan with data");
+  ASSERT_TRUE(layout.groups[0].block_bitmap_block == 20000,
+              "run starts right after the data");
+  ASSERT_TRUE(layout.groups[0].data_start_block == 3,
+              "data before the run stays usable");
+  ASSERT_TRUE(ext4_find_conflicts(&layout, &fs_info) == 0, "no conflicts");
+  ext4_free_layout(&layout);
+
+  /* Unpacked: each group's metadata in the group */
+  ext4_plan_set_flex_pack(0);
+  ASSERT_TRUE(ext4_plan_layout(&layout, dev_size, 4096, 16384, &fs_info) == 0,
+              "plan unpacked");
+  ext4_plan_set_flex_pack(1);
+  ASSERT_TRUE(layout.groups[2].block_bitmap_block ==
+                  layout.groups[2].group_start_block,
+              "group without backup starts with its bitmap");
+  ASSERT_TRUE(ext4_find_conflicts(&layout, &fs_info) > 0,
+              "default place covers the data");
+  ext4_free_layout(&layout);
+  usage_map_free(&fs_info.usage);
+  TEST_PASS();
+}
+
+static void test_planner_layout_search(void) {
+  TEST_START("Planner: layout search picks the cheapest candidate");
+
+  /* 2 GiB, data in 13 stretches of 35500 blocks with 4500-block gaps,
+   * cut around the superblock backups: a flex run of default inode tables
+   * (8224 blocks) fits no gap, one at twice the ratio (4128 blocks) does */
+  uint64_t dev_size = 2ULL * 1024 * 1024 * 1024;
+  struct chunk_mapping cme = {.logical = 0, .physical = 0,
+                              .length = dev_size};
+  struct chunk_map cmap = {.entries = &cme, .count = 1, .capacity = 1};
+  static const uint64_t backups[] = {32768, 98304, 163840, 229376, 294912};
+  struct file_extent exts[24];
+  memset(exts, 0, sizeof(exts));
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < 13; i++) {
+    uint64_t start = (uint64_t)i * 40000 + 4500, end = (i + 1) * 40000ULL;
+    for (uint32_t k = 0; k <= 5 && start < end; k++) {
+      uint64_t cut = k < 5 && backups[k] >= start && backups[k] < end
+                         ? backups[k]
+                         : end;
+      if (k < 5 && cut == end)
+        continue;
+      if (cut > start) {
+        exts[n].type = 1;
+        exts[n].disk_bytenr = start * 4096;
+        exts[n].disk_num_bytes = (cut - start) * 4096;
+        exts[n].num_bytes = exts[n].disk_num_bytes;
+        n++;
+      }
+      start = cut + 3;
+    }
+  }
+  struct file_entry fe;
+  memset(&fe, 0, sizeof(fe));
+  fe.ino = 256;
+  fe.mode = 0100644;
+  fe.extents = exts;
+  fe.extent_count = n;
+  struct file_entry *table[] = {&fe};
+  struct btrfs_fs_info fs_info;
+  memset(&fs_info, 0, sizeof(fs_info));
+  fs_info.inode_table = table;
+  fs_info.inode_count = 1;
+  fs_info.chunk_map = &cmap;
+  ASSERT_TRUE(btrfs_build_usage_map(&fs_info, dev_size) == 0, "usage map");
+
+  struct ext4_plan_params base = {
+      .inode_ratio = 16384,
+      .reserved_gdt = EXT4_PLAN_RESERVED_GDT_AUTO,
+      .flex_pack = 1,
+  };
+  struct ext4_plan_search search;
+  ASSERT_TRUE(ext4_plan_search(&search, dev_size, 4096, &base, 16384,
+                               &fs_info) == 0,
+              "search without room to vary the ratio");
+  ASSERT_TRUE(search.count == 4, "reserved GDT x packing");
+  ASSERT_TRUE(search.cand[0].params.inode_ratio == 16384 &&
+                  search.cand[0].params.flex_pack,
+              "configured layout first");
+
+  ASSERT_TRUE(ext4_plan_search(&search, dev_size, 4096, &base, 65536,
+                               &fs_info) == 0,
+              "search");
+  ASSERT_TRUE(search.count == 12, "three ratios");
+  const struct ext4_plan_candidate *c = &search.cand[search.chosen];
+  ASSERT_TRUE(search.cand[0].ok && c->ok, "candidates planned");
+  ASSERT_TRUE(c->reloc_bytes < search.cand[0].reloc_bytes,
+              "cheaper than the configured layout");
+  ASSERT_TRUE(c->params.inode_ratio == 32768,
+              "smallest ratio whose run fits a gap");
+  for (uint32_t i = 0; i < search.count; i++)
+    ASSERT_TRUE(!search.cand[i].ok ||
+                    search.cand[i].reloc_bytes >= c->reloc_bytes,
+                "chosen is the cheapest");
+
+  /* The score matches what the planner and conflict detector see */
+  struct ext4_layout layout;
+  ASSERT_TRUE(ext4_plan_layout_params(&layout, dev_size, 4096, &c->params,
+                                      &fs_info) == 0,
+              "plan the chosen layout");
+  ASSERT_TRUE(ext4_find_conflicts(&layout, &fs_info) == c->conflicts,
+              "same conflicts");
+  ASSERT_TRUE(layout.total_inodes == c->total_inodes &&
+                  layout.reserved_block_count == c->reserved_blocks,
+              "same geometry");
+  ext4_free_layout(&layout);
+  usage_map_free(&fs_info.usage);
+  TEST_PASS();
+}
+
 /* ========================================================================
  * TEST GROUP 5: Relocator stress tests
  * ======================================================================== */
@@ -488,6 +829,7 @@ static void test_relocator_empty_plan(void) {
   ASSERT_TRUE(plan.count == 0, "no relocations needed");
 
   relocator_free(&plan);
+  usage_map_free(&fs_info.usage);
   TEST_PASS();
 }
 
@@ -562,8 +904,687 @@ static void test_relocator_all_blocks_conflict(void) {
   }
 
   relocator_free(&plan);
+  usage_map_free(&fs_info.usage);
+  free(layout.reserved_blocks);
+  chunk_map_free(&cmap);
+  TEST_PASS();
+}
+
+static void test_relocator_best_fit(void) {
+  TEST_START("Relocator: conflict run goes to the smallest hole that fits");
+
+  /* Blocks 0-9 reserved and holding data; Btrfs data leaves free holes of
+   * 20 (30-49), 10 (60-69) and 80 (120-199) blocks */
+  struct ext4_layout layout;
+  memset(&layout, 0, sizeof(layout));
+  layout.block_size = 4096;
+  layout.total_blocks = 200;
+  layout.reserved_blocks = malloc(10 * sizeof(uint64_t));
+  layout.reserved_block_count = 10;
+  layout.reserved_block_capacity = 10;
+  for (uint32_t i = 0; i < 10; i++)
+    layout.reserved_blocks[i] = i;
+
+  struct chunk_map cmap;
+  memset(&cmap, 0, sizeof(cmap));
+  cmap.capacity = 1;
+  cmap.entries = calloc(1, sizeof(struct chunk_mapping));
+  cmap.entries[0].length = layout.total_blocks * 4096;
+  cmap.count = 1;
+
+  static const uint64_t used[][2] = {{10, 29}, {50, 59}, {70, 119}};
+  struct file_extent exts[4];
+  memset(exts, 0, sizeof(exts));
+  exts[0].type = 1;
+  exts[0].disk_bytenr = 4096; /* block 0 would read as a hole */
+  exts[0].disk_num_bytes = 9 * 4096;
+  for (int i = 0; i < 3; i++) {
+    exts[i + 1].type = 1;
+    exts[i + 1].disk_bytenr = used[i][0] * 4096;
+    exts[i + 1].disk_num_bytes = (used[i][1] - used[i][0] + 1) * 4096;
+  }
+
+  struct file_entry fe;
+  memset(&fe, 0, sizeof(fe));
+  fe.ino = 256;
+  fe.mode = 0100644;
+  fe.extents = exts;
+  fe.extent_count = 4;
+
+  struct file_entry *table[] = {&fe};
+  struct btrfs_fs_info fs_info;
+  memset(&fs_info, 0, sizeof(fs_info));
+  fs_info.inode_table = table;
+  fs_info.inode_count = 1;
+  fs_info.chunk_map = &cmap;
+
+  struct relocation_plan plan;
+  int ret = relocator_plan(&plan, &layout, &fs_info);
+  ASSERT_TRUE(ret == 0, "plan failed");
+  ASSERT_TRUE(plan.count == 1, "run should stay in one piece");
+  ASSERT_TRUE(plan.entries[0].src_offset == 1 * 4096 &&
+                  plan.entries[0].length == 9 * 4096,
+              "wrong source run");
+  ASSERT_TRUE(plan.entries[0].dst_offset == 60 * 4096,
+              "not placed in the best-fitting hole");
+
+  relocator_free(&plan);
+  usage_map_free(&fs_info.usage);
+  free(layout.reserved_blocks);
+  chunk_map_free(&cmap);
+  TEST_PASS();
+}
+
+static void test_relocator_split_shared(void) {
+  TEST_START("Relocator: extent split over free runs, shared source once");
+
+  const char *path = "/tmp/btrfs2ext4_test_split.img";
+  const uint32_t BS = 4096, NBLOCKS = 64;
+  if (create_temp_device(path, (uint64_t)NBLOCKS * BS) < 0) {
+    TEST_FAIL("couldn't create temp file");
+    return;
+  }
+  struct device dev;
+  if (device_open(&dev, path, 0) < 0) {
+    TEST_FAIL("device_open failed");
+    unlink(path);
+    return;
+  }
+
+  /* Blocks 0-15 reserved; a 12-block extent at 1-12 that two files share
+   * must go to the 5-block holes at 20, 30 and 40 */
+  struct ext4_layout layout;
+  memset(&layout, 0, sizeof(layout));
+  layout.block_size = BS;
+  layout.total_blocks = NBLOCKS;
+  layout.reserved_blocks = malloc(16 * sizeof(uint64_t));
+  layout.reserved_block_count = 16;
+  layout.reserved_block_capacity = 16;
+  for (uint32_t i = 0; i < 16; i++)
+    layout.reserved_blocks[i] = i;
+
+  struct chunk_map cmap;
+  memset(&cmap, 0, sizeof(cmap));
+  cmap.capacity = 1;
+  cmap.entries = calloc(1, sizeof(struct chunk_mapping));
+  cmap.entries[0].length = (uint64_t)NBLOCKS * BS;
+  cmap.count = 1;
+
+  /* Two files clone the extent, the second only its first 7 blocks; a
+   * third holds the data around the holes */
+  struct btrfs_fs_info fs_info;
+  memset(&fs_info, 0, sizeof(fs_info));
+  fs_info.extents_packed = 1; /* arrays grow in the main arena */
+  struct file_extent *a = arena_alloc(&fs_info.arena, 2 * sizeof(*a));
+  struct file_extent *b = arena_alloc(&fs_info.arena, sizeof(*b));
+  struct file_extent c[3];
+  memset(c, 0, sizeof(c));
+  a[0].type = BTRFS_FILE_EXTENT_REG;
+  a[0].disk_bytenr = 1 * BS;
+  a[0].disk_num_bytes = a[0].num_bytes = a[0].ram_bytes = 12 * BS;
+  a[1] = a[0];
+  a[1].disk_bytenr = 16 * BS;
+  a[1].disk_num_bytes = a[1].num_bytes = a[1].ram_bytes = 4 * BS;
+  a[1].file_offset = 12 * BS;
+  b[0] = a[0];
+  b[0].num_bytes = 7 * BS;
+  static const uint64_t used[][2] = {{25, 29}, {35, 39}, {45, 63}};
+  for (int i = 0; i < 3; i++) {
+    c[i].type = BTRFS_FILE_EXTENT_REG;
+    c[i].file_offset = (uint64_t)i * 32 * BS;
+    c[i].disk_bytenr = used[i][0] * BS;
+    c[i].disk_num_bytes = c[i].num_bytes =
+        (used[i][1] - used[i][0] + 1) * BS;
+  }
+
+  struct file_entry fa, fb, fc;
+  memset(&fa, 0, sizeof(fa));
+  memset(&fb, 0, sizeof(fb));
+  memset(&fc, 0, sizeof(fc));
+  fa.ino = 256;
+  fb.ino = 257;
+  fc.ino = 258;
+  fa.mode = fb.mode = fc.mode = 0100644;
+  fa.extents = a;
+  fa.extent_count = fa.extent_capacity = 2;
+  fb.extents = b;
+  fb.extent_count = fb.extent_capacity = 1;
+  fc.extents = c;
+  fc.extent_count = 3;
+  struct file_entry *table[] = {&fa, &fb, &fc};
+  fs_info.inode_table = table;
+  fs_info.inode_count = 3;
+  fs_info.chunk_map = &cmap;
+
+  uint8_t *seed = malloc(16 * BS), *got = malloc(12 * BS);
+  for (uint32_t i = 0; i < 16 * BS; i++)
+    seed[i] = (uint8_t)(i * 13 + 5);
+  ASSERT_TRUE(device_write(&dev, 0, seed, 16 * BS) == 0, "seed failed");
+
+  struct relocation_plan plan;
+  ASSERT_TRUE(relocator_plan(&plan, &layout, &fs_info) == 0,
+              "no single hole fits, but the holes together do");
+  ASSERT_TRUE(plan.total_bytes_to_move == 12 * (uint64_t)BS,
+              "shared extent moved once");
+  uint64_t from_12 = 0;
+  for (uint32_t i = 0; i < plan.count; i++) {
+    const struct relocation_entry *re = &plan.entries[i];
+    ASSERT_TRUE(re->dst_offset >= 20ULL * BS, "destination in a hole");
+    if (re->src_offset < 13ULL * BS)
+      from_12 += re->length;
+  }
+  ASSERT_TRUE(from_12 == 12ULL * BS, "each source block has one entry");
+  ASSERT_TRUE(fa.extent_count == 4, "first file split in three pieces");
+  ASSERT_TRUE(fb.extent_count == 2, "clone split the same way");
+
+  ASSERT_TRUE(relocator_execute(&plan, &dev, &fs_info, BS) == 0,
+              "execute failed");
+
+  /* Both files read the original bytes back through the new pointers */
+  const struct file_entry *files[] = {&fa, &fb};
+  for (int f = 0; f < 2; f++) {
+    const struct file_entry *fe = files[f];
+    uint64_t off = 0;
+    for (uint32_t j = 0; j < fe->extent_count; j++) {
+      const struct file_extent *e = &fe->extents[j];
+      if (e->disk_bytenr == 16ULL * BS || e->file_offset >= 12ULL * BS)
+        break;
+      ASSERT_TRUE(e->disk_bytenr & CHUNK_MAP_PHYSICAL, "pointer not moved");
+      ASSERT_TRUE(e->file_offset == off, "pieces out of order");
+      ASSERT_TRUE(device_read(&dev, e->disk_bytenr & ~CHUNK_MAP_PHYSICAL,
+                              got, (size_t)e->num_bytes) == 0,
+                  "read failed");
+      ASSERT_TRUE(memcmp(got, seed + BS + off, (size_t)e->num_bytes) == 0,
+                  "data not behind the pointer");
+      off += e->num_bytes;
+    }
+    ASSERT_TRUE(off == (f == 0 ? 12ULL : 7ULL) * BS, "bytes lost in split");
+  }
+
+  free(seed);
+  free(got);
+  relocator_free(&plan);
+  usage_map_free(&fs_info.usage);
+  arena_free(&fs_info.arena);
+  free(layout.reserved_blocks);
+  chunk_map_free(&cmap);
+  device_close(&dev);
+  unlink(path);
+  TEST_PASS();
+}
+
+/* Bump allocator over blocks no test move touches */
+static uint64_t sched_scratch_next;
+static uint64_t sched_scratch_alloc(uint64_t length, void *arg) {
+  (void)arg;
+  uint64_t at = sched_scratch_next;
+  sched_scratch_next += length;
+  return at;
+}
+
+static void sched_add(struct relocation_plan *plan, uint64_t src_blk,
+                      uint64_t dst_blk, uint64_t nblocks) {
+  struct relocation_entry *re = &plan->entries[plan->count];
+  memset(re, 0, sizeof(*re));
+  re->src_offset = src_blk * 4096;
+  re->dst_offset = dst_blk * 4096;
+  re->length = nblocks * 4096;
+  re->seq = plan->count++;
+}
+
+static void test_usage_map_build_and_mark(void) {
+  TEST_START("Usage map: merged build, metadata kept out of ext4 bitmap");
+
+  /* Two chunks: logical [0, 64 blocks) at physical 128, the rest identity */
+  struct chunk_mapping cme[2];
+  memset(cme, 0, sizeof(cme));
+  cme[0].logical = 0;
+  cme[0].physical = 128 * 4096;
+  cme[0].length = 64 * 4096;
+  cme[1].logical = 64 * 4096;
+  cme[1].physical = 64 * 4096;
+  cme[1].length = 192 * 4096;
+  struct chunk_map cmap = {.entries = cme, .count = 2, .capacity = 2};
+
+  /* Adjacent extents that straddle the chunk boundary, and a lone one */
+  struct file_extent exts[3];
+  memset(exts, 0, sizeof(exts));
+  exts[0].type = 1;
+  exts[0].disk_bytenr = 60 * 4096;
+  exts[0].disk_num_bytes = 4 * 4096;
+  exts[1].type = 1;
+  exts[1].disk_bytenr = 64 * 4096;
+  exts[1].disk_num_bytes = 2 * 4096;
+  exts[2].type = 1;
+  exts[2].disk_bytenr = 100 * 4096;
+  exts[2].disk_num_bytes = 4096;
+
+  struct file_entry fe;
+  memset(&fe, 0, sizeof(fe));
+  fe.ino = 256;
+  fe.mode = 0100644;
+  fe.extents = exts;
+  fe.extent_count = 3;
+  struct file_entry *table[] = {&fe};
+
+  struct btrfs_fs_info fs_info;
+  memset(&fs_info, 0, sizeof(fs_info));
+  fs_info.inode_table = table;
+  fs_info.inode_count = 1;
+  fs_info.chunk_map = &cmap;
+
+  ASSERT_TRUE(btrfs_build_usage_map(&fs_info, 256 * 4096) == 0, "build");
+  struct usage_map *um = &fs_info.usage;
+  ASSERT_TRUE(um->items == 3 && um->ranges == 2, "adjacent extents merge");
+  ASSERT_TRUE(usage_map_test(um, (128 + 60) * 4096, 4 * 4096),
+              "first chunk part at its physical place");
+  ASSERT_TRUE(usage_map_test(um, 64 * 4096, 2 * 4096), "second chunk part");
+  ASSERT_TRUE(!usage_map_test(um, 66 * 4096, 34 * 4096), "gap stays free");
+  ASSERT_TRUE(usage_map_next(um, 0, 1) == 64 * 4096, "first used byte");
+  ASSERT_TRUE(usage_map_next(um, 64 * 4096, 0) == 66 * 4096,
+              "first free byte after it");
+
+  /* Metadata in use, out of order: merged and sorted by finish */
+  ASSERT_TRUE(usage_map_add_meta(um, 210 * 4096, 4096) == 0, "meta");
+  ASSERT_TRUE(usage_map_add_meta(um, 200 * 4096, 4096) == 0, "meta");
+  ASSERT_TRUE(usage_map_add_meta(um, 201 * 4096, 4096) == 0, "meta");
+  usage_map_finish(um);
+  ASSERT_TRUE(um->meta_count == 2 && um->meta[0].start == 200 * 4096 &&
+                  um->meta[0].end == 202 * 4096,
+              "meta ranges merged");
+  ASSERT_TRUE(usage_map_test(um, 200 * 4096, 4096), "meta is in use");
+
+  /* ext4 blocks of 1 KiB: each 4 KiB granule spans four of them */
+  uint8_t bitmap[128];
+  memset(bitmap, 0, sizeof(bitmap));
+  usage_map_mark_data(um, bitmap, 1024, 300);
+  ASSERT_TRUE(bitmap[256 / 8] == 0xFF && bitmap[264 / 8] == 0,
+              "data granules set at 1 KiB blocks");
+  uint32_t set = 0;
+  for (uint32_t b = 0; b < 1024; b++)
+    set += (bitmap[b / 8] >> (b % 8)) & 1;
+  ASSERT_TRUE(set == 8, "blocks past total_blocks untouched");
+
+  /* 4 KiB blocks: metadata stays out, data goes in */
+  uint8_t *bm4 = calloc(1, 256 / 8);
+  usage_map_mark_data(um, bm4, 4096, 256);
+  ASSERT_TRUE((bm4[64 / 8] & 0x3) == 0x3, "data block set");
+  ASSERT_TRUE((bm4[200 / 8] & 0x1) == 0, "metadata block not set");
+  free(bm4);
+
+  usage_map_free(um);
+  TEST_PASS();
+}
+
+static void test_extent_store_pack(void) {
+  TEST_START("Extent store: pack ordinary files, keep compressed arrays");
+
+  struct btrfs_fs_info fs_info;
+  memset(&fs_info, 0, sizeof(fs_info));
+
+  /* A: data, hole, prealloc laid end to end; B: one compressed extent */
+  struct file_entry fa, fb;
+  memset(&fa, 0, sizeof(fa));
+  memset(&fb, 0, sizeof(fb));
+  fa.mode = fb.mode = 0100644;
+  ASSERT_TRUE(btrfs_reserve_extents(&fs_info, &fa, 3) == 0, "reserve A");
+  ASSERT_TRUE(btrfs_reserve_extents(&fs_info, &fb, 1) == 0, "reserve B");
+  memset(fa.extents, 0, 3 * sizeof(struct file_extent));
+  memset(fb.extents, 0, sizeof(struct file_extent));
+
+  struct file_extent want[3];
+  memset(want, 0, sizeof(want));
+  want[0].type = BTRFS_FILE_EXTENT_REG;
+  want[0].disk_bytenr = 1 << 20;
+  want[0].disk_num_bytes = 16384;
+  want[0].num_bytes = 8192;
+  want[0].ram_bytes = 16384;
+  want[1].type = BTRFS_FILE_EXTENT_REG;
+  want[1].file_offset = 8192;
+  want[1].num_bytes = 4096;
+  want[1].ram_bytes = 4096;
+  want[2].type = BTRFS_FILE_EXTENT_PREALLOC;
+  want[2].file_offset = 12288;
+  want[2].disk_bytenr = 2 << 20;
+  want[2].disk_num_bytes = 4096;
+  want[2].num_bytes = 4096;
+  want[2].ram_bytes = 4096;
+  memcpy(fa.extents, want, sizeof(want));
+  fa.extent_count = 3;
+
+  fb.extents[0].type = BTRFS_FILE_EXTENT_REG;
+  fb.extents[0].compression = BTRFS_COMPRESS_ZLIB;
+  fb.extents[0].disk_bytenr = 3 << 20;
+  fb.extents[0].disk_num_bytes = 4096;
+  fb.extents[0].num_bytes = 16384;
+  fb.extents[0].ram_bytes = 16384;
+  fb.extent_count = 1;
+
+  struct file_entry *table[] = {&fa, &fb};
+  fs_info.inode_table = table;
+  fs_info.inode_count = 2;
+
+  ASSERT_TRUE(btrfs_pack_extents(&fs_info) == 0, "pack");
+  ASSERT_TRUE(fs_info.extent_store.count == 3, "three extents packed");
+  ASSERT_TRUE(fa.extents == NULL && fa.extent_count == 3, "A is packed");
+  ASSERT_TRUE(fb.extents != NULL && fb.extents[0].disk_bytenr == 3 << 20,
+              "B keeps its array");
+  ASSERT_TRUE(fs_info.extent_arena.reserved == 0, "Pass 1 arena released");
+
+  struct extent_iter it;
+  const struct file_extent *ext;
+  uint32_t n = 0;
+  extent_iter_init(&it, &fs_info, &fa);
+  while ((ext = extent_iter_next(&it)) != NULL) {
+    ASSERT_TRUE(it.index == n && memcmp(ext, &want[n], sizeof(*ext)) == 0,
+                "extent decodes unchanged");
+    n++;
+  }
+  ASSERT_TRUE(n == 3, "iterator visits every extent");
+
+  btrfs_extent_set_bytenr(&fs_info, &fa, 2, 5 << 20);
+  btrfs_extent_set_bytenr(&fs_info, &fb, 0, 6 << 20);
+  extent_iter_init(&it, &fs_info, &fa);
+  for (n = 0; n < 3; n++)
+    ext = extent_iter_next(&it);
+  ASSERT_TRUE(ext->disk_bytenr == 5 << 20, "packed extent relocated");
+  ASSERT_TRUE(fb.extents[0].disk_bytenr == 6 << 20, "array extent relocated");
+
+  free(fs_info.extent_store.bytenr);
+  free(fs_info.extent_store.disk_len);
+  free(fs_info.extent_store.len);
+  free(fs_info.extent_store.flags);
+  arena_free(&fs_info.arena);
+  TEST_PASS();
+}
+
+static void test_relocator_schedule_dependencies(void) {
+  TEST_START("Relocator: schedule honours deps, breaks cycles");
+
+  struct relocation_plan plan;
+  memset(&plan, 0, sizeof(plan));
+  plan.capacity = 16;
+  plan.entries = calloc(plan.capacity, sizeof(struct relocation_entry));
+  ASSERT_TRUE(plan.entries != NULL, "alloc failed");
+
+  sched_add(&plan, 10, 20, 2);  /* swap with the next one: a cycle */
+  sched_add(&plan, 20, 10, 2);
+  sched_add(&plan, 30, 40, 4);  /* overwrites the source of the next one */
+  sched_add(&plan, 40, 50, 4);
+  sched_add(&plan, 60, 70, 3);  /* independent */
+  sched_add(&plan, 5, 61, 1);   /* overwrites part of an independent source */
+  struct relocation_entry orig[6];
+  memcpy(orig, plan.entries, sizeof(orig));
+
+  sched_scratch_next = 1000 * 4096;
+  int ret = relocator_schedule(&plan, 2, sched_scratch_alloc, NULL);
+  ASSERT_TRUE(ret == 0, "schedule failed");
+  ASSERT_TRUE(plan.sched.cycles_broken == 1, "expected one cycle broken");
+  ASSERT_TRUE(plan.count == 7, "cycle should add one scratch leg");
+  ASSERT_TRUE(plan.sched.dependencies == 4, "expected 4 dependency edges");
+
+  /* Replay the schedule on block tags: every move must deliver the
+   * original contents of its source */
+  uint32_t tags[1100];
+  for (uint32_t b = 0; b < 1100; b++)
+    tags[b] = b;
+  for (uint32_t i = 0; i < plan.count; i++) {
+    const struct relocation_entry *re = &plan.entries[i];
+    ASSERT_TRUE(re->seq == i, "seq not renumbered in execution order");
+    memmove(&tags[re->dst_offset / 4096], &tags[re->src_offset / 4096],
+            (re->length / 4096) * sizeof(uint32_t));
+  }
+  for (uint32_t i = 0; i < 6; i++) {
+    for (uint64_t k = 0; k < orig[i].length / 4096; k++) {
+      ASSERT_TRUE(tags[orig[i].dst_offset / 4096 + k] ==
+                      orig[i].src_offset / 4096 + k,
+                  "a source was overwritten before it was read");
+    }
+  }
+
+  relocator_free(&plan);
+  TEST_PASS();
+}
+
+static void test_relocator_schedule_seek_estimate(void) {
+  TEST_START("Relocator: batched schedule shortens seek estimate");
+
+  struct relocation_plan plan;
+  memset(&plan, 0, sizeof(plan));
+  plan.capacity = 64;
+  plan.entries = calloc(plan.capacity, sizeof(struct relocation_entry));
+  ASSERT_TRUE(plan.entries != NULL, "alloc failed");
+
+  /* Metadata-region sources, far-away free-space destinations */
+  for (uint32_t i = 0; i < 64; i++)
+    sched_add(&plan, (uint64_t)(63 - i) * 8, 1000000 + (uint64_t)i * 8, 1);
+
+  ASSERT_TRUE(relocator_schedule(&plan, 8, NULL, NULL) == 0,
+              "schedule failed");
+  ASSERT_TRUE(plan.sched.dependencies == 0, "no dependencies expected");
+  ASSERT_TRUE(plan.sched.seek_after < plan.sched.seek_before / 4,
+              "batched elevator order should cut the seek estimate");
+  for (uint32_t i = 1; i < plan.count; i++)
+    ASSERT_TRUE(plan.entries[i].src_offset > plan.entries[i - 1].src_offset,
+                "independent moves should sweep sources upwards");
+
+  relocator_free(&plan);
+  TEST_PASS();
+}
+
+/* Forward half of a conversion: map, CRC'd moves, map with the CRCs */
+static int rollback_forward(struct device *dev, struct relocation_plan *plan) {
+  for (uint32_t i = 0; i < plan->count; i++) {
+    plan->entries[i].completed = 0;
+    plan->entries[i].flags = 0;
+  }
+  if (migration_map_save(dev, plan) < 0)
+    return -1;
+  relocator_set_verify(1);
+  int ret = relocator_move(plan, dev);
+  relocator_set_verify(0);
+  if (ret < 0)
+    return -1;
+  return migration_map_update(dev, plan);
+}
+
+static void test_relocator_rollback(void) {
+  TEST_START("Relocator: rollback verifies CRCs and undoes moves in reverse");
+
+  const char *path = "/tmp/btrfs2ext4_test_rollback.img";
+  const uint64_t MiB = 1024 * 1024;
+  if (create_temp_device(path, 16 * MiB) < 0) {
+    TEST_FAIL("couldn't create temp file");
+    return;
+  }
+  struct device dev;
+  if (device_open(&dev, path, 0) < 0) {
+    TEST_FAIL("device_open failed");
+    unlink(path);
+    return;
+  }
+
+  const size_t span = 2 * MiB + 128 * 1024; /* [1 MiB, 3 MiB + 128 KiB) */
+  uint8_t *orig = malloc(span), *now = malloc(span);
+  for (size_t i = 0; i < span; i++)
+    orig[i] = (uint8_t)(i * 31 + i / 4096);
+  ASSERT_TRUE(device_write(&dev, MiB, orig, span) == 0, "seed failed");
+
+  /* The second move overwrites part of the first one's source */
+  struct relocation_entry entries[3] = {
+      {.src_offset = MiB, .dst_offset = 8 * MiB, .length = MiB + 8192},
+      {.src_offset = 3 * MiB, .dst_offset = MiB, .length = 65536, .seq = 1},
+      {.src_offset = 3 * MiB + 65536, .dst_offset = 12 * MiB, .length = 4096,
+       .seq = 2},
+  };
+  struct relocation_plan plan;
+  memset(&plan, 0, sizeof(plan));
+  plan.entries = entries;
+  plan.count = 3;
+
+  ASSERT_TRUE(rollback_forward(&dev, &plan) == 0, "forward moves failed");
+  for (uint32_t i = 0; i < 3; i++)
+    ASSERT_TRUE(entries[i].flags & RELOC_FLAG_CHECKSUM, "CRC not taken");
+  /* Pass 3 overwrites the vacated sources */
+  memset(now, 0xEE, 65536 + 4096);
+  ASSERT_TRUE(device_write(&dev, 3 * MiB, now, 65536 + 4096) == 0,
+              "clobber failed");
+
+  /* Undo through the read pipeline at rollback depth, not kernel copies */
+  device_copy_set_mode(&dev, DEVICE_COPY_BUFFER);
+  ASSERT_TRUE(migration_map_rollback(&dev) == 0, "rollback failed");
+  ASSERT_TRUE(device_read(&dev, MiB, now, span) == 0 &&
+                  memcmp(now, orig, span) == 0,
+              "rollback did not restore the original data");
+  ASSERT_TRUE(migration_map_rollback(&dev) < 0, "footer not wiped");
+
+  /* A damaged copy aborts the rollback before anything is written */
+  ASSERT_TRUE(rollback_forward(&dev, &plan) == 0, "second forward failed");
+  uint8_t bad = 0x5A;
+  ASSERT_TRUE(device_write(&dev, 12 * MiB + 100, &bad, 1) == 0,
+              "corrupt failed");
+  uint8_t *before = malloc(span);
+  ASSERT_TRUE(device_read(&dev, MiB, before, span) == 0, "read failed");
+  ASSERT_TRUE(migration_map_rollback(&dev) < 0,
+              "rollback should refuse a copy with a bad CRC");
+  ASSERT_TRUE(device_read(&dev, MiB, now, span) == 0 &&
+                  memcmp(now, before, span) == 0,
+              "failed rollback changed the device");
+
+  free(before);
+  free(orig);
+  free(now);
+  device_close(&dev);
+  device_buf_pool_drain();
+  unlink(path);
+  TEST_PASS();
+}
+
+static void test_relocator_prealloc_unwritten(void) {
+  TEST_START("Relocator: PREALLOC extents move without copying");
+
+  const char *path = "/tmp/btrfs2ext4_test_prealloc.img";
+  const uint32_t BS = 4096, NBLOCKS = 2000;
+  if (create_temp_device(path, (uint64_t)NBLOCKS * BS) < 0) {
+    TEST_FAIL("couldn't create temp file");
+    return;
+  }
+  struct device dev;
+  if (device_open(&dev, path, 0) < 0) {
+    TEST_FAIL("device_open failed");
+    unlink(path);
+    return;
+  }
+
+  struct ext4_layout layout;
+  memset(&layout, 0, sizeof(layout));
+  layout.block_size = BS;
+  layout.total_blocks = NBLOCKS;
+  layout.reserved_blocks = malloc(100 * sizeof(uint64_t));
+  layout.reserved_block_count = 100;
+  layout.reserved_block_capacity = 100;
+  for (uint32_t i = 0; i < 100; i++)
+    layout.reserved_blocks[i] = i;
+  layout.num_groups = 1;
+  struct ext4_bg_layout bg;
+  memset(&bg, 0, sizeof(bg));
+  bg.data_blocks = NBLOCKS;
+  layout.groups = &bg;
+
+  struct chunk_map cmap;
+  memset(&cmap, 0, sizeof(cmap));
+  cmap.capacity = 1;
+  cmap.entries = calloc(1, sizeof(struct chunk_mapping));
+  cmap.entries[0].length = (uint64_t)NBLOCKS * BS;
+  cmap.count = 1;
+
+  /* Written data at block 10, untouched preallocation at block 20, and a
+   * preallocation at block 30 that was written in part */
+  struct file_extent ext[4];
+  memset(ext, 0, sizeof(ext));
+  const struct {
+    uint8_t type;
+    uint64_t block, blocks, file_off;
+  } spec[4] = {{BTRFS_FILE_EXTENT_REG, 10, 5, 0},
+               {BTRFS_FILE_EXTENT_PREALLOC, 20, 5, 5},
+               {BTRFS_FILE_EXTENT_REG, 30, 4, 10},
+               {BTRFS_FILE_EXTENT_PREALLOC, 30, 4, 11}};
+  for (int i = 0; i < 4; i++) {
+    ext[i].type = spec[i].type;
+    ext[i].file_offset = spec[i].file_off * BS;
+    ext[i].disk_bytenr = spec[i].block * BS;
+    ext[i].disk_num_bytes = spec[i].blocks * BS;
+    ext[i].num_bytes = BS;
+  }
+  struct file_entry fe;
+  memset(&fe, 0, sizeof(fe));
+  fe.ino = 256;
+  fe.mode = 0100644;
+  fe.extents = ext;
+  fe.extent_count = 4;
+  struct file_entry *table[] = {&fe};
+  struct btrfs_fs_info fs_info;
+  memset(&fs_info, 0, sizeof(fs_info));
+  fs_info.inode_table = table;
+  fs_info.inode_count = 1;
+  fs_info.chunk_map = &cmap;
+
+  uint8_t *seed = malloc(100 * BS), *got = malloc(5 * BS);
+  for (uint32_t i = 0; i < 100 * BS; i++)
+    seed[i] = (uint8_t)(i * 7 + 1);
+  ASSERT_TRUE(device_write(&dev, 0, seed, 100 * BS) == 0, "seed failed");
+
+  struct relocation_plan plan;
+  ASSERT_TRUE(relocator_plan(&plan, &layout, &fs_info) == 0, "plan failed");
+  uint32_t unwritten = 0;
+  for (uint32_t i = 0; i < plan.count; i++) {
+    const struct relocation_entry *re = &plan.entries[i];
+    int want = re->src_offset == 20ULL * BS;
+    ASSERT_TRUE(!(re->flags & RELOC_FLAG_UNWRITTEN) == !want,
+                "only the untouched preallocation is unwritten");
+    unwritten += want;
+  }
+  ASSERT_TRUE(unwritten == 1, "one unwritten entry");
+  ASSERT_TRUE(plan.count == 3, "shared extent moved once");
+  ASSERT_TRUE(plan.total_bytes_to_move == (5 + 4) * (uint64_t)BS,
+              "unwritten bytes counted as copied");
+
+  /* Through the pipeline and through kernel copies */
+  for (int mode = 0; mode < 2; mode++) {
+    for (uint32_t i = 0; i < plan.count; i++)
+      plan.entries[i].completed = 0;
+    device_copy_set_mode(&dev, mode ? DEVICE_COPY_RANGE : DEVICE_COPY_BUFFER);
+    relocator_set_verify(mode == 0);
+    ASSERT_TRUE(relocator_move(&plan, &dev) == 0, "move failed");
+    for (uint32_t i = 0; i < plan.count; i++) {
+      const struct relocation_entry *re = &plan.entries[i];
+      ASSERT_TRUE(re->completed, "entry not completed");
+      ASSERT_TRUE(device_read(&dev, re->dst_offset, got,
+                              (size_t)re->length) == 0,
+                  "read failed");
+      if (re->flags & RELOC_FLAG_UNWRITTEN) {
+        int zero = 1;
+        for (uint64_t k = 0; k < re->length; k++)
+          zero &= got[k] == 0;
+        ASSERT_TRUE(zero, "unwritten entry was copied");
+      } else {
+        ASSERT_TRUE(memcmp(got, seed + re->src_offset, (size_t)re->length) ==
+                        0,
+                    "data entry not copied");
+      }
+    }
+  }
+  relocator_set_verify(0);
+
+  free(seed);
+  free(got);
+  relocator_free(&plan);
+  usage_map_free(&fs_info.usage);
   free(layout.reserved_blocks);
   chunk_map_free(&cmap);
+  device_close(&dev);
+  device_buf_pool_drain();
+  unlink(path);
   TEST_PASS();
 }
 
@@ -648,6 +1669,335 @@ static void test_device_zero_size_file(void) {
   TEST_PASS();
 }
 
+static void *io_stats_reader(void *arg) {
+  struct device *dev = arg;
+  uint8_t buf[4096];
+  for (int i = 0; i < 8; i++)
+    if (device_read(dev, (uint64_t)i * 8192, buf, sizeof(buf)) < 0)
+      return NULL;
+  return dev;
+}
+
+static void test_device_io_stats(void) {
+  TEST_START("Device I/O: per-phase counters merge across threads");
+
+  const char *path = "/tmp/btrfs2ext4_test_iostats.img";
+  if (create_temp_device(path, 1024 * 1024) < 0) {
+    TEST_FAIL("couldn't create temp file");
+    return;
+  }
+  struct device dev;
+  if (device_open(&dev, path, 0) < 0) {
+    TEST_FAIL("device_open failed");
+    unlink(path);
+    return;
+  }
+
+  io_stats_reset();
+  io_stats_phase(IO_PHASE_INODES);
+  uint8_t buf[4096] = {0};
+  device_write(&dev, 0, buf, sizeof(buf));
+  device_write(&dev, 65536, buf, sizeof(buf));
+  device_sync(&dev);
+
+  /* Reads from another thread land in the phase current at the time */
+  io_stats_phase(IO_PHASE_SCAN);
+  pthread_t th;
+  void *res = NULL;
+  ASSERT_TRUE(pthread_create(&th, NULL, io_stats_reader, &dev) == 0,
+              "thread create");
+  pthread_join(th, &res);
+  ASSERT_TRUE(res == &dev, "reader failed");
+
+  struct io_phase_stats st[IO_PHASE_COUNT];
+  io_stats_collect(st);
+  ASSERT_TRUE(st[IO_PHASE_INODES].write_ops == 2 &&
+                  st[IO_PHASE_INODES].write_bytes == 8192 &&
+                  st[IO_PHASE_INODES].fsyncs == 1,
+              "write counters wrong");
+  ASSERT_TRUE(st[IO_PHASE_INODES].seek_bytes == 65536 - 4096,
+              "seek distance wrong");
+  ASSERT_TRUE(st[IO_PHASE_SCAN].read_ops == 8 &&
+                  st[IO_PHASE_SCAN].read_bytes == 8 * 4096 &&
+                  st[IO_PHASE_SCAN].syscalls >= 8 &&
+                  st[IO_PHASE_SCAN].write_ops == 0,
+              "reader thread not merged");
+  ASSERT_TRUE(st[IO_PHASE_SCAN].wall_sec >= 0.0 &&
+                  st[IO_PHASE_INODES].wall_sec > 0.0,
+              "phase time missing");
+
+  FILE *f = tmpfile();
+  ASSERT_TRUE(f && io_stats_print(f, IO_STATS_JSON) == 0, "JSON failed");
+  char out[4096];
+  rewind(f);
+  size_t n = fread(out, 1, sizeof(out) - 1, f);
+  out[n] = '\0';
+  fclose(f);
+  ASSERT_TRUE(strstr(out, "\"inode_tables\"") &&
+                  strstr(out, "\"read_bytes\": 32768") &&
+                  strchr(out, '\n') == out + n - 1,
+              "JSON output wrong");
+
+  device_close(&dev);
+  io_stats_reset();
+  unlink(path);
+  TEST_PASS();
+}
+
+static void test_device_copy_modes(void) {
+  TEST_START("Device I/O: device_copy in every mode");
+
+  const char *path = "/tmp/btrfs2ext4_test_copy.img";
+  if (create_temp_device(path, 8 * 1024 * 1024) < 0) {
+    TEST_FAIL("couldn't create temp file");
+    return;
+  }
+  struct device dev;
+  if (device_open(&dev, path, 0) < 0) {
+    TEST_FAIL("device_open failed");
+    unlink(path);
+    return;
+  }
+
+  /* More than one piece in every mode, and not block aligned */
+  const size_t len = DEVICE_COPY_CHUNK + DEVICE_COPY_CHUNK / 2 + 123;
+  uint8_t *src = malloc(len), *out = malloc(len);
+  for (size_t i = 0; i < len; i++)
+    src[i] = (uint8_t)(i * 7 + i / 4096);
+  ASSERT_TRUE(device_write(&dev, 0, src, len) == 0, "seed write failed");
+
+  ASSERT_TRUE(device_copy_mode(&dev) == DEVICE_COPY_RANGE,
+              "regular file should take copy_file_range");
+  const enum device_copy_mode modes[] = {DEVICE_COPY_RANGE, DEVICE_COPY_SPLICE,
+                                         DEVICE_COPY_BUFFER};
+  for (int m = 0; m < 3; m++) {
+    uint64_t dst = (uint64_t)(m + 1) * 2 * 1024 * 1024;
+    device_copy_set_mode(&dev, modes[m]);
+    ASSERT_TRUE(device_copy(&dev, 0, dst, len) == 0, "copy failed");
+    ASSERT_TRUE(dev.copy_mode == (int)modes[m], "mode was demoted");
+    memset(out, 0, len);
+    ASSERT_TRUE(device_read(&dev, dst, out, len) == 0 &&
+                    memcmp(out, src, len) == 0,
+                "copied bytes differ");
+  }
+
+  /* A write still in the cache is what gets copied */
+  ASSERT_TRUE(device_cache_enable(&dev, 0) == 0, "cache enable failed");
+  memset(src, 0xA5, 4096);
+  ASSERT_TRUE(device_write(&dev, 0, src, 4096) == 0, "cached write failed");
+  device_copy_set_mode(&dev, DEVICE_COPY_RANGE);
+  ASSERT_TRUE(device_copy(&dev, 0, 7 * 1024 * 1024, 4096) == 0,
+              "copy after cached write failed");
+  ASSERT_TRUE(device_read(&dev, 7 * 1024 * 1024, out, 4096) == 0 &&
+                  memcmp(out, src, 4096) == 0,
+              "copy missed the cached write");
+
+  ASSERT_TRUE(device_copy(&dev, 0, 4096, 8192) < 0,
+              "overlapping copy should fail");
+  ASSERT_TRUE(device_copy(&dev, 0, 8 * 1024 * 1024 - 4096, 8192) < 0,
+              "copy past the end should fail");
+
+  free(src);
+  free(out);
+  device_close(&dev);
+  device_buf_pool_drain(); /* the bounce buffer */
+  unlink(path);
+  TEST_PASS();
+}
+
+static void test_device_zero_modes(void) {
+  TEST_START("Device I/O: device_zero_range in every mode");
+
+  const char *path = "/tmp/btrfs2ext4_test_zero.img";
+  const size_t size = 8 * 1024 * 1024;
+  if (create_temp_device(path, size) < 0) {
+    TEST_FAIL("couldn't create temp file");
+    return;
+  }
+  struct device dev;
+  if (device_open(&dev, path, 0) < 0) {
+    TEST_FAIL("device_open failed");
+    unlink(path);
+    return;
+  }
+
+  /* More than one buffer's worth, with unaligned edges */
+  const uint64_t off = 4096 + 100;
+  const uint64_t len = DEVICE_ZERO_CHUNK + DEVICE_ZERO_CHUNK / 2 + 123;
+  const size_t span = 2 * 1024 * 1024;
+  uint8_t *fill = malloc(span), *out = malloc(span);
+  memset(fill, 0xC3, span);
+
+  ASSERT_TRUE(device_zero_mode(&dev) == DEVICE_ZERO_AUTO,
+              "no method should be picked before the first call");
+  const enum device_zero_mode modes[] = {DEVICE_ZERO_PUNCH, DEVICE_ZERO_RANGE,
+                                         DEVICE_ZERO_WRITE};
+  for (int m = 0; m < 3; m++) {
+    uint64_t base = (uint64_t)m * span;
+    ASSERT_TRUE(device_write(&dev, base, fill, span) == 0,
+                "seed write failed");
+    device_zero_set_mode(&dev, modes[m]);
+    ASSERT_TRUE(device_zero_range(&dev, base + off, len) == 0,
+                "zeroing failed");
+    ASSERT_TRUE(dev.zero_mode == (int)modes[m], "mode was demoted");
+    ASSERT_TRUE(device_read(&dev, base, out, span) == 0, "read back failed");
+    int ok = 1;
+    for (uint64_t i = 0; i < span && ok; i++)
+      ok = out[i] == ((i >= off && i < off + len) ? 0 : 0xC3);
+    ASSERT_TRUE(ok, "wrong bytes zeroed");
+  }
+
+  /* A write still in the cache must not land over the zeros later */
+  ASSERT_TRUE(device_cache_enable(&dev, 0) == 0, "cache enable failed");
+  ASSERT_TRUE(device_write(&dev, 6 * 1024 * 1024 + 8192, fill, 4096) == 0,
+              "cached write failed");
+  device_zero_set_mode(&dev, DEVICE_ZERO_AUTO);
+  ASSERT_TRUE(device_zero_range(&dev, 6 * 1024 * 1024, 65536) == 0,
+              "zeroing after cached write failed");
+  ASSERT_TRUE(device_cache_flush(&dev) == 0, "cache flush failed");
+  ASSERT_TRUE(device_read(&dev, 6 * 1024 * 1024 + 8192, out, 4096) == 0 &&
+                  out[0] == 0 && out[4095] == 0,
+              "cached write survived the zeroing");
+  ASSERT_TRUE(device_zero_mode(&dev) != DEVICE_ZERO_AUTO,
+              "no method recorded");
+
+  ASSERT_TRUE(device_zero_range(&dev, size - 4096, 8192) < 0,
+              "zeroing past the end should fail");
+
+  free(fill);
+  free(out);
+  device_close(&dev);
+  unlink(path);
+  TEST_PASS();
+}
+
+static void test_device_profile(void) {
+  TEST_START("Device I/O: profile, write tests, cache, time model");
+
+  const char *path = "/tmp/btrfs2ext4_test_profile.img";
+  const char *prof_path = "/tmp/btrfs2ext4_test_profile.prof";
+  const uint64_t size = 16 * 1024 * 1024;
+  if (create_temp_device(path, size) < 0) {
+    TEST_FAIL("couldn't create temp file");
+    return;
+  }
+  uint8_t *img = malloc(size), *after = malloc(size);
+  for (uint64_t i = 0; i < size; i++)
+    img[i] = (uint8_t)(i * 13 + i / 4096);
+  int fd = open(path, O_WRONLY);
+  ASSERT_TRUE(fd >= 0 && pwrite(fd, img, size, 0) == (ssize_t)size,
+              "seed write failed");
+  close(fd);
+
+  /* Read-only handle, as in a dry run; the first half is in use */
+  struct device dev;
+  ASSERT_TRUE(device_open(&dev, path, 1) == 0, "device_open failed");
+  struct usage_map um;
+  ASSERT_TRUE(usage_map_init(&um, size, 4096) == 0, "usage map init failed");
+  usage_map_set(&um, 0, size / 2, 1);
+
+  struct device_profile p;
+  ASSERT_TRUE(device_profile_measure(&p, &dev, &um, DEVICE_PROFILE_WRITES) == 0,
+              "measure failed");
+  ASSERT_TRUE(p.device_size == size && p.seq_read > 0.0 &&
+                  p.rand_4k_iops > 0.0 && p.rand_64k_iops > 0.0,
+              "read figures missing");
+  ASSERT_TRUE(p.writes == 1 && p.seq_write > 0.0, "write figures missing");
+  for (int k = 0; k < DEVICE_PROFILE_DEPTHS; k++)
+    ASSERT_TRUE(p.commit_sec[k] > 0.0, "commit not timed");
+  fd = open(path, O_RDONLY);
+  ASSERT_TRUE(fd >= 0 && pread(fd, after, size, 0) == (ssize_t)size,
+              "read back failed");
+  close(fd);
+  ASSERT_TRUE(memcmp(img, after, size) == 0, "profiling changed the device");
+
+  /* Nothing free: the write figures stay unmeasured */
+  struct device_profile ro;
+  usage_map_set(&um, 0, size, 1);
+  ASSERT_TRUE(device_profile_measure(&ro, &dev, &um, DEVICE_PROFILE_WRITES) ==
+                      0 &&
+                  ro.writes == 0 && ro.seq_write == 0.0,
+              "wrote without free space");
+
+  /* Saved profiles come back only for the same device size, intact */
+  struct device_profile back;
+  unlink(prof_path);
+  ASSERT_TRUE(device_profile_load(&back, prof_path, size) < 0,
+              "loaded a missing profile");
+  ASSERT_TRUE(device_profile_save(&p, prof_path) == 0, "save failed");
+  ASSERT_TRUE(device_profile_load(&back, prof_path, size) == 0 &&
+                  memcmp(&back, &p, sizeof(p)) == 0,
+              "profile did not round-trip");
+  ASSERT_TRUE(device_profile_load(&back, prof_path, size * 2) < 0,
+              "profile of another size accepted");
+  fd = open(prof_path, O_WRONLY);
+  ASSERT_TRUE(fd >= 0 && pwrite(fd, "x", 1, 40) == 1, "corrupt failed");
+  close(fd);
+  ASSERT_TRUE(device_profile_load(&back, prof_path, size) < 0,
+              "corrupt profile accepted");
+
+  /* A disk with 10 ms access, 100 MiB/s both ways, 20 ms commits */
+  struct device_profile hdd;
+  memset(&hdd, 0, sizeof(hdd));
+  hdd.rotational = 1;
+  hdd.seq_read = hdd.seq_write = 100.0 * 1024 * 1024;
+  hdd.rand_4k_iops = 1.0 / (0.010 + 4096 / hdd.seq_read);
+  hdd.rand_64k_iops = 1.0 / (0.010 + 65536 / hdd.seq_read);
+  hdd.writes = 1;
+  const uint32_t depths[DEVICE_PROFILE_DEPTHS] = DEVICE_PROFILE_DEPTH_LIST;
+  const double write_4k = 0.010 + 4096 / hdd.seq_write;
+  for (int k = 0; k < DEVICE_PROFILE_DEPTHS; k++) {
+    hdd.depth[k] = depths[k];
+    hdd.commit_sec[k] = 0.020 + depths[k] * write_4k;
+  }
+  ASSERT_TRUE(fabs(device_profile_access(&hdd) - 0.010) < 1e-6,
+              "access time not recovered");
+
+  struct eta_workload w;
+  memset(&w, 0, sizeof(w));
+  w.scan_sec = 5.0;
+  w.reloc_moves = 1000;
+  w.reloc_bytes = 1000 * 65536ULL;
+  w.reloc_syncs = 4;
+  struct eta_estimate e;
+  device_profile_estimate(&hdd, &w, &e);
+  /* 2000 accesses, 62.5 MiB each way, 4 x 20 ms flush (no record) */
+  double expect = 2000 * 0.010 + 2 * 0.625 + 4 * 0.020;
+  ASSERT_TRUE(fabs(e.phase_sec[ETA_PHASE_RELOCATE] - expect) < 0.01,
+              "relocation estimate off");
+  ASSERT_TRUE(e.phase_sec[ETA_PHASE_SCAN] == 5.0 &&
+                  fabs(e.total_sec - 5.0 - expect) < 0.01,
+              "phases do not add up");
+
+  /* A 500 ms window syncs 42.5 times over the 21.25 s of moves */
+  w.reloc_sync_sec = 0.5;
+  device_profile_estimate(&hdd, &w, &e);
+  ASSERT_TRUE(fabs(e.phase_sec[ETA_PHASE_RELOCATE] - 21.25 - 42.5 * 0.020) <
+                  0.01,
+              "time-window syncs not charged");
+  w.reloc_sync_sec = 0.0;
+
+  /* Same counts on a disk with no seek cost: bandwidth only */
+  struct device_profile flat = hdd;
+  flat.rand_4k_iops = flat.seq_read / 4096;
+  flat.rand_64k_iops = flat.seq_read / 65536;
+  flat.writes = 0;
+  struct eta_estimate f;
+  device_profile_estimate(&flat, &w, &f);
+  ASSERT_TRUE(f.phase_sec[ETA_PHASE_RELOCATE] < 2.0 &&
+                  f.phase_sec[ETA_PHASE_RELOCATE] >= 1.25,
+              "seekless estimate off");
+
+  usage_map_free(&um);
+  device_close(&dev);
+  device_buf_pool_drain();
+  free(img);
+  free(after);
+  unlink(prof_path);
+  unlink(path);
+  TEST_PASS();
+}
+
 /* ========================================================================
  * TEST GROUP 7: Extent tree edge cases
  * ======================================================================== */
@@ -688,7 +2038,11 @@ static void test_extent_tree_empty_file(void) {
   struct ext4_block_allocator alloc;
   ext4_block_alloc_init(&alloc, &layout);
 
-  int ret = ext4_build_extent_tree(&alloc, &dev, &inode, &fe, &cmap, &layout);
+  struct btrfs_fs_info fs_info;
+  memset(&fs_info, 0, sizeof(fs_info));
+  fs_info.chunk_map = &cmap;
+  int ret =
+      ext4_build_extent_tree(&alloc, &dev, &inode, &fe, &fs_info, &layout);
   ext4_block_alloc_free(&alloc);
 
   ASSERT_TRUE(ret == 0, "empty file should succeed");
@@ -754,7 +2108,11 @@ static void test_extent_tree_single_extent(void) {
   struct ext4_block_allocator alloc;
   ext4_block_alloc_init(&alloc, &layout);
 
-  int ret = ext4_build_extent_tree(&alloc, &dev, &inode, &fe, &cmap, &layout);
+  struct btrfs_fs_info fs_info;
+  memset(&fs_info, 0, sizeof(fs_info));
+  fs_info.chunk_map = &cmap;
+  int ret =
+      ext4_build_extent_tree(&alloc, &dev, &inode, &fe, &fs_info, &layout);
   ext4_block_alloc_free(&alloc);
 
   ASSERT_TRUE(ret == 0, "single extent should succeed");
@@ -769,6 +2127,85 @@ static void test_extent_tree_single_extent(void) {
   TEST_PASS();
 }
 
+static void test_extent_tree_prealloc_unwritten(void) {
+  TEST_START("Extent tree: PREALLOC written as unwritten extents");
+
+  const char *path = "/tmp/btrfs2ext4_test_ext_prealloc.img";
+  if (create_temp_device(path, 64 * 1024 * 1024) < 0) {
+    TEST_FAIL("couldn't create temp file");
+    return;
+  }
+  struct device dev;
+  if (device_open(&dev, path, 0) < 0) {
+    TEST_FAIL("device_open failed");
+    unlink(path);
+    return;
+  }
+
+  struct chunk_map cmap;
+  memset(&cmap, 0, sizeof(cmap));
+  cmap.capacity = 1;
+  cmap.entries = calloc(1, sizeof(struct chunk_mapping));
+  cmap.entries[0].length = 1ULL << 30;
+  cmap.count = 1;
+
+  /* 10 written blocks, then 32767 + 10 preallocated ones right behind
+   * them on disk: the kinds must not merge, and an unwritten extent holds
+   * at most 32767 blocks */
+  const uint64_t BS = 4096, PRE = EXT4_EXT_UNWRITTEN_MAX_LEN + 10;
+  struct file_extent ext[2];
+  memset(ext, 0, sizeof(ext));
+  ext[0].type = BTRFS_FILE_EXTENT_REG;
+  ext[0].disk_bytenr = 100 * BS;
+  ext[0].disk_num_bytes = ext[0].num_bytes = 10 * BS;
+  ext[1].type = BTRFS_FILE_EXTENT_PREALLOC;
+  ext[1].file_offset = 10 * BS;
+  ext[1].disk_bytenr = 110 * BS;
+  ext[1].disk_num_bytes = ext[1].num_bytes = PRE * BS;
+
+  struct file_entry fe;
+  memset(&fe, 0, sizeof(fe));
+  fe.ino = 256;
+  fe.extent_count = 2;
+  fe.extents = ext;
+
+  struct ext4_layout layout;
+  memset(&layout, 0, sizeof(layout));
+  layout.block_size = BS;
+  layout.total_blocks = 65536;
+
+  struct ext4_inode inode;
+  memset(&inode, 0, sizeof(inode));
+  struct ext4_block_allocator alloc;
+  ext4_block_alloc_init(&alloc, &layout);
+  struct btrfs_fs_info fs_info;
+  memset(&fs_info, 0, sizeof(fs_info));
+  fs_info.chunk_map = &cmap;
+  int ret =
+      ext4_build_extent_tree(&alloc, &dev, &inode, &fe, &fs_info, &layout);
+  ext4_block_alloc_free(&alloc);
+  ASSERT_TRUE(ret == 0, "build failed");
+
+  struct ext4_extent_header *eh = (struct ext4_extent_header *)inode.i_block;
+  struct ext4_extent *ee = (struct ext4_extent *)(eh + 1);
+  ASSERT_TRUE(le16toh(eh->eh_entries) == 3, "three extents");
+  ASSERT_TRUE(le16toh(ee[0].ee_len) == 10, "written extent");
+  ASSERT_TRUE(le16toh(ee[1].ee_len) ==
+                  EXT4_EXT_INIT_MAX_LEN + EXT4_EXT_UNWRITTEN_MAX_LEN,
+              "first unwritten extent not full");
+  ASSERT_TRUE(le16toh(ee[2].ee_len) == EXT4_EXT_INIT_MAX_LEN + 10,
+              "second unwritten extent");
+  ASSERT_TRUE(le32toh(ee[2].ee_block) == 10 + EXT4_EXT_UNWRITTEN_MAX_LEN &&
+                  le32toh(ee[2].ee_start_lo) ==
+                      110 + EXT4_EXT_UNWRITTEN_MAX_LEN,
+              "second unwritten extent misplaced");
+
+  device_close(&dev);
+  chunk_map_free(&cmap);
+  unlink(path);
+  TEST_PASS();
+}
+
 static void test_extent_tree_max_inline(void) {
   TEST_START("Extent tree: exactly 4 extents (max inline)");
 
@@ -821,7 +2258,11 @@ static void test_extent_tree_max_inline(void) {
   struct ext4_block_allocator alloc;
   ext4_block_alloc_init(&alloc, &layout);
 
-  int ret = ext4_build_extent_tree(&alloc, &dev, &inode, &fe, &cmap, &layout);
+  struct btrfs_fs_info fs_info;
+  memset(&fs_info, 0, sizeof(fs_info));
+  fs_info.chunk_map = &cmap;
+  int ret =
+      ext4_build_extent_tree(&alloc, &dev, &inode, &fe, &fs_info, &layout);
   ext4_block_alloc_free(&alloc);
 
   ASSERT_TRUE(ret == 0, "4 extents should succeed");
@@ -872,41 +2313,324 @@ static void test_extent_tree_multi_level(void) {
     exts[i].num_bytes = 4096 * 5;
   }
 
-  struct file_entry fe;
-  memset(&fe, 0, sizeof(fe));
-  fe.ino = 256;
-  fe.extent_count = NEXT;
-  fe.extents = exts;
+  struct file_entry fe;
+  memset(&fe, 0, sizeof(fe));
+  fe.ino = 256;
+  fe.extent_count = NEXT;
+  fe.extents = exts;
+
+  /* Set up layout with block groups and allocator */
+  struct ext4_layout layout;
+  memset(&layout, 0, sizeof(layout));
+  layout.block_size = 4096;
+  layout.total_blocks = 16384;
+  layout.num_groups = 1;
+
+  struct ext4_bg_layout bg;
+  memset(&bg, 0, sizeof(bg));
+  bg.group_start_block = 0;
+  bg.data_start_block = 100;
+  bg.data_blocks = 16284;
+  layout.groups = &bg;
+
+  struct ext4_block_allocator alloc;
+  ext4_block_alloc_init(&alloc, &layout);
+
+  struct ext4_inode inode;
+  memset(&inode, 0, sizeof(inode));
+
+  struct btrfs_fs_info fs_info;
+  memset(&fs_info, 0, sizeof(fs_info));
+  fs_info.chunk_map = &cmap;
+  int ret =
+      ext4_build_extent_tree(&alloc, &dev, &inode, &fe, &fs_info, &layout);
+  ext4_block_alloc_free(&alloc);
+
+  ASSERT_TRUE(ret == 0, "100 extents should succeed");
+
+  struct ext4_extent_header *eh = (struct ext4_extent_header *)inode.i_block;
+  ASSERT_TRUE(le16toh(eh->eh_depth) == 1, "depth 1 (multi-level)");
+
+  free(exts);
+  device_close(&dev);
+  chunk_map_free(&cmap);
+  unlink(path);
+  TEST_PASS();
+}
+
+/* `count` non-adjacent extents of 5 blocks, 50 blocks apart in the file */
+static struct file_extent *scattered_extents(int count) {
+  struct file_extent *exts = calloc(count, sizeof(struct file_extent));
+  for (int i = 0; exts && i < count; i++) {
+    exts[i].type = 1;
+    exts[i].file_offset = (uint64_t)i * 4096 * 50;
+    exts[i].disk_bytenr = (uint64_t)(i * 2 + 10) * 4096;
+    exts[i].disk_num_bytes = 4096 * 5;
+    exts[i].num_bytes = 4096 * 5;
+  }
+  return exts;
+}
+
+static void test_extent_tree_regions(void) {
+  TEST_START("Extent tree: leaves packed into a tree region");
+
+  const char *path = "/tmp/btrfs2ext4_test_region.img";
+  if (create_temp_device(path, 64 * 1024 * 1024) < 0) {
+    TEST_FAIL("couldn't create temp file");
+    return;
+  }
+
+  struct device dev;
+  if (device_open(&dev, path, 0) < 0) {
+    TEST_FAIL("device_open failed");
+    unlink(path);
+    return;
+  }
+
+  struct chunk_map cmap;
+  memset(&cmap, 0, sizeof(cmap));
+  cmap.capacity = 1;
+  cmap.entries = calloc(1, sizeof(struct chunk_mapping));
+  cmap.entries[0].length = 64 * 1024 * 1024;
+  cmap.count = 1;
+
+  /* a: 3 leaves, b: 2 leaves, c: 4 leaves estimated but never built */
+  const int counts[3] = {800, 400, 1300};
+  struct file_entry files[3];
+  struct file_entry *table[3];
+  memset(files, 0, sizeof(files));
+  for (int i = 0; i < 3; i++) {
+    files[i].ino = 257 + i;
+    files[i].mode = S_IFREG | 0644;
+    files[i].extent_count = counts[i];
+    files[i].extents = scattered_extents(counts[i]);
+    table[i] = &files[i];
+  }
+
+  struct ext4_layout layout;
+  memset(&layout, 0, sizeof(layout));
+  layout.block_size = 4096;
+  layout.total_blocks = 16384;
+  layout.num_groups = 1;
+
+  struct ext4_bg_layout bg;
+  memset(&bg, 0, sizeof(bg));
+  bg.data_start_block = 100;
+  bg.data_blocks = 16284;
+  layout.groups = &bg;
+
+  struct ext4_block_allocator alloc;
+  ext4_block_alloc_init(&alloc, &layout);
+
+  struct btrfs_fs_info fs_info;
+  memset(&fs_info, 0, sizeof(fs_info));
+  fs_info.chunk_map = &cmap;
+  fs_info.inode_table = table;
+  fs_info.inode_count = 3;
+
+  ASSERT_TRUE(ext4_extent_tree_blocks(4, 4096) == 0, "inline: no blocks");
+  ASSERT_TRUE(ext4_extent_tree_blocks(1360, 4096) == 4, "4 leaves");
+  ASSERT_TRUE(ext4_extent_tree_blocks(1361, 4096) == 6, "5 leaves + index");
+
+  struct ext4_tree_regions regions;
+  int ret = ext4_tree_regions_init(&regions, &alloc, &dev, &layout,
+                                   &fs_info, NULL);
+  ASSERT_TRUE(ret == 0 && regions.count == 1, "one region");
+  ASSERT_TRUE(regions.planned == 9, "9 tree blocks estimated");
+  alloc.tree_regions = &regions;
+
+  struct ext4_inode inode[2];
+  memset(inode, 0, sizeof(inode));
+  for (int i = 0; i < 2 && ret == 0; i++)
+    ret = ext4_build_extent_tree(&alloc, &dev, &inode[i], &files[i], &fs_info,
+                                 &layout);
+  ASSERT_TRUE(ret == 0, "both trees built");
+
+  /* The leaves of both files follow each other in the region */
+  uint64_t leaf[5];
+  int n = 0;
+  for (int i = 0; i < 2; i++) {
+    const struct ext4_extent_header *eh =
+        (const struct ext4_extent_header *)inode[i].i_block;
+    const struct ext4_extent_idx *ei = (const struct ext4_extent_idx *)(eh + 1);
+    ASSERT_TRUE(le16toh(eh->eh_depth) == 1, "depth 1");
+    for (uint16_t k = 0; k < le16toh(eh->eh_entries) && n < 5; k++)
+      leaf[n++] = (uint64_t)le16toh(ei[k].ei_leaf_hi) << 32 |
+                  le32toh(ei[k].ei_leaf_lo);
+  }
+  ASSERT_TRUE(n == 5, "5 leaves");
+  for (int k = 1; k < n; k++)
+    ASSERT_TRUE(leaf[k] == leaf[0] + (uint64_t)k, "leaves consecutive");
+
+  alloc.tree_regions = NULL;
+  ret = ext4_tree_regions_finish(&regions, &alloc, &layout);
+  ASSERT_TRUE(ret == 0, "finish");
+  ASSERT_TRUE(regions.blocks == 5 && regions.writes == 1,
+              "5 blocks in one write");
+
+  /* The unused estimate of c is given back */
+  ASSERT_TRUE(ext4_alloc_block(&alloc, &layout) == leaf[0] + 5,
+              "tail released");
+
+  /* The last leaf of b holds its last extents */
+  uint8_t buf[4096];
+  ASSERT_TRUE(device_read(&dev, leaf[4] * 4096, buf, sizeof(buf)) == 0,
+              "read leaf");
+  const struct ext4_extent_header *lh = (const struct ext4_extent_header *)buf;
+  const struct ext4_extent *le = (const struct ext4_extent *)(lh + 1);
+  uint16_t entries = le16toh(lh->eh_entries);
+  ASSERT_TRUE(le16toh(lh->eh_magic) == EXT4_EXT_MAGIC && entries == 400 - 340,
+              "leaf header");
+  ASSERT_TRUE(le32toh(le[entries - 1].ee_block) == 399 * 50 &&
+                  le32toh(le[entries - 1].ee_start_lo) == 399 * 2 + 10,
+              "last extent");
+
+  ext4_block_alloc_free(&alloc);
+  for (int i = 0; i < 3; i++)
+    free(files[i].extents);
+  device_close(&dev);
+  chunk_map_free(&cmap);
+  unlink(path);
+  TEST_PASS();
+}
+
+/* First physical block the inline extent root maps file block `fb` to */
+static uint64_t inline_extent_phys(const struct ext4_inode *inode,
+                                   uint32_t fb) {
+  const struct ext4_extent_header *eh =
+      (const struct ext4_extent_header *)inode->i_block;
+  const struct ext4_extent *ee = (const struct ext4_extent *)(eh + 1);
+  for (uint16_t i = 0; i < le16toh(eh->eh_entries); i++) {
+    uint32_t start = le32toh(ee[i].ee_block);
+    if (fb >= start && fb < start + le16toh(ee[i].ee_len))
+      return ((uint64_t)le16toh(ee[i].ee_start_hi) << 32 |
+              le32toh(ee[i].ee_start_lo)) +
+             (fb - start);
+  }
+  return (uint64_t)-1;
+}
+
+static void test_extent_tree_cow_clones(void) {
+  TEST_START("Extent tree: shared blocks copied once per reader");
+
+  const char *path = "/tmp/btrfs2ext4_test_clone.img";
+  if (create_temp_device(path, 64 * 1024 * 1024) < 0) {
+    TEST_FAIL("couldn't create temp file");
+    return;
+  }
+  struct device dev;
+  if (device_open(&dev, path, 0) < 0) {
+    TEST_FAIL("device_open failed");
+    unlink(path);
+    return;
+  }
+
+  /* Blocks 4000-4009 hold distinct data */
+  uint8_t blk[4096];
+  for (uint32_t b = 4000; b < 4010; b++) {
+    memset(blk, (int)(b & 0xff), sizeof(blk));
+    device_write(&dev, (uint64_t)b * 4096, blk, sizeof(blk));
+  }
+
+  /* Logical 1 GiB maps to the start of the device */
+  struct chunk_map cmap;
+  memset(&cmap, 0, sizeof(cmap));
+  cmap.capacity = 1;
+  cmap.entries = calloc(1, sizeof(struct chunk_mapping));
+  cmap.entries[0].logical = 1ULL << 30;
+  cmap.entries[0].physical = 0;
+  cmap.entries[0].length = 64 * 1024 * 1024;
+  cmap.count = 1;
+
+  /* a owns 4000-4009, b reflinks all of it, c the last 5 blocks plus 5 of
+   * its own, d was relocated (device offset) */
+  struct file_extent ext[4];
+  memset(ext, 0, sizeof(ext));
+  for (int i = 0; i < 4; i++)
+    ext[i].type = BTRFS_FILE_EXTENT_REG;
+  ext[0].disk_bytenr = (1ULL << 30) + 4000 * 4096;
+  ext[0].disk_num_bytes = ext[0].num_bytes = 10 * 4096;
+  ext[1] = ext[0];
+  ext[2].disk_bytenr = (1ULL << 30) + 4005 * 4096;
+  ext[2].disk_num_bytes = ext[2].num_bytes = 10 * 4096;
+  ext[3].disk_bytenr = (6000ULL * 4096) | CHUNK_MAP_PHYSICAL;
+  ext[3].disk_num_bytes = ext[3].num_bytes = 4 * 4096;
+
+  struct file_entry fe[4];
+  struct file_entry *table[4];
+  memset(fe, 0, sizeof(fe));
+  for (int i = 0; i < 4; i++) {
+    fe[i].ino = 257 + i;
+    fe[i].mode = S_IFREG | 0644;
+    fe[i].extent_count = 1;
+    fe[i].extents = &ext[i];
+    table[i] = &fe[i];
+  }
+
+  struct btrfs_fs_info fs_info;
+  memset(&fs_info, 0, sizeof(fs_info));
+  fs_info.chunk_map = &cmap;
+  fs_info.inode_table = table;
+  fs_info.inode_count = 4;
 
-  /* Set up layout with block groups and allocator */
   struct ext4_layout layout;
-  memset(&layout, 0, sizeof(layout));
-  layout.block_size = 4096;
-  layout.total_blocks = 16384;
-  layout.num_groups = 1;
-
-  struct ext4_bg_layout bg;
-  memset(&bg, 0, sizeof(bg));
-  bg.group_start_block = 0;
-  bg.data_start_block = 100;
-  bg.data_blocks = 16284;
-  layout.groups = &bg;
-
+  ASSERT_TRUE(ext4_plan_layout(&layout, 64 * 1024 * 1024, 4096, 16384,
+                               NULL) == 0,
+              "layout");
   struct ext4_block_allocator alloc;
   ext4_block_alloc_init(&alloc, &layout);
+  ext4_block_alloc_mark_fs_data(&alloc, &layout, &fs_info);
+
+  struct ext4_clone_plan plan;
+  ASSERT_TRUE(ext4_clone_plan_build(&plan, &layout, &fs_info, &alloc,
+                                    NULL) == 0,
+              "plan build failed");
+  ASSERT_TRUE(plan.count == 2 && plan.blocks == 15,
+              "expected 2 runs of 15 shared blocks");
+  ASSERT_TRUE(plan.source_ranges == 1 && plan.source_blocks == 10,
+              "overlapping sources should merge into one range");
+  /* The fan-out path; with copy_file_range each clone is its own copy */
+  device_copy_set_mode(&dev, DEVICE_COPY_BUFFER);
+  ASSERT_TRUE(ext4_clone_plan_execute(&plan, &dev, 4096) == 0,
+              "execute failed");
+  ASSERT_TRUE(plan.bytes_read == 10 * 4096 && plan.bytes_written == 15 * 4096,
+              "each source block should be read once");
+  alloc.clones = &plan;
+
+  struct ext4_inode inode[4];
+  memset(inode, 0, sizeof(inode));
+  for (int i = 0; i < 4; i++)
+    ASSERT_TRUE(ext4_build_extent_tree(&alloc, &dev, &inode[i], &fe[i],
+                                       &fs_info, &layout) == 0,
+                "extent tree failed");
+
+  ASSERT_TRUE(inline_extent_phys(&inode[0], 0) == 4000,
+              "first reader keeps the shared blocks");
+  ASSERT_TRUE(inline_extent_phys(&inode[2], 5) == 4010,
+              "unshared blocks stay in place");
+  ASSERT_TRUE(inline_extent_phys(&inode[3], 0) == 6000,
+              "tagged device offsets resolve as is");
+
+  /* Copies hold the source data and no block is mapped twice */
+  int ok = 1;
+  for (uint32_t fb = 0; fb < 10 && ok; fb++) {
+    uint64_t pb = inline_extent_phys(&inode[1], fb);
+    ok = pb != (uint64_t)-1 && (pb < 4000 || pb >= 4010) &&
+         device_read(&dev, pb * 4096, blk, sizeof(blk)) == 0 &&
+         blk[0] == ((4000 + fb) & 0xff) && blk[4095] == blk[0];
+    if (ok && fb < 5) {
+      uint64_t pc = inline_extent_phys(&inode[2], fb);
+      ok = pc != pb && (pc < 4000 || pc >= 4015) &&
+           device_read(&dev, pc * 4096, blk, sizeof(blk)) == 0 &&
+           blk[0] == ((4005 + fb) & 0xff);
+    }
+  }
+  ASSERT_TRUE(ok, "copies should hold the shared data");
 
-  struct ext4_inode inode;
-  memset(&inode, 0, sizeof(inode));
-
-  int ret = ext4_build_extent_tree(&alloc, &dev, &inode, &fe, &cmap, &layout);
+  alloc.clones = NULL;
+  ext4_clone_plan_free(&plan);
   ext4_block_alloc_free(&alloc);
-
-  ASSERT_TRUE(ret == 0, "100 extents should succeed");
-
-  struct ext4_extent_header *eh = (struct ext4_extent_header *)inode.i_block;
-  ASSERT_TRUE(le16toh(eh->eh_depth) == 1, "depth 1 (multi-level)");
-
-  free(exts);
+  ext4_free_layout(&layout);
   device_close(&dev);
   chunk_map_free(&cmap);
   unlink(path);
@@ -1131,10 +2855,971 @@ static void test_free_after_operations(void) {
   TEST_PASS();
 }
 
+/* ========================================================================
+ * TEST GROUP 11: B-tree walker (sequential vs. parallel subtrees)
+ * ======================================================================== */
+
+#define BT_NODESIZE 4096
+#define BT_FANOUT 4
+#define BT_LEAF_ITEMS 10
+
+/* Write a node at physical == logical with a valid CRC32C checksum */
+static int bt_write_node(struct device *dev, uint64_t logical, uint8_t level,
+                         const uint64_t *children, uint32_t nritems,
+                         uint64_t first_objectid) {
+  uint8_t buf[BT_NODESIZE];
+  memset(buf, 0, sizeof(buf));
+  struct btrfs_header *hdr = (struct btrfs_header *)buf;
+  hdr->bytenr = htole64(logical);
+  hdr->nritems = htole32(nritems);
+  hdr->level = level;
+
+  if (level > 0) {
+    struct btrfs_key_ptr *ptrs =
+        (struct btrfs_key_ptr *)(buf + sizeof(struct btrfs_header));
+    for (uint32_t i = 0; i < nritems; i++)
+      ptrs[i].blockptr = htole64(children[i]);
+  } else {
+    struct btrfs_item *items =
+        (struct btrfs_item *)(buf + sizeof(struct btrfs_header));
+    uint32_t data_end = BT_NODESIZE - (uint32_t)sizeof(struct btrfs_header);
+    for (uint32_t i = 0; i < nritems; i++) {
+      items[i].key.objectid = htole64(first_objectid + i);
+      items[i].key.type = BTRFS_INODE_ITEM_KEY;
+      data_end -= 8;
+      items[i].offset = htole32(data_end);
+      items[i].size = htole32(8);
+    }
+  }
+
+  uint32_t crc = htole32(btrfs_crc32c(~0U, buf + BTRFS_CSUM_SIZE,
+                                      BT_NODESIZE - BTRFS_CSUM_SIZE));
+  memcpy(hdr->csum, &crc, sizeof(crc));
+  return device_write(dev, logical, buf, BT_NODESIZE);
+}
+
+/*
+ * Build a 3-level tree: root (level 2) -> BT_FANOUT level-1 nodes ->
+ * BT_FANOUT leaves each. Returns the root's logical address, 0 on error.
+ */
+static uint64_t bt_build_tree(struct device *dev) {
+  uint64_t next = BT_NODESIZE;
+  uint64_t objectid = 256;
+  uint64_t mids[BT_FANOUT];
+
+  for (int m = 0; m < BT_FANOUT; m++) {
+    uint64_t leaves[BT_FANOUT];
+    for (int l = 0; l < BT_FANOUT; l++) {
+      leaves[l] = next;
+      next += BT_NODESIZE;
+      if (bt_write_node(dev, leaves[l], 0, NULL, BT_LEAF_ITEMS, objectid) < 0)
+        return 0;
+      objectid += BT_LEAF_ITEMS;
+    }
+    mids[m] = next;
+    next += BT_NODESIZE;
+    if (bt_write_node(dev, mids[m], 1, leaves, BT_FANOUT, 0) < 0)
+      return 0;
+  }
+
+  uint64_t root = next;
+  if (bt_write_node(dev, root, 2, mids, BT_FANOUT, 0) < 0)
+    return 0;
+  return root;
+}
+
+struct bt_key_log {
+  uint64_t keys[BT_FANOUT * BT_FANOUT * BT_LEAF_ITEMS];
+  uint32_t count;
+};
+
+struct bt_shard_set {
+  struct bt_key_log logs[64];
+  uint32_t count;
+};
+
+static int bt_log_callback(const struct btrfs_disk_key *key, const void *data,
+                           uint32_t data_size, void *ctx) {
+  struct bt_key_log *log = (struct bt_key_log *)ctx;
+  (void)data;
+  (void)data_size;
+  if (log->count < sizeof(log->keys) / sizeof(log->keys[0]))
+    log->keys[log->count++] = le64toh(key->objectid);
+  return 0;
+}
+
+static void *bt_new_shard(uint32_t shard_index, void *arg) {
+  struct bt_shard_set *set = (struct bt_shard_set *)arg;
+  if (shard_index != set->count || set->count >= 64)
+    return NULL;
+  return &set->logs[set->count++];
+}
+
+static void test_btree_parallel_matches_sequential(void) {
+  TEST_START("B-tree: parallel subtree walk == sequential order");
+
+  const char *path = "/tmp/btrfs2ext4_test_btree_par.img";
+  if (create_temp_device(path, 1024 * 1024) < 0) {
+    TEST_FAIL("couldn't create temp file");
+    return;
+  }
+  struct device dev;
+  if (device_open(&dev, path, 0) < 0) {
+    TEST_FAIL("device_open failed");
+    unlink(path);
+    return;
+  }
+
+  uint64_t root = bt_build_tree(&dev);
+  struct chunk_mapping identity = {.length = dev.size};
+  struct chunk_map cmap = {.entries = &identity, .count = 1, .capacity = 1};
+
+  static struct bt_key_log seq;
+  memset(&seq, 0, sizeof(seq));
+  int ret = btree_walk(&dev, &cmap, root, 2, BT_NODESIZE,
+                       BTRFS_CSUM_TYPE_CRC32, bt_log_callback, &seq);
+
+  static const uint8_t split_levels[] = {0, 1, 2, BTREE_SPLIT_AUTO};
+  int ok = root != 0 && ret == 0 &&
+           seq.count == BT_FANOUT * BT_FANOUT * BT_LEAF_ITEMS;
+
+  for (size_t t = 0; ok && t < sizeof(split_levels); t++) {
+    static struct bt_shard_set set;
+    memset(&set, 0, sizeof(set));
+    int shards = btree_walk_parallel(
+        &dev, &cmap, root, 2, BT_NODESIZE, BTRFS_CSUM_TYPE_CRC32,
+        split_levels[t], 4, bt_log_callback, bt_new_shard, &set);
+    if (shards < 1 || (uint32_t)shards != set.count) {
+      ok = 0;
+      break;
+    }
+    if (split_levels[t] == 1 && shards != BT_FANOUT)
+      ok = 0;
+
+    /* Concatenating shards in index order must reproduce the DFS order */
+    uint32_t pos = 0;
+    for (uint32_t s = 0; ok && s < set.count; s++) {
+      for (uint32_t k = 0; k < set.logs[s].count; k++) {
+        if (pos >= seq.count || set.logs[s].keys[k] != seq.keys[pos++]) {
+          ok = 0;
+          break;
+        }
+      }
+    }
+    if (pos != seq.count)
+      ok = 0;
+  }
+
+  device_close(&dev);
+  unlink(path);
+  ASSERT_TRUE(ok, "parallel shards diverge from sequential walk");
+  TEST_PASS();
+}
+
+static void test_btree_parallel_bad_child(void) {
+  TEST_START("B-tree: parallel walk propagates corrupt subtree");
+
+  const char *path = "/tmp/btrfs2ext4_test_btree_bad.img";
+  if (create_temp_device(path, 1024 * 1024) < 0) {
+    TEST_FAIL("couldn't create temp file");
+    return;
+  }
+  struct device dev;
+  if (device_open(&dev, path, 0) < 0) {
+    TEST_FAIL("device_open failed");
+    unlink(path);
+    return;
+  }
+
+  uint64_t root = bt_build_tree(&dev);
+  /* Corrupt the first leaf's checksum */
+  uint8_t junk = 0xA5;
+  device_write(&dev, BT_NODESIZE + 200, &junk, 1);
+
+  struct chunk_mapping identity = {.length = dev.size};
+  struct chunk_map cmap = {.entries = &identity, .count = 1, .capacity = 1};
+  static struct bt_shard_set set;
+  memset(&set, 0, sizeof(set));
+  int shards = btree_walk_parallel(&dev, &cmap, root, 2, BT_NODESIZE,
+                                   BTRFS_CSUM_TYPE_CRC32, 1, 4,
+                                   bt_log_callback, bt_new_shard, &set);
+
+  device_close(&dev);
+  unlink(path);
+  ASSERT_TRUE(root != 0, "tree build failed");
+  ASSERT_TRUE(shards < 0, "corrupt leaf should fail the walk");
+  TEST_PASS();
+}
+
+static void test_btree_dup_copies(void) {
+  TEST_START("B-tree: DUP metadata reads nearest copy, falls back");
+
+  const char *path = "/tmp/btrfs2ext4_test_btree_dup.img";
+  const uint64_t half = 512 * 1024;
+  if (create_temp_device(path, 2 * half) < 0) {
+    TEST_FAIL("couldn't create temp file");
+    return;
+  }
+  struct device dev;
+  if (device_open(&dev, path, 0) < 0) {
+    TEST_FAIL("device_open failed");
+    unlink(path);
+    return;
+  }
+
+  /* Second copy of the whole tree in the upper half */
+  uint64_t root = bt_build_tree(&dev);
+  static uint8_t img[512 * 1024];
+  int ok = root != 0 && root < half &&
+           device_read(&dev, 0, img, half) == 0 &&
+           device_write(&dev, half, img, half) == 0;
+
+  struct chunk_mapping dup = {.logical = 0,
+                              .physical = 0,
+                              .length = half,
+                              .type = BTRFS_BLOCK_GROUP_METADATA |
+                                      BTRFS_BLOCK_GROUP_DUP,
+                              .copy = {0, half},
+                              .copies = 2};
+  struct chunk_map cmap = {.entries = &dup, .count = 1, .capacity = 1};
+
+  uint32_t copy = 9;
+  ok = ok && chunk_map_resolve_near(&cmap, 8192, half + 4096, &copy) ==
+                 half + 8192 && copy == 1;
+  ok = ok && chunk_map_resolve_near(&cmap, 8192, 4096, &copy) == 8192 &&
+       copy == 0;
+  ok = ok && chunk_map_resolve_near(&cmap, 8192, UINT64_MAX, &copy) == 8192;
+  ok = ok && chunk_map_resolve_copy(&cmap, 8192, 1) == half + 8192 &&
+       chunk_map_resolve_copy(&cmap, 8192, 2) == (uint64_t)-1;
+  ASSERT_TRUE(ok, "tree build or copy resolution failed");
+
+  /* One bad leaf in each copy: whichever copy is read, one needs the other */
+  uint8_t junk = 0xA5;
+  device_write(&dev, BT_NODESIZE + 200, &junk, 1);
+  device_write(&dev, half + 2 * BT_NODESIZE + 200, &junk, 1);
+
+  static struct bt_key_log seq, phys;
+  memset(&seq, 0, sizeof(seq));
+  memset(&phys, 0, sizeof(phys));
+  int r1 = btree_walk(&dev, &cmap, root, 2, BT_NODESIZE,
+                      BTRFS_CSUM_TYPE_CRC32, bt_log_callback, &seq);
+  int r2 = btree_walk_physical(&dev, &cmap, root, 2, BT_NODESIZE,
+                               BTRFS_CSUM_TYPE_CRC32, bt_log_callback, &phys);
+
+  /* The same leaf bad in both copies is fatal */
+  device_write(&dev, half + BT_NODESIZE + 200, &junk, 1);
+  static struct bt_key_log lost;
+  memset(&lost, 0, sizeof(lost));
+  int r3 = btree_walk(&dev, &cmap, root, 2, BT_NODESIZE,
+                      BTRFS_CSUM_TYPE_CRC32, bt_log_callback, &lost);
+
+  device_close(&dev);
+  unlink(path);
+  ASSERT_TRUE(r1 == 0 && seq.count == BT_FANOUT * BT_FANOUT * BT_LEAF_ITEMS,
+              "key-order walk did not recover from the other copy");
+  ASSERT_TRUE(r2 == 0 && phys.count == seq.count,
+              "physical sweep did not recover from the other copy");
+  ASSERT_TRUE(r3 < 0, "a node bad in every copy should fail the walk");
+  TEST_PASS();
+}
+
 /* ========================================================================
  * Main test runner
  * ======================================================================== */
 
+/* ========================================================================
+ * TEST GROUP 12: Work-stealing thread pool
+ * ======================================================================== */
+
+#define TP_FANOUT 64
+#define TP_LEAVES 32
+
+struct tp_nested {
+  struct thread_pool *pool;
+  struct thread_pool_wait_group *wg;
+  uint64_t *sum;
+  uint64_t value;
+};
+
+static void tp_leaf_task(void *arg) {
+  struct tp_nested *t = (struct tp_nested *)arg;
+  __atomic_fetch_add(t->sum, t->value, __ATOMIC_RELAXED);
+}
+
+/* Runs on a worker and fans out into its own deque */
+static void tp_parent_task(void *arg) {
+  struct tp_nested *t = (struct tp_nested *)arg;
+  struct tp_nested *leaves = t + 1;
+  for (uint32_t i = 0; i < TP_LEAVES; i++) {
+    thread_pool_wg_add(t->wg, 1);
+    if (thread_pool_submit(t->pool, tp_leaf_task, &leaves[i], t->wg) < 0) {
+      thread_pool_wg_done(t->wg);
+      tp_leaf_task(&leaves[i]);
+    }
+  }
+}
+
+static void test_thread_pool_nested_submit(void) {
+  TEST_START("Thread pool: nested submits all run exactly once");
+
+  struct thread_pool *pool = thread_pool_create(4, 256);
+  struct thread_pool_wait_group *wg = thread_pool_wg_create();
+  /* Each parent is followed by its leaves */
+  struct tp_nested *jobs =
+      calloc((size_t)TP_FANOUT * (TP_LEAVES + 1), sizeof(struct tp_nested));
+  ASSERT_TRUE(pool && wg && jobs, "alloc failed");
+
+  uint64_t sum = 0, expect = 0;
+  for (uint32_t p = 0; p < TP_FANOUT; p++) {
+    struct tp_nested *parent = &jobs[p * (TP_LEAVES + 1)];
+    for (uint32_t i = 0; i <= TP_LEAVES; i++) {
+      parent[i].pool = pool;
+      parent[i].wg = wg;
+      parent[i].sum = &sum;
+      parent[i].value = i ? (uint64_t)p * 1000 + i : 0;
+      expect += parent[i].value;
+    }
+    thread_pool_wg_add(wg, 1);
+    if (thread_pool_submit(pool, tp_parent_task, parent, wg) < 0) {
+      thread_pool_wg_done(wg);
+      tp_parent_task(parent);
+    }
+  }
+  thread_pool_wg_wait(wg);
+
+  struct thread_pool_stats st;
+  thread_pool_get_stats(pool, &st);
+  thread_pool_destroy(pool);
+  thread_pool_wg_destroy(wg);
+  free(jobs);
+
+  ASSERT_TRUE(sum == expect, "a task was lost or ran twice");
+  ASSERT_TRUE(st.tasks_run + st.submit_rejected >= TP_FANOUT,
+              "counters do not add up");
+  printf("(%lu run, %lu stolen) ", (unsigned long)st.tasks_run,
+         (unsigned long)st.tasks_stolen);
+  TEST_PASS();
+}
+
+static void test_thread_pool_default_threads(void) {
+  TEST_START("Thread pool: default size within online CPUs");
+
+  uint32_t n = thread_pool_default_threads();
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  ASSERT_TRUE(n >= 1, "at least one worker");
+  ASSERT_TRUE(online <= 0 || n <= (uint32_t)online,
+              "more workers than online CPUs");
+
+  struct thread_pool *pool = thread_pool_create(0, 1);
+  ASSERT_TRUE(pool != NULL, "auto-sized pool");
+  ASSERT_TRUE(pool->num_threads == n, "create(0) should use the default");
+  thread_pool_destroy(pool);
+  TEST_PASS();
+}
+
+/* ========================================================================
+ * TEST GROUP 13: Pass 1 arena and name pool
+ * ======================================================================== */
+
+static void test_arena_alloc_and_grow(void) {
+  TEST_START("Arena: aligned zeroed blocks, grow keeps data and recycles");
+
+  struct arena a;
+  arena_init(&a, 4096);
+
+  int ok = 1;
+  for (int i = 0; i < 1000 && ok; i++) {
+    uint8_t *p = arena_alloc(&a, (size_t)(i % 37) + 1);
+    ok = p && ((uintptr_t)p % 16) == 0 && p[0] == 0;
+    if (p)
+      memset(p, 0xFF, (size_t)(i % 37) + 1);
+  }
+  ASSERT_TRUE(ok, "block misaligned or not zeroed");
+
+  /* Oversized request gets its own chunk */
+  uint8_t *big = arena_alloc(&a, 64 * 1024);
+  ASSERT_TRUE(big && big[64 * 1024 - 1] == 0, "oversized alloc failed");
+
+  /* Grow an array by doubling, as extent/dirent arrays do */
+  uint32_t *arr = NULL;
+  uint32_t cap = 0;
+  for (uint32_t n = 0; n < 5000; n++) {
+    if (n == cap) {
+      uint32_t new_cap = cap ? cap * 2 : 1;
+      arr = arena_grow(&a, arr, cap * sizeof(uint32_t),
+                       new_cap * sizeof(uint32_t));
+      ASSERT_TRUE(arr != NULL, "grow failed");
+      cap = new_cap;
+    }
+    arr[n] = n * 7;
+  }
+  for (uint32_t n = 0; n < 5000 && ok; n++)
+    ok = arr[n] == n * 7;
+  ASSERT_TRUE(ok, "grow lost data");
+
+  /* A second array of the same shape reuses the abandoned blocks */
+  uint64_t before = a.reserved;
+  uint32_t *arr2 = NULL;
+  cap = 0;
+  for (uint32_t n = 0; n < 2048; n++) {
+    if (n == cap) {
+      uint32_t new_cap = cap ? cap * 2 : 1;
+      arr2 = arena_grow(&a, arr2, cap * sizeof(uint32_t),
+                        new_cap * sizeof(uint32_t));
+      cap = new_cap;
+    }
+    arr2[n] = n;
+  }
+  ASSERT_TRUE(a.reserved == before, "recycled blocks were not reused");
+
+  arena_free(&a);
+  ASSERT_TRUE(a.head == NULL && a.reserved == 0, "arena_free left chunks");
+  TEST_PASS();
+}
+
+static void test_arena_spill(void) {
+  TEST_START("Arena: chunks past the budget map from the spill file");
+
+  struct arena_spill spill;
+  ASSERT_TRUE(arena_spill_open(&spill, "/tmp", 8192) == 0, "spill open");
+
+  struct arena a, shard;
+  arena_init(&a, 4096);
+  arena_init(&shard, 4096);
+  a.spill = shard.spill = &spill;
+
+  /* The first chunk fits the budget, the rest come from the file */
+  uint32_t *objs[64];
+  for (uint32_t i = 0; i < 64; i++) {
+    objs[i] = arena_alloc(i % 2 ? &shard : &a, 1000);
+    ASSERT_TRUE(objs[i] && objs[i][249] == 0, "spilled block not zeroed");
+    for (uint32_t k = 0; k < 250; k++)
+      objs[i][k] = i * 1000 + k;
+  }
+  ASSERT_TRUE(spill.resident <= 8192,
+              "resident chunks exceed the budget");
+  ASSERT_TRUE(spill.file_size > 0, "nothing spilled");
+
+  arena_adopt(&a, &shard);
+  ASSERT_TRUE(shard.spill == &spill, "adopt dropped the spill file");
+  int ok = 1;
+  for (uint32_t i = 0; i < 64 && ok; i++)
+    ok = objs[i][0] == i * 1000 && objs[i][249] == i * 1000 + 249;
+  ASSERT_TRUE(ok, "spilled objects corrupted");
+
+  arena_free(&a);
+  ASSERT_TRUE(spill.resident == 0 && a.spill == &spill, "free accounting");
+  arena_spill_close(&spill);
+  TEST_PASS();
+}
+
+static void test_arena_adopt_and_name_pool(void) {
+  TEST_START("Arena: adopted shard memory and rebased names stay valid");
+
+  struct btrfs_fs_info global, shard;
+  memset(&global, 0, sizeof(global));
+  memset(&shard, 0, sizeof(shard));
+
+  uint64_t g_off = btrfs_intern_name(&global, "global.txt", 10);
+  uint64_t s_off = btrfs_intern_name(&shard, "shard_name", 10);
+  char *s_obj = arena_strndup(&shard.arena, "payload", 7);
+  ASSERT_TRUE(g_off != STR_POOL_INVALID && s_off != STR_POOL_INVALID &&
+                  s_obj,
+              "setup failed");
+
+  arena_adopt(&global.arena, &shard.arena);
+  uint64_t base = str_pool_append(&global.names, &shard.names);
+  ASSERT_TRUE(base != STR_POOL_INVALID, "append failed");
+  ASSERT_TRUE(shard.arena.head == NULL, "shard arena not emptied");
+
+  struct dir_entry_link link = {
+      .target = NULL, .name_off = s_off + base, .name_len = 10};
+  ASSERT_TRUE(strcmp(btrfs_link_name(&global, &link), "shard_name") == 0,
+              "rebased name wrong");
+  link.name_off = g_off;
+  ASSERT_TRUE(strcmp(btrfs_link_name(&global, &link), "global.txt") == 0,
+              "global name clobbered");
+  ASSERT_TRUE(strcmp(s_obj, "payload") == 0, "adopted object corrupted");
+
+  /* Both arenas release cleanly; btrfs_free_fs owns the rest */
+  btrfs_free_fs(&shard);
+  btrfs_free_fs(&global);
+  TEST_PASS();
+}
+
+static void test_sorted_append_and_links(void) {
+  TEST_START("Pass 1: sorted inode append, fallback and link resolution");
+
+  struct btrfs_fs_info fs;
+  memset(&fs, 0, sizeof(fs));
+  fs.use_hash = 1;
+  fs.sorted_append = 1;
+
+  /* A key-order walk: every new inode lands above the last one */
+  int ok = 1;
+  for (uint64_t ino = 256; ino < 256 + 5000; ino += 2) {
+    struct file_entry *fe = btrfs_get_inode(&fs, ino);
+    ok &= fe && fe->ino == ino && btrfs_get_inode(&fs, ino) == fe;
+  }
+  ASSERT_TRUE(ok && fs.inode_count == 2500, "append failed");
+  ASSERT_TRUE(fs.sorted_append && fs.ino_ht.count == 0,
+              "sorted append should not hash");
+  ASSERT_TRUE(btrfs_find_inode(&fs, 256 + 1234)->ino == 256 + 1234 &&
+                  btrfs_find_inode(&fs, 256 + 1235) == NULL &&
+                  btrfs_find_inode(&fs, 10) == NULL,
+              "binary search wrong");
+
+  /* The root lists two children it precedes and one that never shows up */
+  struct file_entry *root = btrfs_find_inode(&fs, 256);
+  const uint64_t targets[3] = {258, 4000, 999999};
+  for (int i = 0; i < 3; i++) {
+    root->children = arena_grow(&fs.arena, root->children,
+                                i * sizeof(struct dir_entry_link),
+                                (i + 1) * sizeof(struct dir_entry_link));
+    root->children[i].target_ino = targets[i];
+    root->children[i].name_off = btrfs_intern_name(&fs, "x", 1);
+    root->children[i].name_len = 1;
+  }
+  root->child_count = root->child_capacity = 3;
+
+  /* Out of order: the table is indexed and lookups switch to the hash */
+  struct file_entry *low = btrfs_get_inode(&fs, 257);
+  ASSERT_TRUE(low && !fs.sorted_append && fs.ino_ht.count == 2501,
+              "out-of-order insert did not index the table");
+  ASSERT_TRUE(btrfs_find_inode(&fs, 257) == low &&
+                  btrfs_find_inode(&fs, 4000)->ino == 4000,
+              "hash lookups wrong after fallback");
+
+  ASSERT_TRUE(btrfs_resolve_links(&fs) == 0, "resolve failed");
+  ASSERT_TRUE(root->children[0].target == btrfs_find_inode(&fs, 258) &&
+                  root->children[1].target->ino == 4000 &&
+                  root->children[2].target->ino == 999999 &&
+                  root->children[2].target->mode == 0,
+              "links not resolved");
+  ASSERT_TRUE(fs.inode_count == 2502, "dangling target not created");
+
+  btrfs_free_fs(&fs);
+  TEST_PASS();
+}
+
+static uint64_t test_reclaim_calls;
+
+static uint64_t test_reclaim_bloom(void *arg, uint64_t want) {
+  uint64_t *held = arg;
+  uint64_t give = want < *held ? want : *held;
+  test_reclaim_calls++;
+  *held -= give;
+  mem_track_free_tag(MEM_TAG_BLOOM, give);
+  return give;
+}
+
+static void test_mem_tracker_tags(void) {
+  TEST_START("Memory tracker: tag peaks, phases, reclaim and JSON report");
+
+  uint64_t base = mem_track_tag_usage(MEM_TAG_BLOOM);
+  mem_track_phase("tags_a");
+  mem_track_alloc_tag(MEM_TAG_BLOOM, 3 << 20);
+  mem_track_free_tag(MEM_TAG_BLOOM, 2 << 20);
+  ASSERT_TRUE(mem_track_tag_usage(MEM_TAG_BLOOM) == base + (1 << 20),
+              "tag usage wrong");
+  ASSERT_TRUE(mem_track_tag_peak(MEM_TAG_BLOOM) >= base + (3 << 20),
+              "tag peak lost");
+
+  /* A new phase starts from current usage, not the old peak */
+  mem_track_phase("tags_b");
+  mem_track_alloc_tag(MEM_TAG_BLOOM, 1 << 20);
+
+  /* Over the limit, the registered callback gives memory back */
+  uint64_t held = 2 << 20;
+  mem_track_set_reclaim(MEM_TAG_BLOOM, test_reclaim_bloom, &held);
+  mem_track_set_limit(mem_track_usage() + (1 << 19));
+  mem_track_alloc_tag(MEM_TAG_BLOOM, held);
+  ASSERT_TRUE(mem_track_exceeded(), "limit not applied");
+  uint64_t released = mem_track_reclaim();
+  ASSERT_TRUE(test_reclaim_calls == 1 && released > 0 && !mem_track_exceeded(),
+              "reclaim callback not used");
+  mem_track_set_reclaim(MEM_TAG_BLOOM, NULL, NULL);
+  mem_track_set_limit(1ULL << 62);
+  mem_track_free_tag(MEM_TAG_BLOOM, held + (2 << 20));
+
+  FILE *f = tmpfile();
+  ASSERT_TRUE(f && mem_track_write_json(f) == 0, "JSON write failed");
+  char buf[8192];
+  rewind(f);
+  size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+  buf[n] = '\0';
+  fclose(f);
+  ASSERT_TRUE(strstr(buf, "\"tags_a\"") && strstr(buf, "\"tags_b\"") &&
+                  strstr(buf, "\"bloom\""),
+              "JSON report incomplete");
+  TEST_PASS();
+}
+
+/* ========================================================================
+ * TEST GROUP 14: Checkpoint / resume
+ * ======================================================================== */
+
+static void test_checkpoint_round_trip(void) {
+  TEST_START("Checkpoint: PLANNED state and relocation log round-trip");
+
+  const char *path = "/tmp/btrfs2ext4_test_ckpt.img";
+  if (create_temp_device(path, 16 * 1024 * 1024) < 0) {
+    TEST_FAIL("couldn't create temp file");
+    return;
+  }
+  struct device dev;
+  if (device_open(&dev, path, 0) < 0) {
+    TEST_FAIL("device_open failed");
+    unlink(path);
+    return;
+  }
+
+  /* The snapshot is tied to the superblock's fsid and generation */
+  struct btrfs_super_block sb;
+  memset(&sb, 0, sizeof(sb));
+  memset(sb.fsid, 0xAB, sizeof(sb.fsid));
+  sb.magic = htole64(BTRFS_MAGIC);
+  sb.generation = htole64(42);
+  ASSERT_TRUE(device_write(&dev, BTRFS_SUPER_OFFSET, &sb, sizeof(sb)) == 0,
+              "superblock write");
+
+  struct btrfs_fs_info fs;
+  memset(&fs, 0, sizeof(fs));
+  fs.sb = sb;
+  struct file_entry *root = btrfs_get_inode(&fs, 256);
+  struct file_entry *file = btrfs_get_inode(&fs, 257);
+  struct file_entry *link = btrfs_get_inode(&fs, 258);
+  ASSERT_TRUE(root && file && link, "inode setup");
+  fs.root_dir = root;
+  root->mode = S_IFDIR | 0755;
+  root->nlink = 2;
+  file->mode = S_IFREG | 0644;
+  file->size = 3 * 4096;
+  file->mtime_sec = 1700000000;
+  ASSERT_TRUE(btrfs_reserve_extents(&fs, file, 2) == 0, "extent setup");
+  file->extents[0] = (struct file_extent){0, 1 << 20, 4096, 8192, 8192,
+                                          BTRFS_COMPRESS_ZLIB,
+                                          BTRFS_FILE_EXTENT_REG, NULL, 0};
+  file->extents[1] = (struct file_extent){8192, 2 << 20, 4096, 4096, 4096, 0,
+                                          BTRFS_FILE_EXTENT_REG, NULL, 0};
+  file->extent_count = 2;
+  struct xattr_entry xe = {NULL, "user.test", "value", 9, 5};
+  file->xattrs = &xe;
+  link->mode = S_IFLNK | 0777;
+  link->symlink_target = "target/path";
+
+  root->children = arena_alloc(&fs.arena, 2 * sizeof(struct dir_entry_link));
+  ASSERT_TRUE(root->children != NULL, "children alloc");
+  root->children[0] = (struct dir_entry_link){
+      .target = file,
+      .name_off = btrfs_intern_name(&fs, "data.bin", 8),
+      .name_len = 8};
+  root->children[1] = (struct dir_entry_link){
+      .target = link,
+      .name_off = btrfs_intern_name(&fs, "link", 4),
+      .name_len = 4};
+  root->child_count = root->child_capacity = 2;
+  ASSERT_TRUE(usage_map_init(&fs.usage, dev.size, 4096) == 0, "usage map");
+  usage_map_set(&fs.usage, 1 << 20, 4096, 1);
+
+  struct ext4_layout layout;
+  memset(&layout, 0, sizeof(layout));
+  ASSERT_TRUE(ext4_plan_layout(&layout, dev.size, 4096, 16384, NULL) == 0,
+              "layout");
+  struct relocation_entry entries[3];
+  memset(entries, 0, sizeof(entries));
+  for (uint32_t i = 0; i < 3; i++) {
+    entries[i].src_offset = (uint64_t)(i + 1) << 20;
+    entries[i].dst_offset = (uint64_t)(i + 8) << 20;
+    entries[i].length = 4096;
+    entries[i].seq = i;
+  }
+  struct relocation_plan plan = {entries, 3, 3, 3 * 4096, {0}};
+
+  struct checkpoint ck;
+  checkpoint_init(&ck, "/tmp", &dev, 4096, 16384);
+  ASSERT_TRUE(checkpoint_save(&ck, CHECKPOINT_PLANNED, &fs, &layout, &plan) ==
+                  0,
+              "save failed");
+
+  /* The log opens with the leading entries already on disk recorded */
+  entries[0].completed = entries[1].completed = 1;
+  ASSERT_TRUE(checkpoint_reloc_begin(&ck, &plan) == 0, "log open");
+  checkpoint_reloc_end(&ck);
+
+  struct btrfs_fs_info fs2;
+  struct ext4_layout layout2;
+  struct relocation_plan plan2;
+  memset(&fs2, 0, sizeof(fs2));
+  memset(&layout2, 0, sizeof(layout2));
+  memset(&plan2, 0, sizeof(plan2));
+  checkpoint_init(&ck, "/tmp", &dev, 4096, 16384);
+  ASSERT_TRUE(checkpoint_load(&ck, &fs2, &layout2, &plan2) ==
+                  CHECKPOINT_PLANNED,
+              "load failed");
+
+  struct file_entry *f2 = btrfs_find_inode(&fs2, 257);
+  struct file_entry *l2 = btrfs_find_inode(&fs2, 258);
+  ASSERT_TRUE(fs2.inode_count == 3 && fs2.root_dir &&
+                  fs2.root_dir->ino == 256 && f2 && l2,
+              "inodes not restored");
+  ASSERT_TRUE(fs2.root_dir->child_count == 2 &&
+                  fs2.root_dir->children[0].target == f2 &&
+                  strcmp(btrfs_link_name(&fs2, &fs2.root_dir->children[1]),
+                         "link") == 0,
+              "directory links wrong");
+  ASSERT_TRUE(f2->extent_count == 2 && f2->extents &&
+                  f2->extents[0].compression == BTRFS_COMPRESS_ZLIB &&
+                  f2->extents[1].disk_bytenr == 2 << 20 &&
+                  f2->mtime_sec == 1700000000,
+              "extents not restored");
+  ASSERT_TRUE(f2->xattrs && f2->xattrs->name_len == 9 &&
+                  memcmp(f2->xattrs->value, "value", 5) == 0 &&
+                  strcmp(l2->symlink_target, "target/path") == 0,
+              "xattr or symlink wrong");
+  ASSERT_TRUE(fs2.usage.bits && fs2.usage.granules == fs.usage.granules,
+              "usage map lost");
+  ASSERT_TRUE(layout2.num_groups == layout.num_groups &&
+                  layout2.reserved_block_count == layout.reserved_block_count,
+              "layout not restored");
+  ASSERT_TRUE(plan2.count == 3 && plan2.entries[0].completed &&
+                  plan2.entries[1].completed && !plan2.entries[2].completed &&
+                  plan2.entries[2].dst_offset == 10 << 20,
+              "relocation progress lost");
+  btrfs_free_fs(&fs2);
+  ext4_free_layout(&layout2);
+  relocator_free(&plan2);
+
+  /* A newer generation on disk invalidates the snapshot */
+  sb.generation = htole64(43);
+  device_write(&dev, BTRFS_SUPER_OFFSET, &sb, sizeof(sb));
+  memset(&fs2, 0, sizeof(fs2));
+  memset(&layout2, 0, sizeof(layout2));
+  memset(&plan2, 0, sizeof(plan2));
+  ASSERT_TRUE(checkpoint_load(&ck, &fs2, &layout2, &plan2) < 0,
+              "stale checkpoint accepted");
+
+  checkpoint_remove("/tmp");
+  btrfs_free_fs(&fs);
+  ext4_free_layout(&layout);
+  device_close(&dev);
+  unlink(path);
+  TEST_PASS();
+}
+
+/* Run a tool with its output discarded; returns its exit status */
+static int run_tool(const char *const argv[]) {
+  pid_t pid = fork();
+  if (pid < 0)
+    return -1;
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) {
+      dup2(null, STDOUT_FILENO);
+      dup2(null, STDERR_FILENO);
+    }
+    execv(argv[0], (char *const *)argv);
+    _exit(127);
+  }
+  int status;
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+    return -1;
+  return WEXITSTATUS(status);
+}
+
+/* CRC of a sparse image's data segments and where they are */
+static uint32_t image_crc(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  static uint8_t buf[1 << 20];
+  uint32_t crc = 0;
+  off_t pos = 0, data;
+  while ((data = lseek(fd, pos, SEEK_DATA)) >= 0) {
+    off_t hole = lseek(fd, data, SEEK_HOLE);
+    crc = crc32c(crc, &data, sizeof(data));
+    for (pos = data; pos < hole;) {
+      ssize_t n = pread(fd, buf,
+                        hole - pos < (off_t)sizeof(buf) ? (size_t)(hole - pos)
+                                                        : sizeof(buf),
+                        pos);
+      if (n <= 0) {
+        close(fd);
+        return 0;
+      }
+      crc = crc32c(crc, buf, (size_t)n);
+      pos += n;
+    }
+  }
+  close(fd);
+  return crc;
+}
+
+static int image_is_ext4(const char *path) {
+  struct device dev;
+  uint16_t magic = 0;
+  if (device_open(&dev, path, 1) < 0)
+    return 0;
+  device_read(&dev, 1024 + 56, &magic, sizeof(magic));
+  device_close(&dev);
+  return le16toh(magic) == EXT4_SUPER_MAGIC;
+}
+
+static void test_plan_only_resume(void) {
+  TEST_START("Checkpoint: --plan-only, then --resume or a refusal");
+
+  const char *img[2] = {"/tmp/btrfs2ext4_test_plan0.img",
+                        "/tmp/btrfs2ext4_test_plan1.img"};
+  char wd[2][64];
+  int ok = 1;
+  for (int i = 0; i < 2 && ok; i++) {
+    snprintf(wd[i], sizeof(wd[i]), "/tmp/btrfs2ext4_test_plan%d.d", i);
+    mkdir(wd[i], 0700);
+    checkpoint_remove(wd[i]);
+    const char *gen[] = {GEN_BTRFS_IMAGE_BIN, "-q", "-n", "64", "-S", "16K",
+                         "--fill", img[i], NULL};
+    ok = run_tool(gen) == 0;
+  }
+  ASSERT_TRUE(ok, "image generation failed");
+
+  /* Plan both: a read-only run that leaves a PLANNED snapshot */
+  for (int i = 0; i < 2; i++) {
+    uint32_t before = image_crc(img[i]);
+    const char *plan[] = {BTRFS2EXT4_BIN, "--plan-only", "-w", wd[i], img[i],
+                          NULL};
+    ASSERT_TRUE(run_tool(plan) == 0, "--plan-only failed");
+    ASSERT_TRUE(before != 0 && image_crc(img[i]) == before,
+                "--plan-only wrote to the device");
+
+    struct device dev;
+    ASSERT_TRUE(device_open(&dev, img[i], 1) == 0, "device_open failed");
+    struct btrfs_fs_info fs;
+    struct ext4_layout layout;
+    struct relocation_plan rp;
+    memset(&fs, 0, sizeof(fs));
+    memset(&layout, 0, sizeof(layout));
+    memset(&rp, 0, sizeof(rp));
+    struct checkpoint ck;
+    checkpoint_init(&ck, wd[i], &dev, EXT4_DEFAULT_BLOCK_SIZE,
+                    EXT4_DEFAULT_INODE_RATIO);
+    int phase = checkpoint_load(&ck, &fs, &layout, &rp);
+    btrfs_free_fs(&fs);
+    ext4_free_layout(&layout);
+    relocator_free(&rp);
+    device_close(&dev);
+    ASSERT_TRUE(phase == CHECKPOINT_PLANNED, "no PLANNED checkpoint");
+  }
+
+  /* Resuming the untouched filesystem converts it */
+  const char *resume0[] = {BTRFS2EXT4_BIN, "--resume", "-w", wd[0], img[0],
+                           NULL};
+  ASSERT_TRUE(run_tool(resume0) == 0, "--resume failed");
+  ASSERT_TRUE(image_is_ext4(img[0]), "--resume did not convert");
+
+  /* A commit since the plan: the snapshot is refused, nothing written */
+  struct device dev;
+  struct btrfs_super_block sb;
+  ASSERT_TRUE(device_open(&dev, img[1], 0) == 0, "device_open failed");
+  ok = device_read(&dev, BTRFS_SUPER_OFFSET, &sb, sizeof(sb)) == 0;
+  sb.generation = htole64(le64toh(sb.generation) + 1);
+  ok = ok && device_write(&dev, BTRFS_SUPER_OFFSET, &sb, sizeof(sb)) == 0;
+  device_close(&dev);
+  ASSERT_TRUE(ok, "generation bump failed");
+  uint32_t before = image_crc(img[1]);
+  const char *resume1[] = {BTRFS2EXT4_BIN, "--resume", "-w", wd[1], img[1],
+                           NULL};
+  ASSERT_TRUE(run_tool(resume1) != 0, "stale plan resumed");
+  ASSERT_TRUE(image_crc(img[1]) == before && !image_is_ext4(img[1]),
+              "refused resume wrote to the device");
+
+  for (int i = 0; i < 2; i++) {
+    checkpoint_remove(wd[i]);
+    rmdir(wd[i]);
+    unlink(img[i]);
+  }
+  TEST_PASS();
+}
+
+/* ========================================================================
+ * TEST GROUP 15: Progress reporter
+ * ======================================================================== */
+
+#define PROG_THREADS 4
+#define PROG_ADDS 2500
+
+static void *prog_adder(void *arg) {
+  (void)arg;
+  for (uint32_t i = 0; i < PROG_ADDS; i++) {
+    progress_add(1);
+    if (i % 500 == 0)
+      usleep(10000);
+  }
+  return NULL;
+}
+
+static void test_progress_json(void) {
+  TEST_START("Progress: JSON records, concurrent adds and ETA");
+
+  int fds[2];
+  ASSERT_TRUE(pipe(fds) == 0, "pipe");
+  ASSERT_TRUE(progress_start(NULL, fds[1], 20) == 0, "reporter start");
+
+  const uint64_t total = (uint64_t)PROG_THREADS * PROG_ADDS;
+  progress_begin("test", total, "items");
+  pthread_t th[PROG_THREADS];
+  for (int i = 0; i < PROG_THREADS; i++)
+    pthread_create(&th[i], NULL, prog_adder, NULL);
+  for (int i = 0; i < PROG_THREADS; i++)
+    pthread_join(th[i], NULL);
+  uint64_t done = progress_done();
+  progress_end();
+  /* A new phase starts counting from zero */
+  progress_begin("second", 0, NULL);
+  progress_add(4096);
+  progress_stop();
+  close(fds[1]);
+
+  char buf[16384];
+  size_t len = 0;
+  ssize_t n;
+  while (len < sizeof(buf) - 1 &&
+         (n = read(fds[0], buf + len, sizeof(buf) - 1 - len)) > 0)
+    len += (size_t)n;
+  buf[len] = '\0';
+  close(fds[0]);
+  ASSERT_TRUE(done == total, "concurrent adds lost");
+
+  uint32_t begins = 0, samples = 0, ends = 0, etas = 0;
+  int end_ok = 0, second_ok = 0;
+  for (char *line = strtok(buf, "\n"); line; line = strtok(NULL, "\n")) {
+    ASSERT_TRUE(line[0] == '{' && line[strlen(line) - 1] == '}',
+                "record is not one object per line");
+    int first = strstr(line, "\"phase\":\"test\"") != NULL;
+    if (strstr(line, "\"event\":\"begin\""))
+      begins++;
+    if (first && strstr(line, "\"event\":\"progress\"")) {
+      samples++;
+      if (!strstr(line, "\"eta\":null"))
+        etas++;
+    }
+    if (strstr(line, "\"event\":\"end\"")) {
+      ends++;
+      if (first)
+        end_ok = strstr(line, "\"done\":10000,\"total\":10000") != NULL;
+      else
+        second_ok = strstr(line, "\"unit\":\"bytes\",") &&
+                    strstr(line, "\"done\":4096,\"total\":0,");
+    }
+  }
+  ASSERT_TRUE(begins == 2 && ends == 2, "begin/end records");
+  ASSERT_TRUE(samples >= 1, "no samples while the phase ran");
+  ASSERT_TRUE(etas >= 1, "no ETA although the total is known");
+  ASSERT_TRUE(end_ok, "end record of the first phase");
+  ASSERT_TRUE(second_ok, "second phase did not restart the count");
+  printf("(%u samples) ", samples);
+  TEST_PASS();
+}
+
 int main(void) {
   printf("\n");
   printf(
@@ -1159,6 +3844,8 @@ int main(void) {
   test_inode_map_large_scale();
   test_inode_map_hash_collisions();
   test_inode_map_zero_entries();
+  test_inode_map_index_modes();
+  test_bloom_blocked();
 
   /* Group 3: Chunk map */
   printf(
@@ -1166,6 +3853,7 @@ int main(void) {
   test_chunk_map_resolve_miss();
   test_chunk_map_empty();
   test_chunk_map_overlapping_ranges();
+  test_chunk_map_resolver_matches_search();
 
   /* Group 4: Ext4 planner */
   printf(
@@ -1175,12 +3863,22 @@ int main(void) {
   test_planner_large_device();
   test_planner_zero_size();
   test_planner_block_sizes();
+  test_planner_flex_pack();
+  test_planner_layout_search();
 
   /* Group 5: Relocator */
   printf(
       "\n─── GROUP 5: Relocator Stress ──────────────────────────────────\n");
   test_relocator_empty_plan();
   test_relocator_all_blocks_conflict();
+  test_relocator_best_fit();
+  test_relocator_split_shared();
+  test_usage_map_build_and_mark();
+  test_extent_store_pack();
+  test_relocator_schedule_dependencies();
+  test_relocator_schedule_seek_estimate();
+  test_relocator_rollback();
+  test_relocator_prealloc_unwritten();
 
   /* Group 6: Device I/O */
   printf(
@@ -1188,14 +3886,21 @@ int main(void) {
   test_device_read_beyond_end();
   test_device_write_readonly();
   test_device_zero_size_file();
+  test_device_io_stats();
+  test_device_copy_modes();
+  test_device_zero_modes();
+  test_device_profile();
 
   /* Group 7: Extent tree */
   printf(
       "\n─── GROUP 7: Extent Tree Edge Cases ────────────────────────────\n");
   test_extent_tree_empty_file();
   test_extent_tree_single_extent();
+  test_extent_tree_prealloc_unwritten();
   test_extent_tree_max_inline();
   test_extent_tree_multi_level();
+  test_extent_tree_regions();
+  test_extent_tree_cow_clones();
 
   /* Group 8: Benchmarks */
   printf(
@@ -1217,6 +3922,39 @@ int main(void) {
       "\n─── GROUP 10: Memory Safety ────────────────────────────────────\n");
   test_free_double_free();
   test_free_after_operations();
+  test_mem_tracker_tags();
+
+  /* Group 11: B-tree walker */
+  printf(
+      "\n─── GROUP 11: B-tree Walker ────────────────────────────────────\n");
+  test_btree_parallel_matches_sequential();
+  test_btree_parallel_bad_child();
+  test_btree_dup_copies();
+
+  /* Group 12: Thread pool */
+  printf(
+      "\n─── GROUP 12: Thread Pool ──────────────────────────────────────\n");
+  test_thread_pool_nested_submit();
+  test_thread_pool_default_threads();
+
+  /* Group 13: Pass 1 arena */
+  printf(
+      "\n─── GROUP 13: Pass 1 Arena ─────────────────────────────────────\n");
+  test_arena_alloc_and_grow();
+  test_arena_adopt_and_name_pool();
+  test_arena_spill();
+  test_sorted_append_and_links();
+
+  /* Group 14: Checkpoint / resume */
+  printf(
+      "\n─── GROUP 14: Checkpoint / Resume ──────────────────────────────\n");
+  test_checkpoint_round_trip();
+  test_plan_only_resume();
+
+  /* Group 15: Progress reporter */
+  printf(
+      "\n─── GROUP 15: Progress Reporter ────────────────────────────────\n");
+  test_progress_json();
 
   /* Summary */
   printf("\n");